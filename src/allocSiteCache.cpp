@@ -0,0 +1,63 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+#include "allocSiteCache.h"
+
+
+u64 AllocSiteCache::key(int event_type, u32 class_id, int tid, int num_frames, ASGCT_CallFrame* frames) {
+    const u64 M = 0xc6a4a7935bd1e995ULL;
+    const int R = 47;
+
+    u64 h = ((u64)class_id << 32 | (u32)tid) * M ^ (u64)(u32)event_type;
+    for (int i = 0; i < num_frames; i++) {
+        u64 k = (u64)frames[i].method_id ^ ((u64)(u32)frames[i].bci << 32);
+        k *= M;
+        k ^= k >> R;
+        k *= M;
+        h ^= k;
+        h *= M;
+    }
+
+    h ^= h >> R;
+    h *= M;
+    h ^= h >> R;
+
+    // Zero marks an empty entry
+    return h | 1;
+}
+
+u32 AllocSiteCache::lookup(u64 key, u32 epoch, u32 max_reuses) {
+    AllocSite& site = _sites[key % ALLOC_SITE_ENTRIES];
+    if (site.key != key || site.epoch != epoch || site.reuses >= max_reuses) {
+        return 0;
+    }
+    site.reuses++;
+    return site.call_trace_id;
+}
+
+void AllocSiteCache::store(u64 key, u32 epoch, u32 call_trace_id) {
+    AllocSite& site = _sites[key % ALLOC_SITE_ENTRIES];
+    site.key = key;
+    site.epoch = epoch;
+    site.call_trace_id = call_trace_id;
+    site.reuses = 0;
+}
+
+void AllocSiteCache::clear() {
+    memset(_sites, 0, sizeof(_sites));
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _ALLOCSITECACHE_H
+#define _ALLOCSITECACHE_H
+
+#include "arch.h"
+#include "vmEntry.h"
+
+
+// Java frames from the top of the stack that identify an allocation site
+const int ALLOC_SITE_FRAMES = 2;
+const int ALLOC_SITE_ENTRIES = 256;
+
+struct AllocSite {
+    u64 key;
+    u32 epoch;
+    u32 call_trace_id;
+    u32 reuses;
+};
+
+// allocsite: stacks of recently sampled allocation sites, so that a sample at a hot site
+// walks only ALLOC_SITE_FRAMES frames rather than the whole stack. A site is walked in full
+// again after max_reuses samples, and whenever the call trace storage starts a new epoch.
+// There is one cache per Profiler lock; it is only accessed with that lock held.
+class AllocSiteCache {
+  private:
+    AllocSite _sites[ALLOC_SITE_ENTRIES];
+
+  public:
+    AllocSiteCache() {
+        clear();
+    }
+
+    static u64 key(int event_type, u32 class_id, int tid, int num_frames, ASGCT_CallFrame* frames);
+
+    // Trace id to reuse for the site, 0 if the stack has to be walked
+    u32 lookup(u64 key, u32 epoch, u32 max_reuses);
+    void store(u64 key, u32 epoch, u32 call_trace_id);
+    void clear();
+};
+
+#endif // _ALLOCSITECACHE_H
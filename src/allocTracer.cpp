@@ -112,6 +112,10 @@ Error AllocTracer::start(Arguments& args) {
     if (error) {
         return error;
     }
+    if (args._live > 0) {
+        // TLAB events do not carry the allocated object
+        return Error("live requires SampledObjectAlloc (JDK 11+) or OpenJ9");
+    }
 
     _interval = args._alloc > 0 ? args._alloc : 0;
     _allocated_bytes = 0;
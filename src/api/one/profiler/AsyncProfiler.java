@@ -17,6 +17,7 @@
 package one.profiler;
 
 import java.io.IOException;
+import java.nio.ByteBuffer;
 
 /**
  * Java API for in-process profiling. Serves as a wrapper around
@@ -200,6 +201,58 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
         filterThread(thread, false);
     }
 
+    /**
+     * Tag all further samples and lock waits of the current thread with a trace context,
+     * until the context is changed or cleared. The ids are kept in native memory
+     * and read by the profiler at sampling time; nothing is called per sample.
+     *
+     * @param traceIdHigh Upper 64 bits of the trace id
+     * @param traceIdLow Lower 64 bits of the trace id
+     * @param spanId Current span id
+     */
+    public native void setTraceContext(long traceIdHigh, long traceIdLow, long spanId);
+
+    /**
+     * Stop tagging samples of the current thread with a trace context.
+     */
+    public void clearTraceContext() {
+        setTraceContext(0, 0, 0);
+    }
+
+    /**
+     * Sample the current thread at the 'boost' interval for the given time,
+     * e.g. while a slow or otherwise interesting span is running.
+     * Works with perf_events based profiling started with 'boost' option.
+     * The number of windows open at a time is limited by 'boostmax'.
+     *
+     * @param durationNanos Length of the capture window, at most 1 second
+     * @return false if boost is not enabled or all capture windows are taken
+     */
+    public native boolean boostSampling(long durationNanos);
+
+    /**
+     * Write aggregated samples and the frame names they refer to into a direct buffer,
+     * starting at its position, in the binary format described in sampleExporter.h.
+     * Nothing is copied through Java strings. In incremental mode, only the growth
+     * since the previous incremental export and the frames not sent before are written.
+     *
+     * @param buffer Direct buffer that receives the export
+     * @param incremental Export the changes since the previous call only
+     * @return Number of bytes written and added to the buffer position,
+     *         or the negated number of bytes needed if the export does not fit
+     * @throws IllegalStateException If the profiler has no data
+     */
+    public int exportSamples(ByteBuffer buffer, boolean incremental) throws IllegalStateException {
+        if (!buffer.isDirect()) {
+            throw new IllegalArgumentException("Direct buffer required");
+        }
+        int size = exportSamples0(buffer, buffer.position(), buffer.remaining(), incremental);
+        if (size > 0) {
+            buffer.position(buffer.position() + size);
+        }
+        return size;
+    }
+
     private void filterThread(Thread thread, boolean enable) {
         if (thread == null || thread == Thread.currentThread()) {
             filterThread0(null, enable);
@@ -218,4 +271,5 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
     private native void stop0() throws IllegalStateException;
     private native String execute0(String command) throws IllegalArgumentException, IllegalStateException, IOException;
     private native void filterThread0(Thread thread, boolean enable);
+    private native int exportSamples0(ByteBuffer buffer, int offset, int length, boolean incremental) throws IllegalStateException;
 }
@@ -52,6 +52,8 @@ const int ADJUST_RET = 1;
 const int PLT_HEADER_SIZE = 16;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 8;  // PERF_REG_X86_IP
+const int PERF_REG_SP = 7;  // PERF_REG_X86_SP
+const int PERF_REG_FP = 6;  // PERF_REG_X86_BP
 
 #define spinPause()       asm volatile("pause")
 #define rmb()             asm volatile("lfence" : : : "memory")
@@ -70,6 +72,8 @@ const int ADJUST_RET = 0;
 const int PLT_HEADER_SIZE = 20;
 const int PLT_ENTRY_SIZE = 12;
 const int PERF_REG_PC = 15;  // PERF_REG_ARM_PC
+const int PERF_REG_SP = 13;  // PERF_REG_ARM_SP
+const int PERF_REG_FP = 11;  // PERF_REG_ARM_FP
 
 #define spinPause()       asm volatile("yield")
 #define rmb()             asm volatile("dmb ish" : : : "memory")
@@ -87,6 +91,8 @@ const int ADJUST_RET = 0;
 const int PLT_HEADER_SIZE = 32;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 32;  // PERF_REG_ARM64_PC
+const int PERF_REG_SP = 31;  // PERF_REG_ARM64_SP
+const int PERF_REG_FP = 29;  // PERF_REG_ARM64_X29
 
 #define spinPause()       asm volatile("isb")
 #define rmb()             asm volatile("dmb ish" : : : "memory")
@@ -106,6 +112,8 @@ const int ADJUST_RET = 0;
 const int PLT_HEADER_SIZE = 24;
 const int PLT_ENTRY_SIZE = 24;
 const int PERF_REG_PC = 32;  // PERF_REG_POWERPC_NIP
+const int PERF_REG_SP = 1;  // PERF_REG_POWERPC_R1
+const int PERF_REG_FP = 31;  // PERF_REG_POWERPC_R31
 
 #define spinPause()       asm volatile("yield") // does nothing, but using or 1,1,1 would lead to other problems
 #define rmb()             asm volatile ("sync" : : : "memory") // lwsync would do but better safe than sorry
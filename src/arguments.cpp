@@ -61,14 +61,31 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     status           - print profiling status (inactive / running for X seconds)
 //     list             - show the list of available profiling events
 //     version[=full]   - display the agent version
-//     event=EVENT      - which event to trace (cpu, wall, cache-misses, etc.)
+//     top[=N]          - print top N methods by self time from the hotmethods table (default: 20)
+//     toptotal[=N]     - same as top, ordered by total time
+//     snapshot[=MS]    - print the stack of every thread, taken at once by signals without a safepoint;
+//                        threads that do not answer in MS ms are listed as missed (default: 500)
+//     event=EVENT      - which event to trace (cpu, wall, cache-misses, etc.);
+//                        ttsp samples the threads a safepoint waits for while it synchronizes
 //     alloc[=BYTES]    - profile allocations with BYTES interval
+//     live[=N]         - keep up to N sampled objects and report the ones still alive (default: 1024)
+//     allocsite[=N]    - reuse the stack of a hot allocation site for up to N samples (default: 64)
 //     lock[=DURATION]  - profile contended locks longer than DURATION ns
+//     locksample=N     - sample shorter lock waits, one per N ns of waiting (default: off)
+//     lockgraph=TIME   - summarize lock contention and report deadlocks every TIME seconds
+//     nativemem[=N]    - profile malloc/calloc/realloc with N bytes interval (default: 512k)
+//     io[=DURATION]    - profile blocking I/O calls longer than DURATION ns (default: 1ms)
+//     iostat=TIME      - log I/O latency histograms every TIME seconds (default: 10)
+//     ioaddr           - resolve the peer address of sockets in I/O events
+//     methods=M+M      - time calls of up to 64 methods (Class.method[(signature)]) and log latency histograms
+//     methodpct=P      - record stacks of traced calls slower than the P-th percentile (default: 99)
 //     collapsed        - dump collapsed stacks (the format used by FlameGraph script)
 //     flamegraph       - produce Flame Graph in HTML format
 //     tree             - produce call tree in HTML format
 //     jfr              - dump events in Java Flight Recorder format
 //     jfrsync[=CONFIG] - start Java Flight Recording with the given config along with the profiler 
+//     jfrstream=ADDR   - send every finished JFR chunk to host:port, a Unix socket or a FIFO
+//     pprof            - dump gzip'd pprof profile.proto (requires file=)
 //     traces[=N]       - dump top N call traces
 //     flat[=N]         - dump top N methods (aka flat profile)
 //     samples          - count the number of samples (default)
@@ -84,27 +101,80 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     log=FILENAME     - log warnings and errors to the given dedicated stream
 //     loglevel=LEVEL   - logging level: TRACE, DEBUG, INFO, WARN, ERROR, or NONE
 //     server=ADDRESS   - start insecure HTTP server at ADDRESS/PORT
-//     filter=FILTER    - thread filter
+//     filter=FILTER    - thread filter: thread IDs, ID ranges and Java thread name patterns, e.g. 1-100;http-nio-*
 //     threads          - profile different threads separately
 //     sched            - group threads by scheduling policy
+//     gcskip           - do not walk Java stacks of CPU samples taken during GC pauses
+//     samplecpu        - record the CPU every sample was taken on (kd-cpu)
+//     cgroup           - log the CPU usage and CFS throttling of the process cgroup every second (kd-cg)
 //     cstack=MODE      - how to collect C stack frames in addition to Java stack
 //                        MODE is 'fp' (Frame Pointer), 'dwarf', 'lbr' (Last Branch Record) or 'no'
+//     jstackwalk=MODE  - how to walk Java stacks of CPU samples: 'asgct' (AsyncGetCallTrace, default)
+//                        or 'vm' (VMStructs, inlined methods show as the compiled method containing them)
 //     allkernel        - include only kernel-mode events
 //     alluser          - include only user-mode events
 //     fdtransfer       - use fdtransfer to pass fds to the profiler
+//     perfpoll         - read perf_events samples from a background thread instead of signals;
+//                        with cstack=dwarf, the kernel copies the top of the user stack
+//                        and the thread unwinds the copy
+//     percpu           - one system-wide perf event per CPU filtered by pid (implies perfpoll)
+//     counters=EV+EV   - read up to 4 more perf events with every sample of the main one
+//     dataaddr         - record the data address of precise (PEBS/SPE) memory samples
+//     boost=N          - sampling interval of threads that request a capture window (perf events only)
+//     boostmax=N       - capture windows open at the same time across the process (default: 8)
+//     budget=PCT       - keep the profiler under PCT percent of process CPU by scaling intervals
+//     bgcpus=LIST      - run the background threads of the profiler on CPUs LIST, e.g. 0-1,6
+//     bgnice=N         - nice value of the background threads
+//     bgidle           - run the background scheduler in SCHED_IDLE
+//     hugepages=MODE   - back call trace tables with 'thp' (default) or reserved ('hugetlb') huge pages
+//     numa             - interleave call trace tables across NUMA nodes
+//     hotmethods       - maintain self/total time per method while sampling (for top)
+//     windows=N        - keep the samples of the last N time windows, also across loop cycles
+//     window=TIME      - duration of one window (default: 60s)
+//     last=TIME        - collapsed/flamegraph/tree of the windows of the last TIME only
+//     latency          - histograms of the time spent in the profiler's own hot paths
+//     memlimit=SIZE    - cap on the memory of profiler data structures; growth past it is shed
+//     symcache=DIR     - keep parsed symbols and DWARF tables of libraries and kernel symbols in DIR for later attaches
+//     perfmap[=PATH]   - keep a perf map of JIT code at PATH (default: /tmp/perf-<pid>.map) for perf and eBPF profilers;
+//                        on HotSpot it lists the code compiled before the start, unless with perfmapjit
+//     perfmapjit       - also list newly compiled methods on HotSpot by enabling CompiledMethodLoad,
+//                        which the profiler otherwise avoids there for JDK-8173361
+//     heapmon[=TIME]   - log heap pool usage and GC counts/pauses every TIME (default: the profiling interval)
 //     simple           - simple class names instead of FQN
 //     dot              - dotted class names
 //     sig              - print method signatures
 //     ann              - annotate Java methods
 //     lib              - prepend library names
 //     mcache           - max age of jmethodID cache (default: 0 = disabled)
+//     warm             - keep thread names, class names, method and symbol caches from the previous session
 //     include=PATTERN  - include stack traces containing PATTERN
-//     exclude=PATTERN  - exclude stack traces containing PATTERN
+//     exclude=PATTERN  - exclude stack traces containing PATTERN (both also filter the Kindling stream)
 //     begin=FUNCTION   - begin profiling when FUNCTION is executed
 //     end=FUNCTION     - end profiling when FUNCTION is executed
+//     kdformat=FORMAT  - format of the Kindling CPU stream: text (default), ids or binary
+//     kdcapacity=N     - max CPU samples buffered per collect interval (default: 8192)
+//     kddepth=N        - max frames of a CPU sample in the Kindling stream (default: 128)
+//     kdspill=PATH     - spill CPU samples to a file mapped at PATH when the collector falls behind
+//     kdspillsize=SIZE - size of the spill file (default: 64M)
+//     kdshm=PATH       - write Kindling events to a shared memory ring at PATH, e.g. /dev/shm/kd
+//     kdshmsize=BYTES  - size of the shared memory ring (default: 8M)
+//     kdasync          - write Kindling events from a background thread in batches (not with kdshm)
+//     kdcompress       - LZ4 compress every batch of Kindling events (implies kdasync)
+//     kdclock=CLOCK    - timestamps of Kindling events: wall (default) or tsc ticks
+//     kdaggregate[=group] - report CPU samples per interval as counts of (thread, stack),
+//                        or of (thread group, stack) where digits in thread names are replaced by #
+//     kdstates         - report samples per interval as counts of (thread state, stack), e.g. with event=wall
+//     kddelta          - encode CPU stacks as a delta against the previous stack of the thread
+//     kdidle[=PATTERN] - send only the first idle stack of a thread per interval and count the rest;
+//                        idle stacks have a frame matching PATTERN on top (default: epoll_wait, park, ...)
+//     kdalloc          - report sampled allocations (alloc) per interval as totals of (class, stack)
 //     title=TITLE      - FlameGraph title
 //     minwidth=PCT     - FlameGraph minimum frame width in percent
+//     maxframes=N      - FlameGraph frame limit, narrower frames are pruned (default: 250000, 0 - no limit)
 //     reverse          - generate stack-reversed FlameGraph / Call tree
+//     baseline         - remember the samples collected so far as the baseline of a later diff
+//     diff             - collapsed/flamegraph/tree of the samples since the baseline, compared with it
+//     leaks            - collapsed/flamegraph/tree of the sampled native allocations not freed yet
 //
 // It is possible to specify multiple dump options at the same time
 
@@ -156,6 +226,21 @@ Error Arguments::parse(const char* args) {
             CASE("version")
                 _action = value == NULL ? ACTION_VERSION : ACTION_FULL_VERSION;
 
+            CASE("top")
+                _action = ACTION_TOP;
+                if (value != NULL) _dump_top = atoi(value);
+
+            CASE("toptotal")
+                _action = ACTION_TOP;
+                _top_by_total = true;
+                if (value != NULL) _dump_top = atoi(value);
+
+            CASE("snapshot")
+                _action = ACTION_SNAPSHOT;
+                if (value != NULL && (_snapshot_timeout = atol(value)) <= 0) {
+                    msg = "snapshot timeout must be > 0";
+                }
+
             // Output formats
             CASE("collapsed")
                 _output = OUTPUT_COLLAPSED;
@@ -172,11 +257,21 @@ Error Arguments::parse(const char* args) {
                     _jfr_options = (int)strtol(value, NULL, 0);
                 }
 
+            CASE("jfrstream")
+                if (value == NULL || value[0] == 0) {
+                    msg = "jfrstream must be host:port or a path";
+                }
+                _jfr_stream = value;
+                _output = OUTPUT_JFR;
+
             CASE("jfrsync")
                 _output = OUTPUT_JFR;
                 _jfr_options = JFR_SYNC_OPTS;
                 _jfr_sync = value == NULL ? "default" : value;
 
+            CASE("pprof")
+                _output = OUTPUT_PPROF;
+
             CASE("traces")
                 _output = OUTPUT_TEXT;
                 _dump_traces = value == NULL ? INT_MAX : atoi(value);
@@ -232,12 +327,67 @@ Error Arguments::parse(const char* args) {
                     msg = "alloc must be >= 0";
                 }
 
+            CASE("live")
+                _live = value == NULL ? DEFAULT_LIVE_REFS : atoi(value);
+                if (_live <= 0) {
+                    msg = "live must be > 0";
+                } else if (_alloc < 0) {
+                    _alloc = 0;
+                }
+
+            CASE("allocsite")
+                _alloc_site_reuse = value == NULL ? DEFAULT_ALLOC_SITE_REUSE : atoi(value);
+                if (_alloc_site_reuse < 0) {
+                    msg = "allocsite must be >= 0";
+                }
+
             CASE("lock")
                 _lock = value == NULL ? 0 : parseUnits(value, NANOS);
                 if (_lock < 0) {
                     msg = "lock must be >= 0";
                 }
 
+            CASE("locksample")
+                if (value == NULL || (_lock_sample = parseUnits(value, NANOS)) < 0) {
+                    msg = "locksample must be >= 0";
+                }
+
+            CASE("nativemem")
+                _nativemem = value == NULL ? 0 : parseUnits(value, BYTES);
+                if (_nativemem < 0) {
+                    msg = "nativemem must be >= 0";
+                }
+
+            CASE("io")
+                _io = value == NULL ? 0 : parseUnits(value, NANOS);
+                if (_io < 0) {
+                    msg = "io must be >= 0";
+                }
+
+            CASE("iostat")
+                if (value == NULL || (_io_stat = parseUnits(value, SECONDS)) <= 0) {
+                    msg = "iostat must be > 0";
+                }
+
+            CASE("ioaddr")
+                _io_addr = true;
+
+            CASE("methods")
+                if (value == NULL || value[0] == 0) {
+                    msg = "methods must not be empty";
+                }
+                _methods = value;
+
+            CASE("methodpct")
+                if (value == NULL || (_method_pct = atoi(value)) <= 0 || _method_pct >= 100) {
+                    msg = "methodpct must be between 0 and 100";
+                }
+
+            CASE("lockgraph")
+                if (value == NULL || (_lock_graph = parseUnits(value, SECONDS)) <= 0) {
+                    msg = "lockgraph must be > 0";
+                }
+
             CASE("interval")
                 if (value == NULL || (_interval = parseUnits(value, UNIVERSAL)) <= 0) {
                     msg = "Invalid interval";
@@ -276,6 +426,100 @@ Error Arguments::parse(const char* args) {
                 _fdtransfer = true;
                 _fdtransfer_path = value;
 
+            CASE("perfpoll")
+                _perf_poll = true;
+
+            CASE("percpu")
+                _per_cpu = true;
+
+            CASE("counters")
+                _counters = value == NULL || value[0] == 0 ? NULL : value;
+
+            CASE("dataaddr")
+                _data_addr = true;
+
+            CASE("boost")
+                if (value == NULL || (_boost_interval = parseUnits(value, UNIVERSAL)) <= 0) {
+                    msg = "Invalid boost interval";
+                }
+
+            CASE("boostmax")
+                if (value == NULL || (_boost_max = atoi(value)) <= 0) {
+                    msg = "boostmax must be > 0";
+                }
+
+            CASE("budget")
+                if (value == NULL || (_overhead_budget = atof(value)) <= 0 || _overhead_budget >= 100) {
+                    msg = "budget must be a percentage between 0 and 100";
+                }
+
+            CASE("bgcpus")
+                if (value == NULL || value[0] == 0) {
+                    msg = "bgcpus must be a CPU list";
+                } else {
+                    _bg_cpus = value;
+                }
+
+            CASE("bgnice")
+                if (value == NULL || (_bg_nice = atoi(value)) < -20 || _bg_nice > 19) {
+                    msg = "bgnice must be between -20 and 19";
+                }
+
+            CASE("bgidle")
+                _bg_idle = true;
+
+            CASE("hugepages")
+                if (value == NULL || strcmp(value, "thp") == 0) {
+                    _large_pages = LARGE_PAGES_THP;
+                } else if (strcmp(value, "hugetlb") == 0) {
+                    _large_pages = LARGE_PAGES_HUGETLB;
+                } else {
+                    msg = "hugepages must be thp or hugetlb";
+                }
+
+            CASE("numa")
+                _numa_interleave = true;
+
+            CASE("latency")
+                _latency_stats = true;
+
+            CASE("hotmethods")
+                _hot_methods = true;
+
+            CASE("windows")
+                if (value == NULL || (_windows = atoi(value)) <= 0) {
+                    msg = "windows must be > 0";
+                }
+
+            CASE("window")
+                if (value == NULL || (_window_time = parseUnits(value, SECONDS)) <= 0) {
+                    msg = "Invalid window duration";
+                }
+
+            CASE("last")
+                if (value == NULL || (_last = parseUnits(value, SECONDS)) <= 0) {
+                    msg = "Invalid last duration";
+                }
+
+            CASE("memlimit")
+                if (value == NULL || (_memory_limit = parseUnits(value, BYTES)) <= 0) {
+                    msg = "Invalid memlimit";
+                }
+
+            CASE("symcache")
+                _symcache = value == NULL || value[0] == 0 ? NULL : value;
+
+            CASE("perfmap")
+                _perf_map = value == NULL ? "" : value;
+
+            CASE("perfmapjit")
+                _perf_map_jit = true;
+
+            CASE("heapmon")
+                if ((_heap_monitor = value == NULL ? 0 : parseUnits(value, NANOS)) < 0) {
+                    msg = "Invalid heapmon interval";
+                }
+
             // Filters
             CASE("filter")
                 _filter = value == NULL ? "" : value;
@@ -292,6 +536,15 @@ Error Arguments::parse(const char* args) {
             CASE("sched")
                 _sched = true;
 
+            CASE("gcskip")
+                _gc_skip = true;
+
+            CASE("samplecpu")
+                _sample_cpu = true;
+
+            CASE("cgroup")
+                _cgroup = true;
+
             CASE("allkernel")
                 _ring = RING_KERNEL;
 
@@ -311,6 +564,11 @@ Error Arguments::parse(const char* args) {
                     }
                 }
 
+            CASE("jstackwalk")
+                if (value != NULL) {
+                    _jstack_walk = strcmp(value, "vm") == 0 ? JSTACK_VM : JSTACK_ASGCT;
+                }
+
             // Output style modifiers
             CASE("simple")
                 _style |= STYLE_SIMPLE;
@@ -330,12 +588,93 @@ Error Arguments::parse(const char* args) {
             CASE("mcache")
                 _mcache = value == NULL ? 1 : (unsigned char)strtol(value, NULL, 0);
 
+            CASE("warm")
+                _warm = true;
+
             CASE("begin")
                 _begin = value;
 
             CASE("end")
                 _end = value;
 
+            CASE("kdformat")
+                if (value == NULL || strcmp(value, "text") == 0) {
+                    _kd_format = KD_FORMAT_TEXT;
+                } else if (strcmp(value, "ids") == 0) {
+                    _kd_format = KD_FORMAT_IDS;
+                } else if (strcmp(value, "binary") == 0) {
+                    _kd_format = KD_FORMAT_BINARY;
+                } else {
+                    msg = "kdformat must be text, ids or binary";
+                }
+
+            CASE("kdcapacity")
+                if (value == NULL || (_kd_capacity = atoi(value)) <= 0) {
+                    msg = "kdcapacity must be > 0";
+                }
+
+            CASE("kddepth")
+                if (value == NULL || (_kd_depth = atoi(value)) <= 0) {
+                    msg = "kddepth must be > 0";
+                }
+
+            CASE("kdspill")
+                if (value == NULL || value[0] == 0) {
+                    msg = "kdspill must not be empty";
+                }
+                _kd_spill = value;
+
+            CASE("kdspillsize")
+                if (value == NULL || (_kd_spill_size = parseUnits(value, BYTES)) < 65536) {
+                    msg = "kdspillsize must be >= 64K";
+                }
+
+            CASE("kdshm")
+                if (value == NULL || value[0] == 0) {
+                    msg = "kdshm must not be empty";
+                }
+                _kd_shm = value;
+
+            CASE("kdshmsize")
+                if (value == NULL || (_kd_shm_size = parseUnits(value, BYTES)) < 65536) {
+                    msg = "kdshmsize must be >= 64K";
+                }
+
+            CASE("kdasync")
+                _kd_async = true;
+
+            CASE("kdcompress")
+                _kd_async = true;
+                _kd_compress = true;
+
+            CASE("kdclock")
+                if (value == NULL || strcmp(value, "wall") == 0) {
+                    _kd_tsc = false;
+                } else if (strcmp(value, "tsc") == 0) {
+                    _kd_tsc = true;
+                } else {
+                    msg = "kdclock must be wall or tsc";
+                }
+
+            CASE("kdaggregate")
+                _kd_aggregate = true;
+                if (value != NULL && !(_kd_groups = strcmp(value, "group") == 0)) {
+                    msg = "kdaggregate must be empty or group";
+                }
+
+            CASE("kdstates")
+                _kd_states = true;
+
+            CASE("kddelta")
+                _kd_delta = true;
+
+            CASE("kdidle")
+                _kd_idle = true;
+                if (value != NULL) appendToEmbeddedList(_kd_idle_frames, value);
+
+            CASE("kdalloc")
+                _kd_alloc = true;
+
             // FlameGraph options
             CASE("title")
                 _title = value;
@@ -343,9 +682,23 @@ Error Arguments::parse(const char* args) {
             CASE("minwidth")
                 if (value != NULL) _minwidth = atof(value);
 
+            CASE("maxframes")
+                if (value == NULL || (_max_frames = atoi(value)) < 0) {
+                    msg = "maxframes must be >= 0";
+                }
+
             CASE("reverse")
                 _reverse = true;
 
+            CASE("leaks")
+                _leaks = true;
+
+            CASE("baseline")
+                _baseline = true;
+
+            CASE("diff")
+                _diff = true;
+
             DEFAULT()
                 if (_unknown_arg == NULL) _unknown_arg = arg;
         }
@@ -356,7 +709,12 @@ Error Arguments::parse(const char* args) {
         return Error(msg);
     }
 
-    if (_event == NULL && _alloc < 0 && _lock < 0) {
+    if (_kd_shm != NULL && _kd_async) {
+        // The shared memory ring takes whole events; it has no batches to defer or compress
+        return Error(_kd_compress ? "kdcompress cannot be used with kdshm" : "kdasync cannot be used with kdshm");
+    }
+
+    if (_event == NULL && _alloc < 0 && _lock < 0 && _nativemem < 0 && _io < 0) {
         _event = EVENT_CPU;
     }
 
@@ -369,7 +727,12 @@ Error Arguments::parse(const char* args) {
         _dump_flat = 200;
     }
 
-    if (_action == ACTION_NONE && _output != OUTPUT_NONE) {
+    if (_output == OUTPUT_PPROF && _file == NULL && !_binary_out) {
+        // The profile is binary and cannot be returned as a string
+        return Error("pprof output requires file=");
+    }
+
+    if (_action == ACTION_NONE && (_output != OUTPUT_NONE || _baseline)) {
         _action = ACTION_DUMP;
     }
 
@@ -464,6 +827,11 @@ Output Arguments::detectOutputFormat(const char* file) {
             return OUTPUT_JFR;
         } else if (strcmp(ext, ".collapsed") == 0 || strcmp(ext, ".folded") == 0) {
             return OUTPUT_COLLAPSED;
+        } else if (strcmp(ext, ".pprof") == 0 || strcmp(ext, ".pb") == 0) {
+            return OUTPUT_PPROF;
+        } else if (strcmp(ext, ".gz") == 0 && ext - file >= 3 && strncmp(ext - 3, ".pb", 3) == 0) {
+            // Only profile.pb.gz: out.collapsed.gz and the like are not pprof
+            return OUTPUT_PPROF;
         } else if (strcmp(ext, ".svg") == 0) {
             return OUTPUT_SVG;
         }
@@ -18,17 +18,32 @@
 #define _ARGUMENTS_H
 
 #include <stddef.h>
+#include "os.h"
 
 
 const long DEFAULT_INTERVAL = 10000000;      // 10 ms
 const long DEFAULT_ALLOC_INTERVAL = 524287;  // 512 KiB
+const int DEFAULT_LIVE_REFS = 1024;
+const int DEFAULT_ALLOC_SITE_REUSE = 64;
 const int DEFAULT_JSTACKDEPTH = 20;
+const int DEFAULT_KD_CAPACITY = 8192;
+const int DEFAULT_KD_DEPTH = 128;
+const long DEFAULT_KD_SHM_SIZE = 8 * 1024 * 1024;
+const long DEFAULT_KD_SPILL_SIZE = 64 * 1024 * 1024;
+const int DEFAULT_BOOST_MAX = 8;
+const int DEFAULT_MAX_FRAMES = 250000;
+const int DEFAULT_TOP_METHODS = 20;
+const long DEFAULT_WINDOW_TIME = 60;
 
 const char* const EVENT_CPU    = "cpu";
 const char* const EVENT_ALLOC  = "alloc";
 const char* const EVENT_LOCK   = "lock";
 const char* const EVENT_WALL   = "wall";
 const char* const EVENT_ITIMER = "itimer";
+const char* const EVENT_CTIMER = "ctimer";
+const char* const EVENT_OFFCPU = "offcpu";
+const char* const EVENT_RUNQ   = "runq";
+const char* const EVENT_TTSP   = "ttsp";
 
 enum Action {
     ACTION_NONE,
@@ -41,7 +56,9 @@ enum Action {
     ACTION_STATUS,
     ACTION_LIST,
     ACTION_VERSION,
-    ACTION_FULL_VERSION
+    ACTION_FULL_VERSION,
+    ACTION_TOP,
+    ACTION_SNAPSHOT
 };
 
 enum Counter {
@@ -71,6 +88,11 @@ enum CStack {
     CSTACK_LBR
 };
 
+enum JStackWalk {
+    JSTACK_ASGCT,
+    JSTACK_VM
+};
+
 enum Output {
     OUTPUT_NONE,
     OUTPUT_TEXT,
@@ -78,7 +100,14 @@ enum Output {
     OUTPUT_COLLAPSED,
     OUTPUT_FLAMEGRAPH,
     OUTPUT_TREE,
-    OUTPUT_JFR
+    OUTPUT_JFR,
+    OUTPUT_PPROF
+};
+
+enum KdFormat {
+    KD_FORMAT_TEXT,
+    KD_FORMAT_IDS,
+    KD_FORMAT_BINARY
 };
 
 enum JfrOption {
@@ -140,6 +169,15 @@ class Arguments {
     long _interval;
     long _alloc;
     long _lock;
+    long _lock_sample;
+    long _lock_graph;
+    long _nativemem;
+    long _io;
+    long _io_stat;
+    int _live;
+    int _alloc_site_reuse;
+    const char* _methods;
+    int _method_pct;
     int  _jstackdepth;
     int _safe_mode;
     const char* _file;
@@ -147,31 +185,86 @@ class Arguments {
     const char* _loglevel;
     const char* _unknown_arg;
     const char* _server;
+    // Set by callers that return the dump as bytes rather than as a Java string
+    bool _binary_out;
     const char* _filter;
     int _include;
     int _exclude;
     unsigned char _mcache;
+    bool _warm;
     bool _loop;
     bool _threads;
     bool _sched;
+    bool _gc_skip;
+    bool _sample_cpu;
+    bool _cgroup;
     bool _fdtransfer;
     const char* _fdtransfer_path;
+    const char* _symcache;
+    const char* _perf_map;
+    bool _perf_map_jit;
+    long _heap_monitor;
+    bool _perf_poll;
+    bool _per_cpu;
+    const char* _counters;
+    bool _data_addr;
+    long _boost_interval;
+    int _boost_max;
+    double _overhead_budget;
+    const char* _bg_cpus;
+    int _bg_nice;
+    bool _bg_idle;
+    LargePages _large_pages;
+    bool _numa_interleave;
+    bool _latency_stats;
+    bool _hot_methods;
+    int _windows;
+    long _window_time;
+    long _last;
+    long _memory_limit;
     int _style;
     CStack _cstack;
+    JStackWalk _jstack_walk;
     Output _output;
     long _chunk_size;
     long _chunk_time;
     const char* _jfr_sync;
+    const char* _jfr_stream;
     int _jfr_options;
     int _dump_traces;
     int _dump_flat;
+    int _dump_top;
+    bool _top_by_total;
+    long _snapshot_timeout;
     unsigned int _file_num;
     const char* _begin;
     const char* _end;
+    KdFormat _kd_format;
+    int _kd_capacity;
+    int _kd_depth;
+    const char* _kd_spill;
+    long _kd_spill_size;
+    const char* _kd_shm;
+    long _kd_shm_size;
+    bool _kd_async;
+    bool _kd_compress;
+    bool _kd_tsc;
+    bool _kd_aggregate;
+    bool _kd_states;
+    bool _kd_groups;
+    bool _kd_delta;
+    bool _kd_idle;
+    int _kd_idle_frames;
+    bool _kd_alloc;
     // FlameGraph parameters
     const char* _title;
     double _minwidth;
+    int _max_frames;
     bool _reverse;
+    bool _baseline;
+    bool _diff;
+    bool _leaks;
+    bool _io_addr;
 
     Arguments(bool persistent = false) :
         _buf(NULL),
@@ -185,6 +278,15 @@ class Arguments {
         _interval(0),
         _alloc(-1),
         _lock(-1),
+        _lock_sample(0),
+        _lock_graph(0),
+        _nativemem(-1),
+        _io(-1),
+        _io_stat(0),
+        _live(0),
+        _alloc_site_reuse(0),
+        _methods(NULL),
+        _method_pct(0),
         _jstackdepth(DEFAULT_JSTACKDEPTH),
         _safe_mode(0),
         _file(NULL),
@@ -192,30 +294,84 @@ class Arguments {
         _loglevel(NULL),
         _unknown_arg(NULL),
         _server(NULL),
+        _binary_out(false),
         _filter(NULL),
         _include(0),
         _exclude(0),
         _mcache(0),
+        _warm(false),
         _loop(false),
         _threads(false),
         _sched(false),
+        _gc_skip(false),
+        _sample_cpu(false),
+        _cgroup(false),
         _fdtransfer(false),
         _fdtransfer_path(NULL),
+        _symcache(NULL),
+        _perf_map(NULL),
+        _perf_map_jit(false),
+        _heap_monitor(-1),
+        _perf_poll(false),
+        _per_cpu(false),
+        _counters(NULL),
+        _data_addr(false),
+        _boost_interval(0),
+        _boost_max(DEFAULT_BOOST_MAX),
+        _overhead_budget(0),
+        _bg_cpus(NULL),
+        _bg_nice(0),
+        _bg_idle(false),
+        _large_pages(LARGE_PAGES_NONE),
+        _numa_interleave(false),
+        _latency_stats(false),
+        _hot_methods(false),
+        _windows(0),
+        _window_time(DEFAULT_WINDOW_TIME),
+        _last(0),
+        _memory_limit(0),
         _style(0),
         _cstack(CSTACK_DEFAULT),
+        _jstack_walk(JSTACK_ASGCT),
         _output(OUTPUT_NONE),
         _chunk_size(100 * 1024 * 1024),
         _chunk_time(3600),
         _jfr_sync(NULL),
+        _jfr_stream(NULL),
         _jfr_options(0),
         _dump_traces(0),
         _dump_flat(0),
+        _dump_top(DEFAULT_TOP_METHODS),
+        _top_by_total(false),
+        _snapshot_timeout(0),
         _file_num(0),
         _begin(NULL),
         _end(NULL),
+        _kd_format(KD_FORMAT_TEXT),
+        _kd_capacity(DEFAULT_KD_CAPACITY),
+        _kd_depth(DEFAULT_KD_DEPTH),
+        _kd_spill(NULL),
+        _kd_spill_size(DEFAULT_KD_SPILL_SIZE),
+        _kd_shm(NULL),
+        _kd_shm_size(DEFAULT_KD_SHM_SIZE),
+        _kd_async(false),
+        _kd_compress(false),
+        _kd_tsc(false),
+        _kd_aggregate(false),
+        _kd_states(false),
+        _kd_groups(false),
+        _kd_delta(false),
+        _kd_idle(false),
+        _kd_idle_frames(0),
+        _kd_alloc(false),
         _title(NULL),
         _minwidth(0),
-        _reverse(false) {
+        _max_frames(DEFAULT_MAX_FRAMES),
+        _reverse(false),
+        _baseline(false),
+        _diff(false),
+        _leaks(false),
+        _io_addr(false) {
     }
 
     ~Arguments();
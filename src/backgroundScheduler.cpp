@@ -0,0 +1,234 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "backgroundScheduler.h"
+#include "arguments.h"
+#include "log.h"
+#include "os.h"
+#include "vmEntry.h"
+
+
+const u64 SCHEDULER_TICK_NS = SCHEDULER_TICK_MS * 1000000ULL;
+
+std::mutex BackgroundScheduler::_lock;
+std::condition_variable BackgroundScheduler::_wakeup;
+std::condition_variable BackgroundScheduler::_done;
+SchedulerEntry* BackgroundScheduler::_wheel[SCHEDULER_WHEEL_SLOTS];
+int BackgroundScheduler::_tasks = 0;
+ScheduledTask* BackgroundScheduler::_current = NULL;
+bool BackgroundScheduler::_cancel_current = false;
+bool BackgroundScheduler::_running = false;
+u64 BackgroundScheduler::_generation = 0;
+std::thread BackgroundScheduler::_thread;
+std::thread::id BackgroundScheduler::_thread_id;
+u64 BackgroundScheduler::_start_time = 0;
+u64 BackgroundScheduler::_tick = 0;
+char* BackgroundScheduler::_cpus = NULL;
+int BackgroundScheduler::_nice = 0;
+bool BackgroundScheduler::_idle = false;
+
+void BackgroundScheduler::configure(Arguments& args) {
+    std::lock_guard<std::mutex> ml(_lock);
+    free(_cpus);
+    _cpus = args._bg_cpus != NULL ? strdup(args._bg_cpus) : NULL;
+    _nice = args._bg_nice;
+    _idle = args._bg_idle;
+}
+
+void BackgroundScheduler::applyPolicy(bool idle) {
+    if (_cpus != NULL && !OS::bindThread(_cpus)) {
+        Log::warn("Could not bind a profiler thread to CPUs %s", _cpus);
+    }
+    if (_nice != 0 && !OS::setThreadNice(_nice)) {
+        Log::warn("Could not set nice %d for a profiler thread", _nice);
+    }
+    if (idle && _idle && !OS::setThreadIdle()) {
+        Log::warn("Could not move the profiler scheduler to the idle class");
+    }
+}
+
+u64 BackgroundScheduler::currentTick() {
+    return (OS::nanotime() - _start_time) / SCHEDULER_TICK_NS;
+}
+
+void BackgroundScheduler::insert(SchedulerEntry* entry) {
+    SchedulerEntry** slot = &_wheel[entry->due & (SCHEDULER_WHEEL_SLOTS - 1)];
+    entry->next = *slot;
+    *slot = entry;
+}
+
+// Intervals longer than a revolution leave entries in slots they are not due at yet,
+// so the earliest tick comes from the entries rather than from the first occupied slot
+u64 BackgroundScheduler::nextDue() {
+    u64 next = (u64)-1;
+    for (int i = 0; i < SCHEDULER_WHEEL_SLOTS; i++) {
+        for (SchedulerEntry* e = _wheel[i]; e != NULL; e = e->next) {
+            if (e->due < next) next = e->due;
+        }
+    }
+    return next;
+}
+
+// Called with the lock held
+void BackgroundScheduler::start() {
+    if (!_running) {
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        memset(_wheel, 0, sizeof(_wheel));
+        _start_time = OS::nanotime();
+        _tick = 0;
+        _running = true;
+        _thread = std::thread(loop, ++_generation);
+        _thread_id = _thread.get_id();
+    }
+}
+
+// Called with the lock held. A loop runs only while the generation it was started with
+// is the current one, so a stopped loop never shares the state of the next one
+void BackgroundScheduler::stop() {
+    _running = false;
+    _generation++;
+    _wakeup.notify_all();
+}
+
+void BackgroundScheduler::schedule(ScheduledTask* task, long interval_ms, bool run_now) {
+    std::unique_lock<std::mutex> ml(_lock);
+    start();
+
+    SchedulerEntry* entry = new SchedulerEntry();
+    entry->task = task;
+    entry->interval = interval_ms > SCHEDULER_TICK_MS ? (u64)(interval_ms + SCHEDULER_TICK_MS - 1) / SCHEDULER_TICK_MS : 1;
+    entry->due = currentTick() + (run_now ? 1 : entry->interval);
+    insert(entry);
+    _tasks++;
+    _wakeup.notify_one();
+}
+
+void BackgroundScheduler::runOnce(ScheduledTask* task) {
+    std::unique_lock<std::mutex> ml(_lock);
+    start();
+
+    SchedulerEntry* entry = new SchedulerEntry();
+    entry->task = task;
+    entry->interval = 0;
+    entry->due = currentTick() + 1;
+    insert(entry);
+    _tasks++;
+    _wakeup.notify_one();
+}
+
+void BackgroundScheduler::cancel(ScheduledTask* task) {
+    std::unique_lock<std::mutex> ml(_lock);
+    bool self = std::this_thread::get_id() == _thread_id;
+
+    bool found = false;
+    for (int i = 0; i < SCHEDULER_WHEEL_SLOTS && !found; i++) {
+        for (SchedulerEntry** link = &_wheel[i]; *link != NULL; link = &(*link)->next) {
+            if ((*link)->task == task) {
+                SchedulerEntry* entry = *link;
+                *link = entry->next;
+                delete entry;
+                _tasks--;
+                found = true;
+                break;
+            }
+        }
+    }
+
+    if (!found && _current == task) {
+        // The loop drops the entry once the task returns
+        _cancel_current = true;
+        if (!self) {
+            _done.wait(ml, [task] { return _current != task; });
+        }
+    }
+
+    // On the scheduler thread, the loop stops by itself once the running task returns
+    if (_tasks == 0 && _running && !self) {
+        stop();
+        ml.unlock();
+        _thread.join();
+    }
+}
+
+void BackgroundScheduler::loop(u64 generation) {
+    VM::attachThread("AsyncProfiler-Scheduler");
+    applyPolicy(true);
+
+    std::unique_lock<std::mutex> ml(_lock);
+    while (_generation == generation) {
+        u64 tick = currentTick();
+        if (tick - _tick > SCHEDULER_WHEEL_SLOTS) {
+            // Every slot is visited once, which is enough after a long stall
+            _tick = tick - SCHEDULER_WHEEL_SLOTS + 1;
+        }
+
+        // All slots passed since the last wakeup, so that a late wakeup does not skip a task
+        for (; _tick <= tick && _generation == generation; _tick++) {
+            SchedulerEntry** link = &_wheel[_tick & (SCHEDULER_WHEEL_SLOTS - 1)];
+            while (*link != NULL && _generation == generation) {
+                SchedulerEntry* entry = *link;
+                if (entry->due > _tick) {
+                    link = &entry->next;
+                    continue;
+                }
+                *link = entry->next;
+
+                _current = entry->task;
+                ml.unlock();
+                entry->task->run();
+                ml.lock();
+                _current = NULL;
+                _done.notify_all();
+
+                if (_cancel_current || entry->interval == 0) {
+                    _cancel_current = false;
+                    delete entry;
+                    // The loop is left before the lock is released, so a new schedule() starts afresh
+                    if (--_tasks == 0) {
+                        stop();
+                        _thread.detach();
+                    }
+                } else {
+                    entry->due = currentTick() + entry->interval;
+                    insert(entry);
+                }
+                // The slot may have changed while the lock was released
+                link = &_wheel[_tick & (SCHEDULER_WHEEL_SLOTS - 1)];
+            }
+        }
+
+        if (_generation == generation) {
+            u64 next = nextDue();
+            if (next != (u64)-1) {
+                u64 wake_time = _start_time + next * SCHEDULER_TICK_NS;
+                u64 now = OS::nanotime();
+                if (wake_time > now) {
+                    _wakeup.wait_for(ml, std::chrono::nanoseconds(wake_time - now));
+                }
+            } else {
+                _wakeup.wait(ml);
+            }
+        }
+    }
+
+    ml.unlock();
+    VM::detachThread();
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _BACKGROUNDSCHEDULER_H
+#define _BACKGROUNDSCHEDULER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "arch.h"
+
+
+const int SCHEDULER_TICK_MS = 10;
+const int SCHEDULER_WHEEL_SLOTS = 256;
+
+class Arguments;
+
+// Periodic work of the profiler that does not need a thread of its own
+class ScheduledTask {
+  public:
+    virtual ~ScheduledTask() {}
+    virtual void run() = 0;
+};
+
+struct SchedulerEntry {
+    ScheduledTask* task;
+    u64 interval;  // in ticks, 0 for runOnce()
+    u64 due;       // tick
+    SchedulerEntry* next;
+};
+
+// Runs the housekeeping tasks of the profiler on one thread. Tasks sit in a timer wheel
+// of SCHEDULER_TICK_MS slots: the tasks due by the same tick run on one wakeup, and the
+// thread sleeps until the next occupied slot. The thread starts with the first task and
+// exits with the last one. bgcpus, bgnice and bgidle set how it competes with the
+// application; the samplers that keep their own threads take bgcpus and bgnice too.
+class BackgroundScheduler {
+  private:
+    static std::mutex _lock;
+    static std::condition_variable _wakeup;
+    static std::condition_variable _done;
+    static SchedulerEntry* _wheel[SCHEDULER_WHEEL_SLOTS];
+    static int _tasks;
+    static ScheduledTask* _current;
+    static bool _cancel_current;
+    static bool _running;
+    static u64 _generation;
+    static std::thread _thread;
+    static std::thread::id _thread_id;
+    static u64 _start_time;
+    static u64 _tick;
+
+    static char* _cpus;
+    static int _nice;
+    static bool _idle;
+
+    static u64 currentTick();
+    static void start();
+    static void stop();
+    static void insert(SchedulerEntry* entry);
+    static u64 nextDue();
+    static void loop(u64 generation);
+
+  public:
+    static void configure(Arguments& args);
+    // Applies bgcpus, bgnice and, for the scheduler thread only, bgidle to the calling thread
+    static void applyPolicy(bool idle);
+
+    // The first run is interval_ms from now, or on the next tick with run_now
+    static void schedule(ScheduledTask* task, long interval_ms, bool run_now = false);
+    // Runs the task once on the next tick, then forgets it. It must stay alive until it has run
+    static void runOnce(ScheduledTask* task);
+    // Once cancel() returns, the task is not running and will not run again
+    static void cancel(ScheduledTask* task);
+};
+
+#endif // _BACKGROUNDSCHEDULER_H
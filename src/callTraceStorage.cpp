@@ -18,16 +18,29 @@
 #include "callTraceStorage.h"
 #include "os.h"
 
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HASH 1
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#define crc32c_u64(crc, v)  _mm_crc32_u64(crc, v)
+#define crc32c_u32(crc, v)  _mm_crc32_u32(crc, v)
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_HASH 1
+#define CRC32C_TARGET
+#define crc32c_u64(crc, v)  __crc32cd(crc, v)
+#define crc32c_u32(crc, v)  __crc32cw(crc, v)
+#endif
+
 
 static const u32 INITIAL_CAPACITY = 65536;
 static const u32 CALL_TRACE_CHUNK = 8 * 1024 * 1024;
-static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
 
 
 class LongHashTable {
   private:
     LongHashTable* _prev;
-    void* _padding0;
+    LinearAllocator* _allocator;
     u32 _capacity;
     u32 _padding1[15];
     volatile u32 _size;
@@ -39,19 +52,33 @@ class LongHashTable {
     }
 
   public:
-    static LongHashTable* allocate(LongHashTable* prev, u32 capacity) {
-        LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity));
+    // All tables of one epoch share the allocator of the epoch's first table
+    // Growth of an epoch counts against memlimit; its first table is always granted
+    static LongHashTable* allocate(LongHashTable* prev, u32 capacity, LinearAllocator* allocator) {
+        size_t size = getSize(capacity);
+        if (prev == NULL) {
+            MemoryBudget::charge(MEMORY_CALL_TRACES, size);
+        } else if (!MemoryBudget::reserve(MEMORY_CALL_TRACES, size)) {
+            return NULL;
+        }
+
+        LongHashTable* table = (LongHashTable*)OS::safeAllocLarge(size);
         if (table != NULL) {
             table->_prev = prev;
+            table->_allocator = allocator;
             table->_capacity = capacity;
             table->_size = 0;
+        } else {
+            MemoryBudget::release(MEMORY_CALL_TRACES, size);
         }
         return table;
     }
 
     LongHashTable* destroy() {
         LongHashTable* prev = _prev;
-        OS::safeFree(this, getSize(_capacity));
+        size_t size = getSize(_capacity);
+        OS::safeFree(this, size);
+        MemoryBudget::release(MEMORY_CALL_TRACES, size);
         return prev;
     }
 
@@ -59,6 +86,14 @@ class LongHashTable {
         return _prev;
     }
 
+    void setPrev(LongHashTable* prev) {
+        _prev = prev;
+    }
+
+    LinearAllocator* allocator() {
+        return _allocator;
+    }
+
     u32 capacity() {
         return _capacity;
     }
@@ -87,29 +122,117 @@ class LongHashTable {
 
 
 CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, (jmethodID)"storage_overflow"}};
-
-CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK) {
-    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
-    _overflow = 0;
+bool CallTraceStorage::_crc32c = false;
+
+CallTraceStorage::CallTraceStorage() : _overflow(0), _epoch(0), _retired(NULL), _spare(NULL) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    _crc32c = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_HASH)
+    _crc32c = true;
+#endif
+    _current_table = newEpoch();
 }
 
 CallTraceStorage::~CallTraceStorage() {
+    if (_reclaimer.joinable()) {
+        _reclaimer.join();
+    }
+    reclaim();
+    if (_spare != NULL) {
+        delete _spare->allocator();
+        _spare->destroy();
+    }
+
+    LinearAllocator* allocator = _current_table->allocator();
     while (_current_table != NULL) {
         _current_table = _current_table->destroy();
     }
+    delete allocator;
+}
+
+LongHashTable* CallTraceStorage::newEpoch() {
+    LongHashTable* table = __atomic_exchange_n(&_spare, (LongHashTable*)NULL, __ATOMIC_ACQUIRE);
+    if (table != NULL) {
+        return table;
+    }
+    return LongHashTable::allocate(NULL, INITIAL_CAPACITY, new LinearAllocator(CALL_TRACE_CHUNK, MEMORY_CALL_TRACES));
+}
+
+// Runs on the reclaimer thread: tables of retired epochs are unmapped, and the first
+// table of one of them is emptied together with its allocator to serve the next epoch
+void CallTraceStorage::reclaim() {
+    LongHashTable* epoch = __atomic_exchange_n(&_retired, (LongHashTable*)NULL, __ATOMIC_ACQUIRE);
+    while (epoch != NULL) {
+        // The next retired epoch is linked through the first table of this one
+        LongHashTable* first = epoch;
+        while (first->prev() != NULL && first->prev()->allocator() == epoch->allocator()) {
+            first = first->prev();
+        }
+        LongHashTable* next = first->prev();
+
+        while (epoch != first) {
+            epoch = epoch->destroy();
+        }
+        first->setPrev(NULL);
+
+        if (__atomic_load_n(&_spare, __ATOMIC_ACQUIRE) == NULL) {
+            first->clear();
+            first->allocator()->clear();
+            __atomic_store_n(&_spare, first, __ATOMIC_RELEASE);
+        } else {
+            delete first->allocator();
+            first->destroy();
+        }
+        epoch = next;
+    }
 }
 
 void CallTraceStorage::clear() {
-    while (_current_table->prev() != NULL) {
-        _current_table = _current_table->destroy();
+    if (_reclaimer.joinable()) {
+        _reclaimer.join();
     }
-    _current_table->clear();
-    _allocator.clear();
+
+    LongHashTable* table = newEpoch();
+    if (table == NULL) {
+        // Out of memory: fall back to emptying the current epoch in place
+        while (_current_table->prev() != NULL) {
+            _current_table = _current_table->destroy();
+        }
+        _current_table->clear();
+        _current_table->allocator()->clear();
+        _overflow = 0;
+        _epoch++;
+        return;
+    }
+
+    LongHashTable* old = __atomic_exchange_n(&_current_table, table, __ATOMIC_ACQ_REL);
     _overflow = 0;
+    _epoch++;
+
+    LongHashTable* first = old;
+    while (first->prev() != NULL) {
+        first = first->prev();
+    }
+    first->setPrev(_retired);
+    _retired = old;
+
+    _reclaimer = std::thread([this] {
+        reclaim();
+    });
 }
 
-void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+void CallTraceStorage::collectTraces(std::vector<CallTraceRef>& traces) {
+    // Each table doubles the previous one and its ids follow the ids of all smaller
+    // tables, so walking from the oldest table up yields ascending ids
+    LongHashTable* tables[32];
+    int table_count = 0;
+    for (LongHashTable* table = _current_table; table != NULL && table_count < 32; table = table->prev()) {
+        tables[table_count++] = table;
+    }
+
+    while (--table_count >= 0) {
+        LongHashTable* table = tables[table_count];
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
@@ -120,14 +243,16 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
                 values[slot].samples = 0;
                 CallTrace* trace = values[slot].acquireTrace();
                 if (trace != NULL) {
-                    map[capacity - (INITIAL_CAPACITY - 1) + slot] = trace;
+                    CallTraceRef ref = {capacity - (INITIAL_CAPACITY - 1) + slot, trace};
+                    traces.push_back(ref);
                 }
             }
         }
     }
 
     if (_overflow > 0) {
-        map[OVERFLOW_TRACE_ID] = &_overflow_trace;
+        CallTraceRef ref = {OVERFLOW_TRACE_ID, &_overflow_trace};
+        traces.push_back(ref);
     }
 }
 
@@ -159,8 +284,48 @@ void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
     }
 }
 
+#ifdef CRC32C_HASH
+
+// Two interleaved CRC32C streams, so that consecutive words do not wait for each other,
+// joined into 64 bits and spread by the MurmurHash3 finalizer
+CRC32C_TARGET
+static u64 crc32cHash(int num_frames, ASGCT_CallFrame* frames) {
+    int len = num_frames * sizeof(ASGCT_CallFrame);
+    const u64* data = (const u64*)frames;
+    const u64* end = data + len / 8;
+
+    u64 a = (u32)len;
+    u64 b = 0x9e3779b9;
+    for (; data + 1 < end; data += 2) {
+        a = crc32c_u64(a, data[0]);
+        b = crc32c_u64(b, data[1]);
+    }
+    if (data != end) {
+        a = crc32c_u64(a, *data++);
+    }
+    if (len & 4) {
+        b = crc32c_u32((u32)b, *(u32*)data);
+    }
+
+    u64 h = a << 32 | (u32)b;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#endif // CRC32C_HASH
+
 // Adaptation of MurmurHash64A by Austin Appleby
 u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
+#ifdef CRC32C_HASH
+    if (_crc32c) {
+        return crc32cHash(num_frames, frames);
+    }
+#endif
+
     const u64 M = 0xc6a4a7935bd1e995ULL;
     const int R = 47;
 
@@ -191,9 +356,9 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     return h;
 }
 
-CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
+CallTrace* CallTraceStorage::storeCallTrace(LinearAllocator* allocator, int num_frames, ASGCT_CallFrame* frames) {
     const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
-    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+    CallTrace* buf = (CallTrace*)allocator->alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
     if (buf != NULL) {
         buf->num_frames = num_frames;
         // Do not use memcpy inside signal handler
@@ -240,7 +405,7 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
 
             // Increment the table size, and if the load factor exceeds 0.75, reserve a new table
             if (table->incSize() == capacity * 3 / 4) {
-                LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
+                LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2, table->allocator());
                 if (new_table != NULL) {
                     __sync_bool_compare_and_swap(&_current_table, table, new_table);
                 }
@@ -249,7 +414,7 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
             // Migrate from a previous table to save space
             CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
             if (trace == NULL) {
-                trace = storeCallTrace(num_frames, frames);
+                trace = storeCallTrace(table->allocator(), num_frames, frames);
             }
             table->values()[slot].setTrace(trace);
             break;
@@ -270,3 +435,43 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
 
     return capacity - (INITIAL_CAPACITY - 1) + slot;
 }
+
+CallTrace* CallTraceStorage::add(u32 call_trace_id, u64 counter) {
+    if (call_trace_id == OVERFLOW_TRACE_ID) {
+        return NULL;
+    }
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        u32 capacity = table->capacity();
+        u32 base = capacity - (INITIAL_CAPACITY - 1);
+        if (call_trace_id >= base && call_trace_id < base + capacity) {
+            u32 slot = call_trace_id - base;
+            if (table->keys()[slot] == 0) {
+                return NULL;
+            }
+            CallTraceSample& s = table->values()[slot];
+            CallTrace* trace = s.acquireTrace();
+            if (trace != NULL) {
+                atomicInc(s.samples);
+                atomicInc(s.counter, counter);
+            }
+            return trace;
+        }
+    }
+    return NULL;
+}
+
+// Inverse of the id calculation in put(): every table owns a distinct range of ids
+CallTrace* CallTraceStorage::findTrace(u32 call_trace_id) {
+    if (call_trace_id == OVERFLOW_TRACE_ID) {
+        return &_overflow_trace;
+    }
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        u32 capacity = table->capacity();
+        u32 base = capacity - (INITIAL_CAPACITY - 1);
+        if (call_trace_id >= base && call_trace_id < base + capacity) {
+            u32 slot = call_trace_id - base;
+            return table->keys()[slot] != 0 ? table->values()[slot].acquireTrace() : NULL;
+        }
+    }
+    return NULL;
+}
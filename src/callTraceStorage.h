@@ -18,12 +18,16 @@
 #define _CALLTRACESTORAGE_H
 
 #include <map>
+#include <thread>
 #include <vector>
 #include "arch.h"
 #include "linearAllocator.h"
 #include "vmEntry.h"
 
 
+// All traces that did not fit in the storage share this id
+const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
+
 class LongHashTable;
 
 struct CallTrace {
@@ -56,28 +60,68 @@ struct CallTraceSample {
     }
 };
 
+// A trace together with the id that put() returned for it
+struct CallTraceRef {
+    u32 id;
+    CallTrace* trace;
+};
+
+// Value of a stack since a baseline snapshot, and its value at the snapshot
+struct CallTraceDelta {
+    CallTrace* trace;
+    u64 value;
+    u64 base;
+};
+
+// Sampled allocations of a stack that are still in use (leaks, live)
+struct LiveTotal {
+    u64 samples;
+    u64 bytes;
+};
+
 class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
+    // Hash stacks with the CRC32C instruction; chosen once by CPU feature detection
+    static bool _crc32c;
 
-    LinearAllocator _allocator;
     LongHashTable* _current_table;
     u64 _overflow;
+    // Incremented by clear(): ids of an older epoch must not be passed to add()
+    volatile u32 _epoch;
+
+    // Epochs replaced by clear() and not yet reclaimed, and an emptied
+    // epoch ready to be published by the next clear()
+    LongHashTable* _retired;
+    LongHashTable* _spare;
+    std::thread _reclaimer;
 
     u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
-    CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames);
+    CallTrace* storeCallTrace(LinearAllocator* allocator, int num_frames, ASGCT_CallFrame* frames);
     CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    LongHashTable* newEpoch();
+    void reclaim();
 
   public:
     CallTraceStorage();
     ~CallTraceStorage();
 
+    // Publishes an empty epoch in O(1). The caller must make sure no put() is
+    // still using the previous epoch; its memory is released in the background.
     void clear();
-    void collectTraces(std::map<u32, CallTrace*>& map);
+    // Traces sampled since the previous call, in id order
+    void collectTraces(std::vector<CallTraceRef>& traces);
     void collectSamples(std::vector<CallTraceSample*>& samples);
     void collectSamples(std::map<u64, CallTraceSample>& map);
 
+    u32 epoch() {
+        return _epoch;
+    }
+
     u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    // Counts one more sample of a trace that put() returned in this epoch
+    CallTrace* add(u32 call_trace_id, u64 counter);
+    CallTrace* findTrace(u32 call_trace_id);
 };
 
 #endif // _CALLTRACESTORAGE
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cgroupCpu.h"
+#include "eventLogger.h"
+#include "log.h"
+#include "os.h"
+#include "timeUtil.h"
+
+
+static const char CGROUP_ROOT[] = "/sys/fs/cgroup";
+// Where cgroup v1 mounts its CPU controllers, merged or not
+static const char* const CGROUP_V1_MOUNTS[] = {
+    "/sys/fs/cgroup/cpu,cpuacct",
+    "/sys/fs/cgroup/cpuacct,cpu",
+    "/sys/fs/cgroup/cpuacct",
+    "/sys/fs/cgroup/cpu"
+};
+
+int CgroupCpu::_version = 0;
+char CgroupCpu::_usage_path[PATH_MAX];
+char CgroupCpu::_stat_path[PATH_MAX];
+double CgroupCpu::_limit = 0;
+bool CgroupCpu::_enabled = false;
+u64 CgroupCpu::_last_report = 0;
+
+static bool readText(const char* path, char* buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t bytes = read(fd, buf, size - 1);
+    close(fd);
+    if (bytes <= 0) {
+        return false;
+    }
+    buf[bytes] = 0;
+    return true;
+}
+
+// Value of a "key value" line of a cgroup stat file, 0 if there is none
+static u64 statValue(const char* buf, const char* key) {
+    size_t len = strlen(key);
+    for (const char* line = buf; line != NULL; line = strchr(line, '\n')) {
+        if (*line == '\n') line++;
+        if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+            return strtoull(line + len + 1, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+// The cgroup directory as seen from the host, or the mount point itself
+// when the container has its own cgroup namespace or mount
+static bool findFile(char* dst, const char* mount, const char* path, const char* file) {
+    if (path != NULL && strcmp(path, "/") != 0) {
+        snprintf(dst, PATH_MAX, "%s%s/%s", mount, path, file);
+        if (access(dst, R_OK) == 0) {
+            return true;
+        }
+    }
+    snprintf(dst, PATH_MAX, "%s/%s", mount, file);
+    return access(dst, R_OK) == 0;
+}
+
+static bool findV1File(char* dst, const char* path, const char* file) {
+    for (size_t i = 0; i < sizeof(CGROUP_V1_MOUNTS) / sizeof(CGROUP_V1_MOUNTS[0]); i++) {
+        if (findFile(dst, CGROUP_V1_MOUNTS[i], path, file)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether a comma separated controller list of /proc/self/cgroup names the controller
+static bool hasController(const char* list, size_t len, const char* controller) {
+    size_t clen = strlen(controller);
+    for (const char* p = list; p < list + len; ) {
+        const char* end = (const char*)memchr(p, ',', list + len - p);
+        if (end == NULL) end = list + len;
+        if ((size_t)(end - p) == clen && strncmp(p, controller, clen) == 0) {
+            return true;
+        }
+        p = end + 1;
+    }
+    return false;
+}
+
+void CgroupCpu::locate() {
+    _version = 0;
+    _limit = 0;
+
+    char buf[4096];
+    if (!readText("/proc/self/cgroup", buf, sizeof(buf))) {
+        return;
+    }
+
+    // hierarchy-id:controller-list:path; v2 is the line with id 0 and no controllers.
+    // On hybrid systems the CPU controllers stay with v1.
+    char v1_cpu[PATH_MAX] = "";
+    char v1_cpuacct[PATH_MAX] = "";
+    char v2[PATH_MAX] = "";
+    for (char* line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        char* controllers = strchr(line, ':');
+        char* path = controllers == NULL ? NULL : strchr(controllers + 1, ':');
+        if (path == NULL) {
+            continue;
+        }
+        controllers++;
+        size_t len = path - controllers;
+        path++;
+        if (len == 0 && strncmp(line, "0:", 2) == 0) {
+            snprintf(v2, sizeof(v2), "%s", path);
+        } else {
+            if (hasController(controllers, len, "cpu")) snprintf(v1_cpu, sizeof(v1_cpu), "%s", path);
+            if (hasController(controllers, len, "cpuacct")) snprintf(v1_cpuacct, sizeof(v1_cpuacct), "%s", path);
+        }
+    }
+
+    char text[256];
+    if (v1_cpuacct[0] != 0 || v1_cpu[0] != 0) {
+        if (!findV1File(_usage_path, v1_cpuacct, "cpuacct.usage") || !findV1File(_stat_path, v1_cpu, "cpu.stat")) {
+            return;
+        }
+        _version = 1;
+
+        char quota_path[PATH_MAX], period_path[PATH_MAX];
+        long long quota, period;
+        if (findV1File(quota_path, v1_cpu, "cpu.cfs_quota_us") && findV1File(period_path, v1_cpu, "cpu.cfs_period_us") &&
+            readText(quota_path, text, sizeof(text)) && (quota = atoll(text)) > 0 &&
+            readText(period_path, text, sizeof(text)) && (period = atoll(text)) > 0) {
+            _limit = (double)quota / period;
+        }
+    } else if (v2[0] != 0) {
+        if (!findFile(_stat_path, CGROUP_ROOT, v2, "cpu.stat")) {
+            return;
+        }
+        _usage_path[0] = 0;
+        _version = 2;
+
+        // "max 100000" when unlimited
+        char max_path[PATH_MAX];
+        long long quota, period;
+        if (findFile(max_path, CGROUP_ROOT, v2, "cpu.max") && readText(max_path, text, sizeof(text)) &&
+            sscanf(text, "%lld %lld", &quota, &period) == 2 && quota > 0 && period > 0) {
+            _limit = (double)quota / period;
+        }
+    }
+}
+
+bool CgroupCpu::read(CgroupCpuStats* stats) {
+    char buf[1024];
+    if (_version == 0 || !readText(_stat_path, buf, sizeof(buf))) {
+        return false;
+    }
+
+    stats->nr_periods = statValue(buf, "nr_periods");
+    stats->nr_throttled = statValue(buf, "nr_throttled");
+    if (_version == 2) {
+        stats->usage_ns = statValue(buf, "usage_usec") * 1000;
+        stats->throttled_ns = statValue(buf, "throttled_usec") * 1000;
+        return true;
+    }
+
+    stats->throttled_ns = statValue(buf, "throttled_time");
+    if (!readText(_usage_path, buf, sizeof(buf))) {
+        return false;
+    }
+    stats->usage_ns = strtoull(buf, NULL, 10);
+    return true;
+}
+
+void CgroupCpu::reset(bool enabled) {
+    locate();
+    _last_report = OS::nanotime();
+    _enabled = enabled && _version != 0;
+    if (enabled && _version == 0) {
+        Log::warn("No cgroup CPU controller found, cgroup is ignored");
+    }
+}
+
+// kd-cg@ts!usage_ns!nr_periods!nr_throttled!throttled_ns!limit_millicpus!
+// Counters are cumulative since the cgroup was created; limit is the CFS quota
+// in thousandths of a CPU, 0 if unlimited. A sample taken in an interval where
+// nr_throttled grew may have been stalled by the quota rather than by its code.
+void CgroupCpu::report() {
+    if (!_enabled) {
+        return;
+    }
+
+    u64 now = OS::nanotime();
+    if (now - _last_report < CGROUP_REPORT_INTERVAL_NS) {
+        return;
+    }
+    _last_report = now;
+
+    CgroupCpuStats stats;
+    if (read(&stats)) {
+        EventLogger::log("kd-cg@%llu!%llu!%llu!%llu!%llu!%llu!", KdClock::now(), stats.usage_ns, stats.nr_periods,
+                         stats.nr_throttled, stats.throttled_ns, (u64)(_limit * 1000 + 0.5));
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CGROUPCPU_H
+#define _CGROUPCPU_H
+
+#include "arch.h"
+
+
+const u64 CGROUP_REPORT_INTERVAL_NS = 1000000000ULL;
+
+// Cumulative CPU accounting of a cgroup since it was created
+struct CgroupCpuStats {
+    u64 usage_ns;
+    u64 nr_periods;
+    u64 nr_throttled;
+    u64 throttled_ns;
+};
+
+// CPU controller of the cgroup the process belongs to, v2 (cpu.stat, cpu.max)
+// or v1 (cpuacct.usage, cpu.stat, cpu.cfs_quota_us). Inside a container the
+// cgroup namespace usually shows it as the root of /sys/fs/cgroup.
+class CgroupCpu {
+  private:
+    static int _version;
+    static char _usage_path[];
+    static char _stat_path[];
+    static double _limit;
+    static bool _enabled;
+    static u64 _last_report;
+
+    static void locate();
+
+  public:
+    // 0 if the process is not in a cgroup with a CPU controller
+    static int version() {
+        return _version;
+    }
+
+    // CPUs allowed by the CFS quota, 0 if unlimited
+    static double limit() {
+        return _limit;
+    }
+
+    static bool read(CgroupCpuStats* stats);
+
+    static void reset(bool enabled);
+    // Sends a kd-cg record at most every CGROUP_REPORT_INTERVAL_NS
+    static void report();
+};
+
+#endif // _CGROUPCPU_H
@@ -34,6 +34,74 @@ void NativeFunc::destroy(char* name) {
     free(from(name));
 }
 
+DecodedName* NativeFunc::_decoded = NULL;
+
+// Insert-only open addressing table, safe for concurrent FrameName instances
+DecodedName* NativeFunc::decodedSlot(const char* name, bool insert) {
+    DecodedName* table = __atomic_load_n(&_decoded, __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        if (!insert) {
+            return NULL;
+        }
+        DecodedName* new_table = (DecodedName*)calloc(DECODED_NAMES_CAPACITY, sizeof(DecodedName));
+        if (new_table == NULL) {
+            return NULL;
+        }
+        if (__sync_bool_compare_and_swap(&_decoded, NULL, new_table)) {
+            table = new_table;
+        } else {
+            free(new_table);
+            table = _decoded;
+        }
+    }
+
+    uintptr_t h = (uintptr_t)name;
+    h = (h ^ (h >> 17)) * 0x9e3779b97f4a7c15ULL;
+    u32 index = (u32)(h >> 32) & (DECODED_NAMES_CAPACITY - 1);
+    for (int i = 0; i < DECODED_NAMES_PROBES; i++) {
+        DecodedName* slot = &table[(index + i) & (DECODED_NAMES_CAPACITY - 1)];
+        const char* key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (key == name) {
+            return slot;
+        }
+        if (key == NULL) {
+            if (!insert) {
+                return NULL;
+            }
+            if (__sync_bool_compare_and_swap(&slot->key, NULL, name) || slot->key == name) {
+                return slot;
+            }
+        }
+    }
+    return NULL;
+}
+
+const char* NativeFunc::decoded(const char* name, bool qualified) {
+    DecodedName* slot = decodedSlot(name, false);
+    if (slot == NULL) {
+        return NULL;
+    }
+    return qualified ? __atomic_load_n(&slot->qualified, __ATOMIC_ACQUIRE) : __atomic_load_n(&slot->plain, __ATOMIC_ACQUIRE);
+}
+
+const char* NativeFunc::setDecoded(const char* name, bool qualified, const char* value) {
+    DecodedName* slot = decodedSlot(name, true);
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    char* copy = strdup(value);
+    if (copy == NULL) {
+        return NULL;
+    }
+    const char* volatile* field = qualified ? &slot->qualified : &slot->plain;
+    if (!__sync_bool_compare_and_swap(field, NULL, copy)) {
+        // Decoded by another thread meanwhile
+        free(copy);
+    }
+    return *field;
+}
+
 
 CodeCache::CodeCache(const char* name, short lib_index, const void* min_address, const void* max_address) {
     _name = NativeFunc::create(name, -1);
@@ -47,11 +115,14 @@ CodeCache::CodeCache(const char* name, short lib_index, const void* min_address,
     _got_patchable = false;
 
     _dwarf_table = NULL;
-    _dwarf_table_length = 0;
 
     _capacity = INITIAL_CODE_CACHE_CAPACITY;
     _count = 0;
     _blobs = new CodeBlob[_capacity];
+
+    _search_keys = NULL;
+    _search_index = NULL;
+    _search_count = 0;
 }
 
 CodeCache::~CodeCache() {
@@ -60,7 +131,9 @@ CodeCache::~CodeCache() {
     }
     NativeFunc::destroy(_name);
     delete[] _blobs;
-    free(_dwarf_table);
+    free(_search_keys);
+    free(_search_index);
+    delete _dwarf_table;
 }
 
 void CodeCache::expand() {
@@ -104,10 +177,47 @@ void CodeCache::updateBounds(const void* start, const void* end) {
 void CodeCache::sort() {
     if (_count == 0) return;
 
-    qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
+    // Tables loaded from the symbol cache are stored sorted already
+    int i = 1;
+    while (i < _count && CodeBlob::comparator(&_blobs[i - 1], &_blobs[i]) <= 0) {
+        i++;
+    }
+    if (i < _count) {
+        qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
+    }
 
     if (_min_address == NO_MIN_ADDRESS) _min_address = _blobs[0]._start;
     if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1]._end;
+
+    buildSearchIndex();
+}
+
+void CodeCache::buildSearchIndex() {
+    free(_search_keys);
+    free(_search_index);
+    _search_keys = NULL;
+    _search_index = NULL;
+    _search_count = 0;
+
+    void* keys;
+    if (posix_memalign(&keys, 64, (_count + 1) * sizeof(const void*)) != 0) {
+        return;
+    }
+    _search_keys = (const void**)keys;
+    _search_index = (int*)malloc((_count + 1) * sizeof(int));
+    _search_count = _count;
+    buildSearchIndex(0, 1);
+}
+
+// In-order walk of the implicit tree: node k has children 2k and 2k+1
+int CodeCache::buildSearchIndex(int i, int k) {
+    if (k <= _search_count) {
+        i = buildSearchIndex(i, 2 * k);
+        _search_keys[k] = _blobs[i]._start;
+        _search_index[k] = i++;
+        i = buildSearchIndex(i, 2 * k + 1);
+    }
+    return i;
 }
 
 void CodeCache::mark(NamePredicate predicate) {
@@ -129,6 +239,34 @@ CodeBlob* CodeCache::find(const void* address) {
 }
 
 const char* CodeCache::binarySearch(const void* address) {
+    int n = _search_count;
+    if (n == 0 || n != _count) {
+        return searchBlobs(address);
+    }
+
+    // Branchless descent for the first start above the address; the prefetch
+    // brings in the cache line with the node's eight descendants three levels down
+    const void** keys = _search_keys;
+    unsigned int k = 1;
+    while (k <= (unsigned int)n) {
+        __builtin_prefetch(keys + k * 8);
+        k = 2 * k + (keys[k] <= address);
+    }
+    k >>= __builtin_ffs(~k);
+
+    int i = (k == 0 ? n : _search_index[k]) - 1;
+    if (i < 0) {
+        return _name;
+    }
+
+    if (address < _blobs[i]._end) {
+        return _blobs[i]._name;
+    }
+    // Zero sized symbols, gaps and nested blobs are left to the full search
+    return searchBlobs(address);
+}
+
+const char* CodeCache::searchBlobs(const void* address) {
     int low = 0;
     int high = _count - 1;
 
@@ -200,26 +338,14 @@ void CodeCache::makeGotPatchable() {
     }
 }
 
+// The table may be published while the library is already in use by the unwinder
 void CodeCache::setDwarfTable(FrameDesc* table, int length) {
-    _dwarf_table = table;
-    _dwarf_table_length = length;
+    FrameTable* frame_table = new FrameTable(table, length);
+    free(table);
+    __atomic_store_n(&_dwarf_table, frame_table, __ATOMIC_RELEASE);
 }
 
 FrameDesc* CodeCache::findFrameDesc(const void* pc) {
-    u32 target_loc = (const char*)pc - _text_base;
-    int low = 0;
-    int high = _dwarf_table_length - 1;
-
-    while (low <= high) {
-        int mid = (unsigned int)(low + high) >> 1;
-        if (_dwarf_table[mid].loc < target_loc) {
-            low = mid + 1;
-        } else if (_dwarf_table[mid].loc > target_loc) {
-            high = mid - 1;
-        } else {
-            return &_dwarf_table[mid];
-        }
-    }
-
-    return low > 0 ? &_dwarf_table[low - 1] : NULL;
+    FrameTable* table = __atomic_load_n(&_dwarf_table, __ATOMIC_ACQUIRE);
+    return table == NULL ? NULL : table->find((const char*)pc - _text_base);
 }
@@ -27,10 +27,23 @@ typedef bool (*NamePredicate)(const char* name);
 
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
 const int MAX_NATIVE_LIBS = 2048;
+const int DECODED_NAMES_CAPACITY = 32768;  // power of 2
+const int DECODED_NAMES_PROBES = 32;
 
 
+// Output form of a native frame name, demangled and possibly prefixed with the library
+struct DecodedName {
+    const char* volatile key;
+    const char* volatile plain;
+    const char* volatile qualified;
+};
+
 class NativeFunc {
   private:
+    static DecodedName* _decoded;
+
+    static DecodedName* decodedSlot(const char* name, bool insert);
+
     short _lib_index;
     char _mark;
     char _reserved;
@@ -55,6 +68,12 @@ class NativeFunc {
     static void mark(const char* name) {
         from(name)->_mark = 1;
     }
+
+    // Symbols are never freed, so their decoded names are kept by pointer for the whole run.
+    // Other native frame names, e.g. of JVM stubs, are static strings and safe keys as well.
+    static const char* decoded(const char* name, bool qualified);
+    // Stores a copy of value; returns the stored name, or NULL if the table is full
+    static const char* setDecoded(const char* name, bool qualified, const char* value);
 };
 
 
@@ -81,6 +100,7 @@ class CodeBlob {
 
 
 class FrameDesc;
+class FrameTable;
 
 class CodeCache {
   protected:
@@ -94,14 +114,22 @@ class CodeCache {
     void** _got_end;
     bool _got_patchable;
 
-    FrameDesc* _dwarf_table;
-    int _dwarf_table_length;
+    FrameTable* _dwarf_table;
 
     int _capacity;
     int _count;
     CodeBlob* _blobs;
 
+    // Blob start addresses in Eytzinger (BFS) order, 1-based, built by sort().
+    // _search_index maps a position back to the blob index.
+    const void** _search_keys;
+    int* _search_index;
+    int _search_count;
+
     void expand();
+    void buildSearchIndex();
+    int buildSearchIndex(int i, int k);
+    const char* searchBlobs(const void* address);
 
   public:
     CodeCache(const char* name,
@@ -139,6 +167,18 @@ class CodeCache {
         return _got_end;
     }
 
+    int count() const {
+        return _count;
+    }
+
+    const CodeBlob* blobs() const {
+        return _blobs;
+    }
+
+    const FrameTable* dwarfTable() const {
+        return __atomic_load_n(&_dwarf_table, __ATOMIC_ACQUIRE);
+    }
+
     void add(const void* start, int length, const char* name, bool update_bounds = false);
     void updateBounds(const void* start, const void* end);
     void sort();
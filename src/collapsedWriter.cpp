@@ -0,0 +1,134 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "collapsedWriter.h"
+
+
+CollapsedWriter::CollapsedWriter(std::ostream& out, FrameName* fn) :
+    _out(out), _fn(fn), _capacity(COLLAPSED_NAMES_CAPACITY), _size(0), _pool(), _pos(0) {
+    _table = (CollapsedName*)calloc(_capacity, sizeof(CollapsedName));
+    _buf = (char*)malloc(COLLAPSED_BUFFER_SIZE);
+}
+
+CollapsedWriter::~CollapsedWriter() {
+    free(_buf);
+    free(_table);
+}
+
+u32 CollapsedWriter::hash(jmethodID method, int kind) {
+    u64 h = ((u64)(uintptr_t)method ^ (u32)kind) * 0x9e3779b97f4a7c15ULL;
+    return (u32)(h >> 32);
+}
+
+// Entries with a NULL method are free, NULL methods themselves are never stored
+void CollapsedWriter::grow() {
+    u32 capacity = _capacity * 2;
+    CollapsedName* table = (CollapsedName*)calloc(capacity, sizeof(CollapsedName));
+    for (u32 i = 0; i < _capacity; i++) {
+        if (_table[i].method != NULL) {
+            u32 slot = hash(_table[i].method, _table[i].kind) & (capacity - 1);
+            while (table[slot].method != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            table[slot] = _table[i];
+        }
+    }
+    free(_table);
+    _table = table;
+    _capacity = capacity;
+}
+
+const CollapsedName* CollapsedWriter::resolve(ASGCT_CallFrame& frame) {
+    static const CollapsedName unknown = {NULL, 0, 0, 0};
+    if (frame.method_id == NULL) {
+        return &unknown;
+    }
+
+    int kind = FrameType::nameKind(frame.bci);
+    u32 mask = _capacity - 1;
+    u32 slot = hash(frame.method_id, kind) & mask;
+    for (; _table[slot].method != NULL; slot = (slot + 1) & mask) {
+        if (_table[slot].method == frame.method_id && _table[slot].kind == kind) {
+            return &_table[slot];
+        }
+    }
+
+    const char* name = _fn->name(frame);
+    CollapsedName* entry = &_table[slot];
+    entry->method = frame.method_id;
+    entry->kind = kind;
+    entry->offset = (u32)_pool.size();
+    entry->length = (u32)strlen(name);
+    _pool.append(name, entry->length);
+
+    if (++_size >= _capacity / 2) {
+        grow();
+        // The entry has moved
+        return resolve(frame);
+    }
+    return entry;
+}
+
+void CollapsedWriter::flush() {
+    _out.write(_buf, _pos);
+    _pos = 0;
+}
+
+void CollapsedWriter::write(const char* data, size_t len) {
+    if (_pos + len > COLLAPSED_BUFFER_SIZE) {
+        flush();
+        if (len > COLLAPSED_BUFFER_SIZE) {
+            _out.write(data, len);
+            return;
+        }
+    }
+    memcpy(_buf + _pos, data, len);
+    _pos += len;
+}
+
+void CollapsedWriter::writeFrames(CallTrace* trace) {
+    for (int j = trace->num_frames - 1; j >= 0; j--) {
+        const CollapsedName* name = resolve(trace->frames[j]);
+        if (name->method == NULL) {
+            write("[unknown]", 9);
+        } else {
+            write(_pool.data() + name->offset, name->length);
+        }
+        write(j == 0 ? " " : ";", 1);
+    }
+}
+
+void CollapsedWriter::writeTrace(CallTrace* trace, u64 counter) {
+    writeFrames(trace);
+    // Beware of locale-sensitive conversion
+    char num[32];
+    write(num, snprintf(num, sizeof(num), "%llu\n", counter));
+}
+
+void CollapsedWriter::writeTrace(CallTrace* trace, u64 before, u64 after) {
+    writeFrames(trace);
+    char num[48];
+    write(num, snprintf(num, sizeof(num), "%llu %llu\n", before, after));
+}
+
+bool CollapsedWriter::finish() {
+    flush();
+    _out.flush();
+    return _out.good();
+}
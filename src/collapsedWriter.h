@@ -0,0 +1,73 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COLLAPSEDWRITER_H
+#define _COLLAPSEDWRITER_H
+
+#include <ostream>
+#include <string>
+#include "arch.h"
+#include "callTraceStorage.h"
+#include "frameName.h"
+
+
+const u32 COLLAPSED_NAMES_CAPACITY = 16384;
+const size_t COLLAPSED_BUFFER_SIZE = 1024 * 1024;
+
+// A frame is named by its method and, for Java frames, by its type only
+struct CollapsedName {
+    jmethodID method;
+    int kind;
+    u32 offset;
+    u32 length;
+};
+
+// Writes stacks in the collapsed format, one line per trace. Every distinct
+// frame is symbolized once into a name pool; a line is then assembled
+// by copying names into a large buffer that reaches the stream in big blocks.
+class CollapsedWriter {
+  private:
+    std::ostream& _out;
+    FrameName* _fn;
+
+    CollapsedName* _table;
+    u32 _capacity;
+    u32 _size;
+    std::string _pool;
+
+    char* _buf;
+    size_t _pos;
+
+    static u32 hash(jmethodID method, int kind);
+    void grow();
+    const CollapsedName* resolve(ASGCT_CallFrame& frame);
+    void writeFrames(CallTrace* trace);
+
+    void flush();
+    void write(const char* data, size_t len);
+
+  public:
+    CollapsedWriter(std::ostream& out, FrameName* fn);
+    ~CollapsedWriter();
+
+    void writeTrace(CallTrace* trace, u64 counter);
+    // Two counts per line, as read by difffolded tools
+    void writeTrace(CallTrace* trace, u64 before, u64 after);
+    // Returns false if the stream failed
+    bool finish();
+};
+
+#endif // _COLLAPSEDWRITER_H
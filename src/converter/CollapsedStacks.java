@@ -41,6 +41,19 @@ public class CollapsedStacks extends FlameGraph {
         sb.setLength(0);
     }
 
+    // Every sample is written out, so frames are named right away, with the suffix of their type
+    @Override
+    public void addSample(long[] frames, int length, long ticks) {
+        for (int i = 0; i < length; i++) {
+            sb.append(getTitle(frames[i])).append(FRAME_SUFFIX[(int) (frames[i] & 7)]).append(';');
+        }
+        if (sb.length() > 0) sb.setCharAt(sb.length() - 1, ' ');
+        sb.append(ticks);
+
+        out.println(sb.toString());
+        sb.setLength(0);
+    }
+
     @Override
     public void dump() {
         if (out != System.out) {
@@ -25,8 +25,12 @@ import java.io.InputStreamReader;
 import java.io.PrintStream;
 import java.io.Reader;
 import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Comparator;
+import java.util.HashMap;
+import java.util.List;
 import java.util.Map;
-import java.util.TreeMap;
 
 public class FlameGraph {
     public static final byte FRAME_INTERPRETED = 0;
@@ -37,11 +41,34 @@ public class FlameGraph {
     public static final byte FRAME_KERNEL = 5;
     public static final byte FRAME_C1_COMPILED = 6;
 
+    static final String[] FRAME_SUFFIX = {"_[0]", "_[j]", "_[i]", "", "", "_[k]", "_[1]"};
+
+    /**
+     * Names the frames passed to addSample(long[], int, long) by their title id.
+     * Only frames that are written out are ever named.
+     */
+    public interface TitleResolver {
+        String getTitle(int titleId);
+    }
+
     private final Arguments args;
     private final Frame root = new Frame(FRAME_NATIVE);
     private int depth;
     private long mintotal;
 
+    // Titles of collapsed stacks: raw title with its suffix -> frame code, title id -> title
+    private final Map<String, Long> frameCodes = new HashMap<>();
+    private final Map<String, Integer> titleIds = new HashMap<>();
+    private final List<String> titles = new ArrayList<>();
+    private long[] codes = new long[64];
+
+    private TitleResolver resolver = new TitleResolver() {
+        @Override
+        public String getTitle(int titleId) {
+            return titles.get(titleId);
+        }
+    };
+
     public FlameGraph(Arguments args) {
         this.args = args;
     }
@@ -67,20 +94,82 @@ public class FlameGraph {
         }
     }
 
+    public void setTitleResolver(TitleResolver resolver) {
+        this.resolver = resolver;
+    }
+
+    // A frame of the given type; the title id is resolved by the TitleResolver
+    public static long frameCode(int titleId, byte type) {
+        return (long) titleId << 3 | type;
+    }
+
     public void addSample(String[] trace, long ticks) {
+        if (codes.length < trace.length) {
+            codes = new long[trace.length * 2];
+        }
+        for (int i = 0; i < trace.length; i++) {
+            codes[i] = frameCode(trace[i]);
+        }
+        addSample(codes, trace.length, ticks);
+    }
+
+    // frames[0, length) are frame codes from the root to the leaf
+    public void addSample(long[] frames, int length, long ticks) {
         Frame frame = root;
         if (args.reverse) {
-            for (int i = trace.length; --i >= args.skip; ) {
-                frame = frame.addChild(trace[i], ticks);
+            for (int i = length; --i >= args.skip; ) {
+                frame = frame.addChild(frames[i], ticks);
             }
         } else {
-            for (int i = args.skip; i < trace.length; i++) {
-                frame = frame.addChild(trace[i], ticks);
+            for (int i = args.skip; i < length; i++) {
+                frame = frame.addChild(frames[i], ticks);
             }
         }
         frame.addLeaf(ticks);
 
-        depth = Math.max(depth, trace.length);
+        depth = Math.max(depth, length);
+    }
+
+    protected String getTitle(long frameCode) {
+        return resolver.getTitle((int) (frameCode >>> 3));
+    }
+
+    // The type of a collapsed stack frame comes from its suffix or, without one, from the name
+    private long frameCode(String title) {
+        Long code = frameCodes.get(title);
+        if (code != null) {
+            return code;
+        }
+
+        byte type = -1;
+        for (byte t = 0; t < FRAME_SUFFIX.length; t++) {
+            if (!FRAME_SUFFIX[t].isEmpty() && title.endsWith(FRAME_SUFFIX[t])) {
+                type = t;
+                break;
+            }
+        }
+
+        String name = title;
+        if (type >= 0) {
+            name = stripSuffix(title);
+        } else if (title.contains("::") || title.startsWith("-[") || title.startsWith("+[")) {
+            type = FRAME_CPP;
+        } else if (title.indexOf('/') > 0 && title.charAt(0) != '['
+                || title.indexOf('.') > 0 && Character.isUpperCase(title.charAt(0))) {
+            type = FRAME_JIT_COMPILED;
+        } else {
+            type = FRAME_NATIVE;
+        }
+
+        Integer titleId = titleIds.get(name);
+        if (titleId == null) {
+            titleIds.put(name, titleId = titles.size());
+            titles.add(name);
+        }
+
+        long result = frameCode(titleId, type);
+        frameCodes.put(title, result);
+        return result;
     }
 
     public void dump() throws IOException {
@@ -130,9 +219,6 @@ public class FlameGraph {
 
     private void printFrame(PrintStream out, String title, Frame frame, int level, long x) {
         int type = frame.getType();
-        if (type == FRAME_KERNEL) {
-            title = stripSuffix(title);
-        }
 
         if ((frame.inlined | frame.c1 | frame.interpreted) != 0 && frame.inlined < frame.total && frame.interpreted < frame.total) {
             out.println("f(" + level + "," + x + "," + frame.total + "," + type + ",'" + escape(title) + "'," +
@@ -142,15 +228,26 @@ public class FlameGraph {
         }
 
         x += frame.self;
-        for (Map.Entry<String, Frame> e : frame.entrySet()) {
-            Frame child = e.getValue();
+        for (Frame child : sortedChildren(frame)) {
             if (child.total >= mintotal) {
-                printFrame(out, e.getKey(), child, level + 1, x);
+                printFrame(out, getTitle(child.key), child, level + 1, x);
             }
             x += child.total;
         }
     }
 
+    // Siblings are laid out in the order of their titles
+    private Frame[] sortedChildren(Frame frame) {
+        Frame[] children = frame.children();
+        Arrays.sort(children, new Comparator<Frame>() {
+            @Override
+            public int compare(Frame f1, Frame f2) {
+                return getTitle(f1.key).compareTo(getTitle(f2.key));
+            }
+        });
+        return children;
+    }
+
     static String stripSuffix(String title) {
         return title.substring(0, title.length() - 4);
     }
@@ -197,14 +294,20 @@ public class FlameGraph {
         fg.dump();
     }
 
-    static class Frame extends TreeMap<String, Frame> {
-        final byte type;
+    // Children are kept in an open addressing table by their key: title id << 3 | type,
+    // where the type is FRAME_JIT_COMPILED for all kinds of Java frames
+    static class Frame {
+        private static final Frame[] NO_CHILDREN = new Frame[0];
+
+        final long key;
         long total;
         long self;
         long inlined, c1, interpreted;
+        private Frame[] children = NO_CHILDREN;
+        private int size;
 
-        Frame(byte type) {
-            this.type = type;
+        Frame(long key) {
+            this.key = key;
         }
 
         byte getType() {
@@ -215,39 +318,45 @@ public class FlameGraph {
             } else if (interpreted * 2 >= total) {
                 return FRAME_INTERPRETED;
             } else {
-                return type;
+                return (byte) (key & 7);
             }
         }
 
-        private Frame getChild(String title, byte type) {
-            Frame child = super.get(title);
-            if (child == null) {
-                super.put(title, child = new Frame(type));
+        private Frame getChild(long key) {
+            if (children.length == 0) {
+                children = new Frame[2];
+            }
+
+            int mask = children.length - 1;
+            int i = hashCode(key) & mask;
+            for (Frame child; (child = children[i]) != null; i = (i + 1) & mask) {
+                if (child.key == key) {
+                    return child;
+                }
+            }
+
+            Frame child = children[i] = new Frame(key);
+            if (++size * 2 > children.length) {
+                resize(children.length * 2);
             }
             return child;
         }
 
-        Frame addChild(String title, long ticks) {
+        Frame addChild(long frameCode, long ticks) {
             total += ticks;
 
-            Frame child;
-            if (title.endsWith("_[j]")) {
-                child = getChild(stripSuffix(title), FRAME_JIT_COMPILED);
-            } else if (title.endsWith("_[i]")) {
-                (child = getChild(stripSuffix(title), FRAME_JIT_COMPILED)).inlined += ticks;
-            } else if (title.endsWith("_[k]")) {
-                child = getChild(title, FRAME_KERNEL);
-            } else if (title.endsWith("_[1]")) {
-                (child = getChild(stripSuffix(title), FRAME_JIT_COMPILED)).c1 += ticks;
-            } else if (title.endsWith("_[0]")) {
-                (child = getChild(stripSuffix(title), FRAME_JIT_COMPILED)).interpreted += ticks;
-            } else if (title.contains("::") || title.startsWith("-[") || title.startsWith("+[")) {
-                child = getChild(title, FRAME_CPP);
-            } else if (title.indexOf('/') > 0 && title.charAt(0) != '['
-                    || title.indexOf('.') > 0 && Character.isUpperCase(title.charAt(0))) {
-                child = getChild(title, FRAME_JIT_COMPILED);
-            } else {
-                child = getChild(title, FRAME_NATIVE);
+            byte type = (byte) (frameCode & 7);
+            if (type >= FRAME_NATIVE && type <= FRAME_KERNEL) {
+                return getChild(frameCode);
+            }
+
+            Frame child = getChild(frameCode - type + FRAME_JIT_COMPILED);
+            if (type == FRAME_INLINED) {
+                child.inlined += ticks;
+            } else if (type == FRAME_C1_COMPILED) {
+                child.c1 += ticks;
+            } else if (type == FRAME_INTERPRETED) {
+                child.interpreted += ticks;
             }
             return child;
         }
@@ -257,16 +366,45 @@ public class FlameGraph {
             self += ticks;
         }
 
+        Frame[] children() {
+            Frame[] result = new Frame[size];
+            int count = 0;
+            for (Frame child : children) {
+                if (child != null) {
+                    result[count++] = child;
+                }
+            }
+            return result;
+        }
+
         int depth(long cutoff) {
             int depth = 0;
-            if (size() > 0) {
-                for (Frame child : values()) {
-                    if (child.total >= cutoff) {
-                        depth = Math.max(depth, child.depth(cutoff));
-                    }
+            for (Frame child : children) {
+                if (child != null && child.total >= cutoff) {
+                    depth = Math.max(depth, child.depth(cutoff));
                 }
             }
             return depth + 1;
         }
+
+        private void resize(int newCapacity) {
+            Frame[] newChildren = new Frame[newCapacity];
+            int mask = newCapacity - 1;
+            for (Frame child : children) {
+                if (child != null) {
+                    int i = hashCode(child.key) & mask;
+                    while (newChildren[i] != null) {
+                        i = (i + 1) & mask;
+                    }
+                    newChildren[i] = child;
+                }
+            }
+            children = newChildren;
+        }
+
+        private static int hashCode(long key) {
+            int h = (int) (key ^ key >>> 32) * 0x9e3779b9;
+            return h ^ h >>> 16;
+        }
     }
 }
@@ -27,41 +27,55 @@ import one.jfr.event.ExecutionSample;
 
 import java.io.IOException;
 import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+import java.util.List;
 import java.util.Map;
 
 /**
  * Converts .jfr output produced by async-profiler to HTML Flame Graph.
+ * Stacks are passed to FlameGraph as frame codes; a frame is named only when it is rendered.
  */
-public class jfr2flame {
+public class jfr2flame implements FlameGraph.TitleResolver {
 
-    private static final String[] FRAME_SUFFIX = {"_[0]", "_[j]", "_[i]", "", "", "_[k]", "_[1]"};
+    // Kinds of frame titles, see titleKey
+    private static final int TITLE_METHOD = 0;
+    private static final int TITLE_LINE = 1;
+    private static final int TITLE_BCI = 2;
+    private static final int TITLE_THREAD = 3;
+    private static final int TITLE_CLASS = 4;
 
     private final JfrReader jfr;
     private final Arguments args;
     private final Dictionary<String> methodNames = new Dictionary<>();
 
+    // Title id by titleKey; a title is a String once resolved, a PendingTitle before
+    private final Dictionary<Integer> titleIds = new Dictionary<>();
+    private final List<Object> titles = new ArrayList<>();
+    private long[] frames = new long[256];
+
     public jfr2flame(JfrReader jfr, Arguments args) {
         this.jfr = jfr;
         this.args = args;
     }
 
     public void convert(final FlameGraph fg) throws IOException {
+        fg.setTitleResolver(this);
         EventAggregator agg = new EventAggregator(args.threads, args.total);
 
         Class<? extends Event> eventClass = args.alloc ? AllocationSample.class :
                 args.lock ? ContendedLock.class : ExecutionSample.class;
-        int threadState = args.cpu ? getMapKey(jfr.threadStates, "STATE_RUNNABLE") : -1;
+        final int threadState = args.cpu ? getMapKey(jfr.threadStates, "STATE_RUNNABLE") : -1;
 
-        long startTicks = args.from != 0 ? toTicks(args.from) : Long.MIN_VALUE;
-        long endTicks = args.to != 0 ? toTicks(args.to) : Long.MAX_VALUE;
+        final long startTicks = args.from != 0 ? toTicks(args.from) : Long.MIN_VALUE;
+        final long endTicks = args.to != 0 ? toTicks(args.to) : Long.MAX_VALUE;
 
-        for (Event event; (event = jfr.readEvent(eventClass)) != null; ) {
-            if (event.time >= startTicks && event.time <= endTicks) {
-                if (threadState < 0 || ((ExecutionSample) event).threadState == threadState) {
-                    agg.collect(event);
-                }
+        jfr.aggregateEvents(eventClass, new EventAggregator.Filter() {
+            @Override
+            public boolean accept(Event event) {
+                return event.time >= startTicks && event.time <= endTicks &&
+                        (threadState < 0 || ((ExecutionSample) event).threadState == threadState);
             }
-        }
+        }, agg);
 
         final double ticksToNanos = 1e9 / jfr.ticksPerSec;
         final boolean scale = args.total && eventClass == ContendedLock.class && ticksToNanos != 1.0;
@@ -76,49 +90,103 @@ public class jfr2flame {
                     long[] methods = stackTrace.methods;
                     byte[] types = stackTrace.types;
                     int[] locations = stackTrace.locations;
-                    String classFrame = getClassFrame(event);
-                    String[] trace = new String[methods.length + (args.threads ? 1 : 0) + (classFrame != null ? 1 : 0)];
+                    long classFrame = getClassFrame(event);
+                    int length = methods.length + (args.threads ? 1 : 0) + (classFrame >= 0 ? 1 : 0);
+                    if (frames.length < length) {
+                        frames = new long[length * 2];
+                    }
                     if (args.threads) {
-                        trace[0] = getThreadFrame(event.tid);
+                        frames[0] = FlameGraph.frameCode(titleId(titleKey(TITLE_THREAD, event.tid, 0), (byte) 0),
+                                FlameGraph.FRAME_NATIVE);
                     }
-                    int idx = trace.length;
-                    if (classFrame != null) {
-                        trace[--idx] = classFrame;
+                    int idx = length;
+                    if (classFrame >= 0) {
+                        frames[--idx] = classFrame;
                     }
                     for (int i = 0; i < methods.length; i++) {
-                        String methodName = getMethodName(methods[i], types[i]);
-                        int location;
+                        int kind = TITLE_METHOD;
+                        int location = 0;
                         if (args.lines && (location = locations[i] >>> 16) != 0) {
-                            methodName += ":" + location;
+                            kind = TITLE_LINE;
                         } else if (args.bci && (location = locations[i] & 0xffff) != 0) {
-                            methodName += "@" + location;
+                            kind = TITLE_BCI;
+                        } else {
+                            location = 0;
                         }
-                        trace[--idx] = methodName + FRAME_SUFFIX[types[i]];
+                        int titleId = titleId(titleKey(kind, methods[i], location), types[i]);
+                        frames[--idx] = FlameGraph.frameCode(titleId, types[i]);
                     }
-                    fg.addSample(trace, scale ? (long) (value * ticksToNanos) : value);
+                    fg.addSample(frames, length, scale ? (long) (value * ticksToNanos) : value);
                 }
             }
         });
     }
 
+    @Override
+    public String getTitle(int titleId) {
+        Object title = titles.get(titleId);
+        if (title instanceof PendingTitle) {
+            titles.set(titleId, title = resolveTitle((PendingTitle) title));
+        }
+        return (String) title;
+    }
+
+    // Kind, id and location in one non-zero Dictionary key; ids go up to 2^44, locations to 2^16
+    private static long titleKey(int kind, long id, int location) {
+        return ((id << 16 | location) << 3 | kind) + 1;
+    }
+
+    private int titleId(long key, byte type) {
+        Integer titleId = titleIds.get(key);
+        if (titleId == null) {
+            titleIds.put(key, titleId = titles.size());
+            titles.add(new PendingTitle(key, type));
+        }
+        return titleId;
+    }
+
+    private String resolveTitle(PendingTitle title) {
+        long key = title.key - 1;
+        int kind = (int) (key & 7);
+        int location = (int) (key >>> 3) & 0xffff;
+        long id = key >>> 19;
+
+        switch (kind) {
+            case TITLE_LINE:
+                return getMethodName(id, title.type) + ":" + location;
+            case TITLE_BCI:
+                return getMethodName(id, title.type) + "@" + location;
+            case TITLE_THREAD:
+                return getThreadFrame((int) id);
+            case TITLE_CLASS:
+                return getClassName(id);
+            default:
+                return getMethodName(id, title.type);
+        }
+    }
+
     private String getThreadFrame(int tid) {
         String threadName = jfr.threads.get(tid);
         return threadName == null ? "[tid=" + tid + ']' : '[' + threadName + " tid=" + tid + ']';
     }
 
-    private String getClassFrame(Event event) {
+    // Frame code of the allocated or locked class on top of the stack, -1 for other events
+    private long getClassFrame(Event event) {
         long classId;
-        String suffix;
+        byte type;
         if (event instanceof AllocationSample) {
             classId = ((AllocationSample) event).classId;
-            suffix = ((AllocationSample) event).tlabSize == 0 ? "_[k]" : "_[i]";
+            type = ((AllocationSample) event).tlabSize == 0 ? FlameGraph.FRAME_KERNEL : FlameGraph.FRAME_INLINED;
         } else if (event instanceof ContendedLock) {
             classId = ((ContendedLock) event).classId;
-            suffix = "_[i]";
+            type = FlameGraph.FRAME_INLINED;
         } else {
-            return null;
+            return -1;
         }
+        return FlameGraph.frameCode(titleId(titleKey(TITLE_CLASS, classId, 0), type), type);
+    }
 
+    private String getClassName(long classId) {
         ClassRef cls = jfr.classes.get(classId);
         if (cls == null) {
             return "null";
@@ -134,7 +202,7 @@ public class jfr2flame {
         while (arrayDepth-- > 0) {
             sb.append("[]");
         }
-        return sb.append(suffix).toString();
+        return sb.toString();
     }
 
     private String getMethodName(long methodId, byte methodType) {
@@ -224,6 +292,16 @@ public class jfr2flame {
         return -1;
     }
 
+    private static final class PendingTitle {
+        final long key;
+        final byte type;
+
+        PendingTitle(long key, byte type) {
+            this.key = key;
+            this.type = type;
+        }
+    }
+
     public static void main(String[] cmdline) throws Exception {
         Arguments args = new Arguments(cmdline);
         if (args.input == null) {
@@ -59,6 +59,16 @@ public class Dictionary<T> {
         }
     }
 
+    @SuppressWarnings("unchecked")
+    public void putAll(Dictionary<T> other) {
+        preallocate(size + other.size);
+        for (int i = 0; i < other.keys.length; i++) {
+            if (other.keys[i] != 0) {
+                put(other.keys[i], (T) other.values[i]);
+            }
+        }
+    }
+
     @SuppressWarnings("unchecked")
     public T get(long key) {
         int mask = keys.length - 1;
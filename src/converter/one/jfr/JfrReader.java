@@ -16,16 +16,14 @@
 
 package one.jfr;
 
-import one.jfr.event.AllocationSample;
-import one.jfr.event.ContendedLock;
 import one.jfr.event.Event;
-import one.jfr.event.ExecutionSample;
+import one.jfr.event.EventAggregator;
 
 import java.io.Closeable;
 import java.io.IOException;
+import java.io.InterruptedIOException;
 import java.nio.ByteBuffer;
 import java.nio.channels.FileChannel;
-import java.nio.charset.StandardCharsets;
 import java.nio.file.Paths;
 import java.nio.file.StandardOpenOption;
 import java.util.ArrayList;
@@ -33,18 +31,25 @@ import java.util.Collections;
 import java.util.HashMap;
 import java.util.List;
 import java.util.Map;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
 
 /**
  * Parses JFR output produced by async-profiler.
+ * The file is mapped into memory chunk by chunk. readEvent goes through the chunks
+ * one after another; readAllEvents and aggregateEvents parse the remaining chunks
+ * in parallel, each with its own constant pools, and merge the results in file order.
  */
 public class JfrReader implements Closeable {
-    private static final int BUFFER_SIZE = 2 * 1024 * 1024;
-    private static final int CHUNK_HEADER_SIZE = 68;
-    private static final int CHUNK_SIGNATURE = 0x464c5200;
+    private static final int PARALLELISM = Runtime.getRuntime().availableProcessors();
 
     private final FileChannel ch;
-    private ByteBuffer buf;
-    private long filePosition;
+    private final List<JfrChunk> chunks = new ArrayList<>();
+    private int nextChunk;
+    private JfrChunk current;
 
     public boolean incomplete;
     public long startNanos = Long.MAX_VALUE;
@@ -63,25 +68,16 @@ public class JfrReader implements Closeable {
     public final Map<Integer, String> threadStates = new HashMap<>();
     public final Map<String, String> settings = new HashMap<>();
 
-    private int executionSample;
-    private int nativeMethodSample;
-    private int allocationInNewTLAB;
-    private int allocationOutsideTLAB;
-    private int allocationSample;
-    private int monitorEnter;
-    private int threadPark;
-    private int activeSetting;
-    private boolean activeSettingHasStack;
-
     public JfrReader(String fileName) throws IOException {
         this.ch = FileChannel.open(Paths.get(fileName), StandardOpenOption.READ);
-        this.buf = ByteBuffer.allocateDirect(BUFFER_SIZE);
 
-        buf.flip();
-        ensureBytes(CHUNK_HEADER_SIZE);
-        if (!readChunk(0)) {
+        indexChunks();
+        if (chunks.isEmpty()) {
             throw new IOException("Incomplete JFR file");
         }
+
+        // Constant pools of the first chunk are available before any event is read
+        current = openChunk();
     }
 
     @Override
@@ -101,435 +97,200 @@ public class JfrReader implements Closeable {
         return readAllEvents(null);
     }
 
-    public <E extends Event> List<E> readAllEvents(Class<E> cls) throws IOException {
-        ArrayList<E> events = new ArrayList<>();
-        for (E event; (event = readEvent(cls)) != null; ) {
-            events.add(event);
-        }
+    public <E extends Event> List<E> readAllEvents(final Class<E> cls) throws IOException {
+        final ArrayList<E> events = new ArrayList<>();
+        readChunks(new ChunkReader<List<E>>() {
+            @Override
+            public List<E> read(JfrChunk chunk) {
+                ArrayList<E> chunkEvents = new ArrayList<>();
+                for (E event; (event = chunk.readEvent(cls)) != null; ) {
+                    chunkEvents.add(event);
+                }
+                return chunkEvents;
+            }
+
+            @Override
+            public void merge(List<E> chunkEvents) {
+                events.addAll(chunkEvents);
+            }
+        });
         Collections.sort(events);
         return events;
     }
 
-    public Event readEvent() throws IOException {
-        return readEvent(null);
-    }
-
-    @SuppressWarnings("unchecked")
-    public <E extends Event> E readEvent(Class<E> cls) throws IOException {
-        while (ensureBytes(CHUNK_HEADER_SIZE)) {
-            int pos = buf.position();
-            int size = getVarint();
-            int type = getVarint();
-
-            if (type == 'L' && buf.getInt(pos) == CHUNK_SIGNATURE) {
-                if (readChunk(pos)) {
-                    continue;
+    /**
+     * Collects the remaining events of class cls that pass the filter (null for all) into agg.
+     * Every chunk is aggregated on its own and the results are merged into agg.
+     */
+    public void aggregateEvents(final Class<? extends Event> cls, final EventAggregator.Filter filter,
+                                final EventAggregator agg) throws IOException {
+        readChunks(new ChunkReader<EventAggregator>() {
+            @Override
+            public EventAggregator read(JfrChunk chunk) {
+                EventAggregator chunkAgg = agg.newAggregator();
+                for (Event event; (event = chunk.readEvent(cls)) != null; ) {
+                    if (filter == null || filter.accept(event)) {
+                        chunkAgg.collect(event);
+                    }
                 }
-                break;
+                return chunkAgg;
             }
 
-            if (type == executionSample || type == nativeMethodSample) {
-                if (cls == null || cls == ExecutionSample.class) return (E) readExecutionSample();
-            } else if (type == allocationInNewTLAB) {
-                if (cls == null || cls == AllocationSample.class) return (E) readAllocationSample(true);
-            } else if (type == allocationOutsideTLAB || type == allocationSample) {
-                if (cls == null || cls == AllocationSample.class) return (E) readAllocationSample(false);
-            } else if (type == monitorEnter) {
-                if (cls == null || cls == ContendedLock.class) return (E) readContendedLock(false);
-            } else if (type == threadPark) {
-                if (cls == null || cls == ContendedLock.class) return (E) readContendedLock(true);
-            } else if (type == activeSetting) {
-                readActiveSetting();
+            @Override
+            public void merge(EventAggregator chunkAgg) {
+                agg.merge(chunkAgg);
             }
-
-            if ((pos += size) <= buf.limit()) {
-                buf.position(pos);
-            } else {
-                seek(filePosition + pos);
-            }
-        }
-        return null;
-    }
-
-    private ExecutionSample readExecutionSample() {
-        long time = getVarlong();
-        int tid = getVarint();
-        int stackTraceId = getVarint();
-        int threadState = getVarint();
-        return new ExecutionSample(time, tid, stackTraceId, threadState);
-    }
-
-    private AllocationSample readAllocationSample(boolean tlab) {
-        long time = getVarlong();
-        int tid = getVarint();
-        int stackTraceId = getVarint();
-        int classId = getVarint();
-        long allocationSize = getVarlong();
-        long tlabSize = tlab ? getVarlong() : 0;
-        return new AllocationSample(time, tid, stackTraceId, classId, allocationSize, tlabSize);
-    }
-
-    private ContendedLock readContendedLock(boolean hasTimeout) {
-        long time = getVarlong();
-        long duration = getVarlong();
-        int tid = getVarint();
-        int stackTraceId = getVarint();
-        int classId = getVarint();
-        if (hasTimeout) getVarlong();
-        long until = getVarlong();
-        long address = getVarlong();
-        return new ContendedLock(time, tid, stackTraceId, duration, classId);
-    }
-
-    private void readActiveSetting() {
-        long time = getVarlong();
-        long duration = getVarlong();
-        int tid = getVarint();
-        if (activeSettingHasStack) getVarint();
-        long id = getVarlong();
-        String name = getString();
-        String value = getString();
-        settings.put(name, value);
+        });
     }
 
-    private boolean readChunk(int pos) throws IOException {
-        if (pos + CHUNK_HEADER_SIZE > buf.limit() || buf.getInt(pos) != CHUNK_SIGNATURE) {
-            throw new IOException("Not a valid JFR file");
-        }
-
-        int version = buf.getInt(pos + 4);
-        if (version < 0x20000 || version > 0x2ffff) {
-            throw new IOException("Unsupported JFR version: " + (version >>> 16) + "." + (version & 0xffff));
-        }
-
-        long cpOffset = buf.getLong(pos + 16);
-        long metaOffset = buf.getLong(pos + 24);
-        if (cpOffset == 0 || metaOffset == 0) {
-            incomplete = true;
-            return false;
-        }
-
-        startNanos = Math.min(startNanos, buf.getLong(pos + 32));
-        endNanos = Math.max(endNanos, buf.getLong(pos + 32) + buf.getLong(pos + 40));
-        startTicks = Math.min(startTicks, buf.getLong(pos + 48));
-        ticksPerSec = buf.getLong(pos + 56);
-
-        types.clear();
-        typesByName.clear();
-
-        long chunkStart = filePosition + pos;
-        readMeta(chunkStart + metaOffset);
-        readConstantPool(chunkStart + cpOffset);
-        cacheEventTypes();
-
-        seek(chunkStart + CHUNK_HEADER_SIZE);
-        return true;
+    public Event readEvent() throws IOException {
+        return readEvent(null);
     }
 
-    private void readMeta(long metaOffset) throws IOException {
-        seek(metaOffset);
-        ensureBytes(5);
-
-        ensureBytes(getVarint() - buf.position());
-        getVarint();
-        getVarlong();
-        getVarlong();
-        getVarlong();
-
-        String[] strings = new String[getVarint()];
-        for (int i = 0; i < strings.length; i++) {
-            strings[i] = getString();
+    public <E extends Event> E readEvent(Class<E> cls) throws IOException {
+        while (current != null || nextChunk < chunks.size()) {
+            if (current == null) {
+                current = openChunk();
+            }
+            E event = current.readEvent(cls);
+            if (event != null) {
+                return event;
+            }
+            mergeSettings(current);
+            current.release();
+            current = null;
         }
-        readElement(strings);
+        return null;
     }
 
-    private Element readElement(String[] strings) {
-        String name = strings[getVarint()];
-
-        int attributeCount = getVarint();
-        Map<String, String> attributes = new HashMap<>(attributeCount);
-        for (int i = 0; i < attributeCount; i++) {
-            attributes.put(strings[getVarint()], strings[getVarint()]);
-        }
-
-        Element e = createElement(name, attributes);
-        int childCount = getVarint();
-        for (int i = 0; i < childCount; i++) {
-            e.addChild(readElement(strings));
-        }
-        return e;
-    }
+    private void indexChunks() throws IOException {
+        long fileSize = ch.size();
+        ByteBuffer header = ByteBuffer.allocate(JfrChunk.CHUNK_HEADER_SIZE);
 
-    private Element createElement(String name, Map<String, String> attributes) {
-        switch (name) {
-            case "class": {
-                JfrClass type = new JfrClass(attributes);
-                if (!attributes.containsKey("superType")) {
-                    types.put(type.id, type);
-                }
-                typesByName.put(type.name, type);
-                return type;
+        for (long pos = 0; pos < fileSize; ) {
+            header.clear();
+            while (header.hasRemaining() && ch.read(header, pos + header.position()) > 0) {
+                // keep reading
+            }
+            if (header.hasRemaining() || header.getInt(0) != JfrChunk.CHUNK_SIGNATURE) {
+                throw new IOException("Not a valid JFR file");
             }
-            case "field":
-                return new JfrField(attributes);
-            default:
-                return new Element();
-        }
-    }
 
-    private void readConstantPool(long cpOffset) throws IOException {
-        long delta;
-        do {
-            seek(cpOffset);
-            ensureBytes(5);
-
-            ensureBytes(getVarint() - buf.position());
-            getVarint();
-            getVarlong();
-            getVarlong();
-            delta = getVarlong();
-            getVarint();
-
-            int poolCount = getVarint();
-            for (int i = 0; i < poolCount; i++) {
-                int type = getVarint();
-                readConstants(types.get(type));
+            int version = header.getInt(4);
+            if (version < 0x20000 || version > 0x2ffff) {
+                throw new IOException("Unsupported JFR version: " + (version >>> 16) + "." + (version & 0xffff));
             }
-        } while (delta != 0 && (cpOffset += delta) > 0);
-    }
 
-    private void readConstants(JfrClass type) {
-        switch (type.name) {
-            case "jdk.types.ChunkHeader":
-                buf.position(buf.position() + (CHUNK_HEADER_SIZE + 3));
-                break;
-            case "java.lang.Thread":
-                readThreads(type.field("group") != null);
-                break;
-            case "java.lang.Class":
-                readClasses(type.field("hidden") != null);
-                break;
-            case "jdk.types.Symbol":
-                readSymbols();
+            // A chunk that is still being written has no constant pool or metadata yet
+            long size = header.getLong(8);
+            long cpOffset = header.getLong(16);
+            long metaOffset = header.getLong(24);
+            if (cpOffset == 0 || metaOffset == 0 || size < JfrChunk.CHUNK_HEADER_SIZE || size > fileSize - pos) {
+                incomplete = true;
                 break;
-            case "jdk.types.Method":
-                readMethods();
-                break;
-            case "jdk.types.StackTrace":
-                readStackTraces();
-                break;
-            case "jdk.types.FrameType":
-                readMap(frameTypes);
-                break;
-            case "jdk.types.ThreadState":
-                readMap(threadStates);
-                break;
-            default:
-                readOtherConstants(type.fields);
-        }
-    }
-
-    private void readThreads(boolean hasGroup) {
-        int count = threads.preallocate(getVarint());
-        for (int i = 0; i < count; i++) {
-            long id = getVarlong();
-            String osName = getString();
-            int osThreadId = getVarint();
-            String javaName = getString();
-            long javaThreadId = getVarlong();
-            if (hasGroup) getVarlong();
-            threads.put(id, javaName != null ? javaName : osName);
-        }
-    }
-
-    private void readClasses(boolean hasHidden) {
-        int count = classes.preallocate(getVarint());
-        for (int i = 0; i < count; i++) {
-            long id = getVarlong();
-            long loader = getVarlong();
-            long name = getVarlong();
-            long pkg = getVarlong();
-            int modifiers = getVarint();
-            if (hasHidden) getVarint();
-            classes.put(id, new ClassRef(name));
-        }
-    }
+            }
+            if (size > Integer.MAX_VALUE) {
+                throw new IOException("JFR chunk is too large: " + size);
+            }
 
-    private void readMethods() {
-        int count = methods.preallocate(getVarint());
-        for (int i = 0; i < count; i++) {
-            long id = getVarlong();
-            long cls = getVarlong();
-            long name = getVarlong();
-            long sig = getVarlong();
-            int modifiers = getVarint();
-            int hidden = getVarint();
-            methods.put(id, new MethodRef(cls, name, sig));
-        }
-    }
+            startNanos = Math.min(startNanos, header.getLong(32));
+            endNanos = Math.max(endNanos, header.getLong(32) + header.getLong(40));
+            startTicks = Math.min(startTicks, header.getLong(48));
+            ticksPerSec = header.getLong(56);
 
-    private void readStackTraces() {
-        int count = stackTraces.preallocate(getVarint());
-        for (int i = 0; i < count; i++) {
-            long id = getVarlong();
-            int truncated = getVarint();
-            StackTrace stackTrace = readStackTrace();
-            stackTraces.put(id, stackTrace);
+            chunks.add(new JfrChunk(ch.map(FileChannel.MapMode.READ_ONLY, pos, size)));
+            pos += size;
         }
     }
 
-    private StackTrace readStackTrace() {
-        int depth = getVarint();
-        long[] methods = new long[depth];
-        byte[] types = new byte[depth];
-        int[] locations = new int[depth];
-        for (int i = 0; i < depth; i++) {
-            methods[i] = getVarlong();
-            int line = getVarint();
-            int bci = getVarint();
-            locations[i] = line << 16 | (bci & 0xffff);
-            types[i] = buf.get();
-        }
-        return new StackTrace(methods, types, locations);
+    // Hands the next chunk over to the caller, so that it is not kept after being read
+    private JfrChunk openChunk() {
+        JfrChunk chunk = chunks.set(nextChunk++, null);
+        chunk.readConstants();
+        mergeConstants(chunk);
+        return chunk;
     }
 
-    private void readSymbols() {
-        int count = symbols.preallocate(getVarint());
-        for (int i = 0; i < count; i++) {
-            long id = getVarlong();
-            if (buf.get() != 3) {
-                throw new IllegalArgumentException("Invalid symbol encoding");
-            }
-            symbols.put(id, getBytes());
-        }
+    private void mergeConstants(JfrChunk chunk) {
+        types.putAll(chunk.types);
+        typesByName.putAll(chunk.typesByName);
+        threads.putAll(chunk.threads);
+        classes.putAll(chunk.classes);
+        symbols.putAll(chunk.symbols);
+        methods.putAll(chunk.methods);
+        stackTraces.putAll(chunk.stackTraces);
+        frameTypes.putAll(chunk.frameTypes);
+        threadStates.putAll(chunk.threadStates);
     }
 
-    private void readMap(Map<Integer, String> map) {
-        int count = getVarint();
-        for (int i = 0; i < count; i++) {
-            map.put(getVarint(), getString());
-        }
+    private void mergeSettings(JfrChunk chunk) {
+        settings.putAll(chunk.settings);
     }
 
-    private void readOtherConstants(List<JfrField> fields) {
-        int stringType = getTypeId("java.lang.String");
-
-        boolean[] numeric = new boolean[fields.size()];
-        for (int i = 0; i < numeric.length; i++) {
-            JfrField f = fields.get(i);
-            numeric[i] = f.constantPool || f.type != stringType;
+    // Parses the chunk being read by readEvent, if any, and all after it,
+    // on up to PARALLELISM threads. Results and constants are merged in file order,
+    // so a later chunk overrides an earlier one exactly as with readEvent.
+    private <R> void readChunks(final ChunkReader<R> reader) throws IOException {
+        List<JfrChunk> remaining = new ArrayList<>();
+        if (current != null) {
+            remaining.add(current);
+            current = null;
         }
-
-        int count = getVarint();
-        for (int i = 0; i < count; i++) {
-            getVarlong();
-            readFields(numeric);
+        while (nextChunk < chunks.size()) {
+            remaining.add(chunks.set(nextChunk++, null));
         }
-    }
-
-    private void readFields(boolean[] numeric) {
-        for (boolean n : numeric) {
-            if (n) {
-                getVarlong();
-            } else {
-                getString();
-            }
+        if (remaining.isEmpty()) {
+            return;
         }
-    }
-
-    private void cacheEventTypes() {
-        executionSample = getTypeId("jdk.ExecutionSample");
-        nativeMethodSample = getTypeId("jdk.NativeMethodSample");
-        allocationInNewTLAB = getTypeId("jdk.ObjectAllocationInNewTLAB");
-        allocationOutsideTLAB = getTypeId("jdk.ObjectAllocationOutsideTLAB");
-        allocationSample = getTypeId("jdk.ObjectAllocationSample");
-        monitorEnter = getTypeId("jdk.JavaMonitorEnter");
-        threadPark = getTypeId("jdk.ThreadPark");
-        activeSetting = getTypeId("jdk.ActiveSetting");
-        activeSettingHasStack = activeSetting >= 0 && typesByName.get("jdk.ActiveSetting").field("stackTrace") != null;
-    }
-
-    private int getTypeId(String typeName) {
-        JfrClass type = typesByName.get(typeName);
-        return type != null ? type.id : -1;
-    }
 
-    private int getVarint() {
-        int result = 0;
-        for (int shift = 0; ; shift += 7) {
-            byte b = buf.get();
-            result |= (b & 0x7f) << shift;
-            if (b >= 0) {
-                return result;
+        ExecutorService executor = Executors.newFixedThreadPool(Math.min(PARALLELISM, remaining.size()));
+        try {
+            List<Future<R>> results = new ArrayList<>(remaining.size());
+            for (final JfrChunk chunk : remaining) {
+                results.add(executor.submit(new Callable<R>() {
+                    @Override
+                    public R call() {
+                        chunk.readConstants();
+                        return reader.read(chunk);
+                    }
+                }));
             }
-        }
-    }
 
-    private long getVarlong() {
-        long result = 0;
-        for (int shift = 0; shift < 56; shift += 7) {
-            byte b = buf.get();
-            result |= (b & 0x7fL) << shift;
-            if (b >= 0) {
-                return result;
+            for (int i = 0; i < results.size(); i++) {
+                R result = getResult(results.set(i, null));
+                JfrChunk chunk = remaining.set(i, null);
+                mergeConstants(chunk);
+                mergeSettings(chunk);
+                chunk.release();
+                reader.merge(result);
             }
+        } finally {
+            executor.shutdownNow();
         }
-        return result | (buf.get() & 0xffL) << 56;
     }
 
-    private String getString() {
-        switch (buf.get()) {
-            case 0:
-                return null;
-            case 1:
-                return "";
-            case 3:
-                return new String(getBytes(), StandardCharsets.UTF_8);
-            case 4: {
-                char[] chars = new char[getVarint()];
-                for (int i = 0; i < chars.length; i++) {
-                    chars[i] = (char) getVarint();
-                }
-                return new String(chars);
+    private static <R> R getResult(Future<R> future) throws IOException {
+        try {
+            return future.get();
+        } catch (InterruptedException e) {
+            Thread.currentThread().interrupt();
+            throw new InterruptedIOException();
+        } catch (ExecutionException e) {
+            Throwable cause = e.getCause();
+            if (cause instanceof RuntimeException) {
+                throw (RuntimeException) cause;
+            } else if (cause instanceof Error) {
+                throw (Error) cause;
             }
-            case 5:
-                return new String(getBytes(), StandardCharsets.ISO_8859_1);
-            default:
-                throw new IllegalArgumentException("Invalid string encoding");
+            throw new IOException(cause);
         }
     }
 
-    private byte[] getBytes() {
-        byte[] bytes = new byte[getVarint()];
-        buf.get(bytes);
-        return bytes;
-    }
-
-    private void seek(long pos) throws IOException {
-        filePosition = pos;
-        ch.position(pos);
-        buf.rewind().flip();
-    }
-
-    private boolean ensureBytes(int needed) throws IOException {
-        if (buf.remaining() >= needed) {
-            return true;
-        }
-
-        filePosition += buf.position();
+    private interface ChunkReader<R> {
+        // Called on a pool thread for every chunk
+        R read(JfrChunk chunk);
 
-        if (buf.capacity() < needed) {
-            ByteBuffer newBuf = ByteBuffer.allocateDirect(needed);
-            newBuf.put(buf);
-            buf = newBuf;
-        } else {
-            buf.compact();
-        }
-
-        while (ch.read(buf) > 0 && buf.position() < needed) {
-            // keep reading
-        }
-        buf.flip();
-        return buf.limit() > 0;
+        // Called on the caller's thread, in the order of chunks
+        void merge(R result);
     }
 }
@@ -42,6 +42,11 @@ public class AllocationSample extends Event {
         return false;
     }
 
+    @Override
+    public int group() {
+        return classId << 1 | (tlabSize == 0 ? 1 : 0);
+    }
+
     @Override
     public long value() {
         return tlabSize != 0 ? tlabSize : allocationSize;
@@ -40,6 +40,11 @@ public class ContendedLock extends Event {
         return false;
     }
 
+    @Override
+    public int group() {
+        return classId;
+    }
+
     @Override
     public long value() {
         return duration;
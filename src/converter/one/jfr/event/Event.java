@@ -41,6 +41,12 @@ public abstract class Event implements Comparable<Event> {
         return getClass() == o.getClass();
     }
 
+    // Events of one class and stack trace with equal groups are aggregated together,
+    // consistent with sameGroup
+    public int group() {
+        return 0;
+    }
+
     public long value() {
         return 1;
     }
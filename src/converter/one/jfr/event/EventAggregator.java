@@ -16,76 +16,116 @@
 
 package one.jfr.event;
 
+/**
+ * Sums up events by stack trace, thread (optionally) and group, see Event.group().
+ * Keys are compared as primitives; the first event of every group is kept for Visitor.
+ */
 public class EventAggregator {
     private static final int INITIAL_CAPACITY = 1024;
 
     private final boolean threads;
     private final boolean total;
-    private Event[] keys;
+    private long[] keys;
+    private int[] groups;
+    private Event[] events;
     private long[] values;
     private int size;
 
     public EventAggregator(boolean threads, boolean total) {
         this.threads = threads;
         this.total = total;
-        this.keys = new Event[INITIAL_CAPACITY];
+        this.keys = new long[INITIAL_CAPACITY];
+        this.groups = new int[INITIAL_CAPACITY];
+        this.events = new Event[INITIAL_CAPACITY];
         this.values = new long[INITIAL_CAPACITY];
     }
 
+    // An empty aggregator with the same grouping, e.g. for one chunk of a recording
+    public EventAggregator newAggregator() {
+        return new EventAggregator(threads, total);
+    }
+
     public void collect(Event e) {
-        int mask = keys.length - 1;
-        int i = hashCode(e) & mask;
-        while (keys[i] != null) {
-            if (sameGroup(keys[i], e)) {
-                values[i] += total ? e.value() : 1;
-                return;
+        add(e, total ? e.value() : 1);
+    }
+
+    // Adds everything collected by other, which must group events the same way
+    public void merge(EventAggregator other) {
+        for (int i = 0; i < other.events.length; i++) {
+            if (other.events[i] != null) {
+                add(other.events[i], other.values[i]);
             }
-            i = (i + 1) & mask;
         }
+    }
 
-        keys[i] = e;
-        values[i] = total ? e.value() : 1;
+    public long getValue(Event e) {
+        int i = find(key(e), e.group(), e.getClass());
+        return events[i] != null ? values[i] : 0;
+    }
 
-        if (++size * 2 > keys.length) {
-            resize(keys.length * 2);
+    public void forEach(Visitor visitor) {
+        for (int i = 0; i < events.length; i++) {
+            if (events[i] != null) {
+                visitor.visit(events[i], values[i]);
+            }
         }
     }
 
-    public long getValue(Event e) {
-        int mask = keys.length - 1;
-        int i = hashCode(e) & mask;
-        while (keys[i] != null && !sameGroup(keys[i], e)) {
-            i = (i + 1) & mask;
+    private void add(Event e, long value) {
+        long key = key(e);
+        int group = e.group();
+        int i = find(key, group, e.getClass());
+        if (events[i] != null) {
+            values[i] += value;
+            return;
+        }
+
+        keys[i] = key;
+        groups[i] = group;
+        events[i] = e;
+        values[i] = value;
+
+        if (++size * 2 > events.length) {
+            resize(events.length * 2);
         }
-        return values[i];
     }
 
-    public void forEach(Visitor visitor) {
-        for (int i = 0; i < keys.length; i++) {
-            if (keys[i] != null) {
-                visitor.visit(keys[i], values[i]);
+    // The slot of the matching group, or the free slot for it
+    private int find(long key, int group, Class<?> cls) {
+        int mask = events.length - 1;
+        int i = hashCode(key, group) & mask;
+        while (events[i] != null) {
+            if (keys[i] == key && groups[i] == group && events[i].getClass() == cls) {
+                break;
             }
+            i = (i + 1) & mask;
         }
+        return i;
     }
 
-    private int hashCode(Event e) {
-        return e.hashCode() + (threads ? e.tid * 31 : 0);
+    private long key(Event e) {
+        return (long) e.stackTraceId << 32 | (threads ? e.tid & 0xffffffffL : 0);
     }
 
-    private boolean sameGroup(Event e1, Event e2) {
-        return e1.stackTraceId == e2.stackTraceId && (!threads || e1.tid == e2.tid) && e1.sameGroup(e2);
+    private static int hashCode(long key, int group) {
+        int h = ((int) (key ^ key >>> 32) + group * 127) * 0x9e3779b9;
+        return h ^ h >>> 16;
     }
 
     private void resize(int newCapacity) {
-        Event[] newKeys = new Event[newCapacity];
+        long[] newKeys = new long[newCapacity];
+        int[] newGroups = new int[newCapacity];
+        Event[] newEvents = new Event[newCapacity];
         long[] newValues = new long[newCapacity];
-        int mask = newKeys.length - 1;
+        int mask = newCapacity - 1;
 
-        for (int i = 0; i < keys.length; i++) {
-            if (keys[i] != null) {
-                for (int j = hashCode(keys[i]) & mask; ; j = (j + 1) & mask) {
-                    if (newKeys[j] == null) {
+        for (int i = 0; i < events.length; i++) {
+            if (events[i] != null) {
+                for (int j = hashCode(keys[i], groups[i]) & mask; ; j = (j + 1) & mask) {
+                    if (newEvents[j] == null) {
                         newKeys[j] = keys[i];
+                        newGroups[j] = groups[i];
+                        newEvents[j] = events[i];
                         newValues[j] = values[i];
                         break;
                     }
@@ -94,10 +134,16 @@ public class EventAggregator {
         }
 
         keys = newKeys;
+        groups = newGroups;
+        events = newEvents;
         values = newValues;
     }
 
     public interface Visitor {
         void visit(Event event, long value);
     }
+
+    public interface Filter {
+        boolean accept(Event event);
+    }
 }
@@ -18,9 +18,20 @@ package one.jfr.event;
 
 public class ExecutionSample extends Event {
     public final int threadState;
+    public final long traceIdHigh;
+    public final long traceIdLow;
+    public final long spanId;
 
     public ExecutionSample(long time, int tid, int stackTraceId, int threadState) {
+        this(time, tid, stackTraceId, threadState, 0, 0, 0);
+    }
+
+    public ExecutionSample(long time, int tid, int stackTraceId, int threadState,
+                           long traceIdHigh, long traceIdLow, long spanId) {
         super(time, tid, stackTraceId);
         this.threadState = threadState;
+        this.traceIdHigh = traceIdHigh;
+        this.traceIdLow = traceIdLow;
+        this.spanId = spanId;
     }
 }
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _CTIMER_H
+#define _CTIMER_H
+
+#include <signal.h>
+#include "engine.h"
+
+
+// ctimer: one POSIX timer per thread on the CPU clock of that thread, delivering
+// SIGPROF to the thread itself (SIGEV_THREAD_ID). Unlike the process-wide itimer,
+// every busy thread gets its own samples, and unlike perf_events no special
+// permissions are needed. Timers are created for the running threads at start
+// and then by the pthread_setspecific hook as threads come and go.
+class CTimer : public Engine {
+  private:
+    static long _interval;
+    static CStack _cstack;
+    static int _max_timers;
+    // Kernel timer id + 1 by tid, 0 if none, -1 while being created
+    static volatile int* _timers;
+
+    static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
+    static void signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext);
+
+  public:
+    const char* title() {
+        return "CPU profile";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    static bool supported();
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    long interval() {
+        return _interval;
+    }
+
+    bool setInterval(long interval);
+
+    static int createForThread(int tid);
+    static void destroyForThread(int tid);
+};
+
+#endif // _CTIMER_H
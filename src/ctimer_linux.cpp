@@ -0,0 +1,235 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "ctimer.h"
+#include "j9StackTraces.h"
+#include "log.h"
+#include "os.h"
+#include "profiler.h"
+#include "stackWalker.h"
+#include "threadHook.h"
+
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID 4
+#endif
+
+
+long CTimer::_interval;
+CStack CTimer::_cstack;
+int CTimer::_max_timers = 0;
+volatile int* CTimer::_timers = NULL;
+
+
+// The CPU clock of any thread of the process, as pthread_getcpuclockid() would
+// return it: CLOCK_THREAD_CPUTIME_ID names the calling thread only
+static inline clockid_t threadCpuClock(int tid) {
+    return ((~(unsigned int)tid) << 3) | 6;  // CPUCLOCK_SCHED | CPUCLOCK_PERTHREAD_MASK
+}
+
+static inline struct itimerspec timerSpec(long interval) {
+    struct itimerspec ts;
+    ts.it_interval.tv_sec = (time_t)(interval / 1000000000);
+    ts.it_interval.tv_nsec = interval % 1000000000;
+    ts.it_value = ts.it_interval;
+    return ts;
+}
+
+static void ctimerThreadStart(int tid) {
+    CTimer::createForThread(tid);
+}
+
+static void ctimerThreadEnd(int tid) {
+    CTimer::destroyForThread(tid);
+}
+
+
+void CTimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    if (!_enabled) return;
+
+    Profiler::instance()->printSample(ucontext, _interval);
+}
+
+void CTimer::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext) {
+    if (!_enabled) return;
+
+    J9StackTraceNotification notif;
+    StackContext java_ctx;
+    notif.num_frames = _cstack == CSTACK_NO ? 0 : _cstack == CSTACK_DWARF
+        ? StackWalker::walkDwarf(ucontext, notif.addr, MAX_J9_NATIVE_FRAMES, &java_ctx)
+        : StackWalker::walkFP(ucontext, notif.addr, MAX_J9_NATIVE_FRAMES, &java_ctx);
+    J9StackTraces::checkpoint(_interval, &notif);
+}
+
+// Returns 0 or the error of the failed system call
+int CTimer::createForThread(int tid) {
+    if (tid >= _max_timers) {
+        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_timers);
+        return -1;
+    }
+
+    // Mark the slot early to prevent duplicates, as for perf events
+    if (!__sync_bool_compare_and_swap(&_timers[tid], 0, -1)) {
+        return -1;
+    }
+
+    // glibc names the target thread field differently across versions; it follows sigev_notify
+    struct sigevent sev = {};
+    sev.sigev_value.sival_ptr = NULL;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    ((int*)&sev.sigev_notify)[1] = tid;
+
+    int timer_id;
+    if (syscall(__NR_timer_create, threadCpuClock(tid), &sev, &timer_id) != 0) {
+        int err = errno;
+        _timers[tid] = 0;
+        return err;
+    }
+
+    struct itimerspec ts = timerSpec(_interval);
+    if (syscall(__NR_timer_settime, timer_id, 0, &ts, NULL) != 0) {
+        int err = errno;
+        syscall(__NR_timer_delete, timer_id);
+        _timers[tid] = 0;
+        return err;
+    }
+
+    _timers[tid] = timer_id + 1;
+    return 0;
+}
+
+void CTimer::destroyForThread(int tid) {
+    if (tid >= _max_timers) {
+        return;
+    }
+
+    int timer = _timers[tid];
+    if (timer > 0 && __sync_bool_compare_and_swap(&_timers[tid], timer, 0)) {
+        syscall(__NR_timer_delete, timer - 1);
+    }
+}
+
+bool CTimer::supported() {
+    // Creating a timer costs nothing until it is armed
+    struct sigevent sev = {};
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    ((int*)&sev.sigev_notify)[1] = OS::threadId();
+
+    int timer_id;
+    if (syscall(__NR_timer_create, threadCpuClock(OS::threadId()), &sev, &timer_id) != 0) {
+        return false;
+    }
+    syscall(__NR_timer_delete, timer_id);
+    return true;
+}
+
+Error CTimer::check(Arguments& args) {
+    if (!ThreadHook::initialize()) {
+        return Error("Could not set pthread hook");
+    } else if (!supported()) {
+        return Error("Per-thread CPU timers are not supported on this system");
+    }
+    return Error::OK;
+}
+
+Error CTimer::start(Arguments& args) {
+    if (args._interval < 0) {
+        return Error("interval must be positive");
+    }
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    _interval = args._interval ? args._interval : DEFAULT_INTERVAL;
+    _cstack = args._cstack;
+
+    int max_timers = OS::getMaxThreadId();
+    if (max_timers != _max_timers) {
+        free((void*)_timers);
+        _timers = (int*)calloc(max_timers, sizeof(int));
+        _max_timers = max_timers;
+    }
+
+    if (VM::isOpenJ9()) {
+        if (_cstack == CSTACK_DEFAULT) _cstack = CSTACK_DWARF;
+        OS::installSignalHandler(SIGPROF, signalHandlerJ9);
+        error = J9StackTraces::start(args);
+        if (error) {
+            return error;
+        }
+    } else {
+        OS::installSignalHandler(SIGPROF, signalHandler);
+    }
+
+    // Enable pthread hook before traversing currently running threads
+    ThreadHook::enable(ctimerThreadStart, ctimerThreadEnd);
+
+    int err = 0;
+    bool created = false;
+    ThreadRegistry* registry = Profiler::instance()->threadRegistry();
+    registry->scan();
+    ThreadList* thread_list = registry->listThreads();
+    for (int tid; (tid = thread_list->next()) != -1; ) {
+        if ((err = createForThread(tid)) == 0) {
+            created = true;
+        }
+    }
+    delete thread_list;
+
+    if (!created) {
+        ThreadHook::disable();
+        J9StackTraces::stop();
+        return Error(err == EPERM || err == EACCES ? "No permission to create CPU timers" : "Could not create CPU timers");
+    }
+    return Error::OK;
+}
+
+// Running timers are re-armed one by one; a thread created meanwhile gets the new interval
+bool CTimer::setInterval(long interval) {
+    if (interval <= 0) {
+        return false;
+    }
+    _interval = interval;
+
+    struct itimerspec ts = timerSpec(interval);
+    for (int tid = 0; tid < _max_timers; tid++) {
+        int timer = _timers[tid];
+        if (timer > 0) {
+            syscall(__NR_timer_settime, timer - 1, 0, &ts, NULL);
+        }
+    }
+    return true;
+}
+
+void CTimer::stop() {
+    ThreadHook::disable();
+    for (int tid = 0; tid < _max_timers; tid++) {
+        destroyForThread(tid);
+    }
+    J9StackTraces::stop();
+}
+
+#endif // __linux__
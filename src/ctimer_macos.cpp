@@ -0,0 +1,61 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifdef __APPLE__
+
+#include "ctimer.h"
+
+
+long CTimer::_interval;
+CStack CTimer::_cstack;
+int CTimer::_max_timers = 0;
+volatile int* CTimer::_timers = NULL;
+
+
+void CTimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+}
+
+void CTimer::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext) {
+}
+
+int CTimer::createForThread(int tid) {
+    return -1;
+}
+
+void CTimer::destroyForThread(int tid) {
+}
+
+bool CTimer::supported() {
+    return false;
+}
+
+Error CTimer::check(Arguments& args) {
+    return Error("ctimer is not supported on macOS");
+}
+
+Error CTimer::start(Arguments& args) {
+    return Error("ctimer is not supported on macOS");
+}
+
+bool CTimer::setInterval(long interval) {
+    return false;
+}
+
+void CTimer::stop() {
+}
+
+#endif // __APPLE__
@@ -18,28 +18,48 @@
 #include <string.h>
 #include "dictionary.h"
 #include "arch.h"
+#include "memoryBudget.h"
 
 
+// Dictionary memory is only counted: ids handed out must stay resolvable
 static inline char* allocateKey(const char* key, size_t length) {
     char* result = (char*)malloc(length + 1);
     memcpy(result, key, length);
     result[length] = 0;
+    MemoryBudget::charge(MEMORY_DICTIONARY, length + 1);
     return result;
 }
 
+static inline void freeKey(char* key) {
+    if (key != NULL) {
+        MemoryBudget::release(MEMORY_DICTIONARY, strlen(key) + 1);
+        free(key);
+    }
+}
+
+static inline DictTable* allocateTable() {
+    MemoryBudget::charge(MEMORY_DICTIONARY, sizeof(DictTable));
+    return (DictTable*)calloc(1, sizeof(DictTable));
+}
+
+static inline void freeTable(DictTable* table) {
+    MemoryBudget::release(MEMORY_DICTIONARY, sizeof(DictTable));
+    free(table);
+}
+
 static inline bool keyEquals(const char* candidate, const char* key, size_t length) {
     return strncmp(candidate, key, length) == 0 && candidate[length] == 0;
 }
 
 
 Dictionary::Dictionary() {
-    _table = (DictTable*)calloc(1, sizeof(DictTable));
+    _table = allocateTable();
     _table->base_index = _base_index = 1;
 }
 
 Dictionary::~Dictionary() {
     clear(_table);
-    free(_table);
+    freeTable(_table);
 }
 
 void Dictionary::clear() {
@@ -52,23 +72,38 @@ void Dictionary::clear(DictTable* table) {
     for (int i = 0; i < ROWS; i++) {
         DictRow* row = &table->rows[i];
         for (int j = 0; j < CELLS; j++) {
-            free(row->keys[j]);
+            freeKey(row->keys[j]);
         }
         if (row->next != NULL) {
             clear(row->next);
-            free(row->next);
+            freeTable(row->next);
         }
     }
 }
 
 // Many popular symbols are quite short, e.g. "[B", "()V" etc.
-// FNV-1a is reasonably fast and sufficiently random.
+// Eight bytes are mixed at a time; the tail is loaded byte by byte
+// so that the hash never reads past the key.
 unsigned int Dictionary::hash(const char* key, size_t length) {
-    unsigned int h = 2166136261U;
-    for (size_t i = 0; i < length; i++) {
-        h = (h ^ key[i]) * 16777619;
+    const u64 M = 0xc6a4a7935bd1e995ULL;
+    u64 h = length * M;
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        u64 k;
+        memcpy(&k, key + i, 8);
+        h = (h ^ k) * M;
+        h ^= h >> 47;
     }
-    return h;
+
+    u64 k = 0;
+    for (int shift = 0; i < length; i++, shift += 8) {
+        k |= (u64)(u8)key[i] << shift;
+    }
+    h = (h ^ k) * M;
+    h ^= h >> 47;
+    h *= M;
+    return (unsigned int)(h ^ (h >> 32));
 }
 
 unsigned int Dictionary::lookup(const char* key) {
@@ -76,8 +111,19 @@ unsigned int Dictionary::lookup(const char* key) {
 }
 
 unsigned int Dictionary::lookup(const char* key, size_t length) {
+    return lookup(key, length, NULL);
+}
+
+const char* Dictionary::intern(const char* key) {
+    const char* stored_key;
+    lookup(key, strlen(key), &stored_key);
+    return stored_key;
+}
+
+unsigned int Dictionary::lookup(const char* key, size_t length, const char** stored_key) {
     DictTable* table = _table;
-    unsigned int h = hash(key, length);
+    unsigned int tag = hash(key, length);
+    unsigned int h = tag;
 
     while (true) {
         DictRow* row = &table->rows[h % ROWS];
@@ -85,20 +131,27 @@ unsigned int Dictionary::lookup(const char* key, size_t length) {
             if (row->keys[c] == NULL) {
                 char* new_key = allocateKey(key, length);
                 if (__sync_bool_compare_and_swap(&row->keys[c], NULL, new_key)) {
+                    __atomic_store_n(&row->tags[c], tag, __ATOMIC_RELEASE);
+                    if (stored_key != NULL) *stored_key = new_key;
                     return table->index(h % ROWS, c);
                 }
-                free(new_key);
+                freeKey(new_key);
+            }
+            unsigned int cell_tag = __atomic_load_n(&row->tags[c], __ATOMIC_ACQUIRE);
+            if (cell_tag != 0 && cell_tag != tag) {
+                continue;
             }
             if (keyEquals(row->keys[c], key, length)) {
+                if (stored_key != NULL) *stored_key = row->keys[c];
                 return table->index(h % ROWS, c);
             }
         }
 
         if (row->next == NULL) {
-            DictTable* new_table = (DictTable*)calloc(1, sizeof(DictTable));
+            DictTable* new_table = allocateTable();
             new_table->base_index = __sync_add_and_fetch(&_base_index, TABLE_CAPACITY);
             if (!__sync_bool_compare_and_swap(&row->next, NULL, new_table)) {
-                free(new_table);
+                freeTable(new_table);
             }
         }
 
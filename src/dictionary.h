@@ -29,8 +29,11 @@
 
 struct DictTable;
 
+// tags[c] is the hash of keys[c], published after the key itself;
+// 0 means unknown yet, and the key has to be compared
 struct DictRow {
     char* keys[CELLS];
+    unsigned int tags[CELLS];
     DictTable* next;
 };
 
@@ -55,6 +58,8 @@ class Dictionary {
 
     static void collect(std::map<unsigned int, const char*>& map, DictTable* table);
 
+    unsigned int lookup(const char* key, size_t length, const char** stored_key);
+
   public:
     Dictionary();
     ~Dictionary();
@@ -64,6 +69,9 @@ class Dictionary {
     unsigned int lookup(const char* key);
     unsigned int lookup(const char* key, size_t length);
 
+    // Returns the copy of the key owned by the dictionary, valid until clear()
+    const char* intern(const char* key);
+
     void collect(std::map<unsigned int, const char*>& map);
 };
 
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <map>
+#include <vector>
 #include <stdlib.h>
 #include "dwarf.h"
 #include "log.h"
@@ -351,3 +353,86 @@ FrameDesc* DwarfParser::addRecordRaw(u32 loc, int cfa, int fp_off) {
     f->fp_off = fp_off;
     return f;
 }
+
+
+FrameTable::FrameTable(FrameDesc* table, int length) {
+    bool sorted = true;
+    for (int i = 1; i < length && sorted; i++) {
+        sorted = table[i - 1].loc <= table[i].loc;
+    }
+    if (!sorted) {
+        qsort(table, length, sizeof(FrameDesc), FrameDesc::comparator);
+    }
+
+    std::map<u64, u32> rule_index;
+    std::vector<FrameDesc> rules;
+    _entries = (FrameEntry*)malloc((length > 0 ? length : 1) * sizeof(FrameEntry));
+    _count = 0;
+
+    for (int i = 0; i < length; i++) {
+        u64 key = (u64)(u32)table[i].cfa << 32 | (u32)table[i].fp_off;
+        std::map<u64, u32>::iterator it = rule_index.find(key);
+        u32 rule;
+        if (it != rule_index.end()) {
+            rule = it->second;
+        } else {
+            rule = rules.size();
+            rule_index[key] = rule;
+            rules.push_back(table[i]);
+            rules.back().loc = 0;
+        }
+
+        if (_count > 0 && _entries[_count - 1].loc == table[i].loc) {
+            // The later record of the same location wins, e.g. the start of the next function
+            _count--;
+        }
+        if (_count > 0 && _entries[_count - 1].rule == rule) {
+            continue;
+        }
+        _entries[_count].loc = table[i].loc;
+        _entries[_count].rule = rule;
+        _count++;
+    }
+
+    _rules = (FrameDesc*)malloc((rules.size() > 0 ? rules.size() : 1) * sizeof(FrameDesc));
+    for (size_t i = 0; i < rules.size(); i++) {
+        _rules[i] = rules[i];
+    }
+    _entries = (FrameEntry*)realloc(_entries, (_count > 0 ? _count : 1) * sizeof(FrameEntry));
+
+    // _pages[p] is the first entry at or after page p; the last one closes the range
+    _page_count = _count > 0 ? (_entries[_count - 1].loc >> FRAME_PAGE_BITS) + 1 : 0;
+    _pages = (u32*)malloc((_page_count + 1) * sizeof(u32));
+    int e = 0;
+    for (u32 p = 0; p <= _page_count; p++) {
+        while (e < _count && (_entries[e].loc >> FRAME_PAGE_BITS) < p) e++;
+        _pages[p] = e;
+    }
+}
+
+FrameTable::~FrameTable() {
+    free(_rules);
+    free(_entries);
+    free(_pages);
+}
+
+FrameDesc* FrameTable::find(u32 loc) const {
+    u32 page = loc >> FRAME_PAGE_BITS;
+    if (page >= _page_count) {
+        return _count > 0 ? &_rules[_entries[_count - 1].rule] : NULL;
+    }
+
+    // Last entry of [low, high) with entry.loc <= loc, or the one before the page
+    int low = _pages[page];
+    int high = _pages[page + 1];
+    while (low < high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (_entries[mid].loc <= loc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low > 0 ? &_rules[_entries[low - 1].rule] : NULL;
+}
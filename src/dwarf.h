@@ -70,6 +70,45 @@ struct FrameDesc {
 };
 
 
+struct FrameEntry {
+    u32 loc;
+    u32 rule;
+};
+
+const int FRAME_PAGE_BITS = 12;
+
+// Read-only form of a DwarfParser table, built once per library.
+// Identical (cfa, fp_off) rules are stored once, and a record that repeats
+// the rule of the previous one is dropped. The 8-byte entries are indexed by
+// 4 KB pages of code, so that a lookup only searches the entries of one page.
+class FrameTable {
+  private:
+    FrameDesc* _rules;
+    FrameEntry* _entries;
+    u32* _pages;
+    int _count;
+    u32 _page_count;
+
+  public:
+    // Does not take ownership of the table
+    FrameTable(FrameDesc* table, int length);
+    ~FrameTable();
+
+    int count() const {
+        return _count;
+    }
+
+    FrameDesc at(int index) const {
+        FrameDesc f = _rules[_entries[index].rule];
+        f.loc = _entries[index].loc;
+        return f;
+    }
+
+    // The rule of the last record at or before loc; loc of the result is not meaningful
+    FrameDesc* find(u32 loc) const;
+};
+
+
 class DwarfParser {
   private:
     const char* _name;
@@ -57,6 +57,16 @@ class Engine {
     virtual Error start(Arguments& args);
     virtual void stop();
 
+    // Sampling interval in effect, 0 if the engine does not sample periodically
+    virtual long interval() {
+        return 0;
+    }
+
+    // Changes the interval of the running engine; false if it cannot be changed
+    virtual bool setInterval(long interval) {
+        return false;
+    }
+
     void enableEvents(bool enabled) {
         _enabled = enabled;
     }
@@ -52,4 +52,61 @@ class LockEvent : public Event {
     long long _timeout;
 };
 
+// A lock wait traced by LockRecorder (lock=...), along with the thread that held the lock
+class LockWaitSample : public Event {
+  public:
+    u32 _class_id;
+    u64 _start_time;
+    u64 _end_time;
+    uintptr_t _address;
+    // The thread which acquired the lock last before the wait, 0 if unknown
+    int _owner_tid;
+    // MonitorEnter, MonitorWait or UnsafePark
+    const char* _lock_type;
+};
+
+// A blocking call timed by IoTracer (io=...)
+class IoEvent : public Event {
+  public:
+    u64 _start_time;
+    u64 _end_time;
+    int _fd;
+    // Bytes transferred, or ready descriptors for poll; negative on error
+    long long _result;
+    const char* _operation;
+    const char* _fd_type;
+    // Empty unless ioaddr is set and the descriptor is a socket
+    const char* _peer;
+};
+
+// Counters of a perf event group read along with the leader (counters=...)
+const int MAX_GROUP_COUNTERS = 4;
+
+// Details of a Kindling sample beyond its stack: an off-CPU period, the values
+// of a counter group or a data address. Zero fields are not reported.
+class SampleEvent : public Event {
+  public:
+    // When the thread was switched in, in KdClock::now() units; 0 means now
+    u64 _timestamp;
+    u64 _duration;
+    // Lock the thread was waiting for, 0 if unknown
+    uintptr_t _address;
+    // Deltas since the previous sample, in the order of the counters option
+    int _counter_count;
+    u64 _counters[MAX_GROUP_COUNTERS];
+    // Operand of the sampled instruction and where it was found (dataaddr)
+    uintptr_t _data_address;
+    u64 _data_source;
+    // CPU the sample was taken on when it is stored by another thread (perfpoll), -1 otherwise
+    int _cpu;
+    // Guessed from the interrupted instruction by the wall clock engine
+    ThreadState _thread_state;
+    // CPU ns the thread used since its previous itimer or wall sample, 0 if unknown
+    u64 _cpu_time;
+
+    SampleEvent() : _timestamp(0), _duration(0), _address(0), _counter_count(0), _data_address(0), _data_source(0), _cpu(-1),
+        _thread_state(THREAD_RUNNING), _cpu_time(0) {
+    }
+};
+
 #endif // _EVENT_H
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EVENTBUFFER_H
+#define _EVENTBUFFER_H
+
+#include <string.h>
+#include "arch.h"
+#include "eventLogger.h"
+
+
+// Binary Kindling stream (kdformat=binary).
+// Every write carries one chunk, and a record is never split between chunks:
+//     chunk  := "KDB" version:u8 length:u16 record*
+//     record := type:u8 length:varint body
+// Integers in record bodies are unsigned LEB128 varints.
+// Native frames are defined before their first use, Java methods
+// at the end of the batch where they are first used.
+const int KD_CHUNK_SIZE = 1024;  // Keep every write within 1K, like the text stream does
+const int KD_CHUNK_HEADER = 6;
+const int KD_RECORD_LIMIT = KD_CHUNK_SIZE - KD_CHUNK_HEADER - 6;
+const int KD_MAX_NAME_LENGTH = 900;
+const int KD_STACK_FRAMES = 192;  // Frame ids per KD_STACK record, 5 bytes each at most
+const u8 KD_VERSION = 1;
+
+enum KdRecordType {
+    KD_BATCH = 1,  // timestamp, stacks in this batch
+    KD_FRAME = 2,  // frame id, name bytes up to the end of the record; defined once per session
+    KD_STACK = 3,  // timestamp, tid, depth, finish, frame count, frame ids from the top of the stack
+    KD_CLOCK = 4,  // ticks, wall clock ns, ticks per second; precedes a batch with kdclock=tsc
+    KD_TRACE = 5,  // trace id, depth, finish, frame count, frame ids; defined once per session
+    KD_SAMPLES = 6, // tid, trace id, count, first timestamp, last timestamp, [CPU ns] (kdaggregate)
+    KD_DELTA = 7,   // timestamp, tid, frames kept from the bottom of the previous stack of tid,
+                    // frame count, frame ids from the top of the stack (kddelta)
+    KD_OFFCPU = 8,  // timestamp, tid, off-CPU ns, address of the lock waited for; precedes the stack
+    KD_COUNTERS = 9, // timestamp, tid, value count, values of the counter group; precedes the stack
+    KD_MEMORY = 10,  // timestamp, tid, data address, perf data source, area (H, C or N); precedes the stack
+    KD_CONTEXT = 11, // timestamp, tid, trace id high and low, span id; precedes the stack
+    KD_GC = 12,      // timestamp, tid, number of the GC pause in progress; precedes the stack
+    KD_CPU = 13,     // timestamp, tid, CPU the sample was taken on; precedes the stack (samplecpu)
+    KD_STATES = 14,  // thread state (R or S), trace id, count (kdstates)
+    KD_IDLE = 15,    // tid, idle samples not sent after its first idle stack, timestamp of that stack, last timestamp, [CPU ns] (kdidle)
+    KD_ALLOC = 16,   // timestamp, class frame id, trace id, sampled allocations, bytes (kdalloc)
+    KD_VTHREAD = 17, // timestamp, tid, Java id of the virtual thread mounted on tid; precedes the stack
+    KD_CPUTIME = 18, // timestamp, tid, CPU ns used since the previous itimer or wall sample of tid; precedes the stack
+    KD_GROUPS = 19   // trace id, count, first timestamp, last timestamp, CPU ns, thread group up to the end of the record (kdaggregate=group)
+};
+
+
+class EventBuffer {
+  private:
+    int _offset;
+    int _record_offset;
+    char _data[KD_CHUNK_SIZE];
+    char _record[KD_RECORD_LIMIT];
+
+    static int putVarint(char* dst, u64 v) {
+        int len = 0;
+        while (v > 0x7f) {
+            dst[len++] = (char)(0x80 | (v & 0x7f));
+            v >>= 7;
+        }
+        dst[len++] = (char)v;
+        return len;
+    }
+
+  public:
+    EventBuffer() : _offset(KD_CHUNK_HEADER), _record_offset(0) {
+    }
+
+    void putVar32(u32 v) {
+        _record_offset += putVarint(_record + _record_offset, v);
+    }
+
+    void putVar64(u64 v) {
+        _record_offset += putVarint(_record + _record_offset, v);
+    }
+
+    void putUtf8(const char* v) {
+        size_t len = strlen(v);
+        if (len > KD_MAX_NAME_LENGTH) len = KD_MAX_NAME_LENGTH;
+        memcpy(_record + _record_offset, v, len);
+        _record_offset += (int)len;
+    }
+
+    // Moves the current record into the chunk, flushing the chunk first if the record does not fit
+    void commit(KdRecordType type) {
+        char header[6];
+        header[0] = (char)type;
+        int header_len = 1 + putVarint(header + 1, (u32)_record_offset);
+
+        if (_offset + header_len + _record_offset > KD_CHUNK_SIZE) {
+            flush();
+        }
+        memcpy(_data + _offset, header, header_len);
+        memcpy(_data + _offset + header_len, _record, _record_offset);
+        _offset += header_len + _record_offset;
+        _record_offset = 0;
+    }
+
+    void flush() {
+        if (_offset == KD_CHUNK_HEADER) {
+            return;
+        }
+
+        int length = _offset - KD_CHUNK_HEADER;
+        _data[0] = 'K';
+        _data[1] = 'D';
+        _data[2] = 'B';
+        _data[3] = (char)KD_VERSION;
+        _data[4] = (char)(length >> 8);
+        _data[5] = (char)length;
+        EventLogger::write(_data, _offset);
+        _offset = KD_CHUNK_HEADER;
+    }
+};
+
+#endif // _EVENTBUFFER_H
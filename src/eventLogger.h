@@ -5,13 +5,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include "eventRing.h"
+#include "eventWriter.h"
+#include "timeUtil.h"
 
 class EventLogger {
   private:
     static FILE* _file;
+    static EventRing _ring;
+    static EventWriter _writer;
 
   public: 
     static void open(const char* file_name) {
+        _writer.stop();
+        _ring.close();
         if (_file != stdout && _file != stderr) {
             fclose(_file);
         }
@@ -26,7 +33,24 @@ class EventLogger {
         }
     }
 
+    // Events go to a shared memory ring instead of the file
+    static bool openRing(const char* path, u64 capacity) {
+        return _ring.open(path, capacity);
+    }
+
+    // Producers append to memory, a background thread writes to the file
+    static void startWriter(bool compress) {
+        fflush(_file);
+        _writer.start(fileno(_file), compress);
+    }
+
+    static u64 dropped() {
+        return _writer.dropped();
+    }
+
     static void close() {
+        _writer.stop();
+        _ring.close();
         if (_file != stdout && _file != stderr) {
             fclose(_file);
             _file = stdout;
@@ -48,11 +72,34 @@ class EventLogger {
             buf[len] = 0;
         }
 
+        if (_ring.active()) {
+            _ring.write(KD_RING_TEXT, KdClock::now(), buf, len);
+            return;
+        }
+        if (_writer.active()) {
+            _writer.append(buf, len, true);
+            return;
+        }
         fprintf(_file, "%s\n", buf);
         fflush(_file);
     }
+
+    static void write(const char* data, size_t len) {
+        if (_ring.active()) {
+            _ring.write(KD_RING_BINARY, KdClock::now(), data, len);
+            return;
+        }
+        if (_writer.active()) {
+            _writer.append(data, len, false);
+            return;
+        }
+        fwrite(data, 1, len, _file);
+        fflush(_file);
+    }
 };
 
 FILE* EventLogger::_file = stdout;
+EventRing EventLogger::_ring;
+EventWriter EventLogger::_writer;
 
 #endif // _EVENT_LOGGER_H
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "eventRing.h"
+#include "timeUtil.h"
+
+
+bool EventRing::open(const char* path, u64 capacity) {
+    close();
+
+    u32 size = 64 * 1024;
+    while ((u64)size * 2 <= capacity && size < 0x40000000) {
+        size *= 2;
+    }
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    size_t total = KD_RING_HEADER_SIZE + size;
+    void* addr = MAP_FAILED;
+    if (ftruncate(fd, total) == 0) {
+        addr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    _lock.lock();
+    _header = (EventRingHeader*)addr;
+    _data = (char*)addr + KD_RING_HEADER_SIZE;
+    _size = total;
+    _capacity = size;
+
+    _header->header_size = KD_RING_HEADER_SIZE;
+    _header->capacity = size;
+    _header->start_ticks = KdClock::now();
+    _header->start_time = getCurrentTimestamp();
+    _header->frequency = KdClock::frequency();
+    _header->reserve = 0;
+    _header->commit = 0;
+    _header->version = KD_RING_VERSION;
+    // The reader checks magic last, when the rest of the header is set up
+    __atomic_store_n(&_header->magic, KD_RING_MAGIC, __ATOMIC_RELEASE);
+    _lock.unlock();
+    return true;
+}
+
+void EventRing::close() {
+    // Wait for a concurrent write to complete before unmapping
+    _lock.lock();
+    if (_header != NULL) {
+        munmap(_header, _size);
+        _header = NULL;
+        _data = NULL;
+    }
+    _lock.unlock();
+}
+
+void EventRing::write(KdRingRecordType type, u64 timestamp, const char* data, size_t len) {
+    u32 record_size = (KD_RING_RECORD_HEADER + len + 15) & ~15U;
+    if (record_size > _capacity / 2) {
+        return;
+    }
+
+    _lock.lock();
+    if (_header == NULL) {
+        _lock.unlock();
+        return;
+    }
+
+    u64 cursor = _header->commit;
+    u32 offset = (u32)(cursor & (_capacity - 1));
+    u32 pad = _capacity - offset < record_size ? _capacity - offset : 0;
+    storeRelease(_header->reserve, cursor + pad + record_size);
+
+    if (pad > 0) {
+        // The record does not fit before the end of the area, start over from its beginning
+        char* p = _data + offset;
+        *(u32*)p = pad - KD_RING_RECORD_HEADER;
+        *(u16*)(p + 4) = KD_RING_PAD;
+        offset = 0;
+    }
+
+    char* p = _data + offset;
+    *(u32*)p = (u32)len;
+    *(u16*)(p + 4) = (u16)type;
+    *(u16*)(p + 6) = 0;
+    *(u64*)(p + 8) = timestamp;
+    memcpy(p + KD_RING_RECORD_HEADER, data, len);
+
+    storeRelease(_header->commit, cursor + pad + record_size);
+
+    _lock.unlock();
+}
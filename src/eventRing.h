@@ -0,0 +1,88 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EVENTRING_H
+#define _EVENTRING_H
+
+#include <stddef.h>
+#include "arch.h"
+#include "spinLock.h"
+
+
+// Kindling events in a memory-mapped file (kdshm=PATH), read in place by the collector.
+//     file   := header data[capacity]
+//     record := length:u32 type:u16 reserved:u16 timestamp:u64 payload, padded to 16 bytes
+// Cursors are byte offsets since the start and only grow; a record lives at
+// cursor % capacity and never wraps, the tail of the area is skipped by a KD_RING_PAD record.
+// The producer advances reserve before writing and commit after it: the reader
+// consumes up to commit, and data it copied is valid only if reserve has not
+// since moved more than capacity bytes past it. A slow or restarted reader just loses
+// the oldest records, the agent never blocks or grows the file.
+const u32 KD_RING_MAGIC = 0x5242444b;  // "KDBR"
+const u32 KD_RING_VERSION = 1;
+const u32 KD_RING_HEADER_SIZE = 4096;
+const u32 KD_RING_RECORD_HEADER = 16;
+
+enum KdRingRecordType {
+    KD_RING_PAD = 0,     // skip to the start of the data area
+    KD_RING_TEXT = 1,    // one line of the text stream, without '\n'
+    KD_RING_BINARY = 2   // one chunk of the binary stream
+};
+
+struct EventRingHeader {
+    u32 magic;
+    u32 version;
+    u32 header_size;
+    u32 capacity;
+    // Record timestamps are in ticks of the given frequency; start_ticks and
+    // start_time are taken together to anchor them to the wall clock
+    u64 start_time;
+    u64 start_ticks;
+    u64 frequency;
+    char _pad0[64 - 40];
+    u64 reserve;
+    char _pad1[64 - 8];
+    u64 commit;
+};
+
+class EventRing {
+  private:
+    SpinLock _lock;
+    EventRingHeader* _header;
+    char* _data;
+    size_t _size;
+    u32 _capacity;
+
+  public:
+    EventRing() : _lock(), _header(NULL), _data(NULL), _size(0), _capacity(0) {
+    }
+
+    ~EventRing() {
+        close();
+    }
+
+    bool active() {
+        return _header != NULL;
+    }
+
+    // capacity is rounded down to a power of 2
+    bool open(const char* path, u64 capacity);
+    void close();
+
+    void write(KdRingRecordType type, u64 timestamp, const char* data, size_t len);
+};
+
+#endif // _EVENTRING_H
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "eventWriter.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+
+static inline u32 slotIndex() {
+    u64 h = (u64)(uintptr_t)pthread_self() * 0x9e3779b97f4a7c15ULL;
+    return (u32)(h >> 32) % EVENT_WRITER_SLOTS;
+}
+
+void EventWriter::start(int fd, bool compress) {
+    stop();
+
+    if (_slots == NULL) {
+        _slots = new EventWriterSlot[EVENT_WRITER_SLOTS];
+        for (int i = 0; i < EVENT_WRITER_SLOTS; i++) {
+            _slots[i].active = 0;
+            for (int j = 0; j < 2; j++) {
+                _slots[i].buffers[j].data = (char*)malloc(EVENT_WRITER_BUFFER_SIZE);
+                _slots[i].buffers[j].size = 0;
+                _slots[i].buffers[j].count = 0;
+            }
+        }
+    }
+
+    if (compress && _encoder == NULL) {
+        _encoder = new FrameEncoder(EVENT_WRITER_BUFFER_SIZE);
+    }
+
+    _fd = fd;
+    _dropped = 0;
+    _task = new EventWriterTask(this);
+    _thread = std::thread([&]{
+        _task->run();
+    });
+}
+
+void EventWriter::stop() {
+    if (_task != NULL) {
+        _task->stop();
+        _thread.join();
+        // Still active while draining, so that late events are buffered
+        // rather than written directly between the final batches
+        flush();
+        delete _task;
+        _task = NULL;
+        delete _encoder;
+        _encoder = NULL;
+    }
+}
+
+void EventWriter::append(const char* data, size_t len, bool newline) {
+    EventWriterSlot* slot = &_slots[slotIndex()];
+    size_t total = len + (newline ? 1 : 0);
+
+    slot->lock.lock();
+    EventWriterBuffer* buf = &slot->buffers[slot->active];
+    if (buf->data == NULL || buf->count >= EVENT_WRITER_RECORDS || buf->size + total > EVENT_WRITER_BUFFER_SIZE) {
+        // The sink does not keep up; never wait for it
+        slot->lock.unlock();
+        atomicInc(_dropped);
+        return;
+    }
+
+    memcpy(buf->data + buf->size, data, len);
+    if (newline) buf->data[buf->size + len] = '\n';
+    buf->size += total;
+    buf->ends[buf->count++] = buf->size;
+    slot->lock.unlock();
+}
+
+// Called by the flusher thread only
+void EventWriter::flush() {
+    if (_slots == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < EVENT_WRITER_SLOTS; i++) {
+        EventWriterSlot* slot = &_slots[i];
+        slot->lock.lock();
+        EventWriterBuffer* buf = &slot->buffers[slot->active];
+        slot->active ^= 1;
+        slot->lock.unlock();
+
+        if (buf->count > 0) {
+            if (_encoder != NULL) {
+                writeFrame(buf);
+            } else {
+                writeBuffer(buf);
+            }
+            buf->size = 0;
+            buf->count = 0;
+        }
+    }
+}
+
+void EventWriter::writeBuffer(EventWriterBuffer* buf) {
+    struct iovec iov[IOV_MAX];
+    u32 start = 0;
+    u32 record = 0;
+
+    while (record < buf->count) {
+        int n = 0;
+        u32 batch_start = start;
+        for (; record < buf->count && n < IOV_MAX; record++) {
+            iov[n].iov_base = buf->data + start;
+            iov[n].iov_len = buf->ends[record] - start;
+            start = buf->ends[record];
+            n++;
+        }
+
+        ssize_t written = writev(_fd, iov, n);
+        if (written < 0 && errno == EINTR) {
+            written = writev(_fd, iov, n);
+        }
+        if (written < 0) {
+            return;
+        }
+
+        // A short write leaves the tail of the batch
+        u32 offset = batch_start + (u32)written;
+        if (offset < start && !writeFully(buf->data + offset, start - offset)) {
+            return;
+        }
+    }
+}
+
+void EventWriter::writeFrame(EventWriterBuffer* buf) {
+    u32 frame_len;
+    const char* frame = _encoder->encode(buf->data, buf->size, frame_len);
+    writeFully(frame, frame_len);
+}
+
+bool EventWriter::writeFully(const char* data, u32 len) {
+    while (len > 0) {
+        ssize_t bytes = ::write(_fd, data, len);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) continue;
+            return false;
+        }
+        data += bytes;
+        len -= (u32)bytes;
+    }
+    return true;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EVENTWRITER_H
+#define _EVENTWRITER_H
+
+#include <stddef.h>
+#include <thread>
+#include "arch.h"
+#include "lz4Frame.h"
+#include "overheadGovernor.h"
+#include "spinLock.h"
+#include "stoppableTask.h"
+
+
+const int EVENT_WRITER_SLOTS = 16;
+const u32 EVENT_WRITER_BUFFER_SIZE = 256 * 1024;
+const u32 EVENT_WRITER_RECORDS = 4096;
+const int EVENT_WRITER_INTERVAL_MS = 20;
+
+// Records appended by producers and not yet written out
+struct EventWriterBuffer {
+    char* data;
+    u32 size;
+    u32 count;
+    u32 ends[EVENT_WRITER_RECORDS];
+};
+
+// Producer threads are spread over slots; each slot is double buffered,
+// so a producer only ever contends with the flusher swapping the buffers
+struct EventWriterSlot {
+    SpinLock lock;
+    int active;
+    EventWriterBuffer buffers[2];
+};
+
+class EventWriterTask;
+
+// Asynchronous sink for EventLogger (kdasync). The flusher writes every
+// EVENT_WRITER_INTERVAL_MS with writev, one iovec per record, so records keep
+// their boundaries, or as one compressed frame per buffer (kdcompress).
+// Records that do not fit in a full buffer are dropped and counted.
+class EventWriter {
+  private:
+    EventWriterSlot* _slots;
+    int _fd;
+    volatile u64 _dropped;
+    FrameEncoder* _encoder;
+    EventWriterTask* _task;
+    std::thread _thread;
+
+    void writeBuffer(EventWriterBuffer* buf);
+    void writeFrame(EventWriterBuffer* buf);
+    bool writeFully(const char* data, u32 len);
+
+  public:
+    EventWriter() : _slots(NULL), _fd(-1), _dropped(0), _encoder(NULL), _task(NULL) {
+    }
+
+    bool active() {
+        return _task != NULL;
+    }
+
+    u64 dropped() {
+        return _dropped;
+    }
+
+    void start(int fd, bool compress);
+    // Writes out everything appended so far and stops the flusher
+    void stop();
+
+    void append(const char* data, size_t len, bool newline);
+    void flush();
+};
+
+class EventWriterTask : public Stoppable {
+  public:
+    EventWriterTask(EventWriter* writer) {
+        this->writer = writer;
+    }
+    void run() {
+        // Check if thread is requested to stop
+        while (stopRequested() == false)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(EVENT_WRITER_INTERVAL_MS));
+            u64 start = TSC::ticks();
+            writer->flush();
+            OverheadGovernor::add(OVERHEAD_WRITE, start);
+        }
+    }
+  private:
+    EventWriter* writer;
+};
+
+#endif // _EVENTWRITER_H
@@ -31,6 +31,9 @@
 enum request_type {
     PERF_FD,
     KALLSYMS_FD,
+    SYMBOLS_FD,
+    SYMBOLS_STORE,  // refused since tables are no longer taken from peers
+    PERF_FD_BATCH,
 };
 
 struct fd_request {
@@ -44,6 +47,29 @@ struct perf_fd_request {
     struct perf_event_attr attr;
 };
 
+// Perf fds of many threads at once, all with the same attributes. The response carries
+// the fds of the threads whose error is 0 in one SCM_RIGHTS message, in tid order.
+#define MAX_PERF_FD_BATCH 64
+
+struct perf_fd_batch_request {
+    struct fd_request header;
+    int count;
+    struct perf_event_attr attr;
+    int tids[MAX_PERF_FD_BATCH];
+};
+
+// Host-wide symbol service: parsed symbol tables of libraries in the symcache format,
+// keyed by the hex GNU build-id. SYMBOLS_FD returns a read-only fd of the table.
+// The directory belongs to the server and is filled by its owner, e.g. from the symcache=
+// directory of an agent they trust; a table is never taken from a peer.
+#define SYMBOLS_DIR "/tmp/async-profiler-symbols"
+#define MAX_BUILD_ID 132
+
+struct symbols_request {
+    struct fd_request header;
+    char build_id[MAX_BUILD_ID];
+};
+
 struct fd_response {
     // of type "enum request_type"
     unsigned int type;
@@ -56,6 +82,12 @@ struct perf_fd_response {
     int tid;
 };
 
+struct perf_fd_batch_response {
+    struct fd_response header;
+    int count;
+    int errors[MAX_PERF_FD_BATCH];
+};
+
 
 static inline bool socketPathForPid(int pid, struct sockaddr_un *sun, socklen_t *addrlen) {
     sun->sun_path[0] = '\0';
@@ -37,12 +37,19 @@ class FdTransferServer {
   private:
     static int _server;
     static int _peer;
+    static const char* _symbols_dir;
     static int copyFile(const char* src_name, const char* dst_name, mode_t mode);
+    static int copyData(int src, int dst);
+    static bool symbolsPath(const char* build_id, char* path, size_t size);
     static bool sendFd(int fd, struct fd_response *resp, size_t resp_size);
+    static bool sendFds(const int* fds, int count, struct fd_response *resp, size_t resp_size);
+    static int openPerfFd(int peer_pid, int tid, struct perf_event_attr* attr);
+    static ssize_t recvRequest(void* buf, size_t size, int* fd);
 
   public:
     static void closeServer() { close(_server); }
     static void closePeer() { close(_peer); }
+    static bool openSymbolsDir(const char* dir);
     static bool bindServer(struct sockaddr_un *sun, socklen_t addrlen, int accept_timeout);
     static bool acceptPeer(int *peer_pid);
     static bool serveRequests(int peer_pid);
@@ -50,6 +57,22 @@ class FdTransferServer {
 
 int FdTransferServer::_server;
 int FdTransferServer::_peer;
+const char* FdTransferServer::_symbols_dir = NULL;
+
+// Shared by all JVMs of the host, so it must not be a directory someone else controls
+bool FdTransferServer::openSymbolsDir(const char* dir) {
+    struct stat st;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("FdTransfer mkdir()");
+        return false;
+    }
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022) != 0) {
+        fprintf(stderr, "Symbol directory %s is not a private directory, symbol service disabled\n", dir);
+        return false;
+    }
+    _symbols_dir = dir;
+    return true;
+}
 
 bool FdTransferServer::bindServer(struct sockaddr_un *sun, socklen_t addrlen, int accept_timeout) {
     _server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
@@ -116,8 +139,9 @@ bool FdTransferServer::serveRequests(int peer_pid) {
     while (1) {
         unsigned char request_buf[1024];
         struct fd_request *req = (struct fd_request *)request_buf;
+        int req_fd = -1;
 
-        ssize_t ret = recv(_peer, req, sizeof(request_buf), 0);
+        ssize_t ret = recvRequest(req, sizeof(request_buf), &req_fd);
 
         if (ret == 0) {
             // EOF means done
@@ -130,18 +154,8 @@ bool FdTransferServer::serveRequests(int peer_pid) {
         switch (req->type) {
         case PERF_FD: {
             struct perf_fd_request *request = (struct perf_fd_request*)req;
-            int perf_fd = -1;
-            int error;
-
-            // In pid == 0 mode, allow all perf_event_open requests.
-            // Otherwise, verify the thread belongs to PID.
-            if (peer_pid == 0 || syscall(__NR_tgkill, peer_pid, request->tid, 0) == 0) {
-                perf_fd = syscall(__NR_perf_event_open, &request->attr, request->tid, -1, -1, 0);
-                error = perf_fd < 0 ? errno : 0;
-            } else {
-                fprintf(stderr, "Target has requested perf_event_open for TID %d which is not a thread of process %d\n", request->tid, peer_pid);
-                error = ESRCH;
-            }
+            int perf_fd = openPerfFd(peer_pid, request->tid, &request->attr);
+            int error = perf_fd < 0 ? -perf_fd : 0;
 
             // Map the perf buffer here (mapping perf fds may require privileges, and fdtransfer has them while the target application does not
             // necessarily; if pages are already mapped, the same physical pages will be used when the profiler agent maps them again, requiring
@@ -160,6 +174,8 @@ bool FdTransferServer::serveRequests(int peer_pid) {
 
                 ringbuf_index++;
                 ringbuf_index = ringbuf_index % ARRAY_SIZE(perf_mmap_ringbuf);
+            } else {
+                perf_fd = -1;
             }
 
             struct perf_fd_response resp;
@@ -171,6 +187,45 @@ bool FdTransferServer::serveRequests(int peer_pid) {
             break;
         }
 
+        case PERF_FD_BATCH: {
+            struct perf_fd_batch_request *request = (struct perf_fd_batch_request*)req;
+            struct perf_fd_batch_response resp;
+            resp.header.type = req->type;
+            resp.header.error = 0;
+            resp.count = 0;
+
+            int fds[MAX_PERF_FD_BATCH];
+            int fd_count = 0;
+            if (ret < (ssize_t)sizeof(*request) || request->count < 0 || request->count > MAX_PERF_FD_BATCH) {
+                resp.header.error = EINVAL;
+            } else {
+                resp.count = request->count;
+                for (int i = 0; i < request->count; i++) {
+                    int perf_fd = openPerfFd(peer_pid, request->tids[i], &request->attr);
+                    if (perf_fd < 0) {
+                        resp.errors[i] = -perf_fd;
+                        continue;
+                    }
+                    resp.errors[i] = 0;
+                    fds[fd_count++] = perf_fd;
+
+                    // Same as for PERF_FD
+                    void *map_result = mmap(NULL, perf_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, perf_fd, 0);
+                    if (perf_mmap_ringbuf[ringbuf_index] != NULL && perf_mmap_ringbuf[ringbuf_index] != MAP_FAILED) {
+                        (void)munmap(perf_mmap_ringbuf[ringbuf_index], perf_mmap_size);
+                    }
+                    perf_mmap_ringbuf[ringbuf_index] = map_result;
+                    ringbuf_index = (ringbuf_index + 1) % ARRAY_SIZE(perf_mmap_ringbuf);
+                }
+            }
+
+            sendFds(fds, fd_count, &resp.header, sizeof(resp));
+            for (int i = 0; i < fd_count; i++) {
+                close(fds[i]);
+            }
+            break;
+        }
+
         case KALLSYMS_FD: {
             // can't directly pass the fd of /proc/kallsyms, because before Linux 4.15 the permission check
             // was conducted on each read.
@@ -198,10 +253,50 @@ bool FdTransferServer::serveRequests(int peer_pid) {
             break;
         }
 
-        default:
+        case SYMBOLS_FD: {
+            struct symbols_request *request = (struct symbols_request*)req;
+            char path[MAX_PATH];
+            int symbols_fd = -1;
+            int error = ENOENT;
+            if (_symbols_dir == NULL || ret < (ssize_t)sizeof(*request)) {
+                error = ENOSYS;
+            } else if (symbolsPath(request->build_id, path, sizeof(path))) {
+                symbols_fd = open(path, O_RDONLY);
+                error = symbols_fd == -1 ? errno : 0;
+            }
+
+            struct fd_response resp;
+            resp.type = req->type;
+            resp.error = error;
+            sendFd(symbols_fd, &resp, sizeof(resp));
+            close(symbols_fd);
+            break;
+        }
+
+        case SYMBOLS_STORE: {
+            // Tables from a peer are not taken: any process that reaches the socket could
+            // change the symbols every other JVM sees
+            struct fd_response resp;
+            resp.type = req->type;
+            resp.error = EPERM;
+            sendFd(-1, &resp, sizeof(resp));
+            break;
+        }
+
+        default: {
             fprintf(stderr, "Unknown request type %u\n", req->type);
+            // Answer anyway, so that a newer agent does not wait for a timeout
+            struct fd_response resp;
+            resp.type = req->type;
+            resp.error = ENOSYS;
+            sendFd(-1, &resp, sizeof(resp));
             break;
         }
+        }
+
+        if (req_fd != -1) {
+            close(req_fd);
+        }
     }
 
     return false;
@@ -220,17 +315,103 @@ int FdTransferServer::copyFile(const char* src_name, const char* dst_name, mode_
         return result;
     }
 
+    copyData(src, dst);
+
+    close(dst);
+    close(src);
+    return 0;
+}
+
+int FdTransferServer::copyData(int src, int dst) {
     // copy_file_range() doesn't exist in older kernels, sendfile() no longer works in newer ones
     char buf[65536];
     ssize_t r;
     while ((r = read(src, buf, sizeof(buf))) > 0) {
-        ssize_t w = write(dst, buf, r);
-        (void)w;
+        if (write(dst, buf, r) != r) {
+            return EIO;
+        }
     }
+    return r < 0 ? errno : 0;
+}
 
-    close(dst);
-    close(src);
-    return 0;
+// The build-id comes from the peer: only a plain hex name is accepted
+bool FdTransferServer::symbolsPath(const char* build_id, char* path, size_t size) {
+    size_t len = strnlen(build_id, MAX_BUILD_ID);
+    if (len == 0 || len >= MAX_BUILD_ID || strspn(build_id, "0123456789abcdef") != len) {
+        return false;
+    }
+    return snprintf(path, size, "%s/%s.sym", _symbols_dir, build_id) < (int)size;
+}
+
+ssize_t FdTransferServer::recvRequest(void* buf, size_t size, int* fd) {
+    struct msghdr msg = {0};
+
+    struct iovec iov[1];
+    iov[0].iov_base = buf;
+    iov[0].iov_len = size;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ARRAY_SIZE(iov);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    ssize_t ret = recvmsg(_peer, &msg, 0);
+    struct cmsghdr *cmsg = ret > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_len == CMSG_LEN(sizeof(int))
+        && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return ret;
+}
+
+// Returns the fd or a negative errno
+int FdTransferServer::openPerfFd(int peer_pid, int tid, struct perf_event_attr* attr) {
+    // In pid == 0 mode, allow all perf_event_open requests.
+    // Otherwise, verify the thread belongs to PID.
+    if (peer_pid != 0 && syscall(__NR_tgkill, peer_pid, tid, 0) != 0) {
+        fprintf(stderr, "Target has requested perf_event_open for TID %d which is not a thread of process %d\n", tid, peer_pid);
+        return -ESRCH;
+    }
+    int perf_fd = syscall(__NR_perf_event_open, attr, tid, -1, -1, 0);
+    return perf_fd < 0 ? -errno : perf_fd;
+}
+
+bool FdTransferServer::sendFds(const int* fds, int count, struct fd_response *resp, size_t resp_size) {
+    struct msghdr msg = {0};
+
+    struct iovec iov[1];
+    iov[0].iov_base = resp;
+    iov[0].iov_len = resp_size;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ARRAY_SIZE(iov);
+
+    union {
+       char buf[CMSG_SPACE(sizeof(int) * MAX_PERF_FD_BATCH)];
+       struct cmsghdr align;
+    } u;
+
+    if (count > 0) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+
+    ssize_t ret = sendmsg(_peer, &msg, 0);
+    if (ret < 0) {
+        perror("sendmsg()");
+        return false;
+    }
+
+    return true;
 }
 
 bool FdTransferServer::sendFd(int fd, struct fd_response *resp, size_t resp_size) {
@@ -360,11 +541,14 @@ static int path_server(const char *path) {
 }
 
 int main(int argc, const char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <pid>|<path>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <pid>|<path> [<symbol dir>]\n", argv[0]);
         return 1;
     }
 
+    // Symbol tables in the directory are served to all JVMs of the host
+    FdTransferServer::openSymbolsDir(argc == 3 ? argv[2] : SYMBOLS_DIR);
+
     int pid = atoi(argv[1]);
     // 2 modes:
     // pid == 0 - bind on a path and accept requests forever, from any PID, until being killed
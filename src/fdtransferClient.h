@@ -20,12 +20,18 @@
 #ifdef __linux__
 
 #include "fdtransfer/fdtransfer.h"
+#include "mutex.h"
 
 class FdTransferClient {
   private:
     static int _peer;
+    // Requests come from several threads; a response must reach the thread that asked
+    static Mutex _lock;
+    static bool _symbols_service;
+    static bool _batch_service;
 
     static int recvFd(unsigned int request_id, struct fd_response *resp, size_t resp_size);
+    static int requestSymbols(struct symbols_request* request);
 
   public:
     static bool connectToServer(const char *path, int pid);
@@ -38,7 +44,12 @@ class FdTransferClient {
     }
 
     static int requestPerfFd(int *tid, struct perf_event_attr *attr);
+    // Fills fds[i] with the fd of tids[i], or -1 and errors[i]; false if the server has no batches
+    static bool requestPerfFds(int count, const int* tids, struct perf_event_attr* attr, int* fds, int* errors);
     static int requestKallsymsFd();
+
+    // Host-wide symbol service; -1 if the table is not known or the server is older
+    static int requestSymbolsFd(const char* build_id);
 };
 
 #else
@@ -48,6 +59,8 @@ class FdTransferClient {
     static bool connectToServer(const char *path, int pid) { return false; }
     static bool hasPeer() { return false; }
     static void closePeer() { }
+    static bool requestPerfFds(int count, const int* tids, struct perf_event_attr* attr, int* fds, int* errors) { return false; }
+    static int requestSymbolsFd(const char* build_id) { return -1; }
 };
 
 #endif // __linux__
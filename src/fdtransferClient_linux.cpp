@@ -30,9 +30,14 @@
 
 
 int FdTransferClient::_peer = -1;
+Mutex FdTransferClient::_lock;
+bool FdTransferClient::_symbols_service = true;
+bool FdTransferClient::_batch_service = true;
 
 bool FdTransferClient::connectToServer(const char *path, int pid) {
     closePeer();
+    _symbols_service = true;
+    _batch_service = true;
 
     _peer = socket(AF_UNIX, SOCK_SEQPACKET, 0);
     if (_peer == -1) {
@@ -70,6 +75,7 @@ int FdTransferClient::requestPerfFd(int *tid, struct perf_event_attr *attr) {
     request.tid = *tid;
     memcpy(&request.attr, attr, sizeof(request.attr));
 
+    MutexLocker ml(_lock);
     if (send(_peer, &request, sizeof(request), 0) != sizeof(request)) {
         Log::warn("FdTransferClient send(): %s", strerror(errno));
         return -1;
@@ -89,10 +95,75 @@ int FdTransferClient::requestPerfFd(int *tid, struct perf_event_attr *attr) {
     return fd;
 }
 
+bool FdTransferClient::requestPerfFds(int count, const int* tids, struct perf_event_attr* attr, int* fds, int* errors) {
+    struct perf_fd_batch_request request;
+    request.header.type = PERF_FD_BATCH;
+    request.count = count;
+    memcpy(&request.attr, attr, sizeof(request.attr));
+    memcpy(request.tids, tids, count * sizeof(int));
+
+    MutexLocker ml(_lock);
+    if (!_batch_service || count > MAX_PERF_FD_BATCH) {
+        return false;
+    }
+    if (send(_peer, &request, sizeof(request), 0) != sizeof(request)) {
+        Log::warn("FdTransferClient send(): %s", strerror(errno));
+        return false;
+    }
+
+    struct perf_fd_batch_response resp;
+    struct msghdr msg = {0};
+    struct iovec iov[1];
+    iov[0].iov_base = &resp;
+    iov[0].iov_len = sizeof(resp);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ARRAY_SIZE(iov);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_PERF_FD_BATCH)];
+        struct cmsghdr align;
+    } u;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    // Servers without batches never answer; they are asked one tid at a time afterwards
+    struct timeval short_tv = {1, 0};
+    struct timeval tv = {10, 0};
+    setsockopt(_peer, SOL_SOCKET, SO_RCVTIMEO, &short_tv, sizeof(short_tv));
+    ssize_t ret = recvmsg(_peer, &msg, 0);
+    setsockopt(_peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (ret != sizeof(resp) || resp.header.type != PERF_FD_BATCH || resp.header.error != 0 || resp.count != count) {
+        _batch_service = false;
+        return false;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    int received = 0;
+    const int* passed = NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        received = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        passed = (const int*)CMSG_DATA(cmsg);
+    }
+
+    int next = 0;
+    for (int i = 0; i < count; i++) {
+        errors[i] = resp.errors[i];
+        if (errors[i] == 0 && next < received) {
+            memcpy(&fds[i], &passed[next++], sizeof(int));
+        } else {
+            fds[i] = -1;
+            if (errors[i] == 0) errors[i] = EBADF;
+        }
+    }
+    return true;
+}
+
 int FdTransferClient::requestKallsymsFd() {
     struct fd_request request;
     request.type = KALLSYMS_FD;
 
+    MutexLocker ml(_lock);
     if (send(_peer, &request, sizeof(request), 0) != sizeof(request)) {
         Log::warn("FdTransferClient send(): %s", strerror(errno));
         return -1;
@@ -107,6 +178,48 @@ int FdTransferClient::requestKallsymsFd() {
     return fd;
 }
 
+int FdTransferClient::requestSymbolsFd(const char* build_id) {
+    struct symbols_request request;
+    request.header.type = SYMBOLS_FD;
+    strncpy(request.build_id, build_id, sizeof(request.build_id) - 1);
+    request.build_id[sizeof(request.build_id) - 1] = 0;
+    return requestSymbols(&request);
+}
+
+// Servers without the symbol service never answer; after the first timeout
+// the service is not asked again on this connection
+int FdTransferClient::requestSymbols(struct symbols_request* request) {
+    MutexLocker ml(_lock);
+    if (!_symbols_service) {
+        return -1;
+    }
+
+    struct msghdr msg = {0};
+    struct iovec iov[1];
+    iov[0].iov_base = request;
+    iov[0].iov_len = sizeof(*request);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ARRAY_SIZE(iov);
+
+    if (sendmsg(_peer, &msg, 0) != sizeof(*request)) {
+        return -1;
+    }
+
+    struct timeval short_tv = {1, 0};
+    struct timeval tv = {10, 0};
+    setsockopt(_peer, SOL_SOCKET, SO_RCVTIMEO, &short_tv, sizeof(short_tv));
+    struct fd_response resp;
+    resp.type = request->header.type;
+    resp.error = ETIMEDOUT;
+    int result = recvFd(request->header.type, &resp, sizeof(resp));
+    setsockopt(_peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (resp.error == ENOSYS || resp.error == ETIMEDOUT) {
+        _symbols_service = false;
+    }
+    return result;
+}
+
 int FdTransferClient::recvFd(unsigned int type, struct fd_response *resp, size_t resp_size) {
     struct msghdr msg = {0};
 
@@ -15,11 +15,14 @@
  */
 
 #include <algorithm>
+#include <functional>
 #include <vector>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "flameGraph.h"
 #include "incbin.h"
+#include "memoryBudget.h"
 #include "vmEntry.h"
 
 
@@ -72,22 +75,121 @@ class Format {
 };
 
 
-class Node {
-  public:
-    std::string _name;
-    const Trie* _trie;
-
-    Node(const std::string& name, const Trie& trie) : _name(name), _trie(&trie) {
+// Children of a node in the order of output
+struct ByName {
+    bool operator()(const Trie* a, const Trie* b) const {
+        return strcmp(a->_name, b->_name) < 0;
     }
+};
 
-    bool operator<(const Node& other) const {
-        return _trie->_total > other._trie->_total;
+struct ByTotal {
+    bool operator()(const Trie* a, const Trie* b) const {
+        return a->_total > b->_total;
     }
 };
 
+template<class Order>
+static void sortedChildren(const Trie& f, std::vector<const Trie*>& children) {
+    for (const Trie* c = f._child; c != NULL; c = c->_sibling) {
+        children.push_back(c);
+    }
+    std::sort(children.begin(), children.end(), Order());
+}
+
+
+FlameGraph::FlameGraph(const char* title, Counter counter, double minwidth, int max_frames, bool reverse) :
+    _arena(TRIE_CHUNK_SIZE, MEMORY_DUMP),
+    _names(),
+    _index_capacity(TRIE_INDEX_CAPACITY),
+    _index_size(0),
+    _title(title),
+    _counter(counter),
+    _minwidth(minwidth),
+    _max_frames(max_frames),
+    _reverse(reverse) {
+    _index = (Trie**)calloc(_index_capacity, sizeof(Trie*));
+    MemoryBudget::charge(MEMORY_DUMP, _index_capacity * sizeof(Trie*));
+    _root.init("all", NULL);
+    _lost.init("", NULL);
+    _buf[sizeof(_buf) - 1] = 0;
+}
+
+FlameGraph::~FlameGraph() {
+    free(_index);
+    MemoryBudget::release(MEMORY_DUMP, _index_capacity * sizeof(Trie*));
+}
+
+// Names are interned, so their addresses identify them
+u32 FlameGraph::hash(const Trie* parent, const char* name) {
+    u64 h = ((u64)(uintptr_t)parent * 31 + (u64)(uintptr_t)name) * 0x9e3779b97f4a7c15ULL;
+    return (u32)(h >> 32);
+}
+
+void FlameGraph::growIndex() {
+    u32 capacity = _index_capacity * 2;
+    if (!MemoryBudget::reserve(MEMORY_DUMP, capacity * sizeof(Trie*))) {
+        return;
+    }
+    Trie** index = (Trie**)calloc(capacity, sizeof(Trie*));
+    if (index == NULL) {
+        MemoryBudget::release(MEMORY_DUMP, capacity * sizeof(Trie*));
+        return;
+    }
+
+    for (u32 i = 0; i < _index_capacity; i++) {
+        Trie* node = _index[i];
+        if (node != NULL) {
+            u32 slot = hash(node->_parent, node->_name) & (capacity - 1);
+            while (index[slot] != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            index[slot] = node;
+        }
+    }
+
+    free(_index);
+    MemoryBudget::release(MEMORY_DUMP, _index_capacity * sizeof(Trie*));
+    _index = index;
+    _index_capacity = capacity;
+}
+
+Trie* FlameGraph::addChild(Trie* parent, const char* name, u64 value, u64 base) {
+    if (parent == &_lost) {
+        return parent;
+    }
+    parent->_total += value;
+    parent->_base += base;
+
+    const char* key = _names.intern(name);
+    u32 mask = _index_capacity - 1;
+    u32 slot = hash(parent, key) & mask;
+    for (Trie* node; (node = _index[slot]) != NULL; slot = (slot + 1) & mask) {
+        if (node->_parent == parent && node->_name == key) {
+            return node;
+        }
+    }
+
+    Trie* node;
+    if (_index_size >= mask || (node = (Trie*)_arena.alloc(sizeof(Trie))) == NULL) {
+        // Over memlimit: the rest of the stack is not shown
+        return &_lost;
+    }
+    node->init(key, parent);
+    node->_sibling = parent->_child;
+    parent->_child = node;
+    _index[slot] = node;
+
+    if (++_index_size >= _index_capacity / 2) {
+        growIndex();
+    }
+    return node;
+}
 
 void FlameGraph::dump(std::ostream& out, bool tree) {
     _mintotal = _minwidth == 0 && tree ? _root._total / 1000 : (u64)(_root._total * _minwidth / 100);
+    if (!tree && _max_frames > 0) {
+        _mintotal = std::max(_mintotal, frameLimitCutoff());
+    }
     int depth = _root.depth(_mintotal);
 
     if (tree) {
@@ -124,7 +226,7 @@ void FlameGraph::dump(std::ostream& out, bool tree) {
 
         tail = printTill(out, tail, "/*frames:*/");
 
-        printFrame(out, "all", _root, 0, 0);
+        printFrame(out, _root, 0, 0);
 
         tail = printTill(out, tail, "/*highlight:*/");
 
@@ -132,10 +234,11 @@ void FlameGraph::dump(std::ostream& out, bool tree) {
     }
 }
 
-void FlameGraph::printFrame(std::ostream& out, const std::string& name, const Trie& f, int level, u64 x) {
-    std::string name_copy = name;
+void FlameGraph::printFrame(std::ostream& out, const Trie& f, int level, u64 x) {
+    std::string name_copy = f._name;
     int type = frameType(name_copy, f);
     StringUtils::replace(name_copy, '\'', "\\'", 2);
+    appendDelta(name_copy, f);
 
     if (f._inlined | f._c1_compiled | f._interpreted) {
         snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'%s',%llu,%llu,%llu)\n",
@@ -146,31 +249,73 @@ void FlameGraph::printFrame(std::ostream& out, const std::string& name, const Tr
     }
     out << _buf;
 
+    std::vector<const Trie*> children;
+    sortedChildren<ByName>(f, children);
+
     x += f._self;
-    for (std::map<std::string, Trie>::const_iterator it = f._children.begin(); it != f._children.end(); ++it) {
-        if (it->second._total >= _mintotal) {
-            printFrame(out, it->first, it->second, level + 1, x);
+    u64 pruned_total = 0;
+    u64 pruned_frames = 0;
+    for (size_t i = 0; i < children.size(); i++) {
+        const Trie* child = children[i];
+        if (child->_total >= _mintotal) {
+            printFrame(out, *child, level + 1, x);
+            x += child->_total;
+        } else {
+            pruned_total += child->_total;
+            pruned_frames += child->frames();
         }
-        x += it->second._total;
+    }
+
+    // Narrow children go last, merged into one frame of their total width
+    if (pruned_frames > 0) {
+        printPruned(out, level + 1, x, pruned_total, pruned_frames);
     }
 }
 
-void FlameGraph::printTreeFrame(std::ostream& out, const Trie& f, int level) {
-    std::vector<Node> subnodes;
-    for (std::map<std::string, Trie>::const_iterator it = f._children.begin(); it != f._children.end(); ++it) {
-        subnodes.push_back(Node(it->first, it->second));
+void FlameGraph::printPruned(std::ostream& out, int level, u64 x, u64 total, u64 frames) {
+    snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'[pruned %llu frames]')\n",
+             level, x, total, FRAME_NATIVE, frames);
+    out << _buf;
+}
+
+// Lowest total that keeps the number of printed frames within _max_frames.
+// Totals never grow from a parent to its child, so frames above a cutoff form
+// a connected top of the trie; every one of them adds at most one pruned frame.
+u64 FlameGraph::frameLimitCutoff() {
+    std::vector<u64> totals;
+    std::vector<const Trie*> stack(1, &_root);
+    while (!stack.empty()) {
+        const Trie* node = stack.back();
+        stack.pop_back();
+        totals.push_back(node->_total);
+        for (const Trie* c = node->_child; c != NULL; c = c->_sibling) {
+            stack.push_back(c);
+        }
+    }
+
+    size_t keep = _max_frames / 2;
+    if (totals.size() <= (size_t)_max_frames || keep == 0) {
+        return 0;
     }
-    std::sort(subnodes.begin(), subnodes.end());
+
+    std::nth_element(totals.begin(), totals.begin() + keep, totals.end(), std::greater<u64>());
+    return totals[keep] + 1;
+}
+
+void FlameGraph::printTreeFrame(std::ostream& out, const Trie& f, int level) {
+    std::vector<const Trie*> subnodes;
+    sortedChildren<ByTotal>(f, subnodes);
 
     double pct = 100.0 / _root._total;
     for (size_t i = 0; i < subnodes.size(); i++) {
-        std::string name = subnodes[i]._name;
-        const Trie* trie = subnodes[i]._trie;
+        const Trie* trie = subnodes[i];
+        std::string name = trie->_name;
 
         int type = frameType(name, f);
         StringUtils::replace(name, '&', "&amp;", 5);
         StringUtils::replace(name, '<', "&lt;", 4);
         StringUtils::replace(name, '>', "&gt;", 4);
+        appendDelta(name, *trie);
 
         if (_reverse) {
             snprintf(_buf, sizeof(_buf) - 1,
@@ -188,7 +333,7 @@ void FlameGraph::printTreeFrame(std::ostream& out, const Trie& f, int level) {
         }
         out << _buf;
 
-        if (trie->_children.size() > 0) {
+        if (trie->_child != NULL) {
             out << "<ul>\n";
             if (trie->_total >= _mintotal) {
                 printTreeFrame(out, *trie, level + 1);
@@ -206,6 +351,19 @@ const char* FlameGraph::printTill(std::ostream& out, const char* data, const cha
     return pos + strlen(till);
 }
 
+// In a diff, the share of the frame changed by this many percentage points since the baseline.
+// Both profiles are normalized, so windows of different length compare.
+void FlameGraph::appendDelta(std::string& name, const Trie& f) {
+    if (_root._base == 0 || _root._total == 0) {
+        return;
+    }
+
+    double delta = f._total * 100.0 / _root._total - f._base * 100.0 / _root._base;
+    char buf[32];
+    snprintf(buf, sizeof(buf), " [%+.2f%%]", delta);
+    name += buf;
+}
+
 // TODO: Reuse frame type embedded in ASGCT_CallFrame
 int FlameGraph::frameType(std::string& name, const Trie& f) {
     if (f._inlined * 3 >= f._total) {
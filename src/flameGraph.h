@@ -17,32 +17,47 @@
 #ifndef _FLAMEGRAPH_H
 #define _FLAMEGRAPH_H
 
-#include <map>
 #include <string>
 #include <iostream>
 #include "arch.h"
 #include "arguments.h"
+#include "dictionary.h"
+#include "linearAllocator.h"
 #include "vmEntry.h"
 
 
+const size_t TRIE_CHUNK_SIZE = 1024 * 1024;
+const u32 TRIE_INDEX_CAPACITY = 65536;
+
+// A frame of the merged stacks. Nodes are allocated in the arena of their
+// FlameGraph and never freed one by one; the name is interned by the FlameGraph,
+// so nodes with the same name share it. Children form a singly linked list,
+// a child of a given name is found through the FlameGraph index.
 class Trie {
   public:
-    std::map<std::string, Trie> _children;
+    const char* _name;
+    Trie* _parent;
+    Trie* _child;
+    Trie* _sibling;
     u64 _total;
     u64 _self;
+    // Total of the frame in the baseline of a diff
+    u64 _base;
     u64 _inlined, _c1_compiled, _interpreted;
 
-    Trie() : _children(), _total(0), _self(0), _inlined(0), _c1_compiled(0), _interpreted(0) {
-    }
-
-    Trie* addChild(const std::string& key, u64 value) {
-        _total += value;
-        return &_children[key];
+    void init(const char* name, Trie* parent) {
+        _name = name;
+        _parent = parent;
+        _child = NULL;
+        _sibling = NULL;
+        _total = _self = _base = 0;
+        _inlined = _c1_compiled = _interpreted = 0;
     }
 
-    void addLeaf(u64 value) {
+    void addLeaf(u64 value, u64 base) {
         _total += value;
         _self += value;
+        _base += base;
     }
 
     void addCompilationDetails(int bci, u64 counter) {
@@ -54,51 +69,73 @@ class Trie {
         }
     }
 
+    // Children below the cutoff are drawn as one pruned frame
     int depth(u64 cutoff) const {
         if (_total < cutoff) {
             return 0;
         }
 
         int max_depth = 0;
-        for (std::map<std::string, Trie>::const_iterator it = _children.begin(); it != _children.end(); ++it) {
-            int d = it->second.depth(cutoff);
+        for (const Trie* c = _child; c != NULL; c = c->_sibling) {
+            int d = c->_total < cutoff ? 1 : c->depth(cutoff);
             if (d > max_depth) max_depth = d;
         }
         return max_depth + 1;
     }
+
+    u64 frames() const {
+        u64 count = 1;
+        for (const Trie* c = _child; c != NULL; c = c->_sibling) {
+            count += c->frames();
+        }
+        return count;
+    }
 };
 
 
 class FlameGraph {
   private:
+    LinearAllocator _arena;
+    Dictionary _names;
+    // Open addressing table of all nodes but the root, keyed by (parent, name)
+    Trie** _index;
+    u32 _index_capacity;
+    u32 _index_size;
+
     Trie _root;
+    // Takes the stacks that did not fit under memlimit
+    Trie _lost;
     char _buf[4096];
     u64 _mintotal;
 
     const char* _title;
     Counter _counter;
     double _minwidth;
+    int _max_frames;
     bool _reverse;
 
-    void printFrame(std::ostream& out, const std::string& name, const Trie& f, int level, u64 x);
+    static u32 hash(const Trie* parent, const char* name);
+    void growIndex();
+
+    u64 frameLimitCutoff();
+    void printFrame(std::ostream& out, const Trie& f, int level, u64 x);
+    void printPruned(std::ostream& out, int level, u64 x, u64 total, u64 frames);
     void printTreeFrame(std::ostream& out, const Trie& f, int level);
     const char* printTill(std::ostream& out, const char* data, const char* till);
     int frameType(std::string& name, const Trie& f);
+    void appendDelta(std::string& name, const Trie& f);
 
   public:
-    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse) :
-        _root(),
-        _title(title),
-        _counter(counter),
-        _minwidth(minwidth),
-        _reverse(reverse) {
-        _buf[sizeof(_buf) - 1] = 0;
-    }
+    FlameGraph(const char* title, Counter counter, double minwidth, int max_frames, bool reverse);
+    ~FlameGraph();
 
     Trie* root() {
         return &_root;
     }
 
+    // Counts the value in the parent and returns its child of the given name
+    Trie* addChild(Trie* parent, const char* name, u64 value, u64 base);
+
     void dump(std::ostream& out, bool tree);
 };
 
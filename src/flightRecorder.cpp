@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <map>
 #include <string>
+#include <thread>
 #include <arpa/inet.h>
 #include <cxxabi.h>
 #include <errno.h>
@@ -26,15 +28,20 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <unistd.h>
+#include "cgroupCpu.h"
 #include "flightRecorder.h"
 #include "incbin.h"
 #include "jfrMetadata.h"
+#include "jfrStreamer.h"
+#include "memoryBudget.h"
 #include "dictionary.h"
 #include "os.h"
 #include "profiler.h"
 #include "spinLock.h"
+#include "stoppableTask.h"
 #include "symbols.h"
 #include "threadFilter.h"
+#include "traceContext.h"
 #include "tsc.h"
 #include "vmStructs.h"
 
@@ -50,6 +57,7 @@ const int BUFFER_SIZE = 1024;
 const int BUFFER_LIMIT = BUFFER_SIZE - 128;
 const int RECORDING_BUFFER_SIZE = 65536;
 const int RECORDING_BUFFER_LIMIT = RECORDING_BUFFER_SIZE - 4096;
+const int RECORDING_WRITER_INTERVAL_MS = 10;
 const int MAX_STRING_LENGTH = 8191;
 const u64 MAX_JLONG = 0x7fffffffffffffffULL;
 const u64 MIN_JLONG = 0x8000000000000000ULL;
@@ -75,6 +83,8 @@ struct CpuTime {
 struct CpuTimes {
     CpuTime proc;
     CpuTime total;
+    // Wall and usage ns of a cgroup with a CPU quota, real is 0 otherwise
+    CpuTime cgroup;
 };
 
 
@@ -93,6 +103,10 @@ class MethodInfo {
     jvmtiLineNumberEntry* _line_number_table;
     FrameTypeId _type;
 
+    static bool byKey(const MethodInfo* a, const MethodInfo* b) {
+        return a->_key < b->_key;
+    }
+
     jint getLineNumber(jint bci) {
         if (_line_number_table_size == 0) {
             return 0;
@@ -106,12 +120,16 @@ class MethodInfo {
     }
 };
 
+// Counted against memlimit, never refused: a recording must describe every method it refers to
+const u64 METHOD_MAP_ENTRY_SIZE = sizeof(std::pair<jmethodID, MethodInfo>) + MAP_NODE_OVERHEAD;
+
 class MethodMap : public std::map<jmethodID, MethodInfo> {
   public:
     MethodMap() {
     }
 
     ~MethodMap() {
+        MemoryBudget::release(MEMORY_JFR_METHODS, size() * METHOD_MAP_ENTRY_SIZE);
         jvmtiEnv* jvmti = VM::jvmti();
         for (const_iterator it = begin(); it != end(); ++it) {
             jvmtiLineNumberEntry* line_number_table = it->second._line_number_table;
@@ -125,6 +143,8 @@ class MethodMap : public std::map<jmethodID, MethodInfo> {
 class Lookup {
   public:
     MethodMap* _method_map;
+    // Methods referenced by the stack traces of this chunk
+    std::vector<MethodInfo*> _marked;
     Dictionary* _classes;
     Dictionary _packages;
     Dictionary _symbols;
@@ -221,7 +241,7 @@ class Lookup {
 
   public:
     Lookup(MethodMap* method_map, Dictionary* classes) :
-        _method_map(method_map), _classes(classes), _packages(), _symbols() {
+        _method_map(method_map), _marked(), _classes(classes), _packages(), _symbols() {
     }
 
     MethodInfo* resolveMethod(ASGCT_CallFrame& frame) {
@@ -231,10 +251,12 @@ class Lookup {
         bool first_time = mi->_key == 0;
         if (first_time) {
             mi->_key = _method_map->size();
+            MemoryBudget::charge(MEMORY_JFR_METHODS, METHOD_MAP_ENTRY_SIZE);
         }
 
         if (!mi->_mark) {
             mi->_mark = true;
+            _marked.push_back(mi);
             if (method == NULL) {
                 fillNativeMethodInfo(mi, "unknown", NULL);
             } else if (frame.bci == BCI_ERROR) {
@@ -334,6 +356,40 @@ class Buffer {
         put32(u.i);
     }
 
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Varints without a branch per byte: the 7-bit groups are spread into one word,
+    // continuation bits are masked in by length, and 8 bytes are stored at once.
+    // Every buffer keeps more than 8 bytes of slack past its flush limit.
+    void putVar32(u32 v) {
+        if (v <= 0x7f) {
+            _data[_offset++] = (char)v;
+            return;
+        }
+        int len = (31 - __builtin_clz(v)) / 7 + 1;
+        u64 x = v;
+        u64 w = (x & 0x7f) | (x << 1 & 0x7f00) | (x << 2 & 0x7f0000) | (x << 3 & 0x7f000000) | (x << 4 & 0xf00000000ULL);
+        w |= 0x80808080ULL >> (8 * (5 - len));
+        memcpy(_data + _offset, &w, 8);
+        _offset += len;
+    }
+
+    // The 9th byte, if any, carries the top 8 bits whole
+    void putVar64(u64 v) {
+        if (v <= 0x7f) {
+            _data[_offset++] = (char)v;
+            return;
+        }
+        int len = (63 - __builtin_clzll(v)) / 7 + 1;
+        if (len > 9) len = 9;
+        u64 w = (v & 0x7f) | (v << 1 & 0x7f00) | (v << 2 & 0x7f0000) | (v << 3 & 0x7f000000) |
+                (v << 4 & 0x7f00000000ULL) | (v << 5 & 0x7f0000000000ULL) |
+                (v << 6 & 0x7f000000000000ULL) | (v << 7 & 0x7f00000000000000ULL);
+        w |= 0x8080808080808080ULL >> (8 * (9 - len));
+        memcpy(_data + _offset, &w, 8);
+        _data[_offset + 8] = (char)(v >> 56);
+        _offset += len;
+    }
+#else
     void putVar32(u32 v) {
         while (v > 0x7f) {
             _data[_offset++] = (char)v | 0x80;
@@ -356,6 +412,7 @@ class Buffer {
         }
         _data[_offset++] = (char)v;
     }
+#endif
 
     void putUtf8(const char* v) {
         if (v == NULL) {
@@ -395,6 +452,19 @@ class RecordingBuffer : public Buffer {
 };
 
 
+class Recording;
+
+// Writes the buffers that signal handlers have filled, off the sampled threads
+class RecordingWriterTask : public Stoppable {
+  public:
+    RecordingWriterTask(Recording* rec) {
+        this->rec = rec;
+    }
+    void run();
+  private:
+    Recording* rec;
+};
+
 class Recording {
   private:
     static char* _agent_properties;
@@ -402,8 +472,30 @@ class Recording {
     static char* _jvm_flags;
     static char* _java_command;
 
-    RecordingBuffer _buf[CONCURRENCY_LEVEL];
+    RecordingBuffer* _buf;
+    int _buf_count;
+
+    // Event buffers in use per Profiler lock. A full one is swapped for a spare
+    // under _pool_lock and queued for the writer thread; if no spare is left,
+    // the full buffer is discarded and counted in _dropped_buffers.
+    RecordingBuffer* _spare;
+    RecordingBuffer** _active;
+    RecordingBuffer** _free;
+    int _free_count;
+    RecordingBuffer** _full;
+    int _full_head;
+    int _full_count;
+    SpinLock _pool_lock;
+    // Keeps the writer thread off the file while a chunk is finished
+    Mutex _write_lock;
+    volatile u64 _dropped_buffers;
+    RecordingWriterTask* _writer_task;
+    std::thread _writer_thread;
+
     int _fd;
+    // With jfrstream, finished chunks are shipped; a memory file is then reused from the start
+    JfrStreamer* _streamer;
+    bool _rewind;
     char* _master_recording_file;
     off_t _chunk_start;
     ThreadFilter _thread_set;
@@ -432,7 +524,8 @@ class Recording {
     }
 
   public:
-    Recording(int fd, Arguments& args) : _fd(fd), _thread_set(), _method_map() {
+    Recording(int fd, Arguments& args, JfrStreamer* streamer, bool rewind) :
+        _fd(fd), _streamer(streamer), _rewind(rewind), _thread_set(), _method_map() {
         _master_recording_file = args._jfr_sync == NULL ? NULL : strdup(args.file());
         _chunk_start = lseek(_fd, 0, SEEK_END);
         _start_time = OS::micros();
@@ -443,6 +536,22 @@ class Recording {
         _chunk_size = args._chunk_size <= 0 ? MAX_JLONG : (args._chunk_size < 262144 ? 262144 : args._chunk_size);
         _chunk_time = args._chunk_time <= 0 ? MAX_JLONG : (args._chunk_time < 5 ? 5 : args._chunk_time) * 1000000ULL;
 
+        // One buffer per Profiler lock, and as many spares
+        _buf_count = Profiler::instance()->concurrency_level();
+        _buf = new RecordingBuffer[_buf_count];
+        _spare = new RecordingBuffer[_buf_count];
+        _active = new RecordingBuffer*[_buf_count];
+        _free = new RecordingBuffer*[_buf_count * 2];
+        _full = new RecordingBuffer*[_buf_count * 2];
+        for (int i = 0; i < _buf_count; i++) {
+            _active[i] = &_buf[i];
+            _free[i] = &_spare[i];
+        }
+        _free_count = _buf_count;
+        _full_head = 0;
+        _full_count = 0;
+        _dropped_buffers = 0;
+
         _tid = OS::threadId();
         addThread(_tid);
         VM::jvmti()->GetAvailableProcessors(&_available_processors);
@@ -470,11 +579,28 @@ class Recording {
         if (_cpu_monitor_enabled) {
             _last_times.proc.real = OS::getProcessCpuTime(&_last_times.proc.user, &_last_times.proc.system);
             _last_times.total.real = OS::getTotalCpuTime(&_last_times.total.user, &_last_times.total.system);
+            getCgroupCpuTime(&_last_times.cgroup);
         }
+
+        _writer_task = new RecordingWriterTask(this);
+        _writer_thread = std::thread([this] {
+            _writer_task->run();
+        });
     }
 
     ~Recording() {
+        _writer_task->stop();
+        _writer_thread.join();
+        delete _writer_task;
+
         off_t chunk_end = finishChunk();
+        if (_dropped_buffers > 0) {
+            Log::warn("JFR writer could not keep up, %llu event buffers dropped", _dropped_buffers);
+        }
+        if (_streamer != NULL) {
+            _streamer->ship(_fd, _chunk_start, chunk_end);
+            delete _streamer;
+        }
 
         if (_master_recording_file != NULL) {
             appendRecording(_master_recording_file, chunk_end);
@@ -482,17 +608,28 @@ class Recording {
         }
 
         close(_fd);
+        delete[] _full;
+        delete[] _free;
+        delete[] _active;
+        delete[] _spare;
+        delete[] _buf;
     }
 
+    // Runs with all Profiler locks held, so no event is being recorded
     off_t finishChunk() {
-        flush(&_cpu_monitor_buf);
+        MutexLocker ml(_write_lock);
+        writeFullBuffers();
 
-        writeNativeLibraries(_buf);
+        flush(&_cpu_monitor_buf);
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            flush(&_buf[i]);
+        for (int i = 0; i < _buf_count; i++) {
+            flush(_active[i]);
         }
 
+        // Every buffer is empty now, so _buf serves as scratch space as in the constructor
+        writeNativeLibraries(_buf);
+        flush(_buf);
+
         _stop_time = OS::micros();
         _stop_ticks = TSC::ticks();
 
@@ -531,7 +668,14 @@ class Recording {
     }
 
     void switchChunk() {
-        _chunk_start = finishChunk();
+        off_t chunk_end = finishChunk();
+        if (_streamer != NULL) {
+            _streamer->ship(_fd, _chunk_start, chunk_end);
+            if (_rewind && ftruncate(_fd, 0) == 0) {
+                chunk_end = lseek(_fd, 0, SEEK_SET);
+            }
+        }
+        _chunk_start = chunk_end;
         _start_time = _stop_time;
         _start_ticks = _stop_ticks;
         _base_id += 0x1000000;
@@ -547,12 +691,20 @@ class Recording {
         return loadAcquire(_bytes_written) >= _chunk_size || wall_time - _start_time >= _chunk_time;
     }
 
+    static void getCgroupCpuTime(CpuTime* time) {
+        CgroupCpuStats stats;
+        time->real = CgroupCpu::limit() > 0 && CgroupCpu::read(&stats) ? OS::nanotime() : 0;
+        time->user = time->real != 0 ? stats.usage_ns : 0;
+        time->system = 0;
+    }
+
     void cpuMonitorCycle() {
         if (!_cpu_monitor_enabled) return;
 
         CpuTimes times;
         times.proc.real = OS::getProcessCpuTime(&times.proc.user, &times.proc.system);
         times.total.real = OS::getTotalCpuTime(&times.total.user, &times.total.system);
+        getCgroupCpuTime(&times.cgroup);
 
         float proc_user = 0, proc_system = 0, machine_total = 0;
 
@@ -562,7 +714,14 @@ class Recording {
             proc_system = ratio((times.proc.system - _last_times.proc.system) / delta);
         }
 
-        if (times.total.real != (u64)-1 && times.total.real > _last_times.total.real) {
+        if (times.cgroup.real != 0 && _last_times.cgroup.real != 0 && times.cgroup.real > _last_times.cgroup.real) {
+            // Under a CFS quota the machine is what the quota allows, not what /proc/stat shows
+            float delta = (times.cgroup.real - _last_times.cgroup.real) * CgroupCpu::limit();
+            machine_total = ratio((times.cgroup.user - _last_times.cgroup.user) / delta);
+            if (machine_total < proc_user + proc_system) {
+                machine_total = ratio(proc_user + proc_system);
+            }
+        } else if (times.total.real != (u64)-1 && times.total.real > _last_times.total.real) {
             float delta = times.total.real - _last_times.total.real;
             machine_total = ratio(((times.total.user + times.total.system) -
                                    (_last_times.total.user + _last_times.total.system)) / delta);
@@ -593,7 +752,52 @@ class Recording {
     }
 
     Buffer* buffer(int lock_index) {
-        return &_buf[lock_index];
+        return _active[lock_index];
+    }
+
+    // Called in a signal handler instead of flushIfNeeded: a blocking write
+    // there would stall the sampled thread while it holds a Profiler lock
+    void handOffIfNeeded(int lock_index) {
+        RecordingBuffer* buf = _active[lock_index];
+        if (buf->offset() < RECORDING_BUFFER_LIMIT) {
+            return;
+        }
+
+        _pool_lock.lock();
+        if (_free_count == 0) {
+            _pool_lock.unlock();
+            buf->reset();
+            atomicInc(_dropped_buffers);
+            return;
+        }
+        _active[lock_index] = _free[--_free_count];
+        _full[(_full_head + _full_count++) % (_buf_count * 2)] = buf;
+        _pool_lock.unlock();
+    }
+
+    void writeFullBuffers() {
+        while (true) {
+            _pool_lock.lock();
+            if (_full_count == 0) {
+                _pool_lock.unlock();
+                return;
+            }
+            RecordingBuffer* buf = _full[_full_head];
+            _full_head = (_full_head + 1) % (_buf_count * 2);
+            _full_count--;
+            _pool_lock.unlock();
+
+            flush(buf);
+
+            _pool_lock.lock();
+            _free[_free_count++] = buf;
+            _pool_lock.unlock();
+        }
+    }
+
+    void writerCycle() {
+        MutexLocker ml(_write_lock);
+        writeFullBuffers();
     }
 
     bool parseAgentProperties() {
@@ -973,14 +1177,14 @@ class Recording {
     }
 
     void writeStackTraces(Buffer* buf, Lookup* lookup) {
-        std::map<u32, CallTrace*> traces;
+        std::vector<CallTraceRef> traces;
         Profiler::instance()->_call_trace_storage.collectTraces(traces);
 
         buf->putVar32(T_STACK_TRACE);
         buf->putVar32(traces.size());
-        for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
-            CallTrace* trace = it->second;
-            buf->putVar32(it->first);
+        for (std::vector<CallTraceRef>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
+            CallTrace* trace = it->trace;
+            buf->putVar32(it->id);
             buf->putVar32(0);  // truncated
             buf->putVar32(trace->num_frames);
             for (int i = 0; i < trace->num_frames; i++) {
@@ -1005,30 +1209,24 @@ class Recording {
     }
 
     void writeMethods(Buffer* buf, Lookup* lookup) {
-        MethodMap* method_map = lookup->_method_map;
-
-        u32 marked_count = 0;
-        for (MethodMap::const_iterator it = method_map->begin(); it != method_map->end(); ++it) {
-            if (it->second._mark) {
-                marked_count++;
-            }
-        }
+        // Only the methods of this chunk's traces, not the whole map
+        std::vector<MethodInfo*>& marked = lookup->_marked;
+        std::sort(marked.begin(), marked.end(), MethodInfo::byKey);
 
         buf->putVar32(T_METHOD);
-        buf->putVar32(marked_count);
-        for (MethodMap::iterator it = method_map->begin(); it != method_map->end(); ++it) {
-            MethodInfo& mi = it->second;
-            if (mi._mark) {
-                mi._mark = false;
-                buf->putVar32(mi._key);
-                buf->putVar32(mi._class);
-                buf->putVar64(mi._name | _base_id);
-                buf->putVar64(mi._sig | _base_id);
-                buf->putVar32(mi._modifiers);
-                buf->putVar32(0);  // hidden
-                flushIfNeeded(buf);
-            }
+        buf->putVar32(marked.size());
+        for (std::vector<MethodInfo*>::const_iterator it = marked.begin(); it != marked.end(); ++it) {
+            MethodInfo& mi = **it;
+            mi._mark = false;
+            buf->putVar32(mi._key);
+            buf->putVar32(mi._class);
+            buf->putVar64(mi._name | _base_id);
+            buf->putVar64(mi._sig | _base_id);
+            buf->putVar32(mi._modifiers);
+            buf->putVar32(0);  // hidden
+            flushIfNeeded(buf);
         }
+        marked.clear();
     }
 
     void writeClasses(Buffer* buf, Lookup* lookup) {
@@ -1090,6 +1288,13 @@ class Recording {
         buf->putVar32(tid);
         buf->putVar32(call_trace_id);
         buf->putVar32(event->_thread_state);
+        TraceIds ids;
+        if (!TraceContext::get(tid, &ids)) {
+            ids.trace_high = ids.trace_low = ids.span_id = 0;
+        }
+        buf->putVar64(ids.trace_high);
+        buf->putVar64(ids.trace_low);
+        buf->putVar64(ids.span_id);
         buf->put8(start, buf->offset() - start);
     }
 
@@ -1143,6 +1348,52 @@ class Recording {
         buf->put8(start, buf->offset() - start);
     }
 
+    void recordLockWait(Buffer* buf, int tid, u32 call_trace_id, LockWaitSample* event) {
+        int start = buf->skip(1);
+        buf->put8(T_LOCK_WAIT);
+        buf->putVar64(event->_start_time);
+        buf->putVar64(event->_end_time - event->_start_time);
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        buf->putVar32(event->_class_id);
+        buf->putUtf8(event->_lock_type);
+        buf->putVar32(event->_owner_tid);
+        buf->putVar64(event->_address);
+        TraceIds ids;
+        if (!TraceContext::get(tid, &ids)) {
+            ids.trace_high = ids.trace_low = ids.span_id = 0;
+        }
+        buf->putVar64(ids.trace_high);
+        buf->putVar64(ids.trace_low);
+        buf->putVar64(ids.span_id);
+        buf->put8(start, buf->offset() - start);
+        if (event->_owner_tid > 0) {
+            addThread(event->_owner_tid);
+        }
+    }
+
+    void recordIoWait(Buffer* buf, int tid, u32 call_trace_id, IoEvent* event) {
+        int start = buf->skip(1);
+        buf->put8(T_IO_WAIT);
+        buf->putVar64(event->_start_time);
+        buf->putVar64(event->_end_time - event->_start_time);
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        buf->putUtf8(event->_operation);
+        buf->putUtf8(event->_fd_type);
+        buf->putVar32(event->_fd);
+        buf->putVar64(event->_result);
+        buf->putUtf8(event->_peer);
+        TraceIds ids;
+        if (!TraceContext::get(tid, &ids)) {
+            ids.trace_high = ids.trace_low = ids.span_id = 0;
+        }
+        buf->putVar64(ids.trace_high);
+        buf->putVar64(ids.trace_low);
+        buf->putVar64(ids.span_id);
+        buf->put8(start, buf->offset() - start);
+    }
+
     void recordCpuLoad(Buffer* buf, float proc_user, float proc_system, float machine_total) {
         int start = buf->skip(1);
         buf->put8(T_CPU_LOAD);
@@ -1163,19 +1414,40 @@ class Recording {
 char* Recording::_agent_properties = NULL;
 char* Recording::_jvm_args = NULL;
 char* Recording::_jvm_flags = NULL;
+
+void RecordingWriterTask::run() {
+    while (stopRequested() == false) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(RECORDING_WRITER_INTERVAL_MS));
+        rec->writerCycle();
+    }
+}
 char* Recording::_java_command = NULL;
 
 
 Error FlightRecorder::start(Arguments& args, bool reset) {
     const char* filename = args.file();
-    if (filename == NULL || filename[0] == 0) {
+    bool memory_file = (filename == NULL || filename[0] == 0) && args._jfr_stream != NULL;
+    if (!memory_file && (filename == NULL || filename[0] == 0)) {
         return Error("Flight Recorder output file is not specified");
     }
+    if (memory_file && args._jfr_sync != NULL) {
+        return Error("jfrsync needs an output file");
+    }
+
+    JfrStreamer* streamer = NULL;
+    if (args._jfr_stream != NULL) {
+        streamer = new JfrStreamer();
+        if (!streamer->open(args._jfr_stream)) {
+            delete streamer;
+            return Error("Could not connect to jfrstream address");
+        }
+    }
 
     char* filename_tmp = NULL;
     if (args._jfr_sync != NULL) {
         Error error = startMasterRecording(args);
         if (error) {
+            delete streamer;
             return error;
         }
 
@@ -1189,10 +1461,12 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
         TSC::initialize();
     }
 
-    int fd = open(filename, O_CREAT | O_RDWR | (reset ? O_TRUNC : 0), 0644);
+    // Streaming without a file keeps only the chunk being written, in memory
+    int fd = memory_file ? OS::createMemoryFile("async-profiler.jfr") : open(filename, O_CREAT | O_RDWR | (reset ? O_TRUNC : 0), 0644);
     if (fd == -1) {
         free(filename_tmp);
-        return Error("Could not open Flight Recorder output file");
+        delete streamer;
+        return Error(memory_file ? "jfrstream needs file= on this platform" : "Could not open Flight Recorder output file");
     }
 
     if (args._jfr_sync != NULL) {
@@ -1200,7 +1474,7 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
         free(filename_tmp);
     }
 
-    _rec = new Recording(fd, args);
+    _rec = new Recording(fd, args, streamer, memory_file);
     _rec_lock.unlock();
     return Error::OK;
 }
@@ -1325,8 +1599,14 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
             case BCI_PARK:
                 _rec->recordThreadPark(buf, tid, call_trace_id, (LockEvent*)event);
                 break;
+            case BCI_LOCK_WAIT:
+                _rec->recordLockWait(buf, tid, call_trace_id, (LockWaitSample*)event);
+                break;
+            case BCI_IO:
+                _rec->recordIoWait(buf, tid, call_trace_id, (IoEvent*)event);
+                break;
         }
-        _rec->flushIfNeeded(buf);
+        _rec->handOffIfNeeded(lock_index);
         _rec->addThread(tid);
     }
 }
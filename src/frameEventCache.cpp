@@ -1,45 +1,32 @@
 #include "frameEventCache.h"
 #include "arch.h"
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "cgroupCpu.h"
 #include "eventLogger.h"
+#include "gcPhase.h"
+#include "latencyStats.h"
+#include "memoryBudget.h"
+#include "profiledThread.h"
+#include "profiler.h"
 #include "timeUtil.h"
+#include "traceContext.h"
+#include "virtualThreads.h"
+#include "vmStructs.h"
 
 using namespace std;
 
-static const int MAX_SIZE = 4096;
-static const int MAX_DEPTH = 128;
-
-FrameEvent::FrameEvent(int depth) : _thread_id(0), _timestamp(0), _num_frames(0) {
-    _frames = new ASGCT_CallFrame[depth];
-}
-
-FrameEvent::~FrameEvent() {
-    delete []_frames;
-    _frames = NULL;
-}
-
-void FrameEvent::setEvent(int thread_id, int num_frames, ASGCT_CallFrame* frames) {
-    _timestamp = getCurrentTimestamp();
-    _thread_id = thread_id;
-    _num_frames = num_frames;
-    if (_num_frames > MAX_DEPTH) {
-        _num_frames = MAX_DEPTH;
-    }
-    for (int i = 0; i < _num_frames; i++) {
-        _frames[i].bci = frames[i].bci;
-        _frames[i].method_id = frames[i].method_id;
-    }
-}
-
-void FrameEvent::log(FrameName* frameName) {
+void FrameEvent::log(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace) {
     string ret_string = string();
     int depth = 0;
-    for (int i = 0; i < _num_frames; i++) {
+    for (int i = 0; i < trace->num_frames; i++) {
         if (ret_string.empty()) {
             depth = i;
-            ret_string.append(frameName->name(_frames[i]));
+            ret_string.append(dictionary.name(frameName, trace->frames[i]));
         } else {
-            const char* newName = frameName->name(_frames[i]);
+            const char* newName = dictionary.name(frameName, trace->frames[i]);
             // Split stack within 1K.
             if (strlen(newName) + ret_string.length() > 950) {
                 EventLogger::log("kd-stack@%lld!%d!%d!%d!%s", _timestamp, _thread_id, depth, 0, ret_string.c_str());
@@ -54,72 +41,1097 @@ void FrameEvent::log(FrameName* frameName) {
     EventLogger::log("kd-stack@%lld!%d!%d!%d!%s", _timestamp, _thread_id, depth, 1, ret_string.c_str());
 }
 
-FrameEventList::FrameEventList(int capacity, int max_depth) : _capacity(capacity), _count(0) {
-    _events = new P_FrameEvent[capacity];
-    for (int i = 0; i < capacity; i++) {
-        _events[i] = new FrameEvent(max_depth);
+// kd-ids@ts!tid!depth!finish!id!id!...!
+// Every id is defined once by a kd-method@id!name! record.
+void FrameEvent::logIds(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace) {
+    char ids[1024];
+    int len = 0;
+    int depth = 0;
+    for (int i = 0; i < trace->num_frames; i++) {
+        u32 id = dictionary.lookup(frameName, trace->frames[i]);
+        // Split stack within 1K.
+        if (len > 950) {
+            EventLogger::log("kd-ids@%lld!%d!%d!%d!%s", _timestamp, _thread_id, depth, 0, ids);
+            len = 0;
+            depth = i;
+        }
+        len += snprintf(ids + len, sizeof(ids) - len, "%u!", id);
+    }
+    ids[len] = 0;
+    EventLogger::log("kd-ids@%lld!%d!%d!%d!%s", _timestamp, _thread_id, depth, 1, ids);
+}
+
+// Deep stacks are split into several KD_STACK records, like kd-stack lines are
+void FrameEvent::write(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace, EventBuffer& buf) {
+    u32 frame_ids[KD_STACK_FRAMES];
+    int num_frames = trace->num_frames;
+    int depth = 0;
+    do {
+        int count = num_frames - depth < KD_STACK_FRAMES ? num_frames - depth : KD_STACK_FRAMES;
+        for (int i = 0; i < count; i++) {
+            frame_ids[i] = dictionary.lookup(frameName, trace->frames[depth + i]);
+        }
+
+        buf.putVar64(_timestamp);
+        buf.putVar32(_thread_id);
+        buf.putVar32(depth);
+        buf.putVar32(depth + count == num_frames ? 1 : 0);
+        buf.putVar32(count);
+        for (int i = 0; i < count; i++) {
+            buf.putVar32(frame_ids[i]);
+        }
+        buf.commit(KD_STACK);
+        depth += count;
+    } while (depth < num_frames);
+}
+
+// kd-delta@ts!tid!kept!id!id!...!
+// The stack of tid is its previous stack with all but the bottom kept frames
+// replaced by ids, which are listed from the top of the stack.
+bool FrameEvent::logDelta(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace, int kept) {
+    char ids[1024];
+    int len = 0;
+    for (int i = 0; i < trace->num_frames - kept; i++) {
+        if (len > 950) {
+            return false;
+        }
+        len += snprintf(ids + len, sizeof(ids) - len, "%u!", dictionary.lookup(frameName, trace->frames[i]));
+    }
+    ids[len] = 0;
+    EventLogger::log("kd-delta@%lld!%d!%d!%s", _timestamp, _thread_id, kept, ids);
+    return true;
+}
+
+bool FrameEvent::writeDelta(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace, int kept, EventBuffer& buf) {
+    int count = trace->num_frames - kept;
+    if (count > KD_STACK_FRAMES) {
+        return false;
+    }
+
+    u32 frame_ids[KD_STACK_FRAMES];
+    for (int i = 0; i < count; i++) {
+        frame_ids[i] = dictionary.lookup(frameName, trace->frames[i]);
+    }
+
+    buf.putVar64(_timestamp);
+    buf.putVar32(_thread_id);
+    buf.putVar32(kept);
+    buf.putVar32(count);
+    for (int i = 0; i < count; i++) {
+        buf.putVar32(frame_ids[i]);
+    }
+    buf.commit(KD_DELTA);
+    return true;
+}
+
+FrameEventRing::FrameEventRing(int capacity) : _head(0), _tail(0), _capacity(capacity), _owned(true), _dropped(0) {
+    _events = new FrameEvent[capacity];
+}
+
+FrameEventRing::FrameEventRing(FrameEvent* events, int capacity) :
+    _head(0), _tail(0), _capacity(capacity), _events(events), _owned(false), _dropped(0) {
+}
+
+FrameEventRing::~FrameEventRing() {
+    if (_owned) {
+        delete []_events;
+    }
+}
+
+bool FrameEventRing::add(int thread_id, u32 call_trace_id, SampleEvent* sample, bool sample_cpu) {
+    u64 head = _head;
+    if (head - loadAcquire(_tail) >= (u64)_capacity) {
+        // The collector has not caught up yet
+        _dropped++;
+        return false;
+    }
+    FrameEvent* event = &_events[head % _capacity];
+    event->_thread_id = thread_id;
+    event->_call_trace_id = call_trace_id;
+    if (!TraceContext::get(thread_id, &event->_context)) {
+        event->_context.trace_high = event->_context.trace_low = event->_context.span_id = 0;
+    }
+    event->_gc_pause = GcPhase::active() ? GcPhase::collections() + 1 : 0;
+    // Samples read from a perf ring are added by another thread, not by the carrier
+    event->_vthread_id = thread_id == ProfiledThread::currentTid() ? VirtualThreadNames::current() : 0;
+    if (!sample_cpu) {
+        event->_cpu = -1;
+    } else {
+        // Signal handlers run on the CPU of the sampled thread
+        event->_cpu = sample != NULL && sample->_cpu >= 0 ? sample->_cpu : OS::cpuId();
+    }
+    if (sample == NULL) {
+        event->_timestamp = KdClock::now();
+        event->_off_cpu = 0;
+        event->_lock_address = 0;
+        event->_counter_count = 0;
+        event->_data_address = 0;
+        event->_thread_state = THREAD_RUNNING;
+        event->_cpu_time = 0;
+    } else {
+        event->_timestamp = sample->_timestamp != 0 ? sample->_timestamp : KdClock::now();
+        event->_off_cpu = sample->_duration;
+        event->_lock_address = sample->_address;
+        event->_counter_count = sample->_counter_count;
+        for (int i = 0; i < sample->_counter_count; i++) {
+            event->_counters[i] = sample->_counters[i];
+        }
+        event->_data_address = sample->_data_address;
+        event->_data_source = sample->_data_source;
+        event->_thread_state = sample->_thread_state;
+        event->_cpu_time = sample->_cpu_time;
+    }
+    storeRelease(_head, head + 1);
+    return true;
+}
+
+int FrameEventRing::count(u64 head, int skip_thread) {
+    int count = 0;
+    for (u64 seq = _tail; seq < head; seq++) {
+        if (_events[seq % _capacity]._thread_id != skip_thread) count++;
+    }
+    return count;
+}
+
+FrameDictionary::FrameDictionary(EventBuffer& buf) :
+    _methods(METHOD_CACHE_CAPACITY), _next_id(1), _format(KD_FORMAT_TEXT), _buf(buf) {
+}
+
+void FrameDictionary::reset(KdFormat format) {
+    _names.clear();
+    _name_ids.clear();
+    _methods.clear();
+    _pending.clear();
+    _next_id = 1;
+    _format = format;
+}
+
+u32 FrameDictionary::nameId(const char* name) {
+    u32 index = _names.lookup(name);
+    if (index >= _name_ids.size()) {
+        _name_ids.resize(index + TABLE_CAPACITY);
+    }
+    if (_name_ids[index] == 0) {
+        _name_ids[index] = _next_id++;
+        define(_name_ids[index], name);
+    }
+    return _name_ids[index];
+}
+
+u32 FrameDictionary::lookup(FrameName* frameName, ASGCT_CallFrame& frame) {
+    if (frame.method_id != NULL && frame.bci > BCI_NATIVE_FRAME) {
+        u32 type = frameName->annotate() ? FrameType::decode(frame.bci) : 0;
+        bool added;
+        MethodCacheEntry* entry = _methods.lookup(frame.method_id, type, added);
+        if (entry != NULL) {
+            if (added) {
+                entry->id = _next_id++;
+                _pending.push_back(entry);
+            }
+            return entry->id;
+        }
+    }
+    return nameId(frameName->name(frame));
+}
+
+const char* FrameDictionary::name(FrameName* frameName, ASGCT_CallFrame& frame) {
+    if (frame.method_id == NULL || frame.bci <= BCI_NATIVE_FRAME) {
+        return frameName->name(frame);
+    }
+
+    FrameTypeId type = FrameType::decode(frame.bci);
+    bool added;
+    MethodCacheEntry* entry = _methods.lookup(frame.method_id, frameName->annotate() ? type : 0, added);
+    if (entry == NULL) {
+        return frameName->javaFrameName(frame.method_id, type);
+    }
+    if (entry->name == NULL) {
+        entry->name = MethodCache::copyName(frameName->javaFrameName(frame.method_id, type));
+    }
+    return entry->name;
+}
+
+void FrameDictionary::define(u32 id, const char* name) {
+    if (_format == KD_FORMAT_BINARY) {
+        _buf.putVar32(id);
+        _buf.putUtf8(name);
+        _buf.commit(KD_FRAME);
+    } else {
+        EventLogger::log("kd-method@%u!%s!", id, name);
+    }
+}
+
+void FrameDictionary::resolvePending(FrameName* frameName) {
+    for (size_t i = 0; i < _pending.size(); i++) {
+        MethodCacheEntry* entry = _pending[i];
+        define(entry->id, frameName->javaFrameName(entry->method, (FrameTypeId)entry->type));
+    }
+    _pending.clear();
+    _methods.nextEpoch();
+}
+
+FrameEventCache::FrameEventCache(int slots, CallTraceStorage& traces) :
+    _slots(slots), _capacity(0), _max_depth(0), _spills(NULL), _spill_heads(NULL), _spill_map(NULL), _spill_size(0),
+    _format(KD_FORMAT_TEXT), _aggregate(false), _by_state(false), _by_group(false), _delta(false), _sample_cpu(false), _fold_idle(false),
+    _alloc_slots(NULL), _alloc_enabled(false), _alloc_dropped(0), _traces(traces), _dictionary(_buffer), _reported_skipped(0), _reported_dropped(0) {
+    _rings = new FrameEventRing*[slots]();
+    _heads = new u64[slots];
+}
+
+FrameEventCache::~FrameEventCache() {
+    closeSpill();
+    free(_alloc_slots);
+    for (int i = 0; i < _slots; i++) {
+        delete _rings[i];
+    }
+    delete []_rings;
+    delete []_heads;
+}
+
+// Must not be called while samplers may be running
+void FrameEventCache::init(int capacity, int max_depth, bool sample_cpu) {
+    _max_depth = max_depth;
+    _sample_cpu = sample_cpu;
+    if (capacity == _capacity) {
+        return;
+    }
+
+    int ring_size = (capacity + _slots - 1) / _slots;
+    for (int i = 0; i < _slots; i++) {
+        delete _rings[i];
+        _rings[i] = new FrameEventRing(ring_size);
+    }
+    MemoryBudget::release(MEMORY_FRAME_EVENTS, (u64)_capacity * sizeof(FrameEvent));
+    MemoryBudget::charge(MEMORY_FRAME_EVENTS, (u64)capacity * sizeof(FrameEvent));
+    _capacity = capacity;
+}
+
+// kdspill: a full ring overflows into its share of the file instead of dropping
+// samples. The file is mapped shared, so spilled events live in the page cache,
+// where the kernel can write them back under memory pressure, rather than on the heap.
+// Blocks are allocated up front, so that a sampler never waits for the file system.
+bool FrameEventCache::openSpill(const char* path, long size) {
+    closeSpill();
+    if (path == NULL) {
+        return true;
+    }
+
+    long per_slot = size / _slots / (long)sizeof(FrameEvent);
+    if (per_slot <= 0) {
+        return false;
+    }
+    size_t total = (size_t)per_slot * _slots * sizeof(FrameEvent);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return false;
+    }
+
+    void* addr = MAP_FAILED;
+#ifdef __linux__
+    bool allocated = posix_fallocate(fd, 0, total) == 0;
+#else
+    bool allocated = ftruncate(fd, total) == 0;
+#endif
+    if (allocated) {
+        addr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    _spill_map = addr;
+    _spill_size = total;
+    _spills = new FrameEventRing*[_slots];
+    _spill_heads = new u64[_slots];
+    for (int i = 0; i < _slots; i++) {
+        _spills[i] = new FrameEventRing((FrameEvent*)addr + i * per_slot, (int)per_slot);
+    }
+    return true;
+}
+
+void FrameEventCache::closeSpill() {
+    if (_spills == NULL) {
+        return;
+    }
+    for (int i = 0; i < _slots; i++) {
+        delete _spills[i];
+    }
+    delete []_spills;
+    delete []_spill_heads;
+    munmap(_spill_map, _spill_size);
+    _spills = NULL;
+    _spill_heads = NULL;
+    _spill_map = NULL;
+    _spill_size = 0;
+}
+
+void FrameEventCache::clearCounters() {
+    for (int i = 0; i < _slots; i++) {
+        if (_rings[i] != NULL) _rings[i]->_dropped = 0;
+        if (_spills != NULL) _spills[i]->_dropped = 0;
+    }
+}
+
+u64 FrameEventCache::dropped() {
+    u64 dropped = 0;
+    for (int i = 0; i < _slots; i++) {
+        if (_rings[i] != NULL) dropped += _rings[i]->_dropped;
+        if (_spills != NULL) dropped += _spills[i]->_dropped;
     }
+    return dropped;
 }
 
-FrameEventList::~FrameEventList() {
-    delete []_events;
-    _count = 0;
+// The stack is interned by the caller's CallTraceStorage::put, the ring keeps only its id
+void FrameEventCache::add(int slot, int thread_id, u32 call_trace_id, SampleEvent* sample) {
+    FrameEventRing* ring = _rings[slot];
+    if (_spills != NULL) {
+        // Once a slot spills, it keeps spilling until the collector has replayed
+        // the whole spill, so that the events of a slot are logged in order
+        FrameEventRing* spill = _spills[slot];
+        if (!spill->empty() || ring->full()) {
+            spill->add(thread_id, call_trace_id, sample, _sample_cpu);
+            return;
+        }
+    }
+    ring->add(thread_id, call_trace_id, sample, _sample_cpu);
 }
 
-void FrameEventList::addFrameEvent(int thread_id, int num_frames, ASGCT_CallFrame* frames) {
-    int index = atomicInc(_count) % _capacity;
-    _events[index]->setEvent(thread_id, num_frames, frames);
+void FrameEventCache::enableAllocations(bool enable) {
+    if (enable && _alloc_slots == NULL) {
+        _alloc_slots = (KdAllocSlot*)calloc(_slots, sizeof(KdAllocSlot));
+        if (_alloc_slots == NULL) {
+            enable = false;
+        }
+    }
+    if (_alloc_slots != NULL) {
+        for (int i = 0; i < _slots; i++) {
+            KdAllocSlot& s = _alloc_slots[i];
+            s.lock.reset();
+            s.active = 0;
+            s.size[0] = s.size[1] = 0;
+            for (int t = 0; t < 2; t++) {
+                for (int j = 0; j < KD_ALLOC_ENTRIES; j++) {
+                    s.entries[t][j] = KdAllocEntry();
+                }
+            }
+        }
+    }
+    _alloc_dropped = 0;
+    _alloc_enabled = enable;
 }
 
-void FrameEventList::log(FrameName* frameName) {
-    if (_count == 0) {
+// Called by samplers with the Profiler lock of the slot held
+void FrameEventCache::addAllocation(int slot, u32 class_id, int event_type, u32 call_trace_id, u64 bytes) {
+    KdAllocSlot* s = &_alloc_slots[slot];
+    s->lock.lock();
+
+    int active = s->active;
+    KdAllocEntry* entries = s->entries[active];
+    u32 index = (class_id * 31 + call_trace_id) % KD_ALLOC_ENTRIES;
+    for (int i = 0; i < KD_ALLOC_ENTRIES; i++) {
+        KdAllocEntry& e = entries[index];
+        if (e.count == 0) {
+            if (s->size[active] >= KD_ALLOC_ENTRIES * 3 / 4) {
+                break;
+            }
+            s->size[active]++;
+            e.class_id = class_id;
+            e.trace_id = call_trace_id;
+            e.event_type = event_type;
+        } else if (e.class_id != class_id || e.trace_id != call_trace_id || e.event_type != event_type) {
+            index = (index + 1) % KD_ALLOC_ENTRIES;
+            continue;
+        }
+        e.count++;
+        e.bytes += bytes;
+        s->lock.unlock();
         return;
     }
 
+    s->lock.unlock();
+    atomicInc(_alloc_dropped);
+}
+
+// Stacks of a ring that the batch is going to log
+int FrameEventCache::countStacks(FrameEventRing* ring, u64 head, int skip_thread, FrameName* fn) {
+    if (!fn->hasIncludeList() && !fn->hasExcludeList() && !_fold_idle) {
+        return ring->count(head, skip_thread);
+    }
+
+    int count = 0;
+    for (u64 seq = ring->tail(); seq < head; seq++) {
+        FrameEvent* event = ring->at(seq);
+        if (event->_thread_id == skip_thread) {
+            continue;
+        }
+        CallTrace* trace = _traces.findTrace(event->_call_trace_id);
+        if (trace != NULL && !fn->excluded(trace->num_frames, trace->frames) && !foldIdle(event, trace, fn, _idle_counted)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void FrameEventCache::collect(FrameName* fn) {
     int collect_thread = OS::threadId();
-    for (int i = 0; i < _count && i < _capacity; i++) {
+    int stacks = 0;
+
+    u64 ticks = 0, wall = 0;
+    if (KdClock::ticks()) {
+        // Anchor of this interval for all Kindling streams
+        ticks = KdClock::now();
+        wall = getCurrentTimestamp();
+        EventLogger::log("kd-clk@%llu!%llu!%llu!", ticks, wall, KdClock::frequency());
+    }
+
+    reportLoss();
+    LatencyStats::report();
+    CgroupCpu::report();
+
+    bool allocations = _alloc_enabled && logAllocations(fn);
+
+    _fold_idle = fn->hasIdleList() && !_aggregate;
+    _idle_counted.clear();
+    _idle_folds.clear();
+
+    for (int i = 0; i < _slots; i++) {
+        // The spill first: whatever a ring took after that is newer than the spill
+        if (_spills != NULL) {
+            _spill_heads[i] = _spills[i]->head();
+        }
+        _heads[i] = _rings[i]->head();
+        if (_format == KD_FORMAT_BINARY) {
+            stacks += countStacks(_rings[i], _heads[i], collect_thread, fn);
+            if (_spills != NULL) {
+                stacks += countStacks(_spills[i], _spill_heads[i], collect_thread, fn);
+            }
+        }
+    }
+
+    if (_aggregate) {
+        aggregate(collect_thread, fn);
+        return;
+    }
+
+    if (_format == KD_FORMAT_BINARY) {
+        if (stacks == 0) {
+            if (allocations) {
+                _dictionary.resolvePending(fn);
+                _buffer.flush();
+            }
+            return;
+        }
+        if (ticks != 0) {
+            _buffer.putVar64(ticks);
+            _buffer.putVar64(wall);
+            _buffer.putVar64(KdClock::frequency());
+            _buffer.commit(KD_CLOCK);
+        }
+        _buffer.putVar64(KdClock::now());
+        _buffer.putVar32(stacks);
+        _buffer.commit(KD_BATCH);
+    }
+
+    for (int i = 0; i < _slots; i++) {
+        logRing(_rings[i], _heads[i], collect_thread, fn);
+        if (_spills != NULL) {
+            if (logRing(_spills[i], _spill_heads[i], collect_thread, fn) > 0) {
+                releaseSpill(i);
+            }
+        }
+    }
+    logIdleFolds();
+    _dictionary.resolvePending(fn);
+
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.flush();
+    }
+}
+
+// Returns how many events the ring had up to head
+u64 FrameEventCache::logRing(FrameEventRing* ring, u64 head, int skip_thread, FrameName* fn) {
+    u64 tail = ring->tail();
+    for (u64 seq = tail; seq < head; seq++) {
+        FrameEvent* event = ring->at(seq);
         // Ignore collect thread.
-        if (collect_thread != _events[i]->_thread_id) {
-            _events[i]->log(frameName);
+        if (event->_thread_id == skip_thread) {
+            continue;
+        }
+        CallTrace* trace = _traces.findTrace(event->_call_trace_id);
+        if (trace != NULL && !fn->excluded(trace->num_frames, trace->frames) && !foldIdle(event, trace, fn, _idle_folds)) {
+            logEvent(event, trace, fn);
         }
     }
-    _count = 0;
+    ring->release(head);
+    return head - tail;
 }
 
-FrameEventCache::FrameEventCache() : _write_index(0) {
-    _list = new P_FrameEventList[2];
-    _list[0] = new FrameEventList(MAX_SIZE, MAX_DEPTH);
-    _list[1] = new FrameEventList(MAX_SIZE, MAX_DEPTH);
+// kdidle: the first idle sample of a thread in an interval is logged with its stack,
+// later ones are only counted, along with their CPU time. Samples that carry values of
+// their own, like off-CPU time, counters or a virtual thread, are never folded.
+// countStacks and logRing see the events in the same order, so both fold the same samples.
+bool FrameEventCache::foldIdle(FrameEvent* event, CallTrace* trace, FrameName* fn, std::map<int, FrameAggregate>& folds) {
+    if (!_fold_idle || event->_off_cpu != 0 || event->_counter_count != 0 || event->_data_address != 0 ||
+        event->_vthread_id != 0) {
+        return false;
+    }
+    if (!fn->idle(trace->num_frames, trace->frames)) {
+        return false;
+    }
+
+    FrameAggregate& fold = folds[event->_thread_id];
+    if (fold.count++ == 0) {
+        fold.first = event->_timestamp;
+        fold.last = event->_timestamp;
+        return false;
+    }
+    fold.last = event->_timestamp;
+    fold.cpu_time += event->_cpu_time;
+    return true;
 }
 
-FrameEventCache::~FrameEventCache() {
-    delete []_list;
+// kd-idle@tid!count!first_ts!last_ts![cpu_ns!]
+// Follows the batch that logged the first idle stack of tid; count more idle samples
+// of the thread were taken after the one at first_ts, up to last_ts, and not sent.
+// cpu_ns, present when not zero, is the CPU time those samples carried in kd-ct.
+void FrameEventCache::logIdleFolds() {
+    for (std::map<int, FrameAggregate>::const_iterator it = _idle_folds.begin(); it != _idle_folds.end(); ++it) {
+        const FrameAggregate& fold = it->second;
+        if (fold.count <= 1) {
+            continue;
+        }
+        if (_format == KD_FORMAT_BINARY) {
+            _buffer.putVar32(it->first);
+            _buffer.putVar64(fold.count - 1);
+            _buffer.putVar64(fold.first);
+            _buffer.putVar64(fold.last);
+            if (fold.cpu_time != 0) {
+                _buffer.putVar64(fold.cpu_time);
+            }
+            _buffer.commit(KD_IDLE);
+        } else if (fold.cpu_time != 0) {
+            EventLogger::log("kd-idle@%d!%llu!%llu!%llu!%llu!", it->first, fold.count - 1, fold.first, fold.last,
+                             fold.cpu_time);
+        } else {
+            EventLogger::log("kd-idle@%d!%llu!%llu!%llu!", it->first, fold.count - 1, fold.first, fold.last);
+        }
+    }
 }
 
-void FrameEventCache::add(int thread_id, int num_frames, ASGCT_CallFrame* frames) {
-    _list[_write_index]->addFrameEvent(thread_id, num_frames, frames);
+// Replayed pages are unmapped, so the spill takes no resident memory between bursts.
+// This is safe while the sampler writes again: the file keeps what it writes.
+void FrameEventCache::releaseSpill(int slot) {
+    FrameEventRing* spill = _spills[slot];
+    if (spill->head() != _spill_heads[slot]) {
+        return;  // still spilling
+    }
+    size_t slot_size = _spill_size / _slots;
+    uintptr_t start = (uintptr_t)_spill_map + slot * slot_size;
+    uintptr_t page_start = (start + OS::page_size - 1) & ~(OS::page_size - 1);
+    uintptr_t page_end = (start + slot_size) & ~(OS::page_size - 1);
+    if (page_end > page_start) {
+        madvise((void*)page_start, page_end - page_start, MADV_DONTNEED);
+    }
 }
 
-void FrameEventCache::collect(FrameName* fn) {
-    FrameEventList* list = _list[_write_index];
-    _write_index = 1 - _write_index;
-    list->log(fn);
+// kd-loss@total!skipped!dropped!
+// Samples taken, skipped because all tried sample buffers were busy, and dropped
+// because a ring was full; counted since profiling started and sent when a loss grows.
+void FrameEventCache::reportLoss() {
+    Profiler* profiler = Profiler::instance();
+    u64 skipped = profiler->skipped_samples();
+    u64 dropped = this->dropped();
+    if (skipped != _reported_skipped || dropped != _reported_dropped) {
+        EventLogger::log("kd-loss@%llu!%llu!%llu!", profiler->total_samples(), skipped, dropped);
+        _reported_skipped = skipped;
+        _reported_dropped = dropped;
+    }
+}
+
+// Number of frames shared by the bottoms of two stacks
+static int commonBottom(CallTrace* a, CallTrace* b) {
+    int i = a->num_frames - 1;
+    int j = b->num_frames - 1;
+    while (i >= 0 && j >= 0 && a->frames[i].bci == b->frames[j].bci && a->frames[i].method_id == b->frames[j].method_id) {
+        i--;
+        j--;
+    }
+    return a->num_frames - 1 - i;
+}
+
+// kd-off@ts!tid!duration_ns!lock_address!
+// Precedes the stack of an off-CPU sample; ts is when the thread ran again.
+// A non-zero lock_address joins the sample with the kd-jf wait of that thread.
+void FrameEventCache::logOffCpu(FrameEvent* event) {
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.putVar64(event->_timestamp);
+        _buffer.putVar32(event->_thread_id);
+        _buffer.putVar64(event->_off_cpu);
+        _buffer.putVar64(event->_lock_address);
+        _buffer.commit(KD_OFFCPU);
+    } else {
+        EventLogger::log("kd-off@%llu!%d!%llu!%llu!", event->_timestamp, event->_thread_id,
+                         event->_off_cpu, (u64)event->_lock_address);
+    }
+}
+
+// kd-ctr@ts!tid!value!value!...!
+// Precedes the stack of a sample taken with counters=...; the values are
+// what each group follower counted since the previous sample of the thread.
+void FrameEventCache::logCounters(FrameEvent* event) {
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.putVar64(event->_timestamp);
+        _buffer.putVar32(event->_thread_id);
+        _buffer.putVar32(event->_counter_count);
+        for (int i = 0; i < event->_counter_count; i++) {
+            _buffer.putVar64(event->_counters[i]);
+        }
+        _buffer.commit(KD_COUNTERS);
+    } else {
+        char buf[256];
+        int len = snprintf(buf, sizeof(buf), "kd-ctr@%llu!%d!", event->_timestamp, event->_thread_id);
+        for (int i = 0; i < event->_counter_count; i++) {
+            len += snprintf(buf + len, sizeof(buf) - len, "%llu!", event->_counters[i]);
+        }
+        EventLogger::log("%s", buf);
+    }
+}
+
+// kd-mem@ts!tid!address!data_source!area!
+// Precedes the stack of a precise memory sample. data_source is perf_mem_data_src
+// as reported by the kernel; area is H for the Java heap, C for the code cache
+// and N for anything else (native memory, stacks, metaspace).
+void FrameEventCache::logDataAddress(FrameEvent* event) {
+    const void* address = (const void*)event->_data_address;
+    char area = JavaHeap::contains(address) ? 'H' : CodeHeap::contains(address) ? 'C' : 'N';
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.putVar64(event->_timestamp);
+        _buffer.putVar32(event->_thread_id);
+        _buffer.putVar64(event->_data_address);
+        _buffer.putVar64(event->_data_source);
+        _buffer.putVar32(area);
+        _buffer.commit(KD_MEMORY);
+    } else {
+        EventLogger::log("kd-mem@%llu!%d!%llu!%llu!%c!", event->_timestamp, event->_thread_id,
+                         (u64)event->_data_address, event->_data_source, area);
+    }
+}
+
+// kd-ctx@ts!tid!trace_id!span_id!
+// Precedes the stack of a sample taken while the thread had a trace context;
+// trace_id is 32 and span_id 16 hex digits, as in W3C traceparent.
+void FrameEventCache::logContext(FrameEvent* event) {
+    const TraceIds& ids = event->_context;
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.putVar64(event->_timestamp);
+        _buffer.putVar32(event->_thread_id);
+        _buffer.putVar64(ids.trace_high);
+        _buffer.putVar64(ids.trace_low);
+        _buffer.putVar64(ids.span_id);
+        _buffer.commit(KD_CONTEXT);
+    } else {
+        EventLogger::log("kd-ctx@%llu!%d!%016llx%016llx!%016llx!", event->_timestamp, event->_thread_id,
+                         ids.trace_high, ids.trace_low, ids.span_id);
+    }
+}
+
+void FrameEventCache::logEvent(FrameEvent* event, CallTrace* trace, FrameName* fn) {
+    u64 start = LatencyStats::start();
+    logRecords(event, trace, fn);
+    LatencyStats::add(LATENCY_EVENT_LOG, start);
+}
+
+// kd-gc@ts!tid!pause!
+// Precedes the stack of a sample taken during a stop-the-world collection;
+// pause numbers the collections reported by JVM TI since the VM started.
+void FrameEventCache::logGcPause(FrameEvent* event) {
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.putVar64(event->_timestamp);
+        _buffer.putVar32(event->_thread_id);
+        _buffer.putVar32(event->_gc_pause);
+        _buffer.commit(KD_GC);
+    } else {
+        EventLogger::log("kd-gc@%llu!%d!%u!", event->_timestamp, event->_thread_id, event->_gc_pause);
+    }
+}
+
+// kd-cpu@ts!tid!cpu!
+// Precedes the stack of every sample with samplecpu. Together with kd-cg it tells
+// a hot method from one that only looks hot because its CPU was taken away.
+void FrameEventCache::logCpu(FrameEvent* event) {
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.putVar64(event->_timestamp);
+        _buffer.putVar32(event->_thread_id);
+        _buffer.putVar32(event->_cpu);
+        _buffer.commit(KD_CPU);
+    } else {
+        EventLogger::log("kd-cpu@%llu!%d!%d!", event->_timestamp, event->_thread_id, event->_cpu);
+    }
+}
+
+// kd-vt@ts!tid!vthread_id!
+// Precedes the stack of a sample taken while a virtual thread was mounted on the carrier tid;
+// the name of the virtual thread comes in kd-vtm once a lock event has seen it.
+void FrameEventCache::logVirtualThread(FrameEvent* event) {
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.putVar64(event->_timestamp);
+        _buffer.putVar32(event->_thread_id);
+        _buffer.putVar64(event->_vthread_id);
+        _buffer.commit(KD_VTHREAD);
+    } else {
+        EventLogger::log("kd-vt@%llu!%d!%lld!", event->_timestamp, event->_thread_id, (long long)event->_vthread_id);
+    }
+}
+
+// kd-ct@ts!tid!cpu_ns!
+// Precedes the stack of an itimer or wall sample: the CPU time the thread used since its
+// previous sample. Summed up, it gives exact CPU totals however coarse the interval is.
+void FrameEventCache::logCpuTime(FrameEvent* event) {
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.putVar64(event->_timestamp);
+        _buffer.putVar32(event->_thread_id);
+        _buffer.putVar64(event->_cpu_time);
+        _buffer.commit(KD_CPUTIME);
+    } else {
+        EventLogger::log("kd-ct@%llu!%d!%llu!", event->_timestamp, event->_thread_id, event->_cpu_time);
+    }
+}
+
+void FrameEventCache::logRecords(FrameEvent* event, CallTrace* trace, FrameName* fn) {
+    if (event->_off_cpu != 0) {
+        logOffCpu(event);
+    }
+    if (event->_counter_count != 0) {
+        logCounters(event);
+    }
+    if (event->_data_address != 0) {
+        logDataAddress(event);
+    }
+    if (!event->_context.empty()) {
+        logContext(event);
+    }
+    if (event->_gc_pause != 0) {
+        logGcPause(event);
+    }
+    if (event->_cpu >= 0) {
+        logCpu(event);
+    }
+    if (event->_vthread_id != 0) {
+        logVirtualThread(event);
+    }
+    if (event->_cpu_time != 0) {
+        logCpuTime(event);
+    }
+
+    if (_delta) {
+        // Consecutive samples of a thread mostly differ only near the top of the stack
+        if (_last_traces.size() >= KD_DELTA_MAX_THREADS) {
+            _last_traces.clear();
+        }
+        std::map<int, u32>::iterator it = _last_traces.find(event->_thread_id);
+        CallTrace* last = it == _last_traces.end() ? NULL : _traces.findTrace(it->second);
+        _last_traces[event->_thread_id] = event->_call_trace_id;
+
+        // A stack without a delta replaces the previous stack of the thread
+        if (last != NULL) {
+            int kept = commonBottom(trace, last);
+            if (_format == KD_FORMAT_BINARY ? event->writeDelta(fn, _dictionary, trace, kept, _buffer)
+                                            : event->logDelta(fn, _dictionary, trace, kept)) {
+                return;
+            }
+        }
+    }
+
+    if (_format == KD_FORMAT_BINARY) {
+        event->write(fn, _dictionary, trace, _buffer);
+    } else if (_format == KD_FORMAT_IDS || _delta) {
+        event->logIds(fn, _dictionary, trace);
+    } else {
+        event->log(fn, _dictionary, trace);
+    }
+}
+
+u64 FrameEventCache::aggregateRing(FrameEventRing* ring, u64 head, int skip_thread, FrameName* fn) {
+    u64 tail = ring->tail();
+    for (u64 seq = tail; seq < head; seq++) {
+        FrameEvent* event = ring->at(seq);
+        u32 trace_id = event->_call_trace_id;
+        if (event->_thread_id == skip_thread) {
+            continue;
+        }
+        if (!acceptTrace(trace_id, fn)) {
+            continue;
+        }
+
+        u32 group = _by_state ? (u32)event->_thread_state :
+                    _by_group ? groupOf(event->_thread_id) : (u32)event->_thread_id;
+        FrameAggregate& agg = _aggregates[(u64)group << 32 | trace_id];
+        if (agg.count++ == 0) {
+            agg.first = event->_timestamp;
+        }
+        agg.last = event->_timestamp;
+        agg.cpu_time += event->_cpu_time;
+    }
+    ring->release(head);
+    return head - tail;
+}
+
+// Names are read once per interval, so a reused tid does not keep the group of an exited thread
+u32 FrameEventCache::groupOf(int tid) {
+    std::map<int, u32>::const_iterator it = _thread_groups.find(tid);
+    if (it != _thread_groups.end()) {
+        return it->second;
+    }
+
+    char name[64];
+    char group[64];
+    if (!OS::threadName(tid, name, sizeof(name))) {
+        strcpy(name, "[unknown]");
+    }
+    OS::threadGroup(name, group, sizeof(group));
+
+    std::map<std::string, u32>::const_iterator g = _group_ids.find(group);
+    u32 id;
+    if (g != _group_ids.end()) {
+        id = g->second;
+    } else {
+        id = (u32)_group_names.size();
+        _group_ids[group] = id;
+        _group_names.push_back(group);
+    }
+    _thread_groups[tid] = id;
+    return id;
+}
+
+// Defines the trace on first use; false if it is gone or excluded by filters
+bool FrameEventCache::acceptTrace(u32 trace_id, FrameName* fn) {
+    if (trace_id >= _defined_traces.size() || _defined_traces[trace_id] == TRACE_UNSEEN) {
+        CallTrace* trace = _traces.findTrace(trace_id);
+        if (trace == NULL) {
+            return false;
+        }
+        if (fn->excluded(trace->num_frames, trace->frames)) {
+            markTrace(trace_id, TRACE_EXCLUDED);
+        } else {
+            defineTrace(trace_id, trace->num_frames, trace->frames, fn);
+        }
+    }
+    return _defined_traces[trace_id] != TRACE_EXCLUDED;
+}
+
+// kd-alloc@ts!class!trace!count!bytes!
+// Sampled allocations of the interval per allocated class and stack. class is the frame id
+// of the class name, as in allocation stacks: outside of TLAB it is another frame with
+// styles that mark the kind. Traces are defined by kd-trace, like with kdaggregate.
+bool FrameEventCache::logAllocations(FrameName* fn) {
+    std::map<u64, KdAllocTotal> totals;
+    for (int i = 0; i < _slots; i++) {
+        KdAllocSlot* s = &_alloc_slots[i];
+        s->lock.lock();
+        int filled = s->active;
+        s->active = filled ^ 1;
+        s->lock.unlock();
+
+        if (s->size[filled] == 0) {
+            continue;
+        }
+        KdAllocEntry* entries = s->entries[filled];
+        for (int j = 0; j < KD_ALLOC_ENTRIES; j++) {
+            KdAllocEntry& e = entries[j];
+            if (e.count == 0 || !acceptTrace(e.trace_id, fn)) {
+                continue;
+            }
+            u32 class_frame = 0;
+            if (e.class_id != 0) {
+                ASGCT_CallFrame frame;
+                frame.bci = e.event_type;
+                frame.method_id = (jmethodID)(uintptr_t)e.class_id;
+                class_frame = _dictionary.lookup(fn, frame);
+            }
+            KdAllocTotal& total = totals[(u64)class_frame << 32 | e.trace_id];
+            total.count += e.count;
+            total.bytes += e.bytes;
+        }
+        memset(entries, 0, sizeof(s->entries[filled]));
+        s->size[filled] = 0;
+    }
+
+    if (totals.empty()) {
+        return false;
+    }
+
+    u64 now = KdClock::now();
+    for (std::map<u64, KdAllocTotal>::const_iterator it = totals.begin(); it != totals.end(); ++it) {
+        u32 class_frame = (u32)(it->first >> 32);
+        u32 trace_id = (u32)it->first;
+        if (_format == KD_FORMAT_BINARY) {
+            _buffer.putVar64(now);
+            _buffer.putVar32(class_frame);
+            _buffer.putVar32(trace_id);
+            _buffer.putVar64(it->second.count);
+            _buffer.putVar64(it->second.bytes);
+            _buffer.commit(KD_ALLOC);
+        } else {
+            EventLogger::log("kd-alloc@%llu!%u!%u!%llu!%llu!", now, class_frame, trace_id, it->second.count, it->second.bytes);
+        }
+    }
+    return true;
 }
 
-void FrameEventCache::startCollectThreadTask(FrameName* fn, long interval) {
-    _collect_frame_task = new CollectFrameEventTask(this, fn, interval);
-    _collect_frame_thread = std::thread([&]{
-        VM::attachThread("AsyncProfiler-Collect-Cpu");
-        _collect_frame_task->run();
-        VM::detachThread();
-    });
+// kdaggregate: samples are grouped by thread and CallTraceStorage id.
+// Every trace is defined once per session, then each interval reports
+//     kd-agg@tid!trace!count!first_ts!last_ts![cpu_ns!]
+// with cpu_ns, the CPU time of the samples in kd-ct terms, when it is not zero.
+// kdaggregate=group groups by thread group instead, the thread name with its
+// digits replaced as in kd-rqh, so that the threads of a pool share a record:
+//     kd-grp@group!trace!count!first_ts!last_ts![cpu_ns!]
+// kdstates groups by thread state instead, so the size of the report depends
+// on what the threads are doing rather than on how many of them there are:
+//     kd-st@state!trace!count!
+// where state is R for running and S for sleeping in a syscall.
+void FrameEventCache::aggregate(int skip_thread, FrameName* fn) {
+    _aggregates.clear();
+    _thread_groups.clear();
+    _group_ids.clear();
+    _group_names.clear();
+    for (int i = 0; i < _slots; i++) {
+        aggregateRing(_rings[i], _heads[i], skip_thread, fn);
+        if (_spills != NULL && aggregateRing(_spills[i], _spill_heads[i], skip_thread, fn) > 0) {
+            releaseSpill(i);
+        }
+    }
+    _dictionary.resolvePending(fn);
+
+    if (_format == KD_FORMAT_BINARY && !_aggregates.empty()) {
+        _buffer.putVar64(KdClock::now());
+        _buffer.putVar32((u32)_aggregates.size());
+        _buffer.commit(KD_BATCH);
+    }
+    for (std::map<u64, FrameAggregate>::const_iterator it = _aggregates.begin(); it != _aggregates.end(); ++it) {
+        int tid = (int)(it->first >> 32);
+        u32 trace_id = (u32)it->first;
+        const FrameAggregate& agg = it->second;
+        if (_by_state) {
+            char state = tid == THREAD_SLEEPING ? 'S' : 'R';
+            if (_format == KD_FORMAT_BINARY) {
+                _buffer.putVar32(state);
+                _buffer.putVar32(trace_id);
+                _buffer.putVar64(agg.count);
+                _buffer.commit(KD_STATES);
+            } else {
+                EventLogger::log("kd-st@%c!%u!%llu!", state, trace_id, agg.count);
+            }
+        } else if (_by_group) {
+            const char* group = _group_names[tid].c_str();
+            if (_format == KD_FORMAT_BINARY) {
+                _buffer.putVar32(trace_id);
+                _buffer.putVar64(agg.count);
+                _buffer.putVar64(agg.first);
+                _buffer.putVar64(agg.last);
+                _buffer.putVar64(agg.cpu_time);
+                _buffer.putUtf8(group);
+                _buffer.commit(KD_GROUPS);
+            } else if (agg.cpu_time != 0) {
+                EventLogger::log("kd-grp@%s!%u!%llu!%llu!%llu!%llu!", group, trace_id, agg.count, agg.first, agg.last,
+                                 agg.cpu_time);
+            } else {
+                EventLogger::log("kd-grp@%s!%u!%llu!%llu!%llu!", group, trace_id, agg.count, agg.first, agg.last);
+            }
+        } else if (_format == KD_FORMAT_BINARY) {
+            _buffer.putVar32(tid);
+            _buffer.putVar32(trace_id);
+            _buffer.putVar64(agg.count);
+            _buffer.putVar64(agg.first);
+            _buffer.putVar64(agg.last);
+            if (agg.cpu_time != 0) {
+                _buffer.putVar64(agg.cpu_time);
+            }
+            _buffer.commit(KD_SAMPLES);
+        } else if (agg.cpu_time != 0) {
+            EventLogger::log("kd-agg@%d!%u!%llu!%llu!%llu!%llu!", tid, trace_id, agg.count, agg.first, agg.last,
+                             agg.cpu_time);
+        } else {
+            EventLogger::log("kd-agg@%d!%u!%llu!%llu!%llu!", tid, trace_id, agg.count, agg.first, agg.last);
+        }
+    }
+
+    if (_format == KD_FORMAT_BINARY) {
+        _buffer.flush();
+    }
+}
+
+void FrameEventCache::markTrace(u32 trace_id, TraceState state) {
+    if (trace_id >= _defined_traces.size()) {
+        _defined_traces.resize(trace_id + TABLE_CAPACITY, TRACE_UNSEEN);
+    }
+    _defined_traces[trace_id] = state;
+}
+
+// kd-trace@trace!depth!finish!id!id!...!, split within 1K like kd-ids
+void FrameEventCache::defineTrace(u32 trace_id, int num_frames, ASGCT_CallFrame* frames, FrameName* fn) {
+    markTrace(trace_id, TRACE_DEFINED);
+
+    int depth = 0;
+    if (_format == KD_FORMAT_BINARY) {
+        u32 frame_ids[KD_STACK_FRAMES];
+        do {
+            int count = num_frames - depth < KD_STACK_FRAMES ? num_frames - depth : KD_STACK_FRAMES;
+            for (int i = 0; i < count; i++) {
+                frame_ids[i] = _dictionary.lookup(fn, frames[depth + i]);
+            }
+            _buffer.putVar32(trace_id);
+            _buffer.putVar32(depth);
+            _buffer.putVar32(depth + count == num_frames ? 1 : 0);
+            _buffer.putVar32(count);
+            for (int i = 0; i < count; i++) {
+                _buffer.putVar32(frame_ids[i]);
+            }
+            _buffer.commit(KD_TRACE);
+            depth += count;
+        } while (depth < num_frames);
+        return;
+    }
+
+    char ids[1024];
+    int len = 0;
+    for (int i = 0; i < num_frames; i++) {
+        u32 id = _dictionary.lookup(fn, frames[i]);
+        if (len > 950) {
+            EventLogger::log("kd-trace@%u!%d!%d!%s", trace_id, depth, 0, ids);
+            len = 0;
+            depth = i;
+        }
+        len += snprintf(ids + len, sizeof(ids) - len, "%u!", id);
+    }
+    ids[len] = 0;
+    EventLogger::log("kd-trace@%u!%d!%d!%s", trace_id, depth, 1, ids);
+}
+
+void FrameEventCache::startCollectThreadTask(FrameName* fn, long interval, KdFormat format, bool aggregate, bool by_state, bool by_group, bool delta) {
+    _format = format;
+    _aggregate = aggregate || by_state || by_group;
+    _by_state = by_state;
+    _by_group = by_group && !by_state;
+    _delta = delta && !_aggregate;
+    // Frame ids start over, so do trace definitions and stacks that refer to them
+    _dictionary.reset((_aggregate || delta) && format == KD_FORMAT_TEXT ? KD_FORMAT_IDS : format);
+    _defined_traces.clear();
+    _last_traces.clear();
+    _reported_skipped = 0;
+    _reported_dropped = 0;
+    _collect_frame_task = new CollectFrameEventTask(this, fn);
+    BackgroundScheduler::schedule(_collect_frame_task, interval / 1000000);
 }
 
 void FrameEventCache::endCollectThreadTask() {
     fprintf(stderr, "[End Task] %s \n", "endCollectThreadTask");
+    if (_alloc_dropped != 0) {
+        Log::debug("Kindling allocation samples dropped: %llu", _alloc_dropped);
+    }
     if (_collect_frame_task != NULL) {
-        _collect_frame_task->stop();
-        _collect_frame_thread.join();
+        BackgroundScheduler::cancel(_collect_frame_task);
         delete _collect_frame_task;
         _collect_frame_task = NULL;        
     }
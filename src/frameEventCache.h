@@ -1,78 +1,265 @@
 #ifndef _FRAME_EVENT_CACHE_H
 #define _FRAME_EVENT_CACHE_H
 
+#include <map>
+#include <string>
+#include <vector>
+#include "arch.h"
+#include "backgroundScheduler.h"
 #include "vmEntry.h"
+#include "callTraceStorage.h"
+#include "dictionary.h"
+#include "event.h"
+#include "eventBuffer.h"
 #include "frameName.h"
-#include "stoppableTask.h"
+#include "methodCache.h"
+#include "overheadGovernor.h"
+#include "spinLock.h"
+#include "traceContext.h"
 
-class FrameEvent {
+// Session-wide ids of frames. Each frame is defined in the stream once
+// and stacks refer to frames by id afterwards. Native and synthetic frames are
+// defined right before their first use; new Java methods are queued and resolved
+// in one batch at the end of the interval, so stacks never wait on JVM TI.
+class FrameDictionary {
     private:
-        u64 _timestamp;
-        int _num_frames;
-        ASGCT_CallFrame* _frames;
+        Dictionary _names;
+        std::vector<u32> _name_ids;
+        MethodCache _methods;
+        std::vector<MethodCacheEntry*> _pending;
+        u32 _next_id;
+        KdFormat _format;
+        EventBuffer& _buf;
+
+        u32 nameId(const char* name);
     public:
-        int _thread_id;
+        FrameDictionary(EventBuffer& buf);
 
-        FrameEvent(int depth);
-        ~FrameEvent();
-        void setEvent(int thread_id, int num_frames, ASGCT_CallFrame* frames);
-        void log(FrameName* frameName);
+        void reset(KdFormat format);
+        u32 lookup(FrameName* frameName, ASGCT_CallFrame& frame);
+        const char* name(FrameName* frameName, ASGCT_CallFrame& frame);
+        void define(u32 id, const char* name);
+        void resolvePending(FrameName* frameName);
 };
 
-typedef FrameEvent* P_FrameEvent;
+// One CPU sample; the stack itself lives in CallTraceStorage
+struct FrameEvent {
+    int _thread_id;
+    u32 _call_trace_id;
+    u64 _timestamp;
+    // Off-CPU samples only (event=offcpu), 0 otherwise
+    u64 _off_cpu;
+    uintptr_t _lock_address;
+    // Follower values of a counter group (counters=...)
+    int _counter_count;
+    u64 _counters[MAX_GROUP_COUNTERS];
+    // Precise memory samples only (dataaddr)
+    uintptr_t _data_address;
+    u64 _data_source;
+    // Set by the application with setTraceContext, zero otherwise
+    TraceIds _context;
+    // Number of the GC pause in progress when the sample was taken, zero outside of pauses
+    u32 _gc_pause;
+    // CPU the sample was taken on (samplecpu), -1 otherwise
+    int _cpu;
+    // Java id of the virtual thread mounted on the sampled carrier thread, 0 otherwise
+    jlong _vthread_id;
+    // CPU ns the thread used since its previous sample (itimer, wall), 0 if unknown
+    u64 _cpu_time;
+    // THREAD_SLEEPING only for wall clock samples taken in a syscall
+    ThreadState _thread_state;
+
+    void log(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace);
+    void logIds(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace);
+    void write(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace, EventBuffer& buf);
+    // Return false if the changed frames do not fit in one record
+    bool logDelta(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace, int kept);
+    bool writeDelta(FrameName* frameName, FrameDictionary& dictionary, CallTrace* trace, int kept, EventBuffer& buf);
+};
 
-class FrameEventList {
+// Single-producer single-consumer ring of sampled stacks.
+// Samplers write to a ring only while holding the matching Profiler lock,
+// so there is at most one producer at a time; the collector is the only consumer.
+// A slot is reused only after the collector has logged it, so events are never torn.
+class FrameEventRing {
     private:
+        u64 _head;
+        char _pad1[64 - sizeof(u64)];
+        u64 _tail;
+        char _pad2[64 - sizeof(u64)];
         int _capacity;
-        volatile int _count;
-        P_FrameEvent* _events;
+        FrameEvent* _events;
+        bool _owned;
     public:
-        FrameEventList(int capacity, int max_depth);
-        ~FrameEventList();
-        void addFrameEvent(int thread_id, int num_frames, ASGCT_CallFrame* frames);
-        void log(FrameName* frameName);
+        // Samples dropped because the ring was full, updated only by the producer
+        u64 _dropped;
+
+        FrameEventRing(int capacity);
+        // Over events owned by the caller, e.g. a mapped spill file
+        FrameEventRing(FrameEvent* events, int capacity);
+        ~FrameEventRing();
+        bool add(int thread_id, u32 call_trace_id, SampleEvent* sample, bool sample_cpu);
+        // Producer side only
+        bool full() { return _head - loadAcquire(_tail) >= (u64)_capacity; }
+        bool empty() { return loadAcquire(_tail) == _head; }
+        u64 head() { return loadAcquire(_head); }
+        u64 tail() { return _tail; }
+        FrameEvent* at(u64 seq) { return &_events[seq % _capacity]; }
+        // Makes the slots up to head available to the producer again
+        void release(u64 head) { storeRelease(_tail, head); }
+        int count(u64 head, int skip_thread);
+};
+
+// Samples of one thread with the same stack within a collect interval
+struct FrameAggregate {
+    u64 count;
+    u64 first;
+    u64 last;
+    // Sum of _cpu_time of the samples counted
+    u64 cpu_time;
 };
 
-typedef FrameEventList* P_FrameEventList;
+// kdalloc: sampled allocations of one collect interval per (class, kind, trace)
+const int KD_ALLOC_ENTRIES = 512;
+
+struct KdAllocEntry {
+    u32 class_id;
+    u32 trace_id;
+    int event_type;
+    u64 count;
+    u64 bytes;
+};
+
+struct KdAllocTotal {
+    u64 count;
+    u64 bytes;
+};
+
+// Producers of a slot add to the active table, which the collector swaps for the other one;
+// like EventWriterSlot, a producer only ever contends with the collector swapping the tables
+struct KdAllocSlot {
+    SpinLock lock;
+    int active;
+    int size[2];
+    KdAllocEntry entries[2][KD_ALLOC_ENTRIES];
+};
+
+// Threads whose previous stack kddelta remembers; beyond that it starts over
+const size_t KD_DELTA_MAX_THREADS = 8192;
+
+// What kdaggregate knows about a CallTraceStorage id
+enum TraceState {
+    TRACE_UNSEEN,
+    TRACE_DEFINED,
+    TRACE_EXCLUDED  // by include/exclude filters
+};
 
 class CollectFrameEventTask;
 
 class FrameEventCache {
     private:
-        P_FrameEventList* _list;
-        volatile int _write_index;
+        int _slots;
+        int _capacity;
+        int _max_depth;
+        FrameEventRing** _rings;
+        u64* _heads;
+        // kdspill: one ring per slot over a mapped file, NULL without it
+        FrameEventRing** _spills;
+        u64* _spill_heads;
+        void* _spill_map;
+        size_t _spill_size;
+        KdFormat _format;
+        bool _aggregate;
+        bool _by_state;
+        bool _by_group;
+        bool _delta;
+        bool _sample_cpu;
+        bool _fold_idle;
+        // kdalloc: one table pair per slot, NULL until a session asks for them
+        KdAllocSlot* _alloc_slots;
+        volatile bool _alloc_enabled;
+        volatile u64 _alloc_dropped;
+        CallTraceStorage& _traces;
+
+        // Used only by the collector thread
+        EventBuffer _buffer;
+        FrameDictionary _dictionary;
+        std::map<u64, FrameAggregate> _aggregates;
+        // kdaggregate=group: thread groups of the interval, in order of the first sample
+        std::map<int, u32> _thread_groups;
+        std::map<std::string, u32> _group_ids;
+        std::vector<std::string> _group_names;
+        std::vector<unsigned char> _defined_traces;
+        std::map<int, u32> _last_traces;
+        // kdidle: idle samples of each thread in this interval, as counted and as logged
+        std::map<int, FrameAggregate> _idle_counted;
+        std::map<int, FrameAggregate> _idle_folds;
+        u64 _reported_skipped;
+        u64 _reported_dropped;
+
+        void reportLoss();
+        void logEvent(FrameEvent* event, CallTrace* trace, FrameName* fn);
+        void logRecords(FrameEvent* event, CallTrace* trace, FrameName* fn);
+        void logOffCpu(FrameEvent* event);
+        void logCounters(FrameEvent* event);
+        void logDataAddress(FrameEvent* event);
+        void logContext(FrameEvent* event);
+        void logGcPause(FrameEvent* event);
+        void logCpu(FrameEvent* event);
+        void logVirtualThread(FrameEvent* event);
+    void logCpuTime(FrameEvent* event);
+        void logIdleFolds();
+        bool logAllocations(FrameName* fn);
+        bool acceptTrace(u32 trace_id, FrameName* fn);
+        bool foldIdle(FrameEvent* event, CallTrace* trace, FrameName* fn, std::map<int, FrameAggregate>& folds);
+        void aggregate(int skip_thread, FrameName* fn);
+        u32 groupOf(int tid);
+        void markTrace(u32 trace_id, TraceState state);
+        void defineTrace(u32 trace_id, int num_frames, ASGCT_CallFrame* frames, FrameName* fn);
+        int countStacks(FrameEventRing* ring, u64 head, int skip_thread, FrameName* fn);
+        u64 logRing(FrameEventRing* ring, u64 head, int skip_thread, FrameName* fn);
+        u64 aggregateRing(FrameEventRing* ring, u64 head, int skip_thread, FrameName* fn);
+        void releaseSpill(int slot);
 
         CollectFrameEventTask* _collect_frame_task;
-        std::thread _collect_frame_thread;
 
         friend class CollectFrameEventTask;
     public:
-        FrameEventCache();
+        FrameEventCache(int slots, CallTraceStorage& traces);
         ~FrameEventCache();
 
-        void add(jint thread_id, int num_frames, ASGCT_CallFrame* frames);
+        void init(int capacity, int max_depth, bool sample_cpu);
+        // Also must not be called while samplers may be running; NULL path closes the spill
+        bool openSpill(const char* path, long size);
+        void closeSpill();
+        void clearCounters();
+        u64 dropped();
+
+        int maxDepth() { return _max_depth; }
+        void add(int slot, jint thread_id, u32 call_trace_id, SampleEvent* sample);
+        // Must not be called while samplers may be running
+        void enableAllocations(bool enable);
+        bool allocationsEnabled() { return _alloc_enabled; }
+        void addAllocation(int slot, u32 class_id, int event_type, u32 call_trace_id, u64 bytes);
         void collect(FrameName* fn);
-        void startCollectThreadTask(FrameName* fn, long interval);
+        void startCollectThreadTask(FrameName* fn, long interval, KdFormat format, bool aggregate, bool by_state, bool by_group, bool delta);
         void endCollectThreadTask();
 };
 
-class CollectFrameEventTask: public Stoppable {
+class CollectFrameEventTask: public ScheduledTask {
     public:
-        CollectFrameEventTask(FrameEventCache* cache, FrameName* fn, long interval) {
+        CollectFrameEventTask(FrameEventCache* cache, FrameName* fn) {
             this->cache = cache;
             this->fn = fn;
-            this->intervalMs = interval / 1000000;
         }
 
         void run() {
-            while (stopRequested() == false) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
-                cache->collect(fn);
-            }
+            u64 start = TSC::ticks();
+            cache->collect(fn);
+            OverheadGovernor::add(OVERHEAD_COLLECT, start);
         }
     private:
         FrameEventCache* cache;
         FrameName* fn;
-        long intervalMs;
 };
 #endif // _FRAME_EVENT_CACHE_H
\ No newline at end of file
@@ -19,10 +19,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include "frameName.h"
+#include "memoryBudget.h"
 #include "profiler.h"
 #include "vmStructs.h"
 
 
+static inline u64 cacheEntrySize(const std::string& name) {
+    return sizeof(JMethodCache::value_type) + MAP_NODE_OVERHEAD + name.size();
+}
+
+static inline u64 filterEntrySize() {
+    return sizeof(FilterCache::value_type) + MAP_NODE_OVERHEAD;
+}
+
 static inline bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
@@ -80,15 +89,24 @@ bool Matcher::matches(const char* s) {
 }
 
 
+// What a thread blocked waiting for work or I/O has on top of its stack
+static const char* const DEFAULT_IDLE_FRAMES[] = {
+    "*epoll_wait", "*epoll_pwait", "*Unsafe.park", "*Object.wait", "*Object.wait0",
+    "*Thread.sleep", "*Thread.sleep0", "accept", "accept4", "*_accept", "*_accept4"
+};
+
 JMethodCache FrameName::_cache;
+unsigned char FrameName::_default_max_age = 0;
 
 FrameName::FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names) :
     _class_names(),
     _include(),
     _exclude(),
+    _idle(),
+    _filter_cache(),
     _style(style),
     _cache_epoch((unsigned char)epoch),
-    _cache_max_age(args._mcache),
+    _cache_max_age(args._mcache != 0 ? args._mcache : _default_max_age),
     _thread_names_lock(thread_names_lock),
     _thread_names(thread_names)
 {
@@ -96,17 +114,31 @@ FrameName::FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_
 
     buildFilter(_include, args._buf, args._include);
     buildFilter(_exclude, args._buf, args._exclude);
+    if (args._kd_idle) {
+        buildFilter(_idle, args._buf, args._kd_idle_frames);
+        if (_idle.empty()) {
+            for (int i = 0; i < sizeof(DEFAULT_IDLE_FRAMES) / sizeof(DEFAULT_IDLE_FRAMES[0]); i++) {
+                _idle.push_back(DEFAULT_IDLE_FRAMES[i]);
+            }
+        }
+    }
 
     Profiler::instance()->classMap()->collect(_class_names);
 }
 
 FrameName::~FrameName() {
+    MemoryBudget::release(MEMORY_METHOD_NAMES, _filter_cache.size() * filterEntrySize());
+
     if (_cache_max_age == 0) {
+        for (JMethodCache::iterator it = _cache.begin(); it != _cache.end(); ++it) {
+            MemoryBudget::release(MEMORY_METHOD_NAMES, cacheEntrySize(it->second));
+        }
         _cache.clear();
     } else {
         // Remove stale methods from the cache, leave the fresh ones for the next profiling session
         for (JMethodCache::iterator it = _cache.begin(); it != _cache.end(); ) {
             if (_cache_epoch - (unsigned char)it->second[0] >= _cache_max_age) {
+                MemoryBudget::release(MEMORY_METHOD_NAMES, cacheEntrySize(it->second));
                 _cache.erase(it++);
             } else {
                 ++it;
@@ -129,29 +161,41 @@ char* FrameName::truncate(char* name, int max_length) {
     return name;
 }
 
+// Demangling mallocs and parses the whole name, so the result is kept for the next
+// FrameName that decodes the same symbol
 const char* FrameName::decodeNativeSymbol(const char* name) {
-    const char* lib_name = (_style & STYLE_LIB_NAMES) ? Profiler::instance()->getLibraryName(name) : NULL;
+    bool qualified = (_style & STYLE_LIB_NAMES) != 0;
+    bool mangled = name[0] == '_' && name[1] == 'Z';
+    if (!mangled && !qualified) {
+        return name;
+    }
 
-    if (name[0] == '_' && name[1] == 'Z') {
+    const char* cached = NativeFunc::decoded(name, qualified);
+    if (cached != NULL) {
+        return cached;
+    }
+
+    const char* lib_name = qualified ? Profiler::instance()->getLibraryName(name) : NULL;
+    char* demangled = NULL;
+    if (mangled) {
         int status;
-        char* demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
-        if (demangled != NULL) {
-            if (lib_name != NULL) {
-                snprintf(_buf, sizeof(_buf) - 1, "%s`%s", lib_name, demangled);
-            } else {
-                strncpy(_buf, demangled, sizeof(_buf) - 1);
-            }
-            free(demangled);
-            return _buf;
-        }
+        demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
     }
 
+    const char* result = name;
     if (lib_name != NULL) {
-        snprintf(_buf, sizeof(_buf) - 1, "%s`%s", lib_name, name);
-        return _buf;
-    } else {
-        return name;
+        snprintf(_buf, sizeof(_buf) - 1, "%s`%s", lib_name, demangled != NULL ? demangled : name);
+        result = _buf;
+    } else if (demangled != NULL) {
+        strncpy(_buf, demangled, sizeof(_buf) - 1);
+        _buf[sizeof(_buf) - 1] = 0;
+        result = _buf;
     }
+    free(demangled);
+
+    // Names that decode to themselves are remembered too, so that they are not parsed again
+    const char* stored = NativeFunc::setDecoded(name, qualified, result);
+    return stored != NULL ? stored : result;
 }
 
 const char* FrameName::typeSuffix(FrameTypeId type) {
@@ -245,6 +289,20 @@ char* FrameName::javaClassName(const char* symbol, int length, int style) {
     return result;
 }
 
+// Classes first seen after this FrameName was created are looked up in the class map again;
+// a long-lived FrameName, like the one of the Kindling collector, meets them all the time
+const char* FrameName::classSymbol(u32 class_id) {
+    ClassMap::iterator it = _class_names.find(class_id);
+    if (it == _class_names.end()) {
+        Profiler::instance()->classMap()->collect(_class_names);
+        it = _class_names.find(class_id);
+        if (it == _class_names.end()) {
+            return "[unknown]";
+        }
+    }
+    return it->second;
+}
+
 const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
     if (frame.method_id == NULL) {
         return "[unknown]";
@@ -258,7 +316,7 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
         case BCI_ALLOC_OUTSIDE_TLAB:
         case BCI_LOCK:
         case BCI_PARK: {
-            const char* symbol = _class_names[(uintptr_t)frame.method_id];
+            const char* symbol = classSymbol((u32)(uintptr_t)frame.method_id);
             char* class_name = javaClassName(symbol, strlen(symbol), _style | STYLE_DOTTED);
             if (!for_matching && !(_style & STYLE_DOTTED)) {
                 strcat(class_name, frame.bci == BCI_ALLOC_OUTSIDE_TLAB ? "_[k]" : "_[i]");
@@ -299,12 +357,22 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
             }
 
             char* newName = javaMethodName(frame.method_id);
-            _cache.insert(it, JMethodCache::value_type(frame.method_id, std::string(1, _cache_epoch) + newName));
+            std::string entry = std::string(1, _cache_epoch) + newName;
+            // Over memlimit, names are resolved every time instead
+            if (MemoryBudget::reserve(MEMORY_METHOD_NAMES, cacheEntrySize(entry))) {
+                _cache.insert(it, JMethodCache::value_type(frame.method_id, entry));
+            }
             return type_suffix != NULL ? strcat(newName, type_suffix) : newName;
         }
     }
 }
 
+const char* FrameName::javaFrameName(jmethodID method, FrameTypeId type) {
+    const char* type_suffix = typeSuffix(type);
+    char* name = javaMethodName(method);
+    return type_suffix != NULL ? strcat(name, type_suffix) : name;
+}
+
 bool FrameName::include(const char* frame_name) {
     for (int i = 0; i < _include.size(); i++) {
         if (_include[i].matches(frame_name)) {
@@ -323,3 +391,67 @@ bool FrameName::exclude(const char* frame_name) {
     return false;
 }
 
+bool FrameName::idle(const char* frame_name) {
+    for (int i = 0; i < _idle.size(); i++) {
+        if (_idle[i].matches(frame_name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int FrameName::filter(ASGCT_CallFrame& frame) {
+    // Thread names may change, so thread frames are matched every time
+    bool cacheable = frame.bci != BCI_THREAD_ID;
+    std::pair<jmethodID, int> key(frame.method_id, FrameType::nameKind(frame.bci));
+    FilterCache::iterator it = _filter_cache.end();
+    if (cacheable) {
+        it = _filter_cache.lower_bound(key);
+        if (it != _filter_cache.end() && it->first == key) {
+            return it->second;
+        }
+    }
+
+    const char* frame_name = name(frame, true);
+    int verdict = (!_include.empty() && include(frame_name) ? FILTER_INCLUDE : 0) |
+                  (!_exclude.empty() && exclude(frame_name) ? FILTER_EXCLUDE : 0) |
+                  (!_idle.empty() && idle(frame_name) ? FILTER_IDLE : 0);
+    if (cacheable && MemoryBudget::reserve(MEMORY_METHOD_NAMES, filterEntrySize())) {
+        _filter_cache.insert(it, FilterCache::value_type(key, (unsigned char)verdict));
+    }
+    return verdict;
+}
+
+bool FrameName::excluded(int num_frames, ASGCT_CallFrame* frames) {
+    bool checkInclude = !_include.empty();
+    bool checkExclude = !_exclude.empty();
+    if (!(checkInclude || checkExclude)) {
+        return false;
+    }
+
+    for (int i = 0; i < num_frames; i++) {
+        int verdict = filter(frames[i]);
+        if (checkExclude && (verdict & FILTER_EXCLUDE)) {
+            return true;
+        }
+        if (checkInclude && (verdict & FILTER_INCLUDE)) {
+            checkInclude = false;
+            if (!checkExclude) break;
+        }
+    }
+
+    return checkInclude;
+}
+
+bool FrameName::idle(int num_frames, ASGCT_CallFrame* frames) {
+    for (int i = 0; i < num_frames; i++) {
+        if (filter(frames[i]) & FILTER_IDLE) {
+            return true;
+        }
+        if (frames[i].bci >= 0) {
+            // Frames below the first Java frame are what the thread runs, not what it waits in
+            break;
+        }
+    }
+    return false;
+}
@@ -28,6 +28,8 @@
 typedef std::map<jmethodID, std::string> JMethodCache;
 typedef std::map<int, std::string> ThreadMap;
 typedef std::map<unsigned int, const char*> ClassMap;
+// Frame identity for filtering: method id and the kind of name it has, see FrameType::nameKind
+typedef std::map<std::pair<jmethodID, int>, unsigned char> FilterCache;
 
 
 enum MatchType {
@@ -37,6 +39,12 @@ enum MatchType {
   MATCH_ENDS_WITH
 };
 
+enum FilterVerdict {
+  FILTER_INCLUDE = 1,
+  FILTER_EXCLUDE = 2,
+  FILTER_IDLE = 4
+};
+
 
 class Matcher {
   private:
@@ -58,10 +66,13 @@ class Matcher {
 class FrameName {
   private:
     static JMethodCache _cache;
+    static unsigned char _default_max_age;
 
     ClassMap _class_names;
     std::vector<Matcher> _include;
     std::vector<Matcher> _exclude;
+    std::vector<Matcher> _idle;
+    FilterCache _filter_cache;
     char _buf[800];  // must be large enough for class name + method name + method signature
     int _style;
     unsigned char _cache_epoch;
@@ -72,21 +83,42 @@ class FrameName {
     void buildFilter(std::vector<Matcher>& vector, const char* base, int offset);
     char* truncate(char* name, int max_length);
     const char* decodeNativeSymbol(const char* name);
+    const char* classSymbol(u32 class_id);
     const char* typeSuffix(FrameTypeId type);
     char* javaMethodName(jmethodID method);
     char* javaClassName(const char* symbol, int length, int style);
 
   public:
+    // warm: without mcache, method names outlive the session for up to 255 sessions unused
+    static void keepCache(bool warm) {
+        _default_max_age = warm ? 255 : 0;
+    }
+
     FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names);
     ~FrameName();
 
     const char* name(ASGCT_CallFrame& frame, bool for_matching = false);
 
+    // Resolves a Java frame without the shared jmethodID cache
+    const char* javaFrameName(jmethodID method, FrameTypeId type);
+
+    bool annotate() { return (_style & STYLE_ANNOTATE) != 0; }
+
     bool hasIncludeList() { return !_include.empty(); }
     bool hasExcludeList() { return !_exclude.empty(); }
 
+    bool hasIdleList() { return !_idle.empty(); }
+
     bool include(const char* frame_name);
     bool exclude(const char* frame_name);
+    bool idle(const char* frame_name);
+
+    // FilterVerdict bits of the frame; every distinct frame is matched only once
+    int filter(ASGCT_CallFrame& frame);
+    // True if the trace misses all include patterns or matches an exclude pattern
+    bool excluded(int num_frames, ASGCT_CallFrame* frames);
+    // True if the trace waits in an idle frame (kdidle) above or at its first Java frame
+    bool idle(int num_frames, ASGCT_CallFrame* frames);
 };
 
 #endif // _FRAMENAME_H
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gcPhase.h"
+#include "os.h"
+#include "vmEntry.h"
+
+
+volatile u32 GcPhase::_state = 0;
+u64 GcPhase::_paused_samples = 0;
+u64 GcPhase::_pause_start = 0;
+volatile u64 GcPhase::_pause_ns = 0;
+volatile u64 GcPhase::_max_pause_ns = 0;
+
+u64 GcPhase::takePauseTime(u64* max_pause) {
+    *max_pause = __sync_lock_test_and_set(&_max_pause_ns, 0);
+    return __sync_lock_test_and_set(&_pause_ns, 0);
+}
+
+void GcPhase::start() {
+    _paused_samples = 0;
+    _pause_ns = 0;
+    _max_pause_ns = 0;
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
+}
+
+void GcPhase::stop() {
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
+    if (active()) {
+        // The finish event of the current pause will not come
+        __sync_fetch_and_add(&_state, 1);
+    }
+}
+
+void JNICALL GcPhase::GarbageCollectionStart(jvmtiEnv* jvmti) {
+    if (!active()) {
+        _pause_start = OS::nanotime();
+        __sync_fetch_and_add(&_state, 1);
+    }
+}
+
+void JNICALL GcPhase::GarbageCollectionFinish(jvmtiEnv* jvmti) {
+    if (active()) {
+        u64 pause = OS::nanotime() - _pause_start;
+        __sync_fetch_and_add(&_pause_ns, pause);
+        u64 max_pause;
+        while ((max_pause = _max_pause_ns) < pause && !__sync_bool_compare_and_swap(&_max_pause_ns, max_pause, pause)) {
+            // retry
+        }
+        __sync_fetch_and_add(&_state, 1);
+    }
+}
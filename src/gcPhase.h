@@ -0,0 +1,65 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GCPHASE_H
+#define _GCPHASE_H
+
+#include <jvmti.h>
+#include "arch.h"
+
+
+// Tracks stop-the-world collections reported by JVM TI.
+// The state is incremented on both GarbageCollectionStart and Finish,
+// so it is odd while a pause is in progress, and half of it counts the
+// collections finished so far. No JNI or JVM TI calls are allowed in
+// these callbacks, and they must not block. The pause durations are summed
+// here for HeapMonitor, which takes them once per cycle.
+class GcPhase {
+  private:
+    static volatile u32 _state;
+    static u64 _paused_samples;
+    static u64 _pause_start;
+    static volatile u64 _pause_ns;
+    static volatile u64 _max_pause_ns;
+
+  public:
+    static bool active() {
+        return (_state & 1) != 0;
+    }
+
+    static u32 collections() {
+        return _state >> 1;
+    }
+
+    static void countPausedSample() {
+        atomicInc(_paused_samples);
+    }
+
+    static u64 pausedSamples() {
+        return _paused_samples;
+    }
+
+    // Total and longest pause in ns since the previous call
+    static u64 takePauseTime(u64* max_pause);
+
+    static void start();
+    static void stop();
+
+    static void JNICALL GarbageCollectionStart(jvmtiEnv* jvmti);
+    static void JNICALL GarbageCollectionFinish(jvmtiEnv* jvmti);
+};
+
+#endif // _GCPHASE_H
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "gzip.h"
+
+
+const int DEFLATE_HASH_LOG = 15;
+const u32 DEFLATE_MIN_MATCH = 4;
+const u32 DEFLATE_MAX_MATCH = 258;
+const u32 DEFLATE_WINDOW = 32768;
+
+static const u16 LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const u8 LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const u16 DISTANCE_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const u8 DISTANCE_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+
+class BitWriter {
+  private:
+    std::string& _out;
+    u64 _bits;
+    int _count;
+
+  public:
+    BitWriter(std::string& out) : _out(out), _bits(0), _count(0) {
+    }
+
+    // Deflate packs values starting from the least significant bit
+    void put(u32 value, int count) {
+        _bits |= (u64)value << _count;
+        _count += count;
+        while (_count >= 8) {
+            _out.push_back((char)_bits);
+            _bits >>= 8;
+            _count -= 8;
+        }
+    }
+
+    // Huffman codes go most significant bit first
+    void putCode(u32 code, int count) {
+        u32 reversed = 0;
+        for (int i = 0; i < count; i++) {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        put(reversed, count);
+    }
+
+    void finish() {
+        if (_count > 0) {
+            _out.push_back((char)_bits);
+        }
+        _bits = 0;
+        _count = 0;
+    }
+};
+
+// Fixed literal/length alphabet of RFC 1951, 3.2.6
+static void putSymbol(BitWriter& bw, u32 symbol) {
+    if (symbol < 144) {
+        bw.putCode(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        bw.putCode(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        bw.putCode(symbol - 256, 7);
+    } else {
+        bw.putCode(0xc0 + symbol - 280, 8);
+    }
+}
+
+static void putMatch(BitWriter& bw, u32 length, u32 distance) {
+    int l = 28;
+    while (LENGTH_BASE[l] > length) l--;
+    putSymbol(bw, 257 + l);
+    bw.put(length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+
+    int d = 29;
+    while (DISTANCE_BASE[d] > distance) d--;
+    bw.putCode(d, 5);
+    bw.put(distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+}
+
+static inline u32 load32(const char* p) {
+    u32 v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void putLE32(std::string& out, u32 v) {
+    out.push_back((char)v);
+    out.push_back((char)(v >> 8));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 24));
+}
+
+static u32 crc32(const char* data, size_t len) {
+    static u32 table[256];
+    if (table[1] == 0) {
+        for (u32 i = 0; i < 256; i++) {
+            u32 c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+
+    u32 crc = 0xffffffff;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ (u8)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+}
+
+void Gzip::compress(const char* data, size_t len, std::string& out) {
+    static const char header[10] = {0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    out.append(header, sizeof(header));
+
+    BitWriter bw(out);
+    bw.put(1, 1);  // BFINAL
+    bw.put(1, 2);  // BTYPE = fixed Huffman codes
+
+    // Positions are stored + 1, so that 0 means an empty entry
+    std::string table_storage(sizeof(u32) << DEFLATE_HASH_LOG, 0);
+    u32* table = (u32*)&table_storage[0];
+
+    size_t ip = 0;
+    while (ip < len) {
+        if (ip + DEFLATE_MIN_MATCH <= len) {
+            u32 seq = load32(data + ip);
+            u32 h = (seq * 2654435761U) >> (32 - DEFLATE_HASH_LOG);
+            u32 ref = table[h];
+            table[h] = (u32)ip + 1;
+
+            if (ref != 0 && ip - (ref - 1) <= DEFLATE_WINDOW && load32(data + ref - 1) == seq) {
+                ref--;
+                u32 match_len = DEFLATE_MIN_MATCH;
+                u32 max_len = len - ip < DEFLATE_MAX_MATCH ? (u32)(len - ip) : DEFLATE_MAX_MATCH;
+                while (match_len < max_len && data[ref + match_len] == data[ip + match_len]) {
+                    match_len++;
+                }
+                putMatch(bw, match_len, (u32)(ip - ref));
+                ip += match_len;
+                continue;
+            }
+        }
+        putSymbol(bw, (u8)data[ip]);
+        ip++;
+    }
+
+    putSymbol(bw, 256);
+    bw.finish();
+
+    putLE32(out, crc32(data, len));
+    putLE32(out, (u32)len);
+}
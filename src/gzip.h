@@ -0,0 +1,33 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GZIP_H
+#define _GZIP_H
+
+#include <stddef.h>
+#include <string>
+#include "arch.h"
+
+
+// Single-member gzip stream with one deflate block of fixed Huffman codes.
+// Matches are found greedily as in Lz4::compress, which is plenty for
+// the repetitive tables of a pprof profile and needs no zlib at runtime.
+class Gzip {
+  public:
+    static void compress(const char* data, size_t len, std::string& out);
+};
+
+#endif // _GZIP_H
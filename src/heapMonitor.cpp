@@ -0,0 +1,242 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "heapMonitor.h"
+#include "eventLogger.h"
+#include "gcPhase.h"
+#include "overheadGovernor.h"
+#include "timeUtil.h"
+#include "tsc.h"
+#include "vmEntry.h"
+
+
+jobject HeapMonitor::_pools[HEAP_MONITOR_POOLS];
+int HeapMonitor::_pool_count = 0;
+jobject HeapMonitor::_collectors[HEAP_MONITOR_COLLECTORS];
+int HeapMonitor::_collector_count = 0;
+jlong HeapMonitor::_gc_counts[HEAP_MONITOR_COLLECTORS];
+jlong HeapMonitor::_gc_times[HEAP_MONITOR_COLLECTORS];
+u32 HeapMonitor::_collections = 0;
+
+jmethodID HeapMonitor::_get_usage = NULL;
+jmethodID HeapMonitor::_get_used = NULL;
+jmethodID HeapMonitor::_get_committed = NULL;
+jmethodID HeapMonitor::_get_collection_count = NULL;
+jmethodID HeapMonitor::_get_collection_time = NULL;
+
+HeapMonitorTask* HeapMonitor::_task = NULL;
+
+static void logName(JNIEnv* env, const char* record, int id, jobject bean, jmethodID get_name) {
+    jstring name = (jstring)env->CallObjectMethod(bean, get_name);
+    const char* chars = name == NULL ? NULL : env->GetStringUTFChars(name, NULL);
+    if (chars != NULL) {
+        EventLogger::log("%s@%d!%s!", record, id, chars);
+        env->ReleaseStringUTFChars(name, chars);
+    } else {
+        env->ExceptionClear();
+    }
+    env->DeleteLocalRef(name);
+}
+
+// Heap pools and collectors of the VM; they do not change after startup
+bool HeapMonitor::lookup(JNIEnv* env) {
+    jclass factory = env->FindClass("java/lang/management/ManagementFactory");
+    jclass list = env->FindClass("java/util/List");
+    jclass pool = env->FindClass("java/lang/management/MemoryPoolMXBean");
+    jclass usage = env->FindClass("java/lang/management/MemoryUsage");
+    jclass manager = env->FindClass("java/lang/management/MemoryManagerMXBean");
+    jclass collector = env->FindClass("java/lang/management/GarbageCollectorMXBean");
+    jclass type = env->FindClass("java/lang/management/MemoryType");
+    if (factory == NULL || list == NULL || pool == NULL || usage == NULL ||
+        manager == NULL || collector == NULL || type == NULL) {
+        return false;
+    }
+
+    jmethodID get_pools = env->GetStaticMethodID(factory, "getMemoryPoolMXBeans", "()Ljava/util/List;");
+    jmethodID get_collectors = env->GetStaticMethodID(factory, "getGarbageCollectorMXBeans", "()Ljava/util/List;");
+    jmethodID size = env->GetMethodID(list, "size", "()I");
+    jmethodID get = env->GetMethodID(list, "get", "(I)Ljava/lang/Object;");
+    jmethodID get_pool_name = env->GetMethodID(pool, "getName", "()Ljava/lang/String;");
+    jmethodID get_type = env->GetMethodID(pool, "getType", "()Ljava/lang/management/MemoryType;");
+    jmethodID get_collector_name = env->GetMethodID(manager, "getName", "()Ljava/lang/String;");
+    jfieldID heap_field = env->GetStaticFieldID(type, "HEAP", "Ljava/lang/management/MemoryType;");
+    _get_usage = env->GetMethodID(pool, "getUsage", "()Ljava/lang/management/MemoryUsage;");
+    _get_used = env->GetMethodID(usage, "getUsed", "()J");
+    _get_committed = env->GetMethodID(usage, "getCommitted", "()J");
+    _get_collection_count = env->GetMethodID(collector, "getCollectionCount", "()J");
+    _get_collection_time = env->GetMethodID(collector, "getCollectionTime", "()J");
+    if (get_pools == NULL || get_collectors == NULL || size == NULL || get == NULL ||
+        get_pool_name == NULL || get_type == NULL || get_collector_name == NULL || heap_field == NULL ||
+        _get_usage == NULL || _get_used == NULL || _get_committed == NULL ||
+        _get_collection_count == NULL || _get_collection_time == NULL) {
+        return false;
+    }
+
+    jobject heap = env->GetStaticObjectField(type, heap_field);
+    jobject pools = env->CallStaticObjectMethod(factory, get_pools);
+    jobject collectors = env->CallStaticObjectMethod(factory, get_collectors);
+    if (heap == NULL || pools == NULL || collectors == NULL) {
+        return false;
+    }
+
+    // Non-heap pools (metaspace, code cache) are left out
+    jint pool_count = env->CallIntMethod(pools, size);
+    for (jint i = 0; i < pool_count && _pool_count < HEAP_MONITOR_POOLS && !env->ExceptionCheck(); i++) {
+        jobject bean = env->CallObjectMethod(pools, get, i);
+        jobject bean_type = bean == NULL ? NULL : env->CallObjectMethod(bean, get_type);
+        if (bean_type != NULL && env->IsSameObject(bean_type, heap)) {
+            logName(env, "kd-hpn", _pool_count, bean, get_pool_name);
+            _pools[_pool_count++] = env->NewGlobalRef(bean);
+        }
+        env->DeleteLocalRef(bean_type);
+        env->DeleteLocalRef(bean);
+    }
+
+    jint collector_count = env->CallIntMethod(collectors, size);
+    for (jint i = 0; i < collector_count && _collector_count < HEAP_MONITOR_COLLECTORS && !env->ExceptionCheck(); i++) {
+        jobject bean = env->CallObjectMethod(collectors, get, i);
+        if (bean != NULL) {
+            logName(env, "kd-gcn", _collector_count, bean, get_collector_name);
+            _gc_counts[_collector_count] = env->CallLongMethod(bean, _get_collection_count);
+            _gc_times[_collector_count] = env->CallLongMethod(bean, _get_collection_time);
+            _collectors[_collector_count++] = env->NewGlobalRef(bean);
+        }
+        env->DeleteLocalRef(bean);
+    }
+
+    return !env->ExceptionCheck();
+}
+
+void HeapMonitor::release(JNIEnv* env) {
+    for (int i = 0; i < _pool_count; i++) {
+        env->DeleteGlobalRef(_pools[i]);
+    }
+    for (int i = 0; i < _collector_count; i++) {
+        env->DeleteGlobalRef(_collectors[i]);
+    }
+    _pool_count = 0;
+    _collector_count = 0;
+}
+
+Error HeapMonitor::start(Arguments& args) {
+    JNIEnv* env = VM::jni();
+    if (env == NULL || env->PushLocalFrame(64) != 0) {
+        return Error("Could not start heap monitor");
+    }
+
+    bool found = lookup(env);
+    env->ExceptionClear();
+    env->PopLocalFrame(NULL);
+    if (!found) {
+        release(env);
+        return Error("Heap and GC MXBeans are not available");
+    }
+
+    long interval_ms = (args._heap_monitor > 0 ? args._heap_monitor : args._interval ? args._interval : DEFAULT_INTERVAL) / 1000000;
+    if (interval_ms < SCHEDULER_TICK_MS) {
+        interval_ms = SCHEDULER_TICK_MS;
+    }
+
+    _collections = GcPhase::collections();
+    u64 max_pause;
+    GcPhase::takePauseTime(&max_pause);
+
+    _task = new HeapMonitorTask();
+    BackgroundScheduler::schedule(_task, interval_ms, true);
+    return Error::OK;
+}
+
+void HeapMonitor::stop() {
+    if (_task == NULL) {
+        return;
+    }
+
+    BackgroundScheduler::cancel(_task);
+    delete _task;
+    _task = NULL;
+
+    JNIEnv* env = VM::jni();
+    if (env != NULL) {
+        release(env);
+    }
+}
+
+void HeapMonitor::sample() {
+    JNIEnv* env = VM::jni();
+    if (env == NULL || env->PushLocalFrame(16) != 0) {
+        return;
+    }
+
+    u64 start = TSC::ticks();
+    u64 now = KdClock::now();
+
+    char list[640];
+    size_t len = 0;
+    for (int i = 0; i < _pool_count; i++) {
+        jobject usage = env->CallObjectMethod(_pools[i], _get_usage);
+        if (usage == NULL) {
+            env->ExceptionClear();
+            continue;
+        }
+        jlong used = env->CallLongMethod(usage, _get_used);
+        jlong committed = env->CallLongMethod(usage, _get_committed);
+        env->DeleteLocalRef(usage);
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            continue;
+        }
+        if (len < sizeof(list) - 1) {
+            int n = snprintf(list + len, sizeof(list) - len, len == 0 ? "%d:%lld:%lld" : ",%d:%lld:%lld",
+                             i, (long long)used, (long long)committed);
+            if (n > 0) len += n;
+        }
+    }
+    list[len < sizeof(list) ? len : sizeof(list) - 1] = 0;
+    EventLogger::log("kd-hp@%llu!%s!", (unsigned long long)now, list);
+
+    u32 collections = GcPhase::collections();
+    len = 0;
+    for (int i = 0; i < _collector_count; i++) {
+        jlong count = env->CallLongMethod(_collectors[i], _get_collection_count);
+        jlong time = env->CallLongMethod(_collectors[i], _get_collection_time);
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            continue;
+        }
+        // Concurrent cycles show here without a JVM TI pause
+        if (count != _gc_counts[i] && len < sizeof(list) - 1) {
+            int n = snprintf(list + len, sizeof(list) - len, len == 0 ? "%d:%lld:%lld" : ",%d:%lld:%lld",
+                             i, (long long)(count - _gc_counts[i]), (long long)(time - _gc_times[i]));
+            if (n > 0) len += n;
+        }
+        _gc_counts[i] = count;
+        _gc_times[i] = time;
+    }
+    list[len < sizeof(list) ? len : sizeof(list) - 1] = 0;
+
+    if (len > 0 || collections != _collections) {
+        u64 max_pause;
+        u64 pause = GcPhase::takePauseTime(&max_pause);
+        EventLogger::log("kd-gct@%llu!%u!%llu!%llu!%s!", (unsigned long long)now, collections - _collections,
+                         (unsigned long long)pause, (unsigned long long)max_pause, list);
+        _collections = collections;
+    }
+
+    env->PopLocalFrame(NULL);
+    OverheadGovernor::add(OVERHEAD_LOCK, start);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HEAPMONITOR_H
+#define _HEAPMONITOR_H
+
+#include <jni.h>
+#include "arch.h"
+#include "arguments.h"
+#include "backgroundScheduler.h"
+
+
+const int HEAP_MONITOR_POOLS = 16;
+const int HEAP_MONITOR_COLLECTORS = 8;
+
+class HeapMonitorTask;
+
+// Periodic heap and GC timeline of the Kindling stream (heapmon). The pools and
+// collectors are named once in kd-hpn and kd-gcn records; then every cycle logs
+//     kd-hp@ts!id:used:committed,...!
+// and, when a collection ran since the previous cycle,
+//     kd-gct@ts!pauses!pause_ns!max_pause_ns!id:count:time_ms,...!
+// with the collector counts and times as deltas. The numbers come from the
+// platform MXBeans, read on the scheduler thread; the pause durations from the
+// JVM TI callbacks of GcPhase.
+class HeapMonitor {
+  private:
+    static jobject _pools[HEAP_MONITOR_POOLS];
+    static int _pool_count;
+    static jobject _collectors[HEAP_MONITOR_COLLECTORS];
+    static int _collector_count;
+    static jlong _gc_counts[HEAP_MONITOR_COLLECTORS];
+    static jlong _gc_times[HEAP_MONITOR_COLLECTORS];
+    static u32 _collections;
+
+    static jmethodID _get_usage;
+    static jmethodID _get_used;
+    static jmethodID _get_committed;
+    static jmethodID _get_collection_count;
+    static jmethodID _get_collection_time;
+
+    static HeapMonitorTask* _task;
+
+    static bool lookup(JNIEnv* env);
+    static void release(JNIEnv* env);
+
+  public:
+    static bool active() {
+        return _task != NULL;
+    }
+
+    static Error start(Arguments& args);
+    static void stop();
+
+    static void sample();
+};
+
+class HeapMonitorTask : public ScheduledTask {
+  public:
+    void run() {
+        HeapMonitor::sample();
+    }
+};
+
+#endif // _HEAPMONITOR_H
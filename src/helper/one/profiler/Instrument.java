@@ -25,4 +25,8 @@ public class Instrument {
     }
 
     public static native void recordSample();
+
+    public static native void recordEntry(int id);
+
+    public static native void recordExit(int id);
 }
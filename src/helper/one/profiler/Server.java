@@ -21,8 +21,10 @@ import com.sun.net.httpserver.HttpHandler;
 import com.sun.net.httpserver.HttpServer;
 
 import java.io.IOException;
+import java.io.OutputStream;
 import java.net.InetSocketAddress;
 import java.net.URI;
+import java.nio.ByteBuffer;
 import java.nio.charset.StandardCharsets;
 import java.util.concurrent.Executor;
 import java.util.concurrent.atomic.AtomicInteger;
@@ -30,8 +32,15 @@ import java.util.concurrent.atomic.AtomicInteger;
 class Server extends Thread implements Executor, HttpHandler {
     private static final String[] COMMANDS = "start,resume,stop,dump,check,status,list,version".split(",");
 
+    // Scrapers asking for the same profile within this time share one snapshot
+    private static final long SNAPSHOT_TTL_MILLIS = 2000;
+    private static final int CHUNK_SIZE = 65536;
+
     private final HttpServer server;
     private final AtomicInteger threadNum = new AtomicInteger();
+    private String snapshotKey;
+    private long snapshotTime;
+    private ByteBuffer snapshot;
 
     private Server(String address) throws IOException {
         super("Async-profiler Server");
@@ -66,8 +75,11 @@ class Server extends Thread implements Executor, HttpHandler {
     @Override
     public void handle(HttpExchange exchange) throws IOException {
         try {
-            String command = getCommand(exchange.getRequestURI());
-            if (command == null) {
+            URI uri = exchange.getRequestURI();
+            String command = getCommand(uri);
+            if (uri.getPath().equals("/profile")) {
+                sendProfile(exchange, uri.getQuery());
+            } else if (command == null) {
                 sendResponse(exchange, 404, "Unknown command");
             } else {
                 String response = execute0(command);
@@ -98,6 +110,59 @@ class Server extends Thread implements Executor, HttpHandler {
         return null;
     }
 
+    // GET /profile?collapsed&last=5m: the dump itself, gzip'd if the client accepts it,
+    // written in chunks straight from the native snapshot
+    private void sendProfile(HttpExchange exchange, String query) throws IOException {
+        String command = query == null ? "collapsed" : query.replace('&', ',');
+        String acceptEncoding = exchange.getRequestHeaders().getFirst("Accept-Encoding");
+        boolean gzip = acceptEncoding != null && acceptEncoding.contains("gzip") && !command.contains("pprof");
+
+        String contentType = command.contains("pprof") ? "application/octet-stream"
+                : command.contains("flamegraph") || command.contains("tree") ? "text/html; charset=utf-8"
+                : "text/plain";
+        exchange.getResponseHeaders().add("Content-Type", contentType);
+        if (gzip) {
+            exchange.getResponseHeaders().add("Content-Encoding", "gzip");
+        }
+
+        ByteBuffer buffer = acquireSnapshot(command, gzip);
+        try {
+            // Length 0 selects chunked transfer encoding
+            exchange.sendResponseHeaders(200, 0);
+
+            ByteBuffer data = buffer.duplicate();
+            byte[] chunk = new byte[Math.min(CHUNK_SIZE, data.remaining())];
+            OutputStream body = exchange.getResponseBody();
+            while (data.hasRemaining()) {
+                int length = Math.min(chunk.length, data.remaining());
+                data.get(chunk, 0, length);
+                body.write(chunk, 0, length);
+            }
+        } finally {
+            free0(buffer);
+        }
+    }
+
+    // The native dump is reference counted: the server holds one reference while it is
+    // the current snapshot, and each response sending it one more, dropped by free0.
+    // The class is defined on its own by JavaAPI::startHttpServer, so the count cannot
+    // live in a nested class
+    private synchronized ByteBuffer acquireSnapshot(String command, boolean gzip) {
+        String key = gzip ? command + ",gzip" : command;
+        long now = System.currentTimeMillis();
+        if (snapshot == null || !key.equals(snapshotKey) || now - snapshotTime >= SNAPSHOT_TTL_MILLIS) {
+            ByteBuffer buffer = profile0(command, gzip);
+            if (snapshot != null) {
+                free0(snapshot);
+            }
+            snapshot = buffer;
+            snapshotKey = key;
+            snapshotTime = now;
+        }
+        retain0(snapshot);
+        return snapshot;
+    }
+
     private void sendResponse(HttpExchange exchange, int code, String body) throws IOException {
         String contentType = body.startsWith("<!DOCTYPE html>") ? "text/html; charset=utf-8" : "text/plain";
         exchange.getResponseHeaders().add("Content-Type", contentType);
@@ -108,4 +173,7 @@ class Server extends Thread implements Executor, HttpHandler {
     }
 
     private native String execute0(String command) throws IllegalArgumentException, IllegalStateException, IOException;
+    private static native ByteBuffer profile0(String command, boolean gzip) throws IllegalArgumentException, IllegalStateException;
+    private static native void retain0(ByteBuffer buffer);
+    private static native void free0(ByteBuffer buffer);
 }
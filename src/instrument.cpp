@@ -23,6 +23,7 @@
 #include "profiler.h"
 #include "vmEntry.h"
 #include "instrument.h"
+#include "methodTracer.h"
 
 
 INCBIN(INSTRUMENT_CLASS, "one/profiler/Instrument.class")
@@ -95,6 +96,10 @@ class Constant {
         }
     }
 
+    const char* utf8() {
+        return (const char*)_info + 2;
+    }
+
     bool equals(const char* value, u16 len) {
         return _tag == CONSTANT_Utf8 && info() == len && memcmp(_info + 2, value, len) == 0;
     }
@@ -121,6 +126,100 @@ enum PatchConstants {
     EXTRA_STACKMAPS = 1
 };
 
+// Traced methods (methods=) get a call at entry and before every return, each padded
+// to 8 bytes so that tableswitch/lookupswitch keep their alignment, and a catch-all
+// handler at the end: sipush id; invokestatic recordExit; athrow
+enum TracePatchConstants {
+    TRACE_CONSTANTS = 12,
+    TRACE_ENTRY_BYTECODES = 8,
+    TRACE_EXIT_BYTECODES = 8,
+    TRACE_HANDLER_BYTECODES = 7,
+    MAX_CODE_LENGTH = 65535
+};
+
+enum Opcode {
+    OP_NOP = 0x00,
+    OP_SIPUSH = 0x11,
+    OP_IINC = 0x84,
+    OP_IFEQ = 0x99,
+    OP_JSR = 0xa8,
+    OP_TABLESWITCH = 0xaa,
+    OP_LOOKUPSWITCH = 0xab,
+    OP_IRETURN = 0xac,
+    OP_RETURN = 0xb1,
+    OP_INVOKESTATIC = 0xb8,
+    OP_ATHROW = 0xbf,
+    OP_WIDE = 0xc4,
+    OP_IFNULL = 0xc6,
+    OP_IFNONNULL = 0xc7,
+    OP_GOTO_W = 0xc8,
+    OP_JSR_W = 0xc9
+};
+
+static inline u16 read16(const u8* p) {
+    return (u16)(p[0] << 8 | p[1]);
+}
+
+static inline u32 read32(const u8* p) {
+    return (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | (u32)p[3];
+}
+
+static inline bool isReturn(u8 op) {
+    return op >= OP_IRETURN && op <= OP_RETURN;
+}
+
+static inline bool isShortBranch(u8 op) {
+    return (op >= OP_IFEQ && op <= OP_JSR) || op == OP_IFNULL || op == OP_IFNONNULL;
+}
+
+// Length of the instruction at pc, 0 if it is malformed or unknown
+static u32 instructionLength(const u8* code, u32 pc, u32 code_length) {
+    static const u8 lengths[] = {
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x00
+        2, 3, 2, 3, 3, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1,  // 0x10
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x20
+        1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1,  // 0x30
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x40
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x50
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x60
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x70
+        1, 1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x80
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3, 3,  // 0x90
+        3, 3, 3, 3, 3, 3, 3, 3, 3, 2, 0, 0, 1, 1, 1, 1,  // 0xa0
+        1, 1, 3, 3, 3, 3, 3, 3, 3, 5, 5, 3, 2, 3, 1, 1,  // 0xb0
+        3, 3, 1, 1, 0, 4, 3, 3, 5, 5,                    // 0xc0
+    };
+
+    u8 op = code[pc];
+    u32 len;
+    if (op == OP_TABLESWITCH || op == OP_LOOKUPSWITCH) {
+        // Padding aligns the operands to 4 bytes from the start of the code
+        u32 operands = (pc + 4) & ~3;
+        if (operands + 12 > code_length) {
+            return 0;
+        }
+        u64 end;
+        if (op == OP_TABLESWITCH) {
+            int low = (int)read32(code + operands + 4);
+            int high = (int)read32(code + operands + 8);
+            if (high < low) return 0;
+            end = operands + 12 + ((u64)(high - low) + 1) * 4;
+        } else {
+            int npairs = (int)read32(code + operands + 4);
+            if (npairs < 0) return 0;
+            end = operands + 8 + (u64)npairs * 8;
+        }
+        return end <= code_length ? (u32)(end - pc) : 0;
+    } else if (op == OP_WIDE) {
+        len = pc + 1 < code_length && code[pc + 1] == OP_IINC ? 6 : 4;
+    } else if (op < sizeof(lengths)) {
+        len = lengths[op];
+    } else {
+        return 0;
+    }
+    return len > 0 && pc + len <= code_length ? len : 0;
+}
+
 
 class BytecodeRewriter {
   private:
@@ -134,12 +233,21 @@ class BytecodeRewriter {
     Constant** _cpool;
     u16 _cpool_len;
 
-    const char* _target_class;
-    u16 _target_class_len;
-    const char* _target_method;
-    u16 _target_method_len;
-    const char* _target_signature;
-    u16 _target_signature_len;
+    const InstrumentTargets* _targets;
+    // The name of the class as found in the constant pool, not terminated
+    const char* _class_name;
+    u16 _class_name_len;
+
+    // methods= mode: every matched method is timed, its target index is the id;
+    // _traced_id is the id of the method being rewritten or -1
+    bool _trace;
+    u16 _major_version;
+    int _traced_id;
+    u16 _traced_name;
+    bool _traced_handler;
+    u32 _handler_pc;
+    u32* _returns;
+    u32 _return_count;
 
     // Reader
 
@@ -230,37 +338,84 @@ class BytecodeRewriter {
         put16(ref2);
     }
 
+    // Where an instruction of the original code starts in the rewritten one.
+    // A return moves along with the exit call inserted before it.
+    u32 relocate(u32 pc) {
+        if (_traced_id < 0) {
+            return pc + EXTRA_BYTECODES;
+        }
+        u32 lo = 0;
+        u32 hi = _return_count;
+        while (lo < hi) {
+            u32 mid = (lo + hi) / 2;
+            if (_returns[mid] < pc) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return TRACE_ENTRY_BYTECODES + pc + lo * TRACE_EXIT_BYTECODES;
+    }
+
+    int branchOffset(u32 pc, int offset) {
+        return (int)(relocate(pc + offset) - relocate(pc));
+    }
+
+    int findTarget(Constant* name, Constant* descriptor) {
+        for (int i = 0; i < _targets->count(); i++) {
+            const MethodTarget& t = (*_targets)[i];
+            if (InstrumentTargets::sameClass(t, _class_name, _class_name_len)
+                && name->matches(t.method, t.method_len)
+                && (t.signature == NULL || descriptor->matches(t.signature, t.signature_len))) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void putTraceCall(u16 method_ref) {
+        put8(OP_SIPUSH);
+        put16((u16)_traced_id);
+        put8(OP_INVOKESTATIC);
+        put16(method_ref);
+    }
+
     // BytecodeRewriter
 
     void rewriteCode();
+    bool scanTracedCode(const u8* code, u32 code_length);
+    void rewriteTracedCode();
+    void rewriteTracedInstructions(const u8* code, u32 code_length);
     void rewriteBytecodeTable(int data_len);
     void rewriteStackMapTable();
+    void rewriteTracedStackMapTable();
+    void putHandlerFrame(u32 handler_pc, int prev_pc);
     void rewriteVerificationTypeInfo();
     void rewriteAttributes(Scope scope);
     void rewriteMembers(Scope scope);
     bool rewriteClass();
 
   public:
-    BytecodeRewriter(const u8* class_data, int class_data_len, const char* target_class) :
+    // Rewrites the methods of the class that match any of the targets:
+    // for event=, with a call to recordSample at entry; for methods=, timed
+    BytecodeRewriter(const u8* class_data, int class_data_len, const InstrumentTargets* targets, bool trace) :
         _src(class_data),
         _src_limit(class_data + class_data_len),
         _dst(NULL),
         _dst_len(0),
-        _dst_capacity(class_data_len + 400),
-        _cpool(NULL) {
-
-        _target_class = target_class;
-        _target_class_len = strlen(_target_class);
-
-        _target_method = _target_class + _target_class_len + 1;
-        _target_signature = strchr(_target_method, '(');
-
-        if (_target_signature == NULL) {
-            _target_method_len = strlen(_target_method);
-        } else {
-            _target_method_len = _target_signature - _target_method;
-            _target_signature_len = strlen(_target_signature);
-        }
+        _dst_capacity(class_data_len + (trace ? class_data_len / 4 : 0) + 400),
+        _cpool(NULL),
+        _targets(targets),
+        _class_name(NULL),
+        _class_name_len(0),
+        _trace(trace),
+        _major_version(0),
+        _traced_id(-1),
+        _traced_name(0),
+        _traced_handler(false),
+        _handler_pc(0),
+        _returns(NULL),
+        _return_count(0) {
     }
 
     ~BytecodeRewriter() {
@@ -323,6 +478,177 @@ void BytecodeRewriter::rewriteCode() {
     *(u32*)(_dst + code_begin - 4) = htonl(_dst_len - code_begin);
 }
 
+// Finds the returns and checks that the rewritten code is still valid:
+// no unknown instructions, short branches in range, length within the limit
+bool BytecodeRewriter::scanTracedCode(const u8* code, u32 code_length) {
+    _return_count = 0;
+    for (u32 pc = 0, len; pc < code_length; pc += len) {
+        if ((len = instructionLength(code, pc, code_length)) == 0) {
+            return false;
+        }
+        if (isReturn(code[pc])) {
+            _returns[_return_count++] = pc;
+        }
+    }
+
+    if (relocate(code_length) + TRACE_HANDLER_BYTECODES > MAX_CODE_LENGTH) {
+        return false;
+    }
+
+    for (u32 pc = 0; pc < code_length; pc += instructionLength(code, pc, code_length)) {
+        if (isShortBranch(code[pc])) {
+            int offset = branchOffset(pc, (short)read16(code + pc + 1));
+            if (offset != (short)offset) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void BytecodeRewriter::rewriteTracedCode() {
+    const u8* attribute_start = _src;
+    u32 attribute_length = get32();
+
+    u16 max_stack = get16();
+    u16 max_locals = get16();
+    u32 code_length = get32();
+    const u8* code = get(code_length);
+
+    _returns = new u32[code_length];
+    if (code == NULL || !scanTracedCode(code, code_length)) {
+        // Leave the method as it is
+        delete[] _returns;
+        _returns = NULL;
+        _src = attribute_start + 4;
+        put32(attribute_length);
+        put(get(attribute_length), attribute_length);
+        return;
+    }
+
+    int code_begin = _dst_len + 4;
+    put32(attribute_length);
+
+    // A constructor cannot catch what it throws while this is uninitialized
+    _traced_handler = !_cpool[_traced_name]->equals("<init>", 6);
+    u32 handler_pc = _handler_pc = relocate(code_length);
+
+    // The exit call takes one more slot on top of a return value; the handler two
+    put16(_traced_handler && max_stack < 1 ? 2 : max_stack + 1);
+    put16(max_locals);
+    put32(handler_pc + (_traced_handler ? TRACE_HANDLER_BYTECODES : 0));
+
+    putTraceCall(_cpool_len);
+    put8(OP_NOP);
+    put8(OP_NOP);
+    rewriteTracedInstructions(code, code_length);
+    if (_traced_handler) {
+        putTraceCall(_cpool_len + 1);
+        put8(OP_ATHROW);
+    }
+
+    u16 exception_table_length = get16();
+    put16(exception_table_length + (_traced_handler ? 1 : 0));
+
+    for (int i = 0; i < exception_table_length; i++) {
+        u16 start_pc = get16();
+        u16 end_pc = get16();
+        u16 handler = get16();
+        u16 catch_type = get16();
+        put16(relocate(start_pc));
+        put16(relocate(end_pc));
+        put16(relocate(handler));
+        put16(catch_type);
+    }
+
+    // Last, so that the handlers of the method itself come first
+    if (_traced_handler) {
+        put16(TRACE_ENTRY_BYTECODES);
+        put16(handler_pc);
+        put16(handler_pc);
+        put16(0);
+    }
+
+    // Class files from version 50 need a frame for the handler, even without a StackMapTable
+    bool add_stack_map = false;
+    if (_traced_handler && _major_version >= 50) {
+        add_stack_map = true;
+        const u8* attributes = _src;
+        u16 attributes_count = get16();
+        for (int i = 0; i < attributes_count; i++) {
+            u16 attribute_name_index = get16();
+            u32 length = get32();
+            get(length);
+            if (_cpool[attribute_name_index]->equals("StackMapTable", 13)) {
+                add_stack_map = false;
+            }
+        }
+        _src = attributes;
+    }
+
+    if (add_stack_map) {
+        u16 attributes_count = get16();
+        _src -= 2;
+        // rewriteAttributes writes the count it reads
+        int count_pos = _dst_len;
+        rewriteAttributes(SCOPE_REWRITE_CODE);
+        *(u16*)(_dst + count_pos) = htons(attributes_count + 1);
+
+        put16(_cpool_len + 11);
+        put32(2 + 1 + 2 + 2 + 2 + 1 + 2);
+        put16(1);
+        putHandlerFrame(handler_pc, -1);
+    } else {
+        rewriteAttributes(SCOPE_REWRITE_CODE);
+    }
+
+    // Patch attribute length
+    *(u32*)(_dst + code_begin - 4) = htonl(_dst_len - code_begin);
+
+    delete[] _returns;
+    _returns = NULL;
+    _traced_handler = false;
+}
+
+void BytecodeRewriter::rewriteTracedInstructions(const u8* code, u32 code_length) {
+    for (u32 pc = 0, len; pc < code_length; pc += len) {
+        len = instructionLength(code, pc, code_length);
+        u8 op = code[pc];
+
+        if (isReturn(op)) {
+            putTraceCall(_cpool_len + 1);
+            put8(OP_NOP);
+            put8(OP_NOP);
+            put8(op);
+        } else if (isShortBranch(op)) {
+            put8(op);
+            put16((u16)branchOffset(pc, (short)read16(code + pc + 1)));
+        } else if (op == OP_GOTO_W || op == OP_JSR_W) {
+            put8(op);
+            put32((u32)branchOffset(pc, (int)read32(code + pc + 1)));
+        } else if (op == OP_TABLESWITCH || op == OP_LOOKUPSWITCH) {
+            // The inserted code keeps the alignment, the padding stays as it is
+            u32 operands = (pc + 4) & ~3;
+            put(code + pc, operands - pc);
+            put32((u32)branchOffset(pc, (int)read32(code + operands)));
+            if (op == OP_TABLESWITCH) {
+                put(code + operands + 4, 8);
+                for (u32 p = operands + 12; p < pc + len; p += 4) {
+                    put32((u32)branchOffset(pc, (int)read32(code + p)));
+                }
+            } else {
+                put(code + operands + 4, 4);
+                for (u32 p = operands + 8; p < pc + len; p += 8) {
+                    put(code + p, 4);
+                    put32((u32)branchOffset(pc, (int)read32(code + p + 4)));
+                }
+            }
+        } else {
+            put(code + pc, len);
+        }
+    }
+}
+
 void BytecodeRewriter::rewriteBytecodeTable(int data_len) {
     u32 attribute_length = get32();
     put32(attribute_length);
@@ -332,9 +658,16 @@ void BytecodeRewriter::rewriteBytecodeTable(int data_len) {
 
     for (int i = 0; i < table_length; i++) {
         u16 start_pc = get16();
-        put16(EXTRA_BYTECODES + start_pc);
+        put16(relocate(start_pc));
 
-        put(get(data_len), data_len);
+        if (data_len == 8) {
+            // LocalVariableTable: the range may enclose inserted calls
+            u16 length = get16();
+            put16(relocate(start_pc + length) - relocate(start_pc));
+            put(get(6), 6);
+        } else {
+            put(get(data_len), data_len);
+        }
     }
 }
 
@@ -387,12 +720,90 @@ void BytecodeRewriter::rewriteStackMapTable() {
     }
 }
 
+// Frames are decoded to their absolute offsets and encoded again, since the
+// distance between them grows; a short frame may need its extended form then
+void BytecodeRewriter::rewriteTracedStackMapTable() {
+    get32();
+    int length_pos = _dst_len;
+    put32(0);
+
+    u16 number_of_entries = get16();
+    put16(number_of_entries + (_traced_handler ? 1 : 0));
+
+    int old_pc = -1;
+    int new_pc = -1;
+    for (int i = 0; i < number_of_entries; i++) {
+        u8 frame_type = get8();
+        u32 offset_delta = frame_type <= 63 ? frame_type : frame_type <= 127 ? frame_type - 64 : get16();
+        old_pc += offset_delta + 1;
+        int pc = (int)relocate(old_pc);
+        u16 delta = (u16)(pc - new_pc - 1);
+        new_pc = pc;
+
+        if (frame_type <= 63) {
+            // same_frame
+            if (delta <= 63) {
+                put8(delta);
+            } else {
+                put8(251);
+                put16(delta);
+            }
+        } else if (frame_type <= 127) {
+            // same_locals_1_stack_item_frame
+            if (delta <= 63) {
+                put8(64 + delta);
+            } else {
+                put8(247);
+                put16(delta);
+            }
+            rewriteVerificationTypeInfo();
+        } else {
+            put8(frame_type);
+            put16(delta);
+            if (frame_type == 247) {
+                rewriteVerificationTypeInfo();
+            } else if (frame_type >= 252 && frame_type <= 254) {
+                for (int j = 0; j < frame_type - 251; j++) {
+                    rewriteVerificationTypeInfo();
+                }
+            } else if (frame_type == 255) {
+                u16 number_of_locals = get16();
+                put16(number_of_locals);
+                for (int j = 0; j < number_of_locals; j++) {
+                    rewriteVerificationTypeInfo();
+                }
+                u16 number_of_stack_items = get16();
+                put16(number_of_stack_items);
+                for (int j = 0; j < number_of_stack_items; j++) {
+                    rewriteVerificationTypeInfo();
+                }
+            }
+        }
+    }
+
+    if (_traced_handler) {
+        putHandlerFrame(_handler_pc, new_pc);
+    }
+
+    *(u32*)(_dst + length_pos) = htonl(_dst_len - length_pos - 4);
+}
+
+// full_frame with no locals and the Throwable on the stack
+void BytecodeRewriter::putHandlerFrame(u32 handler_pc, int prev_pc) {
+    put8(255);
+    put16((u16)(handler_pc - prev_pc - 1));
+    put16(0);
+    put16(1);
+    put8(7);
+    put16(_cpool_len + 9);
+}
+
 void BytecodeRewriter::rewriteVerificationTypeInfo() {
     u8 tag = get8();
     put8(tag);
     if (tag >= 7) {
         // Adjust ITEM_Uninitialized offset
-        put16(tag == 8 ? EXTRA_BYTECODES + get16() : get16());
+        put16(tag == 8 ? relocate(get16()) : get16());
     }
 }
 
@@ -406,7 +817,11 @@ void BytecodeRewriter::rewriteAttributes(Scope scope) {
 
         Constant* attribute_name = _cpool[attribute_name_index];
         if (scope == SCOPE_REWRITE_METHOD && attribute_name->equals("Code", 4)) {
-            rewriteCode();
+            if (_traced_id >= 0) {
+                rewriteTracedCode();
+            } else {
+                rewriteCode();
+            }
             continue;
         } else if (scope == SCOPE_REWRITE_CODE) {
             if (attribute_name->equals("LineNumberTable", 15)) {
@@ -417,7 +832,11 @@ void BytecodeRewriter::rewriteAttributes(Scope scope) {
                 rewriteBytecodeTable(8);
                 continue;
             } else if (attribute_name->equals("StackMapTable", 13)) {
-                rewriteStackMapTable();
+                if (_traced_id >= 0) {
+                    rewriteTracedStackMapTable();
+                } else {
+                    rewriteStackMapTable();
+                }
                 continue;
             }
         }
@@ -442,11 +861,15 @@ void BytecodeRewriter::rewriteMembers(Scope scope) {
         u16 descriptor_index = get16();
         put16(descriptor_index);
 
-        bool need_rewrite = scope == SCOPE_METHOD
-            && _cpool[name_index]->matches(_target_method, _target_method_len)
-            && (_target_signature == NULL || _cpool[descriptor_index]->matches(_target_signature, _target_signature_len));
+        int target = scope == SCOPE_METHOD ? findTarget(_cpool[name_index], _cpool[descriptor_index]) : -1;
+        bool need_rewrite = target >= 0;
+        if (_trace) {
+            _traced_id = target;
+            _traced_name = name_index;
+        }
 
         rewriteAttributes(need_rewrite ? SCOPE_REWRITE_METHOD : SCOPE_METHOD);
+        _traced_id = -1;
     }
 }
 
@@ -456,9 +879,10 @@ bool BytecodeRewriter::rewriteClass() {
 
     u32 version = get32();
     put32(version);
+    _major_version = (u16)version;
 
     _cpool_len = get16();
-    put16(_cpool_len + EXTRA_CONSTANTS);
+    put16(_cpool_len + (_trace ? (int)TRACE_CONSTANTS : (int)EXTRA_CONSTANTS));
 
     const u8* cpool_start = _src;
 
@@ -470,12 +894,27 @@ bool BytecodeRewriter::rewriteClass() {
     const u8* cpool_end = _src;
     put(cpool_start, cpool_end - cpool_start);
 
-    putConstant(CONSTANT_Methodref, _cpool_len + 1, _cpool_len + 2);
-    putConstant(CONSTANT_Class, _cpool_len + 3);
-    putConstant(CONSTANT_NameAndType, _cpool_len + 4, _cpool_len + 5);
-    putConstant("one/profiler/Instrument");
-    putConstant("recordSample");
-    putConstant("()V");
+    if (_trace) {
+        putConstant(CONSTANT_Methodref, _cpool_len + 2, _cpool_len + 3);
+        putConstant(CONSTANT_Methodref, _cpool_len + 2, _cpool_len + 4);
+        putConstant(CONSTANT_Class, _cpool_len + 5);
+        putConstant(CONSTANT_NameAndType, _cpool_len + 6, _cpool_len + 8);
+        putConstant(CONSTANT_NameAndType, _cpool_len + 7, _cpool_len + 8);
+        putConstant("one/profiler/Instrument");
+        putConstant("recordEntry");
+        putConstant("recordExit");
+        putConstant("(I)V");
+        putConstant(CONSTANT_Class, _cpool_len + 10);
+        putConstant("java/lang/Throwable");
+        putConstant("StackMapTable");
+    } else {
+        putConstant(CONSTANT_Methodref, _cpool_len + 1, _cpool_len + 2);
+        putConstant(CONSTANT_Class, _cpool_len + 3);
+        putConstant(CONSTANT_NameAndType, _cpool_len + 4, _cpool_len + 5);
+        putConstant("one/profiler/Instrument");
+        putConstant("recordSample");
+        putConstant("()V");
+    }
 
     u16 access_flags = get16();
     put16(access_flags);
@@ -483,8 +922,10 @@ bool BytecodeRewriter::rewriteClass() {
     u16 this_class = get16();
     put16(this_class);
 
-    u16 class_name_index = _cpool[this_class]->info();
-    if (!_cpool[class_name_index]->equals(_target_class, _target_class_len)) {
+    Constant* class_name = _cpool[_cpool[this_class]->info()];
+    _class_name = class_name->utf8();
+    _class_name_len = class_name->info();
+    if (!_targets->matchesClass(_class_name, _class_name_len)) {
         return false;
     }
 
@@ -503,19 +944,27 @@ bool BytecodeRewriter::rewriteClass() {
 }
 
 
-char* Instrument::_target_class = NULL;
+InstrumentTargets Instrument::_targets;
 bool Instrument::_instrument_class_loaded = false;
 u64 Instrument::_interval;
 volatile u64 Instrument::_calls;
 volatile bool Instrument::_running;
 
 Error Instrument::check(Arguments& args) {
+    return loadClass();
+}
+
+Error Instrument::loadClass() {
     if (!_instrument_class_loaded) {
         JNIEnv* jni = VM::jni();
-        const JNINativeMethod native_method = {(char*)"recordSample", (char*)"()V", (void*)recordSample};
+        const JNINativeMethod native_methods[] = {
+            {(char*)"recordSample", (char*)"()V", (void*)recordSample},
+            {(char*)"recordEntry", (char*)"(I)V", (void*)MethodTracer::recordEntry},
+            {(char*)"recordExit", (char*)"(I)V", (void*)MethodTracer::recordExit}
+        };
 
         jclass cls = jni->DefineClass(NULL, NULL, (const jbyte*)INSTRUMENT_CLASS, INCBIN_SIZEOF(INSTRUMENT_CLASS));
-        if (cls == NULL || jni->RegisterNatives(cls, &native_method, 1) != 0) {
+        if (cls == NULL || jni->RegisterNatives(cls, native_methods, 3) != 0) {
             jni->ExceptionDescribe();
             return Error("Could not load Instrument class");
         }
@@ -536,7 +985,11 @@ Error Instrument::start(Arguments& args) {
         return Error("interval must be positive");
     }
 
-    setupTargetClassAndMethod(args._event);
+    error = _targets.parse(args._event);
+    if (error) {
+        return error;
+    }
+
     _interval = args._interval ? args._interval : 1;
     _calls = 0;
     _running = true;
@@ -553,20 +1006,9 @@ void Instrument::stop() {
 
     jvmtiEnv* jvmti = VM::jvmti();
     retransformMatchedClasses(jvmti);  // undo transformation
-    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
-}
-
-void Instrument::setupTargetClassAndMethod(const char* event) {
-    char* new_class = strdup(event);
-    *strrchr(new_class, '.') = 0;
-
-    for (char* s = new_class; *s; s++) {
-        if (*s == '.') *s = '/';
+    if (!MethodTracer::running()) {
+        jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
     }
-
-    char* old_class = _target_class;
-    _target_class = new_class;
-    free(old_class);
 }
 
 void Instrument::retransformMatchedClasses(jvmtiEnv* jvmti) {
@@ -577,11 +1019,10 @@ void Instrument::retransformMatchedClasses(jvmtiEnv* jvmti) {
     }
 
     jint matched_count = 0;
-    size_t len = strlen(_target_class);
     for (int i = 0; i < class_count; i++) {
         char* signature;
         if (jvmti->GetClassSignature(classes[i], &signature, NULL) == 0) {
-            if (signature[0] == 'L' && strncmp(signature + 1, _target_class, len) == 0 && signature[len + 1] == ';') {
+            if (_targets.matchesSignature(signature)) {
                 classes[matched_count++] = classes[i];
             }
             jvmti->Deallocate((unsigned char*)signature);
@@ -601,11 +1042,20 @@ void JNICALL Instrument::ClassFileLoadHook(jvmtiEnv* jvmti, JNIEnv* jni,
                                            const char* name, jobject protection_domain,
                                            jint class_data_len, const u8* class_data,
                                            jint* new_class_data_len, u8** new_class_data) {
+    // Every class the application loads passes here: most are rejected by a hash probe.
+    // A class without a name is matched by the rewriter once it has read the name.
+    size_t len = name != NULL ? strlen(name) : 0;
+
     // Do not retransform if the profiling has stopped
-    if (!_running) return;
+    if (_running && (name == NULL || _targets.matchesClass(name, len))) {
+        BytecodeRewriter rewriter(class_data, class_data_len, &_targets, false);
+        rewriter.rewrite(new_class_data, new_class_data_len);
+        // A class instrumented for event= is not traced by methods= at the same time
+        if (*new_class_data != NULL) return;
+    }
 
-    if (name == NULL || strcmp(name, _target_class) == 0) {
-        BytecodeRewriter rewriter(class_data, class_data_len, _target_class);
+    if (MethodTracer::running() && name != NULL && MethodTracer::targets().matchesClass(name, len)) {
+        BytecodeRewriter rewriter(class_data, class_data_len, &MethodTracer::targets(), true);
         rewriter.rewrite(new_class_data, new_class_data_len);
     }
 }
@@ -19,11 +19,12 @@
 
 #include <jvmti.h>
 #include "engine.h"
+#include "instrumentTargets.h"
 
 
 class Instrument : public Engine {
   private:
-    static char* _target_class;
+    static InstrumentTargets _targets;
     static bool _instrument_class_loaded;
     static u64 _interval;
     static volatile u64 _calls;
@@ -42,7 +43,12 @@ class Instrument : public Engine {
     Error start(Arguments& args);
     void stop();
 
-    void setupTargetClassAndMethod(const char* event);
+    static bool running() {
+        return _running;
+    }
+
+    // Defines one.profiler.Instrument and binds its natives, once
+    static Error loadClass();
 
     void retransformMatchedClasses(jvmtiEnv* jvmti);
 
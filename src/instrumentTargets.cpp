@@ -0,0 +1,118 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "instrumentTargets.h"
+
+
+u32 InstrumentTargets::hash(const char* name, size_t len) {
+    u32 h = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (u8)name[i]) * 16777619;
+    }
+    return h;
+}
+
+// The method name follows the last '.' before the signature
+Error InstrumentTargets::parse(const char* spec) {
+    clear();
+
+    const char* p = spec;
+    while (*p) {
+        const char* end = strchr(p, '+');
+        size_t len = end != NULL ? end - p : strlen(p);
+        if (len > 0) {
+            if (_count >= MAX_INSTRUMENT_TARGETS) {
+                clear();
+                return Error("Too many methods to instrument");
+            }
+
+            MethodTarget* target = &_targets[_count++];
+            target->name = strndup(p, len);
+            target->class_name = strdup(target->name);
+
+            char* signature = strchr(target->class_name, '(');
+            if (signature != NULL) {
+                target->signature = strdup(signature);
+                target->signature_len = strlen(signature);
+                *signature = 0;
+            }
+
+            char* dot = strrchr(target->class_name, '.');
+            if (dot == NULL || dot == target->class_name || dot[1] == 0) {
+                clear();
+                return Error("Method must be specified as Class.method[(signature)]");
+            }
+            *dot = 0;
+            target->method = strdup(dot + 1);
+            target->method_len = strlen(target->method);
+
+            for (char* s = target->class_name; *s; s++) {
+                if (*s == '.') *s = '/';
+            }
+            target->class_name_len = strlen(target->class_name);
+            addClass(_count - 1);
+        }
+        p += len;
+        if (*p == '+') p++;
+    }
+
+    return _count > 0 ? Error::OK : Error("No methods to instrument");
+}
+
+void InstrumentTargets::addClass(int index) {
+    const MethodTarget& target = _targets[index];
+    u32 h = hash(target.class_name, target.class_name_len);
+    for (u32 i = h & (TARGET_CLASS_SLOTS - 1); ; i = (i + 1) & (TARGET_CLASS_SLOTS - 1)) {
+        TargetClassSlot* slot = &_slots[i];
+        if (slot->target == 0) {
+            slot->hash = h;
+            slot->target = index + 1;
+            return;
+        } else if (slot->hash == h && sameClass(_targets[slot->target - 1], target.class_name, target.class_name_len)) {
+            return;
+        }
+    }
+}
+
+void InstrumentTargets::clear() {
+    for (int i = 0; i < _count; i++) {
+        free(_targets[i].name);
+        free(_targets[i].class_name);
+        free(_targets[i].method);
+        free(_targets[i].signature);
+    }
+    memset(_targets, 0, sizeof(_targets));
+    memset(_slots, 0, sizeof(_slots));
+    _count = 0;
+}
+
+bool InstrumentTargets::matchesClass(const char* name, size_t len) const {
+    u32 h = hash(name, len);
+    for (u32 i = h & (TARGET_CLASS_SLOTS - 1); _slots[i].target != 0; i = (i + 1) & (TARGET_CLASS_SLOTS - 1)) {
+        if (_slots[i].hash == h && sameClass(_targets[_slots[i].target - 1], name, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool InstrumentTargets::matchesSignature(const char* signature) const {
+    size_t len = strlen(signature);
+    return len > 2 && signature[0] == 'L' && signature[len - 1] == ';' && matchesClass(signature + 1, len - 2);
+}
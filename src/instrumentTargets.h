@@ -0,0 +1,90 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _INSTRUMENTTARGETS_H
+#define _INSTRUMENTTARGETS_H
+
+#include <stddef.h>
+#include <string.h>
+#include "arch.h"
+#include "arguments.h"
+
+
+const int MAX_INSTRUMENT_TARGETS = 64;
+const u32 TARGET_CLASS_SLOTS = 256;  // must be a power of 2, at least twice the targets
+
+// One method pattern, e.g. com.example.Handler.handle or com.example.Handler.get*(I)V
+struct MethodTarget {
+    char* name;          // as given, for the reports
+    char* class_name;    // internal form, com/example/Handler
+    u16 class_name_len;
+    char* method;        // may end with '*'
+    u16 method_len;
+    char* signature;     // NULL for any
+    u16 signature_len;
+};
+
+// Distinct target classes by the hash of their name; target is the first
+// target of the class + 1, 0 for a free slot
+struct TargetClassSlot {
+    u32 hash;
+    u32 target;
+};
+
+// The targets of Instrument (event=) or MethodTracer (methods=), separated by '+'.
+// ClassFileLoadHook sees every class the application loads, so a class is rejected
+// with one hash probe; names are only compared when the hash matches.
+class InstrumentTargets {
+  private:
+    MethodTarget _targets[MAX_INSTRUMENT_TARGETS];
+    int _count;
+    TargetClassSlot _slots[TARGET_CLASS_SLOTS];
+
+    static u32 hash(const char* name, size_t len);
+    void addClass(int index);
+
+  public:
+    InstrumentTargets() : _count(0) {
+    }
+
+    ~InstrumentTargets() {
+        clear();
+    }
+
+    int count() const {
+        return _count;
+    }
+
+    const MethodTarget& operator[](int index) const {
+        return _targets[index];
+    }
+
+    Error parse(const char* spec);
+    void clear();
+
+    // name is in the internal form and need not be terminated
+    bool matchesClass(const char* name, size_t len) const;
+
+    // The class signature is Lpkg/Name;
+    bool matchesSignature(const char* signature) const;
+
+    static bool sameClass(const MethodTarget& target, const char* name, size_t len) {
+        return target.class_name_len == len && memcmp(target.class_name, name, len) == 0;
+    }
+};
+
+#endif // _INSTRUMENTTARGETS_H
@@ -0,0 +1,469 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "ioTracer.h"
+#include "eventLogger.h"
+#include "frameName.h"
+#include "memoryBudget.h"
+#include "overheadGovernor.h"
+#include "profiler.h"
+#include "timeUtil.h"
+
+
+static const char* const OPERATION_NAMES[IO_OPERATIONS] = {
+    "read",
+    "write",
+    "recv",
+    "send",
+    "poll"
+};
+
+static const char* const FD_TYPE_NAMES[IO_FD_TYPES] = {
+    "file",
+    "pipe",
+    "tcp",
+    "udp",
+    "unix",
+    "socket",
+    "poll",
+    "other"
+};
+
+u64 IoTracer::_threshold_ticks;
+bool IoTracer::_resolve_peers = false;
+IoHistogram* IoTracer::_table = NULL;
+volatile u64 IoTracer::_dropped = 0;
+CodeCache* IoTracer::_self = NULL;
+volatile bool IoTracer::_running = false;
+jlong IoTracer::_report_interval;
+jlong IoTracer::_last_report = 0;
+FrameName* IoTracer::_frame_name = NULL;
+IoReportTask* IoTracer::_report_task = NULL;
+
+
+// The profiler's own calls are not patched, so the hooks reach the real functions
+static ssize_t read_hook(int fd, void* buf, size_t count) {
+    u64 start = TSC::ticks();
+    ssize_t result = read(fd, buf, count);
+    IoTracer::traced(IO_READ, fd, result, start);
+    return result;
+}
+
+static ssize_t write_hook(int fd, const void* buf, size_t count) {
+    u64 start = TSC::ticks();
+    ssize_t result = write(fd, buf, count);
+    IoTracer::traced(IO_WRITE, fd, result, start);
+    return result;
+}
+
+static ssize_t readv_hook(int fd, const struct iovec* iov, int iovcnt) {
+    u64 start = TSC::ticks();
+    ssize_t result = readv(fd, iov, iovcnt);
+    IoTracer::traced(IO_READ, fd, result, start);
+    return result;
+}
+
+static ssize_t writev_hook(int fd, const struct iovec* iov, int iovcnt) {
+    u64 start = TSC::ticks();
+    ssize_t result = writev(fd, iov, iovcnt);
+    IoTracer::traced(IO_WRITE, fd, result, start);
+    return result;
+}
+
+static ssize_t recv_hook(int fd, void* buf, size_t len, int flags) {
+    u64 start = TSC::ticks();
+    ssize_t result = recv(fd, buf, len, flags);
+    IoTracer::traced(IO_RECV, fd, result, start);
+    return result;
+}
+
+static ssize_t send_hook(int fd, const void* buf, size_t len, int flags) {
+    u64 start = TSC::ticks();
+    ssize_t result = send(fd, buf, len, flags);
+    IoTracer::traced(IO_SEND, fd, result, start);
+    return result;
+}
+
+static ssize_t recvfrom_hook(int fd, void* buf, size_t len, int flags, struct sockaddr* addr, socklen_t* addrlen) {
+    u64 start = TSC::ticks();
+    ssize_t result = recvfrom(fd, buf, len, flags, addr, addrlen);
+    IoTracer::traced(IO_RECV, fd, result, start);
+    return result;
+}
+
+static ssize_t sendto_hook(int fd, const void* buf, size_t len, int flags, const struct sockaddr* addr, socklen_t addrlen) {
+    u64 start = TSC::ticks();
+    ssize_t result = sendto(fd, buf, len, flags, addr, addrlen);
+    IoTracer::traced(IO_SEND, fd, result, start);
+    return result;
+}
+
+static int poll_hook(struct pollfd* fds, nfds_t nfds, int timeout) {
+    u64 start = TSC::ticks();
+    int result = poll(fds, nfds, timeout);
+    IoTracer::traced(IO_POLL, -1, result, start);
+    return result;
+}
+
+#ifdef __linux__
+static int epoll_wait_hook(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+    u64 start = TSC::ticks();
+    int result = epoll_wait(epfd, events, maxevents, timeout);
+    IoTracer::traced(IO_POLL, epfd, result, start);
+    return result;
+}
+#endif
+
+static inline u32 histogramSlot(u64 key) {
+    return (u32)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (IO_TABLE_CAPACITY - 1);
+}
+
+static inline u64 takeCounter(volatile u64& counter) {
+    return __sync_lock_test_and_set(&counter, 0);
+}
+
+void IoTracer::recordIo(IoOperation op, int fd, ssize_t result, u64 start, u64 end) {
+    IoFdType type = fdType(op, fd);
+    char peer[IO_PEER_SIZE];
+    if (!_resolve_peers || !peerName(fd, type, peer, sizeof(peer))) {
+        peer[0] = 0;
+    }
+
+    u64 duration = TSC::ticksToNanos(end - start);
+    IoEvent event;
+    event._start_time = start;
+    event._end_time = end;
+    event._fd = fd;
+    event._result = result;
+    event._operation = OPERATION_NAMES[op];
+    event._fd_type = FD_TYPE_NAMES[type];
+    event._peer = peer;
+    u32 call_trace_id = Profiler::instance()->recordSample(NULL, duration, BCI_IO, &event);
+
+    IoHistogram* histogram = call_trace_id == 0 ? NULL : findHistogram((u64)call_trace_id << 8 | type);
+    if (histogram == NULL) {
+        atomicInc(_dropped);
+        return;
+    }
+
+    atomicInc(histogram->count);
+    if (result > 0 && op != IO_POLL) {
+        atomicInc(histogram->bytes, (u64)result);
+    }
+    atomicInc(histogram->total_ns, duration);
+    u64 max = histogram->max_ns;
+    while (duration > max && !__sync_bool_compare_and_swap(&histogram->max_ns, max, duration)) {
+        max = histogram->max_ns;
+    }
+    __sync_fetch_and_add(&histogram->buckets[LatencyStats::bucket(duration / 1000)], 1);
+
+    if (peer[0] != 0) {
+        histogram->peer_lock.lock();
+        strcpy(histogram->peer, peer);
+        histogram->peer_lock.unlock();
+    }
+}
+
+// Only slow calls get here, so a few more system calls do not matter
+IoFdType IoTracer::fdType(IoOperation op, int fd) {
+    if (op == IO_POLL) {
+        return IO_FD_POLL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return IO_FD_OTHER;
+    } else if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
+        return IO_FD_FILE;
+    } else if (S_ISFIFO(st.st_mode)) {
+        return IO_FD_PIPE;
+    } else if (!S_ISSOCK(st.st_mode)) {
+        return IO_FD_OTHER;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int sock_type;
+    socklen_t type_len = sizeof(sock_type);
+    if (getsockname(fd, (struct sockaddr*)&addr, &addr_len) != 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &type_len) != 0) {
+        return IO_FD_SOCKET;
+    }
+
+    if (addr.ss_family == AF_UNIX) {
+        return IO_FD_UNIX;
+    } else if (addr.ss_family == AF_INET || addr.ss_family == AF_INET6) {
+        return sock_type == SOCK_STREAM ? IO_FD_TCP : sock_type == SOCK_DGRAM ? IO_FD_UDP : IO_FD_SOCKET;
+    }
+    return IO_FD_SOCKET;
+}
+
+// host:port, [host]:port or the path of a Unix socket, '@' first for an abstract one.
+// Unconnected sockets have no peer.
+bool IoTracer::peerName(int fd, IoFdType type, char* buf, size_t size) {
+    if (type != IO_FD_TCP && type != IO_FD_UDP && type != IO_FD_UNIX) {
+        return false;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        return false;
+    }
+
+    char host[INET6_ADDRSTRLEN];
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in* in = (struct sockaddr_in*)&addr;
+        if (inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host)) == NULL) return false;
+        snprintf(buf, size, "%s:%d", host, ntohs(in->sin_port));
+    } else if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+        if (inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host)) == NULL) return false;
+        snprintf(buf, size, "[%s]:%d", host, ntohs(in6->sin6_port));
+    } else if (addr.ss_family == AF_UNIX) {
+        struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+        size_t path_len = addr_len > offsetof(struct sockaddr_un, sun_path) ? addr_len - offsetof(struct sockaddr_un, sun_path) : 0;
+        if (path_len == 0) {
+            return false;
+        } else if (un->sun_path[0] == 0) {
+            snprintf(buf, size, "@%.*s", (int)(path_len - 1), un->sun_path + 1);
+        } else {
+            snprintf(buf, size, "%.*s", (int)path_len, un->sun_path);
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+IoHistogram* IoTracer::findHistogram(u64 key) {
+    const u32 mask = IO_TABLE_CAPACITY - 1;
+    u32 i = histogramSlot(key);
+    for (int probe = 0; probe < IO_TABLE_PROBES; probe++, i = (i + 1) & mask) {
+        IoHistogram* histogram = &_table[i];
+        u64 current = __atomic_load_n(&histogram->key, __ATOMIC_ACQUIRE);
+        if (current == key) {
+            return histogram;
+        } else if (current == 0) {
+            if (__sync_bool_compare_and_swap(&histogram->key, 0, key)) {
+                return histogram;
+            } else if (histogram->key == key) {
+                return histogram;
+            }
+        }
+    }
+    // Too many stacks around this one; the call is still in the profile
+    return NULL;
+}
+
+// Frames are leaf first, separated by ';'. The stack is cut where the record is full.
+void IoTracer::formatStack(u32 call_trace_id, char* buf, size_t size) {
+    buf[0] = 0;
+    CallTrace* trace = Profiler::instance()->findTrace(call_trace_id);
+    if (trace == NULL) {
+        return;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < trace->num_frames && len < size - 1; i++) {
+        int n = snprintf(buf + len, size - len, i == 0 ? "%s" : ";%s", _frame_name->name(trace->frames[i]));
+        if (n < 0) break;
+        len += n;
+    }
+}
+
+// One record per histogram that got calls in the interval:
+//     kd-ioh@timestamp!interval_ns!fd_type!count!bytes!total_ns!max_ns!p50_ns!p99_ns!peer!buckets!stack!
+// buckets lists the non-empty ones as upper_bound_us:count,...; percentiles are
+// bucket upper bounds. A call that lands while its histogram is being read
+// may be counted in this interval and bucketed in the next.
+void IoTracer::report() {
+    if (_table == NULL) {
+        return;
+    }
+
+    jlong now = KdClock::now();
+    jlong interval = KdClock::toNanos(now - _last_report);
+    _last_report = now;
+
+    for (u32 i = 0; i < IO_TABLE_CAPACITY; i++) {
+        IoHistogram* histogram = &_table[i];
+        u64 key = __atomic_load_n(&histogram->key, __ATOMIC_ACQUIRE);
+        if (key == 0 || histogram->count == 0) {
+            continue;
+        }
+
+        u64 count = takeCounter(histogram->count);
+        u64 bytes = takeCounter(histogram->bytes);
+        u64 total_ns = takeCounter(histogram->total_ns);
+        u64 max_ns = takeCounter(histogram->max_ns);
+        u32 buckets[LATENCY_BUCKETS];
+        u64 bucketed = 0;
+        for (int j = 0; j < LATENCY_BUCKETS; j++) {
+            bucketed += buckets[j] = __sync_lock_test_and_set(&histogram->buckets[j], 0);
+        }
+
+        char bucket_list[320];
+        size_t len = 0;
+        u64 p50 = 0, p99 = 0, seen = 0;
+        bucket_list[0] = 0;
+        for (int j = 0; j < LATENCY_BUCKETS; j++) {
+            if (buckets[j] == 0) continue;
+            seen += buckets[j];
+            u64 limit = LatencyStats::bucketLimit(j);
+            if (p50 == 0 && seen * 2 >= bucketed) p50 = limit * 1000;
+            if (p99 == 0 && seen * 100 >= bucketed * 99) p99 = limit * 1000;
+            if (len < sizeof(bucket_list) - 1) {
+                int n = snprintf(bucket_list + len, sizeof(bucket_list) - len, len == 0 ? "%llu:%u" : ",%llu:%u",
+                                 (unsigned long long)limit, buckets[j]);
+                if (n > 0) len += n;
+            }
+        }
+
+        char peer[IO_PEER_SIZE];
+        histogram->peer_lock.lock();
+        strcpy(peer, histogram->peer);
+        histogram->peer_lock.unlock();
+
+        char stack[512];
+        formatStack((u32)(key >> 8), stack, sizeof(stack));
+        EventLogger::log("kd-ioh@%ld!%ld!%s!%llu!%llu!%llu!%llu!%llu!%llu!%s!%s!%s!", now, interval,
+                         FD_TYPE_NAMES[key & 0xff], count, bytes, total_ns, max_ns, p50, p99, peer, bucket_list, stack);
+    }
+}
+
+void IoTracer::reportIfDue() {
+    if (KdClock::toNanos(KdClock::now() - _last_report) >= _report_interval) {
+        u64 start = TSC::ticks();
+        report();
+        OverheadGovernor::add(OVERHEAD_LOCK, start);
+    }
+}
+
+// Every GOT entry of the function is replaced: a library may refer to it both
+// through the PLT and by address
+void IoTracer::patchLibraries(bool enable) {
+    void* const originals[] = {
+        (void*)read, (void*)write, (void*)readv, (void*)writev, (void*)recv, (void*)send,
+        (void*)recvfrom, (void*)sendto, (void*)poll,
+#ifdef __linux__
+        (void*)epoll_wait,
+#endif
+    };
+    void* const hooks[] = {
+        (void*)read_hook, (void*)write_hook, (void*)readv_hook, (void*)writev_hook, (void*)recv_hook, (void*)send_hook,
+        (void*)recvfrom_hook, (void*)sendto_hook, (void*)poll_hook,
+#ifdef __linux__
+        (void*)epoll_wait_hook,
+#endif
+    };
+    const int functions = sizeof(originals) / sizeof(originals[0]);
+
+    CodeCacheArray* libs = Profiler::instance()->nativeLibs();
+    int count = libs->count();
+    for (int i = 0; i < count; i++) {
+        CodeCache* lib = (*libs)[i];
+        if (lib == _self) {
+            continue;
+        }
+        for (int j = 0; j < functions; j++) {
+            void* from = enable ? originals[j] : hooks[j];
+            void* to = enable ? hooks[j] : originals[j];
+            void** entry;
+            while ((entry = lib->findGlobalOffsetEntry(from)) != NULL) {
+                __atomic_store_n(entry, to, __ATOMIC_RELEASE);
+            }
+        }
+    }
+}
+
+void IoTracer::installHooks() {
+    if (_running) {
+        patchLibraries(true);
+    }
+}
+
+Error IoTracer::check(Arguments& args) {
+    if (Profiler::instance()->findLibraryByAddress((const void*)read_hook) == NULL) {
+        return Error("Could not find the profiler library");
+    }
+    return Error::OK;
+}
+
+Error IoTracer::start(Arguments& args) {
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    // The table outlives the run: a call blocked in a hook since then may still land in it
+    if (_table == NULL) {
+        _table = (IoHistogram*)calloc(IO_TABLE_CAPACITY, sizeof(IoHistogram));
+        if (_table == NULL) {
+            return Error("Could not allocate I/O histograms");
+        }
+        MemoryBudget::charge(MEMORY_IO_STATS, IO_TABLE_CAPACITY * sizeof(IoHistogram));
+    } else {
+        memset((void*)_table, 0, IO_TABLE_CAPACITY * sizeof(IoHistogram));
+    }
+    _dropped = 0;
+
+    long threshold = args._io > 0 ? args._io : DEFAULT_IO_THRESHOLD;
+    _threshold_ticks = TSC::enabled() ? (u64)(threshold * (TSC::frequency() / 1e9)) : (u64)threshold;
+    _resolve_peers = args._io_addr;
+    _report_interval = (jlong)(args._io_stat > 0 ? args._io_stat : DEFAULT_IO_REPORT_INTERVAL) * 1000000000LL;
+    _last_report = KdClock::now();
+    _self = Profiler::instance()->findLibraryByAddress((const void*)read_hook);
+
+    _frame_name = Profiler::instance()->newFrameName(args);
+    _report_task = new IoReportTask();
+    BackgroundScheduler::schedule(_report_task, IO_POLL_INTERVAL_MS);
+
+    _running = true;
+    patchLibraries(true);
+    return Error::OK;
+}
+
+void IoTracer::stop() {
+    _running = false;
+    patchLibraries(false);
+
+    BackgroundScheduler::cancel(_report_task);
+    delete _report_task;
+    _report_task = NULL;
+    report();  // the last interval
+    delete _frame_name;
+    _frame_name = NULL;
+
+    if (_dropped > 0) {
+        Log::debug("%llu slow I/O calls were not added to a histogram", _dropped);
+    }
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _IOTRACER_H
+#define _IOTRACER_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "arch.h"
+#include "backgroundScheduler.h"
+#include "codeCache.h"
+#include "engine.h"
+#include "event.h"
+#include "latencyStats.h"
+#include "spinLock.h"
+#include "tsc.h"
+
+
+const long DEFAULT_IO_THRESHOLD = 1000000;  // 1ms
+const int DEFAULT_IO_REPORT_INTERVAL = 10;  // seconds
+const int IO_POLL_INTERVAL_MS = 100;
+const u32 IO_TABLE_CAPACITY = 2048;  // must be a power of 2
+const int IO_TABLE_PROBES = 32;
+const int IO_PEER_SIZE = 64;
+
+enum IoOperation {
+    IO_READ,
+    IO_WRITE,
+    IO_RECV,
+    IO_SEND,
+    IO_POLL,
+    IO_OPERATIONS
+};
+
+// What a file descriptor refers to, as seen when a slow call on it returns
+enum IoFdType {
+    IO_FD_FILE,
+    IO_FD_PIPE,
+    IO_FD_TCP,
+    IO_FD_UDP,
+    IO_FD_UNIX,
+    IO_FD_SOCKET,   // a socket of another family or type
+    IO_FD_POLL,     // epoll_wait and poll wait for many descriptors
+    IO_FD_OTHER,
+    IO_FD_TYPES
+};
+
+// Slow calls of one stack on one type of descriptor, since the last report.
+// key is call_trace_id << 8 | fd type, 0 for a free slot. Slots are claimed
+// with a CAS and never given back while the engine runs; the counters are
+// atomically added to by the hooks and swapped out by the reporter.
+// Durations are bucketed in microseconds with LatencyStats::bucket.
+struct IoHistogram {
+    volatile u64 key;
+    volatile u64 count;
+    volatile u64 bytes;
+    volatile u64 total_ns;
+    volatile u64 max_ns;
+    volatile u32 buckets[LATENCY_BUCKETS];
+    // The peer of the last socket seen (ioaddr)
+    SpinLock peer_lock;
+    char peer[IO_PEER_SIZE];
+};
+
+class FrameName;
+class IoReportTask;
+
+// Times blocking I/O calls (io) by patching read, write, readv, writev, recv, send,
+// recvfrom, sendto, poll and epoll_wait in the GOT of every loaded library but the
+// profiler itself, like MallocTracer does with malloc. Calls that take at least
+// the threshold are recorded as samples weighted by their duration and added to
+// a histogram of their stack and descriptor type. Every iostat seconds
+// the histograms are logged as kd-ioh records and cleared.
+class IoTracer : public Engine {
+  private:
+    static u64 _threshold_ticks;
+    static bool _resolve_peers;
+    static IoHistogram* _table;
+    static volatile u64 _dropped;
+    static CodeCache* _self;
+    static volatile bool _running;
+
+    static jlong _report_interval;
+    static jlong _last_report;
+    static FrameName* _frame_name;
+    static IoReportTask* _report_task;
+
+    static void recordIo(IoOperation op, int fd, ssize_t result, u64 start, u64 end);
+    static IoFdType fdType(IoOperation op, int fd);
+    static bool peerName(int fd, IoFdType type, char* buf, size_t size);
+    static IoHistogram* findHistogram(u64 key);
+    static void patchLibraries(bool enable);
+    static void formatStack(u32 call_trace_id, char* buf, size_t size);
+
+  public:
+    const char* title() {
+        return "I/O latency profile";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    // Hooks libraries loaded since start
+    static void installHooks();
+    // Frames of the profiler on top of a sampled native stack
+    static bool inProfiler(const void* pc) {
+        return _self != NULL && _self->contains(pc);
+    }
+    // Logs the histograms of the last interval and clears them
+    static void report();
+    static void reportIfDue();
+
+    static void traced(IoOperation op, int fd, ssize_t result, u64 start) {
+        u64 end = TSC::ticks();
+        if (end - start >= _threshold_ticks && _enabled && _running) {
+            // The caller looks at errno of the traced call only
+            int saved_errno = errno;
+            recordIo(op, fd, result, start, end);
+            errno = saved_errno;
+        }
+    }
+};
+
+class IoReportTask : public ScheduledTask {
+  public:
+    void run() {
+        IoTracer::reportIfDue();
+    }
+};
+
+#endif // _IOTRACER_H
@@ -18,6 +18,7 @@
 #include "itimer.h"
 #include "j9StackTraces.h"
 #include "os.h"
+#include "profiledThread.h"
 #include "profiler.h"
 #include "stackWalker.h"
 
@@ -29,9 +30,11 @@ CStack ITimer::_cstack;
 void ITimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     if (!_enabled) return;
 
-    // ExecutionEvent event;
-    // Profiler::instance()->recordSample(ucontext, _interval, 0, &event);
-    Profiler::instance()->printSample(ucontext, _interval);
+    // Signals reach a busy thread late or bunched up, so a sample weighs the CPU time
+    // the thread actually used since its previous sample rather than one interval
+    SampleEvent event;
+    event._cpu_time = ProfiledThread::cpuTimeDelta();
+    Profiler::instance()->printSample(ucontext, event._cpu_time != 0 ? event._cpu_time : _interval, &event);
 }
 
 void ITimer::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext) {
@@ -65,6 +68,7 @@ Error ITimer::start(Arguments& args) {
     }
     _interval = args._interval ? args._interval : DEFAULT_INTERVAL;
     _cstack = args._cstack;
+    ProfiledThread::newCpuEpoch();
 
     if (VM::isOpenJ9()) {
         if (_cstack == CSTACK_DEFAULT) _cstack = CSTACK_DWARF;
@@ -88,6 +92,20 @@ Error ITimer::start(Arguments& args) {
     return Error::OK;
 }
 
+bool ITimer::setInterval(long interval) {
+    time_t sec = interval / 1000000000;
+    suseconds_t usec = (interval % 1000000000) / 1000;
+    struct itimerval tv = {{sec, usec}, {sec, usec}};
+    if (usec == 0 && sec == 0) {
+        return false;
+    }
+    if (setitimer(ITIMER_PROF, &tv, NULL) != 0) {
+        return false;
+    }
+    _interval = interval;
+    return true;
+}
+
 void ITimer::stop() {
     struct itimerval tv = {{0, 0}, {0, 0}};
     setitimer(ITIMER_PROF, &tv, NULL);
@@ -41,6 +41,12 @@ class ITimer : public Engine {
     Error check(Arguments& args);
     Error start(Arguments& args);
     void stop();
+
+    long interval() {
+        return _interval;
+    }
+
+    bool setInterval(long interval);
 };
 
 #endif // _ITIMER_H
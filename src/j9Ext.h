@@ -53,6 +53,7 @@ class J9Ext {
     static jvmtiExtensionFunction _GetJ9vmThread;
     static jvmtiExtensionFunction _GetStackTraceExtended;
     static jvmtiExtensionFunction _GetAllStackTracesExtended;
+    static jvmtiExtensionFunction _GetThreadListStackTracesExtended;
 
   public:
     static bool initialize(jvmtiEnv* jvmti, const void* j9thread_self);
@@ -80,6 +81,18 @@ class J9Ext {
             max_frame_count, stack_info_ptr, thread_count_ptr);
     }
 
+    // Optional: stacks of many threads in one safepoint
+    static bool hasThreadListStackTraces() {
+        return _GetThreadListStackTracesExtended != NULL;
+    }
+
+    static jvmtiError GetThreadListStackTracesExtended(jint thread_count, const jthread* thread_list,
+                                                       jint max_frame_count, void** stack_info_ptr) {
+        return JVMTI_EXT(_GetThreadListStackTracesExtended, jint, jint, const jthread*, jint, void**)(
+            _jvmti, SHOW_COMPILED_FRAMES | SHOW_INLINED_FRAMES,
+            thread_count, thread_list, max_frame_count, stack_info_ptr);
+    }
+
     static void* j9thread_self() {
         return _j9thread_self != NULL ? _j9thread_self() : NULL;
     }
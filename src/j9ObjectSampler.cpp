@@ -22,14 +22,14 @@
 void J9ObjectSampler::JavaObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                       jobject object, jclass object_klass, jlong size) {
     if (_enabled && updateCounter(_allocated_bytes, size, _interval)) {
-        recordAllocation(jvmti, BCI_ALLOC, object_klass, size);
+        recordAllocation(jvmti, jni, BCI_ALLOC, object, object_klass, size);
     }
 }
 
 void J9ObjectSampler::VMObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                     jobject object, jclass object_klass, jlong size) {
     if (_enabled && updateCounter(_allocated_bytes, size, _interval)) {
-        recordAllocation(jvmti, BCI_ALLOC_OUTSIDE_TLAB, object_klass, size);
+        recordAllocation(jvmti, jni, BCI_ALLOC_OUTSIDE_TLAB, object, object_klass, size);
     }
 }
 
@@ -54,6 +54,7 @@ Error J9ObjectSampler::start(Arguments& args) {
         return Error("Could not enable InstrumentableObjectAlloc callback");
     }
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_OBJECT_ALLOC, NULL);
+    startLive(args);
 
     return Error::OK;
 }
@@ -62,4 +63,5 @@ void J9ObjectSampler::stop() {
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_VM_OBJECT_ALLOC, NULL);
     jvmti->SetExtensionEventCallback(J9Ext::InstrumentableObjectAlloc_id, NULL);
+    stopLive();
 }
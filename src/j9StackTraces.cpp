@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -56,6 +57,10 @@ class J9VMThread {
 pthread_t J9StackTraces::_thread = 0;
 int J9StackTraces::_max_stack_depth;
 int J9StackTraces::_pipe[2];
+J9BatchSlot* J9StackTraces::_batch = NULL;
+volatile u64 J9StackTraces::_head = 0;
+volatile u64 J9StackTraces::_tail = 0;
+volatile int J9StackTraces::_waiting = 0;
 
 static JNIEnv* _self_env = NULL;
 
@@ -63,6 +68,14 @@ static JNIEnv* _self_env = NULL;
 Error J9StackTraces::start(Arguments& args) {
     _max_stack_depth = args._jstackdepth; 
 
+    if (_batch == NULL) {
+        // Never freed: a late signal may still publish into it after stop()
+        _batch = (J9BatchSlot*)calloc(J9_BATCH_SLOTS, sizeof(J9BatchSlot));
+        if (_batch == NULL) {
+            return Error("Not enough memory for J9 stack trace batch");
+        }
+    }
+
     if (pipe(_pipe) != 0) {
         return Error("Failed to create pipe");
     }
@@ -86,70 +99,186 @@ void J9StackTraces::stop() {
     }
 }
 
+// Called from signal handlers: a slot is reserved with CAS and published with its sequence number
+bool J9StackTraces::enqueue(J9StackTraceNotification* notif) {
+    u64 pos;
+    do {
+        pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+        if (pos - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) >= (u64)J9_BATCH_SLOTS) {
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&_head, pos, pos + 1));
+
+    J9BatchSlot* slot = &_batch[pos & (J9_BATCH_SLOTS - 1)];
+    memcpy(&slot->notif, notif, notif->size());
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in waitForBatch: either the helper sees the slot or we see it waiting
+    __sync_synchronize();
+    if (_waiting && __sync_bool_compare_and_swap(&_waiting, 1, 0)) {
+        char wakeup = 0;
+        ssize_t r = write(_pipe[1], &wakeup, 1);
+        (void)r;
+    }
+    return true;
+}
+
+// Returns false once stop() has closed the pipe
+bool J9StackTraces::waitForBatch() {
+    while (!pending()) {
+        __atomic_store_n(&_waiting, 1, __ATOMIC_RELAXED);
+        __sync_synchronize();
+        if (pending()) {
+            _waiting = 0;
+            break;
+        }
+
+        char buf[64];
+        ssize_t bytes = read(_pipe[0], buf, sizeof(buf));
+        if (bytes == 0 || (bytes < 0 && errno != EINTR && errno != EAGAIN)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void refreshThreads(JNIEnv* jni, jvmtiEnv* jvmti, std::map<void*, jthread>& known_threads) {
+    jni->PopLocalFrame(NULL);
+    jni->PushLocalFrame(64);
+
+    jint thread_count;
+    jthread* threads;
+    if (jvmti->GetAllThreads(&thread_count, &threads) == 0) {
+        known_threads.clear();
+        for (jint i = 0; i < thread_count; i++) {
+            known_threads[J9Ext::GetJ9vmThread(threads[i])] = threads[i];
+        }
+        jvmti->Deallocate((unsigned char*)threads);
+    }
+}
+
+static void printSample(J9StackTraceNotification* notif, jthread thread,
+                        jvmtiFrameInfoExtended* java_frames, jint num_jvmti_frames, ASGCT_CallFrame* frames) {
+    int num_frames = Profiler::instance()->convertNativeTrace(notif->num_frames, notif->addr, frames);
+
+    for (int j = 0; j < num_jvmti_frames; j++) {
+        frames[num_frames].method_id = java_frames[j].method;
+        frames[num_frames].bci = FrameType::encode(java_frames[j].type, java_frames[j].location);
+        num_frames++;
+    }
+
+    int tid = J9Ext::GetOSThreadID(thread);
+    // ExecutionEvent event;
+    // Profiler::instance()->recordExternalSample(notif->counter, &event, tid, num_frames, frames);
+    Profiler::instance()->printExternalSample(tid, num_frames, frames);
+}
+
+static jthread knownThread(std::map<void*, jthread>& known_threads, void* env) {
+    std::map<void*, jthread>::const_iterator it = known_threads.find(env);
+    return it != known_threads.end() ? it->second : NULL;
+}
+
 void J9StackTraces::timerLoop() {
+    BackgroundScheduler::applyPolicy(false);
     JNIEnv* jni = VM::attachThread("Async-profiler Sampler");
     __atomic_store_n(&_self_env, jni, __ATOMIC_RELEASE);
 
     jni->PushLocalFrame(64);
 
     jvmtiEnv* jvmti = VM::jvmti();
-    char notification_buf[65536];
     std::map<void*, jthread> known_threads;
+    J9StackTraceNotification* batch[J9_BATCH_SLOTS];
+    jthread threads[J9_BATCH_SLOTS];
+    jvmtiStackInfoExtended* stacks[J9_BATCH_SLOTS];
 
     int max_frames = _max_stack_depth + MAX_J9_NATIVE_FRAMES + RESERVED_FRAMES;
     ASGCT_CallFrame* frames = (ASGCT_CallFrame*)malloc(max_frames * sizeof(ASGCT_CallFrame));
     jvmtiFrameInfoExtended* jvmti_frames = (jvmtiFrameInfoExtended*)malloc(max_frames * sizeof(jvmtiFrameInfoExtended));
 
-    while (true) {
-        ssize_t bytes = read(_pipe[0], notification_buf, sizeof(notification_buf));
-        if (bytes <= 0) {
-            if (bytes < 0 && errno == EAGAIN) {
-                continue;
+    while (waitForBatch()) {
+        // Everything published so far is resolved in this wakeup
+        u64 tail = _tail;
+        int count = 0;
+        while (count < J9_BATCH_SLOTS) {
+            J9BatchSlot* slot = &_batch[(tail + count) & (J9_BATCH_SLOTS - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + count + 1) {
+                break;
             }
-            break;
+            batch[count++] = &slot->notif;
         }
 
-        ssize_t ptr = 0;
-        while (ptr < bytes) {
-            J9StackTraceNotification* notif = (J9StackTraceNotification*)(notification_buf + ptr);
-
-            jthread thread = known_threads[notif->env];
-            jint num_jvmti_frames;
-            if (thread == NULL || J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) != 0) {
-                jni->PopLocalFrame(NULL);
-                jni->PushLocalFrame(64);
-
-                jint thread_count;
-                jthread* threads;
-                if (jvmti->GetAllThreads(&thread_count, &threads) == 0) {
-                    known_threads.clear();
-                    for (jint i = 0; i < thread_count; i++) {
-                        known_threads[J9Ext::GetJ9vmThread(threads[i])] = threads[i];
-                    }
-                    jvmti->Deallocate((unsigned char*)threads);
+        // A thread started since the last refresh needs one GetAllThreads per batch, not per sample
+        bool refreshed = false;
+        for (int i = 0; i < count; i++) {
+            if ((threads[i] = knownThread(known_threads, batch[i]->env)) == NULL && !refreshed) {
+                refreshThreads(jni, jvmti, known_threads);
+                refreshed = true;
+                for (int j = 0; j <= i; j++) {
+                    threads[j] = knownThread(known_threads, batch[j]->env);
                 }
+            }
+        }
 
-                if ((thread = known_threads[notif->env]) == NULL ||
-                    J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) != 0) {
-                    continue;
+        // One request for all threads of the batch when the JVM offers it
+        jvmtiStackInfoExtended* stack_info = NULL;
+        memset(stacks, 0, count * sizeof(stacks[0]));
+        if (J9Ext::hasThreadListStackTraces() && count > 1) {
+            jthread list[J9_BATCH_SLOTS];
+            int index[J9_BATCH_SLOTS];
+            int listed = 0;
+            for (int i = 0; i < count; i++) {
+                if (threads[i] != NULL) {
+                    index[listed] = i;
+                    list[listed++] = threads[i];
                 }
             }
+            if (listed > 0 && J9Ext::GetThreadListStackTracesExtended(listed, list, _max_stack_depth, (void**)&stack_info) == 0) {
+                for (int k = 0; k < listed; k++) {
+                    if (stack_info[k].state & JVMTI_THREAD_STATE_ALIVE) {
+                        stacks[index[k]] = &stack_info[k];
+                    }
+                }
+            } else {
+                stack_info = NULL;
+            }
+        }
 
-            int num_frames = Profiler::instance()->convertNativeTrace(notif->num_frames, notif->addr, frames);
+        // Samples whose stack could not be taken with the known jthread
+        int retry[J9_BATCH_SLOTS];
+        int retries = 0;
 
-            for (int j = 0; j < num_jvmti_frames; j++) {
-                frames[num_frames].method_id = jvmti_frames[j].method;
-                frames[num_frames].bci = FrameType::encode(jvmti_frames[j].type, jvmti_frames[j].location);
-                num_frames++;
+        for (int i = 0; i < count; i++) {
+            jint num_jvmti_frames;
+            if (stacks[i] != NULL) {
+                printSample(batch[i], stacks[i]->thread, stacks[i]->frame_buffer, stacks[i]->frame_count, frames);
+            } else if (threads[i] != NULL &&
+                       J9Ext::GetStackTraceExtended(threads[i], 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) == 0) {
+                printSample(batch[i], threads[i], jvmti_frames, num_jvmti_frames, frames);
+            } else if (!refreshed) {
+                retry[retries++] = i;
             }
+        }
 
-            int tid = J9Ext::GetOSThreadID(thread);
-            // ExecutionEvent event;
-            // Profiler::instance()->recordExternalSample(notif->counter, &event, tid, num_frames, frames);
-            Profiler::instance()->printExternalSample(tid, num_frames, frames);
+        if (stack_info != NULL) {
+            jvmti->Deallocate((unsigned char*)stack_info);
+        }
 
-            ptr += notif->size();
+        if (retries > 0) {
+            // Possibly stale jthreads of reused envs; the refresh drops all earlier local refs
+            refreshThreads(jni, jvmti, known_threads);
+            for (int k = 0; k < retries; k++) {
+                J9StackTraceNotification* notif = batch[retry[k]];
+                jthread thread = knownThread(known_threads, notif->env);
+                jint num_jvmti_frames;
+                if (thread != NULL &&
+                    J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) == 0) {
+                    printSample(notif, thread, jvmti_frames, num_jvmti_frames, frames);
+                }
+            }
         }
+
+        // Slots are reused only after their notifications are consumed
+        __atomic_store_n(&_tail, tail + count, __ATOMIC_RELEASE);
     }
 
     free(jvmti_frames);
@@ -177,11 +306,11 @@ void J9StackTraces::checkpoint(u64 counter, J9StackTraceNotification* notif) {
             vm_thread->setOverflowMark();
             notif->env = env;
             notif->counter = counter;
-            if (write(_pipe[1], notif, notif->size()) > 0) {
+            if (enqueue(notif)) {
                 return;
             }
         }
-        // Something went wrong - rollback
+        // Something went wrong (or the batch is full) - rollback
         vm_thread->clearFlag(J9_HALT_THREAD_INSPECTION);
     }
 }
@@ -23,6 +23,7 @@
 
 
 const int MAX_J9_NATIVE_FRAMES = 128;
+const int J9_BATCH_SLOTS = 256;  // power of 2
 
 struct J9StackTraceNotification {
     void* env;
@@ -37,17 +38,38 @@ struct J9StackTraceNotification {
 };
 
 
+struct J9BatchSlot {
+    // Position + 1 once the notification is written
+    volatile u64 seq;
+    J9StackTraceNotification notif;
+};
+
+// Sampled threads queue notifications in a lock-free batch shared by all
+// signal handlers. The helper thread sleeps on a pipe only while the batch
+// is empty, so a burst of samples costs one wakeup and, with the thread list
+// extension, one stack walk request for all threads in the batch.
 class J9StackTraces {
   private:
     static pthread_t _thread;
     static int _max_stack_depth;
     static int _pipe[2];
+    static J9BatchSlot* _batch;
+    static volatile u64 _head;
+    static volatile u64 _tail;
+    static volatile int _waiting;
 
     static void* threadEntry(void* unused) {
         timerLoop();
         return NULL;
     }
 
+    static bool pending() {
+        u64 tail = _tail;
+        return __atomic_load_n(&_batch[tail & (J9_BATCH_SLOTS - 1)].seq, __ATOMIC_ACQUIRE) == tail + 1;
+    }
+
+    static bool enqueue(J9StackTraceNotification* notif);
+    static bool waitForBatch();
     static void timerLoop();
 
   public:
@@ -42,6 +42,7 @@ void J9WallClock::stop() {
 }
 
 void J9WallClock::timerLoop() {
+    BackgroundScheduler::applyPolicy(false);
     JNIEnv* jni = VM::attachThread("Async-profiler Sampler");
     jvmtiEnv* jvmti = VM::jvmti();
 
@@ -66,20 +66,196 @@ int jattach(int pid, int argc, char** argv) {
 
 #ifdef JATTACH_VERSION
 
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define MAX_BATCH_PIDS 4096
+#define DEFAULT_PARALLEL 16
+#define MAX_PARALLEL 256
+
+// One target of a batch attach
+typedef struct {
+    int pid;
+    pid_t child;
+    int out;
+    char* output;
+    size_t output_len;
+    struct timespec start;
+} batch_job;
+
+static long elapsed_ms(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Namespaces and credentials are switched for the whole process, and setns(mnt)
+// is not allowed in a multithreaded one, so every target gets a forked child.
+// The children wait for their attach sockets concurrently; the parent collects
+// their output without blocking and prints it per pid once the child is done.
+static int start_job(batch_job* job, int argc, char** argv) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->child = fork();
+    if (job->child == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        int result = jattach(job->pid, argc, argv);
+        fflush(stdout);
+        _exit(result);
+    }
+
+    close(fds[1]);
+    if (job->child < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    job->out = fds[0];
+    return 0;
+}
+
+// Returns 1 when the child has closed its output
+static int read_job_output(batch_job* job) {
+    char buf[4096];
+    ssize_t bytes = read(job->out, buf, sizeof(buf));
+    if (bytes < 0 && errno == EINTR) {
+        return 0;
+    } else if (bytes <= 0) {
+        return 1;
+    }
+
+    char* output = realloc(job->output, job->output_len + bytes);
+    if (output != NULL) {
+        memcpy(output + job->output_len, buf, bytes);
+        job->output = output;
+        job->output_len += bytes;
+    }
+    return 0;
+}
+
+static int finish_job(batch_job* job) {
+    int status;
+    close(job->out);
+    while (waitpid(job->child, &status, 0) < 0 && errno == EINTR);
+    int result = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    printf("[%d] result %d in %ld ms\n", job->pid, result, elapsed_ms(&job->start));
+    fwrite(job->output, 1, job->output_len, stdout);
+    if (job->output_len > 0 && job->output[job->output_len - 1] != '\n') {
+        printf("\n");
+    }
+    fflush(stdout);
+
+    free(job->output);
+    return result;
+}
+
+static int jattach_batch(batch_job* jobs, int count, int parallel, int argc, char** argv) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct pollfd fds[MAX_PARALLEL];
+    batch_job* running[MAX_PARALLEL];
+    unsigned int limit = parallel < MAX_PARALLEL ? (unsigned int)parallel : MAX_PARALLEL;
+    int next = 0;
+    unsigned int active = 0;
+    int succeeded = 0;
+
+    while (next < count || active > 0) {
+        while (next < count && active < limit) {
+            batch_job* job = &jobs[next++];
+            if (start_job(job, argc, argv) == 0) {
+                running[active++] = job;
+            } else {
+                printf("[%d] could not start: %s\n", job->pid, strerror(errno));
+            }
+        }
+        if (active == 0) {
+            continue;
+        }
+
+        unsigned int i;
+        for (i = 0; i < active; i++) {
+            fds[i].fd = running[i]->out;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, (nfds_t)active, -1) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (i = active; i-- > 0; ) {
+            if (fds[i].revents != 0 && read_job_output(running[i])) {
+                if (finish_job(running[i]) == 0) {
+                    succeeded++;
+                }
+                running[i] = running[--active];
+            }
+        }
+    }
+
+    printf("Attached to %d of %d processes in %ld ms\n", succeeded, count, elapsed_ms(&start));
+    return succeeded == count ? 0 : 1;
+}
+
+static int parse_pids(char* list, batch_job* jobs) {
+    int count = 0;
+    char* s;
+    for (s = strtok(list, ","); s != NULL; s = strtok(NULL, ",")) {
+        int pid = atoi(s);
+        if (pid <= 0 || count >= MAX_BATCH_PIDS) {
+            fprintf(stderr, pid <= 0 ? "%s is not a valid process ID\n" : "Too many processes: %s\n", s);
+            return -1;
+        }
+        memset(&jobs[count], 0, sizeof(batch_job));
+        jobs[count++].pid = pid;
+    }
+    return count;
+}
+
 int main(int argc, char** argv) {
-    if (argc < 3) {
+    int parallel = DEFAULT_PARALLEL;
+    if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+        parallel = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc < 3 || parallel <= 0) {
         printf("jattach " JATTACH_VERSION " built on " __DATE__ "\n"
                "Copyright 2021 Andrei Pangin\n"
                "\n"
-               "Usage: jattach <pid> <cmd> [args ...]\n"
+               "Usage: jattach [-j N] <pid>[,<pid>...] <cmd> [args ...]\n"
                "\n"
                "Commands:\n"
                "    load  threaddump   dumpheap  setflag    properties\n"
                "    jcmd  inspectheap  datadump  printflag  agentProperties\n"
-               );
+               "\n"
+               "A comma separated list of pids is attached to concurrently,\n"
+               "at most N at a time (default %d, up to %d), reporting the result of each.\n",
+               DEFAULT_PARALLEL, MAX_PARALLEL);
         return 1;
     }
 
+    if (strchr(argv[1], ',') != NULL) {
+        static batch_job jobs[MAX_BATCH_PIDS];
+        int count = parse_pids(argv[1], jobs);
+        if (count <= 0) {
+            return 1;
+        }
+        return jattach_batch(jobs, count, parallel, argc - 2, argv + 2);
+    }
+
     int pid = atoi(argv[1]);
     if (pid <= 0) {
         fprintf(stderr, "%s is not a valid process ID\n", argv[1]);
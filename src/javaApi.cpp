@@ -15,13 +15,21 @@
  */
 
 #include <fstream>
+#include <map>
 #include <sstream>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include "incbin.h"
 #include "javaApi.h"
+#include "eventLogger.h"
+#include "gzip.h"
+#include "mutex.h"
 #include "os.h"
+#include "perfEvents.h"
+#include "profiledThread.h"
 #include "profiler.h"
+#include "traceContext.h"
 #include "vmStructs.h"
 
 
@@ -78,6 +86,12 @@ Java_one_profiler_AsyncProfiler_execute0(JNIEnv* env, jobject unused, jstring co
         return NULL;
     }
 
+    // The HTTP server of an agent preloaded without a command brings the first one
+    if (!VM::initLate()) {
+        throwNew(env, "java/lang/IllegalStateException", "JVM does not support Tool Interface");
+        return NULL;
+    }
+
     Log::open(args);
 
     if (!args.hasOutputFile()) {
@@ -129,6 +143,127 @@ Java_one_profiler_AsyncProfiler_filterThread0(JNIEnv* env, jobject unused, jthre
     }
 }
 
+extern "C" DLLEXPORT void JNICALL
+Java_one_profiler_AsyncProfiler_setTraceContext(JNIEnv* env, jobject unused, jlong trace_high, jlong trace_low, jlong span_id) {
+    TraceIds ids = {(u64)trace_high, (u64)trace_low, (u64)span_id};
+    TraceContext::set(ProfiledThread::currentOrCreate()->_tid, ids);
+}
+
+// kd-boost@ts!tid!duration_ns!
+// Samples of tid are denser for the given time; consumers should weigh them by interval
+extern "C" DLLEXPORT jboolean JNICALL
+Java_one_profiler_AsyncProfiler_boostSampling(JNIEnv* env, jobject unused, jlong duration) {
+    int tid = OS::threadId();
+    if (duration <= 0 || !PerfEvents::boostThread(tid, (u64)duration)) {
+        return JNI_FALSE;
+    }
+    EventLogger::log("kd-boost@%llu!%d!%lld!", KdClock::now(), tid, (long long)duration);
+    return JNI_TRUE;
+}
+
+extern "C" DLLEXPORT jint JNICALL
+Java_one_profiler_AsyncProfiler_exportSamples0(JNIEnv* env, jobject unused, jobject buffer, jint offset, jint length, jboolean incremental) {
+    char* address = (char*)env->GetDirectBufferAddress(buffer);
+    if (address == NULL || offset < 0 || length < 0 || offset + (jlong)length > env->GetDirectBufferCapacity(buffer)) {
+        throwNew(env, "java/lang/IllegalArgumentException", "Invalid direct buffer");
+        return 0;
+    }
+
+    long size;
+    Error error = Profiler::instance()->exportSamples(address + offset, length, incremental, size);
+    if (error) {
+        throwNew(env, "java/lang/IllegalStateException", error.message());
+        return 0;
+    }
+    // A required size past 2 GB still reads as 'does not fit'
+    return size < -0x7fffffffL ? -0x7fffffff : (jint)size;
+}
+
+// Dumps for the HTTP server's /profile endpoint. The bytes stay in the string the dump
+// was rendered into and are handed out as a direct buffer over it. Each dump is reference
+// counted: profile0 returns it with one reference, retain0 adds one, free0 drops one
+struct ServerDump {
+    std::string data;
+    int refs;
+};
+
+static Mutex _server_dumps_lock;
+static std::map<const void*, ServerDump*> _server_dumps;
+
+static jobject JNICALL
+Server_profile0(JNIEnv* env, jclass unused, jstring command, jboolean gzip) {
+    Arguments args;
+    args._binary_out = true;
+    const char* command_str = env->GetStringUTFChars(command, NULL);
+    Error error = args.parse(command_str);
+    env->ReleaseStringUTFChars(command, command_str);
+
+    if (!error && (args._output == OUTPUT_NONE || args._output == OUTPUT_JFR)) {
+        error = Error("Profile format must be collapsed, flamegraph, tree, text or pprof");
+    }
+    if (error) {
+        throwNew(env, "java/lang/IllegalArgumentException", error.message());
+        return NULL;
+    }
+    if (!VM::initLate()) {
+        throwNew(env, "java/lang/IllegalStateException", "JVM does not support Tool Interface");
+        return NULL;
+    }
+
+    // The response is the dump itself, never a file
+    args._action = ACTION_DUMP;
+    args._file = NULL;
+
+    std::ostringstream out;
+    error = Profiler::instance()->runInternal(args, out);
+    if (error) {
+        throwNew(env, "java/lang/IllegalStateException", error.message());
+        return NULL;
+    }
+
+    ServerDump* dump = new ServerDump();
+    dump->data = out.str();
+    dump->refs = 1;
+    if (gzip && args._output != OUTPUT_PPROF) {
+        std::string compressed;
+        Gzip::compress(dump->data.data(), dump->data.size(), compressed);
+        dump->data.swap(compressed);
+    }
+
+    jobject result = env->NewDirectByteBuffer((void*)dump->data.data(), dump->data.size());
+    if (result == NULL) {
+        delete dump;
+        return NULL;
+    }
+
+    MutexLocker ml(_server_dumps_lock);
+    _server_dumps[dump->data.data()] = dump;
+    return result;
+}
+
+static void JNICALL
+Server_retain0(JNIEnv* env, jclass unused, jobject buffer) {
+    MutexLocker ml(_server_dumps_lock);
+    std::map<const void*, ServerDump*>::iterator it = _server_dumps.find(env->GetDirectBufferAddress(buffer));
+    if (it != _server_dumps.end()) {
+        it->second->refs++;
+    }
+}
+
+static void JNICALL
+Server_free0(JNIEnv* env, jclass unused, jobject buffer) {
+    ServerDump* dump = NULL;
+    {
+        MutexLocker ml(_server_dumps_lock);
+        std::map<const void*, ServerDump*>::iterator it = _server_dumps.find(env->GetDirectBufferAddress(buffer));
+        if (it != _server_dumps.end() && --it->second->refs == 0) {
+            dump = it->second;
+            _server_dumps.erase(it);
+        }
+    }
+    delete dump;
+}
+
 
 #define F(name, sig)  {(char*)#name, (char*)sig, (void*)Java_one_profiler_AsyncProfiler_##name}
 
@@ -138,10 +273,19 @@ static const JNINativeMethod profiler_natives[] = {
     F(execute0,      "(Ljava/lang/String;)Ljava/lang/String;"),
     F(getSamples,    "()J"),
     F(filterThread0, "(Ljava/lang/Thread;Z)V"),
+    F(setTraceContext, "(JJJ)V"),
+    F(boostSampling,   "(J)Z"),
+    F(exportSamples0,  "(Ljava/nio/ByteBuffer;IIZ)I"),
 };
 
 static const JNINativeMethod* execute0 = &profiler_natives[2];
 
+static const JNINativeMethod server_natives[] = {
+    {(char*)"profile0", (char*)"(Ljava/lang/String;Z)Ljava/nio/ByteBuffer;", (void*)Server_profile0},
+    {(char*)"retain0",  (char*)"(Ljava/nio/ByteBuffer;)V",                   (void*)Server_retain0},
+    {(char*)"free0",    (char*)"(Ljava/nio/ByteBuffer;)V",                   (void*)Server_free0},
+};
+
 #undef F
 
 
@@ -180,7 +324,8 @@ bool JavaAPI::startHttpServer(jvmtiEnv* jvmti, JNIEnv* jni, const char* address)
     jobject loader;
     if (handler != NULL && jvmti->GetClassLoader(handler, &loader) == 0) {
         jclass cls = jni->DefineClass(NULL, loader, (const jbyte*)SERVER_CLASS, INCBIN_SIZEOF(SERVER_CLASS));
-        if (cls != NULL && jni->RegisterNatives(cls, execute0, 1) == 0) {
+        if (cls != NULL && jni->RegisterNatives(cls, execute0, 1) == 0 &&
+            jni->RegisterNatives(cls, server_natives, sizeof(server_natives) / sizeof(JNINativeMethod)) == 0) {
             jmethodID method = jni->GetStaticMethodID(cls, "start", "(Ljava/lang/String;)V");
             if (method != NULL) {
                 jni->CallStaticVoidMethod(cls, method, jni->NewStringUTF(address));
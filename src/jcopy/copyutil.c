@@ -1,48 +1,185 @@
 #include <dirent.h>
+#include <elf.h>
 #include <fcntl.h>
 #include <stdio.h>
 
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "copyutil.h"
 
 char agent_command[MAX_PATH];
 
+#define TMP_SUFFIX ".jcopy-tmp"
+
+// GNU build-id of a 64-bit ELF image, or NULL
+static const char* elf_build_id(const char* data, size_t size, size_t* id_len) {
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)data;
+    if (size < sizeof(Elf64_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof(Elf64_Phdr) > size) {
+        return NULL;
+    }
+
+    const Elf64_Phdr* phdr = (const Elf64_Phdr*)(data + ehdr->e_phoff);
+    int i;
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_NOTE || phdr[i].p_offset + phdr[i].p_filesz > size) {
+            continue;
+        }
+        const char* note = data + phdr[i].p_offset;
+        const char* end = note + phdr[i].p_filesz;
+        while (note + sizeof(Elf64_Nhdr) <= end) {
+            const Elf64_Nhdr* nhdr = (const Elf64_Nhdr*)note;
+            const char* name = note + sizeof(Elf64_Nhdr);
+            const char* desc = name + ((nhdr->n_namesz + 3) & ~3);
+            if (desc + nhdr->n_descsz > end) {
+                break;
+            }
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                *id_len = nhdr->n_descsz;
+                return desc;
+            }
+            note = desc + ((nhdr->n_descsz + 3) & ~3);
+        }
+    }
+    return NULL;
+}
+
+static int same_bytes(const char* a, const char* b, size_t size) {
+    size_t a_len, b_len;
+    const char* a_id = elf_build_id(a, size, &a_len);
+    const char* b_id = elf_build_id(b, size, &b_len);
+    if (a_id != NULL && b_id != NULL) {
+        return a_len == b_len && memcmp(a_id, b_id, a_len) == 0;
+    }
+    return memcmp(a, b, size) == 0;
+}
+
+// An existing destination is kept only if it is the same file or has the same
+// build-id (libraries) or bytes (everything else); a stale one is replaced
+static int is_up_to_date(int src_fd, const struct stat* src_stats, const char* dst) {
+    struct stat dst_stats;
+    if (stat(dst, &dst_stats) != 0 || !S_ISREG(dst_stats.st_mode)) {
+        return 0;
+    }
+    if (dst_stats.st_dev == src_stats->st_dev && dst_stats.st_ino == src_stats->st_ino) {
+        return 1;
+    }
+    if (dst_stats.st_size != src_stats->st_size) {
+        return 0;
+    }
+    if (src_stats->st_size == 0) {
+        return 1;
+    }
+
+    int dst_fd = open(dst, O_RDONLY);
+    if (dst_fd < 0) {
+        return 0;
+    }
+
+    size_t size = (size_t)src_stats->st_size;
+    void* a = mmap(NULL, size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+    void* b = mmap(NULL, size, PROT_READ, MAP_PRIVATE, dst_fd, 0);
+    int result = a != MAP_FAILED && b != MAP_FAILED && same_bytes((const char*)a, (const char*)b, size);
+
+    if (a != MAP_FAILED) munmap(a, size);
+    if (b != MAP_FAILED) munmap(b, size);
+    close(dst_fd);
+    return result;
+}
+
+// In-kernel copy where possible; read/write otherwise
+static int copy_data(int src_fd, int dst_fd, off_t size) {
+    off_t copied = 0;
+#ifdef __NR_copy_file_range
+    while (copied < size) {
+        ssize_t bytes = syscall(__NR_copy_file_range, src_fd, NULL, dst_fd, NULL, (size_t)(size - copied), 0);
+        if (bytes <= 0) {
+            break;
+        }
+        copied += bytes;
+    }
+#endif
+#ifdef __linux__
+    while (copied < size) {
+        ssize_t bytes = sendfile(dst_fd, src_fd, NULL, (size_t)(size - copied));
+        if (bytes <= 0) {
+            break;
+        }
+        copied += bytes;
+    }
+#endif
+
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(src_fd, buf, sizeof(buf))) > 0) {
+        ssize_t off = 0;
+        while (off < r) {
+            ssize_t w = write(dst_fd, buf + off, r - off);
+            if (w <= 0) {
+                return -1;
+            }
+            off += w;
+        }
+        copied += r;
+    }
+    return r < 0 || copied != size ? -1 : 0;
+}
+
+// The destination is replaced with rename(), never rewritten in place:
+// a JVM that has mapped the old agent keeps its inode intact
 static void copy_file(const char *src, const char *dst) {
-    int dstFd = open(dst, O_RDONLY);
-    if (dstFd >= 0) {
+    int src_fd = open(src, O_RDONLY);
+    if (src_fd < 0) {
+        fprintf(stderr, "[x Open File] %s\n", src);
+        return;
+    }
+    struct stat stats;
+    if (fstat(src_fd, &stats) != 0) {
+        fprintf(stderr, "[x Open File] %s\n", src);
+        close(src_fd);
+        return;
+    }
+
+    if (is_up_to_date(src_fd, &stats, dst)) {
         fprintf(stderr, "[Exist File] %s\n", dst);
+        close(src_fd);
         return;
     }
 
-	int srcFd = open(src, O_RDONLY);
-	if (srcFd < 0) {
-		fprintf(stderr, "[x Open File] %s\n", src);
-		return;
-	}
-	struct stat stats;
-	stat(src, &stats);
+    char tmp[MAX_PATH];
+    snprintf(tmp, sizeof(tmp), "%s" TMP_SUFFIX "%d", dst, (int)getpid());
+    unlink(tmp);
 
-    dstFd = open(dst, O_WRONLY | O_CREAT, stats.st_mode);
-	if (dstFd < 0) {
-		fprintf(stderr, "[x Create File] %s\n", dst);
-		return;
-	}
+    // Always a private copy: a hard link would share the source inode,
+    // letting root in the container modify the host library
+    int dst_fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, stats.st_mode & 0777);
+    if (dst_fd < 0) {
+        fprintf(stderr, "[x Create File] %s\n", dst);
+        close(src_fd);
+        return;
+    }
 
-    fprintf(stderr, "[Create File] %s, Fd: %d\n", dst, dstFd);
-    char buf[65536];
-    ssize_t r;
-    while ((r = read(srcFd, buf, sizeof(buf))) > 0) {
-        ssize_t w = write(dstFd, buf, r);
-        (void)w;
+    int ok = copy_data(src_fd, dst_fd, stats.st_size) == 0;
+    if (ok && fchmod(dst_fd, 0666) != 0) {
+        fprintf(stderr, "[x Chmod File] %s\n", dst);
+        ok = 0;
     }
+    close(dst_fd);
+    close(src_fd);
 
-	if (fchmod(dstFd, 0666) != 0) {
-		fprintf(stderr, "[x Chmod File] %s\n", dst);
-		return;
-	}
+    if (ok && rename(tmp, dst) == 0) {
+        fprintf(stderr, "[Create File] %s\n", dst);
+    } else {
+        fprintf(stderr, "[x Create File] %s\n", dst);
+        unlink(tmp);
+    }
 }
 
 static int copy_dir(const char *read_dir_path, const char *write_dir_path) {
@@ -90,7 +90,10 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
                 << field("sampledThread", T_THREAD, "Thread", F_CPOOL)
                 << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
-                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL))
+                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL)
+                << field("traceIdHigh", T_LONG, "Trace ID High")
+                << field("traceIdLow", T_LONG, "Trace ID Low")
+                << field("spanId", T_LONG, "Span ID"))
 
             << (type("jdk.ObjectAllocationInNewTLAB", T_ALLOC_IN_NEW_TLAB, "Allocation in new TLAB")
                 << category("Java Application")
@@ -204,6 +207,35 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("level", T_LOG_LEVEL, "Level", F_CPOOL)
                 << field("message", T_STRING, "Message"))
 
+            << (type("profiler.LockWait", T_LOCK_WAIT, "Lock Wait")
+                << category("Java Application")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("lockClass", T_CLASS, "Lock Class", F_CPOOL)
+                << field("lockType", T_STRING, "Lock Type")
+                << field("ownerThread", T_THREAD, "Waiting On Thread", F_CPOOL)
+                << field("address", T_LONG, "Lock Address", F_ADDRESS)
+                << field("traceIdHigh", T_LONG, "Trace ID High")
+                << field("traceIdLow", T_LONG, "Trace ID Low")
+                << field("spanId", T_LONG, "Span ID"))
+
+            << (type("profiler.IoWait", T_IO_WAIT, "I/O Wait")
+                << category("Java Application")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("duration", T_LONG, "Duration", F_DURATION_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("operation", T_STRING, "Operation")
+                << field("fdType", T_STRING, "Descriptor Type")
+                << field("fd", T_INT, "File Descriptor")
+                << field("result", T_LONG, "Result")
+                << field("address", T_STRING, "Peer Address")
+                << field("traceIdHigh", T_LONG, "Trace ID High")
+                << field("traceIdLow", T_LONG, "Trace ID Low")
+                << field("spanId", T_LONG, "Span ID"))
+
             << (type("jdk.jfr.Label", T_LABEL, NULL)
                 << field("value", T_STRING))
 
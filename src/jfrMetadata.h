@@ -65,6 +65,8 @@ enum JfrType {
     T_INITIAL_SYSTEM_PROPERTY = 112,
     T_NATIVE_LIBRARY = 113,
     T_LOG = 114,
+    T_LOCK_WAIT = 115,
+    T_IO_WAIT = 116,
 
     T_ANNOTATION = 200,
     T_LABEL = 201,
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "jfrStreamer.h"
+#include "log.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+static int connectJfrStream(const char* address, bool& is_socket) {
+    is_socket = true;
+
+    if (address[0] == '/' || address[0] == '.') {
+        struct stat st;
+        if (stat(address, &st) == 0 && S_ISFIFO(st.st_mode)) {
+            // Fails at once if nobody reads the FIFO
+            int fd = ::open(address, O_WRONLY | O_NONBLOCK);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            }
+            is_socket = false;
+            return fd;
+        }
+
+        struct sockaddr_un sun;
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, address);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    const char* colon = strrchr(address, ':');
+    if (colon == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char host[256];
+    size_t host_len = colon - address;
+    if (host_len >= sizeof(host)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(host, address, host_len);
+    host[host_len] = 0;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res;
+    if (getaddrinfo(host_len > 0 ? host : NULL, colon + 1, &hints, &res) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+bool JfrStreamer::open(const char* address) {
+    close();
+
+    _fd = connectJfrStream(address, _socket);
+    if (_fd < 0) {
+        Log::warn("Could not connect JFR stream %s: %s", address, strerror(errno));
+        return false;
+    }
+
+    _shipped = 0;
+    _dropped = 0;
+    _task = new JfrStreamerTask(this);
+    _thread = std::thread([this] {
+        _task->run();
+    });
+    return true;
+}
+
+void JfrStreamer::close() {
+    if (_task != NULL) {
+        _task->stop();
+        _thread.join();
+        delete _task;
+        _task = NULL;
+    }
+
+    if (_fd >= 0) {
+        drain();
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+void JfrStreamer::ship(int fd, off_t start, off_t end) {
+    size_t size = end - start;
+    char* data = size > 0 ? (char*)malloc(size) : NULL;
+    if (data == NULL || pread(fd, data, size, start) != (ssize_t)size) {
+        free(data);
+        atomicInc(_dropped);
+        return;
+    }
+
+    MutexLocker ml(_lock);
+    if (_count == JFR_STREAM_QUEUE) {
+        free(data);
+        atomicInc(_dropped);
+        return;
+    }
+    JfrStreamChunk& chunk = _queue[(_head + _count++) % JFR_STREAM_QUEUE];
+    chunk.data = data;
+    chunk.size = size;
+}
+
+// Called by the shipper thread, and at close() after it has stopped
+void JfrStreamer::drain() {
+    while (true) {
+        JfrStreamChunk chunk;
+        {
+            MutexLocker ml(_lock);
+            if (_count == 0) {
+                return;
+            }
+            chunk = _queue[_head];
+        }
+
+        if (writeFully(chunk.data, chunk.size)) {
+            atomicInc(_shipped);
+        } else {
+            atomicInc(_dropped);
+        }
+
+        MutexLocker ml(_lock);
+        free(chunk.data);
+        _head = (_head + 1) % JFR_STREAM_QUEUE;
+        _count--;
+    }
+}
+
+bool JfrStreamer::writeFully(const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t bytes = _socket ? send(_fd, data, size, MSG_NOSIGNAL) : ::write(_fd, data, size);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) continue;
+            return false;
+        }
+        data += bytes;
+        size -= bytes;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _JFRSTREAMER_H
+#define _JFRSTREAMER_H
+
+#include <sys/types.h>
+#include <thread>
+#include "arch.h"
+#include "mutex.h"
+#include "stoppableTask.h"
+
+
+// Finished chunks waiting for the shipper; one more is dropped as a whole
+const int JFR_STREAM_QUEUE = 4;
+const int JFR_STREAM_INTERVAL_MS = 50;
+
+struct JfrStreamChunk {
+    char* data;
+    size_t size;
+};
+
+class JfrStreamerTask;
+
+// jfrstream=ADDRESS: every finished JFR chunk is sent to a TCP host:port,
+// a Unix socket or a FIFO as soon as the recording closes it. JFR chunks are
+// self-contained, so the stream is a plain concatenation of them that any JFR
+// parser reads as one file. A background thread does the blocking writes;
+// if the receiver falls JFR_STREAM_QUEUE chunks behind, new chunks are dropped
+// whole, so the stream never contains a torn chunk.
+class JfrStreamer {
+  private:
+    int _fd;
+    bool _socket;
+    Mutex _lock;
+    JfrStreamChunk _queue[JFR_STREAM_QUEUE];
+    int _head;
+    int _count;
+    u64 _shipped;
+    u64 _dropped;
+    JfrStreamerTask* _task;
+    std::thread _thread;
+
+    bool writeFully(const char* data, size_t size);
+
+  public:
+    JfrStreamer() : _fd(-1), _socket(false), _head(0), _count(0), _shipped(0), _dropped(0), _task(NULL) {
+    }
+
+    ~JfrStreamer() {
+        close();
+    }
+
+    bool open(const char* address);
+    // Sends out what is queued and disconnects
+    void close();
+
+    // Copies the chunk at [start, end) of the recording file into the queue
+    void ship(int fd, off_t start, off_t end);
+    void drain();
+
+    u64 shipped() { return _shipped; }
+    u64 dropped() { return _dropped; }
+};
+
+class JfrStreamerTask : public Stoppable {
+  public:
+    JfrStreamerTask(JfrStreamer* streamer) {
+        this->streamer = streamer;
+    }
+    void run() {
+        while (stopRequested() == false) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(JFR_STREAM_INTERVAL_MS));
+            streamer->drain();
+        }
+    }
+  private:
+    JfrStreamer* streamer;
+};
+
+#endif // _JFRSTREAMER_H
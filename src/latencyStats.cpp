@@ -0,0 +1,122 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "eventLogger.h"
+#include "latencyStats.h"
+
+
+static const char* const STAGE_NAMES[LATENCY_STAGES] = {
+    "sample",
+    "javaTrace",
+    "storagePut",
+    "cacheAdd",
+    "lockInfo",
+    "eventLog"
+};
+
+bool LatencyStats::_enabled = false;
+LatencyHistogram LatencyStats::_shards[LATENCY_SHARDS][LATENCY_STAGES];
+u64 LatencyStats::_last_report = 0;
+
+static inline u32 shardIndex() {
+    u64 h = (u64)(uintptr_t)pthread_self() * 0x9e3779b97f4a7c15ULL;
+    return (u32)(h >> 32) % LATENCY_SHARDS;
+}
+
+u64 LatencyStats::bucketLimit(int index) {
+    if (index < (1 << LATENCY_SUB_BITS)) {
+        return index;
+    }
+    int e = (index >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    u64 mantissa = (1 << LATENCY_SUB_BITS) + (index & ((1 << LATENCY_SUB_BITS) - 1)) + 1;
+    return (mantissa << (e - LATENCY_SUB_BITS)) - 1;
+}
+
+void LatencyStats::record(LatencyStage stage, u64 ticks) {
+    atomicInc(_shards[shardIndex()][stage].buckets[bucket(ticks)]);
+}
+
+void LatencyStats::reset(bool enabled) {
+    _enabled = false;
+    memset((void*)_shards, 0, sizeof(_shards));
+    _last_report = OS::nanotime();
+    _enabled = enabled;
+}
+
+// Percentiles are reported as the upper bound of their bucket, in ns
+void LatencyStats::summarize(LatencyStage stage, u64& count, u64& p50, u64& p99, u64& max) {
+    u64 sum[LATENCY_BUCKETS];
+    count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        sum[i] = 0;
+        for (int s = 0; s < LATENCY_SHARDS; s++) {
+            sum[i] += _shards[s][stage].buckets[i];
+        }
+        count += sum[i];
+    }
+
+    p50 = p99 = max = 0;
+    u64 seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (sum[i] == 0) continue;
+        seen += sum[i];
+        u64 limit = TSC::ticksToNanos(bucketLimit(i));
+        if (p50 == 0 && seen * 2 >= count) p50 = limit;
+        if (p99 == 0 && seen * 100 >= count * 99) p99 = limit;
+        max = limit;
+    }
+}
+
+void LatencyStats::status(std::ostream& out) {
+    if (!_enabled) {
+        return;
+    }
+
+    char buf[256];
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        u64 count, p50, p99, max;
+        summarize((LatencyStage)i, count, p50, p99, max);
+        if (count == 0) continue;
+        snprintf(buf, sizeof(buf), "Latency of %s: %llu calls, p50 %llu ns, p99 %llu ns, max %llu ns\n",
+                 STAGE_NAMES[i], count, p50, p99, max);
+        out << buf;
+    }
+}
+
+// kd-stats@stage!count!p50_ns!p99_ns!max_ns!
+// Counted since profiling started; bounds are those of the histogram buckets.
+void LatencyStats::report() {
+    if (!_enabled) {
+        return;
+    }
+
+    u64 now = OS::nanotime();
+    if (now - _last_report < LATENCY_REPORT_INTERVAL_NS) {
+        return;
+    }
+    _last_report = now;
+
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        u64 count, p50, p99, max;
+        summarize((LatencyStage)i, count, p50, p99, max);
+        if (count != 0) {
+            EventLogger::log("kd-stats@%s!%llu!%llu!%llu!%llu!", STAGE_NAMES[i], count, p50, p99, max);
+        }
+    }
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LATENCYSTATS_H
+#define _LATENCYSTATS_H
+
+#include <ostream>
+#include "arch.h"
+#include "tsc.h"
+
+
+const int LATENCY_SUB_BITS = 2;     // 4 linear sub-buckets per power of two
+const int LATENCY_BUCKETS = 128;    // the last bucket takes everything above 2^32 ticks
+const int LATENCY_SHARDS = 16;
+const u64 LATENCY_REPORT_INTERVAL_NS = 10000000000ULL;
+
+// Hot paths of the profiler itself
+enum LatencyStage {
+    LATENCY_SAMPLE,        // whole signal handler: recordSample, printSample
+    LATENCY_JAVA_TRACE,    // getJavaTraceAsync
+    LATENCY_STORAGE_PUT,   // CallTraceStorage::put
+    LATENCY_CACHE_ADD,     // FrameEventCache::add
+    LATENCY_LOCK_INFO,     // LockTracer::recordLockInfo
+    LATENCY_EVENT_LOG,     // FrameEvent::log and its binary, ids and delta variants
+    LATENCY_STAGES
+};
+
+struct LatencyHistogram {
+    volatile u64 buckets[LATENCY_BUCKETS];
+};
+
+// latency: log-linear histograms of TSC ticks per stage. Threads are spread
+// over shards by pthread_self, so the hot paths only do a relaxed add
+// into a mostly private cache line. Shards are summed when reporting.
+class LatencyStats {
+  private:
+    static bool _enabled;
+    static LatencyHistogram _shards[LATENCY_SHARDS][LATENCY_STAGES];
+    static u64 _last_report;
+
+    static void record(LatencyStage stage, u64 ticks);
+    static void summarize(LatencyStage stage, u64& count, u64& p50, u64& p99, u64& max);
+
+  public:
+    // Log-linear bucket of a value; also used by IoTracer for its own histograms
+    static int bucket(u64 ticks) {
+        if (ticks < (1 << LATENCY_SUB_BITS)) {
+            return (int)ticks;
+        }
+        int e = 63 - __builtin_clzll(ticks);
+        int index = ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + (int)((ticks >> (e - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+        return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+    }
+
+    // Inclusive upper bound of a bucket
+    static u64 bucketLimit(int index);
+
+    static bool enabled() {
+        return _enabled;
+    }
+
+    // 0 while disabled, so that the stages cost a single load then
+    static u64 start() {
+        return _enabled ? TSC::ticks() : 0;
+    }
+
+    static void add(LatencyStage stage, u64 start_ticks) {
+        if (_enabled && start_ticks != 0) {
+            record(stage, TSC::ticks() - start_ticks);
+        }
+    }
+
+    static void reset(bool enabled);
+    static void status(std::ostream& out);
+    // Sends kd-stats records at most every LATENCY_REPORT_INTERVAL_NS
+    static void report();
+};
+
+#endif // _LATENCYSTATS_H
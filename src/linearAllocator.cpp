@@ -18,8 +18,9 @@
 #include "os.h"
 
 
-LinearAllocator::LinearAllocator(size_t chunk_size) {
+LinearAllocator::LinearAllocator(size_t chunk_size, MemoryArea area) {
     _chunk_size = chunk_size;
+    _area = area;
     _reserve = _tail = allocateChunk(NULL);
 }
 
@@ -60,17 +61,27 @@ void* LinearAllocator::alloc(size_t size) {
     return NULL;
 }
 
+// The first chunk is always granted, any further one counts against memlimit
 Chunk* LinearAllocator::allocateChunk(Chunk* current) {
-    Chunk* chunk = (Chunk*)OS::safeAlloc(_chunk_size);
+    if (current == NULL) {
+        MemoryBudget::charge(_area, _chunk_size);
+    } else if (!MemoryBudget::reserve(_area, _chunk_size)) {
+        return NULL;
+    }
+
+    Chunk* chunk = (Chunk*)OS::safeAllocLarge(_chunk_size);
     if (chunk != NULL) {
         chunk->prev = current;
         chunk->offs = sizeof(Chunk);
+    } else {
+        MemoryBudget::release(_area, _chunk_size);
     }
     return chunk;
 }
 
 void LinearAllocator::freeChunk(Chunk* current) {
     OS::safeFree(current, _chunk_size);
+    MemoryBudget::release(_area, _chunk_size);
 }
 
 void LinearAllocator::reserveChunk(Chunk* current) {
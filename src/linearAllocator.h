@@ -18,6 +18,7 @@
 #define _LINEARALLOCATOR_H
 
 #include <stddef.h>
+#include "memoryBudget.h"
 
 
 struct Chunk {
@@ -30,6 +31,7 @@ struct Chunk {
 class LinearAllocator {
   private:
     size_t _chunk_size;
+    MemoryArea _area;
     Chunk* _tail;
     Chunk* _reserve;
 
@@ -39,7 +41,7 @@ class LinearAllocator {
     Chunk* getNextChunk(Chunk* current);
 
   public:
-    LinearAllocator(size_t chunk_size);
+    LinearAllocator(size_t chunk_size, MemoryArea area);
     ~LinearAllocator();
 
     void clear();
@@ -2,48 +2,41 @@
 #define _LOCKEVENT_H
 
 #include <jvmti.h>
-#include <vector>
-#include <string>
-#include <fstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "arch.h"
 #include "log.h"
 #include "eventLogger.h"
+#include "timeUtil.h"
+#include "traceContext.h"
 
-const char* JAVA_LOCK_WAIT_EVENT = "java_lock_wait_event";
-struct LockWaitEvent {
-    LockWaitEvent(
-        jint thread_id, 
-        std::string thread_name, 
-        jint java_thread_id, 
-        uintptr_t lock_object_address, 
-        std::string lock_type, 
-        std::string lock_name,
-        jlong create_timestamp) : 
-        _java_thread_id(java_thread_id),
-        _native_thread_id(thread_id),
-        _thread_name(thread_name),
-        _lock_object_address(lock_object_address),
-        _lock_type(lock_type),
-        _lock_name(lock_name),
-        _wait_timestamp(create_timestamp),
-        _wake_timestamp(0),
-        _wait_duration(0),
-        _wait_thread_id(0) {
-    } 
+const int LOCK_STACK_TRACE_SIZE = 768;
 
-    ~LockWaitEvent() {
-    }
+static inline bool isConcurrentLock(const char* lock_name) {
+    // Do not count synchronizers other than ReentrantLock, ReentrantReadWriteLock
+    return strcmp(lock_name, "Ljava/util/concurrent/locks/ReentrantLock") == 0 ||
+           strcmp(lock_name, "Ljava/util/concurrent/locks/ReentrantReadWriteLock") == 0;
+}
+
+// Lock events are recycled through LockEventPool, so all strings are either
+// static or interned by the LockRecorder; nothing is allocated per event.
+// The stack is kept as a CallTraceStorage id and resolved only when logged.
+struct LockWaitEvent {
+    // Next free event in the pool
+    LockWaitEvent* _next;
+    int _pool;
 
-    std::string _event_name = JAVA_LOCK_WAIT_EVENT;
-    // The thread which produces the event 
+    // The thread which produces the event
     jint _java_thread_id;
     jint _native_thread_id;
-    std::string _thread_name;
+    const char* _thread_name;
     // The lock object address
     uintptr_t _lock_object_address;
     // The lock event type
-    std::string _lock_type;
+    const char* _lock_type;
     // The lock name
-    std::string _lock_name;
+    const char* _lock_name;
 
     // The timestamp when the thread tries to acquire the lock
     jlong _wait_timestamp;
@@ -56,17 +49,64 @@ struct LockWaitEvent {
     // A list of thread IDs that have acquired the lock when the current thread wait for the lock
     jint _wait_thread_id;
 
-    // The stack trace of the current thread when acquiring the lock
-    std::string _stack_trace;
+    // The stack trace of the current thread when acquiring the lock, 0 if none
+    u32 _call_trace_id;
+    // Trace context of the thread when it acquired the lock, zero if none
+    TraceIds _context;
+    // Java id of the virtual thread that waited on the carrier _native_thread_id, 0 if none
+    jlong _vthread_id;
+
+    void init(
+        jint thread_id,
+        uintptr_t lock_object_address,
+        jlong wait_timestamp,
+        jlong wake_timestamp,
+        jint wait_thread_id) {
+        _native_thread_id = thread_id;
+        _lock_object_address = lock_object_address;
+        _wait_timestamp = wait_timestamp;
+        _wake_timestamp = wake_timestamp;
+        _wait_duration = KdClock::toNanos(wake_timestamp - wait_timestamp);
+        _wait_thread_id = wait_thread_id;
+        _call_trace_id = 0;
+        _vthread_id = 0;
+        if (!TraceContext::get(thread_id, &_context)) {
+            _context.trace_high = _context.trace_low = _context.span_id = 0;
+        }
+    }
+
+    // Filled in only for the waits that are going to be logged
+    void describe(
+        const char* thread_name,
+        jint java_thread_id,
+        const char* lock_type,
+        const char* lock_name) {
+        _thread_name = thread_name;
+        _java_thread_id = java_thread_id;
+        _lock_type = lock_type;
+        _lock_name = lock_name;
+        // The owner of a parked-on synchronizer is known only for the locks
+        if (strcmp(lock_type, "UnsafePark") == 0 && !isConcurrentLock(lock_name)) {
+            _wait_thread_id = 0;
+        }
+    }
 
-    void print() {
+    void print(const char* stack_trace) {
         printf("{\"threadId\":%d,\"threadName\":\"%s\", \"javaThreadId\":%d,\"waitTimestamp\":%ld,\"wakeTimestamp\":%ld,\"objectAddr\":\"%lx\",\"lockType\":\"%s\", \"lockName\":%s,\"waitDuration\":%ld,\"waitThread\":%d,\"stack\":\"%s\"}",
-        _native_thread_id, _thread_name.c_str(), _java_thread_id, _wait_timestamp, _wake_timestamp, _lock_object_address, _lock_type.c_str(), _lock_name.c_str(), _wait_duration, _wait_thread_id, _stack_trace.c_str());
+        _native_thread_id, _thread_name, _java_thread_id, _wait_timestamp, _wake_timestamp, _lock_object_address, _lock_type, _lock_name, _wait_duration, _wait_thread_id, stack_trace);
         printf("\n");
     }
 
-    void log() {
-        EventLogger::log("kd-jf@%ld!%ld!%d!%x!%s!%s!%ld!%d!%s!", _wait_timestamp, _wake_timestamp, _native_thread_id, _lock_object_address, _lock_type.c_str(), _thread_name.c_str(), _wait_duration, _wait_thread_id, _stack_trace.c_str());
+    void log(const char* stack_trace) {
+        // kd-ctx like for CPU samples: the context of the kd-jf that follows
+        if (!_context.empty()) {
+            EventLogger::log("kd-ctx@%ld!%d!%016llx%016llx!%016llx!", _wait_timestamp, _native_thread_id,
+                             _context.trace_high, _context.trace_low, _context.span_id);
+        }
+        if (_vthread_id != 0) {
+            EventLogger::log("kd-vt@%ld!%d!%lld!", _wait_timestamp, _native_thread_id, (long long)_vthread_id);
+        }
+        EventLogger::log("kd-jf@%ld!%ld!%d!%x!%s!%s!%ld!%d!%s!", _wait_timestamp, _wake_timestamp, _native_thread_id, _lock_object_address, _lock_type, _thread_name, _wait_duration, _wait_thread_id, stack_trace);
     }
 };
-#endif // _LOCKEVENT_H
\ No newline at end of file
+#endif // _LOCKEVENT_H
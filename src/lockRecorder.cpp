@@ -14,176 +14,596 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include "lockRecorder.h"
-#include <iostream>
+#include "profiledThread.h"
+#include "vmEntry.h"
 #include "timeUtil.h"
 
+// Nanoseconds
 u64 expiredDuration = 30e9;
 
-void LockRecorder::recordLockedThread(uintptr_t lock_address, LockWaitEvent* event) {
-    auto last_locked_thread_it = _locked_thread_map->find(lock_address);
-    if (last_locked_thread_it == _locked_thread_map->end()) {
-        // No last thread found
-        _locked_thread_map->emplace(lock_address, event);
-    } else {
-        LockWaitEvent* lastEvent = last_locked_thread_it->second;
-        delete lastEvent;
-        (*_locked_thread_map)[lock_address] = event;
+static inline u64 hashAddress(uintptr_t address) {
+    return (u64)(address >> 3) * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline u32 slotHash(const LockSlot& slot) {
+    return (u32)hashAddress(slot.address);
+}
+
+static inline u32 slotHash(const WaiterSlot& slot) {
+    return (u32)hashAddress(slot.address) ^ ((u32)slot.thread_id * 0x85ebca6bU);
+}
+
+static bool byBlockedTime(const LockSummary& a, const LockSummary& b) {
+    return a.blocked_time > b.blocked_time;
+}
+
+// Backward shift deletion keeps probe chains intact without tombstones
+template <typename Slot>
+static void removeSlot(Slot* table, u32 i) {
+    const u32 mask = LOCK_SHARD_CAPACITY - 1;
+    for (u32 j = (i + 1) & mask; table[j].address != 0; j = (j + 1) & mask) {
+        u32 home = slotHash(table[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table[i] = table[j];
+            i = j;
+        }
     }
+    memset(&table[i], 0, sizeof(Slot));
 }
 
-void LockRecorder::clearLockedThread() {
-    jlong current_timestamp = getCurrentTimestamp();
-    lock_guard<mutex> lock(_mutex);
-    auto i = this->_locked_thread_map->begin();
-    while (i != this->_locked_thread_map->end()) {
-        auto event = i->second;
-        // Check if there is a thread waiting to lock it.
-        auto lock_address = i->first;
-        auto wait_lock_thread_it = _wait_lock_map->find(lock_address);
-        // We never remove the events if there is a thread waiting for.
-        if (wait_lock_thread_it != _wait_lock_map->end()) {
-            ++i;
-            continue;
+LockSlot* LockShard::findLock(uintptr_t address, bool create) {
+    const u32 mask = LOCK_SHARD_CAPACITY - 1;
+    LockSlot key = {address};
+    for (u32 i = slotHash(key) & mask; ; i = (i + 1) & mask) {
+        LockSlot* slot = &_locks[i];
+        if (slot->address == address) {
+            return slot;
         }
-        if (current_timestamp - event->_wait_timestamp > expiredDuration) {
-            delete i->second;
-            i = this->_locked_thread_map->erase(i);
-        } else {
-            ++i;
+        if (slot->address == 0) {
+            // Keep at least one free slot to terminate probing
+            if (!create || _lock_count >= mask) {
+                return NULL;
+            }
+            slot->address = address;
+            _lock_count++;
+            return slot;
         }
     }
 }
 
-bool isConcurrentLock(const string lock_name) {
-    // Do not count synchronizers other than ReentrantLock, ReentrantReadWriteLock
-    return lock_name == "Ljava/util/concurrent/locks/ReentrantLock" ||
-           lock_name == "Ljava/util/concurrent/locks/ReentrantReadWriteLock";
+void LockShard::removeLock(LockSlot* slot) {
+    removeSlot(_locks, slot - _locks);
+    _lock_count--;
+}
+
+WaiterSlot* LockShard::findWaiter(uintptr_t address, jint thread_id, bool create) {
+    const u32 mask = LOCK_SHARD_CAPACITY - 1;
+    WaiterSlot key = {address, thread_id};
+    for (u32 i = slotHash(key) & mask; ; i = (i + 1) & mask) {
+        WaiterSlot* slot = &_waiters[i];
+        if (slot->address == address && slot->thread_id == thread_id) {
+            return slot;
+        }
+        if (slot->address == 0) {
+            if (!create || _waiter_count >= mask) {
+                return NULL;
+            }
+            slot->address = address;
+            slot->thread_id = thread_id;
+            _waiter_count++;
+            return slot;
+        }
+    }
+}
+
+void LockShard::removeWaiter(WaiterSlot* slot) {
+    removeSlot(_waiters, slot - _waiters);
+    _waiter_count--;
+}
+
+LockShard* LockRecorder::shardOf(uintptr_t lock_address) {
+    return &_shards[hashAddress(lock_address) >> 58];
+}
+
+// Expires a slice of the shards on every call, so that a full pass takes
+// LOCK_CLEAR_INTERVAL_MS and no shard lock is held for more than one shard scan
+void LockRecorder::clearLockedThread() {
+    jlong current_timestamp = KdClock::now();
+    for (int n = 0; n < LOCK_CLEAR_SHARDS_PER_TICK; n++) {
+        LockShard* shard = &_shards[_clear_cursor];
+        _clear_cursor = (_clear_cursor + 1) % LOCK_TABLE_SHARDS;
+
+        shard->_lock.lock();
+        for (u32 i = 0; i < LOCK_SHARD_CAPACITY && shard->_lock_count > 0; ) {
+            LockSlot* slot = &shard->_locks[i];
+            // We never remove the lock if there is a thread waiting for it or unreported contention.
+            if (slot->address != 0 && slot->waiters == 0 && slot->waits == 0 &&
+                KdClock::toNanos(current_timestamp - slot->owner_timestamp) > expiredDuration) {
+                // Another slot may be shifted into this position, check it again
+                shard->removeLock(slot);
+            } else {
+                i++;
+            }
+        }
+        shard->_lock.unlock();
+    }
+}
+
+void LockRecorder::setup(jlong threshold, jlong sample_interval, jlong graph_interval) {
+    _threshold = threshold;
+    _sample_interval = sample_interval;
+    _graph_interval = graph_interval;
+    _last_summary = KdClock::now();
+    _short_waits = 0;
+    _short_wait_time = 0;
+    _sampled_waits = 0;
+    _reported_samples = 0;
 }
 
 // Thread-safe must be guaranteed.
-void LockRecorder::updateWaitLockThread(LockWaitEvent* event) {
-    uintptr_t lock_address = event->_lock_object_address;
-    jint native_thread_id = event->_native_thread_id;
-    bool concurrentLock = event->_lock_type != "UnsafePark" || isConcurrentLock(event->_lock_name);
-    if (concurrentLock) {
-        jint locked_thread = findContendedThreads(lock_address, native_thread_id);
-        event->_wait_thread_id = locked_thread;
-    }
-
-    lock_guard<mutex> lock(_mutex);
-    auto wait_iterator = _wait_lock_map->find(lock_address);
-    auto threads_map = wait_iterator->second;
-    // No object in the map
-    if (wait_iterator == _wait_lock_map->end()) {
-        threads_map = new map<jint, LockWaitEvent*>();
-        threads_map->emplace(native_thread_id, event);
-        _wait_lock_map->emplace(lock_address, threads_map);
+void LockRecorder::updateWaitLockThread(uintptr_t lock_address, jint thread_id, jlong wait_timestamp, bool blocking) {
+    LockShard* shard = shardOf(lock_address);
+    shard->_lock.lock();
+
+    WaiterSlot* waiter = shard->findWaiter(lock_address, thread_id, false);
+    if (waiter != NULL) {
+        // It is supported not to enter this branch.
+        // Because one lock can not be waited by a same thread twice.
+        shard->_lock.unlock();
         return;
     }
 
-    // There is the object in the map. Try to find the thread_id.
-    auto thread_iterator = threads_map->find(native_thread_id);
-    // No the thread_id in the map.
-    if (thread_iterator == threads_map->end()) {
-        threads_map->emplace(native_thread_id, event);
+    LockSlot* lock = shard->findLock(lock_address, true);
+    waiter = shard->findWaiter(lock_address, thread_id, true);
+    if (waiter == NULL) {
+        // The shard is full, the wait cannot be paired with its wake up.
+        // A lock with waiters or a known owner keeps its slot, counters and owner stack
+        if (lock != NULL && lock->waiters == 0 && lock->owner_timestamp == 0) shard->removeLock(lock);
+        shard->_lock.unlock();
         return;
     }
 
-    // It is supported not to enter this branch.
-    // Because one lock can not be waited by a same thread twice. 
-    // TODO: remove the println code.
-    // printf("[WARN] A lock is waited by a same thread twice. thread_id=%d, thread_name=%s.\n", native_thread_id, event->_thread_name.data());
-    delete event;
-}
+    // The thread which holds the lock is the one which acquired it last
+    bool has_owner = lock != NULL && lock->owner_timestamp != 0 && lock->owner_thread_id != thread_id;
+    jint owner_thread_id = has_owner ? lock->owner_thread_id : -1;
+    waiter->owner_thread_id = owner_thread_id;
+    waiter->owner_trace_id = has_owner ? lock->owner_trace_id : 0;
+    waiter->wait_timestamp = wait_timestamp;
+    waiter->blocking = blocking;
+    if (lock != NULL) {
+        lock->waiters++;
+        if (lock->waiters > lock->max_waiters) lock->max_waiters = lock->waiters;
+    }
+    shard->_lock.unlock();
 
-void LockRecorder::updateWakeThread(uintptr_t lock_address, jint thread_id, string thread_name, jlong wake_timestamp) {
-    lock_guard<mutex> lock(_mutex);
-    auto wait_iterator = _wait_lock_map->find(lock_address);
-    if (wait_iterator == _wait_lock_map->end()) {
-        // This should not happen because there should be a same lock.
-        // printf("[WARN] There is no the same lock. lock_address=%lu, thread_id=%d, thread_name=%s.\n", lock_address, thread_id, thread_name.data());
-        return;
+    bool waits_for_owner = blocking && owner_thread_id >= 0;
+    setThreadWait(thread_id, lock_address, waits_for_owner ? owner_thread_id : -1, wait_timestamp, 0);
+    if (_graph_interval > 0 && waits_for_owner) {
+        findCycle(thread_id);
     }
+}
+
+LockWaitEvent* LockRecorder::updateWakeThread(uintptr_t lock_address, jint thread_id, jlong wake_timestamp) {
+    LockShard* shard = shardOf(lock_address);
+    shard->_lock.lock();
 
-    auto threads_map = wait_iterator->second;
-    auto event_iterator = threads_map->find(thread_id);
-    if (event_iterator == threads_map->end()) {
+    WaiterSlot* waiter = shard->findWaiter(lock_address, thread_id, false);
+    if (waiter == NULL) {
         // This should not happen because there should be a waited thread before it is waked.
-        // printf("[WARN] There is no the same thread waiting to be waked. thread_id=%d, thread_name=%s.\n", thread_id, thread_name.data());
-        return;
+        shard->_lock.unlock();
+        return NULL;
     }
-    LockWaitEvent* event = event_iterator->second;
-    threads_map->erase(thread_id);
-    if (threads_map->size() == 0) {
-        _wait_lock_map->erase(lock_address);
-        delete threads_map;
+    jint owner_thread_id = waiter->owner_thread_id;
+    u32 owner_trace_id = waiter->owner_trace_id;
+    jlong wait_timestamp = waiter->wait_timestamp;
+    bool blocking = waiter->blocking;
+    shard->removeWaiter(waiter);
+    setThreadWait(thread_id, lock_address, -1, wait_timestamp, wake_timestamp);
+
+    jlong duration = KdClock::toNanos(wake_timestamp - wait_timestamp);
+    LockSlot* lock = shard->findLock(lock_address, true);
+    if (lock != NULL) {
+        if (lock->waiters > 0) lock->waiters--;
+        if (_graph_interval > 0 && blocking && duration > 0) {
+            lock->waits++;
+            if (lock->waiters > 0) lock->handoffs++;
+            lock->blocked_time += duration;
+            if (owner_thread_id >= 0) {
+                // The stack of the owner may have been resolved after the wait started
+                if (lock->owner_thread_id == owner_thread_id && lock->owner_trace_id != 0) {
+                    owner_trace_id = lock->owner_trace_id;
+                }
+                blame(lock, owner_thread_id, owner_trace_id, duration);
+            }
+        }
+        lock->owner_thread_id = thread_id;
+        lock->owner_timestamp = wait_timestamp;
+        lock->owner_trace_id = 0;
     }
-    event->_wake_timestamp = wake_timestamp;
-    event->_wait_duration = wake_timestamp - event->_wait_timestamp;
+    shard->_lock.unlock();
 
-    recordLockedThread(lock_address, event);
+    if (duration < _threshold && !sampleShortWait(duration)) {
+        return NULL;
+    }
 
-    if (!filter(event)) {
-        // event->print();
-        event->log();
+    LockWaitEvent* event = newEvent(thread_id);
+    if (event == NULL) {
+        return NULL;
     }
+    event->init(thread_id, lock_address, wait_timestamp, wake_timestamp, owner_thread_id);
+    return event;
 }
 
-jint LockRecorder::findContendedThreads(uintptr_t lock_address, jint thread_id) {
-    unique_lock<mutex> uni_lock(_mutex, defer_lock);
-    uni_lock.lock();
-    auto last_locked_thread_it = _locked_thread_map->find(lock_address);
-    uni_lock.unlock();
-    if (last_locked_thread_it == _locked_thread_map->end() 
-     || last_locked_thread_it->second->_native_thread_id == thread_id) {
-        // No last thread found
-        return -1;
-    }
-    return last_locked_thread_it->second->_native_thread_id;
+void LockRecorder::setThreadWait(jint thread_id, uintptr_t lock_address, jint owner_thread_id, jlong wait_timestamp, jlong wake_timestamp) {
+    ThreadWait* wait = &_thread_waits[thread_id & (LOCK_THREAD_WAITS - 1)];
+    __atomic_fetch_add(&wait->seq, 1, __ATOMIC_ACQ_REL);
+    wait->thread_id = thread_id;
+    wait->owner_thread_id = owner_thread_id;
+    wait->address = lock_address;
+    wait->wait_timestamp = wait_timestamp;
+    wait->wake_timestamp = wake_timestamp;
+    __atomic_fetch_add(&wait->seq, 1, __ATOMIC_RELEASE);
 }
 
-// 11ms
-jlong threshold = 11 * 1e6;
-inline bool filter(LockWaitEvent* event) {
-    jlong duration = event->_wait_duration;
-    if (duration < threshold) {
-        return true;
+// False if the slot belongs to another thread or keeps changing
+bool LockRecorder::readThreadWait(jint thread_id, ThreadWait* copy) {
+    ThreadWait* wait = &_thread_waits[thread_id & (LOCK_THREAD_WAITS - 1)];
+    for (int attempt = 0; attempt < 3; attempt++) {
+        u32 seq = __atomic_load_n(&wait->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        *copy = *wait;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&wait->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        return copy->thread_id == thread_id;
     }
     return false;
 }
 
-void LockRecorder::reset() {
-    lock_guard<mutex> lock(_mutex);
-    for (auto it = _locked_thread_map->begin(); it != _locked_thread_map->end(); it++) {
-        auto event = it->second;
-        delete event;
+uintptr_t LockRecorder::blockedOn(jint thread_id, jlong from, jlong to) {
+    ThreadWait copy;
+    if (!readThreadWait(thread_id, &copy)) {
+        return 0;
     }
-    _locked_thread_map->clear();
-    for (auto it = _wait_lock_map->begin(); it != _wait_lock_map->end(); it++) {
-        auto thread_map = it->second;
-        for (auto ite = thread_map->begin(); ite != thread_map->end(); ite++) {
-            auto event = ite->second;
-            delete event;
+    bool overlaps = copy.wait_timestamp <= to && (copy.wake_timestamp == 0 || copy.wake_timestamp >= from);
+    return overlaps ? copy.address : 0;
+}
+
+// Follows the wait-for edges from the thread that has just started waiting.
+// A cycle is closed by the wait that starts last, so every cycle is found once.
+void LockRecorder::findCycle(jint thread_id) {
+    LockCycle cycle;
+    jint current = thread_id;
+    for (int depth = 0; depth < LOCK_CYCLE_DEPTH; depth++) {
+        ThreadWait wait;
+        if (!readThreadWait(current, &wait) || wait.wake_timestamp != 0 || wait.owner_thread_id < 0) {
+            return;
         }
-        delete thread_map;
+        cycle.thread_ids[depth] = current;
+        cycle.addresses[depth] = wait.address;
+        cycle.wait_timestamps[depth] = wait.wait_timestamp;
+        cycle.length = depth + 1;
+
+        if (wait.owner_thread_id == thread_id) {
+            _cycle_lock.lock();
+            if (_cycle_count < LOCK_CYCLES) {
+                _cycles[_cycle_count++] = cycle;
+            }
+            _cycle_lock.unlock();
+            return;
+        }
+        current = wait.owner_thread_id;
     }
-    _wait_lock_map->clear();
+}
+
+// A cycle is a deadlock if every wait in it is still the same after LOCK_DEADLOCK_CONFIRM;
+// the owners are only the threads that acquired the locks last, so shorter cycles may be stale.
+//     kd-jfd@timestamp!length!thread_id!lock_address!...!
+void LockRecorder::confirmCycles(jlong now) {
+    LockCycle confirmed[LOCK_CYCLES];
+    int count = 0;
+
+    _cycle_lock.lock();
+    for (int i = 0; i < _cycle_count; ) {
+        LockCycle* cycle = &_cycles[i];
+        bool waiting = true;
+        jlong closed = 0;
+        for (int j = 0; j < cycle->length && waiting; j++) {
+            ThreadWait wait;
+            waiting = readThreadWait(cycle->thread_ids[j], &wait) && wait.wake_timestamp == 0 &&
+                      wait.wait_timestamp == cycle->wait_timestamps[j];
+            if (cycle->wait_timestamps[j] > closed) closed = cycle->wait_timestamps[j];
+        }
+        if (waiting && KdClock::toNanos(now - closed) < LOCK_DEADLOCK_CONFIRM) {
+            i++;
+            continue;
+        }
+        if (waiting) {
+            confirmed[count++] = *cycle;
+        }
+        *cycle = _cycles[--_cycle_count];
+    }
+    _cycle_lock.unlock();
+
+    for (int i = 0; i < count; i++) {
+        char edges[LOCK_CYCLE_DEPTH * 32];
+        size_t len = 0;
+        for (int j = 0; j < confirmed[i].length; j++) {
+            len += snprintf(edges + len, sizeof(edges) - len, "%d!%lx!",
+                            confirmed[i].thread_ids[j], (unsigned long)confirmed[i].addresses[j]);
+        }
+        EventLogger::log("kd-jfd@%ld!%d!%s", now, confirmed[i].length, edges);
+    }
+}
+
+// Space-saving top holders: a new holder replaces the least blamed one and inherits its time
+void LockRecorder::blame(LockSlot* lock, jint thread_id, u32 call_trace_id, u64 duration) {
+    LockHolder* min = &lock->holders[0];
+    for (int i = 0; i < LOCK_TOP_HOLDERS; i++) {
+        LockHolder* holder = &lock->holders[i];
+        if (holder->blocked_time == 0 || (holder->thread_id == thread_id && holder->call_trace_id == call_trace_id)) {
+            min = holder;
+            break;
+        }
+        if (holder->blocked_time < min->blocked_time) {
+            min = holder;
+        }
+    }
+    min->thread_id = thread_id;
+    min->call_trace_id = call_trace_id;
+    min->blocked_time += duration;
+}
+
+// Contention of the locks waited for most since the last summary. Waiter count over
+// time is blocked_ns / interval_ns; each lock is followed by the threads blamed for it.
+//     kd-jfl@timestamp!interval_ns!lock_address!waits!handoffs!max_waiters!blocked_ns!convoy!
+//     kd-jfh@timestamp!lock_address!owner_thread_id!blocked_ns!stack!
+void LockRecorder::summarize(jlong now) {
+    std::vector<LockSummary> locks;
+    for (int s = 0; s < LOCK_TABLE_SHARDS; s++) {
+        LockShard* shard = &_shards[s];
+        shard->_lock.lock();
+        for (u32 i = 0; i < LOCK_SHARD_CAPACITY; i++) {
+            LockSlot* slot = &shard->_locks[i];
+            if (slot->address == 0 || slot->waits == 0) {
+                continue;
+            }
+            LockSummary summary;
+            summary.address = slot->address;
+            summary.waits = slot->waits;
+            summary.handoffs = slot->handoffs;
+            summary.max_waiters = slot->max_waiters;
+            summary.blocked_time = slot->blocked_time;
+            memcpy(summary.holders, slot->holders, sizeof(summary.holders));
+            locks.push_back(summary);
+
+            slot->waits = 0;
+            slot->handoffs = 0;
+            slot->max_waiters = slot->waiters;
+            slot->blocked_time = 0;
+            memset(slot->holders, 0, sizeof(slot->holders));
+        }
+        shard->_lock.unlock();
+    }
+
+    jlong interval = KdClock::toNanos(now - _last_summary);
+    _last_summary = now;
+
+    size_t count = locks.size() < LOCK_SUMMARY_LOCKS ? locks.size() : LOCK_SUMMARY_LOCKS;
+    std::partial_sort(locks.begin(), locks.begin() + count, locks.end(), byBlockedTime);
+
+    char stack_trace[LOCK_STACK_TRACE_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        const LockSummary& lock = locks[i];
+        bool convoy = lock.waits >= LOCK_CONVOY_WAITS && lock.handoffs * 2 >= lock.waits;
+        EventLogger::log("kd-jfl@%ld!%ld!%lx!%u!%u!%d!%llu!%d!", now, interval, (unsigned long)lock.address,
+                         lock.waits, lock.handoffs, lock.max_waiters, (unsigned long long)lock.blocked_time, convoy ? 1 : 0);
+        for (int j = 0; j < LOCK_TOP_HOLDERS && lock.holders[j].blocked_time > 0; j++) {
+            formatStackTrace(lock.holders[j].call_trace_id, stack_trace, sizeof(stack_trace));
+            EventLogger::log("kd-jfh@%ld!%lx!%d!%llu!%s!", now, (unsigned long)lock.address, lock.holders[j].thread_id,
+                             (unsigned long long)lock.holders[j].blocked_time, stack_trace);
+        }
+    }
+}
+
+// Picks one short wait per _sample_interval ns of accumulated short waiting,
+// so that longer waits are proportionally more likely to be reported
+bool LockRecorder::sampleShortWait(jlong duration) {
+    if (_sample_interval <= 0 || duration <= 0) {
+        return false;
+    }
+
+    atomicInc(_short_waits);
+    u64 prev = atomicInc(_short_wait_time, (u64)duration);
+    if ((prev + duration) / _sample_interval == prev / _sample_interval) {
+        return false;
+    }
+    atomicInc(_sampled_waits);
+    return true;
+}
+
+void LockRecorder::record(LockWaitEvent* event) {
+    if (_graph_interval > 0 && event->_call_trace_id != 0) {
+        // Waits for the lock while the thread holds it are blamed on this stack
+        LockShard* shard = shardOf(event->_lock_object_address);
+        shard->_lock.lock();
+        LockSlot* lock = shard->findLock(event->_lock_object_address, false);
+        if (lock != NULL && lock->owner_thread_id == event->_native_thread_id &&
+            lock->owner_timestamp == event->_wait_timestamp) {
+            lock->owner_trace_id = event->_call_trace_id;
+        }
+        shard->_lock.unlock();
+    }
+    // Resolving the stack takes JVM TI calls, leave it to the background task
+    enqueue(event);
+}
+
+void LockRecorder::enqueue(LockWaitEvent* event) {
+    event->_next = NULL;
+    _queue_lock.lock();
+    if (_queue_tail == NULL) {
+        _queue_head = event;
+    } else {
+        _queue_tail->_next = event;
+    }
+    _queue_tail = event;
+    _queue_lock.unlock();
+}
+
+void LockRecorder::flushEvents() {
+    _queue_lock.lock();
+    LockWaitEvent* event = _queue_head;
+    _queue_head = NULL;
+    _queue_tail = NULL;
+    _queue_lock.unlock();
+
+    char stack_trace[LOCK_STACK_TRACE_SIZE];
+    while (event != NULL) {
+        LockWaitEvent* next = event->_next;
+        formatStackTrace(event->_call_trace_id, stack_trace, sizeof(stack_trace));
+        event->log(stack_trace);
+        freeEvent(event);
+        event = next;
+    }
+
+    if (_graph_interval > 0) {
+        jlong now = KdClock::now();
+        confirmCycles(now);
+        if (KdClock::toNanos(now - _last_summary) >= _graph_interval) {
+            summarize(now);
+        }
+    }
+    _methods.nextEpoch();
+
+    u64 sampled_waits = _sampled_waits;
+    if (sampled_waits != _reported_samples) {
+        // Totals since the start: each sampled wait stands for short_wait_time / sampled ns of waiting
+        _reported_samples = sampled_waits;
+        EventLogger::log("kd-jfs@%ld!%lld!%lld!%lld!", KdClock::now(),
+                         (long long)_short_waits, (long long)_short_wait_time, (long long)sampled_waits);
+    }
+}
+
+// Frames are printed as method name and class signature, e.g. "run.Ljava/lang/Thread;"
+void LockRecorder::formatStackTrace(u32 call_trace_id, char* buf, size_t size) {
+    buf[0] = 0;
+    CallTrace* trace = call_trace_id == 0 ? NULL : _traces.findTrace(call_trace_id);
+    if (trace == NULL) {
+        return;
+    }
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    size_t len = 0;
+    for (int i = 0; i < trace->num_frames && len < size - 1; i++) {
+        jmethodID method = trace->frames[i].method_id;
+        if (method == NULL || trace->frames[i].bci <= BCI_NATIVE_FRAME) {
+            continue;
+        }
+
+        bool added;
+        MethodCacheEntry* entry = _methods.lookup(method, 0, added);
+        const char* name = entry != NULL ? entry->name : NULL;
+        char frame_name[LOCK_STACK_TRACE_SIZE];
+        if (name == NULL) {
+            char* method_name = NULL;
+            char* signature = NULL;
+            frame_name[0] = 0;
+            if (jvmti->GetMethodName(method, &method_name, NULL, NULL) == JVMTI_ERROR_NONE) {
+                jclass declaring_class;
+                if (jvmti->GetMethodDeclaringClass(method, &declaring_class) == JVMTI_ERROR_NONE) {
+                    jvmti->GetClassSignature(declaring_class, &signature, NULL);
+                }
+                snprintf(frame_name, sizeof(frame_name), "%s.%s", method_name, signature != NULL ? signature : "");
+            }
+            jvmti->Deallocate((unsigned char*)method_name);
+            jvmti->Deallocate((unsigned char*)signature);
+            name = frame_name;
+            if (entry != NULL) entry->name = MethodCache::copyName(frame_name);
+        }
+
+        int n = snprintf(buf + len, size - len, "%s", name);
+        if (n > 0) len += n;
+    }
+}
+
+LockWaitEvent* LockRecorder::newEvent(jint thread_id) {
+    LockEventPool* pool = &_pools[(u32)thread_id % LOCK_EVENT_POOLS];
+    pool->_lock.lock();
+    if (pool->_free == NULL) {
+        if (!MemoryBudget::reserve(MEMORY_LOCK_EVENTS, LOCK_EVENT_CHUNK * sizeof(LockWaitEvent))) {
+            // Over memlimit: the wait is not reported
+            pool->_lock.unlock();
+            return NULL;
+        }
+        LockWaitEvent* chunk = new LockWaitEvent[LOCK_EVENT_CHUNK];
+        for (int i = 0; i < LOCK_EVENT_CHUNK; i++) {
+            chunk[i]._pool = pool - _pools;
+            chunk[i]._next = i + 1 < LOCK_EVENT_CHUNK ? &chunk[i + 1] : NULL;
+        }
+        pool->_chunks.push_back(chunk);
+        pool->_free = chunk;
+    }
+    LockWaitEvent* event = pool->_free;
+    pool->_free = event->_next;
+    pool->_lock.unlock();
+    return event;
+}
+
+void LockRecorder::freeEvent(LockWaitEvent* event) {
+    LockEventPool* pool = &_pools[event->_pool];
+    pool->_lock.lock();
+    event->_next = pool->_free;
+    pool->_free = event;
+    pool->_lock.unlock();
+}
+
+void LockRecorder::reset() {
+    _queue_lock.lock();
+    LockWaitEvent* event = _queue_head;
+    _queue_head = NULL;
+    _queue_tail = NULL;
+    _queue_lock.unlock();
+    while (event != NULL) {
+        LockWaitEvent* next = event->_next;
+        freeEvent(event);
+        event = next;
+    }
+
+    for (int s = 0; s < LOCK_TABLE_SHARDS; s++) {
+        LockShard* shard = &_shards[s];
+        shard->_lock.lock();
+        memset(shard->_locks, 0, sizeof(shard->_locks));
+        memset(shard->_waiters, 0, sizeof(shard->_waiters));
+        shard->_lock_count = 0;
+        shard->_waiter_count = 0;
+        shard->_lock.unlock();
+    }
+    memset(_thread_waits, 0, sizeof(_thread_waits));
+
+    _cycle_lock.lock();
+    _cycle_count = 0;
+    _cycle_lock.unlock();
+
+    // The hooks are disabled and the final flush is done: no stack id or name is referenced any more
+    _traces.clear();
+    ProfiledThread::newNameEpoch();
+    _strings.clear();
 }
 
 void LockRecorder::startClearLockedThreadTask() {
     _clear_map_task = new ClearMapTask(this);
-    _clear_map_thread = std::thread([&]{
-        VM::attachThread("AsyncProfiler-Lock-Clearer");
-        _clear_map_task->run();
-        VM::detachThread();
-    });
+    BackgroundScheduler::schedule(_clear_map_task, LOCK_FLUSH_INTERVAL_MS, true);
 }
 void LockRecorder::endClearLockedThreadTask() {
     if (_clear_map_task != NULL) {
-        _clear_map_task->stop();
-        _clear_map_thread.join();
+        BackgroundScheduler::cancel(_clear_map_task);
         delete _clear_map_task;
         _clear_map_task = NULL;
+        flushEvents();
     }
 }
\ No newline at end of file
@@ -18,71 +18,265 @@
 #define _LOCKRECORDER_H
 
 #include <jvmti.h>
-#include <map>
-#include <mutex>
+#include <string.h>
+#include <vector>
+#include "backgroundScheduler.h"
+#include "callTraceStorage.h"
+#include "dictionary.h"
 #include "lockEvent.h"
-#include "stoppableTask.h"
+#include "memoryBudget.h"
+#include "methodCache.h"
+#include "overheadGovernor.h"
+#include "spinLock.h"
 
 using namespace std;
 
-bool filter(LockWaitEvent* event);
+const int LOCK_TABLE_SHARDS = 64;
+const int LOCK_SHARD_CAPACITY = 256;  // must be a power of 2
+const int LOCK_EVENT_POOLS = 16;
+const int LOCK_EVENT_CHUNK = 256;
+const int LOCK_FLUSH_INTERVAL_MS = 100;
+const int LOCK_CLEAR_INTERVAL_MS = 5000;
+const int LOCK_CLEAR_SHARDS_PER_TICK = (LOCK_TABLE_SHARDS * LOCK_FLUSH_INTERVAL_MS + LOCK_CLEAR_INTERVAL_MS - 1) / LOCK_CLEAR_INTERVAL_MS;
+const jlong DEFAULT_LOCK_THRESHOLD = 11000000;  // 11ms
+const int LOCK_THREAD_WAITS = 4096;  // must be a power of 2
+const int LOCK_TOP_HOLDERS = 2;
+const int LOCK_CYCLE_DEPTH = 8;
+const int LOCK_CYCLES = 16;
+const jlong LOCK_DEADLOCK_CONFIRM = 1000000000;  // 1s
+const int LOCK_SUMMARY_LOCKS = 16;
+// A lock is a convoy when most of its waiters hand it over to the next waiter
+const u32 LOCK_CONVOY_WAITS = 16;
+
+// A thread blamed for the waits on a lock, with its stack when it acquired the lock
+struct LockHolder {
+    jint thread_id;
+    u32 call_trace_id;
+    u64 blocked_time;
+};
+
+// A lock that has been waited for or acquired recently
+struct LockSlot {
+    uintptr_t address;
+    // The thread which acquired the lock last and when it started waiting for it
+    jint owner_thread_id;
+    jlong owner_timestamp;
+    // The stack of the owner when it acquired the lock, 0 if its wait was not reported
+    u32 owner_trace_id;
+    int waiters;
+
+    // Contention since the last summary (lockgraph)
+    u32 waits;
+    // Waits that ended while other threads were still waiting
+    u32 handoffs;
+    int max_waiters;
+    u64 blocked_time;
+    LockHolder holders[LOCK_TOP_HOLDERS];
+};
+
+// A thread waiting for a lock. Nothing else is captured until the wait ends,
+// since most waits are too short to be reported.
+struct WaiterSlot {
+    uintptr_t address;
+    jint thread_id;
+    // The owner of the lock when the wait started, -1 if unknown
+    jint owner_thread_id;
+    u32 owner_trace_id;
+    jlong wait_timestamp;
+    bool blocking;
+};
+
+// The last lock wait of a thread, indexed by thread id; wake_timestamp is 0
+// while the thread is still waiting. Read without locking by other threads,
+// which retry while seq is odd; a thread sharing the slot may hide the wait.
+struct ThreadWait {
+    u32 seq;
+    jint thread_id;
+    // The thread the wait depends on: -1 if unknown or if the wait is for a notification
+    jint owner_thread_id;
+    uintptr_t address;
+    jlong wait_timestamp;
+    jlong wake_timestamp;
+};
+
+// A chain of waits that leads back to the first waiter. Only reported as a
+// deadlock when none of the waits ends for LOCK_DEADLOCK_CONFIRM ns.
+struct LockCycle {
+    int length;
+    jint thread_ids[LOCK_CYCLE_DEPTH];
+    uintptr_t addresses[LOCK_CYCLE_DEPTH];
+    jlong wait_timestamps[LOCK_CYCLE_DEPTH];
+};
+
+// Per lock totals of one summary interval
+struct LockSummary {
+    uintptr_t address;
+    u32 waits;
+    u32 handoffs;
+    int max_waiters;
+    u64 blocked_time;
+    LockHolder holders[LOCK_TOP_HOLDERS];
+};
+
+// Open-addressed tables with linear probing. A lock and all its waiters
+// live in the same shard, so a single short critical section covers an update.
+class LockShard {
+  public:
+    SpinLock _lock;
+    int _lock_count;
+    int _waiter_count;
+    LockSlot _locks[LOCK_SHARD_CAPACITY];
+    WaiterSlot _waiters[LOCK_SHARD_CAPACITY];
+
+    LockShard() : _lock(), _lock_count(0), _waiter_count(0) {
+        memset(_locks, 0, sizeof(_locks));
+        memset(_waiters, 0, sizeof(_waiters));
+    }
+
+    LockSlot* findLock(uintptr_t address, bool create);
+    void removeLock(LockSlot* slot);
+    WaiterSlot* findWaiter(uintptr_t address, jint thread_id, bool create);
+    void removeWaiter(WaiterSlot* slot);
+};
+
+// Free list of lock events. Events are allocated in chunks and recycled,
+// so recording a lock wait does not allocate at steady state.
+class LockEventPool {
+  public:
+    SpinLock _lock;
+    LockWaitEvent* _free;
+    std::vector<LockWaitEvent*> _chunks;
+
+    LockEventPool() : _lock(), _free(NULL), _chunks() {
+    }
+
+    ~LockEventPool() {
+        for (size_t i = 0; i < _chunks.size(); i++) {
+            delete[] _chunks[i];
+            MemoryBudget::release(MEMORY_LOCK_EVENTS, LOCK_EVENT_CHUNK * sizeof(LockWaitEvent));
+        }
+    }
+};
 
 class ClearMapTask;
 
 class LockRecorder {
   public:
-    LockRecorder() {
+    LockRecorder() : _methods(METHOD_CACHE_CAPACITY) {
         _has_stack = true;
-        _locked_thread_map = new map<uintptr_t, LockWaitEvent*>();
-        _wait_lock_map = new map<uintptr_t, map<jint, LockWaitEvent*>*>();
+        _shards = new LockShard[LOCK_TABLE_SHARDS];
+        _queue_head = NULL;
+        _queue_tail = NULL;
+        _threshold = DEFAULT_LOCK_THRESHOLD;
+        _sample_interval = 0;
+        _short_waits = 0;
+        _short_wait_time = 0;
+        _sampled_waits = 0;
+        _reported_samples = 0;
+        _clear_cursor = 0;
+        _clear_map_task = NULL;
+        _graph_interval = 0;
+        _last_summary = 0;
+        _cycle_count = 0;
+        memset(_thread_waits, 0, sizeof(_thread_waits));
     }
 
     ~LockRecorder() {
         reset();
-        delete _locked_thread_map;
-        delete _wait_lock_map;
+        delete[] _shards;
     }
-    void updateWaitLockThread(LockWaitEvent* event);
-    void updateWakeThread(uintptr_t lock_address, jint thread_id, string thread_name, jlong wake_timestamp);
+    // Waits shorter than threshold are dropped, or sampled once per sample_interval ns of waiting.
+    // Contention is summarized every graph_interval ns, if it is not 0.
+    void setup(jlong threshold, jlong sample_interval, jlong graph_interval);
+    void setSampleInterval(jlong sample_interval) {
+        _sample_interval = sample_interval;
+    }
+    // blocking is false for Object.wait(), which waits for a notification rather than for the owner
+    void updateWaitLockThread(uintptr_t lock_address, jint thread_id, jlong wait_timestamp, bool blocking);
+    // Returns the event to describe and record(), or NULL if the wait is not reported
+    LockWaitEvent* updateWakeThread(uintptr_t lock_address, jint thread_id, jlong wake_timestamp);
+    void record(LockWaitEvent* event);
+    // The lock the thread waited for at some point between from and to, or 0
+    uintptr_t blockedOn(jint thread_id, jlong from, jlong to);
+    LockWaitEvent* newEvent(jint thread_id);
+    void freeEvent(LockWaitEvent* event);
+    // Thread names and lock class names live until reset()
+    const char* intern(const char* name) {
+        return _strings.intern(name);
+    }
+    u32 putStackTrace(int num_frames, ASGCT_CallFrame* frames) {
+        return _traces.put(num_frames, frames, 1);
+    }
+    void flushEvents();
     void clearLockedThread();
     void startClearLockedThreadTask();
     void endClearLockedThreadTask();
-    // reset is used to clear the maps when the logTracer stops.
+    // reset is used to clear the tables when the logTracer stops.
     void reset();
     bool isRecordStack() {
         return _has_stack;
     }
   private:
     bool _has_stack;
-    std::mutex _mutex;
+    LockShard* _shards;
+    ThreadWait _thread_waits[LOCK_THREAD_WAITS];
+    LockEventPool _pools[LOCK_EVENT_POOLS];
+    Dictionary _strings;
+    CallTraceStorage _traces;
+
+    // Woken events waiting to be logged by the background task
+    SpinLock _queue_lock;
+    LockWaitEvent* _queue_head;
+    LockWaitEvent* _queue_tail;
 
-    map<uintptr_t, LockWaitEvent*>* _locked_thread_map;
-    map<uintptr_t, map<jint, LockWaitEvent*>*>* _wait_lock_map;
+    // Names of stack frames, used only by the background task
+    MethodCache _methods;
 
+    jlong _threshold;
+    jlong _sample_interval;
+    // Waits below the threshold, for scaling the sampled ones
+    volatile u64 _short_waits;
+    volatile u64 _short_wait_time;
+    volatile u64 _sampled_waits;
+    u64 _reported_samples;
+
+    // Wait-for graph (lockgraph): cycles found when a wait starts, waiting to be confirmed
+    jlong _graph_interval;
+    jlong _last_summary;
+    SpinLock _cycle_lock;
+    int _cycle_count;
+    LockCycle _cycles[LOCK_CYCLES];
+
+    // Next shard to be expired, used only by the background task
+    int _clear_cursor;
     ClearMapTask* _clear_map_task;
-    std::thread _clear_map_thread;
 
-    void recordLockedThread(uintptr_t lock_address, LockWaitEvent* event);
-    jint findContendedThreads(uintptr_t lock_address, jint thread_id);
+    LockShard* shardOf(uintptr_t lock_address);
+    void setThreadWait(jint thread_id, uintptr_t lock_address, jint owner_thread_id, jlong wait_timestamp, jlong wake_timestamp);
+    bool readThreadWait(jint thread_id, ThreadWait* copy);
+    void findCycle(jint thread_id);
+    void confirmCycles(jlong now);
+    void blame(LockSlot* lock, jint thread_id, u32 call_trace_id, u64 duration);
+    void summarize(jlong now);
+    bool sampleShortWait(jlong duration);
+    void enqueue(LockWaitEvent* event);
+    void formatStackTrace(u32 call_trace_id, char* buf, size_t size);
 
     friend class ClearMapTask;
 };
-
-class ClearMapTask: public Stoppable {
+class ClearMapTask: public ScheduledTask {
   public:
     ClearMapTask(LockRecorder* recorder) {
         this->recorder = recorder;
     }
     void run() {
-        // Check if thread is requested to stop
-        while (stopRequested() == false)
-        {
-            recorder->clearLockedThread();
-            std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-        }
+        u64 start = TSC::ticks();
+        recorder->flushEvents();
+        recorder->clearLockedThread();
+        OverheadGovernor::add(OVERHEAD_LOCK, start);
     }
   private:
     LockRecorder* recorder;
 };
 
-#endif // _LOCKRECORDER_H
\ No newline at end of file
+#endif // _LOCKRECORDER_H
@@ -18,11 +18,13 @@
 #include <cstdlib>
 #include <ctime>
 #include <sys/time.h>
+#include "latencyStats.h"
 #include "lockTracer.h"
 #include "profiler.h"
 #include "tsc.h"
 #include "vmStructs.h"
 #include "timeUtil.h"
+#include "virtualThreads.h"
 
 double LockTracer::_ticks_to_nanos;
 jlong LockTracer::_threshold;
@@ -30,6 +32,7 @@ jlong LockTracer::_start_time = 0;
 jclass LockTracer::_UnsafeClass = NULL;
 jclass LockTracer::_LockSupport = NULL;
 jmethodID LockTracer::_getBlocker = NULL;
+jfieldID LockTracer::_parkBlocker = NULL;
 RegisterNativesFunc LockTracer::_orig_RegisterNatives = NULL;
 UnsafeParkFunc LockTracer::_orig_Unsafe_park = NULL;
 bool LockTracer::_initialized = false;
@@ -42,6 +45,10 @@ Error LockTracer::start(Arguments& args) {
     if (!_initialized) {
         initialize();
     }
+    _lockRecorder->setup(args._lock > 0 ? args._lock : DEFAULT_LOCK_THRESHOLD, args._lock_sample,
+                         (jlong)args._lock_graph * 1000000000);
+    // kd-vtm names are sent again to the new stream
+    VirtualThreadNames::clear();
 
     // Enable Java Monitor events
     jvmtiEnv* jvmti = VM::jvmti();
@@ -110,28 +117,33 @@ void LockTracer::initialize() {
 
     _LockSupport = (jclass)env->NewGlobalRef(env->FindClass("java/util/concurrent/locks/LockSupport"));
     _getBlocker = env->GetStaticMethodID(_LockSupport, "getBlocker", "(Ljava/lang/Thread;)Ljava/lang/Object;");
+    // LockSupport.getBlocker() only reads this field
+    jclass thread_class = env->FindClass("java/lang/Thread");
+    if (thread_class == NULL || (_parkBlocker = env->GetFieldID(thread_class, "parkBlocker", "Ljava/lang/Object;")) == NULL) {
+        env->ExceptionClear();
+    }
 
     env->ExceptionClear();
     _initialized = true;
 }
 
 void JNICALL LockTracer::MonitorWait(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timeout) {
-    recordLockInfo(LOCK_MONITOR_WAIT, jvmti, env, thread, object, getCurrentTimestamp());
+    recordLockInfo(LOCK_MONITOR_WAIT, jvmti, env, thread, object, KdClock::now());
 }
 
 void JNICALL LockTracer::MonitorWaited(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jboolean timed_out) {
-    recordLockInfo(LOCK_MONITOR_WAITED, jvmti, env, thread, object, getCurrentTimestamp());
+    recordLockInfo(LOCK_MONITOR_WAITED, jvmti, env, thread, object, KdClock::now());
 }
 
 void JNICALL LockTracer::MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
     // jlong enter_time = TSC::ticks();
-    recordLockInfo(LOCK_MONITOR_ENTER, jvmti, env, thread, object, getCurrentTimestamp());
+    recordLockInfo(LOCK_MONITOR_ENTER, jvmti, env, thread, object, KdClock::now());
     // jvmti->SetTag(thread, enter_time);
 }
 
 void JNICALL LockTracer::MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
     // jlong entered_time = TSC::ticks();
-    recordLockInfo(LOCK_MONITOR_ENTERED, jvmti, env, thread, object, getCurrentTimestamp());
+    recordLockInfo(LOCK_MONITOR_ENTERED, jvmti, env, thread, object, KdClock::now());
     // jlong enter_time;
     // jvmti->GetTag(thread, &enter_time);
 
@@ -158,19 +170,19 @@ jint JNICALL LockTracer::RegisterNativesHook(JNIEnv* env, jclass cls, const JNIN
 
 void JNICALL LockTracer::UnsafeParkHook(JNIEnv* env, jobject instance, jboolean isAbsolute, jlong time) {
     jvmtiEnv* jvmti = VM::jvmti();
-    jobject park_blocker = _enabled ? getParkBlocker(jvmti, env) : NULL;
-    jlong park_start_time, park_end_time;
     jthread thread;
+    bool traced = _enabled && Profiler::instance()->threadFilter()->allows(ProfiledThread::currentTid());
+    jobject park_blocker = traced ? getParkBlocker(jvmti, env, &thread) : NULL;
+    jlong park_start_time, park_end_time;
     if (park_blocker != NULL) {
         park_start_time = TSC::ticks();
-        jvmti->GetCurrentThread(&thread);
-        recordLockInfo(LOCK_BEFORE_PARK, jvmti, env, thread, park_blocker, getCurrentTimestamp());
+        recordLockInfo(LOCK_BEFORE_PARK, jvmti, env, thread, park_blocker, KdClock::now());
     }
 
     _orig_Unsafe_park(env, instance, isAbsolute, time);
 
     if (park_blocker != NULL) {
-        recordLockInfo(LOCK_AFTER_PARK, jvmti, env, thread, park_blocker, getCurrentTimestamp());
+        recordLockInfo(LOCK_AFTER_PARK, jvmti, env, thread, park_blocker, KdClock::now());
         // park_end_time = TSC::ticks();
         // if (park_end_time - park_start_time >= _threshold) {
         //     char* lock_name = getLockName(jvmti, env, park_blocker);
@@ -182,103 +194,145 @@ void JNICALL LockTracer::UnsafeParkHook(JNIEnv* env, jobject instance, jboolean
     }
 }
 
-jobject LockTracer::getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env) {
-    jthread thread;
-    if (jvmti->GetCurrentThread(&thread) != 0) {
+jobject LockTracer::getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env, jthread* thread) {
+    if (jvmti->GetCurrentThread(thread) != 0) {
         return NULL;
     }
 
+    if (_parkBlocker != NULL) {
+        return env->GetObjectField(*thread, _parkBlocker);
+    }
     // Call LockSupport.getBlocker(Thread.currentThread())
-    return env->CallStaticObjectMethod(_LockSupport, _getBlocker, thread);
+    return env->CallStaticObjectMethod(_LockSupport, _getBlocker, *thread);
 }
 
-void LockTracer::recordLockInfo(LockEventType event_type, jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timestamp) {
-    // hasStack=false;
+// Lock events are always reported by the thread that waits, so its identity
+// is looked up once and kept with the thread, rather than on every park
+const char* LockTracer::describeThread(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, ProfiledThread* current) {
+    if (current->described()) {
+        return current->_name;
+    }
+
     jvmtiThreadInfo thread_info;
-    jlong java_thread_id = 0;
-    int native_thread_id = VMThread::nativeThreadId(env, thread);
-    if (native_thread_id >= 0 && jvmti->GetThreadInfo(thread, &thread_info) == 0) {
-        java_thread_id = VMThread::javaThreadId(env, thread);
+    thread_info.name = NULL;
+    if (jvmti->GetThreadInfo(thread, &thread_info) == 0) {
+        current->_java_thread_id = VMThread::javaThreadId(env, thread);
+    }
+    current->_name = _lockRecorder->intern(thread_info.name != NULL ? thread_info.name : "");
+    jvmti->Deallocate((unsigned char*)thread_info.name);
+    current->setDescribed();
+    return current->_name;
+}
+
+void LockTracer::recordLockInfo(LockEventType event_type, jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timestamp) {
+    if (!Profiler::instance()->threadFilter()->allows(ProfiledThread::currentTid())) {
+        return;
     }
-    
-    std::string event_name;
-    std::string lock_type;
-    std::string lock_name;
+    u64 start = LatencyStats::start();
+    updateLockInfo(event_type, jvmti, env, thread, object, timestamp);
+    LatencyStats::add(LATENCY_LOCK_INFO, start);
+}
+
+void LockTracer::updateLockInfo(LockEventType event_type, jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timestamp) {
+    ProfiledThread* current = ProfiledThread::currentOrCreate();
+    int native_thread_id = current->_tid;
+    uintptr_t lock_address = *(uintptr_t*)object;
+
+    const char* lock_type = NULL;
     switch (event_type) {
         case LOCK_MONITOR_WAIT:
-            event_name = "MonitorWait";
-            lock_type = "MonitorWait";
-            break;
         case LOCK_MONITOR_ENTER:
-            event_name = "MonitorEnter";
-            lock_type = "MonitorEnter";
-            break;
-        case LOCK_BEFORE_PARK: {
-            event_name = "UnsafeParkHookBefore";
-            lock_type = "UnsafePark";
-            char* class_name = NULL;
-            if (jvmti->GetClassSignature(env->GetObjectClass(object), &class_name, NULL) == 0) {
-                lock_name = class_name;
-            }
-            jvmti->Deallocate((unsigned char*)class_name);
-            break;
-        }
+        case LOCK_BEFORE_PARK:
+            // Only the time is taken here: whether the wait is worth reporting is known when it ends
+            _lockRecorder->updateWaitLockThread(lock_address, native_thread_id, timestamp, event_type != LOCK_MONITOR_WAIT);
+            return;
         case LOCK_MONITOR_WAITED:
-            event_name = "MonitorWaited";
+            lock_type = "MonitorWait";
             break;
         case LOCK_MONITOR_ENTERED:
-            event_name = "MonitorEntered";
+            lock_type = "MonitorEnter";
             break;
         case LOCK_AFTER_PARK:
-            event_name = "UnsafeParkHookAfter";
+            lock_type = "UnsafePark";
             break;
     }
 
-    switch (event_type) {
-        case LOCK_MONITOR_WAIT:
-        case LOCK_MONITOR_ENTER:
-        case LOCK_BEFORE_PARK: {
-            LockWaitEvent* event = new LockWaitEvent(native_thread_id, thread_info.name, java_thread_id, *(uintptr_t*)object, lock_type, lock_name, timestamp);
-            if (_lockRecorder->isRecordStack()) {
-                event->_stack_trace = getStackTrace(jvmti, thread, 10);
-            }
-            _lockRecorder->updateWaitLockThread(event);
-            break;
+    LockWaitEvent* event = _lockRecorder->updateWakeThread(lock_address, native_thread_id, timestamp);
+    if (event == NULL) {
+        return;
+    }
+
+    const char* lock_name = "";
+    if (event_type == LOCK_AFTER_PARK) {
+        char* class_name = NULL;
+        if (jvmti->GetClassSignature(env->GetObjectClass(object), &class_name, NULL) == 0) {
+            lock_name = _lockRecorder->intern(class_name);
         }
-        case LOCK_MONITOR_WAITED:
-        case LOCK_MONITOR_ENTERED:
-        case LOCK_AFTER_PARK:
-            _lockRecorder->updateWakeThread(*(uintptr_t*)object, native_thread_id, thread_info.name, timestamp);
-            break;
+        jvmti->Deallocate((unsigned char*)class_name);
     }
 
-    jvmti->Deallocate((unsigned char*)thread_info.name);
+    jlong vthread_id = VirtualThreadNames::current();
+    if (vthread_id != 0) {
+        // thread is the virtual thread here; the carrier keeps its own identity for its own events
+        VirtualThreadNames::touch(jvmti, thread, vthread_id);
+        event->describe("", (jint)vthread_id, lock_type, lock_name);
+        event->_vthread_id = vthread_id;
+    } else {
+        event->describe(describeThread(jvmti, env, thread, current), current->_java_thread_id, lock_type, lock_name);
+    }
+    if (_lockRecorder->isRecordStack()) {
+        // The thread is still inside the blocking call, so its stack is the one of the wait
+        event->_call_trace_id = getStackTrace(jvmti, thread, 10);
+    }
+    if (Profiler::instance()->jfrActive()) {
+        recordLockWait(jvmti, env, object, event);
+    }
+    _lockRecorder->record(event);
 }
 
-string LockTracer::getStackTrace(jvmtiEnv* jvmti, jthread thread, int depth) {
-    jvmtiFrameInfo frames[depth];
+// The same wait as a JFR event, with its stack in the stack trace pool of the recording
+void LockTracer::recordLockWait(jvmtiEnv* jvmti, JNIEnv* env, jobject object, LockWaitEvent* wait) {
+    LockWaitSample event;
+    event._class_id = 0;
+    event._address = wait->_lock_object_address;
+    event._owner_tid = wait->_wait_thread_id > 0 ? wait->_wait_thread_id : 0;
+    event._lock_type = wait->_lock_type;
+
+    // Only parks know the class of the lock so far
+    const char* lock_name = wait->_lock_name;
+    char* class_name = NULL;
+    if (lock_name[0] == 0 && jvmti->GetClassSignature(env->GetObjectClass(object), &class_name, NULL) == 0) {
+        lock_name = class_name;
+    }
+    size_t len = strlen(lock_name);
+    if (len > 2 && lock_name[0] == 'L') {
+        event._class_id = Profiler::instance()->classMap()->lookup(lock_name + 1, len - 2);
+    } else if (len > 0) {
+        event._class_id = Profiler::instance()->classMap()->lookup(lock_name);
+    }
+    jvmti->Deallocate((unsigned char*)class_name);
+
+    // The wait ends now; its timestamps are not TSC ticks unless KdClock counts in ticks
+    event._end_time = TSC::ticks();
+    event._start_time = event._end_time - (u64)(wait->_wait_duration / _ticks_to_nanos);
+
+    Profiler::instance()->recordSample(NULL, wait->_wait_duration, BCI_LOCK_WAIT, &event);
+}
+
+u32 LockTracer::getStackTrace(jvmtiEnv* jvmti, jthread thread, int depth) {
+    jvmtiFrameInfo jvmti_frames[depth];
+    ASGCT_CallFrame frames[depth];
     jint count;
-    jvmtiError err;
-    string ret_string = string();
-    err = jvmti->GetStackTrace(thread, 0, depth, frames, &count);
-    if (err == JVMTI_ERROR_NONE && count >= 1) {
-        for (int i=0; i < count; i++) {
-            char *method_name = NULL;
-            char *signature = NULL;
-            err = jvmti->GetMethodName(frames[i].method, &method_name, NULL, NULL);
-            if (err == JVMTI_ERROR_NONE) {
-                jclass declaring_class;
-                err = jvmti->GetMethodDeclaringClass(frames[i].method, &declaring_class);
-                if (err == JVMTI_ERROR_NONE) {
-                    jvmti->GetClassSignature(declaring_class, &signature, NULL);
-                }
-                ret_string.append(method_name).append(".").append(signature);
-            }
-            jvmti->Deallocate((unsigned char*)method_name);
-            jvmti->Deallocate((unsigned char*)signature);
-        }
+    if (jvmti->GetStackTrace(thread, 0, depth, jvmti_frames, &count) != JVMTI_ERROR_NONE || count < 1) {
+        return 0;
+    }
+
+    // Names are resolved later, and only for the events that are logged
+    for (int i = 0; i < count; i++) {
+        frames[i].method_id = jvmti_frames[i].method;
+        frames[i].bci = (jint)jvmti_frames[i].location;
     }
-    return ret_string;
+    return _lockRecorder->putStackTrace(count, frames);
 }
 
 bool LockTracer::isConcurrentLock(const char* lock_name) {
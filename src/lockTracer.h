@@ -21,6 +21,7 @@
 #include "arch.h"
 #include "engine.h"
 #include "lockRecorder.h"
+#include "profiledThread.h"
 
 enum LockEventType {
     LOCK_MONITOR_WAIT,
@@ -42,6 +43,7 @@ class LockTracer : public Engine {
     static jclass _UnsafeClass;
     static jclass _LockSupport;
     static jmethodID _getBlocker;
+    static jfieldID _parkBlocker;
     static bool _initialized;
 
     static LockRecorder* _lockRecorder;
@@ -54,10 +56,13 @@ class LockTracer : public Engine {
     static UnsafeParkFunc _orig_Unsafe_park;
     static void JNICALL UnsafeParkHook(JNIEnv* env, jobject instance, jboolean isAbsolute, jlong time);
 
-    static jobject getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env);
+    static jobject getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env, jthread* thread);
+    static const char* describeThread(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, ProfiledThread* current);
     static void recordLockInfo(LockEventType event_type, jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timestamp);
-    static string getStackTrace(jvmtiEnv* jvmti, jthread thread, int depth);
+    static void updateLockInfo(LockEventType event_type, jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timestamp);
+    static u32 getStackTrace(jvmtiEnv* jvmti, jthread thread, int depth);
     static bool isConcurrentLock(const char* lock_name);
+    static void recordLockWait(jvmtiEnv* jvmti, JNIEnv* env, jobject object, LockWaitEvent* wait);
     static void recordContendedLock(int event_type, u64 start_time, u64 end_time,
                                     const char* lock_name, jobject lock, jlong timeout);
     static void bindUnsafePark(UnsafeParkFunc entry);
@@ -73,6 +78,19 @@ class LockTracer : public Engine {
     Error start(Arguments& args);
     void stop();
 
+    // The lock the thread waited for between from and to (KdClock::now() units), 0 if none
+    static uintptr_t blockedOn(int thread_id, jlong from, jlong to) {
+        return _lockRecorder != NULL ? _lockRecorder->blockedOn(thread_id, from, to) : 0;
+    }
+
+    static void threadStart(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+        if (_initialized) describeThread(jvmti, env, thread, ProfiledThread::currentOrCreate());
+    }
+
+    static void setSampleInterval(jlong sample_interval) {
+        if (_lockRecorder != NULL) _lockRecorder->setSampleInterval(sample_interval);
+    }
+
     static void JNICALL MonitorWait(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timeout);
     static void JNICALL MonitorWaited(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jboolean timed_out);
     static void JNICALL MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object);
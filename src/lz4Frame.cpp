@@ -0,0 +1,160 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lz4Frame.h"
+
+
+const int LZ4_HASH_LOG = 12;
+const u32 LZ4_MIN_MATCH = 4;
+const u32 LZ4_LAST_LITERALS = 5;   // the block must end with literals
+const u32 LZ4_MATCH_LIMIT = 12;    // no match may start in the last 12 bytes
+const u32 LZ4_MAX_OFFSET = 65535;
+
+static inline u32 read32(const char* p) {
+    u32 v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void write32(char* p, u32 v) {
+    p[0] = (char)v;
+    p[1] = (char)(v >> 8);
+    p[2] = (char)(v >> 16);
+    p[3] = (char)(v >> 24);
+}
+
+static inline u32 hash4(u32 v) {
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// Writes the 255-based continuation of a length that did not fit in its token nibble
+static inline char* putLength(char* op, u32 len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = (char)255;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+static char* putSequence(char* op, const char* literals, u32 literal_len, u32 offset, u32 match_len) {
+    char* token = op++;
+    u32 ml = match_len - LZ4_MIN_MATCH;
+    *token = (char)(((literal_len < 15 ? literal_len : 15) << 4) | (ml < 15 ? ml : 15));
+
+    if (literal_len >= 15) op = putLength(op, literal_len - 15);
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len > 0) {
+        op[0] = (char)offset;
+        op[1] = (char)(offset >> 8);
+        op += 2;
+        if (ml >= 15) op = putLength(op, ml - 15);
+    } else {
+        // The last sequence carries literals only
+        *token &= (char)0xf0;
+    }
+    return op;
+}
+
+static inline u32 sequenceBound(u32 literal_len, u32 match_len) {
+    return 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1;
+}
+
+u32 Lz4::compress(const char* src, u32 len, char* dst, u32 capacity) {
+    // Positions are stored + 1, so that 0 means an empty entry
+    u32 table[1 << LZ4_HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    char* op = dst;
+    char* op_end = dst + capacity;
+    u32 anchor = 0;
+    u32 ip = 0;
+
+    if (len > LZ4_MATCH_LIMIT) {
+        u32 limit = len - LZ4_MATCH_LIMIT;
+        while (ip < limit) {
+            u32 seq = read32(src + ip);
+            u32 h = hash4(seq);
+            u32 ref = table[h];
+            table[h] = ip + 1;
+
+            if (ref == 0 || ip - (ref - 1) > LZ4_MAX_OFFSET || read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+
+            ref--;
+            u32 match_len = LZ4_MIN_MATCH;
+            u32 max_len = len - LZ4_LAST_LITERALS - ip;
+            while (match_len < max_len && src[ref + match_len] == src[ip + match_len]) {
+                match_len++;
+            }
+
+            u32 literal_len = ip - anchor;
+            if ((u32)(op_end - op) < sequenceBound(literal_len, match_len)) {
+                return 0;
+            }
+            op = putSequence(op, src + anchor, literal_len, ip - ref, match_len);
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    u32 literal_len = len - anchor;
+    if ((u32)(op_end - op) < sequenceBound(literal_len, 0)) {
+        return 0;
+    }
+    op = putSequence(op, src + anchor, literal_len, 0, 0);
+    return (u32)(op - dst);
+}
+
+
+FrameEncoder::FrameEncoder(u32 max_batch) : _seq(0) {
+    _capacity = KD_FRAME_HEADER + Lz4::maxCompressedSize(max_batch);
+    _buf = (char*)malloc(_capacity);
+}
+
+FrameEncoder::~FrameEncoder() {
+    free(_buf);
+}
+
+const char* FrameEncoder::encode(const char* data, u32 len, u32& frame_len) {
+    char* payload = _buf + KD_FRAME_HEADER;
+    u32 payload_len = Lz4::compress(data, len, payload, _capacity - KD_FRAME_HEADER);
+    u32 length = payload_len;
+    if (payload_len == 0 || payload_len >= len) {
+        // Incompressible batch
+        memcpy(payload, data, len);
+        payload_len = len;
+        length = len | KD_FRAME_STORED;
+    }
+
+    u32 checksum = 2166136261U;
+    for (u32 i = 0; i < payload_len; i++) {
+        checksum = (checksum ^ (u8)payload[i]) * 16777619;
+    }
+
+    write32(_buf, KD_FRAME_MAGIC);
+    write32(_buf + 4, _seq++);
+    write32(_buf + 8, len);
+    write32(_buf + 12, length);
+    write32(_buf + 16, checksum);
+    frame_len = KD_FRAME_HEADER + payload_len;
+    return _buf;
+}
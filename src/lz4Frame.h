@@ -0,0 +1,58 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LZ4FRAME_H
+#define _LZ4FRAME_H
+
+#include <stddef.h>
+#include "arch.h"
+
+
+// Compressed output (kdcompress): every flushed batch becomes one self-contained frame
+//     frame := "KDZ1" seq:u32 raw_length:u32 length:u32 checksum:u32 payload[length & ~STORED]
+// Integers are little-endian. The payload is an LZ4 block, or the raw batch if
+// KD_FRAME_STORED is set in length. checksum is FNV-1a of the payload.
+// A reader that lost data scans for the magic and accepts the next frame whose
+// checksum matches; a gap in seq tells how many batches are missing.
+const u32 KD_FRAME_MAGIC = 0x315a444b;  // "KDZ1"
+const u32 KD_FRAME_HEADER = 20;
+const u32 KD_FRAME_STORED = 0x80000000;
+
+class Lz4 {
+  public:
+    static u32 maxCompressedSize(u32 len) {
+        return len + len / 255 + 16;
+    }
+
+    // Greedy LZ4 block compressor; returns 0 if the result does not fit in dst
+    static u32 compress(const char* src, u32 len, char* dst, u32 capacity);
+};
+
+class FrameEncoder {
+  private:
+    char* _buf;
+    u32 _capacity;
+    u32 _seq;
+
+  public:
+    FrameEncoder(u32 max_batch);
+    ~FrameEncoder();
+
+    // The frame stays valid until the next call
+    const char* encode(const char* data, u32 len, u32& frame_len);
+};
+
+#endif // _LZ4FRAME_H
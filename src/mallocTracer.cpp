@@ -0,0 +1,215 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "mallocTracer.h"
+#include "profiler.h"
+
+
+u64 MallocTracer::_interval;
+MallocCounter MallocTracer::_counters[MALLOC_COUNTER_STRIPES];
+LiveAllocation* MallocTracer::_live = NULL;
+volatile int MallocTracer::_live_count = 0;
+volatile u64 MallocTracer::_untracked = 0;
+CodeCache* MallocTracer::_self = NULL;
+volatile bool MallocTracer::_running = false;
+
+
+// The profiler's own calls are not patched, so the hooks reach the real functions
+static void* malloc_hook(size_t size) {
+    void* result = malloc(size);
+    if (result != NULL && size > 0) {
+        MallocTracer::sampled(result, size);
+    }
+    return result;
+}
+
+static void* calloc_hook(size_t num, size_t size) {
+    void* result = calloc(num, size);
+    if (result != NULL && num * size > 0) {
+        MallocTracer::sampled(result, num * size);
+    }
+    return result;
+}
+
+static void* realloc_hook(void* address, size_t size) {
+    // Before the block can be handed out again, as with free
+    u64 old_size;
+    u32 old_trace;
+    bool tracked = MallocTracer::freed(address, &old_size, &old_trace);
+
+    void* result = realloc(address, size);
+    if (result == NULL) {
+        if (tracked && size > 0) {
+            // Failed: the old block is still allocated
+            MallocTracer::retrack(address, old_size, old_trace);
+        }
+        return NULL;
+    }
+    if (size > 0) {
+        MallocTracer::sampled(result, size);
+    }
+    return result;
+}
+
+static void free_hook(void* address) {
+    // Before the block can be handed out again
+    MallocTracer::freed(address);
+    free(address);
+}
+
+static inline u32 liveSlot(uintptr_t address) {
+    return (u32)(((u64)address >> 4) * 0x9e3779b97f4a7c15ULL >> 32) & (MALLOC_LIVE_CAPACITY - 1);
+}
+
+void MallocTracer::recordMalloc(void* address, size_t size) {
+    MallocEvent event;
+    event._address = (uintptr_t)address;
+    event._size = size;
+    u32 call_trace_id = Profiler::instance()->recordSample(NULL, size, BCI_NATIVE_ALLOC, &event);
+    if (call_trace_id != 0) {
+        trackLive((uintptr_t)address, size, call_trace_id);
+    }
+}
+
+void MallocTracer::trackLive(uintptr_t address, u64 size, u32 call_trace_id) {
+    const u32 mask = MALLOC_LIVE_CAPACITY - 1;
+    u32 i = liveSlot(address);
+    for (int probe = 0; probe < MALLOC_LIVE_PROBES; probe++, i = (i + 1) & mask) {
+        LiveAllocation* slot = &_live[i];
+        uintptr_t current = slot->address;
+        if ((current == 0 || current == MALLOC_REMOVED) &&
+            __sync_bool_compare_and_swap(&slot->address, current, MALLOC_BUSY)) {
+            slot->size = size;
+            slot->call_trace_id = call_trace_id;
+            __atomic_store_n(&slot->address, address, __ATOMIC_RELEASE);
+            __sync_fetch_and_add(&_live_count, 1);
+            return;
+        }
+    }
+    // Too crowded around this address; the block is not reported as a leak
+    atomicInc(_untracked);
+}
+
+bool MallocTracer::untrackLive(uintptr_t address, u64* size, u32* call_trace_id) {
+    const u32 mask = MALLOC_LIVE_CAPACITY - 1;
+    u32 i = liveSlot(address);
+    for (int probe = 0; probe < MALLOC_LIVE_PROBES; probe++, i = (i + 1) & mask) {
+        LiveAllocation* slot = &_live[i];
+        uintptr_t current = __atomic_load_n(&slot->address, __ATOMIC_ACQUIRE);
+        if (current == address) {
+            // Read before the slot is given up, when nobody else may fill it in
+            *size = slot->size;
+            *call_trace_id = slot->call_trace_id;
+            if (__sync_bool_compare_and_swap(&slot->address, address, MALLOC_REMOVED)) {
+                __sync_fetch_and_sub(&_live_count, 1);
+                return true;
+            }
+            return false;
+        } else if (current == 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
+void MallocTracer::collectLive(std::map<u32, LiveTotal>& totals) {
+    if (_live == NULL) {
+        return;
+    }
+    for (u32 i = 0; i < MALLOC_LIVE_CAPACITY; i++) {
+        LiveAllocation* slot = &_live[i];
+        if (__atomic_load_n(&slot->address, __ATOMIC_ACQUIRE) > MALLOC_BUSY) {
+            LiveTotal& total = totals[slot->call_trace_id];
+            total.samples++;
+            total.bytes += slot->size;
+        }
+    }
+}
+
+// Every GOT entry of the function is replaced: a library may refer to it both
+// through the PLT and by address
+void MallocTracer::patchLibraries(bool enable) {
+    void* const originals[] = {(void*)malloc, (void*)calloc, (void*)realloc, (void*)free};
+    void* const hooks[] = {(void*)malloc_hook, (void*)calloc_hook, (void*)realloc_hook, (void*)free_hook};
+
+    CodeCacheArray* libs = Profiler::instance()->nativeLibs();
+    int count = libs->count();
+    for (int i = 0; i < count; i++) {
+        CodeCache* lib = (*libs)[i];
+        if (lib == _self) {
+            continue;
+        }
+        for (int j = 0; j < 4; j++) {
+            void* from = enable ? originals[j] : hooks[j];
+            void* to = enable ? hooks[j] : originals[j];
+            void** entry;
+            while ((entry = lib->findGlobalOffsetEntry(from)) != NULL) {
+                __atomic_store_n(entry, to, __ATOMIC_RELEASE);
+            }
+        }
+    }
+}
+
+void MallocTracer::installHooks() {
+    if (_running) {
+        patchLibraries(true);
+    }
+}
+
+Error MallocTracer::check(Arguments& args) {
+    if (Profiler::instance()->findLibraryByAddress((const void*)malloc_hook) == NULL) {
+        return Error("Could not find the profiler library");
+    }
+    return Error::OK;
+}
+
+Error MallocTracer::start(Arguments& args) {
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    if (_live == NULL) {
+        _live = (LiveAllocation*)calloc(MALLOC_LIVE_CAPACITY, sizeof(LiveAllocation));
+        if (_live == NULL) {
+            return Error("Could not allocate the live allocation table");
+        }
+        MemoryBudget::charge(MEMORY_NATIVE_ALLOCS, MALLOC_LIVE_CAPACITY * sizeof(LiveAllocation));
+    } else {
+        memset(_live, 0, MALLOC_LIVE_CAPACITY * sizeof(LiveAllocation));
+    }
+    _live_count = 0;
+    _untracked = 0;
+
+    _interval = args._nativemem > 0 ? args._nativemem : DEFAULT_NATIVEMEM_INTERVAL;
+    memset(_counters, 0, sizeof(_counters));
+    _self = Profiler::instance()->findLibraryByAddress((const void*)malloc_hook);
+
+    _running = true;
+    patchLibraries(true);
+    return Error::OK;
+}
+
+void MallocTracer::stop() {
+    _running = false;
+    patchLibraries(false);
+    if (_untracked > 0) {
+        Log::debug("%llu sampled native allocations were not tracked for leaks", _untracked);
+    }
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _MALLOCTRACER_H
+#define _MALLOCTRACER_H
+
+#include <map>
+#include <stddef.h>
+#include "arch.h"
+#include "callTraceStorage.h"
+#include "codeCache.h"
+#include "engine.h"
+#include "event.h"
+
+
+const long DEFAULT_NATIVEMEM_INTERVAL = 512 * 1024;
+const int MALLOC_COUNTER_STRIPES = 64;
+const u32 MALLOC_LIVE_CAPACITY = 65536;  // must be a power of 2
+const int MALLOC_LIVE_PROBES = 16;
+const uintptr_t MALLOC_REMOVED = 1;
+const uintptr_t MALLOC_BUSY = 2;
+
+// Bytes allocated since the last sample by the threads whose stacks fall into the stripe,
+// so that malloc() on different threads does not update one shared cache line
+struct MallocCounter {
+    volatile u64 bytes;
+    char _pad[64 - sizeof(u64)];
+};
+
+// A sampled allocation that has not been freed yet. The address is 0 for a free slot,
+// MALLOC_REMOVED for a freed one, which keeps probe chains intact, and MALLOC_BUSY
+// while the slot is being filled in.
+struct LiveAllocation {
+    volatile uintptr_t address;
+    u64 size;
+    u32 call_trace_id;
+};
+
+class MallocEvent : public Event {
+  public:
+    uintptr_t _address;
+    u64 _size;
+};
+
+// Samples native allocations (nativemem) by patching malloc, calloc, realloc and free
+// in the GOT of every loaded library but the profiler itself, once every
+// _interval allocated bytes. Sampled blocks are kept in a lock-free table until
+// they are freed, so that what is still allocated can be reported (leaks).
+// Only GOT entries already bound are found, as with the other GOT hooks.
+class MallocTracer : public Engine {
+  private:
+    static u64 _interval;
+    static MallocCounter _counters[MALLOC_COUNTER_STRIPES];
+    static LiveAllocation* _live;
+    static volatile int _live_count;
+    static volatile u64 _untracked;
+    static CodeCache* _self;
+    static volatile bool _running;
+
+    static void recordMalloc(void* address, size_t size);
+    static void trackLive(uintptr_t address, u64 size, u32 call_trace_id);
+    // False if the block was not tracked; otherwise its size and stack, to track it again
+    static bool untrackLive(uintptr_t address, u64* size, u32* call_trace_id);
+    static void patchLibraries(bool enable);
+
+  public:
+    const char* title() {
+        return "Native allocation profile";
+    }
+
+    const char* units() {
+        return "bytes";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    // Hooks libraries loaded since start
+    static void installHooks();
+    // Frames of the profiler on top of a sampled native stack
+    static bool inProfiler(const void* pc) {
+        return _self != NULL && _self->contains(pc);
+    }
+    static void collectLive(std::map<u32, LiveTotal>& totals);
+
+    static void sampled(void* address, size_t size) {
+        // Thread stacks are megabytes apart, so the stack address tells threads apart
+        int local;
+        MallocCounter* counter = &_counters[((uintptr_t)&local >> 20) % MALLOC_COUNTER_STRIPES];
+        if (_enabled && updateCounter(counter->bytes, size, _interval)) {
+            recordMalloc(address, size);
+        }
+    }
+
+    static void freed(void* address) {
+        u64 size;
+        u32 call_trace_id;
+        if (_live_count > 0 && address != NULL) {
+            untrackLive((uintptr_t)address, &size, &call_trace_id);
+        }
+    }
+
+    // For realloc, which has to untrack the block before it can be handed out again,
+    // and track it again if it stays where it was because the call failed
+    static bool freed(void* address, u64* size, u32* call_trace_id) {
+        return _live_count > 0 && address != NULL && untrackLive((uintptr_t)address, size, call_trace_id);
+    }
+
+    static void retrack(void* address, u64 size, u32 call_trace_id) {
+        trackLive((uintptr_t)address, size, call_trace_id);
+    }
+};
+
+#endif // _MALLOCTRACER_H
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include "memoryBudget.h"
+
+
+volatile u64 MemoryBudget::_used[MEMORY_AREAS];
+volatile u64 MemoryBudget::_total = 0;
+volatile u64 MemoryBudget::_refused = 0;
+u64 MemoryBudget::_limit = 0;
+
+bool MemoryBudget::reserve(MemoryArea area, u64 size) {
+    u64 total;
+    do {
+        total = _total;
+        if (_limit != 0 && total + size > _limit) {
+            atomicInc(_refused);
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&_total, total, total + size));
+
+    atomicInc(_used[area], size);
+    return true;
+}
+
+void MemoryBudget::status(std::ostream& out) {
+    char buf[448];
+    snprintf(buf, sizeof(buf), "Profiler memory: %llu KB, call traces %llu KB, dictionaries %llu KB, "
+             "frame events %llu KB, method names %llu KB, lock events %llu KB, native allocations %llu KB, "
+             "I/O histograms %llu KB, live objects %llu KB, JFR methods %llu KB, dumps %llu KB\n",
+             _total / 1024, _used[MEMORY_CALL_TRACES] / 1024, _used[MEMORY_DICTIONARY] / 1024,
+             _used[MEMORY_FRAME_EVENTS] / 1024, _used[MEMORY_METHOD_NAMES] / 1024,
+             _used[MEMORY_LOCK_EVENTS] / 1024, _used[MEMORY_NATIVE_ALLOCS] / 1024,
+             _used[MEMORY_IO_STATS] / 1024, _used[MEMORY_LIVE_OBJECTS] / 1024,
+             _used[MEMORY_JFR_METHODS] / 1024, _used[MEMORY_DUMP] / 1024);
+    out << buf;
+
+    if (_limit != 0) {
+        snprintf(buf, sizeof(buf), "Memory limit: %llu KB, refused allocations: %llu\n", _limit / 1024, _refused);
+        out << buf;
+    }
+}
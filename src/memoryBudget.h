@@ -0,0 +1,80 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MEMORYBUDGET_H
+#define _MEMORYBUDGET_H
+
+#include <ostream>
+#include "arch.h"
+
+
+// Rough cost of a std::map node besides the value itself
+const u64 MAP_NODE_OVERHEAD = 32;
+
+// Subsystems that own profiler memory
+enum MemoryArea {
+    MEMORY_CALL_TRACES,    // CallTraceStorage hash tables and LinearAllocator chunks
+    MEMORY_DICTIONARY,     // Dictionary tables and keys
+    MEMORY_FRAME_EVENTS,   // FrameEventCache rings
+    MEMORY_METHOD_NAMES,   // FrameName and MethodCache entries
+    MEMORY_LOCK_EVENTS,    // LockRecorder event pools
+    MEMORY_NATIVE_ALLOCS,  // MallocTracer live allocation table
+    MEMORY_IO_STATS,       // IoTracer histograms
+    MEMORY_LIVE_OBJECTS,   // ObjectSampler weak references (live)
+    MEMORY_JFR_METHODS,    // MethodMap of the current recording
+    MEMORY_DUMP,           // FlameGraph nodes while a dump is built
+    MEMORY_AREAS
+};
+
+// memlimit=SIZE: process-wide accounting of the memory held by the profiler.
+// Growth that can be refused goes through reserve(), which fails once the
+// limit is reached: new stacks then count as storage_overflow, lock events
+// are dropped and method names are resolved without caching.
+// Memory the profiler cannot work without, such as preallocated rings or
+// names that ids already refer to, is charge()d and only counted.
+// Safe to use in signal handlers.
+class MemoryBudget {
+  private:
+    static volatile u64 _used[MEMORY_AREAS];
+    static volatile u64 _total;
+    static volatile u64 _refused;
+    static u64 _limit;
+
+  public:
+    static void setLimit(u64 limit) {
+        _limit = limit;
+    }
+
+    static u64 used(MemoryArea area) {
+        return _used[area];
+    }
+
+    static bool reserve(MemoryArea area, u64 size);
+
+    static void charge(MemoryArea area, u64 size) {
+        atomicInc(_total, size);
+        atomicInc(_used[area], size);
+    }
+
+    static void release(MemoryArea area, u64 size) {
+        atomicInc(_total, -size);
+        atomicInc(_used[area], -size);
+    }
+
+    static void status(std::ostream& out);
+};
+
+#endif // _MEMORYBUDGET_H
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memoryBudget.h"
+#include "methodCache.h"
+
+
+static void freeName(char* name) {
+    if (name != NULL) {
+        MemoryBudget::release(MEMORY_METHOD_NAMES, strlen(name) + 1);
+        free(name);
+    }
+}
+
+MethodCache::MethodCache(u32 capacity) : _capacity(capacity), _size(0), _epoch(0) {
+    _table = (MethodCacheEntry*)calloc(capacity, sizeof(MethodCacheEntry));
+    MemoryBudget::charge(MEMORY_METHOD_NAMES, capacity * sizeof(MethodCacheEntry));
+}
+
+MethodCache::~MethodCache() {
+    clear();
+    free(_table);
+    MemoryBudget::release(MEMORY_METHOD_NAMES, _capacity * sizeof(MethodCacheEntry));
+}
+
+// The table is bounded by itself, so names are counted but never refused
+char* MethodCache::copyName(const char* name) {
+    size_t size = strlen(name) + 1;
+    char* copy = (char*)malloc(size);
+    if (copy != NULL) {
+        memcpy(copy, name, size);
+        MemoryBudget::charge(MEMORY_METHOD_NAMES, size);
+    }
+    return copy;
+}
+
+void MethodCache::clear() {
+    for (u32 i = 0; i < _capacity; i++) {
+        freeName(_table[i].name);
+    }
+    memset(_table, 0, _capacity * sizeof(MethodCacheEntry));
+    _size = 0;
+}
+
+u32 MethodCache::hash(jmethodID method, u32 type) {
+    u64 h = ((u64)(uintptr_t)method ^ type) * 0x9e3779b97f4a7c15ULL;
+    return (u32)(h >> 32);
+}
+
+MethodCacheEntry* MethodCache::lookup(jmethodID method, u32 type, bool& added) {
+    u32 mask = _capacity - 1;
+    for (u32 i = hash(method, type) & mask; ; i = (i + 1) & mask) {
+        MethodCacheEntry* entry = &_table[i];
+        if (entry->method == method && entry->type == type) {
+            entry->epoch = _epoch;
+            added = false;
+            return entry;
+        }
+        if (entry->method == NULL) {
+            // Keep at least one free slot to terminate probing
+            if (_size >= mask) {
+                return NULL;
+            }
+            entry->method = method;
+            entry->type = type;
+            entry->epoch = _epoch;
+            _size++;
+            added = true;
+            return entry;
+        }
+    }
+}
+
+void MethodCache::insert(MethodCacheEntry* table, const MethodCacheEntry& entry) {
+    u32 mask = _capacity - 1;
+    u32 i = hash(entry.method, entry.type) & mask;
+    while (table[i].method != NULL) {
+        i = (i + 1) & mask;
+    }
+    table[i] = entry;
+}
+
+// Rehashes the surviving entries into a fresh table; cheaper than tombstones
+// since eviction happens rarely and off the sampling path
+void MethodCache::evict(u32 min_epoch) {
+    MethodCacheEntry* table = (MethodCacheEntry*)calloc(_capacity, sizeof(MethodCacheEntry));
+    if (table == NULL) {
+        return;
+    }
+
+    _size = 0;
+    for (u32 i = 0; i < _capacity; i++) {
+        MethodCacheEntry& entry = _table[i];
+        if (entry.method == NULL) {
+            continue;
+        }
+        if (entry.epoch >= min_epoch) {
+            insert(table, entry);
+            _size++;
+        } else {
+            freeName(entry.name);
+        }
+    }
+
+    free(_table);
+    _table = table;
+}
+
+void MethodCache::nextEpoch() {
+    if (_size > _capacity / 4 * 3) {
+        // Keep the most recently used entries that fit in half of the table
+        u32 count[METHOD_CACHE_MAX_AGE + 1] = {0};
+        for (u32 i = 0; i < _capacity; i++) {
+            if (_table[i].method != NULL) {
+                u32 age = _epoch - _table[i].epoch;
+                count[age < METHOD_CACHE_MAX_AGE ? age : METHOD_CACHE_MAX_AGE]++;
+            }
+        }
+
+        u32 age = 0;
+        u32 keep = count[0];
+        while (age < METHOD_CACHE_MAX_AGE && keep + count[age + 1] <= _capacity / 2) {
+            keep += count[++age];
+        }
+        if (keep < _size) {
+            evict(_epoch - age);
+        }
+    }
+
+    _epoch++;
+}
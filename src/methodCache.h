@@ -0,0 +1,67 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METHODCACHE_H
+#define _METHODCACHE_H
+
+#include <jvmti.h>
+#include "arch.h"
+
+
+const u32 METHOD_CACHE_CAPACITY = 32768;
+const u32 METHOD_CACHE_MAX_AGE = 64;
+
+
+struct MethodCacheEntry {
+    jmethodID method;
+    u32 type;
+    u32 id;
+    u32 epoch;
+    char* name;
+};
+
+// Flat open-addressing table of Java methods seen by the Kindling collector.
+// Memory is bounded: when the table gets crowded, entries not used
+// for the most epochs (collect intervals) are evicted.
+// Not thread safe: the table belongs to the collector thread.
+class MethodCache {
+  private:
+    MethodCacheEntry* _table;
+    u32 _capacity;
+    u32 _size;
+    u32 _epoch;
+
+    static u32 hash(jmethodID method, u32 type);
+
+    void insert(MethodCacheEntry* table, const MethodCacheEntry& entry);
+    void evict(u32 min_epoch);
+
+  public:
+    MethodCache(u32 capacity);
+    ~MethodCache();
+
+    void clear();
+
+    // Copy of a name to be kept in an entry; the cache frees it on eviction
+    static char* copyName(const char* name);
+
+    // Returns NULL if the table is full of entries used in the current epoch
+    MethodCacheEntry* lookup(jmethodID method, u32 type, bool& added);
+
+    void nextEpoch();
+};
+
+#endif // _METHODCACHE_H
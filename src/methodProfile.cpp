@@ -0,0 +1,172 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+#include <algorithm>
+#include "methodProfile.h"
+#include "memoryBudget.h"
+#include "os.h"
+
+
+// Method ids and name pointers fit in 48 bits; the biased frame kind
+// in the upper bits keeps the key unique and never 0, which marks an empty slot
+static inline u64 methodKey(ASGCT_CallFrame& frame) {
+    return (u64)(uintptr_t)frame.method_id ^ ((u64)(FrameType::nameKind(frame.bci) + 32) << 48);
+}
+
+static inline u32 methodSlot(u64 key) {
+    return (u32)(((key ^ (key >> 31)) * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static MethodProfileEntry EMPTY_METHOD_ENTRY = {0};
+
+// Returns false if the key has been seen in this stack already
+static inline bool firstInStack(u64* seen, u64 key) {
+    u32 slot = methodSlot(key) & (METHOD_PROFILE_SEEN - 1);
+    for (u32 i = 0; i < METHOD_PROFILE_SEEN; i++) {
+        if (seen[slot] == key) {
+            return false;
+        } else if (seen[slot] == 0) {
+            seen[slot] = key;
+            return true;
+        }
+        slot = (slot + 1) & (METHOD_PROFILE_SEEN - 1);
+    }
+    return true;
+}
+
+struct BySelfCounter {
+    bool operator()(const MethodProfileEntry* a, const MethodProfileEntry* b) const {
+        return a->self_counter > b->self_counter;
+    }
+};
+
+struct ByTotalCounter {
+    bool operator()(const MethodProfileEntry* a, const MethodProfileEntry* b) const {
+        return a->total_counter > b->total_counter;
+    }
+};
+
+// Keeps the max_count largest entries in a min-heap: O(N log K) for K = max_count
+template<class Greater>
+static void selectTop(MethodProfileEntry* table, size_t max_count, std::vector<MethodProfileEntry*>& entries) {
+    Greater greater;
+    for (u32 i = 0; i < METHOD_PROFILE_CAPACITY; i++) {
+        MethodProfileEntry* e = &table[i];
+        if (__atomic_load_n(&e->method, __ATOMIC_ACQUIRE) == NULL || !greater(e, &EMPTY_METHOD_ENTRY)) {
+            continue;
+        }
+
+        if (entries.size() < max_count) {
+            entries.push_back(e);
+            std::push_heap(entries.begin(), entries.end(), greater);
+        } else if (greater(e, entries[0])) {
+            std::pop_heap(entries.begin(), entries.end(), greater);
+            entries.back() = e;
+            std::push_heap(entries.begin(), entries.end(), greater);
+        }
+    }
+    std::sort_heap(entries.begin(), entries.end(), greater);
+}
+
+
+void MethodProfile::start(bool enabled, bool reset) {
+    if (enabled && _table == NULL) {
+        size_t size = METHOD_PROFILE_CAPACITY * sizeof(MethodProfileEntry);
+        _table = (MethodProfileEntry*)OS::safeAlloc(size);
+        if (_table == NULL) {
+            return;
+        }
+        MemoryBudget::charge(MEMORY_METHOD_NAMES, size);
+    } else if (reset && _table != NULL) {
+        memset(_table, 0, METHOD_PROFILE_CAPACITY * sizeof(MethodProfileEntry));
+    }
+
+    if (reset) {
+        _samples = 0;
+        _counter = 0;
+        _overflow = 0;
+    }
+    _active = enabled && _table != NULL;
+}
+
+MethodProfileEntry* MethodProfile::lookup(u64 key, ASGCT_CallFrame& frame) {
+    u32 slot = methodSlot(key) & (METHOD_PROFILE_CAPACITY - 1);
+    for (u32 i = 0; i < METHOD_PROFILE_CAPACITY; i++) {
+        MethodProfileEntry* e = &_table[slot];
+        u64 k = e->key;
+        if (k == key) {
+            return e;
+        } else if (k == 0) {
+            if (__sync_bool_compare_and_swap(&e->key, 0, key)) {
+                e->bci = frame.bci;
+                // Publish the method last: top() skips entries that are still being filled
+                __atomic_store_n(&e->method, frame.method_id, __ATOMIC_RELEASE);
+                return e;
+            }
+            if (e->key == key) {
+                return e;
+            }
+        }
+        slot = (slot + 1) & (METHOD_PROFILE_CAPACITY - 1);
+    }
+    return NULL;
+}
+
+void MethodProfile::record(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+    if (!_active || num_frames <= 0) {
+        return;
+    }
+
+    atomicInc(_samples);
+    atomicInc(_counter, counter);
+
+    u64 seen[METHOD_PROFILE_SEEN];
+    memset(seen, 0, sizeof(seen));
+
+    for (int i = 0; i < num_frames; i++) {
+        u64 key = methodKey(frames[i]);
+        if (!firstInStack(seen, key)) {
+            continue;
+        }
+
+        MethodProfileEntry* e = lookup(key, frames[i]);
+        if (e == NULL) {
+            atomicInc(_overflow);
+            continue;
+        }
+
+        if (i == 0) {
+            atomicInc(e->self_samples);
+            atomicInc(e->self_counter, counter);
+        }
+        atomicInc(e->total_samples);
+        atomicInc(e->total_counter, counter);
+    }
+}
+
+void MethodProfile::top(int max_count, bool by_total, std::vector<MethodProfileEntry*>& entries) {
+    if (_table == NULL || max_count <= 0) {
+        return;
+    }
+
+    if (by_total) {
+        selectTop<ByTotalCounter>(_table, max_count, entries);
+    } else {
+        selectTop<BySelfCounter>(_table, max_count, entries);
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _METHODPROFILE_H
+#define _METHODPROFILE_H
+
+#include <vector>
+#include "arch.h"
+#include "vmEntry.h"
+
+
+const u32 METHOD_PROFILE_CAPACITY = 65536;
+// Distinct methods of one stack remembered for the total time; deeper recursion may count twice
+const u32 METHOD_PROFILE_SEEN = 256;
+
+struct MethodProfileEntry {
+    volatile u64 key;
+    jmethodID method;
+    jint bci;
+    volatile u64 self_samples;
+    volatile u64 self_counter;
+    volatile u64 total_samples;
+    volatile u64 total_counter;
+};
+
+// hotmethods: self/total time per method, maintained as samples are stored,
+// so that the top methods can be listed without walking the call trace storage.
+// Keyed by (method, frame kind) in a fixed open-addressing table;
+// methods that do not fit are counted as overflow. Safe to use in signal handlers.
+class MethodProfile {
+  private:
+    MethodProfileEntry* _table;
+    volatile bool _active;
+    volatile u64 _samples;
+    volatile u64 _counter;
+    volatile u64 _overflow;
+
+    MethodProfileEntry* lookup(u64 key, ASGCT_CallFrame& frame);
+
+  public:
+    MethodProfile() : _table(NULL), _active(false), _samples(0), _counter(0), _overflow(0) {
+    }
+
+    u64 samples()  { return _samples; }
+    u64 counter()  { return _counter; }
+    u64 overflow() { return _overflow; }
+
+    bool available() {
+        return _table != NULL;
+    }
+
+    // Must not race with record(), i.e. called while the sampling is off
+    void start(bool enabled, bool reset);
+    void stop() {
+        _active = false;
+    }
+
+    // frames[0] is the top frame; synthetic frames after the stack are excluded by the caller
+    void record(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+
+    // Up to max_count entries with the largest self (or total) counter, in descending order
+    void top(int max_count, bool by_total, std::vector<MethodProfileEntry*>& entries);
+};
+
+#endif // _METHODPROFILE_H
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "methodTracer.h"
+#include "eventLogger.h"
+#include "instrument.h"
+#include "log.h"
+#include "overheadGovernor.h"
+#include "profiledThread.h"
+#include "profiler.h"
+#include "timeUtil.h"
+#include "tsc.h"
+#include "vmEntry.h"
+
+
+InstrumentTargets MethodTracer::_targets;
+MethodHistogram MethodTracer::_histograms[MAX_TRACED_METHODS];
+int MethodTracer::_percentile;
+volatile u64 MethodTracer::_dropped;
+volatile bool MethodTracer::_running = false;
+
+jlong MethodTracer::_report_interval;
+jlong MethodTracer::_last_report;
+MethodReportTask* MethodTracer::_report_task = NULL;
+
+
+static inline u64 takeMethodCounter(volatile u64& counter) {
+    return __sync_lock_test_and_set(&counter, 0);
+}
+
+void JNICALL MethodTracer::recordEntry(JNIEnv* jni, jobject unused, jint id) {
+    if (!_running) return;
+
+    ProfiledThread* thread = ProfiledThread::currentOrCreate();
+    if (thread->_method_calls == NULL) {
+        thread->_method_calls = (MethodCall*)malloc(METHOD_CALL_DEPTH * sizeof(MethodCall));
+        if (thread->_method_calls == NULL) return;
+    }
+
+    int depth = thread->_method_depth++;
+    if (depth < METHOD_CALL_DEPTH) {
+        thread->_method_calls[depth].id = id;
+        thread->_method_calls[depth].start = TSC::ticks();
+    } else {
+        atomicInc(_dropped);
+    }
+}
+
+// A call that left by an exception the handler did not see (a constructor)
+// stays behind until an enclosing traced call returns
+void JNICALL MethodTracer::recordExit(JNIEnv* jni, jobject unused, jint id) {
+    u64 end = TSC::ticks();
+    ProfiledThread* thread = ProfiledThread::current();
+    if (thread == NULL || thread->_method_depth == 0) {
+        return;
+    }
+
+    int depth = thread->_method_depth;
+    if (depth > METHOD_CALL_DEPTH) {
+        thread->_method_depth = depth - 1;
+        return;
+    }
+
+    MethodCall* calls = thread->_method_calls;
+    for (int i = depth - 1; i >= 0; i--) {
+        if (calls[i].id == id) {
+            thread->_method_depth = i;
+            if (_running && id < _targets.count()) {
+                record(id, end - calls[i].start);
+            }
+            return;
+        }
+    }
+}
+
+void MethodTracer::record(int id, u64 ticks) {
+    MethodHistogram* histogram = &_histograms[id];
+    u64 duration = TSC::ticksToNanos(ticks);
+    int bucket = LatencyStats::bucket(duration / 1000);
+
+    atomicInc(histogram->count);
+    atomicInc(histogram->total_ns, duration);
+    u64 max = histogram->max_ns;
+    while (duration > max && !__sync_bool_compare_and_swap(&histogram->max_ns, max, duration)) {
+        max = histogram->max_ns;
+    }
+    __sync_fetch_and_add(&histogram->buckets[bucket], 1);
+    __sync_fetch_and_add(&histogram->run_buckets[bucket], 1);
+
+    u64 runs = atomicInc(histogram->run_count) + 1;
+    if (runs == METHOD_THRESHOLD_CALLS || (runs & (METHOD_THRESHOLD_UPDATE - 1)) == 0) {
+        updateThreshold(histogram, runs);
+    }
+
+    if (duration > histogram->threshold_ns && _enabled) {
+        atomicInc(histogram->captured);
+        ExecutionEvent event;
+        Profiler::instance()->recordSample(NULL, duration, BCI_INSTRUMENT, &event);
+    }
+}
+
+// The upper bound of the bucket holding the percentile; at most 100 - methodpct
+// percent of the calls are slower than that. Racing updates store similar values.
+void MethodTracer::updateThreshold(MethodHistogram* histogram, u64 runs) {
+    u64 seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->run_buckets[i];
+        if (seen * 100 >= runs * _percentile) {
+            histogram->threshold_ns = LatencyStats::bucketLimit(i) * 1000;
+            return;
+        }
+    }
+}
+
+// One record per target that returned in the interval:
+//     kd-mlat@timestamp!interval_ns!method!count!total_ns!max_ns!p50_ns!p99_ns!threshold_ns!captured!buckets!
+// buckets lists the non-empty ones as upper_bound_us:count,...; percentiles are
+// bucket upper bounds, as in kd-ioh. captured is the number of recorded stacks.
+void MethodTracer::report() {
+    jlong now = KdClock::now();
+    jlong interval = KdClock::toNanos(now - _last_report);
+    _last_report = now;
+
+    for (int i = 0; i < _targets.count(); i++) {
+        MethodHistogram* histogram = &_histograms[i];
+        if (histogram->count == 0) {
+            continue;
+        }
+
+        u64 count = takeMethodCounter(histogram->count);
+        u64 total_ns = takeMethodCounter(histogram->total_ns);
+        u64 max_ns = takeMethodCounter(histogram->max_ns);
+        u64 captured = takeMethodCounter(histogram->captured);
+        u32 buckets[LATENCY_BUCKETS];
+        u64 bucketed = 0;
+        for (int j = 0; j < LATENCY_BUCKETS; j++) {
+            bucketed += buckets[j] = __sync_lock_test_and_set(&histogram->buckets[j], 0);
+        }
+
+        char bucket_list[320];
+        size_t len = 0;
+        u64 p50 = 0, p99 = 0, seen = 0;
+        bucket_list[0] = 0;
+        for (int j = 0; j < LATENCY_BUCKETS; j++) {
+            if (buckets[j] == 0) continue;
+            seen += buckets[j];
+            u64 limit = LatencyStats::bucketLimit(j);
+            if (p50 == 0 && seen * 2 >= bucketed) p50 = limit * 1000;
+            if (p99 == 0 && seen * 100 >= bucketed * 99) p99 = limit * 1000;
+            if (len < sizeof(bucket_list) - 1) {
+                int n = snprintf(bucket_list + len, sizeof(bucket_list) - len, len == 0 ? "%llu:%u" : ",%llu:%u",
+                                 (unsigned long long)limit, buckets[j]);
+                if (n > 0) len += n;
+            }
+        }
+
+        u64 threshold = histogram->threshold_ns == (u64)-1 ? 0 : histogram->threshold_ns;
+        EventLogger::log("kd-mlat@%ld!%ld!%s!%llu!%llu!%llu!%llu!%llu!%llu!%llu!%s!", now, interval,
+                         _targets[i].name, count, total_ns, max_ns, p50, p99, threshold, captured, bucket_list);
+    }
+}
+
+void MethodTracer::reportIfDue() {
+    if (KdClock::toNanos(KdClock::now() - _last_report) >= _report_interval) {
+        u64 start = TSC::ticks();
+        report();
+        OverheadGovernor::add(OVERHEAD_LOCK, start);
+    }
+}
+
+void MethodTracer::retransformMatchedClasses(jvmtiEnv* jvmti) {
+    jint class_count;
+    jclass* classes;
+    if (jvmti->GetLoadedClasses(&class_count, &classes) != 0) {
+        return;
+    }
+
+    jint matched_count = 0;
+    for (int i = 0; i < class_count; i++) {
+        char* signature;
+        if (jvmti->GetClassSignature(classes[i], &signature, NULL) == 0) {
+            if (_targets.matchesSignature(signature)) {
+                classes[matched_count++] = classes[i];
+            }
+            jvmti->Deallocate((unsigned char*)signature);
+        }
+    }
+
+    if (matched_count > 0) {
+        jvmti->RetransformClasses(matched_count, classes);
+        VM::jni()->ExceptionClear();
+    }
+
+    jvmti->Deallocate((unsigned char*)classes);
+}
+
+Error MethodTracer::check(Arguments& args) {
+    return Instrument::loadClass();
+}
+
+Error MethodTracer::start(Arguments& args) {
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    error = _targets.parse(args._methods);
+    if (error) {
+        return error;
+    }
+
+    _percentile = args._method_pct > 0 ? args._method_pct : DEFAULT_METHOD_PERCENTILE;
+    memset(_histograms, 0, sizeof(_histograms));
+    for (int i = 0; i < _targets.count(); i++) {
+        _histograms[i].threshold_ns = (u64)-1;
+    }
+    _dropped = 0;
+    _report_interval = (jlong)DEFAULT_METHOD_REPORT_INTERVAL * 1000000000LL;
+    _last_report = KdClock::now();
+
+    _report_task = new MethodReportTask();
+    BackgroundScheduler::schedule(_report_task, METHOD_POLL_INTERVAL_MS);
+
+    _running = true;
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
+    retransformMatchedClasses(jvmti);
+
+    return Error::OK;
+}
+
+void MethodTracer::stop() {
+    _running = false;
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    retransformMatchedClasses(jvmti);  // undo transformation
+    if (!Instrument::running()) {
+        jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
+    }
+
+    BackgroundScheduler::cancel(_report_task);
+    delete _report_task;
+    _report_task = NULL;
+    report();  // the last interval
+
+    if (_dropped > 0) {
+        Log::debug("%llu calls of traced methods were too deep to be timed", _dropped);
+    }
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _METHODTRACER_H
+#define _METHODTRACER_H
+
+#include <jvmti.h>
+#include "arch.h"
+#include "backgroundScheduler.h"
+#include "engine.h"
+#include "instrumentTargets.h"
+#include "latencyStats.h"
+
+
+const int MAX_TRACED_METHODS = MAX_INSTRUMENT_TARGETS;
+const int DEFAULT_METHOD_PERCENTILE = 99;
+const int DEFAULT_METHOD_REPORT_INTERVAL = 10;  // seconds
+const int METHOD_POLL_INTERVAL_MS = 100;
+// Calls of a method before its percentile is trusted, and how often it is recomputed
+const u64 METHOD_THRESHOLD_CALLS = 128;
+const u64 METHOD_THRESHOLD_UPDATE = 1024;  // must be a power of 2
+
+// Durations of one target in microsecond buckets of LatencyStats::bucket.
+// The interval counters are swapped out by the reporter; the run buckets are
+// kept for the whole run to find the percentile above which stacks are recorded.
+struct MethodHistogram {
+    volatile u64 count;
+    volatile u64 total_ns;
+    volatile u64 max_ns;
+    volatile u64 captured;
+    volatile u32 buckets[LATENCY_BUCKETS];
+    volatile u64 run_count;
+    volatile u32 run_buckets[LATENCY_BUCKETS];
+    volatile u64 threshold_ns;
+};
+
+class MethodReportTask;
+
+// Times calls of the methods given with methods=. Instrument rewrites their bytecode
+// to call Instrument.recordEntry(id) on entry and Instrument.recordExit(id) before
+// every return and from a catch-all handler, so that exceptional exits are timed too
+// (except in constructors). The calls in flight are kept in the ProfiledThread.
+// Stacks are recorded only for calls slower than the methodpct percentile of the method;
+// every DEFAULT_METHOD_REPORT_INTERVAL seconds the histograms are logged as kd-mlat records.
+class MethodTracer : public Engine {
+  private:
+    static InstrumentTargets _targets;
+    static MethodHistogram _histograms[MAX_TRACED_METHODS];
+    static int _percentile;
+    static volatile u64 _dropped;
+    static volatile bool _running;
+
+    static jlong _report_interval;
+    static jlong _last_report;
+    static MethodReportTask* _report_task;
+
+    static void record(int id, u64 ticks);
+    static void updateThreshold(MethodHistogram* histogram, u64 runs);
+    static void retransformMatchedClasses(jvmtiEnv* jvmti);
+
+  public:
+    const char* title() {
+        return "Method latency profile";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    static bool running() {
+        return _running;
+    }
+
+    static const InstrumentTargets& targets() {
+        return _targets;
+    }
+
+    // Logs the histograms of the last interval and clears them
+    static void report();
+    static void reportIfDue();
+
+    static void JNICALL recordEntry(JNIEnv* jni, jobject unused, jint id);
+    static void JNICALL recordExit(JNIEnv* jni, jobject unused, jint id);
+};
+
+class MethodReportTask : public ScheduledTask {
+  public:
+    void run() {
+        MethodTracer::reportIfDue();
+    }
+};
+
+#endif // _METHODTRACER_H
@@ -14,23 +14,35 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "objectSampler.h"
+#include "gcPhase.h"
+#include "memoryBudget.h"
 #include "profiler.h"
 
 
 u64 ObjectSampler::_interval;
 volatile u64 ObjectSampler::_allocated_bytes;
 
+Mutex ObjectSampler::_live_lock;
+LiveRef* ObjectSampler::_live_refs = NULL;
+int ObjectSampler::_live_capacity = 0;
+int ObjectSampler::_live_count = 0;
+u32 ObjectSampler::_cleaned_gc = 0;
+u64 ObjectSampler::_aged_out = 0;
+u64 ObjectSampler::_dropped = 0;
+
 
 void ObjectSampler::SampledObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                        jobject object, jclass object_klass, jlong size) {
     if (_enabled) {
-        recordAllocation(jvmti, BCI_ALLOC, object_klass, size);
+        recordAllocation(jvmti, jni, BCI_ALLOC, object, object_klass, size);
     }
 }
 
-void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, int event_type, jclass object_klass, jlong size) {
+void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, JNIEnv* jni, int event_type,
+                                     jobject object, jclass object_klass, jlong size) {
     AllocEvent event;
     event._class_id = 0;
     event._total_size = size > _interval ? size : _interval;
@@ -46,7 +58,105 @@ void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, int event_type, jclass obj
         jvmti->Deallocate((unsigned char*)class_name);
     }
 
-    Profiler::instance()->recordSample(NULL, size, event_type, &event);
+    u32 call_trace_id = Profiler::instance()->recordSample(NULL, size, event_type, &event);
+    if (_live_capacity > 0 && call_trace_id != 0) {
+        addLiveRef(jni, object, size, call_trace_id);
+    }
+}
+
+void ObjectSampler::addLiveRef(JNIEnv* jni, jobject object, jlong size, u32 call_trace_id) {
+    jweak ref = jni->NewWeakGlobalRef(object);
+    if (ref == NULL) {
+        return;
+    }
+
+    MutexLocker ml(_live_lock);
+    if (_cleaned_gc != GcPhase::collections()) {
+        cleanupLiveRefs(jni);
+    }
+
+    LiveRef* slot;
+    if (_live_count < _live_capacity) {
+        slot = &_live_refs[_live_count++];
+    } else {
+        u32 gc_count = GcPhase::collections();
+        slot = &_live_refs[0];
+        for (int i = 1; i < _live_count; i++) {
+            if (gc_count - _live_refs[i].gc_epoch > gc_count - slot->gc_epoch) {
+                slot = &_live_refs[i];
+            }
+        }
+        if (gc_count - slot->gc_epoch < LIVE_AGE_OUT) {
+            _dropped++;
+            jni->DeleteWeakGlobalRef(ref);
+            return;
+        }
+        _aged_out++;
+        jni->DeleteWeakGlobalRef(slot->ref);
+    }
+
+    slot->ref = ref;
+    slot->size = size;
+    slot->call_trace_id = call_trace_id;
+    slot->gc_epoch = GcPhase::collections();
+}
+
+// Called with _live_lock held; survivors keep their order
+void ObjectSampler::cleanupLiveRefs(JNIEnv* jni) {
+    _cleaned_gc = GcPhase::collections();
+    int kept = 0;
+    for (int i = 0; i < _live_count; i++) {
+        if (jni->IsSameObject(_live_refs[i].ref, NULL)) {
+            jni->DeleteWeakGlobalRef(_live_refs[i].ref);
+        } else {
+            _live_refs[kept++] = _live_refs[i];
+        }
+    }
+    _live_count = kept;
+}
+
+// Unreachable objects count as alive until a GC collects them. Without
+// a JNI environment, references cleared since the last sample count too.
+void ObjectSampler::collectLive(std::map<u32, LiveTotal>& totals) {
+    JNIEnv* jni = VM::jni();
+    MutexLocker ml(_live_lock);
+    if (jni != NULL) {
+        cleanupLiveRefs(jni);
+    }
+    for (int i = 0; i < _live_count; i++) {
+        LiveTotal& total = totals[_live_refs[i].call_trace_id];
+        total.samples++;
+        total.bytes += _live_refs[i].size;
+    }
+}
+
+// The references of the previous run are kept until now, so that it can still be dumped
+void ObjectSampler::startLive(Arguments& args) {
+    JNIEnv* jni = VM::jni();
+    MutexLocker ml(_live_lock);
+    for (int i = 0; i < _live_count && jni != NULL; i++) {
+        jni->DeleteWeakGlobalRef(_live_refs[i].ref);
+    }
+    _live_count = 0;
+
+    if (args._live != _live_capacity) {
+        if (_live_refs != NULL) {
+            free(_live_refs);
+            MemoryBudget::release(MEMORY_LIVE_OBJECTS, _live_capacity * sizeof(LiveRef));
+        }
+        _live_refs = args._live > 0 ? (LiveRef*)malloc(args._live * sizeof(LiveRef)) : NULL;
+        _live_capacity = _live_refs != NULL ? args._live : 0;
+        MemoryBudget::charge(MEMORY_LIVE_OBJECTS, _live_capacity * sizeof(LiveRef));
+    }
+    _cleaned_gc = GcPhase::collections();
+    _aged_out = 0;
+    _dropped = 0;
+}
+
+void ObjectSampler::stopLive() {
+    if (_live_capacity > 0) {
+        Log::debug("Live objects: %d tracked, %llu aged out, %llu dropped", _live_count, _aged_out, _dropped);
+    }
 }
 
 Error ObjectSampler::check(Arguments& args) {
@@ -67,6 +177,7 @@ Error ObjectSampler::start(Arguments& args) {
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetHeapSamplingInterval(_interval);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL);
+    startLive(args);
 
     return Error::OK;
 }
@@ -74,4 +185,5 @@ Error ObjectSampler::start(Arguments& args) {
 void ObjectSampler::stop() {
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL);
+    stopLive();
 }
@@ -18,16 +18,49 @@
 #define _OBJECTSAMPLER_H
 
 #include <jvmti.h>
+#include <map>
 #include "arch.h"
+#include "callTraceStorage.h"
 #include "engine.h"
+#include "mutex.h"
 
 
+// GCs a sampled object has to survive before a new sample may take its place
+const u32 LIVE_AGE_OUT = 16;
+
+// A sampled object kept track of with a weak reference (live)
+struct LiveRef {
+    jweak ref;
+    jlong size;
+    u32 call_trace_id;
+    // The GC count when the object was allocated
+    u32 gc_epoch;
+};
+
+// With live=N, up to N sampled objects are kept in a reservoir of weak references.
+// GcPhase only counts collections, since no JNI is allowed in GC callbacks;
+// the next sampled allocation, or a dump, drops the references cleared since.
+// When the reservoir is full, a new sample replaces the oldest survivor once that
+// has survived LIVE_AGE_OUT collections, and is dropped otherwise.
 class ObjectSampler : public Engine {
   protected:
     static u64 _interval;
     static volatile u64 _allocated_bytes;
 
-    static void recordAllocation(jvmtiEnv* jvmti, int event_type, jclass object_klass, jlong size);
+    static Mutex _live_lock;
+    static LiveRef* _live_refs;
+    static int _live_capacity;
+    static int _live_count;
+    static u32 _cleaned_gc;
+    static u64 _aged_out;
+    static u64 _dropped;
+
+    static void recordAllocation(jvmtiEnv* jvmti, JNIEnv* jni, int event_type,
+                                 jobject object, jclass object_klass, jlong size);
+    static void addLiveRef(JNIEnv* jni, jobject object, jlong size, u32 call_trace_id);
+    static void cleanupLiveRefs(JNIEnv* jni);
+    static void startLive(Arguments& args);
+    static void stopLive();
 
   public:
     const char* title() {
@@ -42,6 +75,9 @@ class ObjectSampler : public Engine {
     Error start(Arguments& args);
     void stop();
 
+    // Sampled objects still alive, by the stack that allocated them
+    static void collectLive(std::map<u32, LiveTotal>& totals);
+
     static void JNICALL SampledObjectAlloc(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread,
                                            jobject object, jclass object_klass, jlong size);
 };
@@ -30,6 +30,13 @@ typedef void (*TimerCallback)(void*);
 // Interrupt threads with this signal. The same signal is used inside JDK to interrupt I/O operations.
 const int WAKEUP_SIGNAL = SIGIO;
 
+// Backing of the profiler's large tables (hugepages)
+enum LargePages {
+    LARGE_PAGES_NONE,
+    LARGE_PAGES_THP,      // transparent huge pages, madvise(MADV_HUGEPAGE)
+    LARGE_PAGES_HUGETLB   // reserved huge pages where the size allows, THP otherwise
+};
+
 enum ThreadState {
     THREAD_INVALID,
     THREAD_RUNNING,
@@ -45,6 +52,16 @@ class ThreadList {
     virtual int size() = 0;
 };
 
+// States of the threads a sampler visits over and over; the implementation
+// may keep per-thread resources between ticks rather than look a thread up every time
+class ThreadStateCache {
+  public:
+    virtual ~ThreadStateCache() {}
+    virtual ThreadState get(int thread_id) = 0;
+    // Releases threads not seen since the previous sweep
+    virtual void sweep() = 0;
+};
+
 
 // W^X memory support
 class JitWriteProtection {
@@ -65,6 +82,8 @@ class OS {
 
     static u64 nanotime();
     static u64 micros();
+    // CPU time of the calling thread in ns; async signal safe
+    static u64 threadCpuTime();
     static u64 processStartTime();
     static void sleep(u64 nanos);
 
@@ -72,27 +91,58 @@ class OS {
     static u64 ntoh64(u64 x);
 
     static int getMaxThreadId();
+    static int cpuCount();
+    // CPU the calling thread is running on, or -1 if unknown
+    static int cpuId();
     static int processId();
     static int threadId();
     static const char* schedPolicy(int thread_id);
+    // For background threads of the profiler: bind the calling thread to a CPU list
+    // like "0-3,6", renice it or move it to the idle class. False where not supported.
+    static bool bindThread(const char* cpu_list);
+    static bool setThreadNice(int nice);
+    static bool setThreadIdle();
     static bool threadName(int thread_id, char* name_buf, size_t name_len);
+    // The thread group is the name with every run of digits replaced by '#', so that
+    // the threads of a pool share it: pool-1-thread-12 becomes pool-#-thread-#.
+    // '!' and newlines are dropped, as they delimit Kindling records.
+    static void threadGroup(const char* name, char* group_buf, size_t group_len) {
+        size_t len = 0;
+        for (const char* c = name; *c != 0 && len < group_len - 1; c++) {
+            if (*c >= '0' && *c <= '9') {
+                if (len == 0 || group_buf[len - 1] != '#') group_buf[len++] = '#';
+            } else if (*c != '!' && *c != '\n') {
+                group_buf[len++] = *c;
+            }
+        }
+        group_buf[len] = 0;
+    }
     static ThreadState threadState(int thread_id);
     static ThreadList* listThreads();
+    static ThreadStateCache* threadStateCache();
 
     static bool isLinux();
 
     static SigAction installSignalHandler(int signo, SigAction action, SigHandler handler = NULL);
     static SigAction replaceCrashHandler(SigAction action);
     static bool sendSignalToThread(int thread_id, int signo);
+    // Delivers value as si_value with si_code SI_QUEUE where the OS supports it
+    static bool sendSignalToThread(int thread_id, int signo, intptr_t value);
 
     static void* safeAlloc(size_t size);
     static void safeFree(void* addr, size_t size);
+    // Call trace tables and chunks: probed at random from signal handlers, hence worth
+    // huge pages to save TLB misses, and interleaving on multi-socket machines (numa)
+    static void setLargePages(LargePages pages, bool numa_interleave);
+    static void* safeAllocLarge(size_t size);
 
     static bool getCpuDescription(char* buf, size_t size);
     static u64 getProcessCpuTime(u64* utime, u64* stime);
     static u64 getTotalCpuTime(u64* utime, u64* stime);
 
     static void copyFile(int src_fd, int dst_fd, off_t offset, size_t size);
+    // Anonymous file in memory; -1 if not supported
+    static int createMemoryFile(const char* name);
     static void freePageCache(int fd, off_t start_offset);
 };
 
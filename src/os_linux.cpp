@@ -16,6 +16,7 @@
 
 #ifdef __linux__
 
+#include <map>
 #include <arpa/inet.h>
 #include <byteswap.h>
 #include <dirent.h>
@@ -25,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
@@ -42,6 +44,23 @@
 #  define MMAP_SYSCALL __NR_mmap2
 #endif
 
+const size_t MAX_THREAD_STATE_FDS = 8192;
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+const int MAX_NUMA_NODES = 1024;
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#define MPOL_INTERLEAVE 3
+
+static LargePages _large_pages = LARGE_PAGES_NONE;
+// Online NUMA nodes; empty unless numa is set and there is more than one
+static unsigned long _numa_nodes[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+static bool _numa_interleave = false;
+
 
 class LinuxThreadList : public ThreadList {
   private:
@@ -108,6 +127,91 @@ class LinuxThreadList : public ThreadList {
     }
 };
 
+// Keeps /proc/self/task/<tid>/stat open for every visited thread, so a state
+// check is a single pread. Threads that are gone are closed on the next sweep,
+// or on the first failed read if the thread is visited again.
+class LinuxThreadStateCache : public ThreadStateCache {
+  private:
+    struct Entry {
+        int fd;
+        u32 seen;
+    };
+
+    std::map<int, Entry> _entries;
+    size_t _max_entries;
+    u32 _generation;
+
+    static int openStat(int thread_id) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%d/stat", thread_id);
+        return open(path, O_RDONLY);
+    }
+
+    static ThreadState readState(int fd) {
+        char buf[512];
+        ssize_t r = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (r <= 0) {
+            return THREAD_INVALID;
+        }
+        buf[r] = 0;
+        char* s = strchr(buf, ')');
+        return s != NULL && (s[2] == 'R' || s[2] == 'D') ? THREAD_RUNNING : THREAD_SLEEPING;
+    }
+
+  public:
+    LinuxThreadStateCache() : _generation(0) {
+        // Leave most of the descriptor limit to the application
+        struct rlimit rlim;
+        _max_entries = getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY ? rlim.rlim_cur / 4 : 1024;
+        if (_max_entries > MAX_THREAD_STATE_FDS) {
+            _max_entries = MAX_THREAD_STATE_FDS;
+        }
+    }
+
+    ~LinuxThreadStateCache() {
+        for (std::map<int, Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            close(it->second.fd);
+        }
+    }
+
+    ThreadState get(int thread_id) {
+        std::map<int, Entry>::iterator it = _entries.find(thread_id);
+        if (it == _entries.end()) {
+            if (_entries.size() >= _max_entries) {
+                return OS::threadState(thread_id);
+            }
+            int fd = openStat(thread_id);
+            if (fd == -1) {
+                return THREAD_INVALID;
+            }
+            Entry entry = {fd, _generation};
+            it = _entries.insert(std::make_pair(thread_id, entry)).first;
+        }
+
+        it->second.seen = _generation;
+        ThreadState state = readState(it->second.fd);
+        if (state == THREAD_INVALID) {
+            // The thread has exited; its tid may already belong to a new thread
+            close(it->second.fd);
+            _entries.erase(it);
+            return OS::threadState(thread_id);
+        }
+        return state;
+    }
+
+    void sweep() {
+        for (std::map<int, Entry>::iterator it = _entries.begin(); it != _entries.end(); ) {
+            if (it->second.seen != _generation) {
+                close(it->second.fd);
+                _entries.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        _generation++;
+    }
+};
+
 
 JitWriteProtection::JitWriteProtection(bool enable) {
     // Not used on Linux
@@ -127,6 +231,12 @@ u64 OS::nanotime() {
     return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+u64 OS::threadCpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 u64 OS::micros() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -173,6 +283,15 @@ int OS::getMaxThreadId() {
     return atoi(buf);
 }
 
+int OS::cpuCount() {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+int OS::cpuId() {
+    return sched_getcpu();
+}
+
 int OS::processId() {
     static const int self_pid = getpid();
 
@@ -191,6 +310,47 @@ const char* OS::schedPolicy(int thread_id) {
     return "SCHED_OTHER";
 }
 
+bool OS::bindThread(const char* cpu_list) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const char* p = cpu_list; *p != 0; ) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return false;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+        if (*end != ',' && *end != 0) {
+            return false;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool OS::setThreadNice(int nice) {
+    // Linux nice values are per thread
+    return setpriority(PRIO_PROCESS, threadId(), nice) == 0;
+}
+
+bool OS::setThreadIdle() {
+    struct sched_param param = {0};
+    return sched_setscheduler(0, SCHED_IDLE, &param) == 0;
+}
+
 bool OS::threadName(int thread_id, char* name_buf, size_t name_len) {
     char buf[64];
     sprintf(buf, "/proc/self/task/%d/comm", thread_id);
@@ -231,6 +391,10 @@ ThreadList* OS::listThreads() {
     return new LinuxThreadList();
 }
 
+ThreadStateCache* OS::threadStateCache() {
+    return new LinuxThreadStateCache();
+}
+
 bool OS::isLinux() {
     return true;
 }
@@ -265,6 +429,17 @@ bool OS::sendSignalToThread(int thread_id, int signo) {
     return syscall(__NR_tgkill, processId(), thread_id, signo) == 0;
 }
 
+bool OS::sendSignalToThread(int thread_id, int signo, intptr_t value) {
+    siginfo_t si;
+    memset(&si, 0, sizeof(si));
+    si.si_signo = signo;
+    si.si_code = SI_QUEUE;
+    si.si_pid = processId();
+    si.si_uid = getuid();
+    si.si_value.sival_ptr = (void*)value;
+    return syscall(__NR_rt_tgsigqueueinfo, processId(), thread_id, signo, &si) == 0;
+}
+
 void* OS::safeAlloc(size_t size) {
     // Naked syscall can be used inside a signal handler.
     // Also, we don't want to catch our own calls when profiling mmap.
@@ -279,6 +454,60 @@ void OS::safeFree(void* addr, size_t size) {
     syscall(__NR_munmap, addr, size);
 }
 
+// /sys/devices/system/node/online is a list of ranges such as 0-1,3
+static int readNumaNodes(unsigned long* mask) {
+    char buf[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    ssize_t bytes = fd == -1 ? -1 : read(fd, buf, sizeof(buf) - 1);
+    if (fd != -1) close(fd);
+    if (bytes <= 0) {
+        return 0;
+    }
+    buf[bytes] = 0;
+
+    int nodes = 0;
+    for (char* p = buf; *p >= '0' && *p <= '9'; ) {
+        int first = (int)strtol(p, &p, 10);
+        int last = *p == '-' ? (int)strtol(p + 1, &p, 10) : first;
+        for (int node = first; node <= last && node < MAX_NUMA_NODES; node++) {
+            mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+            nodes++;
+        }
+        if (*p == ',') p++;
+    }
+    return nodes;
+}
+
+void OS::setLargePages(LargePages pages, bool numa_interleave) {
+    _large_pages = pages;
+    memset(_numa_nodes, 0, sizeof(_numa_nodes));
+    _numa_interleave = numa_interleave && readNumaNodes(_numa_nodes) > 1;
+}
+
+// Only syscalls, like safeAlloc, since chunks are also allocated in signal handlers.
+// Every step is advisory: without reserved huge pages, THP or NUMA the memory is plain.
+void* OS::safeAllocLarge(size_t size) {
+    intptr_t result = -1;
+    if (_large_pages == LARGE_PAGES_HUGETLB && (size & (HUGE_PAGE_SIZE - 1)) == 0) {
+        // munmap of the same size is then aligned as hugetlbfs requires
+        result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (result < 0 && result > -4096) {
+        result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (result < 0 && result > -4096) {
+            return NULL;
+        }
+        if (_large_pages != LARGE_PAGES_NONE) {
+            syscall(__NR_madvise, result, size, MADV_HUGEPAGE);
+        }
+    }
+    if (_numa_interleave) {
+        // Before the first touch, so that no page has to move
+        syscall(__NR_mbind, result, size, MPOL_INTERLEAVE, _numa_nodes, MAX_NUMA_NODES, 0);
+    }
+    return (void*)result;
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     int fd = open("/proc/cpuinfo", O_RDONLY);
     if (fd == -1) {
@@ -341,6 +570,14 @@ void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
     }
 }
 
+int OS::createMemoryFile(const char* name) {
+#ifdef __NR_memfd_create
+    return (int)syscall(__NR_memfd_create, name, 0);
+#else
+    return -1;
+#endif
+}
+
 void OS::freePageCache(int fd, off_t start_offset) {
     posix_fadvise(fd, start_offset & ~page_mask, 0, POSIX_FADV_DONTNEED);
 }
@@ -32,6 +32,17 @@
 #include "os.h"
 
 
+// thread_info is a single call already, nothing to cache
+class MacThreadStateCache : public ThreadStateCache {
+  public:
+    ThreadState get(int thread_id) {
+        return OS::threadState(thread_id);
+    }
+
+    void sweep() {
+    }
+};
+
 class MacThreadList : public ThreadList {
   private:
     task_t _task;
@@ -127,6 +138,12 @@ u64 OS::nanotime() {
     return (u64)mach_absolute_time() * timebase.numer / timebase.denom;
 }
 
+u64 OS::threadCpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 u64 OS::micros() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -163,6 +180,15 @@ int OS::getMaxThreadId() {
     return 0x7fffffff;
 }
 
+int OS::cpuCount() {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+int OS::cpuId() {
+    return -1;
+}
+
 int OS::processId() {
     static const int self_pid = getpid();
 
@@ -182,6 +208,20 @@ const char* OS::schedPolicy(int thread_id) {
     return "SCHED_OTHER";
 }
 
+bool OS::bindThread(const char* cpu_list) {
+    // No thread affinity on macOS
+    return false;
+}
+
+bool OS::setThreadNice(int nice) {
+    // setpriority() applies to the whole process
+    return false;
+}
+
+bool OS::setThreadIdle() {
+    return pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0) == 0;
+}
+
 bool OS::threadName(int thread_id, char* name_buf, size_t name_len) {
     pthread_t thread = pthread_from_mach_thread_np(thread_id);
     return thread && pthread_getname_np(thread, name_buf, name_len) == 0 && name_buf[0] != 0;
@@ -200,6 +240,10 @@ ThreadList* OS::listThreads() {
     return new MacThreadList();
 }
 
+ThreadStateCache* OS::threadStateCache() {
+    return new MacThreadStateCache();
+}
+
 bool OS::isLinux() {
     return false;
 }
@@ -250,6 +294,11 @@ bool OS::sendSignalToThread(int thread_id, int signo) {
 #endif
 }
 
+// There is no sigqueue for a single thread, the signal goes without the value
+bool OS::sendSignalToThread(int thread_id, int signo, intptr_t value) {
+    return sendSignalToThread(thread_id, signo);
+}
+
 void* OS::safeAlloc(size_t size) {
     // mmap() is not guaranteed to be async signal safe, but in practice, it is.
     // There is no a reasonable alternative anyway.
@@ -264,6 +313,14 @@ void OS::safeFree(void* addr, size_t size) {
     munmap(addr, size);
 }
 
+// Neither huge pages nor NUMA policies are available to applications on macOS
+void OS::setLargePages(LargePages pages, bool numa_interleave) {
+}
+
+void* OS::safeAllocLarge(size_t size) {
+    return safeAlloc(size);
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     return sysctlbyname("machdep.cpu.brand_string", buf, &size, NULL, 0) == 0;
 }
@@ -322,6 +379,10 @@ void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
     munmap(buf, offset);
 }
 
+int OS::createMemoryFile(const char* name) {
+    return -1;
+}
+
 void OS::freePageCache(int fd, off_t start_offset) {
     // Not supported on macOS
 }
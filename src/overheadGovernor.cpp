@@ -0,0 +1,126 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "lockTracer.h"
+#include "overheadGovernor.h"
+
+
+volatile u64 OverheadGovernor::_ticks[OVERHEAD_SOURCES];
+
+static u64 processCpuNanos() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u64 totalTicks(volatile u64* ticks) {
+    u64 total = 0;
+    for (int i = 0; i < OVERHEAD_SOURCES; i++) {
+        total += ticks[i];
+    }
+    return total;
+}
+
+u64 OverheadGovernor::nanos(OverheadSource source) {
+    return TSC::ticksToNanos(_ticks[source]);
+}
+
+void OverheadGovernor::start(Arguments& args, Engine* engine) {
+    stop();
+
+    memset((void*)_ticks, 0, sizeof(_ticks));
+    _budget = args._overhead_budget / 100;
+    _scale = 1;
+    _overhead = 0;
+    _engine = engine;
+    _base_interval = engine->interval();
+    _base_lock_sample = args._lock >= 0 ? args._lock_sample : 0;
+    _last_ticks = 0;
+    _last_cpu = processCpuNanos();
+
+    if (_budget > 0) {
+        _task = new GovernorTask(this);
+        BackgroundScheduler::schedule(_task, GOVERNOR_INTERVAL_MS);
+    }
+}
+
+void OverheadGovernor::stop() {
+    if (_task != NULL) {
+        BackgroundScheduler::cancel(_task);
+        delete _task;
+        _task = NULL;
+    }
+}
+
+void OverheadGovernor::adjust() {
+    u64 ticks = totalTicks(_ticks);
+    u64 cpu = processCpuNanos();
+    u64 spent = TSC::ticksToNanos(ticks - _last_ticks);
+    u64 elapsed_cpu = cpu - _last_cpu;
+    _last_ticks = ticks;
+    _last_cpu = cpu;
+    if (elapsed_cpu == 0 || cpu == 0) {
+        return;
+    }
+
+    // The cost of the profiler is roughly proportional to the sampling rate
+    _overhead = (double)spent / elapsed_cpu;
+    double scale = _scale;
+    if (_overhead > _budget) {
+        scale *= _overhead / _budget;
+    } else if (_overhead < _budget / 2) {
+        // Give the rate back slowly, so that the scale does not oscillate
+        scale *= 0.8;
+    }
+    if (scale < 1) scale = 1;
+    if (scale > GOVERNOR_MAX_SCALE) scale = GOVERNOR_MAX_SCALE;
+
+    if (scale != _scale) {
+        _scale = scale;
+        apply();
+    }
+}
+
+void OverheadGovernor::apply() {
+    if (_base_interval > 0) {
+        _engine->setInterval((long)(_base_interval * _scale));
+    }
+    if (_base_lock_sample > 0) {
+        LockTracer::setSampleInterval((jlong)(_base_lock_sample * _scale));
+    }
+}
+
+void OverheadGovernor::status(std::ostream& out) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "Profiler time: %llu ms in samples, %llu ms collecting, %llu ms writing, %llu ms lock and I/O events\n",
+             nanos(OVERHEAD_SAMPLE) / 1000000, nanos(OVERHEAD_COLLECT) / 1000000,
+             nanos(OVERHEAD_WRITE) / 1000000, nanos(OVERHEAD_LOCK) / 1000000);
+    out << buf;
+
+    if (_task != NULL) {
+        snprintf(buf, sizeof(buf), "Overhead budget: %.2f%%, last measured: %.2f%%, intervals scaled %.2fx\n",
+                 _budget * 100, _overhead * 100, _scale);
+        out << buf;
+        if (_base_interval > 0) {
+            out << "Effective interval: " << _engine->interval() << "\n";
+        }
+    }
+}
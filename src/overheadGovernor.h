@@ -0,0 +1,93 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OVERHEADGOVERNOR_H
+#define _OVERHEADGOVERNOR_H
+
+#include <ostream>
+#include "arch.h"
+#include "backgroundScheduler.h"
+#include "engine.h"
+#include "tsc.h"
+
+
+const int GOVERNOR_INTERVAL_MS = 1000;
+const double GOVERNOR_MAX_SCALE = 64;
+
+// Where the profiler spends its own CPU time
+enum OverheadSource {
+    OVERHEAD_SAMPLE,     // signal handlers and ring polling, per sample
+    OVERHEAD_COLLECT,    // FrameEventCache collector
+    OVERHEAD_WRITE,      // EventWriter flusher
+    OVERHEAD_LOCK,       // LockRecorder flush and IoTracer reports
+    OVERHEAD_SOURCES
+};
+
+class GovernorTask;
+
+// budget=PCT: every GOVERNOR_INTERVAL_MS, compares the time spent by the profiler
+// with the CPU time of the whole process. Over the budget, intervals grow
+// by the excess; well under it, they shrink back towards the configured ones.
+// The same scale applies to the sampling interval of the CPU engine and to locksample.
+class OverheadGovernor {
+  private:
+    static volatile u64 _ticks[OVERHEAD_SOURCES];
+
+    double _budget;
+    double _scale;
+    double _overhead;
+    Engine* _engine;
+    long _base_interval;
+    long _base_lock_sample;
+
+    u64 _last_ticks;
+    u64 _last_cpu;
+
+    GovernorTask* _task;
+
+    void adjust();
+    void apply();
+
+    friend class GovernorTask;
+
+  public:
+    OverheadGovernor() : _budget(0), _scale(1), _overhead(0), _engine(NULL), _task(NULL) {
+    }
+
+    static void add(OverheadSource source, u64 start_ticks) {
+        atomicInc(_ticks[source], TSC::ticks() - start_ticks);
+    }
+
+    static u64 nanos(OverheadSource source);
+
+    void start(Arguments& args, Engine* engine);
+    void stop();
+    void status(std::ostream& out);
+};
+
+class GovernorTask : public ScheduledTask {
+  public:
+    GovernorTask(OverheadGovernor* governor) {
+        this->governor = governor;
+    }
+    void run() {
+        governor->adjust();
+    }
+  private:
+    OverheadGovernor* governor;
+};
+
+#endif // _OVERHEADGOVERNOR_H
@@ -18,13 +18,32 @@
 #define _PERFEVENTS_H
 
 #include <signal.h>
+#include <thread>
 #include "arch.h"
 #include "engine.h"
 
 
+// event=offcpu and perfpoll: rings are polled this often, each holding this many pages of records
+const int RING_POLL_INTERVAL_MS = 10;
+const int RING_POLL_PAGES = 16;
+const int RING_POLL_MAX_FRAMES = 128;
+// perfpoll with cstack=dwarf: every record carries this much of the user stack, so the rings are larger
+const int RING_POLL_STACK_SIZE = 8192;
+const int RING_POLL_STACK_PAGES = 32;
+// event=runq: run-queue delay histograms per thread group are logged this often
+const int RUN_QUEUE_REPORT_INTERVAL = 10;  // seconds
+const int RUN_QUEUE_WAKEUPS = 4;  // recent wakeups per thread kept for matching with a switch in
+// percpu: one ring per CPU is shared by all threads running there
+const int PERCPU_RING_PAGES = 64;
+// boost: capture windows are bounded in number and in length
+const int MAX_BOOST_WINDOWS = 64;
+const u64 MAX_BOOST_DURATION_NS = 1000000000;
+
 class PerfEvent;
 class PerfEventType;
 class StackContext;
+class RingPollTask;
+class SampleEvent;
 
 class PerfEvents : public Engine {
   private:
@@ -35,8 +54,51 @@ class PerfEvents : public Engine {
     static Ring _ring;
     static CStack _cstack;
     static bool _use_mmap_page;
+    static bool _off_cpu;
+    static bool _run_queue;
+    static int _wakeup_tracepoint;
+    static int _wakeup_pid_offset;
+    static bool _poll;
+    static bool _stack_user;
+    static bool _per_cpu;
+    static int _cpu_count;
+    static PerfEvent* _cpu_events;
+    static RingPollTask* _poll_task;
+    static std::thread _poll_thread;
+    static int _counter_count;
+    static PerfEventType* _counter_types;
+    static int* _counter_fds;
+    static bool _data_addr;
+    static long _boost_interval;
+    static int _boost_max;
+    static volatile u64 _boost_windows[MAX_BOOST_WINDOWS];
+    static volatile u64 _boost_rejected;
+
+    static void setOffCpuAttr(struct perf_event_attr* attr);
+    static void pollRings(RingPollTask* task);
+    static void pollCpuRings(RingPollTask* task);
+    static void recordRunQueueDelay(RingPollTask* task, int tid, u64 delay);
+    static void reportRunQueue(RingPollTask* task);
+    static Error createWakeupEvents();
+    static void pollWakeups(RingPollTask* task);
+    static Error createForCpus();
+    static void destroyForCpus();
+    static bool reserveThread(int tid);
+    static void initAttr(struct perf_event_attr* attr);
+    static int attachThread(int tid, int fd, int err, struct perf_event_attr* attr);
+    static int createForThreads(const int* tids, int count);
+    static bool queueThread(int tid);
+    static void fetchLoop();
+    static void startFetcher();
+    static void stopFetcher();
+    static Error parseCounters(const char* counters);
+    static int createCounters(int tid, int leader, struct perf_event_attr* attr);
+    static void destroyCounters(int tid);
 
     static u64 readCounter(siginfo_t* siginfo, void* ucontext);
+    static u64 readGroup(siginfo_t* siginfo, void* ucontext, SampleEvent* event);
+    static void readDataAddress(int tid, SampleEvent* event);
+    static void endBoost(int tid, int fd);
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
     static void signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext);
 
@@ -48,6 +110,12 @@ class PerfEvents : public Engine {
     const char* title();
     const char* units();
 
+    long interval() {
+        return _interval;
+    }
+
+    bool setInterval(long interval);
+
     static int walk(int tid, void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx);
     static void resetBuffer(int tid);
 
@@ -56,6 +124,13 @@ class PerfEvents : public Engine {
 
     static int createForThread(int tid);
     static void destroyForThread(int tid);
+
+    static bool boostThread(int tid, u64 duration);
+    static u64 boostRejected() {
+        return _boost_rejected;
+    }
+
+    friend class RingPollTask;
 };
 
 #endif // _PERFEVENTS_H
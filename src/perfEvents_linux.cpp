@@ -21,6 +21,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -32,16 +36,24 @@
 #include <sys/syscall.h>
 #include <linux/perf_event.h>
 #include "arch.h"
+#include "eventLogger.h"
 #include "j9StackTraces.h"
+#include "latencyStats.h"
+#include "lockTracer.h"
 #include "log.h"
+#include "mutex.h"
 #include "os.h"
 #include "perfEvents.h"
 #include "fdtransferClient.h"
+#include "profiledThread.h"
 #include "profiler.h"
 #include "spinLock.h"
 #include "stackFrame.h"
 #include "stackWalker.h"
+#include "stoppableTask.h"
 #include "symbols.h"
+#include "threadHook.h"
+#include "timeUtil.h"
 #include "vmStructs.h"
 
 
@@ -91,6 +103,33 @@ static int findTracepointId(const char* name) {
     return fetchInt(buf);
 }
 
+// Offset of a field in the raw record of a tracepoint, from the
+// /sys/kernel/debug/tracing/events/<name>/format file; -1 if not found
+static int findTracepointField(const char* name, const char* field) {
+    char buf[256];
+    if ((size_t)snprintf(buf, sizeof(buf), "/sys/kernel/debug/tracing/events/%s/format", name) >= sizeof(buf)) {
+        return -1;
+    }
+    *strchr(buf, ':') = '/';
+
+    FILE* f = fopen(buf, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), " %s;", field);
+    int offset = -1;
+    while (offset < 0 && fgets(buf, sizeof(buf), f) != NULL) {
+        const char* p = strstr(buf, pattern);
+        if (p != NULL && (p = strstr(p, "offset:")) != NULL) {
+            offset = atoi(p + 7);
+        }
+    }
+    fclose(f);
+    return offset;
+}
+
 // Get perf_event_attr.type for the given event source
 // by reading /sys/bus/event_source/devices/<name>/type
 static int findDeviceType(const char* name) {
@@ -151,42 +190,12 @@ static bool setPmuConfig(const char* device, const char* param, __u64* config, _
 }
 
 
-static void** _pthread_entry = NULL;
-
-// Intercept thread creation/termination by patching libjvm's GOT entry for pthread_setspecific().
-// HotSpot puts VMThread into TLS on thread start, and resets on thread end.
-static int pthread_setspecific_hook(pthread_key_t key, const void* value) {
-    if (key != VMThread::key()) {
-        return pthread_setspecific(key, value);
-    }
-    if (pthread_getspecific(key) == value) {
-        return 0;
-    }
-
-    if (value != NULL) {
-        int result = pthread_setspecific(key, value);
-        PerfEvents::createForThread(OS::threadId());
-        return result;
-    } else {
-        PerfEvents::destroyForThread(OS::threadId());
-        return pthread_setspecific(key, value);
-    }
+static void perfThreadStart(int tid) {
+    PerfEvents::createForThread(tid);
 }
 
-static void** lookupThreadEntry() {
-    // Depending on Zing version, pthread_setspecific is called either from libazsys.so or from libjvm.so
-    if (VM::isZing()) {
-        CodeCache* libazsys = Profiler::instance()->findLibraryByName("libazsys");
-        if (libazsys != NULL) {
-            void** entry = libazsys->findGlobalOffsetEntry((void*)&pthread_setspecific);
-            if (entry != NULL) {
-                return entry;
-            }
-        }
-    }
-
-    CodeCache* lib = Profiler::instance()->findJvmLibrary("libj9thr");
-    return lib != NULL ? lib->findGlobalOffsetEntry((void*)&pthread_setspecific) : NULL;
+static void perfThreadEnd(int tid) {
+    PerfEvents::destroyForThread(tid);
 }
 
 
@@ -212,6 +221,8 @@ struct PerfEventType {
         IDX_TRACEPOINT,
         IDX_KPROBE,
         IDX_UPROBE,
+        IDX_OFFCPU,
+        IDX_RUNQ,
     };
 
     static PerfEventType AVAILABLE_EVENTS[];
@@ -393,6 +404,28 @@ struct PerfEventType {
         return raw;
     }
 
+    // Off-CPU time: sched_switch of the profiled thread together with its switch-in record
+    static PerfEventType* getOffCpu() {
+        int tracepoint_id = findTracepointId("sched:sched_switch");
+        if (tracepoint_id <= 0) {
+            return NULL;
+        }
+        PerfEventType* off_cpu = &AVAILABLE_EVENTS[IDX_OFFCPU];
+        off_cpu->config = tracepoint_id;
+        return off_cpu;
+    }
+
+    // Run-queue delay: off-CPU records of the profiled thread matched with its sched_wakeup
+    static PerfEventType* getRunQueue() {
+        int tracepoint_id = findTracepointId("sched:sched_switch");
+        if (tracepoint_id <= 0 || findTracepointId("sched:sched_wakeup") <= 0) {
+            return NULL;
+        }
+        PerfEventType* run_queue = &AVAILABLE_EVENTS[IDX_RUNQ];
+        run_queue->config = tracepoint_id;
+        return run_queue;
+    }
+
     static PerfEventType* forName(const char* name) {
         // Look through the table of predefined perf events
         for (int i = 0; i < IDX_PREDEFINED; i++) {
@@ -401,6 +434,12 @@ struct PerfEventType {
             }
         }
 
+        if (strcmp(name, EVENT_OFFCPU) == 0) {
+            return getOffCpu();
+        } else if (strcmp(name, EVENT_RUNQ) == 0) {
+            return getRunQueue();
+        }
+
         // Hardware breakpoint
         if (strncmp(name, "mem:", 4) == 0) {
             return getBreakpoint(name + 4, HW_BREAKPOINT_RW, 1);
@@ -484,6 +523,9 @@ PerfEventType PerfEventType::AVAILABLE_EVENTS[] = {
 
     {"kprobe:func",                 1, 0, 0}, /* IDX_KPROBE */
     {"uprobe:path",                 1, 0, 0}, /* IDX_UPROBE */
+
+    {EVENT_OFFCPU,            1000000, PERF_TYPE_TRACEPOINT, 0}, /* IDX_OFFCPU */
+    {EVENT_RUNQ,              1000000, PERF_TYPE_TRACEPOINT, 0}, /* IDX_RUNQ */
 };
 
 FunctionWithCounter PerfEventType::KNOWN_FUNCTIONS[] = {
@@ -505,27 +547,42 @@ char PerfEventType::probe_func[256];
 class RingBuffer {
   private:
     const char* _start;
+    unsigned long _mask;
     unsigned long _offset;
 
   public:
-    RingBuffer(struct perf_event_mmap_page* page) {
+    RingBuffer(struct perf_event_mmap_page* page, size_t data_size = OS::page_size) {
         _start = (const char*)page + OS::page_size;
+        _mask = data_size - 1;
     }
 
     struct perf_event_header* seek(u64 offset) {
-        _offset = (unsigned long)offset & OS::page_mask;
+        _offset = (unsigned long)offset & _mask;
         return (struct perf_event_header*)(_start + _offset);
     }
 
     u64 next() {
-        _offset = (_offset + sizeof(u64)) & OS::page_mask;
+        _offset = (_offset + sizeof(u64)) & _mask;
         return *(u64*)(_start + _offset);
     }
 
     u64 peek(unsigned long words) {
-        unsigned long peek_offset = (_offset + words * sizeof(u64)) & OS::page_mask;
+        unsigned long peek_offset = (_offset + words * sizeof(u64)) & _mask;
         return *(u64*)(_start + peek_offset);
     }
+
+    // Copies len bytes, a multiple of 8, that follow the current word
+    void read(void* dst, size_t len) {
+        unsigned long from = (_offset + sizeof(u64)) & _mask;
+        size_t first = _mask + 1 - from;
+        if (first >= len) {
+            memcpy(dst, _start + from, len);
+        } else {
+            memcpy(dst, _start + from, first);
+            memcpy((char*)dst + first, _start, len - first);
+        }
+        _offset = (_offset + len) & _mask;
+    }
 };
 
 
@@ -533,6 +590,8 @@ class PerfEvent : public SpinLock {
   private:
     int _fd;
     struct perf_event_mmap_page* _page;
+    // OS::nanotime() when the capture window of the thread ends, 0 if not boosted
+    volatile u64 _boost_until;
 
     friend class PerfEvents;
 };
@@ -545,66 +604,214 @@ long PerfEvents::_interval;
 Ring PerfEvents::_ring;
 CStack PerfEvents::_cstack;
 bool PerfEvents::_use_mmap_page;
+bool PerfEvents::_off_cpu = false;
+bool PerfEvents::_run_queue = false;
+int PerfEvents::_wakeup_tracepoint = 0;
+int PerfEvents::_wakeup_pid_offset = -1;
+bool PerfEvents::_poll = false;
+bool PerfEvents::_stack_user = false;
+bool PerfEvents::_per_cpu = false;
+int PerfEvents::_cpu_count = 0;
+PerfEvent* PerfEvents::_cpu_events = NULL;
+RingPollTask* PerfEvents::_poll_task = NULL;
+std::thread PerfEvents::_poll_thread;
+int PerfEvents::_counter_count = 0;
+PerfEventType* PerfEvents::_counter_types = NULL;
+int* PerfEvents::_counter_fds = NULL;
+bool PerfEvents::_data_addr = false;
+long PerfEvents::_boost_interval = 0;
+int PerfEvents::_boost_max = 0;
+volatile u64 PerfEvents::_boost_windows[MAX_BOOST_WINDOWS];
+volatile u64 PerfEvents::_boost_rejected = 0;
+
+// The stack of a thread at its last switch out that has not been matched with a switch in yet
+struct OffCpuState {
+    u64 switch_out;
+    // The last wakeups of the thread (runq), matched with its switch in by time
+    u64 wakeups[RUN_QUEUE_WAKEUPS];
+    int next_wakeup;
+    int cpu;
+    int depth;
+    const void* pcs[RING_POLL_MAX_FRAMES];
+};
 
-int PerfEvents::createForThread(int tid) {
+// Run-queue delays of one thread since the last report, bucketed in microseconds.
+// group is the thread name with its digits replaced, so that the threads of a pool share it.
+struct RunQueueHistogram {
+    char group[32];
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+    u32 buckets[LATENCY_BUCKETS];
+};
+
+// Drains the rings of all threads when samples are not delivered by signals
+class RingPollTask : public Stoppable {
+  public:
+    std::map<int, OffCpuState> _states;
+    std::map<int, RunQueueHistogram> _run_queue;
+    u64 _last_report;
+    std::vector<int> _tids;
+    const void* _pcs[RING_POLL_MAX_FRAMES];
+    u64 _stack[RING_POLL_STACK_SIZE / sizeof(u64)];
+
+    RingPollTask() : _last_report(KdClock::now()) {
+    }
+
+    void run() {
+        BackgroundScheduler::applyPolicy(false);
+        while (stopRequested() == false) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(RING_POLL_INTERVAL_MS));
+            PerfEvents::pollRings(this);
+        }
+        PerfEvents::pollRings(this);
+        if (PerfEvents::_run_queue) {
+            PerfEvents::reportRunQueue(this);
+        }
+    }
+};
+
+// Data pages of an event ring, not counting the control page
+static inline size_t ringSize(bool poll, bool stack_user) {
+    return stack_user ? RING_POLL_STACK_PAGES * OS::page_size : poll ? RING_POLL_PAGES * OS::page_size : OS::page_size;
+}
+
+// Registers that the snapshot walk starts from
+static const u64 STACK_USER_REGS = 1ULL << PERF_REG_PC | 1ULL << PERF_REG_SP | 1ULL << PERF_REG_FP;
+
+// PERF_SAMPLE_REGS_USER and PERF_SAMPLE_STACK_USER, the last fields of a record.
+// The stack is copied out to buf, since it may wrap around the end of the ring.
+static bool readSnapshot(RingBuffer& ring, u64* buf, StackSnapshot* snapshot) {
+    if (ring.next() == PERF_SAMPLE_REGS_ABI_NONE) {
+        return false;  // no user context, e.g. a sample in a kernel thread
+    }
+
+    u64 regs[3] = {0, 0, 0};
+    for (int reg = 0; reg < 64; reg++) {
+        if (STACK_USER_REGS & (1ULL << reg)) {
+            u64 value = ring.next();
+            regs[reg == PERF_REG_PC ? 0 : reg == PERF_REG_SP ? 1 : 2] = value;
+        }
+    }
+
+    u64 size = ring.next();
+    if (size == 0 || size > RING_POLL_STACK_SIZE) {
+        return false;
+    }
+    ring.read(buf, size);
+    u64 dyn_size = ring.next();
+
+    snapshot->pc = (const void*)regs[0];
+    snapshot->sp = (uintptr_t)regs[1];
+    snapshot->fp = (uintptr_t)regs[2];
+    snapshot->data = (const char*)buf;
+    snapshot->size = dyn_size < size ? dyn_size : size;
+    return snapshot->pc != NULL && snapshot->sp != 0;
+}
+
+// Marks the slot of a thread whose event is about to be created
+bool PerfEvents::reserveThread(int tid) {
+    if (_per_cpu) {
+        return false;  // threads are covered by the per-CPU events
+    }
     if (tid >= _max_events) {
         Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_events);
-        return -1;
+        return false;
     }
 
     PerfEventType* event_type = _event_type;
     if (event_type == NULL) {
-        return -1;
+        return false;
     }
 
     // Mark _events[tid] early to prevent duplicates. Real fd will be put later.
     if (!__sync_bool_compare_and_swap(&_events[tid]._fd, 0, -1)) {
         // Lost race. The event is created either from PerfEvents::start() or from pthread hook.
-        return -1;
+        return false;
     }
+    return true;
+}
 
-    struct perf_event_attr attr = {0};
-    attr.size = sizeof(attr);
-    attr.type = event_type->type;
+void PerfEvents::initAttr(struct perf_event_attr* attr) {
+    PerfEventType* event_type = _event_type;
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->type = event_type->type;
 
-    if (attr.type == PERF_TYPE_BREAKPOINT) {
-        attr.bp_type = event_type->config;
+    if (attr->type == PERF_TYPE_BREAKPOINT) {
+        attr->bp_type = event_type->config;
     } else {
-        attr.config = event_type->config;
+        attr->config = event_type->config;
     }
-    attr.config1 = event_type->config1;
-    attr.config2 = event_type->config2;
+    attr->config1 = event_type->config1;
+    attr->config2 = event_type->config2;
 
     // Hardware events may not always support zero skid
-    if (attr.type == PERF_TYPE_SOFTWARE) {
-        attr.precise_ip = 2;
+    if (attr->type == PERF_TYPE_SOFTWARE) {
+        attr->precise_ip = 2;
+    } else if (_data_addr) {
+        // The data address is only known to precise (PEBS, SPE) samples
+        attr->precise_ip = 1;
     }
 
-    attr.sample_period = _interval;
-    attr.sample_type = PERF_SAMPLE_CALLCHAIN;
-    attr.disabled = 1;
-    attr.wakeup_events = 1;
+    attr->sample_period = _interval;
+    attr->sample_type = PERF_SAMPLE_CALLCHAIN;
+    attr->disabled = 1;
+    attr->wakeup_events = 1;
+    if (_data_addr) {
+        attr->sample_type |= PERF_SAMPLE_ADDR | PERF_SAMPLE_DATA_SRC;
+    }
+    if (_counter_count > 0) {
+        attr->read_format = PERF_FORMAT_GROUP;
+    }
 
-    if (_ring == RING_USER) {
-        attr.exclude_kernel = 1;
+    if (_off_cpu) {
+        setOffCpuAttr(attr);
+    } else if (_ring == RING_USER) {
+        attr->exclude_kernel = 1;
     } else if (_ring == RING_KERNEL) {
-        attr.exclude_user = 1;
+        attr->exclude_user = 1;
     }
 
-    if (_cstack == CSTACK_FP || _cstack == CSTACK_DWARF) {
-        attr.exclude_callchain_user = 1;
+    // A polled ring is read away from the thread, so the kernel has to walk the user stack
+    // and tell the CPU too; PERF_SAMPLE_CPU goes between PERF_SAMPLE_TIME and the callchain
+    if (_poll) {
+        attr->sample_type |= PERF_SAMPLE_CPU;
+    }
+    if (!_poll && (_cstack == CSTACK_FP || _cstack == CSTACK_DWARF)) {
+        attr->exclude_callchain_user = 1;
+    }
+    // The poll task unwinds a copy of the user stack, which the kernel takes instead of walking it
+    if (_stack_user) {
+        attr->sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+        attr->sample_regs_user = STACK_USER_REGS;
+        attr->sample_stack_user = RING_POLL_STACK_SIZE;
+        attr->exclude_callchain_user = 1;
     }
 
 #ifdef PERF_ATTR_SIZE_VER5
-    if (_cstack == CSTACK_LBR) {
-        attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
-        attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
-        attr.sample_regs_user = 1ULL << PERF_REG_PC;
-        attr.exclude_callchain_user = 1;
+    if (!_poll && _cstack == CSTACK_LBR) {
+        attr->sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
+        attr->branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
+        attr->sample_regs_user = 1ULL << PERF_REG_PC;
+        attr->exclude_callchain_user = 1;
     }
 #else
 #warning "Compiling without LBR support. Kernel headers 4.1+ required"
 #endif
+}
+
+int PerfEvents::createForThread(int tid) {
+    if (!reserveThread(tid)) {
+        return _per_cpu ? 0 : -1;
+    }
+
+    if (FdTransferClient::hasPeer() && queueThread(tid)) {
+        return 0;
+    }
+
+    struct perf_event_attr attr;
+    initAttr(&attr);
 
     int fd;
     if (FdTransferClient::hasPeer()) {
@@ -612,15 +819,148 @@ int PerfEvents::createForThread(int tid) {
     } else {
         fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
     }
+    return attachThread(tid, fd, fd == -1 ? errno : 0, &attr);
+}
+
+// fdtransfer: threads started while profiling do not wait for a socket round-trip.
+// Their tids are queued, and the fetcher asks for the fds of everything queued
+// meanwhile in one batch. A thread that ends before its fd arrives is dropped.
+static WaitableMutex _fetch_lock;
+static std::vector<int> _fetch_queue;
+static std::set<int> _fetch_pending;
+static bool _fetch_running = false;
+static std::thread _fetch_thread;
+
+bool PerfEvents::queueThread(int tid) {
+    MutexLocker ml(_fetch_lock);
+    if (!_fetch_running) {
+        return false;
+    }
+    _fetch_queue.push_back(tid);
+    _fetch_pending.insert(tid);
+    _fetch_lock.notify();
+    return true;
+}
+
+// Already reserved threads; returns 0 if any event was created, otherwise the last error
+int PerfEvents::createForThreads(const int* tids, int count) {
+    struct perf_event_attr attr;
+    initAttr(&attr);
+
+    int fds[MAX_PERF_FD_BATCH];
+    int errors[MAX_PERF_FD_BATCH];
+    int result = -1;
+    for (int start = 0; start < count; start += MAX_PERF_FD_BATCH) {
+        int batch = count - start < MAX_PERF_FD_BATCH ? count - start : MAX_PERF_FD_BATCH;
+        if (!FdTransferClient::requestPerfFds(batch, tids + start, &attr, fds, errors)) {
+            // The server takes one tid per request
+            for (int i = 0; i < batch; i++) {
+                int tid = tids[start + i];
+                fds[i] = FdTransferClient::requestPerfFd(&tid, &attr);
+                errors[i] = fds[i] == -1 ? errno : 0;
+            }
+        }
+        for (int i = 0; i < batch; i++) {
+            int err = attachThread(tids[start + i], fds[i], errors[i], &attr);
+            if (result != 0) result = err;
+        }
+    }
+    return result;
+}
+
+void PerfEvents::fetchLoop() {
+    std::vector<int> batch;
+    MutexLocker ml(_fetch_lock);
+    while (_fetch_running) {
+        if (_fetch_queue.empty()) {
+            _fetch_lock.waitUntil(OS::micros() + 100000);
+            continue;
+        }
+
+        batch.clear();
+        for (size_t i = 0; i < _fetch_queue.size() && batch.size() < (size_t)MAX_PERF_FD_BATCH; i++) {
+            int tid = _fetch_queue[i];
+            if (_fetch_pending.find(tid) != _fetch_pending.end()) {
+                batch.push_back(tid);
+            } else {
+                _events[tid]._fd = 0;
+            }
+        }
+        _fetch_queue.clear();
+
+        // Threads queued meanwhile wait for the next batch
+        _fetch_lock.unlock();
+        struct perf_event_attr attr;
+        initAttr(&attr);
+        int fds[MAX_PERF_FD_BATCH];
+        int errors[MAX_PERF_FD_BATCH];
+        int count = (int)batch.size();
+        if (count > 0 && !FdTransferClient::requestPerfFds(count, &batch[0], &attr, fds, errors)) {
+            for (int i = 0; i < count; i++) {
+                int tid = batch[i];
+                fds[i] = FdTransferClient::requestPerfFd(&tid, &attr);
+                errors[i] = fds[i] == -1 ? errno : 0;
+            }
+        }
+        _fetch_lock.lock();
+
+        for (int i = 0; i < count; i++) {
+            int tid = batch[i];
+            if (_fetch_pending.erase(tid) != 0) {
+                attachThread(tid, fds[i], errors[i], &attr);
+            } else {
+                // Ended while the request was in flight
+                if (fds[i] != -1) close(fds[i]);
+                _events[tid]._fd = 0;
+            }
+        }
+    }
+}
+
+void PerfEvents::startFetcher() {
+    MutexLocker ml(_fetch_lock);
+    _fetch_running = true;
+    _fetch_thread = std::thread(fetchLoop);
+}
+
+void PerfEvents::stopFetcher() {
+    {
+        MutexLocker ml(_fetch_lock);
+        if (!_fetch_running) {
+            return;
+        }
+        _fetch_running = false;
+        _fetch_lock.notify();
+    }
+    _fetch_thread.join();
+
+    // Threads still queued get no event; their slots become free again
+    for (size_t i = 0; i < _fetch_queue.size(); i++) {
+        _events[_fetch_queue[i]]._fd = 0;
+    }
+    _fetch_queue.clear();
+    _fetch_pending.clear();
+}
 
+// Takes over the fd created for the thread, or records the failure to create it
+int PerfEvents::attachThread(int tid, int fd, int err, struct perf_event_attr* attr) {
     if (fd == -1) {
-        int err = errno;
         Log::warn("perf_event_open for TID %d failed: %s", tid, strerror(err));
         _events[tid]._fd = 0;
         return err;
     }
 
-    void* page = _use_mmap_page ? mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
+    if (_counter_count > 0) {
+        int err = createCounters(tid, fd, attr);
+        if (err != 0) {
+            close(fd);
+            _events[tid]._fd = 0;
+            return err;
+        }
+    }
+
+    size_t mmap_size = OS::page_size + ringSize(_poll, _stack_user);
+    void* page = _use_mmap_page ? mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
     if (page == MAP_FAILED) {
         Log::warn("perf_event mmap failed: %s", strerror(errno));
         page = NULL;
@@ -629,6 +969,14 @@ int PerfEvents::createForThread(int tid) {
     _events[tid].reset();
     _events[tid]._fd = fd;
     _events[tid]._page = (struct perf_event_mmap_page*)page;
+    _events[tid]._boost_until = 0;
+
+    if (_poll) {
+        // Records are drained by the poll task. No signals: an off-CPU signal would wake up
+        // the sleeping thread, and signal delivery dominates the cost of frequent PMU events.
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        return 0;
+    }
 
     struct f_owner_ex ex;
     ex.type = F_OWNER_TID;
@@ -638,7 +986,7 @@ int PerfEvents::createForThread(int tid) {
     fcntl(fd, F_SETSIG, SIGPROF);
     fcntl(fd, F_SETOWN_EX, &ex);
 
-    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
     ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
 
     return 0;
@@ -648,21 +996,625 @@ void PerfEvents::destroyForThread(int tid) {
     if (tid >= _max_events) {
         return;
     }
+    if (_events[tid]._fd == -1 && FdTransferClient::hasPeer()) {
+        MutexLocker ml(_fetch_lock);
+        _fetch_pending.erase(tid);
+    }
 
     PerfEvent* event = &_events[tid];
     int fd = event->_fd;
     if (fd > 0 && __sync_bool_compare_and_swap(&event->_fd, fd, 0)) {
         ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (_counter_count > 0) {
+            destroyCounters(tid);
+        }
         close(fd);
     }
     if (event->_page != NULL) {
         event->lock();
-        munmap(event->_page, 2 * OS::page_size);
+        munmap(event->_page, OS::page_size + ringSize(_poll, _stack_user));
         event->_page = NULL;
         event->unlock();
     }
 }
 
+// counters=EVENT+EVENT...: followers of the sampled event in one perf group.
+// Must run before the sampled event is looked up, since raw and PMU events share a slot.
+Error PerfEvents::parseCounters(const char* counters) {
+    _counter_count = 0;
+    if (counters == NULL) {
+        return Error::OK;
+    }
+    if (_counter_types == NULL) {
+        _counter_types = new PerfEventType[MAX_GROUP_COUNTERS];
+    }
+
+    char buf[256];
+    strncpy(buf, counters, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+
+    for (char* name = buf; name != NULL && name[0]; ) {
+        char* next = strchr(name, '+');
+        if (next != NULL) {
+            *next++ = 0;
+        }
+        if (_counter_count >= MAX_GROUP_COUNTERS) {
+            return Error("Too many counters");
+        }
+
+        // Breakpoints, tracepoints and probes keep their state in shared slots
+        PerfEventType* type = PerfEventType::forName(name);
+        if (type == NULL || type >= &PerfEventType::AVAILABLE_EVENTS[PerfEventType::IDX_BREAKPOINT]) {
+            return Error("Counters must be hardware, cache, software or raw PMU events");
+        }
+        _counter_types[_counter_count++] = *type;
+        name = next;
+    }
+    return Error::OK;
+}
+
+// Followers count only while the leader is scheduled and are read together with it
+int PerfEvents::createCounters(int tid, int leader, struct perf_event_attr* leader_attr) {
+    int* fds = &_counter_fds[(size_t)tid * _counter_count];
+    for (int i = 0; i < _counter_count; i++) {
+        PerfEventType* type = &_counter_types[i];
+
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = type->type;
+        attr.config = type->config;
+        attr.config1 = type->config1;
+        attr.config2 = type->config2;
+        attr.exclude_kernel = leader_attr->exclude_kernel;
+        attr.exclude_user = leader_attr->exclude_user;
+
+        int fd = syscall(__NR_perf_event_open, &attr, tid, -1, leader, 0);
+        if (fd == -1) {
+            int err = errno;
+            Log::warn("perf_event_open of counter %s for TID %d failed: %s", type->name, tid, strerror(err));
+            destroyCounters(tid);
+            return err;
+        }
+        fds[i] = fd;
+    }
+    return 0;
+}
+
+void PerfEvents::destroyCounters(int tid) {
+    int* fds = &_counter_fds[(size_t)tid * _counter_count];
+    for (int i = 0; i < _counter_count; i++) {
+        if (fds[i] > 0) {
+            close(fds[i]);
+            fds[i] = 0;
+        }
+    }
+}
+
+// boost=N: the application asks for a short window of dense sampling of the current
+// thread, e.g. when a span turns out to be slow. Each window holds one of boostmax
+// slots until it ends, which bounds the extra samples across the process.
+// The thread goes back to the normal period at its first sample after the window.
+bool PerfEvents::boostThread(int tid, u64 duration) {
+    if (_boost_interval == 0 || !_enabled || tid >= _max_events || duration == 0) {
+        return false;
+    }
+    if (duration > MAX_BOOST_DURATION_NS) {
+        duration = MAX_BOOST_DURATION_NS;
+    }
+
+    PerfEvent* event = &_events[tid];
+    if (!event->tryLock()) {
+        return false;  // the event is being destroyed
+    }
+
+    u64 now = OS::nanotime();
+    bool boosted = false;
+    if (event->_fd <= 0) {
+        // No event for this thread
+    } else if (event->_boost_until > now) {
+        boosted = true;  // already in a window
+    } else {
+        for (int i = 0; i < _boost_max; i++) {
+            u64 until = _boost_windows[i];
+            if (until <= now && __sync_bool_compare_and_swap(&_boost_windows[i], until, now + duration)) {
+                event->_boost_until = now + duration;
+                u64 period = _boost_interval;
+                ioctl(event->_fd, PERF_EVENT_IOC_PERIOD, &period);
+                boosted = true;
+                break;
+            }
+        }
+        if (!boosted) {
+            atomicInc(_boost_rejected);
+        }
+    }
+
+    event->unlock();
+    return boosted;
+}
+
+// Threads in a capture window keep the boost period until it ends
+bool PerfEvents::setInterval(long interval) {
+    if (_off_cpu) {
+        return false;  // interval is the shortest reported off-CPU or run-queue time
+    }
+    _interval = interval;
+
+    u64 period = interval;
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        if (_cpu_events[cpu]._fd > 0) {
+            ioctl(_cpu_events[cpu]._fd, PERF_EVENT_IOC_PERIOD, &period);
+        }
+    }
+    for (int tid = 0; tid < _max_events && !_per_cpu; tid++) {
+        PerfEvent* event = &_events[tid];
+        if (event->_fd > 0 && event->_boost_until == 0 && event->tryLock()) {
+            if (event->_fd > 0) {
+                ioctl(event->_fd, PERF_EVENT_IOC_PERIOD, &period);
+            }
+            event->unlock();
+        }
+    }
+    return true;
+}
+
+void PerfEvents::endBoost(int tid, int fd) {
+    if (tid >= _max_events) {
+        return;
+    }
+    PerfEvent* event = &_events[tid];
+    u64 until = event->_boost_until;
+    if (until != 0 && OS::nanotime() >= until && __sync_bool_compare_and_swap(&event->_boost_until, until, 0)) {
+        u64 period = _interval;
+        ioctl(fd, PERF_EVENT_IOC_PERIOD, &period);
+    }
+}
+
+// percpu: one system-wide event per CPU; samples of other processes are dropped by pid.
+// The number of descriptors does not grow with threads, but system-wide
+// events need perf_event_paranoid <= 0 or CAP_PERFMON.
+Error PerfEvents::createForCpus() {
+    PerfEventType* event_type = _event_type;
+    _cpu_count = OS::cpuCount();
+    _cpu_events = (PerfEvent*)calloc(_cpu_count, sizeof(PerfEvent));
+
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = event_type->type;
+
+    if (attr.type == PERF_TYPE_BREAKPOINT) {
+        attr.bp_type = event_type->config;
+    } else {
+        attr.config = event_type->config;
+    }
+    attr.config1 = event_type->config1;
+    attr.config2 = event_type->config2;
+
+    attr.sample_period = _interval;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.disabled = 1;
+
+    if (_ring == RING_USER) {
+        attr.exclude_kernel = 1;
+    } else if (_ring == RING_KERNEL) {
+        attr.exclude_user = 1;
+    }
+
+    size_t mmap_size = OS::page_size + PERCPU_RING_PAGES * OS::page_size;
+    int opened = 0;
+    int err = 0;
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, 0);
+        if (fd == -1) {
+            // Offline CPUs cannot be opened
+            err = errno;
+            continue;
+        }
+
+        void* page = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (page == MAP_FAILED) {
+            Log::warn("perf_event mmap failed: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        _cpu_events[cpu].reset();
+        _cpu_events[cpu]._fd = fd;
+        _cpu_events[cpu]._page = (struct perf_event_mmap_page*)page;
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        opened++;
+    }
+
+    if (opened == 0) {
+        destroyForCpus();
+        if (err == EACCES || err == EPERM) {
+            return Error("No access to system-wide perf events. Try 'sysctl kernel.perf_event_paranoid=0'");
+        }
+        return Error("Perf events unavailable");
+    }
+    return Error::OK;
+}
+
+void PerfEvents::destroyForCpus() {
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        PerfEvent* event = &_cpu_events[cpu];
+        if (event->_fd > 0) {
+            ioctl(event->_fd, PERF_EVENT_IOC_DISABLE, 0);
+            close(event->_fd);
+            munmap(event->_page, OS::page_size + PERCPU_RING_PAGES * OS::page_size);
+        }
+    }
+    free(_cpu_events);
+    _cpu_events = NULL;
+    _cpu_count = 0;
+}
+
+// runq: a thread is woken up in the context of the waker, often outside of the
+// process, so sched_wakeup is traced on every CPU and the woken tid is taken from
+// the raw record. The rings take the place of the percpu ones.
+Error PerfEvents::createWakeupEvents() {
+    _wakeup_tracepoint = findTracepointId("sched:sched_wakeup");
+    _wakeup_pid_offset = findTracepointField("sched:sched_wakeup", "pid");
+    if (_wakeup_tracepoint <= 0 || _wakeup_pid_offset < 0) {
+        return Error("sched:sched_wakeup tracepoint is not available");
+    }
+
+    _cpu_count = OS::cpuCount();
+    _cpu_events = (PerfEvent*)calloc(_cpu_count, sizeof(PerfEvent));
+
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = _wakeup_tracepoint;
+    attr.sample_period = 1;
+    attr.sample_type = PERF_SAMPLE_TIME | PERF_SAMPLE_RAW;
+    attr.use_clockid = 1;
+    attr.clockid = CLOCK_MONOTONIC;
+
+    size_t mmap_size = OS::page_size + PERCPU_RING_PAGES * OS::page_size;
+    int opened = 0;
+    int err = 0;
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, 0);
+        if (fd == -1) {
+            err = errno;
+            continue;
+        }
+
+        void* page = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (page == MAP_FAILED) {
+            Log::warn("perf_event mmap failed: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        _cpu_events[cpu].reset();
+        _cpu_events[cpu]._fd = fd;
+        _cpu_events[cpu]._page = (struct perf_event_mmap_page*)page;
+        opened++;
+    }
+
+    if (opened == 0) {
+        destroyForCpus();
+        if (err == EACCES || err == EPERM) {
+            return Error("runq traces wakeups system-wide. Try 'sysctl kernel.perf_event_paranoid=0'");
+        }
+        return Error("Perf events unavailable");
+    }
+    return Error::OK;
+}
+
+// Record: time, then the raw tracepoint data prefixed by its u32 size
+void PerfEvents::pollWakeups(RingPollTask* task) {
+    size_t pid_end = sizeof(u32) + _wakeup_pid_offset + sizeof(u32);
+    u64 raw[8];
+    if (pid_end > sizeof(raw)) {
+        return;
+    }
+    size_t raw_len = (pid_end + sizeof(u64) - 1) & ~(sizeof(u64) - 1);
+
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        struct perf_event_mmap_page* page = _cpu_events[cpu]._page;
+        if (page == NULL) {
+            continue;
+        }
+
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page, PERCPU_RING_PAGES * OS::page_size);
+
+        while (tail < head) {
+            struct perf_event_header* hdr = ring.seek(tail);
+            if (hdr->type == PERF_RECORD_SAMPLE && hdr->size >= sizeof(*hdr) + sizeof(u64) + raw_len) {
+                u64 time = ring.next();
+                ring.read(raw, raw_len);
+                int tid = *(int*)((char*)raw + sizeof(u32) + _wakeup_pid_offset);
+                // Only the threads of this process have events
+                if (tid > 0 && tid < _max_events && _events[tid]._fd > 0) {
+                    OffCpuState& state = task->_states[tid];
+                    state.wakeups[state.next_wakeup] = time;
+                    state.next_wakeup = (state.next_wakeup + 1) % RUN_QUEUE_WAKEUPS;
+                }
+            }
+            tail += hdr->size;
+        }
+
+        __atomic_store_n(&page->data_tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+void PerfEvents::pollCpuRings(RingPollTask* task) {
+    int pid = OS::processId();
+
+    for (int cpu = 0; cpu < _cpu_count; cpu++) {
+        struct perf_event_mmap_page* page = _cpu_events[cpu]._page;
+        if (page == NULL) {
+            continue;
+        }
+
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page, PERCPU_RING_PAGES * OS::page_size);
+
+        while (tail < head) {
+            struct perf_event_header* hdr = ring.seek(tail);
+            if (hdr->type == PERF_RECORD_SAMPLE) {
+                u64 pid_tid = ring.next();
+                if ((int)(u32)pid_tid == pid) {
+                    int depth = 0;
+                    for (u64 nr = ring.next(); nr > 0; nr--) {
+                        u64 ip = ring.next();
+                        if (ip < PERF_CONTEXT_MAX && depth < RING_POLL_MAX_FRAMES) {
+                            task->_pcs[depth++] = (const void*)ip;
+                        }
+                    }
+                    if (_enabled) {
+                        SampleEvent sample;
+                        sample._cpu = cpu;
+                        Profiler::instance()->printRingSample((int)(pid_tid >> 32), depth, task->_pcs, _interval, &sample);
+                    }
+                }
+            }
+            tail += hdr->size;
+        }
+
+        __atomic_store_n(&page->data_tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+void PerfEvents::setOffCpuAttr(struct perf_event_attr* attr) {
+    // Every switch out is sampled with its user stack; the kernel adds
+    // a PERF_RECORD_SWITCH record when the thread is switched in again
+    attr->sample_period = 1;
+    attr->sample_type = PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN;
+    attr->exclude_callchain_kernel = 1;
+    attr->sample_id_all = 1;
+    attr->use_clockid = 1;
+    attr->clockid = CLOCK_MONOTONIC;
+#ifdef PERF_RECORD_MISC_SWITCH_OUT
+    attr->context_switch = 1;
+#endif
+}
+
+void PerfEvents::pollRings(RingPollTask* task) {
+    if (_per_cpu) {
+        pollCpuRings(task);
+        return;
+    }
+
+    int self = OS::threadId();
+    std::vector<int>& tids = task->_tids;
+    tids.clear();
+    Profiler::instance()->threadRegistry()->collect(tids);
+
+    // Forget the threads that are gone
+    for (std::map<int, OffCpuState>::iterator it = task->_states.begin(); it != task->_states.end(); ) {
+        if (!std::binary_search(tids.begin(), tids.end(), it->first)) {
+            task->_states.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    // runq: switch ins up to the horizon are matched with the wakeups read here,
+    // the later ones are left in the ring for the next poll
+    u64 horizon = 0;
+    if (_run_queue) {
+        horizon = OS::nanotime();
+        pollWakeups(task);
+    }
+
+    for (size_t i = 0; i < tids.size(); i++) {
+        int tid = tids[i];
+        if (tid == self || tid >= _max_events || _events[tid]._fd <= 0) {
+            continue;
+        }
+
+        PerfEvent* event = &_events[tid];
+        if (!event->tryLock()) {
+            continue;  // the event is being destroyed
+        }
+
+        struct perf_event_mmap_page* page = event->_page;
+        if (page == NULL) {
+            event->unlock();
+            continue;
+        }
+
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page, ringSize(true, _stack_user));
+        OffCpuState* state = NULL;
+
+        while (tail < head) {
+            struct perf_event_header* hdr = ring.seek(tail);
+            if (hdr->type == PERF_RECORD_SAMPLE && !_off_cpu) {
+                SampleEvent sample;
+                sample._cpu = (int)(u32)ring.next();
+                int depth = 0;
+                for (u64 nr = ring.next(); nr > 0; nr--) {
+                    u64 ip = ring.next();
+                    if (ip < PERF_CONTEXT_MAX && depth < RING_POLL_MAX_FRAMES) {
+                        task->_pcs[depth++] = (const void*)ip;
+                    }
+                }
+                StackSnapshot snapshot;
+                bool has_snapshot = _stack_user && readSnapshot(ring, task->_stack, &snapshot);
+                if (_enabled) {
+                    Profiler::instance()->printRingSample(tid, depth, task->_pcs, _interval, &sample,
+                                                          has_snapshot ? &snapshot : NULL);
+                }
+            } else if (hdr->type == PERF_RECORD_SAMPLE) {
+                if (state == NULL) state = &task->_states[tid];
+                state->switch_out = ring.next();
+                state->cpu = (int)(u32)ring.next();
+                state->depth = 0;
+                for (u64 nr = ring.next(); nr > 0; nr--) {
+                    u64 ip = ring.next();
+                    if (ip < PERF_CONTEXT_MAX && state->depth < RING_POLL_MAX_FRAMES) {
+                        state->pcs[state->depth++] = (const void*)ip;
+                    }
+                }
+#ifdef PERF_RECORD_MISC_SWITCH_OUT
+            } else if (hdr->type == PERF_RECORD_SWITCH && !(hdr->misc & PERF_RECORD_MISC_SWITCH_OUT)) {
+                if (_run_queue && ring.peek(1) >= horizon) {
+                    break;  // its wakeup may not have been read yet
+                }
+                if (state == NULL) state = &task->_states[tid];
+                u64 switch_in = ring.next();
+                // runq: the time runnable, since the wakeup or, if preempted, since the switch out
+                u64 since = state->switch_out;
+                if (_run_queue) {
+                    for (int w = 0; w < RUN_QUEUE_WAKEUPS; w++) {
+                        u64 wakeup = state->wakeups[w];
+                        if (wakeup > since && wakeup < switch_in) since = wakeup;
+                    }
+                }
+                u64 duration = switch_in - since;
+                if (_run_queue && state->switch_out != 0 && switch_in > since && _enabled) {
+                    recordRunQueueDelay(task, tid, duration);
+                }
+                if (state->switch_out != 0 && switch_in > since && duration >= (u64)_interval && _enabled) {
+                    SampleEvent off_cpu;
+                    // Rings are stamped with CLOCK_MONOTONIC, Kindling streams with KdClock
+                    off_cpu._timestamp = KdClock::now() - KdClock::fromNanos(OS::nanotime() - switch_in);
+                    off_cpu._duration = duration;
+                    off_cpu._cpu = state->cpu;
+                    if (!_run_queue) {
+                        off_cpu._address = LockTracer::blockedOn(tid, off_cpu._timestamp - KdClock::fromNanos(duration),
+                                                                 off_cpu._timestamp);
+                    }
+                    Profiler::instance()->printRingSample(tid, state->depth, state->pcs, duration, &off_cpu);
+                }
+                state->switch_out = 0;
+#endif
+            } else if (hdr->type == PERF_RECORD_LOST && state != NULL) {
+                state->switch_out = 0;
+            }
+            tail += hdr->size;
+        }
+
+        __atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
+        if (_boost_interval != 0) {
+            endBoost(tid, event->_fd);
+        }
+        event->unlock();
+    }
+
+    if (_run_queue && KdClock::toNanos(KdClock::now() - task->_last_report) >= RUN_QUEUE_REPORT_INTERVAL * 1000000000LL) {
+        reportRunQueue(task);
+    }
+}
+
+void PerfEvents::recordRunQueueDelay(RingPollTask* task, int tid, u64 delay) {
+    std::map<int, RunQueueHistogram>::iterator it = task->_run_queue.find(tid);
+    if (it == task->_run_queue.end()) {
+        it = task->_run_queue.insert(std::make_pair(tid, RunQueueHistogram())).first;
+        RunQueueHistogram& h = it->second;
+        memset(&h, 0, sizeof(h));
+
+        char name[64];
+        if (!OS::threadName(tid, name, sizeof(name))) {
+            strcpy(name, "[unknown]");
+        }
+        OS::threadGroup(name, h.group, sizeof(h.group));
+    }
+
+    RunQueueHistogram& h = it->second;
+    h.count++;
+    h.total_ns += delay;
+    if (delay > h.max_ns) h.max_ns = delay;
+    h.buckets[LatencyStats::bucket(delay / 1000)]++;
+}
+
+// kd-rqh@time!interval!group!count!total_ns!max_ns!p50_ns!p99_ns!us:count,...!
+// One record per thread group with delays since the previous report
+void PerfEvents::reportRunQueue(RingPollTask* task) {
+    jlong now = KdClock::now();
+    jlong interval = KdClock::toNanos(now - task->_last_report);
+    task->_last_report = now;
+
+    std::map<std::string, RunQueueHistogram> groups;
+    for (std::map<int, RunQueueHistogram>::const_iterator it = task->_run_queue.begin(); it != task->_run_queue.end(); ++it) {
+        const RunQueueHistogram& h = it->second;
+        std::map<std::string, RunQueueHistogram>::iterator g = groups.find(h.group);
+        if (g == groups.end()) {
+            groups.insert(std::make_pair(std::string(h.group), h));
+            continue;
+        }
+        RunQueueHistogram& sum = g->second;
+        sum.count += h.count;
+        sum.total_ns += h.total_ns;
+        if (h.max_ns > sum.max_ns) sum.max_ns = h.max_ns;
+        for (int j = 0; j < LATENCY_BUCKETS; j++) {
+            sum.buckets[j] += h.buckets[j];
+        }
+    }
+    // Threads keep their group; the counts start over
+    for (std::map<int, RunQueueHistogram>::iterator it = task->_run_queue.begin(); it != task->_run_queue.end(); ) {
+        if (task->_states.find(it->first) == task->_states.end()) {
+            task->_run_queue.erase(it++);
+        } else {
+            RunQueueHistogram& h = it->second;
+            h.count = h.total_ns = h.max_ns = 0;
+            memset(h.buckets, 0, sizeof(h.buckets));
+            ++it;
+        }
+    }
+
+    for (std::map<std::string, RunQueueHistogram>::const_iterator g = groups.begin(); g != groups.end(); ++g) {
+        const RunQueueHistogram& h = g->second;
+        if (h.count == 0) continue;
+
+        char bucket_list[320];
+        size_t len = 0;
+        u64 p50 = 0, p99 = 0, seen = 0;
+        bucket_list[0] = 0;
+        for (int j = 0; j < LATENCY_BUCKETS; j++) {
+            if (h.buckets[j] == 0) continue;
+            seen += h.buckets[j];
+            u64 limit = LatencyStats::bucketLimit(j);
+            if (p50 == 0 && seen * 2 >= h.count) p50 = limit * 1000;
+            if (p99 == 0 && seen * 100 >= h.count * 99) p99 = limit * 1000;
+            if (len < sizeof(bucket_list) - 1) {
+                int n = snprintf(bucket_list + len, sizeof(bucket_list) - len, len == 0 ? "%llu:%u" : ",%llu:%u",
+                                 (unsigned long long)limit, h.buckets[j]);
+                if (n > 0) len += n;
+            }
+        }
+
+        EventLogger::log("kd-rqh@%ld!%ld!%s!%llu!%llu!%llu!%llu!%llu!%s!", now, interval, g->first.c_str(),
+                         (unsigned long long)h.count, (unsigned long long)h.total_ns, (unsigned long long)h.max_ns,
+                         (unsigned long long)p50, (unsigned long long)p99, bucket_list);
+    }
+}
+
 u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     switch (_event_type->counter_arg) {
         case 1: return StackFrame(ucontext).arg0();
@@ -676,22 +1628,83 @@ u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     }
 }
 
+// With counters=..., the leader is read as a group: nr, the leader value, then
+// the followers. Resetting the whole group makes every value a per-sample delta.
+u64 PerfEvents::readGroup(siginfo_t* siginfo, void* ucontext, SampleEvent* event) {
+    u64 values[2 + MAX_GROUP_COUNTERS];
+    ssize_t bytes = read(siginfo->si_fd, values, sizeof(values));
+    if (bytes < (ssize_t)(2 * sizeof(u64)) || values[0] != (u64)(_counter_count + 1)) {
+        return 1;
+    }
+
+    event->_counter_count = _counter_count;
+    for (int i = 0; i < _counter_count; i++) {
+        event->_counters[i] = values[2 + i];
+    }
+    return _event_type->counter_arg != 0 ? readCounter(siginfo, ucontext) : values[1];
+}
+
+// dataaddr: a sample record begins with the data address, and its data source
+// follows the callchain. The record is left in the ring for walk() unless cstack=no.
+void PerfEvents::readDataAddress(int tid, SampleEvent* event) {
+    PerfEvent* perf_event = &_events[tid];
+    if (!perf_event->tryLock()) {
+        return;  // the event is being destroyed
+    }
+
+    struct perf_event_mmap_page* page = perf_event->_page;
+    if (page != NULL) {
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page);
+
+        while (tail < head) {
+            struct perf_event_header* hdr = ring.seek(tail);
+            if (hdr->type == PERF_RECORD_SAMPLE) {
+                event->_data_address = ring.next();
+                u64 nr = ring.next();
+                event->_data_source = ring.peek(nr + 1);
+                break;
+            }
+            tail += hdr->size;
+        }
+        if (_cstack == CSTACK_NO) {
+            page->data_tail = head;  // walk() will not run
+        }
+    }
+
+    perf_event->unlock();
+}
+
 void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     if (siginfo->si_code <= 0) {
         // Looks like an external signal; don't treat as a profiling event
         return;
     }
 
-    if (_enabled) {
+    if (_enabled && (_counter_count > 0 || _data_addr)) {
+        SampleEvent event;
+        u64 counter = _counter_count > 0 ? readGroup(siginfo, ucontext, &event) : readCounter(siginfo, ucontext);
+        if (_data_addr) {
+            readDataAddress(ProfiledThread::currentTid(), &event);
+        }
+        Profiler::instance()->printSample(ucontext, counter, &event);
+    } else if (_enabled) {
         u64 counter = readCounter(siginfo, ucontext);
         // ExecutionEvent event;
         // Profiler::instance()->recordSample(ucontext, counter, 0, &event);
         Profiler::instance()->printSample(ucontext, counter);
     } else {
-        resetBuffer(OS::threadId());
+        resetBuffer(ProfiledThread::currentTid());
     }
 
-    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
+    if (_boost_interval != 0) {
+        endBoost(ProfiledThread::currentTid(), siginfo->si_fd);
+    }
+
+    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, 1);
 }
 
@@ -705,10 +1718,10 @@ void PerfEvents::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext)
         u64 counter = readCounter(siginfo, ucontext);
         J9StackTraceNotification notif;
         StackContext java_ctx;
-        notif.num_frames = _cstack == CSTACK_NO ? 0 : walk(OS::threadId(), ucontext, notif.addr, MAX_J9_NATIVE_FRAMES, &java_ctx);
+        notif.num_frames = _cstack == CSTACK_NO ? 0 : walk(ProfiledThread::currentTid(), ucontext, notif.addr, MAX_J9_NATIVE_FRAMES, &java_ctx);
         J9StackTraces::checkpoint(counter, &notif);
     } else {
-        resetBuffer(OS::threadId());
+        resetBuffer(ProfiledThread::currentTid());
     }
 
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
@@ -716,7 +1729,11 @@ void PerfEvents::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext)
 }
 
 const char* PerfEvents::title() {
-    if (_event_type == NULL || _event_type->name == EVENT_CPU) {
+    if (_run_queue) {
+        return "Run queue latency";
+    } else if (_off_cpu) {
+        return "Off-CPU profile";
+    } else if (_event_type == NULL || _event_type->name == EVENT_CPU) {
         return "CPU profile";
     } else if (_event_type->type == PERF_TYPE_SOFTWARE || _event_type->type == PERF_TYPE_HARDWARE || _event_type->type == PERF_TYPE_HW_CACHE) {
         return _event_type->name;
@@ -726,7 +1743,7 @@ const char* PerfEvents::title() {
 }
 
 const char* PerfEvents::units() {
-    return _event_type == NULL || _event_type->name == EVENT_CPU ? "ns" : "total";
+    return _event_type == NULL || _event_type->name == EVENT_CPU || _off_cpu ? "ns" : "total";
 }
 
 Error PerfEvents::check(Arguments& args) {
@@ -737,7 +1754,7 @@ Error PerfEvents::check(Arguments& args) {
         return Error("Only arguments 1-4 can be counted");
     }
 
-    if (_pthread_entry == NULL && (_pthread_entry = lookupThreadEntry()) == NULL) {
+    if (!ThreadHook::initialize()) {
         return Error("Could not set pthread hook");
     }
 
@@ -756,8 +1773,16 @@ Error PerfEvents::check(Arguments& args) {
     attr.sample_period = event_type->default_interval;
     attr.sample_type = PERF_SAMPLE_CALLCHAIN;
     attr.disabled = 1;
+    if (args._data_addr && attr.type != PERF_TYPE_SOFTWARE) {
+        attr.sample_type |= PERF_SAMPLE_ADDR | PERF_SAMPLE_DATA_SRC;
+        attr.precise_ip = 1;
+    }
 
-    if (args._ring == RING_USER) {
+    bool off_cpu = event_type->name == EVENT_OFFCPU || event_type->name == EVENT_RUNQ;
+    bool poll = off_cpu || args._perf_poll || args._per_cpu;
+    if (off_cpu) {
+        setOffCpuAttr(&attr);
+    } else if (args._ring == RING_USER) {
         attr.exclude_kernel = 1;
     } else if (args._ring == RING_KERNEL) {
         attr.exclude_user = 1;
@@ -766,12 +1791,18 @@ Error PerfEvents::check(Arguments& args) {
         attr.exclude_kernel = Symbols::haveKernelSymbols() ? 0 : 1;
     }
 
-    if (_cstack == CSTACK_FP || _cstack == CSTACK_DWARF) {
+    if (!poll && (_cstack == CSTACK_FP || _cstack == CSTACK_DWARF)) {
+        attr.exclude_callchain_user = 1;
+    }
+    if (poll && !off_cpu && !args._per_cpu && args._cstack == CSTACK_DWARF) {
+        attr.sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+        attr.sample_regs_user = STACK_USER_REGS;
+        attr.sample_stack_user = RING_POLL_STACK_SIZE;
         attr.exclude_callchain_user = 1;
     }
 
 #ifdef PERF_ATTR_SIZE_VER5
-    if (args._cstack == CSTACK_LBR) {
+    if (!poll && args._cstack == CSTACK_LBR) {
         attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
         attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
         attr.sample_regs_user = 1ULL << PERF_REG_PC;
@@ -789,6 +1820,11 @@ Error PerfEvents::check(Arguments& args) {
 }
 
 Error PerfEvents::start(Arguments& args) {
+    Error error = parseCounters(args._counters);
+    if (error) {
+        return error;
+    }
+
     _event_type = PerfEventType::forName(args._event);
     if (_event_type == NULL) {
         return Error("Unsupported event type");
@@ -796,7 +1832,7 @@ Error PerfEvents::start(Arguments& args) {
         return Error("Only arguments 1-4 can be counted");
     }
 
-    if (_pthread_entry == NULL && (_pthread_entry = lookupThreadEntry()) == NULL) {
+    if (!ThreadHook::initialize()) {
         return Error("Could not set pthread hook");
     }
 
@@ -813,7 +1849,40 @@ Error PerfEvents::start(Arguments& args) {
         _ring = RING_USER;
     }
     _cstack = args._cstack;
-    _use_mmap_page = _cstack != CSTACK_NO && (_ring != RING_USER || _cstack == CSTACK_DEFAULT || _cstack == CSTACK_LBR);
+    // runq is offcpu with the time before the switch in that the thread was runnable
+    _off_cpu = _event_type->name == EVENT_OFFCPU || _event_type->name == EVENT_RUNQ;
+    _run_queue = _event_type->name == EVENT_RUNQ;
+    _per_cpu = args._per_cpu;
+    _poll = _off_cpu || _per_cpu || args._perf_poll;
+    // Per-CPU rings are shared by many threads and off-CPU records are taken at switch out;
+    // both keep the callchain of the kernel
+    _stack_user = _poll && !_off_cpu && !_per_cpu && _cstack == CSTACK_DWARF;
+    if (_off_cpu && VM::isOpenJ9()) {
+        return Error("offcpu is not supported on OpenJ9");
+    } else if (_poll && VM::isOpenJ9()) {
+        return Error("perfpoll is not supported on OpenJ9");
+    } else if (_per_cpu && (_off_cpu || FdTransferClient::hasPeer())) {
+        return Error("percpu cannot be combined with offcpu or fdtransfer");
+    } else if (_counter_count > 0 && (_poll || FdTransferClient::hasPeer() || VM::isOpenJ9())) {
+        return Error("counters are read in the signal handler; not supported with offcpu, perfpoll, percpu, fdtransfer or OpenJ9");
+    }
+
+    _boost_interval = _per_cpu || _off_cpu ? 0 : args._boost_interval;
+    _boost_max = args._boost_max < MAX_BOOST_WINDOWS ? args._boost_max : MAX_BOOST_WINDOWS;
+    _boost_rejected = 0;
+    memset((void*)_boost_windows, 0, sizeof(_boost_windows));
+    if (args._boost_interval != 0 && _boost_interval == 0) {
+        Log::warn("boost is ignored with percpu and offcpu");
+    }
+
+    _data_addr = args._data_addr;
+    if (_data_addr && (_poll || VM::isOpenJ9() || _cstack == CSTACK_LBR)) {
+        return Error("dataaddr is not supported with offcpu, perfpoll, percpu, cstack=lbr or OpenJ9");
+    } else if (_data_addr && _event_type->type == PERF_TYPE_SOFTWARE) {
+        return Error("dataaddr needs a hardware memory event, e.g. cpu/mem-loads,ldlat=30/");
+    }
+    // Polled stacks come from the ring only; for offcpu, interval is the shortest reported time off CPU
+    _use_mmap_page = _poll || _data_addr || (_cstack != CSTACK_NO && (_ring != RING_USER || _cstack == CSTACK_DEFAULT || _cstack == CSTACK_LBR));
 
     int max_events = OS::getMaxThreadId();
     if (max_events != _max_events) {
@@ -822,6 +1891,9 @@ Error PerfEvents::start(Arguments& args) {
         _max_events = max_events;
     }
 
+    free(_counter_fds);
+    _counter_fds = _counter_count > 0 ? (int*)calloc((size_t)max_events * _counter_count, sizeof(int)) : NULL;
+
     if (VM::isOpenJ9()) {
         if (_cstack == CSTACK_DEFAULT) _cstack = CSTACK_DWARF;
         OS::installSignalHandler(SIGPROF, signalHandlerJ9);
@@ -833,37 +1905,93 @@ Error PerfEvents::start(Arguments& args) {
         OS::installSignalHandler(SIGPROF, signalHandler);
     }
 
+    if (_per_cpu) {
+        Error error = createForCpus();
+        if (error) {
+            return error;
+        }
+        _poll_task = new RingPollTask();
+        _poll_thread = std::thread([&]{
+            _poll_task->run();
+        });
+        return Error::OK;
+    }
+
+    if (_run_queue) {
+        Error error = createWakeupEvents();
+        if (error) {
+            return error;
+        }
+    }
+
     // Enable pthread hook before traversing currently running threads
-    __atomic_store_n(_pthread_entry, (void*)pthread_setspecific_hook, __ATOMIC_RELEASE);
+    ThreadHook::enable(perfThreadStart, perfThreadEnd);
 
     // Create perf_events for all existing threads
     int err;
     bool created = false;
-    ThreadList* thread_list = OS::listThreads();
-    for (int tid; (tid = thread_list->next()) != -1; ) {
-        if ((err = createForThread(tid)) == 0) {
-            created = true;
+    ThreadRegistry* registry = Profiler::instance()->threadRegistry();
+    registry->scan();
+    ThreadList* thread_list = registry->listThreads();
+    if (FdTransferClient::hasPeer()) {
+        // All existing threads in as few round-trips as possible
+        std::vector<int> tids;
+        for (int tid; (tid = thread_list->next()) != -1; ) {
+            if (reserveThread(tid)) {
+                tids.push_back(tid);
+            }
+        }
+        err = tids.empty() ? -1 : createForThreads(&tids[0], (int)tids.size());
+        created = err == 0;
+        startFetcher();
+    } else {
+        for (int tid; (tid = thread_list->next()) != -1; ) {
+            if ((err = createForThread(tid)) == 0) {
+                created = true;
+            }
         }
     }
     delete thread_list;
 
     if (!created) {
-        __atomic_store_n(_pthread_entry, (void*)pthread_setspecific, __ATOMIC_RELEASE);
+        ThreadHook::disable();
+        stopFetcher();
         J9StackTraces::stop();
+        if (_cpu_events != NULL) {
+            destroyForCpus();
+        }
         if (err == EACCES || err == EPERM) {
             return Error("No access to perf events. Try --fdtransfer or --all-user option or 'sysctl kernel.perf_event_paranoid=1'");
         } else {
             return Error("Perf events unavailable");
         }
     }
+
+    if (_poll) {
+        _poll_task = new RingPollTask();
+        _poll_thread = std::thread([&]{
+            _poll_task->run();
+        });
+    }
     return Error::OK;
 }
 
 void PerfEvents::stop() {
-    __atomic_store_n(_pthread_entry, (void*)pthread_setspecific, __ATOMIC_RELEASE);
+    _boost_interval = 0;
+    ThreadHook::disable();
+    stopFetcher();
+    if (_poll_task != NULL) {
+        _poll_task->stop();
+        _poll_thread.join();
+        delete _poll_task;
+        _poll_task = NULL;
+    }
     for (int i = 0; i < _max_events; i++) {
         destroyForThread(i);
     }
+    if (_cpu_events != NULL) {
+        destroyForCpus();
+    }
     J9StackTraces::stop();
 }
 
@@ -886,6 +2014,9 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
         while (tail < head) {
             struct perf_event_header* hdr = ring.seek(tail);
             if (hdr->type == PERF_RECORD_SAMPLE) {
+                if (_data_addr) {
+                    ring.next();  // PERF_SAMPLE_ADDR precedes the callchain
+                }
                 u64 nr = ring.next();
                 while (nr-- > 0) {
                     u64 ip = ring.next();
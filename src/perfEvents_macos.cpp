@@ -26,6 +26,7 @@ long PerfEvents::_interval;
 Ring PerfEvents::_ring;
 CStack PerfEvents::_cstack;
 bool PerfEvents::_use_mmap_page;
+volatile u64 PerfEvents::_boost_rejected = 0;
 
 u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     return 0;
@@ -78,4 +79,12 @@ int PerfEvents::createForThread(int tid) {
 void PerfEvents::destroyForThread(int tid) {
 }
 
+bool PerfEvents::boostThread(int tid, u64 duration) {
+    return false;
+}
+
+bool PerfEvents::setInterval(long interval) {
+    return false;
+}
+
 #endif // __APPLE__
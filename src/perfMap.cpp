@@ -0,0 +1,242 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "perfMap.h"
+#include "codeCache.h"
+#include "frameName.h"
+#include "log.h"
+#include "memoryBudget.h"
+#include "profiler.h"
+#include "vmEntry.h"
+#include "vmStructs.h"
+
+
+Mutex PerfMap::_lock;
+std::vector<PerfMapUpdate> PerfMap::_updates;
+std::map<const void*, PerfMapEntry> PerfMap::_live;
+u32 PerfMap::_dead = 0;
+char PerfMap::_path[PATH_MAX];
+int PerfMap::_fd = -1;
+volatile bool PerfMap::_active = false;
+bool PerfMap::_load_events = false;
+FrameName* PerfMap::_frame_name = NULL;
+PerfMapTask* PerfMap::_task = NULL;
+
+static u64 perfMapEntrySize(const PerfMapEntry& entry) {
+    return sizeof(PerfMapEntry) + MAP_NODE_OVERHEAD + entry.name.size();
+}
+
+Error PerfMap::start(Arguments& args, const CodeCache* stubs) {
+    if (args._perf_map[0] != 0) {
+        snprintf(_path, sizeof(_path), "%s", args._perf_map);
+    } else {
+        snprintf(_path, sizeof(_path), "/tmp/perf-%d.map", getpid());
+    }
+
+    // The default path is in world-writable /tmp: never follow a link planted there,
+    // nor reuse a file another user created. unlink() fails on those because of the sticky bit
+    if (unlink(_path) != 0 && errno != ENOENT) {
+        return Error("Could not replace perf map file");
+    }
+    _fd = open(_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_APPEND, 0644);
+    if (_fd < 0) {
+        return Error("Could not open perf map file");
+    }
+
+    _frame_name = Profiler::instance()->newFrameName(args);
+    _dead = 0;
+    {
+        // Late callbacks of the previous run
+        MutexLocker ml(_lock);
+        _updates.clear();
+    }
+    _active = true;
+
+    for (int i = 0; i < stubs->count(); i++) {
+        const CodeBlob& blob = stubs->blobs()[i];
+        queue(blob._start, (const char*)blob._end - (const char*)blob._start, NULL, blob._name);
+    }
+
+    // VM::init leaves CompiledMethodLoad off on HotSpot with a known code heap (JDK-8173361);
+    // it is turned on only when asked for. GenerateEvents lists the code compiled so far either way
+    jvmtiEnv* jvmti = VM::jvmti();
+    bool events_off = VM::hotspot_version() != 0 && CodeHeap::available();
+    _load_events = events_off && args._perf_map_jit;
+    if (events_off && !_load_events) {
+        Log::info("perfmap lists methods compiled before the start only; perfmapjit adds new ones");
+    }
+    if (_load_events) {
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, NULL);
+    }
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_UNLOAD, NULL);
+    jvmti->GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+
+    _task = new PerfMapTask();
+    BackgroundScheduler::schedule(_task, PERF_MAP_INTERVAL_MS, true);
+    return Error::OK;
+}
+
+void PerfMap::stop() {
+    if (!_active) {
+        return;
+    }
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_COMPILED_METHOD_UNLOAD, NULL);
+    if (_load_events) {
+        jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, NULL);
+    }
+    _active = false;
+
+    BackgroundScheduler::cancel(_task);
+    delete _task;
+    _task = NULL;
+    flush();  // the code queued since the last run
+
+    for (std::map<const void*, PerfMapEntry>::iterator it = _live.begin(); it != _live.end(); ++it) {
+        MemoryBudget::release(MEMORY_METHOD_NAMES, perfMapEntrySize(it->second));
+    }
+    _live.clear();
+    delete _frame_name;
+    _frame_name = NULL;
+    close(_fd);
+    _fd = -1;
+}
+
+void PerfMap::queue(const void* start, u32 size, jmethodID method, const char* name) {
+    PerfMapUpdate update;
+    update.start = start;
+    update.size = size;
+    update.method = method;
+    if (name != NULL) {
+        // Only valid for the duration of the callback
+        update.name = name;
+    }
+
+    MutexLocker ml(_lock);
+    _updates.push_back(update);
+}
+
+void PerfMap::appendLine(std::string& out, const void* start, u32 size, const std::string& name) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lx %x ", (unsigned long)(uintptr_t)start, size);
+    out += buf;
+    out += name;
+    out += '\n';
+}
+
+bool PerfMap::writeFully(int fd, const std::string& out) {
+    const char* data = out.data();
+    size_t len = out.size();
+    while (len > 0) {
+        ssize_t bytes = write(fd, data, len);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) continue;
+            return false;
+        }
+        data += bytes;
+        len -= bytes;
+    }
+    return true;
+}
+
+void PerfMap::flush() {
+    std::vector<PerfMapUpdate> updates;
+    {
+        MutexLocker ml(_lock);
+        updates.swap(_updates);
+    }
+
+    std::string out;
+    for (size_t i = 0; i < updates.size(); i++) {
+        const PerfMapUpdate& update = updates[i];
+        std::map<const void*, PerfMapEntry>::iterator it = _live.find(update.start);
+        if (it != _live.end()) {
+            // Unloaded, or replaced by new code at the same address: the old line is dead
+            MemoryBudget::release(MEMORY_METHOD_NAMES, perfMapEntrySize(it->second));
+            _live.erase(it);
+            _dead++;
+        }
+        if (update.size == 0) {
+            continue;
+        }
+
+        PerfMapEntry& entry = _live[update.start];
+        entry.size = update.size;
+        if (update.method != NULL) {
+            // The method may have been unloaded since; its name is then the JVM TI error
+            entry.name = _frame_name->javaFrameName(update.method, FRAME_JIT_COMPILED);
+        } else {
+            entry.name = update.name;
+        }
+        MemoryBudget::charge(MEMORY_METHOD_NAMES, perfMapEntrySize(entry));
+        appendLine(out, update.start, entry.size, entry.name);
+    }
+
+    if (!out.empty() && !writeFully(_fd, out)) {
+        Log::warn("Could not write perf map %s: %s", _path, strerror(errno));
+    }
+
+    if (_dead >= PERF_MAP_COMPACT_MIN && _dead > _live.size()) {
+        compact();
+    }
+}
+
+void PerfMap::compact() {
+    // A unique name next to the map, so that rename() stays on one file system
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", _path);
+
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return;
+    }
+    if (fchmod(fd, 0644) != 0 || fcntl(fd, F_SETFL, O_APPEND) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+
+    std::string out;
+    bool ok = true;
+    for (std::map<const void*, PerfMapEntry>::iterator it = _live.begin(); ok && it != _live.end(); ++it) {
+        appendLine(out, it->first, it->second.size, it->second.name);
+        if (out.size() >= 65536) {
+            ok = writeFully(fd, out);
+            out.clear();
+        }
+    }
+    ok = ok && writeFully(fd, out);
+
+    if (!ok || rename(tmp_path, _path) != 0) {
+        // Keep appending to the old file
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+
+    close(_fd);
+    _fd = fd;
+    Log::debug("Compacted perf map: %u unloaded, %u live", _dead, (u32)_live.size());
+    _dead = 0;
+}
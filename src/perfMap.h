@@ -0,0 +1,109 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PERFMAP_H
+#define _PERFMAP_H
+
+#include <jvmti.h>
+#include <limits.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "arch.h"
+#include "arguments.h"
+#include "backgroundScheduler.h"
+#include "mutex.h"
+
+
+const int PERF_MAP_INTERVAL_MS = 1000;
+// The file is rewritten once it holds at least this many lines of unloaded code, and more than live ones
+const u32 PERF_MAP_COMPACT_MIN = 4096;
+
+class CodeCache;
+class FrameName;
+class PerfMapTask;
+
+// Code loaded (size > 0) or unloaded (size == 0) since the last flush
+struct PerfMapUpdate {
+    const void* start;
+    u32 size;
+    jmethodID method;  // NULL for a stub, which has its name already
+    std::string name;
+};
+
+struct PerfMapEntry {
+    u32 size;
+    std::string name;
+};
+
+// perfmap[=PATH]: keeps /tmp/perf-<pid>.map, the file perf and eBPF based profilers
+// read to name code that has no ELF image, in step with the JIT (on HotSpot with perfmapjit only,
+// otherwise it has the code compiled before the start). The JVM TI callbacks only
+// queue the loaded and unloaded code; every PERF_MAP_INTERVAL_MS the scheduler resolves
+// the names of the new methods, in the style of the other output, and appends their lines. Lines of unloaded code stay in
+// the file until they outnumber the live ones; then the file is rewritten from the live
+// code and renamed over the old one, so a reader always sees a complete file.
+class PerfMap {
+  private:
+    static Mutex _lock;
+    static std::vector<PerfMapUpdate> _updates;
+    static std::map<const void*, PerfMapEntry> _live;
+    static u32 _dead;
+    static char _path[PATH_MAX];
+    static int _fd;
+    static volatile bool _active;
+    static bool _load_events;
+    static FrameName* _frame_name;
+    static PerfMapTask* _task;
+
+    static void queue(const void* start, u32 size, jmethodID method, const char* name);
+    static void appendLine(std::string& out, const void* start, u32 size, const std::string& name);
+    static bool writeFully(int fd, const std::string& out);
+    static void compact();
+
+  public:
+    static bool active() {
+        return _active;
+    }
+
+    // stubs are the runtime stubs generated before the start, already known to the profiler
+    static Error start(Arguments& args, const CodeCache* stubs);
+    // Writes out the queued code; the file stays for tools that symbolize later
+    static void stop();
+
+    static void addMethod(const void* start, int size, jmethodID method) {
+        if (_active) queue(start, size, method, NULL);
+    }
+
+    static void addStub(const void* start, int size, const char* name) {
+        if (_active) queue(start, size, NULL, name);
+    }
+
+    static void removeMethod(const void* start) {
+        if (_active) queue(start, 0, NULL, NULL);
+    }
+
+    static void flush();
+};
+
+class PerfMapTask : public ScheduledTask {
+  public:
+    void run() {
+        PerfMap::flush();
+    }
+};
+
+#endif // _PERFMAP_H
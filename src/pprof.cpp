@@ -0,0 +1,194 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "gzip.h"
+#include "pprof.h"
+#include "vmEntry.h"
+
+
+// Field numbers of profile.proto
+enum {
+    PROFILE_SAMPLE_TYPE         = 1,
+    PROFILE_SAMPLE              = 2,
+    PROFILE_LOCATION            = 4,
+    PROFILE_FUNCTION            = 5,
+    PROFILE_STRING_TABLE        = 6,
+    PROFILE_TIME_NANOS          = 9,
+    PROFILE_DURATION_NANOS      = 10,
+    PROFILE_PERIOD_TYPE         = 11,
+    PROFILE_PERIOD              = 12,
+    PROFILE_DEFAULT_SAMPLE_TYPE = 14,
+
+    VALUETYPE_TYPE              = 1,
+    VALUETYPE_UNIT              = 2,
+
+    SAMPLE_LOCATION_ID          = 1,
+    SAMPLE_VALUE                = 2,
+
+    LOCATION_ID                 = 1,
+    LOCATION_LINE               = 4,
+
+    LINE_FUNCTION_ID            = 1,
+    LINE_LINE                   = 2,
+
+    FUNCTION_ID                 = 1,
+    FUNCTION_NAME               = 2,
+    FUNCTION_SYSTEM_NAME        = 3
+};
+
+// Indices of the strings every profile starts with
+enum {
+    STRING_EMPTY,
+    STRING_SAMPLES,
+    STRING_COUNT
+};
+
+static inline bool isJavaFrame(const ASGCT_CallFrame& frame) {
+    return frame.bci >= 0 && frame.method_id != NULL;
+}
+
+static inline jint rawBci(int bci) {
+    return (bci >> 24) > 0 ? bci & 0xffffff : bci;
+}
+
+Pprof::Pprof(FrameName* fn, const char* type, const char* unit) : _fn(fn) {
+    intern("");
+    intern("samples");
+    intern("count");
+    _type = intern(type);
+    _unit = intern(unit);
+
+    ProtoBuffer samples;
+    samples.field(VALUETYPE_TYPE, STRING_SAMPLES);
+    samples.field(VALUETYPE_UNIT, STRING_COUNT);
+    _profile.field(PROFILE_SAMPLE_TYPE, samples);
+
+    ProtoBuffer counter;
+    counter.field(VALUETYPE_TYPE, _type);
+    counter.field(VALUETYPE_UNIT, _unit);
+    _profile.field(PROFILE_SAMPLE_TYPE, counter);
+}
+
+Pprof::~Pprof() {
+    jvmtiEnv* jvmti = VM::jvmti();
+    for (std::map<std::pair<jmethodID, int>, Function>::const_iterator it = _functions.begin(); it != _functions.end(); ++it) {
+        if (it->second.lines != NULL) {
+            jvmti->Deallocate((unsigned char*)it->second.lines);
+        }
+    }
+}
+
+// The string table goes out in the order of first use
+u64 Pprof::intern(const char* s) {
+    std::map<std::string, u64>::iterator it = _strings.find(s);
+    if (it != _strings.end()) {
+        return it->second;
+    }
+
+    u64 index = _strings.size();
+    _strings[s] = index;
+    _profile.field(PROFILE_STRING_TABLE, s, strlen(s));
+    return index;
+}
+
+Pprof::Function& Pprof::function(ASGCT_CallFrame& frame) {
+    std::pair<jmethodID, int> key(frame.method_id, FrameType::nameKind(frame.bci));
+    std::map<std::pair<jmethodID, int>, Function>::iterator it = _functions.find(key);
+    if (it != _functions.end()) {
+        return it->second;
+    }
+
+    Function& f = _functions[key];
+    f.id = _functions.size();
+    f.line_count = 0;
+    f.lines = NULL;
+    if (isJavaFrame(frame) && VM::jvmti()->GetLineNumberTable(frame.method_id, &f.line_count, &f.lines) != 0) {
+        f.line_count = 0;
+        f.lines = NULL;
+    }
+
+    u64 name = intern(_fn->name(frame));
+    ProtoBuffer message;
+    message.field(FUNCTION_ID, f.id);
+    message.field(FUNCTION_NAME, name);
+    message.field(FUNCTION_SYSTEM_NAME, name);
+    _profile.field(PROFILE_FUNCTION, message);
+    return f;
+}
+
+u64 Pprof::location(ASGCT_CallFrame& frame) {
+    std::pair<jmethodID, int> key(frame.method_id, frame.bci);
+    std::map<std::pair<jmethodID, int>, u64>::iterator it = _locations.find(key);
+    if (it != _locations.end()) {
+        return it->second;
+    }
+
+    Function& f = function(frame);
+    u64 id = _locations.size() + 1;
+    _locations[key] = id;
+
+    ProtoBuffer line;
+    line.field(LINE_FUNCTION_ID, f.id);
+    if (f.line_count > 0) {
+        jint bci = rawBci(frame.bci);
+        int i = 1;
+        while (i < f.line_count && bci >= f.lines[i].start_location) {
+            i++;
+        }
+        line.field(LINE_LINE, f.lines[i - 1].line_number);
+    }
+
+    ProtoBuffer message;
+    message.field(LOCATION_ID, id);
+    message.field(LOCATION_LINE, line);
+    _profile.field(PROFILE_LOCATION, message);
+    return id;
+}
+
+// Locations go from the leaf to the root, as in CallTrace
+void Pprof::addSample(CallTrace* trace, u64 samples, u64 counter) {
+    ProtoBuffer ids;
+    for (int i = 0; i < trace->num_frames; i++) {
+        ids.varint(location(trace->frames[i]));
+    }
+
+    ProtoBuffer values;
+    values.varint(samples);
+    values.varint(counter);
+
+    ProtoBuffer message;
+    message.field(SAMPLE_LOCATION_ID, ids);
+    message.field(SAMPLE_VALUE, values);
+    _profile.field(PROFILE_SAMPLE, message);
+}
+
+void Pprof::write(std::ostream& out, u64 time_nanos, u64 duration_nanos, u64 period, bool total) {
+    _profile.field(PROFILE_TIME_NANOS, time_nanos);
+    _profile.field(PROFILE_DURATION_NANOS, duration_nanos);
+    if (period > 0) {
+        ProtoBuffer period_type;
+        period_type.field(VALUETYPE_TYPE, _type);
+        period_type.field(VALUETYPE_UNIT, _unit);
+        _profile.field(PROFILE_PERIOD_TYPE, period_type);
+        _profile.field(PROFILE_PERIOD, period);
+    }
+    _profile.field(PROFILE_DEFAULT_SAMPLE_TYPE, total ? _type : STRING_SAMPLES);
+
+    std::string compressed;
+    Gzip::compress(_profile.data().data(), _profile.data().size(), compressed);
+    out.write(compressed.data(), compressed.size());
+}
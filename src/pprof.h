@@ -0,0 +1,93 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PPROF_H
+#define _PPROF_H
+
+#include <map>
+#include <ostream>
+#include <string>
+#include "arch.h"
+#include "callTraceStorage.h"
+#include "frameName.h"
+
+
+// Append-only protobuf encoder
+class ProtoBuffer {
+  private:
+    std::string _data;
+
+  public:
+    const std::string& data() const {
+        return _data;
+    }
+
+    void varint(u64 n) {
+        while (n > 0x7f) {
+            _data.push_back((char)(0x80 | (n & 0x7f)));
+            n >>= 7;
+        }
+        _data.push_back((char)n);
+    }
+
+    void field(int index, u64 n) {
+        varint((u64)index << 3);
+        varint(n);
+    }
+
+    void field(int index, const char* bytes, size_t len) {
+        varint((u64)index << 3 | 2);
+        varint(len);
+        _data.append(bytes, len);
+    }
+
+    void field(int index, const ProtoBuffer& message) {
+        field(index, message.data().data(), message.data().size());
+    }
+};
+
+// pprof output: the gzip'd profile.proto of the samples in CallTraceStorage.
+// Functions are the distinct frame names, locations the distinct (method, bci)
+// pairs; for Java frames, the bci is mapped to a source line through JVM TI.
+class Pprof {
+  private:
+    struct Function {
+        u64 id;
+        jint line_count;
+        jvmtiLineNumberEntry* lines;
+    };
+
+    FrameName* _fn;
+    u64 _type;
+    u64 _unit;
+    ProtoBuffer _profile;
+    std::map<std::string, u64> _strings;
+    std::map<std::pair<jmethodID, int>, Function> _functions;
+    std::map<std::pair<jmethodID, int>, u64> _locations;
+
+    u64 intern(const char* s);
+    Function& function(ASGCT_CallFrame& frame);
+    u64 location(ASGCT_CallFrame& frame);
+
+  public:
+    Pprof(FrameName* fn, const char* type, const char* unit);
+    ~Pprof();
+
+    void addSample(CallTrace* trace, u64 samples, u64 counter);
+    void write(std::ostream& out, u64 time_nanos, u64 duration_nanos, u64 period, bool total);
+};
+
+#endif // _PPROF_H
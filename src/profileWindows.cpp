@@ -0,0 +1,158 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "profileWindows.h"
+#include "memoryBudget.h"
+
+
+static inline size_t traceSize(int num_frames) {
+    return sizeof(CallTrace) - sizeof(ASGCT_CallFrame) + num_frames * sizeof(ASGCT_CallFrame);
+}
+
+CallTrace* ProfileWindows::retain(CallTrace* trace, u64 hash) {
+    std::map<u64, WindowTrace>::iterator it = _traces.find(hash);
+    if (it != _traces.end()) {
+        it->second.refs++;
+        return it->second.trace;
+    }
+
+    size_t size = traceSize(trace->num_frames);
+    CallTrace* copy = (CallTrace*)malloc(size);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, trace, size);
+    MemoryBudget::charge(MEMORY_CALL_TRACES, size + MAP_NODE_OVERHEAD);
+
+    WindowTrace& wt = _traces[hash];
+    wt.trace = copy;
+    wt.refs = 1;
+    return copy;
+}
+
+void ProfileWindows::release(u64 hash) {
+    std::map<u64, WindowTrace>::iterator it = _traces.find(hash);
+    if (it != _traces.end() && --it->second.refs == 0) {
+        MemoryBudget::release(MEMORY_CALL_TRACES, traceSize(it->second.trace->num_frames) + MAP_NODE_OVERHEAD);
+        free(it->second.trace);
+        _traces.erase(it);
+    }
+}
+
+// Adds the growth of every stack since the previous transfer to the open window
+void ProfileWindows::transfer(CallTraceStorage& storage) {
+    std::map<u64, CallTraceSample> totals;
+    storage.collectSamples(totals);
+
+    ProfileWindow& window = _ring[_current];
+    for (std::map<u64, CallTraceSample>::const_iterator it = totals.begin(); it != totals.end(); ++it) {
+        u64 samples = it->second.samples;
+        u64 counter = it->second.counter;
+        std::map<u64, CallTraceSample>::const_iterator prev = _transferred.find(it->first);
+        // JFR chunks zero the sample counts in the storage; the counts that remain are new
+        if (prev != _transferred.end()) {
+            if (samples >= prev->second.samples) samples -= prev->second.samples;
+            if (counter >= prev->second.counter) counter -= prev->second.counter;
+        }
+        if (samples == 0 && counter == 0) continue;
+
+        std::map<u64, CallTraceSample>::iterator ws = window.samples.find(it->first);
+        if (ws == window.samples.end()) {
+            CallTrace* trace = retain(it->second.trace, it->first);
+            if (trace == NULL) continue;
+            CallTraceSample s = {trace, 0, 0};
+            ws = window.samples.insert(std::make_pair(it->first, s)).first;
+        }
+        ws->second.samples += samples;
+        ws->second.counter += counter;
+    }
+
+    _transferred.swap(totals);
+}
+
+void ProfileWindows::clearAll() {
+    for (std::map<u64, WindowTrace>::const_iterator it = _traces.begin(); it != _traces.end(); ++it) {
+        MemoryBudget::release(MEMORY_CALL_TRACES, traceSize(it->second.trace->num_frames) + MAP_NODE_OVERHEAD);
+        free(it->second.trace);
+    }
+    _traces.clear();
+    _transferred.clear();
+    _ring.clear();
+    _current = 0;
+}
+
+void ProfileWindows::setup(int count, int seconds, time_t now) {
+    MutexLocker ml(_lock);
+    if ((int)_ring.size() == count && _seconds == seconds) {
+        return;
+    }
+
+    clearAll();
+    _seconds = seconds;
+    if (count > 0) {
+        _ring.resize(count);
+        _ring[0].start = now;
+        _ring[0].end = now + seconds;
+    }
+}
+
+void ProfileWindows::reset(CallTraceStorage& storage) {
+    MutexLocker ml(_lock);
+    if (!_ring.empty()) {
+        transfer(storage);
+    }
+    storage.clear();
+    _transferred.clear();
+}
+
+void ProfileWindows::tick(CallTraceStorage& storage, time_t now) {
+    MutexLocker ml(_lock);
+    if (_ring.empty() || now < _ring[_current].end) {
+        return;
+    }
+
+    transfer(storage);
+    _ring[_current].end = now;
+
+    // The oldest window makes room for the next one
+    _current = (_current + 1) % (int)_ring.size();
+    ProfileWindow& window = _ring[_current];
+    for (std::map<u64, CallTraceSample>::const_iterator it = window.samples.begin(); it != window.samples.end(); ++it) {
+        release(it->first);
+    }
+    window.samples.clear();
+    window.start = now;
+    window.end = now + _seconds;
+}
+
+void ProfileWindows::collect(CallTraceStorage& storage, time_t since, std::map<u64, CallTraceSample>& map) {
+    if (_ring.empty()) {
+        return;
+    }
+
+    transfer(storage);
+    for (size_t i = 0; i < _ring.size(); i++) {
+        const ProfileWindow& window = _ring[i];
+        if (window.end <= since || window.samples.empty()) continue;
+
+        for (std::map<u64, CallTraceSample>::const_iterator it = window.samples.begin(); it != window.samples.end(); ++it) {
+            map[it->first] += it->second;
+        }
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _PROFILEWINDOWS_H
+#define _PROFILEWINDOWS_H
+
+#include <map>
+#include <vector>
+#include <time.h>
+#include "arch.h"
+#include "callTraceStorage.h"
+#include "mutex.h"
+
+
+struct ProfileWindow {
+    time_t start;
+    time_t end;
+    // Samples of the window per stack hash; traces point into the shared dictionary
+    std::map<u64, CallTraceSample> samples;
+};
+
+// Copy of a stack that outlives the storage epoch it came from,
+// referenced by every window that has samples of it
+struct WindowTrace {
+    CallTrace* trace;
+    int refs;
+};
+
+// windows=N: the samples of the last N time windows of window=TIME each, so that
+// 'last=TIME' can dump a recent period while the profiler keeps running, also
+// across the storage resets of loop mode. Each window holds only aggregated
+// (stack, samples, counter) entries; stacks are shared through one dictionary
+// and freed when the last window that uses them is overwritten.
+class ProfileWindows {
+  private:
+    Mutex _lock;
+    std::vector<ProfileWindow> _ring;
+    int _current;
+    int _seconds;
+    std::map<u64, WindowTrace> _traces;
+    // Storage totals at the last transfer into the open window
+    std::map<u64, CallTraceSample> _transferred;
+
+    CallTrace* retain(CallTrace* trace, u64 hash);
+    void release(u64 hash);
+    void transfer(CallTraceStorage& storage);
+    void clearAll();
+
+  public:
+    ProfileWindows() : _current(0), _seconds(0) {
+    }
+
+    ~ProfileWindows() {
+        clearAll();
+    }
+
+    bool enabled() {
+        return !_ring.empty();
+    }
+
+    Mutex& mutex() {
+        return _lock;
+    }
+
+    // Keeps the windows collected so far unless the layout changes
+    void setup(int count, int seconds, time_t now);
+
+    // Moves what the storage has collected into the open window and clears the storage
+    void reset(CallTraceStorage& storage);
+
+    // Closes the open window once its time is over; called from the timer thread
+    void tick(CallTraceStorage& storage, time_t now);
+
+    // Merged samples of the windows that end after 'since', including the open one.
+    // Must be called with mutex() held; the traces are valid until it is released.
+    void collect(CallTraceStorage& storage, time_t since, std::map<u64, CallTraceSample>& map);
+};
+
+#endif // _PROFILEWINDOWS_H
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "profiledThread.h"
+
+
+// Created when the library is loaded, before any thread can look it up
+pthread_key_t ProfiledThread::_key = ProfiledThread::createKey();
+// Threads start out at epoch 0, so their first delta is never taken as valid
+volatile u32 ProfiledThread::_cpu_epoch = 1;
+// Likewise, no thread starts out described
+volatile u32 ProfiledThread::_name_epoch = 1;
+
+pthread_key_t ProfiledThread::createKey() {
+    pthread_key_t key;
+    pthread_key_create(&key, destroy);
+    return key;
+}
+
+void ProfiledThread::destroy(void* thread) {
+    delete (ProfiledThread*)thread;
+}
+
+ProfiledThread* ProfiledThread::currentOrCreate() {
+    ProfiledThread* thread = current();
+    if (thread == NULL) {
+        thread = new ProfiledThread(OS::threadId());
+        pthread_setspecific(_key, thread);
+    }
+    return thread;
+}
+
+u64 ProfiledThread::cpuTimeDelta() {
+    ProfiledThread* thread = current();
+    if (thread == NULL) {
+        return 0;
+    }
+
+    u64 now = OS::threadCpuTime();
+    u32 epoch = _cpu_epoch;
+    u64 delta = thread->_cpu_epoch_seen == epoch && now > thread->_cpu_time ? now - thread->_cpu_time : 0;
+    thread->_cpu_time = now;
+    thread->_cpu_epoch_seen = epoch;
+    return delta;
+}
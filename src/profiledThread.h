@@ -0,0 +1,112 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _PROFILEDTHREAD_H
+#define _PROFILEDTHREAD_H
+
+#include <jni.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "os.h"
+
+
+const int METHOD_CALL_DEPTH = 64;
+
+// A call of a method traced by MethodTracer that has not returned yet
+struct MethodCall {
+    int id;
+    u64 start;
+};
+
+// State the profiler keeps for a thread, so that hot paths do not repeat syscalls,
+// JNI or JVM TI calls for what does not change. Created at ThreadStart, or by the
+// first caller outside of a signal handler, and freed when the thread exits.
+class ProfiledThread {
+  private:
+    static pthread_key_t _key;
+    static volatile u32 _cpu_epoch;
+    static volatile u32 _name_epoch;
+
+    static pthread_key_t createKey();
+    static void destroy(void* thread);
+
+    ProfiledThread(int tid) : _tid(tid), _described_epoch(0), _java_thread_id(0), _name(NULL),
+        _method_calls(NULL), _method_depth(0), _cpu_time(0), _cpu_epoch_seen(0) {
+    }
+
+    ~ProfiledThread() {
+        free(_method_calls);
+    }
+
+  public:
+    int _tid;
+
+    // Filled in by LockTracer with the first lock event of the thread, valid only in _described_epoch
+    u32 _described_epoch;
+    jlong _java_thread_id;
+    // Interned by the LockRecorder; a later Thread.setName() is not seen
+    const char* _name;
+
+    // Traced methods entered by the thread, innermost last; allocated with the first one.
+    // The depth keeps counting past METHOD_CALL_DEPTH, deeper calls are not timed.
+    MethodCall* _method_calls;
+    int _method_depth;
+
+    // CPU time of the thread at its previous timer sample, valid only in _cpu_epoch_seen
+    u64 _cpu_time;
+    u32 _cpu_epoch_seen;
+
+    // Async signal safe; never allocates, NULL if the thread has no state yet
+    static ProfiledThread* current() {
+        return (ProfiledThread*)pthread_getspecific(_key);
+    }
+
+    // Not for signal handlers
+    static ProfiledThread* currentOrCreate();
+
+    // Async signal safe. CPU ns the calling thread used since its previous call in this epoch;
+    // 0 on the first call, when none was used, or when the thread has no state to keep it in
+    static u64 cpuTimeDelta();
+
+    // Called by timer engines at start, so that the first sample of a session
+    // does not carry the CPU time the thread used before it
+    static void newCpuEpoch() {
+        _cpu_epoch++;
+    }
+
+    bool described() {
+        return _described_epoch == _name_epoch;
+    }
+
+    void setDescribed() {
+        _described_epoch = _name_epoch;
+    }
+
+    // Called when the LockRecorder drops its interned names, so that every
+    // thread looks its identity up again instead of keeping a dangling _name
+    static void newNameEpoch() {
+        _name_epoch++;
+    }
+
+    // Async signal safe. Saves the gettid syscall once the thread has its state.
+    static int currentTid() {
+        ProfiledThread* thread = current();
+        return thread != NULL ? thread->_tid : OS::threadId();
+    }
+};
+
+#endif // _PROFILEDTHREAD_H
@@ -27,24 +27,41 @@
 #include "perfEvents.h"
 #include "allocTracer.h"
 #include "lockTracer.h"
+#include "mallocTracer.h"
+#include "ioTracer.h"
+#include "methodTracer.h"
 #include "wallClock.h"
+#include "safepointProfiler.h"
 #include "j9ObjectSampler.h"
 #include "j9StackTraces.h"
 #include "j9WallClock.h"
 #include "instrument.h"
 #include "itimer.h"
+#include "ctimer.h"
 #include "dwarf.h"
+#include "collapsedWriter.h"
 #include "flameGraph.h"
 #include "flightRecorder.h"
 #include "fdtransferClient.h"
 #include "frameName.h"
+#include "cgroupCpu.h"
+#include "gcPhase.h"
+#include "heapMonitor.h"
 #include "os.h"
+#include "pprof.h"
+#include "profiledThread.h"
 #include "safeAccess.h"
 #include "stackFrame.h"
 #include "stackWalker.h"
 #include "symbols.h"
+#include "threadSnapshot.h"
+#include "tsc.h"
 #include "vmStructs.h"
 #include "eventLogger.h"
+#include "timeUtil.h"
+#include "traceContext.h"
+#include "latencyStats.h"
+#include "memoryBudget.h"
 
 
 // The instance is not deleted on purpose, since profiler structures
@@ -58,11 +75,16 @@ static Engine noop_engine;
 static PerfEvents perf_events;
 static AllocTracer alloc_tracer;
 static LockTracer lock_tracer;
+static MallocTracer malloc_tracer;
+static IoTracer io_tracer;
+static MethodTracer method_tracer;
 static ObjectSampler object_sampler;
 static J9ObjectSampler j9_object_sampler;
 static WallClock wall_clock;
 static J9WallClock j9_wall_clock;
 static ITimer itimer;
+static CTimer ctimer;
+static SafepointProfiler safepoint_profiler;
 static Instrument instrument;
 
 
@@ -82,7 +104,10 @@ enum StackRecovery {
 enum EventMask {
     EM_CPU   = 1,
     EM_ALLOC = 2,
-    EM_LOCK  = 4
+    EM_LOCK  = 4,
+    EM_NATIVEMEM = 8,
+    EM_IO    = 16,
+    EM_METHODS = 32
 };
 
 
@@ -136,17 +161,28 @@ void Profiler::addRuntimeStub(const void* address, int length, const char* name)
 }
 
 void Profiler::onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
+    int tid = ProfiledThread::currentOrCreate()->_tid;
+    _thread_registry.add(tid);
     if (_thread_filter.enabled()) {
-        _thread_filter.remove(OS::threadId());
+        _thread_filter.remove(tid);
     }
     updateThreadName(jvmti, jni, thread);
+    if (_event_mask & EM_LOCK) {
+        LockTracer::threadStart(jvmti, jni, thread);
+    }
 }
 
 void Profiler::onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
+    int tid = ProfiledThread::currentTid();
+    _thread_registry.remove(tid);
+    updateThreadName(jvmti, jni, thread);
     if (_thread_filter.enabled()) {
-        _thread_filter.remove(OS::threadId());
+        _thread_filter.remove(tid);
     }
-    updateThreadName(jvmti, jni, thread);
+    // The tid may be reused by a new thread, which has to be reported again
+    forgetThreadName(tid);
+    TraceIds no_context = {0, 0, 0};
+    TraceContext::set(tid, no_context);
 }
 
 const char* Profiler::asgctError(int code) {
@@ -181,11 +217,26 @@ const char* Profiler::asgctError(int code) {
     }
 }
 
+int Profiler::concurrencyLevel(int cpus) {
+    int level = CONCURRENCY_LEVEL;
+    while (level < cpus && level < MAX_CONCURRENCY_LEVEL) {
+        level *= 2;
+    }
+    return level;
+}
+
+// Start with the buffer of the current CPU: a signal handler can only be
+// preempted by threads that were moved to another CPU, so the lock is rarely taken
 inline u32 Profiler::getLockIndex(int tid) {
+    int cpu = OS::cpuId();
+    if (cpu >= 0) {
+        return (u32)cpu & (_concurrency_level - 1);
+    }
+
     u32 lock_index = tid;
     lock_index ^= lock_index >> 8;
     lock_index ^= lock_index >> 4;
-    return lock_index % CONCURRENCY_LEVEL;
+    return lock_index & (_concurrency_level - 1);
 }
 
 void Profiler::updateSymbols(bool kernel_symbols) {
@@ -282,8 +333,20 @@ CodeCache* Profiler::findLibraryByAddress(const void* address) {
 }
 
 const char* Profiler::findNativeMethod(const void* address) {
+    const char* name = _symbol_cache.lookup(address);
+    return name != NULL ? name : resolveNativeMethod(address);
+}
+
+// Slow path of findNativeMethod; addresses outside known libraries are not cached,
+// since a library may be loaded there later
+const char* Profiler::resolveNativeMethod(const void* address) {
     CodeCache* lib = findLibraryByAddress(address);
-    return lib == NULL ? NULL : lib->binarySearch(address);
+    if (lib == NULL) {
+        return NULL;
+    }
+    const char* name = lib->binarySearch(address);
+    _symbol_cache.store(address, name);
+    return name;
 }
 
 bool Profiler::isAddressInCode(uintptr_t addr) {
@@ -295,16 +358,19 @@ bool Profiler::isAddressInCode(uintptr_t addr) {
     }
 }
 
+template <bool PERF>
 int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, StackContext* java_ctx) {
     const void* callchain[MAX_NATIVE_FRAMES];
     int native_frames;
 
-    if (_cstack == CSTACK_NO || (event_type != 0 && _cstack == CSTACK_DEFAULT)) {
+    // Native allocations and I/O calls are made by native code, so their native stack is always of interest
+    bool hooked = event_type == BCI_NATIVE_ALLOC || event_type == BCI_IO;
+    if (_cstack == CSTACK_NO || (event_type != 0 && !hooked && _cstack == CSTACK_DEFAULT)) {
         return 0;
     }
 
     // Use PerfEvents stack walker for execution samples, or basic stack walker for other events
-    if (event_type == 0 && _engine == &perf_events) {
+    if (PERF) {
         native_frames = PerfEvents::walk(tid, ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx);
     } else if (_cstack == CSTACK_DWARF) {
         native_frames = StackWalker::walkDwarf(ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx);
@@ -312,19 +378,34 @@ int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_
         native_frames = StackWalker::walkFP(ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx);
     }
 
-    return convertNativeTrace(native_frames, callchain, frames);
+    int skip = 0;
+    if (hooked) {
+        // The walk starts in a GOT hook; the stack begins at its caller
+        while (skip < native_frames && (event_type == BCI_IO ? IoTracer::inProfiler(callchain[skip])
+                                                             : MallocTracer::inProfiler(callchain[skip]))) {
+            skip++;
+        }
+    }
+    return convertNativeTrace(native_frames - skip, callchain + skip, frames);
 }
 
 int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames) {
     int depth = 0;
     jmethodID prev_method = NULL;
-
-    for (int i = 0; i < native_frames; i++) {
-        const char* current_method_name = findNativeMethod(callchain[i]);
+    int misses = 0;
+
+    int i;
+    for (i = 0; i < native_frames; i++) {
+        const char* current_method_name = _symbol_cache.lookup(callchain[i]);
+        if (current_method_name == NULL) {
+            current_method_name = resolveNativeMethod(callchain[i]);
+            misses++;
+        }
         if (current_method_name != NULL && NativeFunc::isMarked(current_method_name)) {
             // This is C++ interpreter frame, this and later frames should be reported
             // as Java frames returned by AGCT. Terminate the scan here.
-            return depth;
+            i++;
+            break;
         }
 
         jmethodID current_method = (jmethodID)current_method_name;
@@ -338,6 +419,7 @@ int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGC
         }
     }
 
+    _symbol_cache.count(i - misses, misses);
     return depth;
 }
 
@@ -356,7 +438,7 @@ int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max
     }
 
     StackFrame frame(ucontext);
-    uintptr_t saved_pc, saved_sp, saved_fp;
+    uintptr_t saved_pc = 0, saved_sp = 0, saved_fp = 0;
     if (ucontext != NULL) {
         saved_pc = frame.pc();
         saved_sp = frame.sp();
@@ -516,6 +598,29 @@ int Profiler::getJavaTraceInternal(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame
     return 0;
 }
 
+// allocsite: the top frames of an allocation identify its site together with the class;
+// a site sampled recently counts the sample against its stored trace without a full walk.
+// Returns 0 with the key of the site in site when the stack has to be walked.
+u32 Profiler::reuseAllocSite(u32 lock_index, int tid, jint event_type, Event* event, int num_frames, u64 counter, u64& site) {
+    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames + num_frames;
+    jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames + num_frames;
+    int top_frames = getJavaTraceInternal(jvmti_frames, frames, ALLOC_SITE_FRAMES);
+
+    // Thread frames are part of the trace, so the thread is part of the site
+    site = AllocSiteCache::key(event_type, event->id(), _add_thread_frame ? tid : 0, top_frames, frames);
+    u32 call_trace_id = _alloc_sites[lock_index].lookup(site, _call_trace_storage.epoch(), _alloc_site_reuse);
+    if (call_trace_id == 0) {
+        return 0;
+    }
+
+    CallTrace* trace = _call_trace_storage.add(call_trace_id, counter);
+    if (trace == NULL) {
+        return 0;
+    }
+    _method_profile.record(_add_thread_frame ? trace->num_frames - 1 : trace->num_frames, trace->frames, counter);
+    return call_trace_id;
+}
+
 inline int Profiler::convertFrames(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int num_frames) {
     // Convert to AsyncGetCallTrace format.
     // Note: jvmti_frames and frames may overlap.
@@ -527,6 +632,51 @@ inline int Profiler::convertFrames(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame
     return num_frames;
 }
 
+// Java frames of an execution sample, typed by the compiled method they were found in
+int Profiler::getJavaTraceSampled(void* ucontext, ASGCT_CallFrame* frames, StackContext* java_ctx) {
+    if (_gc_skip && GcPhase::active()) {
+        // Java threads are parked at the safepoint, and their stacks do not change during the pause
+        GcPhase::countPausedSample();
+        return makeFrame(frames, BCI_ERROR, "GC_active");
+    }
+
+    u64 java_start = LatencyStats::start();
+    int java_frames = _vm_stack_walk ? getJavaTraceVM(ucontext, frames, _max_stack_depth, java_ctx) : -1;
+    if (java_frames < 0) {
+        java_frames = getJavaTraceAsync(ucontext, frames, _max_stack_depth, java_ctx);
+        if (java_frames > 0 && java_ctx->pc != NULL && VMStructs::hasMethodStructs()) {
+            NMethod* nmethod = CodeHeap::findNMethod(java_ctx->pc);
+            if (nmethod != NULL) {
+                fillFrameTypes(frames, java_frames, nmethod);
+            }
+        }
+    }
+    LatencyStats::add(LATENCY_JAVA_TRACE, java_start);
+    return java_frames;
+}
+
+// Returns -1 where AsyncGetCallTrace has to walk the stack instead
+int Profiler::getJavaTraceVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, const StackContext* java_ctx) {
+    if (VMThread::current() == NULL) {
+        return -1;
+    }
+
+    StackContext ctx = *java_ctx;
+    bool interrupted = false;
+    if (ucontext != NULL) {
+        StackFrame frame(ucontext);
+        if (ctx.pc == NULL && CodeHeap::contains((const void*)frame.pc())) {
+            // No native frames were walked, since the thread was stopped in Java code
+            ctx.set((const void*)frame.pc(), frame.sp(), frame.fp());
+        }
+        interrupted = ctx.pc == (const void*)frame.pc();
+    }
+
+    int depth = StackWalker::walkVM(&ctx, interrupted, frames, max_depth);
+    atomicInc(depth >= 0 ? _vm_walks : _vm_walk_fallbacks);
+    return depth;
+}
+
 void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod) {
     if (nmethod->isNMethod() && nmethod->isAlive()) {
         VMMethod* method = nmethod->method();
@@ -570,49 +720,8 @@ void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod*
     }
 }
 
-void Profiler::printSample(void* ucontext, u64 counter) {
-    int tid = OS::threadId();
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
-        // Too many concurrent signals already
-        atomicInc(_failures[-ticks_skipped]);
-
-        if (_engine == &perf_events) {
-            // Need to reset PerfEvents ring buffer, even though we discard the collected trace
-            PerfEvents::resetBuffer(tid);
-        }
-        return;
-    }
-
-    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
-    jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
-
-    int num_frames = 0;
-    StackContext java_ctx = {0};
-    num_frames += getNativeTrace(ucontext, frames + num_frames, 0, tid, &java_ctx);
-
-    // Async events
-    int java_frames = getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth, &java_ctx);
-    if (java_frames > 0 && java_ctx.pc != NULL && VMStructs::hasMethodStructs()) {
-        NMethod* nmethod = CodeHeap::findNMethod(java_ctx.pc);
-        if (nmethod != NULL) {
-            fillFrameTypes(frames + num_frames, java_frames, nmethod);
-        }
-    }
-    num_frames += java_frames;
-
-    if (num_frames > 0) {
-        printCallTrace(tid, num_frames, frames);
-    }
-
-    _locks[lock_index].unlock();
-}
-
-void Profiler::printCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames) {
-    int max_frame = _max_stack_depth;
+u32 Profiler::printCallTrace(u32 lock_index, int tid, int num_frames, ASGCT_CallFrame* frames, u64 counter, SampleEvent* sample) {
+    int max_frame = _frameCache.maxDepth();
     if (max_frame > num_frames) {
         max_frame = num_frames;
     }
@@ -621,102 +730,250 @@ void Profiler::printCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames)
     //     // Ignore GC Threads
     //     return;
     // }
-    storeCallTrace(tid, max_frame, frames);
+    return storeCallTrace(lock_index, tid, max_frame, frames, counter, sample);
 }
 
-void Profiler::storeCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames) {
-    _frameCache.add(tid, num_frames, frames);
+u32 Profiler::storeCallTrace(u32 lock_index, int tid, int num_frames, ASGCT_CallFrame* frames, u64 counter, SampleEvent* sample) {
+    u64 put_start = LatencyStats::start();
+    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+    LatencyStats::add(LATENCY_STORAGE_PUT, put_start);
+    _method_profile.record(num_frames, frames, counter);
+
+    u64 add_start = LatencyStats::start();
+    _frameCache.add(lock_index, tid, call_trace_id, sample);
+    LatencyStats::add(LATENCY_CACHE_ADD, add_start);
+    return call_trace_id;
 }
 
-void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event* event) {
-    atomicInc(_total_samples);
+template <bool PERF, SampleWalk WALK, SampleSink SINK>
+u32 Profiler::processSample(void* ucontext, u64 counter, jint event_type, Event* event, SampleEvent* sample) {
+    u64 start = TSC::ticks();
+    int tid = ProfiledThread::currentTid();
+    if (!_thread_filter.allows(tid)) {
+        if (PERF) {
+            PerfEvents::resetBuffer(tid);
+        }
+        return 0;
+    }
+    if (SINK == SINK_EVENT) {
+        atomicInc(_total_samples);
+    }
 
-    int tid = OS::threadId();
     u32 lock_index = getLockIndex(tid);
     if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
+        !_locks[lock_index = (lock_index + 1) & (_concurrency_level - 1)].tryLock() &&
+        !_locks[lock_index = (lock_index + 2) & (_concurrency_level - 1)].tryLock())
     {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
 
-        if (event_type == 0 && _engine == &perf_events) {
+        if (PERF) {
             // Need to reset PerfEvents ring buffer, even though we discard the collected trace
             PerfEvents::resetBuffer(tid);
         }
-        return;
+        return 0;
     }
 
     ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
     jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
 
     int num_frames = 0;
-    if (_add_event_frame && event_type <= BCI_ALLOC && event_type >= BCI_PARK && event->id()) {
+    if (SINK == SINK_EVENT && _add_event_frame && event_type <= BCI_ALLOC && event_type >= BCI_PARK && event->id()) {
         num_frames = makeFrame(frames, event_type, event->id());
     }
 
     StackContext java_ctx = {0};
-    num_frames += getNativeTrace(ucontext, frames + num_frames, event_type, tid, &java_ctx);
-
-    if (event_type == 0) {
-        // Async events
-        int java_frames = getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth, &java_ctx);
-        if (java_frames > 0 && java_ctx.pc != NULL && VMStructs::hasMethodStructs()) {
-            NMethod* nmethod = CodeHeap::findNMethod(java_ctx.pc);
-            if (nmethod != NULL) {
-                fillFrameTypes(frames + num_frames, java_frames, nmethod);
+    int native_frames = getNativeTrace<PERF>(ucontext, frames + num_frames, event_type, tid, &java_ctx);
+    num_frames += native_frames;
+
+    u64 alloc_site = 0;
+    if (WALK == WALK_INTERNAL && SINK == SINK_EVENT && _alloc_site_reuse > 0 && native_frames == 0 && !_add_sched_frame) {
+        u32 call_trace_id = reuseAllocSite(lock_index, tid, event_type, event, num_frames, counter, alloc_site);
+        if (call_trace_id != 0) {
+            if (_frameCache.allocationsEnabled()) {
+                _frameCache.addAllocation(lock_index, event->id(), event_type, call_trace_id, counter);
             }
+            _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+            _locks[lock_index].unlock();
+            OverheadGovernor::add(OVERHEAD_SAMPLE, start);
+            LatencyStats::add(LATENCY_SAMPLE, start);
+            return call_trace_id;
         }
-        num_frames += java_frames;
-    } else if (event_type >= BCI_ALLOC_OUTSIDE_TLAB && VMStructs::_get_stack_trace != NULL) {
+    }
+
+    if (WALK == WALK_SAMPLED) {
+        // Async events
+        num_frames += getJavaTraceSampled(ucontext, frames + num_frames, &java_ctx);
+    } else if (WALK == WALK_INTERNAL) {
         // Object allocation in HotSpot happens at known places where it is safe to call JVM TI,
         // but not directly, since the thread is in_vm rather than in_native
         num_frames += getJavaTraceInternal(jvmti_frames + num_frames, frames + num_frames, _max_stack_depth);
-    } else if (event_type >= BCI_ALLOC_OUTSIDE_TLAB && !VM::isOpenJ9()) {
+    } else if (WALK == WALK_ASYNC) {
+        // malloc() and I/O calls may be made from any state, JVM TI is not safe there
         num_frames += getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth, &java_ctx);
-    } else {
+    } else if (WALK == WALK_JVMTI) {
         // Lock events and instrumentation events can safely call synchronous JVM TI stack walker.
-        // Skip Instrument.recordSample() method
+        // Skip Instrument.recordSample() or recordExit() method
         int start_depth = event_type == BCI_INSTRUMENT ? 1 : 0;
         num_frames += getJavaTraceJvmti(jvmti_frames + num_frames, frames + num_frames, start_depth, _max_stack_depth);
     }
 
-    if (num_frames == 0) {
-        num_frames += makeFrame(frames + num_frames, BCI_ERROR, "no_Java_frame");
-    }
+    u32 call_trace_id = 0;
+    if (SINK == SINK_KINDLING) {
+        if (num_frames > 0) {
+            call_trace_id = printCallTrace(lock_index, tid, num_frames, frames, counter, sample);
+        }
+    } else {
+        if (num_frames == 0) {
+            num_frames += makeFrame(frames + num_frames, BCI_ERROR, "no_Java_frame");
+        }
 
-    if (_add_thread_frame) {
-        num_frames += makeFrame(frames + num_frames, BCI_THREAD_ID, tid);
+        // Thread and policy frames are not methods
+        int method_frames = num_frames;
+        if (_add_thread_frame) {
+            num_frames += makeFrame(frames + num_frames, BCI_THREAD_ID, tid);
+        }
+        if (_add_sched_frame) {
+            num_frames += makeFrame(frames + num_frames, BCI_ERROR, OS::schedPolicy(0));
+        }
+
+        u64 put_start = LatencyStats::start();
+        call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+        LatencyStats::add(LATENCY_STORAGE_PUT, put_start);
+        _method_profile.record(method_frames, frames, counter);
+        if (alloc_site != 0 && call_trace_id != OVERFLOW_TRACE_ID) {
+            _alloc_sites[lock_index].store(alloc_site, _call_trace_storage.epoch(), call_trace_id);
+        }
+        if ((event_type == BCI_ALLOC || event_type == BCI_ALLOC_OUTSIDE_TLAB) && _frameCache.allocationsEnabled()) {
+            _frameCache.addAllocation(lock_index, event->id(), event_type, call_trace_id, counter);
+        }
+        _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
     }
-    if (_add_sched_frame) {
-        num_frames += makeFrame(frames + num_frames, BCI_ERROR, OS::schedPolicy(0));
+
+    _locks[lock_index].unlock();
+    OverheadGovernor::add(OVERHEAD_SAMPLE, start);
+    LatencyStats::add(LATENCY_SAMPLE, start);
+    return call_trace_id;
+}
+
+// The checks of the engine, the JVM and the output are done here once rather than in every sample
+void Profiler::selectSamplePaths(bool perf) {
+    SamplePath alloc_path;
+    SamplePath hooked_path;
+    if (perf) {
+        _execution_path = &Profiler::processSample<true, WALK_SAMPLED, SINK_KINDLING>;
+        _event_paths[0] = &Profiler::processSample<true, WALK_SAMPLED, SINK_EVENT>;
+    } else {
+        _execution_path = &Profiler::processSample<false, WALK_SAMPLED, SINK_KINDLING>;
+        _event_paths[0] = &Profiler::processSample<false, WALK_SAMPLED, SINK_EVENT>;
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
-    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
+    if (VMStructs::_get_stack_trace != NULL) {
+        alloc_path = &Profiler::processSample<false, WALK_INTERNAL, SINK_EVENT>;
+    } else if (!VM::isOpenJ9()) {
+        alloc_path = &Profiler::processSample<false, WALK_ASYNC, SINK_EVENT>;
+    } else {
+        alloc_path = &Profiler::processSample<false, WALK_JVMTI, SINK_EVENT>;
+    }
+    if (!VM::isOpenJ9()) {
+        hooked_path = &Profiler::processSample<false, WALK_ASYNC, SINK_EVENT>;
+    } else {
+        // OpenJ9 has no AsyncGetCallTrace to find the Java frames of a hooked call
+        hooked_path = &Profiler::processSample<false, WALK_NONE, SINK_EVENT>;
+    }
 
-    _locks[lock_index].unlock();
+    for (int i = 1; i < SAMPLE_PATHS; i++) {
+        _event_paths[i] = &Profiler::processSample<false, WALK_JVMTI, SINK_EVENT>;
+    }
+    _event_paths[-BCI_ALLOC] = alloc_path;
+    _event_paths[-BCI_ALLOC_OUTSIDE_TLAB] = alloc_path;
+    _event_paths[-BCI_NATIVE_ALLOC] = hooked_path;
+    _event_paths[-BCI_IO] = hooked_path;
 }
 
 void Profiler::printExternalSample(int tid, int num_frames, ASGCT_CallFrame* frames) {
     u32 lock_index = getLockIndex(tid);
     if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
+        !_locks[lock_index = (lock_index + 1) & (_concurrency_level - 1)].tryLock() &&
+        !_locks[lock_index = (lock_index + 2) & (_concurrency_level - 1)].tryLock())
     {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
         return;
     }
 
-    printCallTrace(tid, num_frames, frames);
+    printCallTrace(lock_index, tid, num_frames, frames, 1, NULL);
 
     _locks[lock_index].unlock();
 }
 
+// One frame for a pc from a perf ring: compiled methods by their nmethod, anything else by symbol
+int Profiler::makeRingFrame(ASGCT_CallFrame* frame, const void* pc) {
+    if (CodeHeap::contains(pc)) {
+        NMethod* nmethod = CodeHeap::findNMethod(pc);
+        if (nmethod == NULL) {
+            return 0;
+        } else if (nmethod->isNMethod()) {
+            jmethodID method_id = nmethod->method()->constMethod()->id();
+            return method_id != NULL ? makeFrame(frame, FrameType::encode(FRAME_JIT_COMPILED, 0), method_id) : 0;
+        } else {
+            return makeFrame(frame, BCI_NATIVE_FRAME, nmethod->name());
+        }
+    }
+    return makeFrame(frame, BCI_NATIVE_FRAME, findNativeMethod(pc));
+}
+
+// A sample read from a perf ring on behalf of another thread (offcpu, perfpoll): the stack is
+// the kernel callchain, followed by the unwound user stack snapshot when the ring has one
+void Profiler::printRingSample(int tid, int num_pcs, const void** pcs, u64 counter, SampleEvent* sample,
+                               const StackSnapshot* snapshot) {
+    u64 start = TSC::ticks();
+    u32 lock_index = getLockIndex(tid);
+    if (!_locks[lock_index].tryLock() &&
+        !_locks[lock_index = (lock_index + 1) & (_concurrency_level - 1)].tryLock() &&
+        !_locks[lock_index = (lock_index + 2) & (_concurrency_level - 1)].tryLock())
+    {
+        atomicInc(_failures[-ticks_skipped]);
+        return;
+    }
+
+    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
+    int max_frames = _max_stack_depth + MAX_NATIVE_FRAMES;
+    int num_frames = 0;
+    for (int i = 0; i < num_pcs && num_frames < max_frames; i++) {
+        num_frames += makeRingFrame(frames + num_frames, pcs[i]);
+    }
+
+    // The user part of the stack was copied by the kernel and is unwound here, off the sampled thread
+    if (snapshot != NULL) {
+        const void* callchain[MAX_NATIVE_FRAMES];
+        StackContext java_ctx = {0};
+        int native_frames = StackWalker::walkDwarf(snapshot, callchain, MAX_NATIVE_FRAMES, &java_ctx);
+        for (int i = 0; i < native_frames && num_frames < max_frames; i++) {
+            num_frames += makeFrame(frames + num_frames, BCI_NATIVE_FRAME, findNativeMethod(callchain[i]));
+        }
+
+        if (java_ctx.pc != NULL && num_frames < max_frames) {
+            int java_frames = StackWalker::walkVM(&java_ctx, native_frames == 0, frames + num_frames,
+                                                  max_frames - num_frames, snapshot);
+            // The Java frames may lie beyond the copy; then only the first one is known
+            num_frames += java_frames > 0 ? java_frames : makeRingFrame(frames + num_frames, java_ctx.pc);
+        }
+    }
+
+    if (num_frames > 0) {
+        printCallTrace(lock_index, tid, num_frames, frames, counter, sample);
+    }
+
+    _locks[lock_index].unlock();
+    OverheadGovernor::add(OVERHEAD_SAMPLE, start);
+    LatencyStats::add(LATENCY_SAMPLE, start);
+}
+
 void Profiler::recordExternalSample(u64 counter, Event* event, int tid, int num_frames, ASGCT_CallFrame* frames) {
     atomicInc(_total_samples);
 
+    int method_frames = num_frames;
     if (_add_thread_frame) {
         num_frames += makeFrame(frames + num_frames, BCI_THREAD_ID, tid);
     }
@@ -724,18 +981,19 @@ void Profiler::recordExternalSample(u64 counter, Event* event, int tid, int num_
         num_frames += makeFrame(frames + num_frames, BCI_ERROR, OS::schedPolicy(tid));
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
-
     u32 lock_index = getLockIndex(tid);
     if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
+        !_locks[lock_index = (lock_index + 1) & (_concurrency_level - 1)].tryLock() &&
+        !_locks[lock_index = (lock_index + 2) & (_concurrency_level - 1)].tryLock())
     {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
         return;
     }
 
+    // Under the lock, so that resetting the storage never races with put()
+    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+    _method_profile.record(method_frames, frames, counter);
     _jfr.recordEvent(lock_index, tid, call_trace_id, 0, event, counter);
 
     _locks[lock_index].unlock();
@@ -751,12 +1009,33 @@ void Profiler::writeLog(LogLevel level, const char* message, size_t len) {
 
 void* Profiler::dlopen_hook(const char* filename, int flags) {
     void* result = dlopen(filename, flags);
-    if (result != NULL) {
-        instance()->updateSymbols(false);
+    if (result != NULL && Symbols::librariesChanged()) {
+        instance()->refreshLibraries();
     }
     return result;
 }
 
+// New libraries are parsed by the background scheduler rather than by the thread that
+// called dlopen, so that dlopen returns at once; their frames show as unknown until then.
+// A dlopen while a refresh is still waiting to start needs no other one.
+void Profiler::refreshLibraries() {
+    if (!__sync_bool_compare_and_swap(&_libs_pending, 0, 1)) {
+        return;
+    }
+    if (_refresh_libraries_task == NULL) {
+        _refresh_libraries_task = new RefreshLibrariesTask(this);
+    }
+    BackgroundScheduler::runOnce(_refresh_libraries_task);
+}
+
+// Hooks go in after the library is known
+void Profiler::loadNewLibraries() {
+    __atomic_store_n(&_libs_pending, 0, __ATOMIC_RELEASE);
+    Symbols::parseNewLibraries(&_native_libs);
+    MallocTracer::installHooks();
+    IoTracer::installHooks();
+}
+
 void Profiler::switchLibraryTrap(bool enable) {
     void* impl = enable ? (void*)dlopen_hook : (void*)dlopen;
     __atomic_store_n(_dlopen_entry, impl, __ATOMIC_RELEASE);
@@ -841,30 +1120,83 @@ void Profiler::setupSignalHandlers() {
     }
 }
 
-void Profiler::setThreadInfo(int tid, const char* name, jlong java_thread_id) {
+// Returns true if the name of a Java thread has not been reported yet
+bool Profiler::setThreadInfo(int tid, const char* name, jlong java_thread_id) {
     MutexLocker ml(_thread_names_lock);
     _thread_names[tid] = name;
-    _java_thread_names[tid] = name;
     _thread_ids[tid] = java_thread_id;
+    _native_thread_ids.erase(tid);
+
+    std::map<int, std::string>::iterator it = _java_thread_names.lower_bound(tid);
+    if (it != _java_thread_names.end() && it->first == tid) {
+        if (it->second == name) {
+            return false;
+        }
+        it->second = name;
+    } else {
+        _java_thread_names.insert(it, std::map<int, std::string>::value_type(tid, name));
+    }
+    return true;
 }
 
 void Profiler::updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
-    if (_update_thread_names) {
+    bool match_name = _thread_filter.hasPatterns();
+    if (_update_thread_names || match_name) {
         JitWriteProtection jit(true);  // workaround for JDK-8262896
         jvmtiThreadInfo thread_info;
         int native_thread_id = VMThread::nativeThreadId(jni, thread);
         if (native_thread_id >= 0 && jvmti->GetThreadInfo(thread, &thread_info) == 0) {
-            jlong java_thread_id = VMThread::javaThreadId(jni, thread);
-            setThreadInfo(native_thread_id, thread_info.name, java_thread_id);
-            EventLogger::log("kd-tm@%d!%s!", native_thread_id, thread_info.name);
-            // printf("Update java thread name [%s] for tid [%d]\n", thread_info.name, native_thread_id);
+            if (match_name) {
+                _thread_filter.updateName(native_thread_id, thread_info.name);
+            }
+            if (_update_thread_names) {
+                jlong java_thread_id = VMThread::javaThreadId(jni, thread);
+                if (setThreadInfo(native_thread_id, thread_info.name, java_thread_id)) {
+                    EventLogger::log("kd-tm@%d!%s!", native_thread_id, thread_info.name);
+                }
+            }
             jvmti->Deallocate((unsigned char*)thread_info.name);
         }
     }
 }
 
+void Profiler::forgetThreadName(int tid) {
+    MutexLocker ml(_thread_names_lock);
+    _java_thread_names.erase(tid);
+    _native_thread_ids.erase(tid);
+}
+
+// Warm restart: forgets the threads that exited while the profiler was stopped
+// and reports the others again from memory, so that the new session knows every
+// name from its first sample without a JVM TI pass
+void Profiler::restoreThreadNames() {
+    ThreadList* thread_list = _thread_registry.listThreads();
+    std::set<int> alive;
+    for (int tid; (tid = thread_list->next()) != -1; ) {
+        alive.insert(tid);
+    }
+    delete thread_list;
+
+    MutexLocker ml(_thread_names_lock);
+    for (std::map<int, std::string>::iterator it = _thread_names.begin(); it != _thread_names.end(); ) {
+        int tid = it->first;
+        if (alive.find(tid) == alive.end()) {
+            _java_thread_names.erase(tid);
+            _native_thread_ids.erase(tid);
+            _thread_ids.erase(tid);
+            _thread_names.erase(it++);
+            continue;
+        }
+        if (_update_thread_names && (_java_thread_names.find(tid) != _java_thread_names.end() ||
+                                     _native_thread_ids.find(tid) != _native_thread_ids.end())) {
+            EventLogger::log("kd-tm@%d!%s!", tid, it->second.c_str());
+        }
+        ++it;
+    }
+}
+
 void Profiler::updateJavaThreadNames() {
-    if (_update_thread_names) {
+    if (_update_thread_names || _thread_filter.hasPatterns()) {
         jvmtiEnv* jvmti = VM::jvmti();
         jint thread_count;
         jthread* thread_objects;
@@ -881,64 +1213,65 @@ void Profiler::updateJavaThreadNames() {
     }
 }
 
+// Reports only the native threads that have not been seen before,
+// and forgets the ones that have exited
 void Profiler::updateNativeThreadNames() {
     if (_update_thread_names) {
-        ThreadList* thread_list = OS::listThreads();
+        ThreadList* thread_list = _thread_registry.listThreads();
+        std::set<int> alive;
         char name_buf[64];
 
         for (int tid; (tid = thread_list->next()) != -1; ) {
+            alive.insert(tid);
             MutexLocker ml(_thread_names_lock);
-            bool ok = OS::threadName(tid, name_buf, sizeof(name_buf));
-            std::map<int, std::string>::iterator java_it = _java_thread_names.lower_bound(tid);
-            if (java_it == _java_thread_names.end() || java_it->first != tid) {
-                if (ok) {
-                    EventLogger::log("kd-tm@%d!%s!", tid, name_buf);
-                    // printf("Update native thread name [%s] for tid [%d]\n", name_buf, tid);
-                }
+            if (_java_thread_names.find(tid) != _java_thread_names.end() ||
+                _native_thread_ids.find(tid) != _native_thread_ids.end()) {
+                continue;
             }
-            
-            std::map<int, std::string>::iterator it = _thread_names.lower_bound(tid);
-            if (it == _thread_names.end() || it->first != tid) {
-                if (ok) {
+
+            if (OS::threadName(tid, name_buf, sizeof(name_buf))) {
+                EventLogger::log("kd-tm@%d!%s!", tid, name_buf);
+                _native_thread_ids.insert(tid);
+                std::map<int, std::string>::iterator it = _thread_names.lower_bound(tid);
+                if (it == _thread_names.end() || it->first != tid) {
                     _thread_names.insert(it, std::map<int, std::string>::value_type(tid, name_buf));
                 }
             }
         }
 
         delete thread_list;
-    }
-}
 
-bool Profiler::excludeTrace(FrameName* fn, CallTrace* trace) {
-    bool checkInclude = fn->hasIncludeList();
-    bool checkExclude = fn->hasExcludeList();
-    if (!(checkInclude || checkExclude)) {
-        return false;
-    }
-
-    for (int i = 0; i < trace->num_frames; i++) {
-        const char* frame_name = fn->name(trace->frames[i], true);
-        if (checkExclude && fn->exclude(frame_name)) {
-            return true;
-        }
-        if (checkInclude && fn->include(frame_name)) {
-            checkInclude = false;
-            if (!checkExclude) break;
+        MutexLocker ml(_thread_names_lock);
+        for (std::set<int>::iterator it = _native_thread_ids.begin(); it != _native_thread_ids.end(); ) {
+            if (alive.find(*it) == alive.end()) {
+                _native_thread_ids.erase(it++);
+            } else {
+                ++it;
+            }
         }
     }
+}
 
-    return checkInclude;
+bool Profiler::excludeTrace(FrameName* fn, CallTrace* trace) {
+    return fn->excluded(trace->num_frames, trace->frames);
 }
 
 Engine* Profiler::selectEngine(const char* event_name) {
     if (event_name == NULL) {
         return &noop_engine;
     } else if (strcmp(event_name, EVENT_CPU) == 0) {
-        return PerfEvents::supported() ? (Engine*)&perf_events : (Engine*)&wall_clock;
+        if (PerfEvents::supported()) {
+            return &perf_events;
+        }
+        return CTimer::supported() ? (Engine*)&ctimer : (Engine*)&wall_clock;
     } else if (strcmp(event_name, EVENT_WALL) == 0) {
         return VM::isOpenJ9() ? (Engine*)&j9_wall_clock : (Engine*)&wall_clock;
     } else if (strcmp(event_name, EVENT_ITIMER) == 0) {
         return &itimer;
+    } else if (strcmp(event_name, EVENT_CTIMER) == 0) {
+        return &ctimer;
+    } else if (strcmp(event_name, EVENT_TTSP) == 0) {
+        return &safepoint_profiler;
     } else if (strchr(event_name, '.') != NULL && strchr(event_name, ':') == NULL) {
         return &instrument;
     } else {
@@ -962,6 +1295,12 @@ Engine* Profiler::activeEngine() {
             return _alloc_engine;
         case EM_LOCK:
             return &lock_tracer;
+        case EM_NATIVEMEM:
+            return &malloc_tracer;
+        case EM_IO:
+            return &io_tracer;
+        case EM_METHODS:
+            return &method_tracer;
         default:
             return _engine;
     }
@@ -1003,7 +1342,10 @@ Error Profiler::start(Arguments& args, bool reset) {
 
     _event_mask = (args._event != NULL ? EM_CPU : 0) |
                   (args._alloc >= 0 ? EM_ALLOC : 0) |
-                  (args._lock >= 0 ? EM_LOCK : 0);
+                  (args._lock >= 0 ? EM_LOCK : 0) |
+                  (args._nativemem >= 0 ? EM_NATIVEMEM : 0) |
+                  (args._io >= 0 ? EM_IO : 0) |
+                  (args._methods != NULL ? EM_METHODS : 0);
     if (_event_mask == 0) {
         return Error("No profiling events specified");
     // } else if ((_event_mask & (_event_mask - 1)) && args._output != OUTPUT_JFR) {
@@ -1016,16 +1358,37 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    _profile_windows.setup(args._windows, args._window_time, time(NULL));
+    BackgroundScheduler::configure(args);
+
+    // Applies to tables allocated from now on, such as the epoch swapped in below
+    OS::setLargePages(args._large_pages, args._numa_interleave);
+
+    // Caches of the previous session are kept; only what changed meanwhile is refreshed
+    bool warm = args._warm && _start_time != 0;
+    FrameName::keepCache(args._warm);
+
     if (reset || _start_time == 0) {
         // Reset counters
         _total_samples = 0;
         memset(_failures, 0, sizeof(_failures));
+        _vm_walks = 0;
+        _vm_walk_fallbacks = 0;
+        _frameCache.clearCounters();
+        _symbol_cache.clearCounters();
 
-        // Reset dicrionaries and bitmaps
+        // Reset dicrionaries and bitmaps. The call trace storage only swaps
+        // in an empty epoch here; the old one is released in the background
         lockAll();
-        _class_map.clear();
+        if (!warm) {
+            _class_map.clear();
+        }
         _thread_filter.clear();
-        _call_trace_storage.clear();
+        // Samples collected so far stay in the open window
+        _profile_windows.reset(_call_trace_storage);
+        // Traces of the baseline belong to the old epoch
+        _baseline.clear();
+        _exporter.reset();
         // Make sure frame structure is consistent throughout the entire recording
         _add_event_frame = args._output != OUTPUT_JFR;
         _add_thread_frame = args._threads && args._output != OUTPUT_JFR;
@@ -1033,18 +1396,24 @@ Error Profiler::start(Arguments& args, bool reset) {
         unlockAll();
 
         // Reset thread names and IDs
-        MutexLocker ml(_thread_names_lock);
-        _thread_names.clear();
-        _java_thread_names.clear();
-        _thread_ids.clear();
+        if (!warm) {
+            MutexLocker ml(_thread_names_lock);
+            _thread_names.clear();
+            _java_thread_names.clear();
+            _native_thread_ids.clear();
+            _thread_ids.clear();
+        }
     }
 
+    // No samples are recorded until the engines start
+    _method_profile.start(args._hot_methods, reset || _start_time == 0);
+
     // (Re-)allocate calltrace buffers
     if (_max_stack_depth != args._jstackdepth) {
         _max_stack_depth = args._jstackdepth;
         size_t buffer_size = (_max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES) * sizeof(CallTraceBuffer);
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        for (int i = 0; i < _concurrency_level; i++) {
             free(_calltrace_buffer[i]);
             _calltrace_buffer[i] = (CallTraceBuffer*)malloc(buffer_size);
             if (_calltrace_buffer[i] == NULL) {
@@ -1054,22 +1423,53 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    _alloc_site_reuse = args._alloc_site_reuse;
+    if (_alloc_site_reuse > 0 && _alloc_sites == NULL) {
+        _alloc_sites = new AllocSiteCache[_concurrency_level];
+    }
+
+    // (Re-)allocate Kindling CPU event rings
+    _frameCache.init(args._kd_capacity, args._kd_depth, args._sample_cpu);
+    if (!_frameCache.openSpill(args._kd_spill, args._kd_spill_size)) {
+        return Error("Could not create Kindling spill file");
+    }
+
     _safe_mode = args._safe_mode;
     if (VM::hotspot_version() < 8) {
         _safe_mode |= GC_TRACES | LAST_JAVA_PC;
     }
+    _gc_skip = args._gc_skip;
+    _vm_stack_walk = args._jstack_walk == JSTACK_VM && VMStructs::hasStackStructs();
+    if (args._jstack_walk == JSTACK_VM && !_vm_stack_walk) {
+        Log::warn("VMStructs stack walker is not supported on this JVM, using AsyncGetCallTrace");
+    }
+
+    if (args._kd_tsc && !TSC::initialized()) {
+        TSC::initialize();
+    }
+    KdClock::init(args._kd_tsc);
 
     EventLogger::open("/dev/null");
+    if (args._kd_shm != NULL && !EventLogger::openRing(args._kd_shm, args._kd_shm_size)) {
+        return Error("Could not create Kindling event ring");
+    }
+    if (args._kd_async) {
+        EventLogger::startWriter(args._kd_compress);
+    }
     _update_thread_names = args._threads || args._output == OUTPUT_JFR;
     _thread_filter.init(args._filter);
-    _update_thread_names_task = new UpdateThreadNamesTask(this);
-    _update_thread_names_thread = std::thread([&]{
-        VM::attachThread("AsyncProfiler-Threads-Dump");
-        _update_thread_names_task->run();
-        VM::detachThread();
-    });
-    updateJavaThreadNames();
-    updateNativeThreadNames();
+    if (_thread_filter.hasPatterns()) {
+        // Threads started later are matched on ThreadStart
+        updateJavaThreadNames();
+    }
+    if (warm) {
+        restoreThreadNames();
+    } else {
+        updateJavaThreadNames();
+        updateNativeThreadNames();
+    }
+    _update_thread_names_task = new UpdateThreadNamesTask(this, warm);
+    BackgroundScheduler::schedule(_update_thread_names_task, THREAD_NAMES_INTERVAL_MS, warm);
 
     _engine = selectEngine(args._event);
     _cstack = args._cstack;
@@ -1080,26 +1480,53 @@ Error Profiler::start(Arguments& args, bool reset) {
     }
 
     // Kernel symbols are useful only for perf_events without --all-user
-    updateSymbols(_engine == &perf_events && args._ring != RING_USER);
+    bool kernel_symbols = _engine == &perf_events && args._ring != RING_USER;
+    if (warm && (!kernel_symbols || Symbols::haveKernelSymbols())) {
+        // Parsed libraries stay valid; skip the scan of the whole address space
+        if (Symbols::librariesChanged()) {
+            Symbols::parseNewLibraries(&_native_libs);
+        }
+    } else {
+        updateSymbols(kernel_symbols);
+    }
+
+    if (args._perf_map != NULL) {
+        _stubs_lock.lockShared();
+        error = PerfMap::start(args, &_runtime_stubs);
+        _stubs_lock.unlockShared();
+        if (error) {
+            return error;
+        }
+    }
 
     error = installTraps(args._begin, args._end);
     if (error) {
+        PerfMap::stop();
         return error;
     }
 
     switchLibraryTrap(true);
 
+    // Also used by the JFR CPU monitor
+    CgroupCpu::reset(args._cgroup);
+
     if (args._output == OUTPUT_JFR) {
         error = _jfr.start(args, reset);
         if (error) {
             uninstallTraps();
             switchLibraryTrap(false);
+            PerfMap::stop();
             return error;
         }
     }
 
     _epoch++;
     _frameName = new FrameName(args, args._style, _epoch, _thread_names_lock, _thread_names);
+    LatencyStats::reset(args._latency_stats);
+    MemoryBudget::setLimit(args._memory_limit);
+    GcPhase::start();
+    _frameCache.enableAllocations(args._kd_alloc && (_event_mask & EM_ALLOC));
+    selectSamplePaths(_engine == &perf_events);
     error = _engine->start(args);
     if (error) {
         goto error1;
@@ -1118,8 +1545,36 @@ Error Profiler::start(Arguments& args, bool reset) {
             goto error3;
         }
     }
+    if (_event_mask & EM_NATIVEMEM) {
+        error = malloc_tracer.start(args);
+        if (error) {
+            goto error4;
+        }
+    }
+    if (_event_mask & EM_IO) {
+        error = io_tracer.start(args);
+        if (error) {
+            goto error5;
+        }
+    }
+    if (_event_mask & EM_METHODS) {
+        error = method_tracer.start(args);
+        if (error) {
+            goto error6;
+        }
+    }
+    if (args._heap_monitor >= 0) {
+        error = HeapMonitor::start(args);
+        if (error) {
+            goto error7;
+        }
+    }
+    if ((_event_mask & EM_CPU) || _frameCache.allocationsEnabled()) {
+        _frameCache.startCollectThreadTask(_frameName, args._interval ? args._interval : DEFAULT_INTERVAL, args._kd_format, args._kd_aggregate, args._kd_states, args._kd_groups, args._kd_delta);
+    }
+
     if (_event_mask & EM_CPU) {
-        _frameCache.startCollectThreadTask(_frameName, args._interval ? args._interval : DEFAULT_INTERVAL);
+        _governor.start(args, _engine);
     }
 
     switchThreadEvents(JVMTI_ENABLE);
@@ -1127,13 +1582,25 @@ Error Profiler::start(Arguments& args, bool reset) {
     _state = RUNNING;
     _start_time = time(NULL);
 
-    if (args._timeout != 0 || args._output == OUTPUT_JFR) {
+    if (args._timeout != 0 || args._output == OUTPUT_JFR || _profile_windows.enabled()) {
         _stop_time = addTimeout(_start_time, args._timeout);
         startTimer();
     }
 
     return Error::OK;
 
+error7:
+    if (_event_mask & EM_METHODS) method_tracer.stop();
+
+error6:
+    if (_event_mask & EM_IO) io_tracer.stop();
+
+error5:
+    if (_event_mask & EM_NATIVEMEM) malloc_tracer.stop();
+
+error4:
+    if (_event_mask & EM_LOCK) lock_tracer.stop();
+
 error3:
     if (_event_mask & EM_ALLOC) _alloc_engine->stop();
 
@@ -1141,8 +1608,10 @@ error2:
     _engine->stop();
 
 error1:
+    GcPhase::stop();
     uninstallTraps();
     switchLibraryTrap(false);
+    PerfMap::stop();
 
     lockAll();
     _jfr.stop();
@@ -1160,19 +1629,29 @@ Error Profiler::stop() {
 
     uninstallTraps();
 
+    HeapMonitor::stop();
+    if (_event_mask & EM_METHODS) method_tracer.stop();
+    if (_event_mask & EM_IO) io_tracer.stop();
+    if (_event_mask & EM_NATIVEMEM) malloc_tracer.stop();
     if (_event_mask & EM_LOCK) lock_tracer.stop();
     if (_event_mask & EM_ALLOC) _alloc_engine->stop();
-    if (_event_mask & EM_CPU) _frameCache.endCollectThreadTask();
+    if ((_event_mask & EM_CPU) || _frameCache.allocationsEnabled()) _frameCache.endCollectThreadTask();
 
+    _governor.stop();
     _engine->stop();
+    _method_profile.stop();
+    GcPhase::stop();
+    PerfMap::stop();
+    if (_gc_skip) {
+        Log::debug("Java stack walks skipped during GC pauses: %llu", GcPhase::pausedSamples());
+    }
 
     switchLibraryTrap(false);
     switchThreadEvents(JVMTI_DISABLE);
     updateJavaThreadNames();
     updateNativeThreadNames();
 
-    _update_thread_names_task->stop();
-    _update_thread_names_thread.join();
+    BackgroundScheduler::cancel(_update_thread_names_task);
     delete _update_thread_names_task;
 
     // Make sure no periodic events sent after JFR stops
@@ -1240,6 +1719,20 @@ Error Profiler::dump(std::ostream& out, Arguments& args) {
         updateNativeThreadNames();
     }
 
+    if (args._last > 0 && !_profile_windows.enabled()) {
+        return Error("No profile windows are kept (start with windows=N)");
+    }
+    // Window traces must not be freed by the timer while the dump refers to them
+    MutexLocker wl(_profile_windows.mutex());
+
+    if (args._baseline) {
+        _baseline.clear();
+        _call_trace_storage.collectSamples(_baseline);
+        if (args._output == OUTPUT_NONE) {
+            return Error::OK;
+        }
+    }
+
     switch (args._output) {
         case OUTPUT_COLLAPSED:
             dumpCollapsed(out, args);
@@ -1253,6 +1746,9 @@ Error Profiler::dump(std::ostream& out, Arguments& args) {
         case OUTPUT_TEXT:
             dumpText(out, args);
             break;
+        case OUTPUT_PPROF:
+            dumpPprof(out, args);
+            break;
         case OUTPUT_JFR:
             if (_state == RUNNING) {
                 lockAll();
@@ -1267,12 +1763,24 @@ Error Profiler::dump(std::ostream& out, Arguments& args) {
     return Error::OK;
 }
 
+Error Profiler::exportSamples(char* buf, size_t capacity, bool incremental, long& size) {
+    MutexLocker ml(_state_lock);
+    if (_state != IDLE && _state != RUNNING) {
+        return Error("Profiler has not started");
+    }
+
+    Arguments args;
+    FrameName fn(args, args._style, _epoch, _thread_names_lock, _thread_names);
+    size = _exporter.write(_call_trace_storage, &fn, incremental, buf, capacity);
+    return Error::OK;
+}
+
 void Profiler::lockAll() {
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
+    for (int i = 0; i < _concurrency_level; i++) _locks[i].lock();
 }
 
 void Profiler::unlockAll() {
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].unlock();
+    for (int i = 0; i < _concurrency_level; i++) _locks[i].unlock();
 }
 
 void Profiler::switchThreadEvents(jvmtiEventMode mode) {
@@ -1289,29 +1797,97 @@ void Profiler::switchThreadEvents(jvmtiEventMode mode) {
  * 
  * <frame>;<frame>;...;<topmost frame> <count>
  */
+// Samples to dump: with 'diff', the value since the baseline and the value at the baseline
+void Profiler::collectDeltas(Arguments& args, std::vector<CallTraceDelta>& deltas) {
+    bool by_samples = args._counter == COUNTER_SAMPLES;
+
+    if (args._leaks || args._live > 0) {
+        // Only the native allocations sampled and not freed since, or the sampled objects still alive
+        std::map<u32, LiveTotal> live;
+        if (args._leaks) MallocTracer::collectLive(live);
+        if (args._live > 0) ObjectSampler::collectLive(live);
+        std::vector<CallTraceRef> traces;
+        _call_trace_storage.collectTraces(traces);
+        for (std::vector<CallTraceRef>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
+            std::map<u32, LiveTotal>::const_iterator total = live.find(it->id);
+            if (total != live.end()) {
+                CallTraceDelta delta = {it->trace, by_samples ? total->second.samples : total->second.bytes, 0};
+                deltas.push_back(delta);
+            }
+        }
+        return;
+    }
+
+    if (args._last > 0) {
+        std::map<u64, CallTraceSample> recent;
+        _profile_windows.collect(_call_trace_storage, time(NULL) - args._last, recent);
+        for (std::map<u64, CallTraceSample>::const_iterator it = recent.begin(); it != recent.end(); ++it) {
+            u64 value = by_samples ? it->second.samples : it->second.counter;
+            if (value != 0) {
+                CallTraceDelta delta = {it->second.trace, value, 0};
+                deltas.push_back(delta);
+            }
+        }
+        return;
+    }
+
+    if (!args._diff) {
+        std::vector<CallTraceSample*> samples;
+        _call_trace_storage.collectSamples(samples);
+        for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+            CallTrace* trace = (*it)->acquireTrace();
+            u64 value = by_samples ? (*it)->samples : (*it)->counter;
+            if (trace != NULL && value != 0) {
+                CallTraceDelta delta = {trace, value, 0};
+                deltas.push_back(delta);
+            }
+        }
+        return;
+    }
+
+    std::map<u64, CallTraceSample> current;
+    _call_trace_storage.collectSamples(current);
+    for (std::map<u64, CallTraceSample>::const_iterator it = current.begin(); it != current.end(); ++it) {
+        u64 value = by_samples ? it->second.samples : it->second.counter;
+        u64 base = 0;
+        std::map<u64, CallTraceSample>::const_iterator b = _baseline.find(it->first);
+        if (b != _baseline.end()) {
+            base = by_samples ? b->second.samples : b->second.counter;
+        }
+        if (value > base || base != 0) {
+            CallTraceDelta delta = {it->second.trace, value > base ? value - base : 0, base};
+            deltas.push_back(delta);
+        }
+    }
+
+    // Stacks that were not seen since are still part of the baseline
+    for (std::map<u64, CallTraceSample>::const_iterator it = _baseline.begin(); it != _baseline.end(); ++it) {
+        u64 base = by_samples ? it->second.samples : it->second.counter;
+        if (base != 0 && current.find(it->first) == current.end()) {
+            CallTraceDelta delta = {it->second.trace, 0, base};
+            deltas.push_back(delta);
+        }
+    }
+}
+
 void Profiler::dumpCollapsed(std::ostream& out, Arguments& args) {
     FrameName fn(args, args._style, _epoch, _thread_names_lock, _thread_names);
-    char buf[32];
-
-    std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    CollapsedWriter writer(out, &fn);
 
-    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-        CallTrace* trace = (*it)->acquireTrace();
-        if (trace == NULL || excludeTrace(&fn, trace)) continue;
+    std::vector<CallTraceDelta> deltas;
+    collectDeltas(args, deltas);
 
-        u64 counter = args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter;
-        if (counter == 0) continue;
+    for (std::vector<CallTraceDelta>::const_iterator it = deltas.begin(); it != deltas.end(); ++it) {
+        if (excludeTrace(&fn, it->trace)) continue;
 
-        for (int j = trace->num_frames - 1; j >= 0; j--) {
-            const char* frame_name = fn.name(trace->frames[j]);
-            out << frame_name << (j == 0 ? ' ' : ';');
+        if (args._diff) {
+            writer.writeTrace(it->trace, it->base, it->value);
+        } else if (it->value != 0) {
+            writer.writeTrace(it->trace, it->value);
         }
-        // Beware of locale-sensitive conversion
-        out.write(buf, sprintf(buf, "%llu\n", counter));
     }
 
-    if (!out.good()) {
+    if (!writer.finish()) {
         Log::warn("Output file may be incomplete");
     }
 }
@@ -1327,19 +1903,19 @@ void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
         }
     }
 
-    FlameGraph flamegraph(args._title == NULL ? title : args._title, args._counter, args._minwidth, args._reverse);
+    FlameGraph flamegraph(args._title == NULL ? title : args._title, args._counter, args._minwidth, args._max_frames, args._reverse);
     FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names);
 
-    std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    std::vector<CallTraceDelta> deltas;
+    collectDeltas(args, deltas);
 
-    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-        CallTrace* trace = (*it)->acquireTrace();
-        if (trace == NULL || excludeTrace(&fn, trace)) continue;
-
-        u64 counter = args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter;
-        if (counter == 0) continue;
+    for (std::vector<CallTraceDelta>::const_iterator it = deltas.begin(); it != deltas.end(); ++it) {
+        CallTrace* trace = it->trace;
+        if (excludeTrace(&fn, trace)) continue;
 
+        // In a diff, the baseline value follows the same path in the same pass
+        u64 counter = it->value;
+        u64 base = it->base;
         int num_frames = trace->num_frames;
 
         Trie* f = flamegraph.root();
@@ -1347,31 +1923,58 @@ void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
             // Thread frames always come first
             if (_add_sched_frame) {
                 const char* frame_name = fn.name(trace->frames[--num_frames]);
-                f = f->addChild(frame_name, counter);
+                f = flamegraph.addChild(f, frame_name, counter, base);
             }
             if (_add_thread_frame) {
                 const char* frame_name = fn.name(trace->frames[--num_frames]);
-                f = f->addChild(frame_name, counter);
+                f = flamegraph.addChild(f, frame_name, counter, base);
             }
 
             for (int j = 0; j < num_frames; j++) {
                 const char* frame_name = fn.name(trace->frames[j]);
-                f = f->addChild(frame_name, counter);
+                f = flamegraph.addChild(f, frame_name, counter, base);
                 f->addCompilationDetails(trace->frames[j].bci, counter);
             }
         } else {
             for (int j = num_frames - 1; j >= 0; j--) {
                 const char* frame_name = fn.name(trace->frames[j]);
-                f = f->addChild(frame_name, counter);
+                f = flamegraph.addChild(f, frame_name, counter, base);
                 f->addCompilationDetails(trace->frames[j].bci, counter);
             }
         }
-        f->addLeaf(counter);
+        f->addLeaf(counter, base);
     }
 
     flamegraph.dump(out, tree);
 }
 
+void Profiler::dumpPprof(std::ostream& out, Arguments& args) {
+    Engine* active_engine = activeEngine();
+    const char* units = active_engine->units();
+    const char* unit = strcmp(units, "ns") == 0 ? "nanoseconds" : strcmp(units, "total") == 0 ? "count" : units;
+
+    FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names);
+    Pprof pprof(&fn, active_engine->title(), unit);
+
+    std::vector<CallTraceSample*> samples;
+    _call_trace_storage.collectSamples(samples);
+
+    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        CallTrace* trace = (*it)->acquireTrace();
+        if (trace == NULL || excludeTrace(&fn, trace)) continue;
+        if ((*it)->samples == 0) continue;
+
+        pprof.addSample(trace, (*it)->samples, (*it)->counter);
+    }
+
+    time_t now = time(NULL);
+    pprof.write(out, (u64)_start_time * 1000000000, (u64)(now - _start_time) * 1000000000,
+                active_engine->interval(), args._counter == COUNTER_TOTAL);
+    if (!out.good()) {
+        Log::warn("Output file may be incomplete");
+    }
+}
+
 void Profiler::dumpText(std::ostream& out, Arguments& args) {
     FrameName fn(args, args._style | STYLE_DOTTED, _epoch, _thread_names_lock, _thread_names);
     char buf[1024] = {0};
@@ -1409,6 +2012,11 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
             out << buf;
         }
     }
+    u64 dropped = _frameCache.dropped();
+    if (dropped > 0) {
+        snprintf(buf, sizeof(buf), "%-20s: %lld\n", "cpu_events_dropped", dropped);
+        out << buf;
+    }
     out << "\n";
 
     double cpercent = 100.0 / total_counter;
@@ -1459,6 +2067,188 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
     }
 }
 
+// Served from the hotmethods table, so neither the call trace storage
+// nor the sample locks are touched while the profiler is running
+Error Profiler::dumpTop(std::ostream& out, Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (!_method_profile.available()) {
+        return Error("Method profile is not collected (start with hotmethods)");
+    }
+
+    std::vector<MethodProfileEntry*> entries;
+    _method_profile.top(args._dump_top, args._top_by_total, entries);
+
+    FrameName fn(args, args._style | STYLE_DOTTED, _epoch, _thread_names_lock, _thread_names);
+    const char* units_str = activeEngine()->units();
+    u64 total_counter = _method_profile.counter();
+    double cpercent = total_counter > 0 ? 100.0 / total_counter : 0;
+    char buf[1024];
+
+    snprintf(buf, sizeof(buf), "--- Hot methods: %llu samples, %llu %s ---\n",
+             _method_profile.samples(), total_counter, units_str);
+    out << buf;
+    if (_method_profile.overflow() > 0) {
+        snprintf(buf, sizeof(buf), "%-20s: %llu\n", "methods_overflow", _method_profile.overflow());
+        out << buf;
+    }
+
+    snprintf(buf, sizeof(buf), "%12s  percent  samples  %12s  percent  method\n"
+                               "  ----------  -------  -------  ------------  -------  ------\n", "self", "total");
+    out << buf;
+
+    for (std::vector<MethodProfileEntry*>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        const MethodProfileEntry* e = *it;
+        ASGCT_CallFrame frame = {e->bci, e->method};
+        snprintf(buf, sizeof(buf), "%12llu  %6.2f%%  %7llu  %12llu  %6.2f%%  %s\n",
+                 e->self_counter, e->self_counter * cpercent, e->self_samples,
+                 e->total_counter, e->total_counter * cpercent, fn.name(frame));
+        out << buf;
+    }
+
+    return Error::OK;
+}
+
+int Profiler::getSnapshotTrace(void* ucontext, ASGCT_CallFrame* frames, int max_depth) {
+    const void* callchain[MAX_NATIVE_FRAMES];
+    StackContext java_ctx = {0};
+    int native_frames = StackWalker::walkFP(ucontext, callchain, MAX_NATIVE_FRAMES, &java_ctx);
+    int num_frames = convertNativeTrace(native_frames, callchain, frames);
+    if (num_frames < max_depth) {
+        num_frames += getJavaTraceAsync(ucontext, frames + num_frames, max_depth - num_frames, &java_ctx);
+    }
+    return num_frames;
+}
+
+static int compareSnapshotStacks(const SnapshotSlot* a, const SnapshotSlot* b) {
+    if (a->num_frames != b->num_frames) {
+        return a->num_frames < b->num_frames ? -1 : 1;
+    }
+    for (int i = 0; i < a->num_frames; i++) {
+        if (a->frames[i].method_id != b->frames[i].method_id) {
+            return a->frames[i].method_id < b->frames[i].method_id ? -1 : 1;
+        }
+        if (a->frames[i].bci != b->frames[i].bci) {
+            return a->frames[i].bci < b->frames[i].bci ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+struct SnapshotStackOrder {
+    bool operator()(const SnapshotSlot* a, const SnapshotSlot* b) const {
+        return compareSnapshotStacks(a, b) < 0;
+    }
+};
+
+// Threads sharing a stack, most common stacks first
+struct SnapshotGroup {
+    int start;
+    int size;
+
+    bool operator<(const SnapshotGroup& other) const {
+        return size > other.size || (size == other.size && start < other.start);
+    }
+};
+
+void Profiler::snapshotThreadName(int tid, char* buf, size_t size) {
+    {
+        MutexLocker ml(_thread_names_lock);
+        std::map<int, std::string>::iterator it = _thread_names.find(tid);
+        if (it != _thread_names.end()) {
+            snprintf(buf, size, "[%s tid=%d]", it->second.c_str(), tid);
+            return;
+        }
+    }
+    char name[64];
+    if (OS::threadName(tid, name, sizeof(name))) {
+        snprintf(buf, size, "[%s tid=%d]", name, tid);
+    } else {
+        snprintf(buf, size, "[tid=%d]", tid);
+    }
+}
+
+Error Profiler::dumpSnapshot(std::ostream& out, Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        // Native frames are named from the libraries parsed by the last start
+        updateSymbols(false);
+    }
+
+    _thread_registry.scan();
+    std::vector<int> tids;
+    _thread_registry.collect(tids);
+    int self = OS::threadId();
+    for (size_t i = 0; i < tids.size(); i++) {
+        if (tids[i] == self) {
+            tids.erase(tids.begin() + i);
+            break;
+        }
+    }
+
+    u64 start = OS::nanotime();
+    Error error = ThreadSnapshot::take(tids, args._snapshot_timeout > 0 ? args._snapshot_timeout : DEFAULT_SNAPSHOT_TIMEOUT);
+    if (error) {
+        return error;
+    }
+    u64 elapsed_us = (OS::nanotime() - start) / 1000;
+
+    std::vector<SnapshotSlot*> answered;
+    std::vector<int> missed;
+    for (int i = 0; i < ThreadSnapshot::count(); i++) {
+        SnapshotSlot* slot = ThreadSnapshot::slot(i);
+        if (slot->state == SLOT_DONE) {
+            answered.push_back(slot);
+        } else {
+            missed.push_back(slot->tid);
+        }
+    }
+    std::stable_sort(answered.begin(), answered.end(), SnapshotStackOrder());
+
+    std::vector<SnapshotGroup> groups;
+    for (size_t i = 0; i < answered.size(); i++) {
+        if (i == 0 || compareSnapshotStacks(answered[i - 1], answered[i]) != 0) {
+            SnapshotGroup group = {(int)i, 0};
+            groups.push_back(group);
+        }
+        groups.back().size++;
+    }
+    std::sort(groups.begin(), groups.end());
+
+    FrameName fn(args, args._style | STYLE_DOTTED, _epoch, _thread_names_lock, _thread_names);
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "--- Thread snapshot: %d threads in %llu us, %d distinct stacks, %d missed ---\n",
+             (int)answered.size(), elapsed_us, (int)groups.size(), (int)missed.size());
+    out << buf;
+
+    for (size_t g = 0; g < groups.size(); g++) {
+        const SnapshotGroup& group = groups[g];
+        SnapshotSlot* first = answered[group.start];
+        snprintf(buf, sizeof(buf), "\n--- Stack %d: %d threads\n", (int)g + 1, group.size);
+        out << buf;
+        for (int i = 0; i < group.size; i++) {
+            snapshotThreadName(answered[group.start + i]->tid, buf, sizeof(buf));
+            out << "  " << buf << "\n";
+        }
+        for (int i = 0; i < first->num_frames; i++) {
+            out << "    " << fn.name(first->frames[i]) << "\n";
+        }
+        if (first->num_frames == 0) {
+            out << "    [no frames]\n";
+        }
+    }
+
+    if (!missed.empty()) {
+        out << "\n--- Missed threads\n";
+        for (size_t i = 0; i < missed.size(); i++) {
+            snapshotThreadName(missed[i], buf, sizeof(buf));
+            out << "  " << buf << "\n";
+        }
+    }
+
+    ThreadSnapshot::release();
+    return Error::OK;
+}
+
 time_t Profiler::addTimeout(time_t start, int timeout) {
     if (timeout == 0) {
         return (time_t)0x7fffffff;
@@ -1523,7 +2313,8 @@ void Profiler::stopTimer() {
 void Profiler::timerLoop(void* timer_id) {
     u64 current_micros = OS::micros();
     u64 stop_micros = _stop_time * 1000000ULL;
-    u64 sleep_until = _jfr.active() ? current_micros + 1000000 : stop_micros;
+    bool ticks = _jfr.active() || _profile_windows.enabled();
+    u64 sleep_until = ticks ? current_micros + 1000000 : stop_micros;
 
     MutexLocker ml(_timer_lock);
     while (_timer_id == timer_id) {
@@ -1537,6 +2328,8 @@ void Profiler::timerLoop(void* timer_id) {
             return;
         }
 
+        _profile_windows.tick(_call_trace_storage, (time_t)(current_micros / 1000000));
+
         bool need_switch_chunk = _jfr.timerTick(current_micros);
         if (need_switch_chunk) {
             // Flush under profiler state lock
@@ -1592,11 +2385,42 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             MutexLocker ml(_state_lock);
             if (_state == RUNNING) {
                 out << "Profiling is running for " << uptime() << " seconds\n";
+                u64 skipped = _failures[-ticks_skipped];
+                char rate[32];
+                snprintf(rate, sizeof(rate), "%.2f%%", _total_samples > 0 ? skipped * 100.0 / _total_samples : 0.0);
+                out << "Skipped samples: " << skipped << " (" << rate << ")\n";
+                out << "Sample buffers: " << _concurrency_level << "\n";
+                out << "Native symbol cache: " << _symbol_cache.hits() << " hits, " << _symbol_cache.misses() << " misses\n";
+                out << "Dropped CPU events: " << _frameCache.dropped() << "\n";
+                out << "Dropped Kindling records: " << EventLogger::dropped() << "\n";
+                if (_vm_stack_walk) {
+                    out << "VMStructs stack walks: " << _vm_walks << ", AsyncGetCallTrace fallbacks: " << _vm_walk_fallbacks << "\n";
+                }
+                _governor.status(out);
+                LatencyStats::status(out);
+                MemoryBudget::status(out);
+                if (_engine == &perf_events && PerfEvents::boostRejected() != 0) {
+                    out << "Rejected capture windows: " << PerfEvents::boostRejected() << "\n";
+                }
             } else {
                 out << "Profiler is not active\n";
             }
             break;
         }
+        case ACTION_TOP: {
+            Error error = dumpTop(out, args);
+            if (error) {
+                return error;
+            }
+            break;
+        }
+        case ACTION_SNAPSHOT: {
+            Error error = dumpSnapshot(out, args);
+            if (error) {
+                return error;
+            }
+            break;
+        }
         case ACTION_LIST: {
             out << "Basic events:\n";
             out << "  " << EVENT_CPU << "\n";
@@ -1604,6 +2428,10 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             out << "  " << EVENT_LOCK << "\n";
             out << "  " << EVENT_WALL << "\n";
             out << "  " << EVENT_ITIMER << "\n";
+            out << "  " << EVENT_CTIMER << "\n";
+            if (VMStructs::hasSafepointState()) {
+                out << "  " << EVENT_TTSP << "\n";
+            }
 
             out << "Java method calls:\n";
             out << "  ClassName.methodName\n";
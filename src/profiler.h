@@ -19,9 +19,12 @@
 
 #include <iostream>
 #include <map>
+#include <set>
 #include <time.h>
+#include "allocSiteCache.h"
 #include "arch.h"
 #include "arguments.h"
+#include "backgroundScheduler.h"
 #include "callTraceStorage.h"
 #include "codeCache.h"
 #include "dictionary.h"
@@ -29,13 +32,19 @@
 #include "event.h"
 #include "flightRecorder.h"
 #include "log.h"
+#include "methodProfile.h"
 #include "mutex.h"
+#include "overheadGovernor.h"
+#include "perfMap.h"
+#include "profileWindows.h"
+#include "sampleExporter.h"
 #include "spinLock.h"
+#include "symbolCache.h"
 #include "threadFilter.h"
+#include "threadRegistry.h"
 #include "trap.h"
 #include "vmEntry.h"
 #include "frameEventCache.h"
-#include "stoppableTask.h"
 
 
 const char FULL_VERSION_STRING[] =
@@ -44,7 +53,9 @@ const char FULL_VERSION_STRING[] =
 
 const int MAX_NATIVE_FRAMES = 128;
 const int RESERVED_FRAMES   = 4;
+// Sample buffers, each guarded by its own lock: one per CPU, rounded up to a power of 2
 const int CONCURRENCY_LEVEL = 16;
+const int MAX_CONCURRENCY_LEVEL = 1024;
 
 
 union CallTraceBuffer {
@@ -56,8 +67,31 @@ union CallTraceBuffer {
 class FrameName;
 class NMethod;
 class StackContext;
+struct StackSnapshot;
 
 class UpdateThreadNamesTask;
+class RefreshLibrariesTask;
+
+const int THREAD_NAMES_INTERVAL_MS = 5000;
+const int JAVA_THREAD_NAMES_TICKS = 12;
+
+// How a sample path finds the Java frames; fixed per event kind and JVM
+enum SampleWalk {
+    WALK_SAMPLED,   // execution samples: VMStructs or AsyncGetCallTrace from the signal context
+    WALK_INTERNAL,  // HotSpot allocations: JVM TI from in_vm, where it is safe
+    WALK_ASYNC,     // hooked calls and allocations elsewhere: AsyncGetCallTrace
+    WALK_NONE,      // hooked calls on OpenJ9, which has no AsyncGetCallTrace
+    WALK_JVMTI      // lock and instrumentation events: synchronous JVM TI
+};
+
+// Where a sample path stores the stack
+enum SampleSink {
+    SINK_KINDLING,  // call trace storage and the Kindling frame cache
+    SINK_EVENT      // call trace storage with event, thread and policy frames, method profile and JFR
+};
+
+// Indexed by -event_type: 0 for execution samples, up to -BCI_IO for events
+const int SAMPLE_PATHS = 1 - BCI_IO;
 
 enum State {
     NEW,
@@ -75,16 +109,25 @@ class Profiler {
     Mutex _thread_names_lock;
     // TODO: single map?
     std::map<int, std::string> _thread_names;
+    // Threads whose names have been sent in kd-tm records
     std::map<int, std::string> _java_thread_names;
+    std::set<int> _native_thread_ids;
     std::map<int, jlong> _thread_ids;
     Dictionary _class_map;
     Dictionary _symbol_map;
     ThreadFilter _thread_filter;
+    ThreadRegistry _thread_registry;
     CallTraceStorage _call_trace_storage;
+    // Samples per stack hash at the last 'baseline' command
+    std::map<u64, CallTraceSample> _baseline;
+    MethodProfile _method_profile;
+    ProfileWindows _profile_windows;
+    SampleExporter _exporter;
     FlightRecorder _jfr;
     Engine* _engine;
     Engine* _alloc_engine;
     int _event_mask;
+    int _concurrency_level;
 
     FrameName* _frameName;
     FrameEventCache _frameCache;
@@ -96,11 +139,18 @@ class Profiler {
 
     u64 _total_samples;
     u64 _failures[ASGCT_FAILURE_TYPES];
-
-    SpinLock _locks[CONCURRENCY_LEVEL];
-    CallTraceBuffer* _calltrace_buffer[CONCURRENCY_LEVEL];
+    u64 _vm_walks;
+    u64 _vm_walk_fallbacks;
+
+    SpinLock* _locks;
+    CallTraceBuffer** _calltrace_buffer;
+    // allocsite: one cache per lock, NULL until a session uses it
+    AllocSiteCache* _alloc_sites;
+    u32 _alloc_site_reuse;
     int _max_stack_depth;
     int _safe_mode;
+    bool _gc_skip;
+    bool _vm_stack_walk;
     CStack _cstack;
     bool _add_event_frame;
     bool _add_thread_frame;
@@ -108,20 +158,30 @@ class Profiler {
     bool _update_thread_names;
     volatile jvmtiEventMode _thread_events_state;
 
+    // Instantiations of processSample() chosen in start() for the engine, the JVM and the output
+    typedef u32 (Profiler::*SamplePath)(void* ucontext, u64 counter, jint event_type, Event* event, SampleEvent* sample);
+    SamplePath _execution_path;
+    SamplePath _event_paths[SAMPLE_PATHS];
+
     SpinLock _stubs_lock;
     CodeCache _runtime_stubs;
     CodeCacheArray _native_libs;
+    SymbolCache _symbol_cache;
+    OverheadGovernor _governor;
     const void* _call_stub_begin;
     const void* _call_stub_end;
 
     // Update threads names task
-    std::thread _update_thread_names_thread;
     UpdateThreadNamesTask* _update_thread_names_task;
 
     // dlopen() hook support
     void** _dlopen_entry;
+    volatile int _libs_pending;
+    RefreshLibrariesTask* _refresh_libraries_task;
     static void* dlopen_hook(const char* filename, int flags);
     void switchLibraryTrap(bool enable);
+    void refreshLibraries();
+    void loadNewLibraries();
 
     Error installTraps(const char* begin, const char* end);
     void uninstallTraps();
@@ -133,18 +193,29 @@ class Profiler {
     void onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
 
     const char* asgctError(int code);
+    static int concurrencyLevel(int cpus);
     u32 getLockIndex(int tid);
     bool isAddressInCode(uintptr_t addr);
+    template <bool PERF>
     int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, int event_type, int tid, StackContext* java_ctx);
     int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx);
+    int getJavaTraceSampled(void* ucontext, ASGCT_CallFrame* frames, StackContext* java_ctx);
+    int getJavaTraceVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, const StackContext* java_ctx);
     int getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth);
     int getJavaTraceInternal(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int max_depth);
     int convertFrames(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int num_frames);
+    u32 reuseAllocSite(u32 lock_index, int tid, jint event_type, Event* event, int num_frames, u64 counter, u64& site);
+    // Every sample path: PERF for execution samples of perf_events, whose native stack is in the ring
+    template <bool PERF, SampleWalk WALK, SampleSink SINK>
+    u32 processSample(void* ucontext, u64 counter, jint event_type, Event* event, SampleEvent* sample);
+    void selectSamplePaths(bool perf);
     void fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod);
-    void setThreadInfo(int tid, const char* name, jlong java_thread_id);
+    bool setThreadInfo(int tid, const char* name, jlong java_thread_id);
     void updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
+    void forgetThreadName(int tid);
     void updateJavaThreadNames();
     void updateNativeThreadNames();
+    void restoreThreadNames();
     bool excludeTrace(FrameName* fn, CallTrace* trace);
     void mangle(const char* name, char* buf, size_t size);
     Engine* selectEngine(const char* event_name);
@@ -161,9 +232,14 @@ class Profiler {
     void lockAll();
     void unlockAll();
 
+    void collectDeltas(Arguments& args, std::vector<CallTraceDelta>& deltas);
     void dumpCollapsed(std::ostream& out, Arguments& args);
     void dumpFlameGraph(std::ostream& out, Arguments& args, bool tree);
+    void dumpPprof(std::ostream& out, Arguments& args);
     void dumpText(std::ostream& out, Arguments& args);
+    Error dumpTop(std::ostream& out, Arguments& args);
+    Error dumpSnapshot(std::ostream& out, Arguments& args);
+    void snapshotThreadName(int tid, char* buf, size_t size);
 
     static Profiler* const _instance;
 
@@ -173,25 +249,33 @@ class Profiler {
         _begin_trap(2),
         _end_trap(3),
         _thread_filter(),
+        _thread_registry(),
         _call_trace_storage(),
         _jfr(),
-        _frameCache(),
+        _concurrency_level(concurrencyLevel(OS::cpuCount())),
+        _frameCache(_concurrency_level, _call_trace_storage),
         _start_time(0),
         _epoch(0),
         _timer_id(NULL),
         _max_stack_depth(0),
         _safe_mode(0),
+        _gc_skip(false),
+        _vm_stack_walk(false),
         _thread_events_state(JVMTI_DISABLE),
         _stubs_lock(),
         _runtime_stubs("[stubs]"),
         _native_libs(),
         _call_stub_begin(NULL),
         _call_stub_end(NULL),
-        _dlopen_entry(NULL) {
-
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            _calltrace_buffer[i] = NULL;
-        }
+        _dlopen_entry(NULL),
+        _libs_pending(0),
+        _refresh_libraries_task(NULL) {
+
+        _locks = new SpinLock[_concurrency_level];
+        _calltrace_buffer = new CallTraceBuffer*[_concurrency_level]();
+        _alloc_sites = NULL;
+        _alloc_site_reuse = 0;
+        selectSamplePaths(false);
     }
 
     static Profiler* instance() {
@@ -199,10 +283,20 @@ class Profiler {
     }
 
     u64 total_samples() { return _total_samples; }
+    u64 skipped_samples() { return _failures[-ticks_skipped]; }
+    int concurrency_level() { return _concurrency_level; }
     time_t uptime()     { return time(NULL) - _start_time; }
 
+    bool jfrActive() { return _jfr.active(); }
     Dictionary* classMap() { return &_class_map; }
+    CodeCacheArray* nativeLibs() { return &_native_libs; }
+    CallTrace* findTrace(u32 call_trace_id) { return _call_trace_storage.findTrace(call_trace_id); }
+    // For engines that name the frames of their stacks themselves; the caller deletes it
+    FrameName* newFrameName(Arguments& args) {
+        return new FrameName(args, args._style, _epoch, _thread_names_lock, _thread_names);
+    }
     ThreadFilter* threadFilter() { return &_thread_filter; }
+    ThreadRegistry* threadRegistry() { return &_thread_registry; }
 
     Error run(Arguments& args);
     Error runInternal(Arguments& args, std::ostream& out);
@@ -213,14 +307,27 @@ class Profiler {
     Error stop();
     Error flushJfr();
     Error dump(std::ostream& out, Arguments& args);
+    Error exportSamples(char* buf, size_t capacity, bool incremental, long& size);
     void switchThreadEvents(jvmtiEventMode mode);
     int convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames);
-    void recordSample(void* ucontext, u64 counter, jint event_type, Event* event);
-    void printSample(void* ucontext, u64 counter);
+    int makeRingFrame(ASGCT_CallFrame* frame, const void* pc);
+    // Native and Java frames of the current thread for the snapshot action, from a signal handler
+    int getSnapshotTrace(void* ucontext, ASGCT_CallFrame* frames, int max_depth);
+    // Returns the id of the stored stack, 0 if the sample was dropped
+    u32 recordSample(void* ucontext, u64 counter, jint event_type, Event* event) {
+        return (this->*_event_paths[-event_type])(ucontext, counter, event_type, event, NULL);
+    }
+    // Execution samples of the CPU engine, stored for the Kindling stream
+    void printSample(void* ucontext, u64 counter, SampleEvent* sample = NULL) {
+        (this->*_execution_path)(ucontext, counter, 0, NULL, sample);
+    }
     void recordExternalSample(u64 counter, Event* event, int tid, int num_frames, ASGCT_CallFrame* frames);
     void printExternalSample(int tid, int num_frames, ASGCT_CallFrame* frames);
-    void printCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames);
-    void storeCallTrace(int tid, int num_frames, ASGCT_CallFrame* frames);
+    // snapshot, if not NULL, is the user stack that follows the kernel frames in pcs
+    void printRingSample(int tid, int num_pcs, const void** pcs, u64 counter, SampleEvent* sample,
+                         const StackSnapshot* snapshot = NULL);
+    u32 printCallTrace(u32 lock_index, int tid, int num_frames, ASGCT_CallFrame* frames, u64 counter, SampleEvent* sample);
+    u32 storeCallTrace(u32 lock_index, int tid, int num_frames, ASGCT_CallFrame* frames, u64 counter, SampleEvent* sample);
     void writeLog(LogLevel level, const char* message);
     void writeLog(LogLevel level, const char* message, size_t len);
 
@@ -231,6 +338,7 @@ class Profiler {
     CodeCache* findLibraryByName(const char* lib_name);
     CodeCache* findLibraryByAddress(const void* address);
     const char* findNativeMethod(const void* address);
+    const char* resolveNativeMethod(const void* address);
 
     void trapHandler(int signo, siginfo_t* siginfo, void* ucontext);
     static void segvHandler(int signo, siginfo_t* siginfo, void* ucontext);
@@ -242,11 +350,17 @@ class Profiler {
                                            jint map_length, const jvmtiAddrLocationMap* map,
                                            const void* compile_info) {
         instance()->addJavaMethod(code_addr, code_size, method);
+        PerfMap::addMethod(code_addr, code_size, method);
+    }
+
+    static void JNICALL CompiledMethodUnload(jvmtiEnv* jvmti, jmethodID method, const void* code_addr) {
+        PerfMap::removeMethod(code_addr);
     }
 
     static void JNICALL DynamicCodeGenerated(jvmtiEnv* jvmti, const char* name,
                                              const void* address, jint length) {
         instance()->addRuntimeStub(address, length, name);
+        PerfMap::addStub(address, length, name);
     }
 
     static void JNICALL ThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
@@ -259,23 +373,45 @@ class Profiler {
 
     friend class Recording;
     friend class UpdateThreadNamesTask;
+    friend class RefreshLibrariesTask;
 };
 
-class UpdateThreadNamesTask: public Stoppable {
+class UpdateThreadNamesTask: public ScheduledTask {
   public:
-    UpdateThreadNamesTask(Profiler* profiler) {
+    UpdateThreadNamesTask(Profiler* profiler, bool rescan) {
         this->profiler = profiler;
+        this->rescan = rescan;
+        this->ticks = 0;
     }
     void run() {
-        // Check if thread is requested to stop
-        while (stopRequested() == false)
-        {
-            // std::cout << "Do some work." << std::endl;
+        if (rescan) {
+            // Warm restart: threads started while the profiler was stopped
+            rescan = false;
             profiler->updateJavaThreadNames();
             profiler->updateNativeThreadNames();
-            std::this_thread::sleep_for(std::chrono::milliseconds(5000));
+            return;
+        }
+        // Java threads report themselves through ThreadStart/ThreadEnd,
+        // a full rescan is needed only to notice Thread.setName()
+        if (++ticks % JAVA_THREAD_NAMES_TICKS == 0) {
+            profiler->updateJavaThreadNames();
         }
-        // std::cout << "End task." << std::endl;
+        profiler->updateNativeThreadNames();
+    }
+  private:
+    Profiler* profiler;
+    bool rescan;
+    int ticks;
+};
+
+// One-shot task of a dlopen() that brought in new libraries
+class RefreshLibrariesTask: public ScheduledTask {
+  public:
+    RefreshLibrariesTask(Profiler* profiler) {
+        this->profiler = profiler;
+    }
+    void run() {
+        profiler->loadNewLibraries();
     }
   private:
     Profiler* profiler;
@@ -0,0 +1,297 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../callTraceStorage.h"
+#include "../dictionary.h"
+#include "../flameGraph.h"
+
+
+const int MAX_MERGE_THREADS = 64;
+
+// Merges collapsed stack files, e.g. the profiles of all pods of a service,
+// into one collapsed output, flame graph or call tree. Worker threads take
+// the input files one by one. Frame names are interned in a Dictionary shared
+// by all workers, and a stack is stored once in a CallTraceStorage as the list
+// of its frame ids, so memory grows with the unique frames and stacks only,
+// not with the number of inputs.
+class ProfileMerger {
+  private:
+    Dictionary _frames;
+    CallTraceStorage _stacks;
+    const char** _files;
+    int _file_count;
+    volatile int _next_file;
+    volatile u64 _lines;
+    volatile u64 _bad_lines;
+    volatile int _failed_files;
+
+    bool mergeLine(char* line, std::vector<ASGCT_CallFrame>& frames);
+    void mergeFile(const char* file);
+    void work();
+
+    void collectNames(std::vector<const char*>& names);
+
+  public:
+    ProfileMerger(const char** files, int file_count) :
+        _files(files), _file_count(file_count), _next_file(0), _lines(0), _bad_lines(0), _failed_files(0) {
+    }
+
+    void merge(int threads);
+
+    u64 lines() { return _lines; }
+    u64 badLines() { return _bad_lines; }
+    int failedFiles() { return _failed_files; }
+
+    void dumpCollapsed(std::ostream& out);
+    void dumpFlameGraph(std::ostream& out, const char* title, double minwidth, bool reverse, bool tree);
+};
+
+// A line is "frame;frame;...;frame value", starting with the root frame.
+// The frame id goes in method_id; bci keeps the frame type of the input,
+// which is part of the name here
+bool ProfileMerger::mergeLine(char* line, std::vector<ASGCT_CallFrame>& frames) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        line[--len] = 0;
+    }
+    if (len == 0) {
+        return true;
+    }
+
+    char* space = strrchr(line, ' ');
+    if (space == NULL || space == line) {
+        return false;
+    }
+    char* end;
+    u64 value = strtoull(space + 1, &end, 10);
+    if (end == space + 1 || *end != 0) {
+        return false;
+    }
+
+    frames.clear();
+    for (char* frame = line; frame < space; ) {
+        char* sep = (char*)memchr(frame, ';', space - frame);
+        size_t frame_len = (sep != NULL ? sep : space) - frame;
+        ASGCT_CallFrame f;
+        f.bci = 0;
+        f.method_id = (jmethodID)(uintptr_t)_frames.lookup(frame, frame_len);
+        frames.push_back(f);
+        frame += frame_len + 1;
+    }
+
+    return _stacks.put((int)frames.size(), frames.data(), value) != OVERFLOW_TRACE_ID;
+}
+
+void ProfileMerger::mergeFile(const char* file) {
+    FILE* f = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", file);
+        __sync_fetch_and_add(&_failed_files, 1);
+        return;
+    }
+
+    std::vector<ASGCT_CallFrame> frames;
+    char* line = NULL;
+    size_t capacity = 0;
+    u64 lines = 0;
+    u64 bad_lines = 0;
+    while (getline(&line, &capacity, f) > 0) {
+        lines++;
+        if (!mergeLine(line, frames)) {
+            bad_lines++;
+        }
+    }
+    free(line);
+
+    if (f != stdin) {
+        fclose(f);
+    }
+    __sync_fetch_and_add(&_lines, lines);
+    __sync_fetch_and_add(&_bad_lines, bad_lines);
+}
+
+void ProfileMerger::work() {
+    int index;
+    while ((index = __sync_fetch_and_add(&_next_file, 1)) < _file_count) {
+        mergeFile(_files[index]);
+    }
+}
+
+void ProfileMerger::merge(int threads) {
+    if (threads > _file_count) threads = _file_count;
+    if (threads <= 1) {
+        work();
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(std::thread(&ProfileMerger::work, this));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void ProfileMerger::collectNames(std::vector<const char*>& names) {
+    std::map<unsigned int, const char*> map;
+    _frames.collect(map);
+    names.resize(map.empty() ? 0 : map.rbegin()->first + 1);
+    for (std::map<unsigned int, const char*>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        names[it->first] = it->second;
+    }
+}
+
+void ProfileMerger::dumpCollapsed(std::ostream& out) {
+    std::vector<const char*> names;
+    collectNames(names);
+
+    std::vector<CallTraceSample*> samples;
+    _stacks.collectSamples(samples);
+
+    std::string line;
+    for (size_t i = 0; i < samples.size(); i++) {
+        CallTrace* trace = samples[i]->acquireTrace();
+        if (trace == NULL || samples[i]->counter == 0) continue;
+
+        line.clear();
+        for (int j = 0; j < trace->num_frames; j++) {
+            if (j > 0) line += ';';
+            line += names[(uintptr_t)trace->frames[j].method_id];
+        }
+        char buf[32];
+        snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long)samples[i]->counter);
+        line += buf;
+        out << line;
+    }
+}
+
+void ProfileMerger::dumpFlameGraph(std::ostream& out, const char* title, double minwidth, bool reverse, bool tree) {
+    std::vector<const char*> names;
+    collectNames(names);
+
+    std::vector<CallTraceSample*> samples;
+    _stacks.collectSamples(samples);
+
+    FlameGraph flamegraph(title, COUNTER_TOTAL, minwidth, 0, reverse);
+    for (size_t i = 0; i < samples.size(); i++) {
+        CallTrace* trace = samples[i]->acquireTrace();
+        u64 counter = samples[i]->counter;
+        if (trace == NULL || counter == 0) continue;
+
+        Trie* f = flamegraph.root();
+        if (reverse) {
+            for (int j = trace->num_frames - 1; j >= 0; j--) {
+                f = flamegraph.addChild(f, names[(uintptr_t)trace->frames[j].method_id], counter, 0);
+            }
+        } else {
+            for (int j = 0; j < trace->num_frames; j++) {
+                f = flamegraph.addChild(f, names[(uintptr_t)trace->frames[j].method_id], counter, 0);
+            }
+        }
+        f->addLeaf(counter, 0);
+    }
+
+    flamegraph.dump(out, tree);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [options] FILE...\n"
+                    "Merges collapsed stack files, '-' reads stdin.\n"
+                    "Options:\n"
+                    "  -o FORMAT       collapsed (default), flamegraph or tree\n"
+                    "  -f FILE         output file (default: stdout)\n"
+                    "  -j THREADS      number of files merged in parallel (default: number of CPUs)\n"
+                    "  --title TITLE   flame graph title\n"
+                    "  --minwidth PCT  skip frames smaller than PCT%%\n"
+                    "  --reverse       reverse stack traces\n", program);
+}
+
+int main(int argc, const char** argv) {
+    const char* format = "collapsed";
+    const char* output = NULL;
+    const char* title = "Merged profile";
+    double minwidth = 0;
+    bool reverse = false;
+    int threads = std::thread::hardware_concurrency();
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--reverse") == 0) {
+            reverse = true;
+        } else if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        } else if (strcmp(arg, "-o") == 0) {
+            format = argv[++i];
+        } else if (strcmp(arg, "-f") == 0) {
+            output = argv[++i];
+        } else if (strcmp(arg, "-j") == 0) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(arg, "--title") == 0) {
+            title = argv[++i];
+        } else if (strcmp(arg, "--minwidth") == 0) {
+            minwidth = atof(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    bool collapsed = strcmp(format, "collapsed") == 0;
+    bool tree = strcmp(format, "tree") == 0;
+    if (i >= argc || (!collapsed && !tree && strcmp(format, "flamegraph") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_MERGE_THREADS) threads = MAX_MERGE_THREADS;
+
+    ProfileMerger merger(argv + i, argc - i);
+    merger.merge(threads);
+    if (merger.badLines() > 0) {
+        fprintf(stderr, "Skipped %llu of %llu lines\n", (unsigned long long)merger.badLines(),
+                (unsigned long long)merger.lines());
+    }
+
+    std::ofstream file;
+    if (output != NULL) {
+        file.open(output, std::ios::out | std::ios::trunc);
+        if (!file.is_open()) {
+            fprintf(stderr, "Could not open %s\n", output);
+            return 1;
+        }
+    }
+    std::ostream& out = output != NULL ? file : std::cout;
+
+    if (collapsed) {
+        merger.dumpCollapsed(out);
+    } else {
+        merger.dumpFlameGraph(out, title, minwidth, reverse, tree);
+    }
+
+    out.flush();
+    return merger.failedFiles() > 0 || !out.good() ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "safepointProfiler.h"
+#include "eventLogger.h"
+#include "os.h"
+#include "profiler.h"
+#include "timeUtil.h"
+#include "vmEntry.h"
+#include "vmStructs.h"
+
+
+// While nothing synchronizes, the state is polled at the interval too, so a synchronization
+// shorter than the interval may go unnoticed. Below this it is a busy loop.
+const long TTSP_DEFAULT_INTERVAL = 100000;
+const long TTSP_MIN_INTERVAL = 10000;
+
+// Values of SafepointSynchronize::_state and of JavaThreadState used here
+const int SAFEPOINT_SYNCHRONIZING = 1;
+const int THREAD_IN_NATIVE = 4;
+const int THREAD_BLOCKED = 10;
+
+
+long SafepointProfiler::_interval;
+volatile u64 SafepointProfiler::_samples = 0;
+
+void SafepointProfiler::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    // Only Java threads take part in a safepoint. In native or blocked, a thread
+    // is already safe; it is the one that keeps running Java or VM code that is late.
+    VMThread* vm_thread = VMThread::current();
+    if (vm_thread == NULL || VM::jni() == NULL) {
+        return;
+    }
+    int state = vm_thread->state();
+    if (state == THREAD_IN_NATIVE || state == THREAD_BLOCKED || VMStructs::safepointState() != SAFEPOINT_SYNCHRONIZING) {
+        return;
+    }
+
+    atomicInc(_samples);
+    long weight = siginfo->si_code == SI_QUEUE ? (long)(intptr_t)siginfo->si_value.sival_ptr : _interval;
+    SampleEvent event;
+    Profiler::instance()->printSample(ucontext, weight, &event);
+}
+
+Error SafepointProfiler::check(Arguments& args) {
+    if (VM::isOpenJ9() || !VMStructs::hasSafepointState()) {
+        return Error("ttsp needs SafepointSynchronize::_state of HotSpot");
+    }
+    return Error::OK;
+}
+
+Error SafepointProfiler::start(Arguments& args) {
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+    if (args._interval < 0) {
+        return Error("interval must be positive");
+    }
+
+    _interval = args._interval ? args._interval : TTSP_DEFAULT_INTERVAL;
+    if (_interval < TTSP_MIN_INTERVAL) {
+        _interval = TTSP_MIN_INTERVAL;
+    }
+
+    OS::installSignalHandler(SIGVTALRM, signalHandler);
+
+    _running = true;
+
+    if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
+        return Error("Unable to create timer thread");
+    }
+
+    return Error::OK;
+}
+
+void SafepointProfiler::stop() {
+    _running = false;
+    pthread_kill(_thread, WAKEUP_SIGNAL);
+    pthread_join(_thread, NULL);
+}
+
+void SafepointProfiler::timerLoop() {
+    // A sampler never goes to the idle class: a starved timer would miss the synchronization
+    BackgroundScheduler::applyPolicy(false);
+
+    int self = OS::threadId();
+    ThreadFilter* thread_filter = Profiler::instance()->threadFilter();
+    bool thread_filter_enabled = thread_filter->enabled();
+
+    ThreadList* thread_list = Profiler::instance()->threadRegistry()->listThreads();
+    ThreadStateCache* thread_states = OS::threadStateCache();
+
+    u64 sync_start = 0;
+    u64 sync_time = 0;
+    u64 last_tick = 0;
+    u64 first_sample = 0;
+    int max_running = 0;
+
+    while (_running) {
+        if (!_enabled || VMStructs::safepointState() != SAFEPOINT_SYNCHRONIZING) {
+            if (sync_start != 0) {
+                u64 duration = OS::nanotime() - sync_start;
+                if (duration >= (u64)_interval) {
+                    reportSync(sync_time, duration, max_running, _samples - first_sample);
+                }
+                sync_start = 0;
+            }
+            OS::sleep(_interval);
+            continue;
+        }
+
+        // Ticks are not paced here: a synchronization lasts short, and any thread left out
+        // would be the one the VM waits for
+        u64 now = OS::nanotime();
+        if (sync_start == 0) {
+            sync_start = last_tick = now;
+            sync_time = KdClock::now();
+            first_sample = _samples;
+            max_running = 0;
+        }
+
+        // The first tick weighs the time since the start was seen, which is at most one interval
+        intptr_t weight = (intptr_t)(now > last_tick ? now - last_tick : _interval);
+        last_tick = now;
+
+        int running = 0;
+        thread_list->rewind();
+        for (int thread_id; (thread_id = thread_list->next()) != -1; ) {
+            if (thread_id == self || (thread_filter_enabled && !thread_filter->accept(thread_id))) {
+                continue;
+            }
+            if (thread_states->get(thread_id) == THREAD_RUNNING) {
+                if (OS::sendSignalToThread(thread_id, SIGVTALRM, weight)) {
+                    running++;
+                }
+            }
+        }
+        thread_states->sweep();
+        if (running > max_running) {
+            max_running = running;
+        }
+
+        OS::sleep(_interval);
+    }
+
+    delete thread_states;
+    delete thread_list;
+}
+
+// Record format:
+//     kd-ttsp@timestamp!duration_ns!max_running_threads!samples!
+// timestamp is when the synchronization was first seen, samples are the stacks of
+// the threads found still in Java or VM code
+void SafepointProfiler::reportSync(u64 start_time, u64 duration, int max_running, u64 samples) {
+    EventLogger::log("kd-ttsp@%llu!%llu!%d!%llu!", (unsigned long long)start_time,
+                     (unsigned long long)duration, max_running, (unsigned long long)samples);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SAFEPOINTPROFILER_H
+#define _SAFEPOINTPROFILER_H
+
+#include <signal.h>
+#include <pthread.h>
+#include "arch.h"
+#include "engine.h"
+
+
+// Time-to-safepoint profiler (event=ttsp). There is no JVMTI event for the start of
+// a safepoint operation, so a timer thread polls SafepointSynchronize::_state every
+// interval. While the VM is synchronizing, every running thread gets a signal each
+// interval; the ones still executing Java or VM code are the threads the safepoint
+// waits for, and their stacks are recorded, weighted by the time since the previous tick.
+// One kd-ttsp record is logged per synchronization that lasted at least one interval.
+class SafepointProfiler : public Engine {
+  private:
+    static long _interval;
+    static volatile u64 _samples;
+
+    volatile bool _running;
+    pthread_t _thread;
+
+    void timerLoop();
+    void reportSync(u64 start_time, u64 duration, int max_running, u64 samples);
+
+    static void* threadEntry(void* profiler) {
+        ((SafepointProfiler*)profiler)->timerLoop();
+        return NULL;
+    }
+
+    static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
+
+  public:
+    const char* title() {
+        return "Time to safepoint";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    long interval() {
+        return _interval;
+    }
+
+    // Picked up by the timer loop at its next cycle
+    bool setInterval(long interval) {
+        _interval = interval;
+        return true;
+    }
+};
+
+#endif // _SAFEPOINTPROFILER_H
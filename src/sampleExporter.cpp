@@ -0,0 +1,126 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+#include "sampleExporter.h"
+
+
+static inline u64 exportFrameKey(ASGCT_CallFrame& frame) {
+    return (u64)(uintptr_t)frame.method_id ^ ((u64)(FrameType::nameKind(frame.bci) + 32) << 48);
+}
+
+static inline void putExport32(std::string& out, u32 v) {
+    char b[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+    out.append(b, 4);
+}
+
+static inline void putExport64(std::string& out, u64 v) {
+    putExport32(out, (u32)v);
+    putExport32(out, (u32)(v >> 32));
+}
+
+void SampleExporter::reset() {
+    _generation++;
+    _frame_ids.clear();
+    _frame_pool.clear();
+    _frame_ends.clear();
+    _frames_sent = 0;
+    _exported.clear();
+}
+
+u32 SampleExporter::frameId(FrameName* fn, ASGCT_CallFrame& frame) {
+    u64 key = exportFrameKey(frame);
+    std::map<u64, u32>::const_iterator it = _frame_ids.find(key);
+    if (it != _frame_ids.end()) {
+        return it->second;
+    }
+
+    const char* name = fn->name(frame);
+    size_t len = strlen(name);
+    _frame_pool.append(name, len < 0xffff ? len : 0xffff);
+    _frame_ends.push_back((u32)_frame_pool.size());
+
+    u32 id = (u32)_frame_ids.size();
+    _frame_ids[key] = id;
+    return id;
+}
+
+long SampleExporter::write(CallTraceStorage& storage, FrameName* fn, bool incremental, char* buf, size_t capacity) {
+    std::map<u64, CallTraceSample> totals;
+    storage.collectSamples(totals);
+
+    std::string stacks;
+    u32 stack_count = 0;
+    for (std::map<u64, CallTraceSample>::const_iterator it = totals.begin(); it != totals.end(); ++it) {
+        u64 samples = it->second.samples;
+        u64 counter = it->second.counter;
+        if (incremental) {
+            std::map<u64, CallTraceSample>::const_iterator prev = _exported.find(it->first);
+            if (prev != _exported.end()) {
+                samples = samples >= prev->second.samples ? samples - prev->second.samples : samples;
+                counter = counter >= prev->second.counter ? counter - prev->second.counter : counter;
+            }
+        }
+        if (samples == 0 && counter == 0) continue;
+
+        CallTrace* trace = it->second.trace;
+        putExport32(stacks, trace->num_frames);
+        for (int j = 0; j < trace->num_frames; j++) {
+            putExport32(stacks, frameId(fn, trace->frames[j]));
+        }
+        putExport64(stacks, samples);
+        putExport64(stacks, counter);
+        stack_count++;
+    }
+
+    // Names are kept for the next export even if this one does not fit;
+    // the ids are already assigned and the receiver will get them later
+    u32 first_frame = incremental ? _frames_sent : 0;
+    u32 frame_count = (u32)_frame_ends.size() - first_frame;
+    u32 pool_start = first_frame == 0 ? 0 : _frame_ends[first_frame - 1];
+
+    size_t size = KD_EXPORT_HEADER + frame_count * 2 + (_frame_pool.size() - pool_start) + stacks.size();
+    if (size > capacity) {
+        return -(long)size;
+    }
+
+    std::string header;
+    putExport32(header, KD_EXPORT_MAGIC);
+    putExport32(header, _generation);
+    putExport32(header, incremental ? KD_EXPORT_INCREMENTAL : 0);
+    putExport32(header, first_frame);
+    putExport32(header, frame_count);
+    putExport32(header, stack_count);
+
+    char* p = buf;
+    memcpy(p, header.data(), header.size());
+    p += header.size();
+    for (u32 i = first_frame, start = pool_start; i < first_frame + frame_count; start = _frame_ends[i++]) {
+        u32 len = _frame_ends[i] - start;
+        p[0] = (char)len;
+        p[1] = (char)(len >> 8);
+        memcpy(p + 2, _frame_pool.data() + start, len);
+        p += 2 + len;
+    }
+    memcpy(p, stacks.data(), stacks.size());
+
+    _frames_sent = (u32)_frame_ends.size();
+    if (incremental) {
+        _exported.swap(totals);
+    }
+    return (long)size;
+}
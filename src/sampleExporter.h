@@ -0,0 +1,68 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _SAMPLEEXPORTER_H
+#define _SAMPLEEXPORTER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "arch.h"
+#include "callTraceStorage.h"
+#include "frameName.h"
+
+
+// Binary export of aggregated samples into a caller's buffer (AsyncProfiler.exportSamples).
+// Integers are little-endian.
+//     export := "KDX1" generation:u32 flags:u32 first_frame:u32 frame_count:u32 stack_count:u32
+//               frame[frame_count] stack[stack_count]
+//     frame  := length:u16 utf8[length]
+//     stack  := depth:u32 frame_id:u32[depth] samples:u64 counter:u64
+// Frame ids are stable within a generation; an export carries the frames
+// first_frame .. first_frame + frame_count - 1 that the receiver has not seen yet,
+// or all of them when it is not incremental. An incremental export holds the growth
+// of every stack since the previous export. The generation changes whenever the
+// profiler resets its data, and then the receiver drops its frame table.
+const u32 KD_EXPORT_MAGIC = 0x3158444b;  // "KDX1"
+const u32 KD_EXPORT_HEADER = 24;
+const u32 KD_EXPORT_INCREMENTAL = 1;
+
+class SampleExporter {
+  private:
+    u32 _generation;
+    std::map<u64, u32> _frame_ids;
+    std::string _frame_pool;
+    std::vector<u32> _frame_ends;
+    u32 _frames_sent;
+    // Storage totals at the last incremental export
+    std::map<u64, CallTraceSample> _exported;
+
+    u32 frameId(FrameName* fn, ASGCT_CallFrame& frame);
+
+  public:
+    SampleExporter() : _generation(0), _frames_sent(0) {
+    }
+
+    // Frame ids and incremental state of the previous data are gone
+    void reset();
+
+    // Returns the number of bytes written, or the negated size needed
+    // if the export does not fit; nothing is consumed in that case
+    long write(CallTraceStorage& storage, FrameName* fn, bool incremental, char* buf, size_t capacity);
+};
+
+#endif // _SAMPLEEXPORTER_H
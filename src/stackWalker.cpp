@@ -19,6 +19,7 @@
 #include "profiler.h"
 #include "safeAccess.h"
 #include "stackFrame.h"
+#include "symbols.h"
 #include "vmStructs.h"
 
 
@@ -26,6 +27,44 @@ const intptr_t MIN_VALID_PC = 0x1000;
 const intptr_t MAX_WALK_SIZE = 0x100000;
 const intptr_t MAX_FRAME_SIZE = 0x40000;
 
+const int UNWIND_CACHE_BITS = 12;
+
+// check is pc ^ frame ^ generation, so a torn entry or one from before
+// a library was loaded never matches
+struct UnwindCacheEntry {
+    uintptr_t check;
+    FrameDesc* frame;
+};
+
+static UnwindCacheEntry _unwind_cache[1 << UNWIND_CACHE_BITS];
+
+static inline uintptr_t unwindCheck(const void* pc, FrameDesc* frame, int generation) {
+    return (uintptr_t)pc ^ (uintptr_t)frame ^ ((uintptr_t)generation * 0x9e3779b97f4a7c15ULL);
+}
+
+static inline UnwindCacheEntry* unwindCacheSlot(const void* pc) {
+    u64 h = (u64)(uintptr_t)pc * 0x9e3779b97f4a7c15ULL;
+    return &_unwind_cache[h >> (64 - UNWIND_CACHE_BITS)];
+}
+
+// Frame layout at pc: the DWARF rule of the library containing pc, or the default frame
+static FrameDesc* findFrameDesc(const void* pc, int generation) {
+    UnwindCacheEntry* e = unwindCacheSlot(pc);
+    FrameDesc* f = __atomic_load_n(&e->frame, __ATOMIC_RELAXED);
+    if (f != NULL && __atomic_load_n(&e->check, __ATOMIC_RELAXED) == unwindCheck(pc, f, generation)) {
+        return f;
+    }
+
+    CodeCache* cc = Profiler::instance()->findLibraryByAddress(pc);
+    if (cc == NULL || (f = cc->findFrameDesc(pc)) == NULL) {
+        f = &FrameDesc::default_frame;
+    }
+
+    __atomic_store_n(&e->frame, f, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->check, unwindCheck(pc, f, generation), __ATOMIC_RELAXED);
+    return f;
+}
+
 
 int StackWalker::walkFP(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx) {
     const void* pc;
@@ -77,26 +116,16 @@ int StackWalker::walkFP(void* ucontext, const void** callchain, int max_depth, S
     return depth;
 }
 
-int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx) {
-    const void* pc;
-    uintptr_t fp;
-    uintptr_t sp;
-    uintptr_t prev_sp;
-    uintptr_t bottom = (uintptr_t)&sp + MAX_WALK_SIZE;
-
-    if (ucontext == NULL) {
-        pc = __builtin_return_address(0);
-        fp = (uintptr_t)__builtin_frame_address(1);
-        sp = (uintptr_t)__builtin_frame_address(0);
-    } else {
-        StackFrame frame(ucontext);
-        pc = (const void*)frame.pc();
-        fp = frame.fp();
-        sp = frame.sp();
-    }
+// A stack slot, from the snapshot if there is one
+static inline const void* loadSlot(const StackSnapshot* snapshot, uintptr_t addr) {
+    return snapshot == NULL ? SafeAccess::load((void**)addr) : snapshot->load(addr);
+}
 
+static int walkDwarfFrom(const void* pc, uintptr_t sp, uintptr_t fp, uintptr_t bottom, const StackSnapshot* snapshot,
+                         const void** callchain, int max_depth, StackContext* java_ctx) {
+    uintptr_t prev_sp;
     int depth = 0;
-    Profiler* profiler = Profiler::instance();
+    int generation = Symbols::generation();
 
     // Walk until the bottom of the stack or until the first Java frame
     while (depth < max_depth) {
@@ -108,11 +137,7 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
         callchain[depth++] = pc;
         prev_sp = sp;
 
-        FrameDesc* f;
-        CodeCache* cc = profiler->findLibraryByAddress(pc);
-        if (cc == NULL || (f = cc->findFrameDesc(pc)) == NULL) {
-            f = &FrameDesc::default_frame;
-        }
+        FrameDesc* f = findFrameDesc(pc, generation);
 
         u8 cfa_reg = (u8)f->cfa;
         int cfa_off = f->cfa >> 8;
@@ -140,9 +165,9 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
             pc = (const char*)pc + (f->fp_off >> 1);
         } else {
             if (f->fp_off != DW_SAME_FP && f->fp_off < MAX_FRAME_SIZE && f->fp_off > -MAX_FRAME_SIZE) {
-                fp = (uintptr_t)SafeAccess::load((void**)(sp + f->fp_off));
+                fp = (uintptr_t)loadSlot(snapshot, sp + f->fp_off);
             }
-            pc = stripPointer(SafeAccess::load((void**)sp - 1));
+            pc = stripPointer(loadSlot(snapshot, sp - sizeof(void*)));
         }
 
         if (pc < (const void*)MIN_VALID_PC || pc > (const void*)-MIN_VALID_PC) {
@@ -152,3 +177,138 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
 
     return depth;
 }
+
+int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx) {
+    const void* pc;
+    uintptr_t fp;
+    uintptr_t sp;
+    uintptr_t bottom = (uintptr_t)&sp + MAX_WALK_SIZE;
+
+    if (ucontext == NULL) {
+        pc = __builtin_return_address(0);
+        fp = (uintptr_t)__builtin_frame_address(1);
+        sp = (uintptr_t)__builtin_frame_address(0);
+    } else {
+        StackFrame frame(ucontext);
+        pc = (const void*)frame.pc();
+        fp = frame.fp();
+        sp = frame.sp();
+    }
+
+    return walkDwarfFrom(pc, sp, fp, bottom, NULL, callchain, max_depth, java_ctx);
+}
+
+int StackWalker::walkDwarf(const StackSnapshot* snapshot, const void** callchain, int max_depth, StackContext* java_ctx) {
+    return walkDwarfFrom(snapshot->pc, snapshot->sp, snapshot->fp, snapshot->bottom(), snapshot,
+                         callchain, max_depth, java_ctx);
+}
+
+#if defined(__x86_64__)
+
+// Interpreter frame slots relative to fp, as in frame_x86.hpp.
+// JDK 9 added the mirror slot above mdp, which moved bcp one slot down.
+const int INTERPRETER_SENDER_SP_SLOT = -1;
+const int INTERPRETER_METHOD_SLOT = -3;
+
+static inline int interpreterBcpSlot() {
+    return VM::hotspot_version() >= 9 ? -8 : -7;
+}
+
+static inline bool isReturnInstruction(const void* pc) {
+    return *(const u8*)pc == 0xc3;
+}
+
+int StackWalker::walkVM(const StackContext* java_ctx, bool interrupted, ASGCT_CallFrame* frames, int max_depth,
+                        const StackSnapshot* snapshot) {
+    const void* pc = java_ctx->pc;
+    uintptr_t sp = java_ctx->sp;
+    uintptr_t fp = java_ctx->fp;
+    uintptr_t bottom = snapshot != NULL ? snapshot->bottom() : (uintptr_t)&sp + MAX_WALK_SIZE;
+    bool top = interrupted;
+
+    if (pc == NULL) {
+        return -1;
+    }
+
+    int depth = 0;
+    while (depth < max_depth) {
+        // Anything but call_stub below the Java frames means the walk went astray
+        NMethod* nm = CodeHeap::contains(pc) ? CodeHeap::findNMethod(pc) : NULL;
+        if (nm == NULL) {
+            return -1;
+        }
+
+        if (nm->isInterpreter()) {
+            VMMethod* method = (VMMethod*)loadSlot(snapshot, fp + INTERPRETER_METHOD_SLOT * sizeof(void*));
+            const void* bcp = loadSlot(snapshot, fp + interpreterBcpSlot() * sizeof(void*));
+            int bci;
+            jmethodID method_id = method->checkedId(bcp, &bci);
+            if (method_id == NULL || bci < 0) {
+                // Also the case of a frame being built or torn down
+                return -1;
+            }
+            frames[depth].bci = FrameType::encode(FRAME_INTERPRETED, bci);
+            frames[depth].method_id = method_id;
+            depth++;
+
+            // The sender sp is unextended, as the compiled caller left it
+            uintptr_t sender_sp = (uintptr_t)loadSlot(snapshot, fp + INTERPRETER_SENDER_SP_SLOT * sizeof(void*));
+            pc = stripPointer(loadSlot(snapshot, fp + FRAME_PC_SLOT * sizeof(void*)));
+            fp = (uintptr_t)loadSlot(snapshot, fp);
+            if (sender_sp <= sp || sender_sp >= bottom) {
+                return -1;
+            }
+            sp = sender_sp;
+            top = false;
+            continue;
+        }
+
+        if (nm->isStubRoutines()) {
+            // call_stub: the VM called into Java here
+            return depth > 0 && !top ? depth : -1;
+        }
+
+        if (nm->isNMethod()) {
+            VMMethod* method = nm->method();
+            jmethodID method_id = method != NULL ? method->checkedId(NULL, NULL) : NULL;
+            if (method_id == NULL) {
+                return -1;
+            }
+            int level = nm->level();
+            frames[depth].bci = FrameType::encode(level >= 1 && level <= 3 ? FRAME_C1_COMPILED : FRAME_JIT_COMPILED, 0);
+            frames[depth].method_id = method_id;
+            depth++;
+        }
+
+        // Compiled methods, runtime stubs and adapters have frames of a fixed size
+        uintptr_t sender_sp;
+        if (top && isReturnInstruction(pc)) {
+            // The epilogue has already popped the frame
+            sender_sp = sp + sizeof(void*);
+        } else if (nm->frameSize() > 0 && (!top || nm->isFrameCompleteAt(pc))) {
+            sender_sp = sp + nm->frameSize() * sizeof(void*);
+            fp = (uintptr_t)loadSlot(snapshot, sender_sp - (FRAME_PC_SLOT + 1) * sizeof(void*));
+        } else {
+            return -1;
+        }
+
+        if (sender_sp <= sp || sender_sp >= bottom) {
+            return -1;
+        }
+        pc = stripPointer(loadSlot(snapshot, sender_sp - FRAME_PC_SLOT * sizeof(void*)));
+        sp = sender_sp;
+        top = false;
+    }
+
+    return depth;
+}
+
+#else
+
+int StackWalker::walkVM(const StackContext* java_ctx, bool interrupted, ASGCT_CallFrame* frames, int max_depth,
+                        const StackSnapshot* snapshot) {
+    // Interpreter frame layout is known for x86_64 only
+    return -1;
+}
+
+#endif // __x86_64__
@@ -18,6 +18,8 @@
 #define _STACKWALKER_H
 
 #include <stdint.h>
+#include <string.h>
+#include "vmEntry.h"
 
 
 struct StackContext {
@@ -32,10 +34,44 @@ struct StackContext {
     }
 };
 
+// Registers and the top of the user stack as the kernel copied them into a perf ring
+// (PERF_SAMPLE_REGS_USER, PERF_SAMPLE_STACK_USER); data holds size bytes from sp up
+struct StackSnapshot {
+    const void* pc;
+    uintptr_t sp;
+    uintptr_t fp;
+    const char* data;
+    size_t size;
+
+    uintptr_t bottom() const {
+        return sp + size;
+    }
+
+    // NULL for addresses outside of the copy
+    const void* load(uintptr_t addr) const {
+        if (addr < sp || addr + sizeof(void*) > sp + size) {
+            return NULL;
+        }
+        const void* value;
+        memcpy(&value, data + (addr - sp), sizeof(value));
+        return value;
+    }
+};
+
 class StackWalker {
   public:
     static int walkFP(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx);
     static int walkDwarf(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx);
+    // The same walk over a snapshot, so it can run on another thread after the sampled one moved on
+    static int walkDwarf(const StackSnapshot* snapshot, const void** callchain, int max_depth, StackContext* java_ctx);
+
+    // Walks Java frames from java_ctx using VMStructs instead of AsyncGetCallTrace.
+    // interrupted tells that java_ctx.pc is where a signal stopped the thread rather than
+    // a return address. Returns -1 if the stack cannot be walked this way; the caller then
+    // falls back to AsyncGetCallTrace. Inlined methods are attributed to their compiled method.
+    // With a snapshot, stack slots are read from the copy instead of the live stack.
+    static int walkVM(const StackContext* java_ctx, bool interrupted, ASGCT_CallFrame* frames, int max_depth,
+                      const StackSnapshot* snapshot = NULL);
 };
 
 #endif // _STACKWALKER_H
@@ -16,6 +16,8 @@ class Stoppable
     std::future<void> futureObj;
 public:
     Stoppable() : futureObj(exitSignal.get_future()) {}
+    // Tasks are deleted through this base
+    virtual ~Stoppable() {}
     Stoppable(Stoppable && obj) : exitSignal(std::move(obj.exitSignal)), futureObj(std::move(obj.futureObj)) {}
     Stoppable & operator=(Stoppable && obj)
     {
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYMBOLCACHE_H
+#define _SYMBOLCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "arch.h"
+
+
+const int SYMBOL_CACHE_BITS = 12;
+const int SYMBOL_CACHE_SIZE = 1 << SYMBOL_CACHE_BITS;
+
+// check is pc ^ name, so an entry torn by concurrent writers never matches a wrong pc
+struct SymbolCacheEntry {
+    uintptr_t check;
+    const char* name;
+};
+
+// Direct-mapped cache of native PC to the name returned by CodeCache::binarySearch.
+// The lib index is part of the name (NativeFunc::libIndex). Native libraries are
+// never unloaded, so entries stay valid for the life of the process.
+// Lock-free and safe to use from a signal handler.
+class SymbolCache {
+  private:
+    SymbolCacheEntry _entries[SYMBOL_CACHE_SIZE];
+    volatile u64 _hits;
+    volatile u64 _misses;
+
+    static SymbolCacheEntry* slot(SymbolCacheEntry* entries, const void* pc) {
+        u64 h = (u64)(uintptr_t)pc * 0x9e3779b97f4a7c15ULL;
+        return &entries[h >> (64 - SYMBOL_CACHE_BITS)];
+    }
+
+  public:
+    SymbolCache() : _entries(), _hits(0), _misses(0) {
+    }
+
+    const char* lookup(const void* pc) {
+        SymbolCacheEntry* e = slot(_entries, pc);
+        const char* name = __atomic_load_n(&e->name, __ATOMIC_RELAXED);
+        uintptr_t check = __atomic_load_n(&e->check, __ATOMIC_RELAXED);
+        return name != NULL && (check ^ (uintptr_t)name) == (uintptr_t)pc ? name : NULL;
+    }
+
+    void store(const void* pc, const char* name) {
+        SymbolCacheEntry* e = slot(_entries, pc);
+        __atomic_store_n(&e->name, name, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->check, (uintptr_t)pc ^ (uintptr_t)name, __ATOMIC_RELAXED);
+    }
+
+    // Counted once per stack rather than per frame
+    void count(u64 hits, u64 misses) {
+        if (hits > 0) atomicInc(_hits, hits);
+        if (misses > 0) atomicInc(_misses, misses);
+    }
+
+    void clearCounters() {
+        _hits = 0;
+        _misses = 0;
+    }
+
+    u64 hits() {
+        return _hits;
+    }
+
+    u64 misses() {
+        return _misses;
+    }
+};
+
+#endif // _SYMBOLCACHE_H
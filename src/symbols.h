@@ -25,10 +25,29 @@ class Symbols {
   private:
     static Mutex _parse_lock;
     static bool _have_kernel_symbols;
+    static char* _cache_dir;
+    static volatile int _generation;
 
   public:
+    // Changes whenever a library or a DWARF table is published,
+    // so that caches of address lookups know when to start over
+    static int generation() {
+        return __atomic_load_n(&_generation, __ATOMIC_ACQUIRE);
+    }
+
+    static void invalidate() {
+        __atomic_add_fetch(&_generation, 1, __ATOMIC_RELEASE);
+    }
+
+    // Directory of the on-disk symbol cache (symcache), or NULL to disable it
+    static void setCacheDir(const char* dir);
+
     static void parseKernelSymbols(CodeCache* cc);
     static void parseLibraries(CodeCacheArray* array, bool kernel_symbols);
+    // Cheap check after a dlopen whether the loader has added anything since the last parse
+    static bool librariesChanged();
+    // Like parseLibraries, but asks the loader rather than scanning the memory map
+    static void parseNewLibraries(CodeCacheArray* array);
 
     static bool haveKernelSymbols() {
         return _have_kernel_symbols;
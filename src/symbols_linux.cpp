@@ -17,13 +17,18 @@
 #ifdef __linux__
 
 #include <set>
+#include <thread>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <elf.h>
+#include <link.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,6 +37,7 @@
 #include "dwarf.h"
 #include "fdtransferClient.h"
 #include "log.h"
+#include "os.h"
 
 
 class SymbolDesc {
@@ -187,6 +193,8 @@ class ElfParser {
 
   public:
     static void parseProgramHeaders(CodeCache* cc, const char* base);
+    static void parseDwarfInfo(CodeCache* cc, const char* base);
+    static int buildId(const char* base, char* buf, int size);
     static bool parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug);
     static void parseMem(CodeCache* cc, const char* base);
 };
@@ -254,10 +262,51 @@ void ElfParser::parseProgramHeaders(CodeCache* cc, const char* base) {
     if (elf.validHeader()) {
         cc->setTextBase(base);
         elf.parseDynamicSection();
+    }
+}
+
+void ElfParser::parseDwarfInfo(CodeCache* cc, const char* base) {
+    ElfParser elf(cc, base, base);
+    if (elf.validHeader()) {
         elf.parseDwarfInfo();
     }
 }
 
+// Hex string of the GNU build-id note found in the loaded segments; 0 if there is none
+int ElfParser::buildId(const char* base, char* buf, int size) {
+    ElfParser elf(NULL, base, base);
+    if (!elf.validHeader()) {
+        return 0;
+    }
+
+    const char* pheaders = (const char*)elf._header + elf._header->e_phoff;
+    for (int i = 0; i < elf._header->e_phnum; i++) {
+        ElfProgramHeader* pheader = (ElfProgramHeader*)(pheaders + i * elf._header->e_phentsize);
+        if (pheader->p_type != PT_NOTE) {
+            continue;
+        }
+
+        const char* note_start = elf.at(pheader);
+        const char* note_end = note_start + pheader->p_memsz;
+        while (note_start + sizeof(ElfNote) <= note_end) {
+            ElfNote* note = (ElfNote*)note_start;
+            const char* name = note_start + sizeof(ElfNote);
+            const char* desc = name + ((note->n_namesz + 3) & ~3);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && strcmp(name, "GNU") == 0) {
+                if (note->n_descsz == 0 || (int)note->n_descsz * 2 >= size) {
+                    return 0;
+                }
+                for (u32 j = 0; j < note->n_descsz; j++) {
+                    sprintf(buf + j * 2, "%02hhx", desc[j]);
+                }
+                return note->n_descsz * 2;
+            }
+            note_start = desc + ((note->n_descsz + 3) & ~3);
+        }
+    }
+    return 0;
+}
+
 void ElfParser::parseDynamicSection() {
     ElfProgramHeader* dynamic = findProgramHeader(PT_DYNAMIC);
     if (dynamic != NULL) {
@@ -483,12 +532,236 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
 }
 
 
+const int MAX_PARSE_THREADS = 8;
+
 Mutex Symbols::_parse_lock;
 bool Symbols::_have_kernel_symbols = false;
+char* Symbols::_cache_dir = NULL;
+volatile int Symbols::_generation = 0;
 static std::set<const void*> _parsed_libraries;
 static std::set<u64> _parsed_inodes;
+// dlpi_adds when libraries were last looked for, -1 if the loader does not count
+static volatile u64 _load_count = (u64)-1;
+
+static int readLoadCount(struct dl_phdr_info* info, size_t size, void* data) {
+    *(u64*)data = size >= offsetof(struct dl_phdr_info, dlpi_subs) ? (u64)info->dlpi_adds : (u64)-1;
+    return 1;
+}
+
+static u64 loadCount() {
+    u64 count = (u64)-1;
+    dl_iterate_phdr(readLoadCount, &count);
+    return count;
+}
+
+const char SYMBOL_FILE_MAGIC[8] = {'A', 'P', 'S', 'Y', 'M', '1', (char)sizeof(void*), (char)sizeof(FrameDesc)};
+
+// On-disk copy of a parsed library (symcache), named after its build-id:
+//     header  blobs[blob_count]  frames[frame_count]  names[names_size]
+// Blob addresses are relative to the image base, frames are stored as FrameDesc.
+struct SymbolFileHeader {
+    char magic[8];
+    u32 blob_count;
+    u32 frame_count;
+    u64 names_size;
+};
+
+struct SymbolFileBlob {
+    u64 offset;
+    u32 length;
+    u32 name;
+};
+
+class SymbolFile {
+  private:
+    static bool write(CodeCache* cc, const char* base, FILE* f);
+
+  public:
+    static bool load(CodeCache* cc, const char* base, const char* path);
+    static bool load(CodeCache* cc, const char* base, int fd, const char* name);
+    static void store(CodeCache* cc, const char* base, const char* path, int mode);
+};
+
+bool SymbolFile::load(CodeCache* cc, const char* base, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool result = load(cc, base, fd, path);
+    close(fd);
+    return result;
+}
+
+bool SymbolFile::load(CodeCache* cc, const char* base, int fd, const char* name) {
+    struct stat st;
+    void* addr = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SymbolFileHeader)
+        ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    const SymbolFileHeader* header = (const SymbolFileHeader*)addr;
+    const SymbolFileBlob* blobs = (const SymbolFileBlob*)(header + 1);
+    const FrameDesc* frames = (const FrameDesc*)(blobs + header->blob_count);
+    const char* names = (const char*)(frames + header->frame_count);
 
+    bool valid = memcmp(header->magic, SYMBOL_FILE_MAGIC, sizeof(SYMBOL_FILE_MAGIC)) == 0
+        && sizeof(SymbolFileHeader) + (u64)header->blob_count * sizeof(SymbolFileBlob)
+           + (u64)header->frame_count * sizeof(FrameDesc) + header->names_size == (u64)st.st_size
+        && header->names_size > 0 && names[header->names_size - 1] == 0;
+
+    for (u32 i = 0; valid && i < header->blob_count; i++) {
+        valid = blobs[i].name < header->names_size;
+    }
+
+    if (valid) {
+        for (u32 i = 0; i < header->blob_count; i++) {
+            cc->add(base + blobs[i].offset, (int)blobs[i].length, names + blobs[i].name);
+        }
+        if (header->frame_count > 0) {
+            FrameDesc* table = (FrameDesc*)malloc(header->frame_count * sizeof(FrameDesc));
+            memcpy(table, frames, header->frame_count * sizeof(FrameDesc));
+            cc->setDwarfTable(table, header->frame_count);
+        }
+    } else {
+        Log::warn("Ignoring invalid symbol cache %s", name);
+    }
+
+    munmap(addr, st.st_size);
+    return valid;
+}
+
+// Written to a temporary file and renamed, so that a reader never sees a partial file
+void SymbolFile::store(CodeCache* cc, const char* base, const char* path, int mode) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", path, OS::processId()) >= (int)sizeof(tmp)) {
+        return;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    FILE* f = fd == -1 ? NULL : fdopen(fd, "w");
+    if (f == NULL) {
+        Log::debug("Could not create symbol cache %s: %s", tmp, strerror(errno));
+        if (fd != -1) close(fd);
+        return;
+    }
+
+    if (!write(cc, base, f) || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
+
+// Closes the file; false if anything could not be written
+bool SymbolFile::write(CodeCache* cc, const char* base, FILE* f) {
+    const CodeBlob* blobs = cc->blobs();
+    int count = cc->count();
+
+    SymbolFileHeader header;
+    memcpy(header.magic, SYMBOL_FILE_MAGIC, sizeof(SYMBOL_FILE_MAGIC));
+    header.blob_count = count;
+    const FrameTable* frames = cc->dwarfTable();
+    header.frame_count = frames == NULL ? 0 : frames->count();
+    header.names_size = 0;
+
+    std::vector<SymbolFileBlob> file_blobs(count);
+    for (int i = 0; i < count; i++) {
+        file_blobs[i].offset = (const char*)blobs[i]._start - base;
+        file_blobs[i].length = (const char*)blobs[i]._end - (const char*)blobs[i]._start;
+        file_blobs[i].name = (u32)header.names_size;
+        header.names_size += strlen(blobs[i]._name) + 1;
+    }
+    if (header.names_size == 0) {
+        // The name table always ends with a terminator
+        header.names_size = 1;
+    }
+
+    fwrite(&header, sizeof(header), 1, f);
+    if (count > 0) fwrite(&file_blobs[0], sizeof(SymbolFileBlob), count, f);
+    for (u32 i = 0; i < header.frame_count; i++) {
+        FrameDesc frame = frames->at(i);
+        fwrite(&frame, sizeof(FrameDesc), 1, f);
+    }
+    for (int i = 0; i < count; i++) {
+        fwrite(blobs[i]._name, 1, strlen(blobs[i]._name) + 1, f);
+    }
+    if (count == 0) fputc(0, f);
+
+    bool failed = ferror(f) != 0;
+    return fclose(f) == 0 && !failed;
+}
+
+
+// /proc/kallsyms is read at once and parsed in place; a line is
+//     address type name[\t[module]]
+// Only text symbols are kept. The whole rest of the line makes the name, as before.
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static char* readFully(int fd, size_t* size) {
+    size_t capacity = 4 * 1024 * 1024;
+    size_t len = 0;
+    char* buf = (char*)malloc(capacity);
+    ssize_t bytes;
+    while (buf != NULL && (bytes = read(fd, buf + len, capacity - len)) > 0) {
+        len += bytes;
+        if (len == capacity) {
+            char* grown = (char*)realloc(buf, capacity *= 2);
+            if (grown == NULL) free(buf);
+            buf = grown;
+        }
+    }
+    *size = len;
+    return buf;
+}
+
+// Kernel symbols change with the boot and with the set of loaded modules
+static char* kernelSymbolFilePath(const char* cache_dir) {
+    char boot_id[64];
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    ssize_t bytes = fd == -1 ? -1 : read(fd, boot_id, sizeof(boot_id) - 1);
+    if (fd != -1) close(fd);
+    if (bytes <= 0) {
+        return NULL;
+    }
+    boot_id[bytes] = 0;
+    boot_id[strcspn(boot_id, "\n")] = 0;
+
+    // Name and size of every module; the rest of /proc/modules changes with use counts
+    u32 modules = 2166136261U;
+    FILE* f = fopen("/proc/modules", "r");
+    if (f != NULL) {
+        char line[512];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char* end = strchr(line, ' ');
+            end = end == NULL ? NULL : strchr(end + 1, ' ');
+            for (char* p = line; p < end; p++) {
+                modules = (modules ^ (u8)*p) * 16777619;
+            }
+        }
+        fclose(f);
+    }
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/kernel-%s-%08x.sym", cache_dir, boot_id, modules) >= (int)sizeof(path)) {
+        return NULL;
+    }
+    return strdup(path);
+}
+
+// With symcache, the parsed table is shared by all profiled JVMs of the user on the host.
+// The file is private to the user, since it gives away kernel addresses.
 void Symbols::parseKernelSymbols(CodeCache* cc) {
+    char* cache_path = _cache_dir == NULL ? NULL : kernelSymbolFilePath(_cache_dir);
+    if (cache_path != NULL && SymbolFile::load(cc, NULL, cache_path)) {
+        _have_kernel_symbols = cc->count() > 0;
+        free(cache_path);
+        return;
+    }
+
     int fd;
     if (FdTransferClient::hasPeer()) {
         fd = FdTransferClient::requestKallsymsFd();
@@ -498,61 +771,231 @@ void Symbols::parseKernelSymbols(CodeCache* cc) {
 
     if (fd == -1) {
         Log::warn("open(\"/proc/kallsyms\"): %s", strerror(errno));
+        free(cache_path);
         return;
     }
 
-    FILE* f = fdopen(fd, "r");
-    if (f == NULL) {
-        Log::warn("fdopen(): %s", strerror(errno));
-        close(fd);
+    size_t size;
+    char* buf = readFully(fd, &size);
+    close(fd);
+    if (buf == NULL) {
+        Log::warn("Not enough memory to read /proc/kallsyms");
+        free(cache_path);
         return;
     }
 
-    char str[256];
-    while (fgets(str, sizeof(str) - 8, f) != NULL) {
-        size_t len = strlen(str) - 1; // trim the '\n'
-        strcpy(str + len, "_[k]");
-
-        SymbolDesc symbol(str);
-        char type = symbol.type();
-        if (type == 'T' || type == 't' || type == 'W' || type == 'w') {
-            const char* addr = symbol.addr();
-            if (addr != NULL) {
-                if (!_have_kernel_symbols) {
-                    if (strncmp(symbol.name(), "__LOAD_PHYSICAL_ADDR", 20) == 0 ||
-                        strncmp(symbol.name(), "phys_startup", 12) == 0) {
-                        continue;
-                    }
+    char name[256];
+    const char* end = buf + size;
+    for (const char* line = buf; line < end; ) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if (eol == NULL) eol = end;
+
+        uintptr_t addr = 0;
+        const char* p = line;
+        for (int d; p < eol && (d = hexDigit(*p)) >= 0; p++) {
+            addr = addr << 4 | d;
+        }
+
+        if (eol - p > 3 && p[0] == ' ' && p[2] == ' ' && addr != 0) {
+            char type = p[1];
+            if (type == 'T' || type == 't' || type == 'W' || type == 'w') {
+                const char* sym = p + 3;
+                size_t len = eol - sym;
+                if (len > sizeof(name) - 5) len = sizeof(name) - 5;
+                memcpy(name, sym, len);
+                strcpy(name + len, "_[k]");
+
+                if (_have_kernel_symbols ||
+                    (strncmp(name, "__LOAD_PHYSICAL_ADDR", 20) != 0 && strncmp(name, "phys_startup", 12) != 0)) {
                     _have_kernel_symbols = true;
+                    cc->add((const void*)addr, 0, name);
                 }
-                cc->add(addr, 0, symbol.name());
             }
         }
+        line = eol + 1;
     }
+    free(buf);
 
-    fclose(f);
+    if (cache_path != NULL && _have_kernel_symbols) {
+        SymbolFile::store(cc, NULL, cache_path, 0600);
+    }
+    free(cache_path);
+}
+
+
+// A library found in /proc/self/maps, parsed off the maps scan
+struct LibraryJob {
+    enum Kind { NONE, FILE, VDSO };
+
+    CodeCache* cc;
+    const char* image_base;
+    Kind kind;
+    bool program_headers;
+    bool cached;
+    char* cache_path;
+};
+
+static char* symbolFilePath(const char* cache_dir, const char* base) {
+    char build_id[132];
+    if (ElfParser::buildId(base, build_id, sizeof(build_id)) == 0) {
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s.sym", cache_dir, build_id) >= (int)sizeof(path)) {
+        return NULL;
+    }
+    return strdup(path);
+}
+
+// fdtransfer symbol service: tables the server's owner has put in its directory
+static bool loadSharedSymbols(LibraryJob* job) {
+    char build_id[MAX_BUILD_ID];
+    if (ElfParser::buildId(job->image_base, build_id, sizeof(build_id)) == 0) {
+        return false;
+    }
+
+    int fd = FdTransferClient::requestSymbolsFd(build_id);
+    if (fd != -1) {
+        bool loaded = SymbolFile::load(job->cc, job->image_base, fd, build_id);
+        close(fd);
+        return loaded;
+    }
+    return false;
+}
+
+static void parseLibrary(LibraryJob* job, const char* cache_dir) {
+    if (job->kind == LibraryJob::FILE) {
+        if (job->program_headers) {
+            ElfParser::parseProgramHeaders(job->cc, job->image_base);
+            if (cache_dir != NULL) {
+                job->cache_path = symbolFilePath(cache_dir, job->image_base);
+                job->cached = job->cache_path != NULL && SymbolFile::load(job->cc, job->image_base, job->cache_path);
+            }
+            if (!job->cached && FdTransferClient::hasPeer()) {
+                job->cached = loadSharedSymbols(job);
+                if (job->cached && job->cache_path != NULL) {
+                    // Also keep it in the local cache for the next attach
+                    SymbolFile::store(job->cc, job->image_base, job->cache_path, 0644);
+                }
+            }
+        }
+        if (!job->cached) {
+            ElfParser::parseFile(job->cc, job->image_base, job->cc->name(), true);
+        }
+    } else if (job->kind == LibraryJob::VDSO) {
+        ElfParser::parseMem(job->cc, job->image_base);
+    }
+    job->cc->sort();
+}
+
+// Symbol tables of different libraries are independent, so they are loaded by
+// a small pool of threads; each takes the next unparsed library
+static void parseLibraryJobs(std::vector<LibraryJob>& jobs, const char* cache_dir) {
+    int threads = OS::cpuCount();
+    if (threads > MAX_PARSE_THREADS) threads = MAX_PARSE_THREADS;
+    if (threads > (int)jobs.size()) threads = (int)jobs.size();
+
+    volatile int next = 0;
+    auto worker = [&jobs, &next, cache_dir] {
+        for (int i; (i = atomicInc(next)) < (int)jobs.size(); ) {
+            parseLibrary(&jobs[i], cache_dir);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; i++) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
+}
+
+// DWARF tables are only needed by the cstack=dwarf unwinder, which falls back
+// to the default frame layout until the table of a library is published.
+// A library is complete after that, and is then saved to the symbol cache.
+static void parseDwarfTables(std::vector<LibraryJob> jobs) {
+    u64 start = OS::nanotime();
+    for (size_t i = 0; i < jobs.size(); i++) {
+        ElfParser::parseDwarfInfo(jobs[i].cc, jobs[i].image_base);
+        Symbols::invalidate();
+        if (jobs[i].cache_path != NULL) {
+            SymbolFile::store(jobs[i].cc, jobs[i].image_base, jobs[i].cache_path, 0644);
+            free(jobs[i].cache_path);
+        }
+    }
+    Log::debug("Parsed DWARF of %d libraries in %llu ms", (int)jobs.size(), (OS::nanotime() - start) / 1000000);
+}
+
+// Parses the jobs of a scan and publishes them; called with _parse_lock held
+static void loadLibraries(CodeCacheArray* array, std::vector<LibraryJob>& jobs, u64 start, const char* cache_dir) {
+    u64 scanned = OS::nanotime();
+    parseLibraryJobs(jobs, cache_dir);
+    u64 parsed = OS::nanotime();
+
+    // Publish in maps order: a library's index in the array is fixed at creation
+    std::vector<LibraryJob> dwarf_jobs;
+    int cached = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        array->add(jobs[i].cc);
+        Symbols::invalidate();
+        if (jobs[i].cached) {
+            free(jobs[i].cache_path);
+            cached++;
+        } else if (jobs[i].program_headers && (DWARF_SUPPORTED || jobs[i].cache_path != NULL)) {
+            dwarf_jobs.push_back(jobs[i]);
+        } else {
+            free(jobs[i].cache_path);
+        }
+    }
+
+    if (!jobs.empty()) {
+        Log::debug("Parsed %d libraries (%d from symbol cache): scan %llu ms, symbols %llu ms",
+                   (int)jobs.size(), cached, (scanned - start) / 1000000, (parsed - scanned) / 1000000);
+    }
+    if (!dwarf_jobs.empty()) {
+        std::thread(parseDwarfTables, dwarf_jobs).detach();
+    }
+}
+
+void Symbols::setCacheDir(const char* dir) {
+    MutexLocker ml(_parse_lock);
+    free(_cache_dir);
+    _cache_dir = dir == NULL ? NULL : strdup(dir);
+    if (_cache_dir != NULL && mkdir(_cache_dir, 0755) != 0 && errno != EEXIST) {
+        Log::warn("Could not create symbol cache directory %s: %s", _cache_dir, strerror(errno));
+    }
 }
 
 void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
     MutexLocker ml(_parse_lock);
 
     if (kernel_symbols && !haveKernelSymbols()) {
+        u64 start = OS::nanotime();
         CodeCache* cc = new CodeCache("[kernel]");
         parseKernelSymbols(cc);
 
         if (haveKernelSymbols()) {
             cc->sort();
             array->add(cc);
+            invalidate();
         } else {
             delete cc;
         }
+        Log::debug("Parsed kernel symbols in %llu ms", (OS::nanotime() - start) / 1000000);
     }
 
+    // Counted before the scan, so that a library loaded meanwhile is looked for again
+    __atomic_store_n(&_load_count, loadCount(), __ATOMIC_RELEASE);
     FILE* f = fopen("/proc/self/maps", "r");
     if (f == NULL) {
         return;
     }
 
+    u64 start = OS::nanotime();
+    std::vector<LibraryJob> jobs;
     const char* last_readable_base = NULL;
     const char* image_end = NULL;
     char* str = NULL;
@@ -576,34 +1019,104 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
                 continue;  // the library was already parsed
             }
 
-            int count = array->count();
+            int count = array->count() + (int)jobs.size();
             if (count >= MAX_NATIVE_LIBS) {
                 break;
             }
 
-            CodeCache* cc = new CodeCache(map.file(), count, image_base, image_end);
+            LibraryJob job = {new CodeCache(map.file(), count, image_base, image_end), image_base, LibraryJob::NONE, false, false, NULL};
 
             unsigned long inode = map.inode();
             if (inode != 0) {
                 // Do not parse the same executable twice, e.g. on Alpine Linux
                 if (_parsed_inodes.insert(u64(map.dev()) << 32 | inode).second) {
                     // Be careful: executable file is not always ELF, e.g. classes.jsa
-                    if ((image_base -= map.offs()) >= last_readable_base) {
-                        ElfParser::parseProgramHeaders(cc, image_base);
-                    }
-                    ElfParser::parseFile(cc, image_base, map.file(), true);
+                    job.image_base = image_base - map.offs();
+                    job.program_headers = job.image_base >= last_readable_base;
+                    job.kind = LibraryJob::FILE;
                 }
             } else if (strcmp(map.file(), "[vdso]") == 0) {
-                ElfParser::parseMem(cc, image_base);
+                job.kind = LibraryJob::VDSO;
             }
 
-            cc->sort();
-            array->add(cc);
+            jobs.push_back(job);
         }
     }
 
     free(str);
     fclose(f);
+
+    loadLibraries(array, jobs, start, _cache_dir);
+}
+
+bool Symbols::librariesChanged() {
+    u64 count = loadCount();
+    return count == (u64)-1 || count != __atomic_load_n(&_load_count, __ATOMIC_ACQUIRE);
+}
+
+struct LibraryScan {
+    CodeCacheArray* array;
+    std::vector<LibraryJob> jobs;
+};
+
+// Makes the same jobs as the maps scan for every executable segment not parsed yet.
+// The executable and the vDSO, which have no path, are always there at the first scan.
+static int collectLibrary(struct dl_phdr_info* info, size_t size, void* data) {
+    LibraryScan* scan = (LibraryScan*)data;
+    char path[PATH_MAX];
+    if (info->dlpi_name == NULL || strchr(info->dlpi_name, '/') == NULL || realpath(info->dlpi_name, path) == NULL) {
+        return 0;
+    }
+
+    const ElfProgramHeader* first_load = NULL;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfProgramHeader* ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD) {
+            continue;
+        }
+        if (first_load == NULL) {
+            first_load = ph;
+        }
+        if ((ph->p_flags & PF_X) == 0) {
+            continue;
+        }
+
+        uintptr_t page_mask = ~(uintptr_t)(OS::page_size - 1);
+        const char* start = (const char*)((info->dlpi_addr + ph->p_vaddr) & page_mask);
+        const char* end = (const char*)((info->dlpi_addr + ph->p_vaddr + ph->p_memsz + OS::page_size - 1) & page_mask);
+        if (!_parsed_libraries.insert(start).second) {
+            continue;  // the library was already parsed
+        }
+
+        int count = scan->array->count() + (int)scan->jobs.size();
+        if (count >= MAX_NATIVE_LIBS) {
+            return 1;
+        }
+
+        LibraryJob job = {new CodeCache(path, count, start, end), start, LibraryJob::NONE, false, false, NULL};
+
+        struct stat st;
+        if (stat(path, &st) == 0 && _parsed_inodes.insert(u64(major(st.st_dev) << 8 | minor(st.st_dev)) << 32 | st.st_ino).second) {
+            job.image_base = start - (ph->p_offset & page_mask);
+            job.program_headers = first_load->p_offset == 0;
+            job.kind = LibraryJob::FILE;
+        }
+        scan->jobs.push_back(job);
+    }
+    return 0;
+}
+
+// After a dlopen, only what the loader added since the last scan is parsed:
+// dl_iterate_phdr walks the loader's own list instead of reading /proc/self/maps
+void Symbols::parseNewLibraries(CodeCacheArray* array) {
+    MutexLocker ml(_parse_lock);
+
+    u64 start = OS::nanotime();
+    __atomic_store_n(&_load_count, loadCount(), __ATOMIC_RELEASE);
+    LibraryScan scan;
+    scan.array = array;
+    dl_iterate_phdr(collectLibrary, &scan);
+    loadLibraries(array, scan.jobs, start, _cache_dir);
 }
 
 #endif // __linux__
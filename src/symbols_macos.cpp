@@ -113,7 +113,14 @@ class MachOParser {
 
 Mutex Symbols::_parse_lock;
 bool Symbols::_have_kernel_symbols = false;
+char* Symbols::_cache_dir = NULL;
+volatile int Symbols::_generation = 0;
 static std::set<const void*> _parsed_libraries;
+static volatile uint32_t _parsed_images = 0;
+
+// The on-disk symbol cache is not implemented for Mach-O
+void Symbols::setCacheDir(const char* dir) {
+}
 
 void Symbols::parseKernelSymbols(CodeCache* cc) {
 }
@@ -121,6 +128,7 @@ void Symbols::parseKernelSymbols(CodeCache* cc) {
 void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
     MutexLocker ml(_parse_lock);
     uint32_t images = _dyld_image_count();
+    _parsed_images = images;
 
     for (uint32_t i = 0; i < images; i++) {
         const mach_header* image_base = _dyld_get_image_header(i);
@@ -150,7 +158,17 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
 
         cc->sort();
         array->add(cc);
+        invalidate();
     }
 }
 
+bool Symbols::librariesChanged() {
+    return _dyld_image_count() != _parsed_images;
+}
+
+// dyld images are already parsed incrementally
+void Symbols::parseNewLibraries(CodeCacheArray* array) {
+    parseLibraries(array, false);
+}
+
 #endif // __APPLE__
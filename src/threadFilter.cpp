@@ -16,6 +16,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <string>
 #include "threadFilter.h"
 #include "os.h"
 
@@ -36,7 +37,10 @@ ThreadFilter::~ThreadFilter() {
     }
 }
 
+// FILTER lists thread IDs, ID ranges and thread name patterns separated by semicolons,
+// e.g. 1234;2000-2100;http-nio-*;kafka-consumer-*, since commas separate profiler options
 void ThreadFilter::init(const char* filter) {
+    _patterns.clear();
     if (filter == NULL) {
         _enabled = false;
         return;
@@ -45,11 +49,15 @@ void ThreadFilter::init(const char* filter) {
     char* end;
     do {
         int id = strtol(filter, &end, 0);
-        if (id <= 0) {
+        if (end == filter || (*end != 0 && *end != ';' && *end != '-')) {
+            // Not a number: the whole token is a name pattern
+            end = (char*)filter + strcspn(filter, ";");
+            if (end > filter) {
+                _patterns.push_back(Matcher(std::string(filter, end - filter).c_str()));
+            }
+        } else if (id <= 0) {
             break;
-        }
-
-        if (*end == '-') {
+        } else if (*end == '-') {
             int to = strtol(end + 1, &end, 0);
             while (id <= to) {
                 add(id++);
@@ -107,6 +115,16 @@ void ThreadFilter::remove(int thread_id) {
     }
 }
 
+void ThreadFilter::updateName(int thread_id, const char* name) {
+    for (size_t i = 0; i < _patterns.size(); i++) {
+        if (_patterns[i].matches(name)) {
+            add(thread_id);
+            return;
+        }
+    }
+    remove(thread_id);
+}
+
 void ThreadFilter::collect(std::vector<int>& v) {
     for (int i = 0; i < MAX_BITMAPS; i++) {
         u32* b = _bitmap[i];
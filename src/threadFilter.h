@@ -19,6 +19,7 @@
 
 #include <vector>
 #include "arch.h"
+#include "frameName.h"
 
 
 // The size of thread ID bitmap in bytes. Must be at least 64K to allow mmap()
@@ -30,12 +31,16 @@ const u32 MAX_BITMAPS = (1 << 31) / BITMAP_CAPACITY;
 
 
 // ThreadFilter query operations must be lock-free and signal-safe;
-// update operations are mostly lock-free, except rare bitmap allocations
+// update operations are mostly lock-free, except rare bitmap allocations.
+// Besides thread IDs, the filter may list Java thread name patterns: the bit of
+// a thread is then set or cleared by its name on ThreadStart and on every rescan
+// of thread names, so that samplers only ever test the bitmap.
 class ThreadFilter {
   private:
     u32* _bitmap[MAX_BITMAPS];
     bool _enabled;
     volatile int _size;
+    std::vector<Matcher> _patterns;
 
     u32* bitmap(int thread_id) {
         return _bitmap[(u32)thread_id / BITMAP_CAPACITY];
@@ -57,12 +62,23 @@ class ThreadFilter {
         return _size;
     }
 
+    bool hasPatterns() {
+        return !_patterns.empty();
+    }
+
+    // True when the filter is off or includes the thread
+    bool allows(int thread_id) {
+        return !_enabled || accept(thread_id);
+    }
+
     void init(const char* filter);
     void clear();
 
     bool accept(int thread_id);
     void add(int thread_id);
     void remove(int thread_id);
+    // Includes the thread if its name matches one of the patterns, excludes it otherwise
+    void updateName(int thread_id, const char* name);
 
     void collect(std::vector<int>& v);
 };
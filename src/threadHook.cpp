@@ -0,0 +1,75 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "threadHook.h"
+#include "os.h"
+#include "profiler.h"
+#include "vmStructs.h"
+
+
+void** ThreadHook::_entry = NULL;
+volatile ThreadCallback ThreadHook::_on_start = NULL;
+volatile ThreadCallback ThreadHook::_on_end = NULL;
+
+
+int ThreadHook::hook(pthread_key_t key, const void* value) {
+    if (key != VMThread::key()) {
+        return pthread_setspecific(key, value);
+    }
+    if (pthread_getspecific(key) == value) {
+        return 0;
+    }
+
+    if (value != NULL) {
+        int result = pthread_setspecific(key, value);
+        ThreadCallback on_start = _on_start;
+        if (on_start != NULL) on_start(OS::threadId());
+        return result;
+    } else {
+        ThreadCallback on_end = _on_end;
+        if (on_end != NULL) on_end(OS::threadId());
+        return pthread_setspecific(key, value);
+    }
+}
+
+void** ThreadHook::lookupEntry() {
+    // Depending on Zing version, pthread_setspecific is called either from libazsys.so or from libjvm.so
+    if (VM::isZing()) {
+        CodeCache* libazsys = Profiler::instance()->findLibraryByName("libazsys");
+        if (libazsys != NULL) {
+            void** entry = libazsys->findGlobalOffsetEntry((void*)&pthread_setspecific);
+            if (entry != NULL) {
+                return entry;
+            }
+        }
+    }
+
+    CodeCache* lib = Profiler::instance()->findJvmLibrary("libj9thr");
+    return lib != NULL ? lib->findGlobalOffsetEntry((void*)&pthread_setspecific) : NULL;
+}
+
+void ThreadHook::enable(ThreadCallback on_start, ThreadCallback on_end) {
+    _on_start = on_start;
+    _on_end = on_end;
+    __atomic_store_n(_entry, (void*)hook, __ATOMIC_RELEASE);
+}
+
+void ThreadHook::disable() {
+    __atomic_store_n(_entry, (void*)pthread_setspecific, __ATOMIC_RELEASE);
+    _on_start = NULL;
+    _on_end = NULL;
+}
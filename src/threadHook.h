@@ -0,0 +1,48 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _THREADHOOK_H
+#define _THREADHOOK_H
+
+#include <pthread.h>
+
+
+typedef void (*ThreadCallback)(int tid);
+
+// Intercepts thread creation/termination by patching libjvm's GOT entry for pthread_setspecific().
+// HotSpot puts VMThread into TLS on thread start, and resets on thread end.
+// The callbacks run on the thread itself; only one engine has them at a time.
+class ThreadHook {
+  private:
+    static void** _entry;
+    static volatile ThreadCallback _on_start;
+    static volatile ThreadCallback _on_end;
+
+    static int hook(pthread_key_t key, const void* value);
+    static void** lookupEntry();
+
+  public:
+    static bool initialize() {
+        return _entry != NULL || (_entry = lookupEntry()) != NULL;
+    }
+
+    // Must be enabled before the running threads are enumerated, so that none is missed
+    static void enable(ThreadCallback on_start, ThreadCallback on_end);
+    static void disable();
+};
+
+#endif // _THREADHOOK_H
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include "threadRegistry.h"
+
+
+class RegistryThreadList : public ThreadList {
+  private:
+    ThreadRegistry* _registry;
+    std::vector<int> _tids;
+    size_t _index;
+
+  public:
+    RegistryThreadList(ThreadRegistry* registry) : _registry(registry), _tids(), _index(0) {
+        _registry->scanIfStale();
+        _registry->collect(_tids);
+    }
+
+    void rewind() {
+        _registry->scanIfStale();
+        _tids.clear();
+        _registry->collect(_tids);
+        _index = 0;
+    }
+
+    int next() {
+        return _index < _tids.size() ? _tids[_index++] : -1;
+    }
+
+    int size() {
+        return (int)_tids.size();
+    }
+};
+
+
+// A thread started between listing and removal is dropped until the next rescan
+void ThreadRegistry::scan() {
+    MutexLocker ml(_scan_lock);
+
+    std::vector<int> alive;
+    ThreadList* thread_list = OS::listThreads();
+    for (int tid; (tid = thread_list->next()) != -1; ) {
+        alive.push_back(tid);
+    }
+    delete thread_list;
+    std::sort(alive.begin(), alive.end());
+
+    std::vector<int> known;
+    _threads.collect(known);
+    for (size_t i = 0; i < known.size(); i++) {
+        if (!std::binary_search(alive.begin(), alive.end(), known[i])) {
+            _threads.remove(known[i]);
+        }
+    }
+    for (size_t i = 0; i < alive.size(); i++) {
+        _threads.add(alive[i]);
+    }
+
+    _last_scan = OS::nanotime();
+}
+
+void ThreadRegistry::scanIfStale() {
+    if (OS::nanotime() - _last_scan >= THREAD_RESCAN_INTERVAL) {
+        scan();
+    }
+}
+
+void ThreadRegistry::collect(std::vector<int>& tids) {
+    _threads.collect(tids);
+}
+
+ThreadList* ThreadRegistry::listThreads() {
+    return new RegistryThreadList(this);
+}
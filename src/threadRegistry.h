@@ -0,0 +1,63 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THREADREGISTRY_H
+#define _THREADREGISTRY_H
+
+#include <vector>
+#include "mutex.h"
+#include "os.h"
+#include "threadFilter.h"
+
+
+// Native threads are not announced by JVM TI; they are picked up by a rescan this old
+const u64 THREAD_RESCAN_INTERVAL = 1000000000ULL;
+
+// Threads of the process, kept in memory so that samplers do not walk
+// /proc/self/task every cycle. Java threads are added and removed by
+// ThreadStart/ThreadEnd; a periodic rescan of the OS thread list catches the rest.
+class ThreadRegistry {
+  private:
+    ThreadFilter _threads;
+    Mutex _scan_lock;
+    volatile u64 _last_scan;
+
+  public:
+    ThreadRegistry() : _threads(), _scan_lock(), _last_scan(0) {
+    }
+
+    int size() {
+        return _threads.size();
+    }
+
+    void add(int thread_id) {
+        _threads.add(thread_id);
+    }
+
+    void remove(int thread_id) {
+        _threads.remove(thread_id);
+    }
+
+    // Replaces the contents with the current OS thread list
+    void scan();
+    void scanIfStale();
+    void collect(std::vector<int>& tids);
+
+    // Iterates a snapshot taken at creation and at every rewind
+    ThreadList* listThreads();
+};
+
+#endif // _THREADREGISTRY_H
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadSnapshot.h"
+#include "memoryBudget.h"
+#include "os.h"
+#include "profiler.h"
+
+
+SnapshotSlot* ThreadSnapshot::_slots = NULL;
+int ThreadSnapshot::_count = 0;
+volatile bool ThreadSnapshot::_active = false;
+volatile int ThreadSnapshot::_answered = 0;
+volatile int ThreadSnapshot::_in_handler = 0;
+bool ThreadSnapshot::_installed = false;
+struct sigaction ThreadSnapshot::_previous;
+
+void ThreadSnapshot::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    int saved_errno = errno;
+    if (siginfo->si_code != SI_QUEUE || siginfo->si_pid != OS::processId()) {
+        // Not a snapshot request: out-of-band data on a socket, a Go preemption and such
+        if (_previous.sa_flags & SA_SIGINFO) {
+            _previous.sa_sigaction(signo, siginfo, ucontext);
+        } else if (_previous.sa_handler != SIG_DFL && _previous.sa_handler != SIG_IGN) {
+            _previous.sa_handler(signo);
+        }
+        errno = saved_errno;
+        return;
+    }
+
+    // Counted before _active is read: once _active is cleared and no handler is inside, the slots are free
+    atomicInc(_in_handler);
+    if (_active) {
+        intptr_t index = (intptr_t)siginfo->si_value.sival_ptr;
+        if (index >= 0 && index < _count) {
+            SnapshotSlot* slot = &_slots[index];
+            if (slot->tid == OS::threadId() && __sync_bool_compare_and_swap(&slot->state, SLOT_PENDING, SLOT_BUSY)) {
+                slot->num_frames = Profiler::instance()->getSnapshotTrace(ucontext, slot->frames, SNAPSHOT_DEPTH);
+                __atomic_store_n(&slot->state, SLOT_DONE, __ATOMIC_RELEASE);
+                atomicInc(_answered);
+            }
+        }
+    }
+    atomicInc(_in_handler, -1);
+    errno = saved_errno;
+}
+
+Error ThreadSnapshot::take(const std::vector<int>& tids, long timeout_ms) {
+    release();
+    if (tids.empty()) {
+        return Error::OK;
+    }
+
+    _slots = (SnapshotSlot*)calloc(tids.size(), sizeof(SnapshotSlot));
+    if (_slots == NULL) {
+        return Error("Not enough memory for the thread snapshot");
+    }
+    MemoryBudget::charge(MEMORY_DUMP, tids.size() * sizeof(SnapshotSlot));
+    _count = tids.size();
+    for (int i = 0; i < _count; i++) {
+        _slots[i].tid = tids[i];
+        _slots[i].state = SLOT_PENDING;
+    }
+
+    if (!_installed) {
+        // Stays installed: a signal that outlives the snapshot finds _active cleared.
+        // Signals of the application are passed on to the handler it had before
+        sigaction(SNAPSHOT_SIGNAL, NULL, &_previous);
+        OS::installSignalHandler(SNAPSHOT_SIGNAL, signalHandler);
+        _installed = true;
+    }
+
+    _answered = 0;
+    __atomic_store_n(&_active, true, __ATOMIC_SEQ_CST);
+
+    int sent = 0;
+    for (int i = 0; i < _count; i++) {
+        if (OS::sendSignalToThread(_slots[i].tid, SNAPSHOT_SIGNAL, (intptr_t)i)) {
+            sent++;
+        } else {
+            // The thread has exited
+            _slots[i].state = SLOT_MISSED;
+        }
+    }
+
+    u64 deadline = OS::nanotime() + (u64)timeout_ms * 1000000;
+    while (_answered < sent && OS::nanotime() < deadline) {
+        usleep(100);
+    }
+
+    __atomic_store_n(&_active, false, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < _count; i++) {
+        __sync_bool_compare_and_swap(&_slots[i].state, SLOT_PENDING, SLOT_MISSED);
+    }
+    // A handler that got its slot before the deadline finishes the walk
+    while (__atomic_load_n(&_in_handler, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    return Error::OK;
+}
+
+void ThreadSnapshot::release() {
+    if (_slots != NULL) {
+        MemoryBudget::release(MEMORY_DUMP, _count * sizeof(SnapshotSlot));
+        free(_slots);
+        _slots = NULL;
+        _count = 0;
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THREADSNAPSHOT_H
+#define _THREADSNAPSHOT_H
+
+#include <signal.h>
+#include <vector>
+#include "arch.h"
+#include "arguments.h"
+#include "vmEntry.h"
+
+
+// The default action of SIGURG is to ignore it, so a signal that arrives late is harmless.
+// Sockets with F_SETOWN and the Go runtime use it too: their signals go to the previous handler
+const int SNAPSHOT_SIGNAL = SIGURG;
+// Native and Java frames captured per thread
+const int SNAPSHOT_DEPTH = 256;
+const int DEFAULT_SNAPSHOT_TIMEOUT = 500;
+
+enum SnapshotSlotState {
+    SLOT_PENDING,
+    SLOT_BUSY,
+    SLOT_DONE,
+    SLOT_MISSED  // the thread did not take the signal in time, or could not be signalled
+};
+
+struct SnapshotSlot {
+    int tid;
+    volatile int state;
+    int num_frames;
+    ASGCT_CallFrame frames[SNAPSHOT_DEPTH];
+};
+
+// snapshot: the stack of every thread of the process at once, without a safepoint.
+// Every thread gets SNAPSHOT_SIGNAL with the index of its slot, preallocated before
+// the first signal is sent; the handler walks the stack of the interrupted thread
+// into the slot, all threads in parallel. take() waits for the slots until the timeout;
+// threads that have not answered by then are given up, and a late handler leaves
+// its slot alone.
+class ThreadSnapshot {
+  private:
+    static SnapshotSlot* _slots;
+    static int _count;
+    static volatile bool _active;
+    static volatile int _answered;
+    static volatile int _in_handler;
+    static bool _installed;
+    static struct sigaction _previous;
+
+    static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
+
+  public:
+    static int count() {
+        return _count;
+    }
+
+    static SnapshotSlot* slot(int index) {
+        return &_slots[index];
+    }
+
+    // Slots of the given threads stay valid until release()
+    static Error take(const std::vector<int>& tids, long timeout_ms);
+    static void release();
+};
+
+#endif // _THREADSNAPSHOT_H
@@ -18,7 +18,9 @@
 #define _TIMEUTIL_H
 
 #include <time.h>
+#include <jni.h>
 #include "arch.h"
+#include "tsc.h"
 
 u64 getCurrentTimestamp() {
     struct timespec ts;
@@ -26,4 +28,39 @@ u64 getCurrentTimestamp() {
     return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+// Time base of the Kindling streams: wall clock nanoseconds by default,
+// raw TSC ticks with kdclock=tsc. Durations are always reported in nanoseconds;
+// kd-clk anchor records let the consumer convert the ticks to wall clock time.
+class KdClock {
+  private:
+    static bool _ticks;
+
+  public:
+    static void init(bool ticks) {
+        _ticks = ticks && TSC::enabled();
+    }
+
+    static bool ticks() {
+        return _ticks;
+    }
+
+    static u64 now() {
+        return _ticks ? TSC::ticks() : getCurrentTimestamp();
+    }
+
+    static u64 frequency() {
+        return _ticks ? TSC::frequency() : 1000000000;
+    }
+
+    static jlong toNanos(jlong duration) {
+        return _ticks ? (jlong)(duration * (1e9 / TSC::frequency())) : duration;
+    }
+
+    static jlong fromNanos(jlong nanos) {
+        return _ticks ? (jlong)(nanos * (TSC::frequency() / 1e9)) : nanos;
+    }
+};
+
+bool KdClock::_ticks = false;
+
 #endif // _TIMEUTIL_H
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include "os.h"
+#include "traceContext.h"
+
+
+int TraceContext::_max_threads = 0;
+TraceContextSlot* TraceContext::_slots = NULL;
+
+void TraceContext::set(int tid, const TraceIds& ids) {
+    TraceContextSlot* slots = __atomic_load_n(&_slots, __ATOMIC_ACQUIRE);
+    if (slots == NULL) {
+        if (ids.empty()) {
+            return;
+        }
+        // Pages of the table are touched only for the threads that set a context
+        int max_threads = OS::getMaxThreadId();
+        TraceContextSlot* new_slots = (TraceContextSlot*)calloc(max_threads, sizeof(TraceContextSlot));
+        if (new_slots == NULL) {
+            return;
+        }
+        __atomic_store_n(&_max_threads, max_threads, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&_slots, &slots, new_slots, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            slots = new_slots;
+        } else {
+            free(new_slots);
+        }
+    }
+
+    if (tid < 0 || tid >= _max_threads) {
+        return;
+    }
+
+    TraceContextSlot* slot = &slots[tid];
+    __atomic_fetch_add(&slot->seq, 1, __ATOMIC_ACQ_REL);
+    slot->ids = ids;
+    __atomic_fetch_add(&slot->seq, 1, __ATOMIC_RELEASE);
+}
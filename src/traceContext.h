@@ -0,0 +1,71 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TRACECONTEXT_H
+#define _TRACECONTEXT_H
+
+#include "arch.h"
+
+
+// Trace id (128 bits) and span id of a thread; all zero means no context
+struct TraceIds {
+    u64 trace_high;
+    u64 trace_low;
+    u64 span_id;
+
+    bool empty() const {
+        return (trace_high | trace_low | span_id) == 0;
+    }
+};
+
+// A slot is written only by its own thread; seq is odd while a write is in progress
+struct TraceContextSlot {
+    u32 seq;
+    TraceIds ids;
+};
+
+// Trace context set by the application (AsyncProfiler.setTraceContext), indexed
+// by native thread id. Samplers read the slot of the sampled thread directly,
+// so tagging costs nothing per sample; only a context switch of the application
+// crosses JNI.
+class TraceContext {
+  private:
+    static int _max_threads;
+    static TraceContextSlot* _slots;
+
+  public:
+    static void set(int tid, const TraceIds& ids);
+
+    // Async signal safe. False if the thread has no context, or if the signal
+    // interrupted the thread in the middle of updating its own context.
+    static bool get(int tid, TraceIds* ids) {
+        TraceContextSlot* slots = __atomic_load_n(&_slots, __ATOMIC_ACQUIRE);
+        if (slots == NULL || tid < 0 || tid >= _max_threads) {
+            return false;
+        }
+
+        TraceContextSlot* slot = &slots[tid];
+        u32 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            return false;
+        }
+        *ids = slot->ids;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq && !ids->empty();
+    }
+};
+
+#endif // _TRACECONTEXT_H
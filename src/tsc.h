@@ -73,6 +73,11 @@ class TSC {
     static u64 frequency() {
         return _frequency;
     }
+
+    // Durations measured with ticks(), which counts ns when TSC is not used
+    static u64 ticksToNanos(u64 ticks) {
+        return enabled() ? (u64)(ticks * (1e9 / _frequency)) : ticks;
+    }
 };
 
 #endif // _TSC_H
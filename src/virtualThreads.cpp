@@ -0,0 +1,72 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "virtualThreads.h"
+#include "eventLogger.h"
+#include "memoryBudget.h"
+#include "vmStructs.h"
+
+
+Mutex VirtualThreadNames::_lock;
+VirtualThreadList VirtualThreadNames::_lru;
+std::map<jlong, VirtualThreadList::iterator> VirtualThreadNames::_index;
+
+static u64 virtualThreadNameSize(const std::string& name) {
+    return 2 * MAP_NODE_OVERHEAD + sizeof(jlong) + sizeof(std::string) + name.size();
+}
+
+jlong VirtualThreadNames::current() {
+    if (!VMThread::hasVirtualThreads()) {
+        return 0;
+    }
+    VMThread* vm_thread = VMThread::current();
+    return vm_thread != NULL ? vm_thread->mountedVirtualThreadId() : 0;
+}
+
+void VirtualThreadNames::touch(jvmtiEnv* jvmti, jthread thread, jlong id) {
+    MutexLocker ml(_lock);
+    std::map<jlong, VirtualThreadList::iterator>::iterator it = _index.find(id);
+    if (it != _index.end()) {
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return;
+    }
+
+    jvmtiThreadInfo thread_info;
+    thread_info.name = NULL;
+    jvmti->GetThreadInfo(thread, &thread_info);
+    std::string name(thread_info.name != NULL ? thread_info.name : "");
+    jvmti->Deallocate((unsigned char*)thread_info.name);
+
+    if (_lru.size() >= VTHREAD_NAMES_CAPACITY) {
+        MemoryBudget::release(MEMORY_METHOD_NAMES, virtualThreadNameSize(_lru.back().second));
+        _index.erase(_lru.back().first);
+        _lru.pop_back();
+    }
+    _lru.push_front(std::make_pair(id, name));
+    _index[id] = _lru.begin();
+    MemoryBudget::charge(MEMORY_METHOD_NAMES, virtualThreadNameSize(name));
+
+    EventLogger::log("kd-vtm@%lld!%s!", (long long)id, name.c_str());
+}
+
+void VirtualThreadNames::clear() {
+    MutexLocker ml(_lock);
+    for (VirtualThreadList::iterator it = _lru.begin(); it != _lru.end(); ++it) {
+        MemoryBudget::release(MEMORY_METHOD_NAMES, virtualThreadNameSize(it->second));
+    }
+    _lru.clear();
+    _index.clear();
+}
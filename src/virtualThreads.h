@@ -0,0 +1,51 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _VIRTUALTHREADS_H
+#define _VIRTUALTHREADS_H
+
+#include <jvmti.h>
+#include <list>
+#include <map>
+#include <string>
+#include "mutex.h"
+
+
+const size_t VTHREAD_NAMES_CAPACITY = 4096;
+
+typedef std::list<std::pair<jlong, std::string> > VirtualThreadList;
+
+// Samples and lock events of a carrier thread name the virtual thread mounted on it
+// by its Java id (kd-vt). Its name is sent once as kd-vtm@id!name! when first seen by
+// a lock event, the only place that has the thread object. Millions of virtual threads
+// rule out a table like _thread_names: only the VTHREAD_NAMES_CAPACITY most recently
+// used names are kept, and a thread evicted and seen again has its name sent again.
+class VirtualThreadNames {
+  private:
+    static Mutex _lock;
+    static VirtualThreadList _lru;
+    static std::map<jlong, VirtualThreadList::iterator> _index;
+
+  public:
+    // Async signal safe; 0 outside of a virtual thread or before JDK 19
+    static jlong current();
+
+    // thread is the virtual thread with the given id, as passed to the JVM TI callbacks
+    static void touch(jvmtiEnv* jvmti, jthread thread, jlong id);
+    static void clear();
+};
+
+#endif // _VIRTUALTHREADS_H
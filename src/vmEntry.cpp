@@ -20,6 +20,7 @@
 #include <sys/mman.h>
 #include "vmEntry.h"
 #include "arguments.h"
+#include "gcPhase.h"
 #include "j9Ext.h"
 #include "j9ObjectSampler.h"
 #include "javaApi.h"
@@ -28,6 +29,7 @@
 #include "instrument.h"
 #include "lockTracer.h"
 #include "log.h"
+#include "symbols.h"
 #include "vmStructs.h"
 
 
@@ -39,6 +41,9 @@ static Arguments _agent_args(true);
 
 JavaVM* VM::_vm;
 jvmtiEnv* VM::_jvmti = NULL;
+volatile bool VM::_initialized = false;
+bool VM::_init_failed = false;
+Mutex VM::_init_lock;
 
 int VM::_hotspot_version = 0;
 bool VM::_openj9 = false;
@@ -88,11 +93,27 @@ static void resolveMethodIdEnd() {
 }
 
 
+// With deferred init, the first command may come from several threads at once:
+// HTTP server requests, JNI_OnLoad and Agent_OnAttach. One of them initializes,
+// the others wait for it; a failed init is not tried again.
 bool VM::init(JavaVM* vm, bool attach) {
-    if (_jvmti != NULL) return true;
+    if (__atomic_load_n(&_initialized, __ATOMIC_ACQUIRE)) return true;
 
+    MutexLocker ml(_init_lock);
+    if (_initialized) return true;
+    if (_init_failed) return false;
+
+    if (!initOnce(vm, attach)) {
+        _init_failed = true;
+        return false;
+    }
+    __atomic_store_n(&_initialized, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool VM::initOnce(JavaVM* vm, bool attach) {
     _vm = vm;
-    if (_vm->GetEnv((void**)&_jvmti, JVMTI_VERSION_1_0) != 0) {
+    if (_jvmti == NULL && _vm->GetEnv((void**)&_jvmti, JVMTI_VERSION_1_0) != 0) {
         return false;
     }
 
@@ -184,6 +205,7 @@ bool VM::init(JavaVM* vm, bool attach) {
     capabilities.can_generate_compiled_method_load_events = 1;
     capabilities.can_generate_monitor_events = 1;
     capabilities.can_tag_objects = 1;
+    capabilities.can_generate_garbage_collection_events = 1;
     if (_jvmti->AddCapabilities(&capabilities) != 0) {
         _can_sample_objects = false;
         capabilities.can_generate_sampled_object_alloc_events = 0;
@@ -197,6 +219,7 @@ bool VM::init(JavaVM* vm, bool attach) {
     callbacks.ClassPrepare = ClassPrepare;
     callbacks.ClassFileLoadHook = Instrument::ClassFileLoadHook;
     callbacks.CompiledMethodLoad = Profiler::CompiledMethodLoad;
+    callbacks.CompiledMethodUnload = Profiler::CompiledMethodUnload;
     callbacks.DynamicCodeGenerated = Profiler::DynamicCodeGenerated;
     callbacks.ThreadStart = Profiler::ThreadStart;
     callbacks.ThreadEnd = Profiler::ThreadEnd;
@@ -206,6 +229,8 @@ bool VM::init(JavaVM* vm, bool attach) {
     callbacks.MonitorContendedEntered = LockTracer::MonitorContendedEntered;
     callbacks.VMObjectAlloc = J9ObjectSampler::VMObjectAlloc;
     callbacks.SampledObjectAlloc = ObjectSampler::SampledObjectAlloc;
+    callbacks.GarbageCollectionStart = GcPhase::GarbageCollectionStart;
+    callbacks.GarbageCollectionFinish = GcPhase::GarbageCollectionFinish;
     _jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
 
     _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, NULL);
@@ -238,6 +263,22 @@ bool VM::init(JavaVM* vm, bool attach) {
     return true;
 }
 
+bool VM::preload(JavaVM* vm) {
+    _vm = vm;
+    if (_vm->GetEnv((void**)&_jvmti, JVMTI_VERSION_1_0) != 0) {
+        return false;
+    }
+
+    jvmtiEventCallbacks callbacks = {0};
+    callbacks.VMInit = VMInit;
+    callbacks.VMDeath = VMDeath;
+    _jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+
+    _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL);
+    _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, NULL);
+    return true;
+}
+
 // Run late initialization when JVM is ready
 void VM::ready() {
     {
@@ -320,8 +361,10 @@ void VM::restartProfiler() {
 }
 
 void JNICALL VM::VMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
-    ready();
-    loadAllMethodIDs(jvmti, jni);
+    if (_initialized) {
+        ready();
+        loadAllMethodIDs(jvmti, jni);
+    }
 
     // Allow profiler server only at JVM startup
     if (_agent_args._server != NULL) {
@@ -332,6 +375,10 @@ void JNICALL VM::VMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
         }
     }
 
+    if (!_initialized) {
+        return;
+    }
+
     // Delayed start of profiler if agent has been loaded at VM bootstrap
     Error error = Profiler::instance()->run(_agent_args);
     if (error) {
@@ -381,13 +428,16 @@ Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
     Error error = _agent_args.parse(options);
 
     Log::open(_agent_args);
+    Symbols::setCacheDir(_agent_args._symcache);
 
     if (error) {
         Log::error("%s", error.message());
         return ARGUMENTS_ERROR;
     }
 
-    if (!VM::init(vm, false)) {
+    // Unless profiling starts with the JVM, the agent costs nothing until its first command
+    bool ok = _agent_args._action == ACTION_NONE ? VM::preload(vm) : VM::init(vm, false);
+    if (!ok) {
         Log::error("JVM does not support Tool Interface");
         return COMMAND_ERROR;
     }
@@ -401,6 +451,7 @@ Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
     Error error = args.parse(options);
 
     Log::open(args);
+    Symbols::setCacheDir(args._symcache);
 
     if (error) {
         Log::error("%s", error.message());
@@ -18,6 +18,7 @@
 #define _VMENTRY_H
 
 #include <jvmti.h>
+#include "mutex.h"
 
 
 #ifdef __clang__
@@ -46,6 +47,11 @@ class FrameType {
     static inline FrameTypeId decode(int bci) {
         return (bci >> 24) > 0 ? (FrameTypeId)(bci >> 25) : FRAME_JIT_COMPILED;
     }
+
+    // Frames that FrameName names alike: special frames share their bci, Java frames their type
+    static inline int nameKind(int bci) {
+        return bci < 0 ? bci : (int)decode(bci);
+    }
 };
 
 
@@ -59,6 +65,9 @@ enum ASGCT_CallFrameType {
     BCI_THREAD_ID           = -15,  // method_id designates a thread
     BCI_ERROR               = -16,  // method_id is an error string
     BCI_INSTRUMENT          = -17,  // synthetic method_id that should not appear in the call stack
+    BCI_LOCK_WAIT           = -18,  // lock wait traced by LockRecorder, never a frame
+    BCI_NATIVE_ALLOC        = -19,  // native allocation sampled by MallocTracer, never a frame
+    BCI_IO                  = -20,  // slow I/O call timed by IoTracer, never a frame
 };
 
 // See hotspot/src/share/vm/prims/forte.cpp
@@ -110,6 +119,9 @@ class VM {
   private:
     static JavaVM* _vm;
     static jvmtiEnv* _jvmti;
+    static volatile bool _initialized;
+    static bool _init_failed;
+    static Mutex _init_lock;
 
     static int _hotspot_version;
     static bool _openj9;
@@ -119,6 +131,7 @@ class VM {
     static jvmtiError (JNICALL *_orig_RedefineClasses)(jvmtiEnv*, jint, const jvmtiClassDefinition*);
     static jvmtiError (JNICALL *_orig_RetransformClasses)(jvmtiEnv*, jint, const jclass* classes);
 
+    static bool initOnce(JavaVM* vm, bool attach);
     static void ready();
     static void applyPatch(char* func, const char* patch, const char* end_patch);
     static void* getLibraryHandle(const char* name);
@@ -132,6 +145,17 @@ class VM {
     static JVM_GetManagement _getManagement;
 
     static bool init(JavaVM* vm, bool attach);
+    // Agent loaded at startup without a command: gets only the VMInit and VMDeath events;
+    // symbols, VMStructs, capabilities and the other events wait for init on the first command
+    static bool preload(JavaVM* vm);
+
+    static bool initialized() {
+        return _initialized;
+    }
+
+    static bool initLate() {
+        return init(_vm, true);
+    }
 
     static void restartProfiler();
 
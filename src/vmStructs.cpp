@@ -19,6 +19,7 @@
 #include "vmStructs.h"
 #include "vmEntry.h"
 #include "j9Ext.h"
+#include "safeAccess.h"
 
 
 CodeCache* VMStructs::_libjvm = NULL;
@@ -28,6 +29,7 @@ bool VMStructs::_has_method_structs = false;
 bool VMStructs::_has_class_loader_data = false;
 bool VMStructs::_has_native_thread_id = false;
 bool VMStructs::_has_perm_gen = false;
+bool VMStructs::_has_stack_structs = false;
 
 int VMStructs::_klass_name_offset = -1;
 int VMStructs::_symbol_length_offset = -1;
@@ -40,12 +42,17 @@ int VMStructs::_jmethod_ids_offset = -1;
 int VMStructs::_thread_osthread_offset = -1;
 int VMStructs::_thread_anchor_offset = -1;
 int VMStructs::_thread_state_offset = -1;
+int VMStructs::_thread_threadobj_offset = -1;
+int VMStructs::_thread_vthread_offset = -1;
+int VMStructs::_thread_tid_offset = -1;
 int VMStructs::_osthread_id_offset = -1;
 int VMStructs::_anchor_sp_offset = -1;
 int VMStructs::_anchor_pc_offset = -1;
 int VMStructs::_frame_size_offset = -1;
 int VMStructs::_frame_complete_offset = -1;
 int VMStructs::_nmethod_name_offset = -1;
+int VMStructs::_code_begin_offset = -1;
+int VMStructs::_code_offset_offset = -1;
 int VMStructs::_nmethod_method_offset = -1;
 int VMStructs::_nmethod_entry_offset = -1;
 int VMStructs::_nmethod_state_offset = -1;
@@ -54,6 +61,8 @@ int VMStructs::_method_constmethod_offset = -1;
 int VMStructs::_method_code_offset = -1;
 int VMStructs::_constmethod_constants_offset = -1;
 int VMStructs::_constmethod_idnum_offset = -1;
+int VMStructs::_constmethod_code_size_offset = -1;
+int VMStructs::_constmethod_size = 0;
 int VMStructs::_pool_holder_offset = -1;
 int VMStructs::_array_data_offset = -1;
 int VMStructs::_code_heap_memory_offset = -1;
@@ -75,6 +84,13 @@ char** VMStructs::_code_heap_addr = NULL;
 const void** VMStructs::_code_heap_low_addr = NULL;
 const void** VMStructs::_code_heap_high_addr = NULL;
 int* VMStructs::_klass_offset_addr = NULL;
+char** VMStructs::_collected_heap_addr = NULL;
+volatile int* VMStructs::_safepoint_state_addr = NULL;
+int VMStructs::_collected_heap_reserved_offset = -1;
+int VMStructs::_region_start_offset = -1;
+int VMStructs::_region_size_offset = -1;
+const void* VMStructs::_java_heap_low = NULL;
+const void* VMStructs::_java_heap_high = NULL;
 
 jfieldID VMStructs::_eetop;
 jfieldID VMStructs::_tid;
@@ -165,6 +181,8 @@ void VMStructs::initOffsets() {
                 _constmethod_constants_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_method_idnum") == 0) {
                 _constmethod_idnum_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_code_size") == 0) {
+                _constmethod_code_size_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "ConstantPool") == 0) {
             if (strcmp(field, "_pool_holder") == 0) {
@@ -193,6 +211,10 @@ void VMStructs::initOffsets() {
                 _thread_anchor_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_thread_state") == 0) {
                 _thread_state_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_threadObj") == 0) {
+                _thread_threadobj_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_vthread") == 0) {
+                _thread_vthread_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "OSThread") == 0) {
             if (strcmp(field, "_thread_id") == 0) {
@@ -211,6 +233,10 @@ void VMStructs::initOffsets() {
                 _frame_complete_offset = *(int*)(entry + offset_offset);
             } else if (strcmp(field, "_name") == 0) {
                 _nmethod_name_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_code_begin") == 0) {
+                _code_begin_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_code_offset") == 0) {
+                _code_offset_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "CodeCache") == 0) {
             if (strcmp(field, "_heap") == 0) {
@@ -222,6 +248,24 @@ void VMStructs::initOffsets() {
             } else if (strcmp(field, "_high_bound") == 0) {
                 _code_heap_high_addr = *(const void***)(entry + address_offset);
             }
+        } else if (strcmp(type, "Universe") == 0) {
+            if (strcmp(field, "_collectedHeap") == 0) {
+                _collected_heap_addr = *(char***)(entry + address_offset);
+            }
+        } else if (strcmp(type, "SafepointSynchronize") == 0) {
+            if (strcmp(field, "_state") == 0) {
+                _safepoint_state_addr = *(volatile int**)(entry + address_offset);
+            }
+        } else if (strcmp(type, "CollectedHeap") == 0) {
+            if (strcmp(field, "_reserved") == 0) {
+                _collected_heap_reserved_offset = *(int*)(entry + offset_offset);
+            }
+        } else if (strcmp(type, "MemRegion") == 0) {
+            if (strcmp(field, "_start") == 0) {
+                _region_start_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_word_size") == 0) {
+                _region_size_offset = *(int*)(entry + offset_offset);
+            }
         } else if (strcmp(type, "CodeHeap") == 0) {
             if (strcmp(field, "_memory") == 0) {
                 _code_heap_memory_offset = *(int*)(entry + offset_offset);
@@ -276,7 +320,9 @@ void VMStructs::initOffsets() {
 
         if (strcmp(type, "JVMFlag") == 0 || strcmp(type, "Flag") == 0) {
             _flag_size = *(int*)(entry + size_offset);
-            break;
+        } else if (strcmp(type, "ConstMethod") == 0) {
+            // Bytecodes follow the fixed part of ConstMethod
+            _constmethod_size = *(int*)(entry + size_offset);
         }
     }
 }
@@ -307,6 +353,14 @@ void VMStructs::resolveOffsets() {
         && _klass != NULL
         && _lock_func != NULL && _unlock_func != NULL;
 
+    _has_stack_structs = _has_method_structs
+        && _frame_size_offset >= 0
+        && _frame_complete_offset >= 0
+        && _nmethod_name_offset >= 0
+        && (_code_begin_offset >= 0 || _code_offset_offset >= 0)
+        && _constmethod_code_size_offset >= 0
+        && _constmethod_size > 0;
+
     if (_code_heap_addr != NULL && _code_heap_low_addr != NULL && _code_heap_high_addr != NULL) {
         char* code_heaps = *_code_heap_addr;
         unsigned int code_heap_count = *(unsigned int*)code_heaps;
@@ -322,6 +376,15 @@ void VMStructs::resolveOffsets() {
         _code_heap_high = *(const void**)(_code_heap[0] + _code_heap_memory_offset + _vs_high_bound_offset);
     }
 
+    if (_collected_heap_addr != NULL && *_collected_heap_addr != NULL &&
+        _collected_heap_reserved_offset >= 0 && _region_start_offset >= 0 && _region_size_offset >= 0) {
+        const char* reserved = *_collected_heap_addr + _collected_heap_reserved_offset;
+        const char* start = *(const char**)(reserved + _region_start_offset);
+        size_t words = *(size_t*)(reserved + _region_size_offset);
+        _java_heap_low = start;
+        _java_heap_high = start + words * sizeof(uintptr_t);
+    }
+
     // Invariant: _code_heap[i] != NULL iff all CodeHeap structures are available
     if (_code_heap[0] != NULL && _code_heap_segment_shift >= 0) {
         _code_heap_segment_shift = *(int*)(_code_heap[0] + _code_heap_segment_shift);
@@ -335,6 +398,10 @@ void VMStructs::resolveOffsets() {
 void VMStructs::initJvmFunctions() {
     _get_stack_trace = (GetStackTraceFunc)_libjvm->findSymbolByPrefix("_ZN8JvmtiEnv13GetStackTraceEP10JavaThreadiiP");
 
+    if (_safepoint_state_addr == NULL) {
+        _safepoint_state_addr = (volatile int*)_libjvm->findSymbol("_ZN20SafepointSynchronize6_stateE");
+    }
+
     if (VM::hotspot_version() == 8) {
         _lock_func = (LockFunc)_libjvm->findSymbol("_ZN7Monitor28lock_without_safepoint_checkEv");
         _unlock_func = (LockFunc)_libjvm->findSymbol("_ZN7Monitor6unlockEv");
@@ -374,10 +441,26 @@ void VMStructs::initThreadBridge(JNIEnv* env) {
             _env_offset = (intptr_t)env - (intptr_t)vm_thread;
             _has_native_thread_id = _thread_osthread_offset >= 0 && _osthread_id_offset >= 0;
             initTLS(vm_thread);
+            initVirtualThreads(env, thread, vm_thread);
         }
     }
 }
 
+// A product build encodes the jfieldID of an instance field as offset << 2 | 2 (jfieldIDWorkaround);
+// the offset is used only if it reads back the tid of the current thread through _threadObj
+void VMStructs::initVirtualThreads(JNIEnv* env, jthread thread, VMThread* vm_thread) {
+    uintptr_t field = (uintptr_t)_tid;
+    if (_thread_vthread_offset < 0 || _thread_threadobj_offset < 0 || (field & 3) != 2) {
+        return;
+    }
+
+    int offset = (int)(field >> 2);
+    const char** handle = *(const char***)((const char*)vm_thread + _thread_threadobj_offset);
+    if (handle != NULL && *handle != NULL && *(jlong*)(*handle + offset) == VMThread::javaThreadId(env, thread)) {
+        _thread_tid_offset = offset;
+    }
+}
+
 void VMStructs::initLogging(JNIEnv* env) {
     // Workaround for JDK-8238460
     if (VM::hotspot_version() >= 15) {
@@ -430,10 +513,61 @@ jmethodID ConstMethod::id() {
     return NULL;
 }
 
+jmethodID VMMethod::checkedId(const void* bcp, int* bci) {
+    const uintptr_t align = sizeof(void*) - 1;
+    if (((uintptr_t)this & align) != 0 || (uintptr_t)this < 0x1000) {
+        return NULL;
+    }
+
+    const char* const_method = (const char*)SafeAccess::load((void**)at(_method_constmethod_offset));
+    if (const_method == NULL || ((uintptr_t)const_method & align) != 0) {
+        return NULL;
+    }
+    const char* cpool = (const char*)SafeAccess::load((void**)(const_method + _constmethod_constants_offset));
+    if (cpool == NULL || ((uintptr_t)cpool & align) != 0) {
+        return NULL;
+    }
+    const char* holder = (const char*)SafeAccess::load((void**)(cpool + _pool_holder_offset));
+    if (holder == NULL || ((uintptr_t)holder & align) != 0) {
+        return NULL;
+    }
+    jmethodID* ids = (jmethodID*)SafeAccess::load((void**)(holder + _jmethod_ids_offset));
+    if (ids == NULL) {
+        return NULL;
+    }
+
+    unsigned short num = *(unsigned short*)(const_method + _constmethod_idnum_offset);
+    if (num >= (size_t)SafeAccess::load((void**)ids)) {
+        return NULL;
+    }
+
+    if (bci != NULL) {
+        const char* code = const_method + _constmethod_size;
+        unsigned short code_size = *(unsigned short*)(const_method + _constmethod_code_size_offset);
+        *bci = bcp >= code && bcp < code + code_size ? (int)((const char*)bcp - code) : -1;
+    }
+    return ids[num + 1];
+}
+
+NMethodCacheEntry CodeHeap::_nmethod_cache[1 << NMETHOD_CACHE_BITS];
+
 NMethod* CodeHeap::findNMethod(char* heap, const void* pc) {
     unsigned char* heap_start = *(unsigned char**)(heap + _code_heap_memory_offset + _vs_low_offset);
     unsigned char* segmap = *(unsigned char**)(heap + _code_heap_segmap_offset + _vs_low_offset);
     size_t idx = ((unsigned char*)pc - heap_start) >> _code_heap_segment_shift;
+    const void* segment = heap_start + (idx << _code_heap_segment_shift);
+
+    u64 h = (u64)(uintptr_t)segment * 0x9e3779b97f4a7c15ULL;
+    NMethodCacheEntry* e = &_nmethod_cache[h >> (64 - NMETHOD_CACHE_BITS)];
+    unsigned char* block = __atomic_load_n(&e->block, __ATOMIC_RELAXED);
+    if (block != NULL && __atomic_load_n(&e->segment, __ATOMIC_RELAXED) == segment &&
+        block >= heap_start && block <= segment) {
+        // Still the start of a used block, and the block still covers the segment
+        size_t block_idx = (block - heap_start) >> _code_heap_segment_shift;
+        if (segmap[block_idx] == 0 && block[sizeof(size_t)] && idx - block_idx < *(size_t*)block) {
+            return (NMethod*)(block + 2 * sizeof(size_t));
+        }
+    }
 
     if (segmap[idx] == 0xff) {
         return NULL;
@@ -442,8 +576,15 @@ NMethod* CodeHeap::findNMethod(char* heap, const void* pc) {
         idx -= segmap[idx];
     }
 
-    unsigned char* block = heap_start + (idx << _code_heap_segment_shift);
-    return block[sizeof(size_t)] ? (NMethod*)(block + 2 * sizeof(size_t)) : NULL;
+    block = heap_start + (idx << _code_heap_segment_shift);
+    if (!block[sizeof(size_t)]) {
+        return NULL;
+    }
+
+    // A torn entry only costs a miss, since a hit is checked against the block anyway
+    __atomic_store_n(&e->block, block, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->segment, segment, __ATOMIC_RELAXED);
+    return (NMethod*)(block + 2 * sizeof(size_t));
 }
 
 void* JVMFlag::find(const char* name) {
@@ -21,8 +21,11 @@
 #include <stdint.h>
 #include <string.h>
 #include "codeCache.h"
+#include "safeAccess.h"
 
 
+class VMThread;
+
 class VMStructs {
   protected:
     static CodeCache* _libjvm;
@@ -32,6 +35,7 @@ class VMStructs {
     static bool _has_class_loader_data;
     static bool _has_native_thread_id;
     static bool _has_perm_gen;
+    static bool _has_stack_structs;
 
     static int _klass_name_offset;
     static int _symbol_length_offset;
@@ -44,12 +48,17 @@ class VMStructs {
     static int _thread_osthread_offset;
     static int _thread_anchor_offset;
     static int _thread_state_offset;
+    static int _thread_threadobj_offset;
+    static int _thread_vthread_offset;
+    static int _thread_tid_offset;
     static int _osthread_id_offset;
     static int _anchor_sp_offset;
     static int _anchor_pc_offset;
     static int _frame_size_offset;
     static int _frame_complete_offset;
     static int _nmethod_name_offset;
+    static int _code_begin_offset;
+    static int _code_offset_offset;
     static int _nmethod_method_offset;
     static int _nmethod_entry_offset;
     static int _nmethod_state_offset;
@@ -58,6 +67,8 @@ class VMStructs {
     static int _method_code_offset;
     static int _constmethod_constants_offset;
     static int _constmethod_idnum_offset;
+    static int _constmethod_code_size_offset;
+    static int _constmethod_size;
     static int _pool_holder_offset;
     static int _array_data_offset;
     static int _code_heap_memory_offset;
@@ -79,6 +90,13 @@ class VMStructs {
     static const void** _code_heap_low_addr;
     static const void** _code_heap_high_addr;
     static int* _klass_offset_addr;
+    static char** _collected_heap_addr;
+    static volatile int* _safepoint_state_addr;
+    static int _collected_heap_reserved_offset;
+    static int _region_start_offset;
+    static int _region_size_offset;
+    static const void* _java_heap_low;
+    static const void* _java_heap_high;
 
     static jfieldID _eetop;
     static jfieldID _tid;
@@ -96,6 +114,7 @@ class VMStructs {
     static void initJvmFunctions();
     static void initTLS(void* vm_thread);
     static void initThreadBridge(JNIEnv* env);
+    static void initVirtualThreads(JNIEnv* env, jthread thread, VMThread* vm_thread);
     static void initLogging(JNIEnv* env);
 
     const char* at(int offset) {
@@ -122,10 +141,24 @@ class VMStructs {
         return _has_class_loader_data;
     }
 
+    // Everything StackWalker::walkVM reads
+    static bool hasStackStructs() {
+        return _has_stack_structs;
+    }
+
     static bool hasJavaThreadId() {
         return _tid != NULL;
     }
 
+    // SafepointSynchronize::_state: 0 not synchronized, 1 synchronizing, 2 synchronized
+    static bool hasSafepointState() {
+        return _safepoint_state_addr != NULL;
+    }
+
+    static int safepointState() {
+        return *_safepoint_state_addr;
+    }
+
     typedef jvmtiError (*GetStackTraceFunc)(void* self, void* thread,
                                             jint start_depth, jint max_frame_count,
                                             jvmtiFrameInfo* frame_buffer, jint* count_ptr);
@@ -264,6 +297,26 @@ class VMThread : VMStructs {
         return _thread_state_offset >= 0 ? *(int*) at(_thread_state_offset) : 0;
     }
 
+    // JDK 19+: both fields are OopHandles, and _vthread differs from _threadObj while a virtual thread is mounted
+    static bool hasVirtualThreads() {
+        return _thread_tid_offset >= 0;
+    }
+
+    // Java id of the virtual thread mounted on this carrier, 0 if none. Async signal safe:
+    // an oop moved by a concurrent GC pass reads as a stale copy or, when unmapped, as none.
+    jlong mountedVirtualThreadId() {
+        void** vthread = *(void***) at(_thread_vthread_offset);
+        void** carrier = *(void***) at(_thread_threadobj_offset);
+        if (vthread == NULL || carrier == NULL) {
+            return 0;
+        }
+        const char* vthread_oop = (const char*)SafeAccess::load(vthread);
+        if (vthread_oop == NULL || vthread_oop == SafeAccess::load(carrier)) {
+            return 0;
+        }
+        return (jlong)(uintptr_t)SafeAccess::load((void**)(vthread_oop + _thread_tid_offset));
+    }
+
     uintptr_t& lastJavaSP() {
         return *(uintptr_t*) (at(_thread_anchor_offset) + _anchor_sp_offset);
     }
@@ -291,6 +344,10 @@ class VMMethod : VMStructs {
     NMethod* code() {
         return *(NMethod**) at(_method_code_offset);
     }
+
+    // The method pointer may come from an arbitrary stack slot, so every step is a SafeAccess load.
+    // The bci of bcp is stored in bci, or -1 if bcp is not within the bytecodes of the method.
+    jmethodID checkedId(const void* bcp, int* bci);
 };
 
 class NMethod : VMStructs {
@@ -303,6 +360,19 @@ class NMethod : VMStructs {
         return *(int*) at(_frame_complete_offset);
     }
 
+    const char* codeBegin() {
+        if (_code_begin_offset >= 0) {
+            return *(const char**) at(_code_begin_offset);
+        }
+        return at(*(int*) at(_code_offset_offset));
+    }
+
+    // Past the prologue, the frame of the blob has its full size
+    bool isFrameCompleteAt(const void* pc) {
+        int offset = frameCompleteOffset();
+        return offset >= 0 && pc >= codeBegin() + offset;
+    }
+
     void setFrameCompleteOffset(int offset) {
         *(int*) at(_frame_complete_offset) = offset;
     }
@@ -321,6 +391,12 @@ class NMethod : VMStructs {
         return n != NULL && strcmp(n, "Interpreter") == 0;
     }
 
+    // call_stub, where the VM enters Java, lives in one of these
+    bool isStubRoutines() {
+        const char* n = name();
+        return n != NULL && strncmp(n, "StubRoutines", 12) == 0;
+    }
+
     VMMethod* method() {
         return *(VMMethod**) at(_nmethod_method_offset);
     }
@@ -342,8 +418,32 @@ class NMethod : VMStructs {
     }
 };
 
+// Address range reserved for the Java heap, whatever the collector
+class JavaHeap : VMStructs {
+  public:
+    static bool available() {
+        return _java_heap_high != NULL;
+    }
+
+    static bool contains(const void* addr) {
+        return _java_heap_low <= addr && addr < _java_heap_high;
+    }
+};
+
+// Blobs take whole segments of the code heap, so a segment always resolves to the same blob
+// until the blob is freed. A cached blob is checked against its heap block on every hit,
+// which catches blobs freed and reused with or without CompiledMethodUnload.
+const int NMETHOD_CACHE_BITS = 12;
+
+struct NMethodCacheEntry {
+    const void* segment;
+    unsigned char* block;
+};
+
 class CodeHeap : VMStructs {
   private:
+    static NMethodCacheEntry _nmethod_cache[1 << NMETHOD_CACHE_BITS];
+
     static bool contains(char* heap, const void* pc) {
         return heap != NULL &&
                pc >= *(const void**)(heap + _code_heap_memory_offset + _vs_low_offset) &&
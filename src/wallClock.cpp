@@ -14,10 +14,13 @@
  * limitations under the License.
  */
 
+#include <map>
+#include <queue>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include "wallClock.h"
+#include "profiledThread.h"
 #include "profiler.h"
 #include "stackFrame.h"
 
@@ -32,9 +35,27 @@ const int THREADS_PER_TICK = 8;
 // Smaller intervals are practically unusable due to large overhead.
 const long MIN_INTERVAL = 100000;
 
+// In wall clock mode, a thread is due one interval after its last sample, or IDLE_PERIODS
+// intervals if that sample found it sleeping. Signals are paced at THREADS_PER_TICK per
+// MIN_INTERVAL; after a longer sleep up to MAX_THREADS_PER_TICK due threads go at once.
+const int IDLE_PERIODS = 4;
+const int MAX_THREADS_PER_TICK = 4 * THREADS_PER_TICK;
+
+// How often the wall clock scheduler picks up new threads and forgets finished ones
+const long THREAD_REFRESH_INTERVAL = 100000000;
+
+struct WallThread {
+    u64 last_sample;
+    u64 deadline;
+    u32 seen;
+};
+
+typedef std::pair<u64, int> WallDeadline;
+
 
 long WallClock::_interval;
 bool WallClock::_sample_idle_threads;
+ThreadFilter WallClock::_idle_threads;
 
 ThreadState WallClock::getThreadState(void* ucontext) {
     StackFrame frame(ucontext);
@@ -58,17 +79,22 @@ ThreadState WallClock::getThreadState(void* ucontext) {
 }
 
 void WallClock::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
-    // ExecutionEvent event;
-    // event._thread_state = _sample_idle_threads ? getThreadState(ucontext) : THREAD_RUNNING;
-    // Profiler::instance()->recordSample(ucontext, _interval, 0, &event);
-    Profiler::instance()->printSample(ucontext, _interval);
-}
-
-long WallClock::adjustInterval(long interval, int thread_count) {
-    if (thread_count > THREADS_PER_TICK) {
-        interval /= (thread_count + THREADS_PER_TICK - 1) / THREADS_PER_TICK;
+    // The weight stays wall time; the CPU time used in it goes along with the sample
+    SampleEvent event;
+    event._cpu_time = ProfiledThread::cpuTimeDelta();
+    if (_sample_idle_threads) {
+        event._thread_state = getThreadState(ucontext);
+        if (event._thread_state == THREAD_SLEEPING) {
+            _idle_threads.add(OS::threadId());
+        } else {
+            _idle_threads.remove(OS::threadId());
+        }
+        // The scheduler sends the wall time since the previous sample of this thread
+        long weight = siginfo->si_code == SI_QUEUE ? (long)(intptr_t)siginfo->si_value.sival_ptr : _interval;
+        Profiler::instance()->printSample(ucontext, weight, &event);
+    } else {
+        Profiler::instance()->printSample(ucontext, _interval, &event);
     }
-    return interval;
 }
 
 Error WallClock::start(Arguments& args) {
@@ -81,6 +107,8 @@ Error WallClock::start(Arguments& args) {
     // Increase default interval for wall clock mode due to larger number of sampled threads
     _interval = args._interval ? args._interval : (_sample_idle_threads ? DEFAULT_INTERVAL * 5 : DEFAULT_INTERVAL);
 
+    _idle_threads.clear();
+    ProfiledThread::newCpuEpoch();
     OS::installSignalHandler(SIGVTALRM, signalHandler);
 
     _running = true;
@@ -99,13 +127,19 @@ void WallClock::stop() {
 }
 
 void WallClock::timerLoop() {
+    // A sampler never goes to the idle class: a starved timer would skew the profile
+    BackgroundScheduler::applyPolicy(false);
+    if (_sample_idle_threads) {
+        scheduleLoop();
+        return;
+    }
+
     int self = OS::threadId();
     ThreadFilter* thread_filter = Profiler::instance()->threadFilter();
     bool thread_filter_enabled = thread_filter->enabled();
-    bool sample_idle_threads = _sample_idle_threads;
 
-    ThreadList* thread_list = OS::listThreads();
-    long long next_cycle_time = OS::nanotime();
+    ThreadList* thread_list = Profiler::instance()->threadRegistry()->listThreads();
+    ThreadStateCache* thread_states = OS::threadStateCache();
 
     while (_running) {
         if (!_enabled) {
@@ -113,16 +147,11 @@ void WallClock::timerLoop() {
             continue;
         }
 
-        if (sample_idle_threads) {
-            // Try to keep the wall clock interval stable, regardless of the number of profiled threads
-            int estimated_thread_count = thread_filter_enabled ? thread_filter->size() : thread_list->size();
-            next_cycle_time += adjustInterval(_interval, estimated_thread_count);
-        }
-
         for (int count = 0; count < THREADS_PER_TICK; ) {
             int thread_id = thread_list->next();
             if (thread_id == -1) {
                 thread_list->rewind();
+                thread_states->sweep();
                 break;
             }
 
@@ -130,24 +159,114 @@ void WallClock::timerLoop() {
                 continue;
             }
 
-            if (sample_idle_threads || OS::threadState(thread_id) == THREAD_RUNNING) {
+            if (thread_states->get(thread_id) == THREAD_RUNNING) {
                 if (OS::sendSignalToThread(thread_id, SIGVTALRM)) {
                     count++;
                 }
             }
         }
 
-        if (sample_idle_threads) {
-            long long current_time = OS::nanotime();
-            if (next_cycle_time - current_time > MIN_INTERVAL) {
-                OS::sleep(next_cycle_time - current_time);
-            } else {
-                next_cycle_time = current_time + MIN_INTERVAL;
-                OS::sleep(MIN_INTERVAL);
-            }
-        } else {
+        OS::sleep(_interval);
+    }
+
+    delete thread_states;
+    delete thread_list;
+}
+
+// Wall clock threads are signaled earliest deadline first rather than round-robin,
+// so that the threads that run get sampled at the interval however many threads idle.
+// Every sample weighs the wall time since the previous sample of its thread, which keeps
+// the profile unbiased when idle threads are sampled less often or the budget runs short.
+void WallClock::scheduleLoop() {
+    int self = OS::threadId();
+    ThreadFilter* thread_filter = Profiler::instance()->threadFilter();
+    bool thread_filter_enabled = thread_filter->enabled();
+    ThreadList* thread_list = Profiler::instance()->threadRegistry()->listThreads();
+
+    std::map<int, WallThread> threads;
+    std::priority_queue<WallDeadline, std::vector<WallDeadline>, std::greater<WallDeadline> > queue;
+    u32 generation = 0;
+    u64 next_refresh = 0;
+    u64 last_tick = OS::nanotime();
+    long budget = THREADS_PER_TICK;
+
+    while (_running) {
+        if (!_enabled) {
+            // Time spent disabled must not count towards the next samples
+            threads.clear();
+            queue = std::priority_queue<WallDeadline, std::vector<WallDeadline>, std::greater<WallDeadline> >();
+            next_refresh = 0;
             OS::sleep(_interval);
+            continue;
+        }
+
+        u64 now = OS::nanotime();
+        long interval = _interval;
+
+        if (now >= next_refresh) {
+            generation++;
+            thread_list->rewind();
+            for (int thread_id; (thread_id = thread_list->next()) != -1; ) {
+                if (thread_id == self || (thread_filter_enabled && !thread_filter->accept(thread_id))) {
+                    continue;
+                }
+                std::map<int, WallThread>::iterator it = threads.find(thread_id);
+                if (it != threads.end()) {
+                    it->second.seen = generation;
+                } else {
+                    WallThread thread = {now - interval, now, generation};
+                    threads.insert(std::make_pair(thread_id, thread));
+                    queue.push(WallDeadline(now, thread_id));
+                }
+            }
+            for (std::map<int, WallThread>::iterator it = threads.begin(); it != threads.end(); ) {
+                if (it->second.seen != generation) {
+                    threads.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+            next_refresh = now + THREAD_REFRESH_INTERVAL;
+        }
+
+        budget += (long)((now - last_tick) * THREADS_PER_TICK / MIN_INTERVAL);
+        if (budget > MAX_THREADS_PER_TICK) budget = MAX_THREADS_PER_TICK;
+        last_tick = now;
+
+        while (budget > 0 && !queue.empty() && queue.top().first <= now) {
+            WallDeadline due = queue.top();
+            queue.pop();
+
+            // Entries of finished threads and of old deadlines are dropped on the way
+            std::map<int, WallThread>::iterator it = threads.find(due.second);
+            if (it == threads.end() || it->second.deadline != due.first) {
+                continue;
+            }
+            if (thread_filter_enabled && !thread_filter->accept(due.second)) {
+                threads.erase(it);
+                continue;
+            }
+
+            WallThread& thread = it->second;
+            if (!OS::sendSignalToThread(due.second, SIGVTALRM, (intptr_t)(now - thread.last_sample))) {
+                threads.erase(it);
+                continue;
+            }
+            budget--;
+            thread.last_sample = now;
+            thread.deadline = now + (_idle_threads.accept(due.second) ? (u64)interval * IDLE_PERIODS : (u64)interval);
+            queue.push(WallDeadline(thread.deadline, due.second));
+        }
+
+        u64 next = next_refresh;
+        if (!queue.empty() && queue.top().first < next) {
+            next = queue.top().first;
+        }
+        if (next > now + interval) {
+            next = now + interval;
         }
+        u64 current_time = OS::nanotime();
+        OS::sleep(next > current_time + MIN_INTERVAL ? next - current_time : MIN_INTERVAL);
     }
 
     delete thread_list;
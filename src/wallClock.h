@@ -22,17 +22,21 @@
 #include <pthread.h>
 #include "engine.h"
 #include "os.h"
+#include "threadFilter.h"
 
 
 class WallClock : public Engine {
   private:
     static long _interval;
     static bool _sample_idle_threads;
+    // Threads whose last wall clock sample found them sleeping in a syscall
+    static ThreadFilter _idle_threads;
 
     volatile bool _running;
     pthread_t _thread;
 
     void timerLoop();
+    void scheduleLoop();
 
     static void* threadEntry(void* wall_clock) {
         ((WallClock*)wall_clock)->timerLoop();
@@ -43,8 +47,6 @@ class WallClock : public Engine {
 
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
 
-    static long adjustInterval(long interval, int thread_count);
-
   public:
     const char* title() {
         return _sample_idle_threads ? "Wall clock profile" : "CPU profile";
@@ -56,6 +58,16 @@ class WallClock : public Engine {
 
     Error start(Arguments& args);
     void stop();
+
+    long interval() {
+        return _interval;
+    }
+
+    // Picked up by the timer loop at its next cycle
+    bool setInterval(long interval) {
+        _interval = interval;
+        return true;
+    }
 };
 
 #endif // _WALLCLOCK_H
@@ -0,0 +1,150 @@
+import java.io.BufferedReader;
+import java.io.FileReader;
+import java.io.IOException;
+import java.util.concurrent.atomic.AtomicLong;
+import java.util.concurrent.locks.LockSupport;
+import java.util.concurrent.locks.ReentrantLock;
+
+// Lock contention workload for lock-stress-test.sh.
+//     java LockStressTarget THREADS LOCKS HOLD_US WAIT_US SECONDS [reentrant|monitor|both]
+// Every thread picks a random one of LOCKS locks, holds it for HOLD_US microseconds
+// and then stays outside of any lock for WAIT_US. The time to acquire a lock is what
+// the profiler adds to with lock=..., since it hooks every contended park and monitor enter.
+// Prints one line of key=value pairs: acquisitions per second, acquire latency percentiles
+// and peak RSS.
+public class LockStressTarget {
+    private static final long WARMUP_NANOS = 1000000000L;
+
+    private static volatile long sink;
+    private static final AtomicLong acquisitions = new AtomicLong();
+
+    private static void spin(long nanos) {
+        long end = System.nanoTime() + nanos;
+        while (System.nanoTime() < end) {
+            sink++;
+        }
+    }
+
+    static class Worker extends Thread {
+        final ReentrantLock[] locks;
+        final Object[] monitors;
+        final String mode;
+        final long holdNanos;
+        final long waitNanos;
+        final long start;
+        final long end;
+        final OverheadTarget.Histogram histogram = new OverheadTarget.Histogram();
+
+        Worker(int index, ReentrantLock[] locks, Object[] monitors, String mode,
+               long holdNanos, long waitNanos, long start, long end) {
+            super("LockStress-" + index);
+            this.locks = locks;
+            this.monitors = monitors;
+            this.mode = mode;
+            this.holdNanos = holdNanos;
+            this.waitNanos = waitNanos;
+            this.start = start;
+            this.end = end;
+        }
+
+        @Override
+        public void run() {
+            long seed = getId() * 0x9e3779b97f4a7c15L;
+            int i = 0;
+            long now;
+            while ((now = System.nanoTime()) < end) {
+                seed ^= seed << 13;
+                seed ^= seed >>> 7;
+                seed ^= seed << 17;
+                int index = (int) ((seed >>> 1) % locks.length);
+                boolean monitor = mode.equals("monitor") || (mode.equals("both") && (i++ & 1) != 0);
+
+                long acquired;
+                if (monitor) {
+                    synchronized (monitors[index]) {
+                        acquired = System.nanoTime();
+                        spin(holdNanos);
+                    }
+                } else {
+                    locks[index].lock();
+                    try {
+                        acquired = System.nanoTime();
+                        spin(holdNanos);
+                    } finally {
+                        locks[index].unlock();
+                    }
+                }
+
+                if (now >= start) {
+                    histogram.add(acquired - now);
+                    acquisitions.incrementAndGet();
+                }
+                if (waitNanos > 0) {
+                    LockSupport.parkNanos(waitNanos);
+                }
+            }
+        }
+    }
+
+    private static long peakRssKb() {
+        try {
+            BufferedReader reader = new BufferedReader(new FileReader("/proc/self/status"));
+            try {
+                for (String line; (line = reader.readLine()) != null; ) {
+                    if (line.startsWith("VmHWM:")) {
+                        return Long.parseLong(line.replaceAll("[^0-9]", ""));
+                    }
+                }
+            } finally {
+                reader.close();
+            }
+        } catch (IOException e) {
+            // Not Linux
+        }
+        return 0;
+    }
+
+    public static void main(String[] args) throws Exception {
+        if (args.length < 5) {
+            System.err.println("Usage: java LockStressTarget THREADS LOCKS HOLD_US WAIT_US SECONDS [reentrant|monitor|both]");
+            System.exit(1);
+        }
+        int threads = Integer.parseInt(args[0]);
+        int lockCount = Integer.parseInt(args[1]);
+        long holdNanos = Long.parseLong(args[2]) * 1000;
+        long waitNanos = Long.parseLong(args[3]) * 1000;
+        int seconds = Integer.parseInt(args[4]);
+        String mode = args.length > 5 ? args[5] : "both";
+
+        ReentrantLock[] locks = new ReentrantLock[lockCount];
+        Object[] monitors = new Object[lockCount];
+        for (int i = 0; i < lockCount; i++) {
+            locks[i] = new ReentrantLock();
+            monitors[i] = new Object();
+        }
+
+        long start = System.nanoTime() + WARMUP_NANOS;
+        long end = start + seconds * 1000000000L;
+        Worker[] workers = new Worker[threads];
+        for (int i = 0; i < threads; i++) {
+            workers[i] = new Worker(i, locks, monitors, mode, holdNanos, waitNanos, start, end);
+            workers[i].start();
+        }
+
+        OverheadTarget.Histogram histogram = new OverheadTarget.Histogram();
+        for (Worker worker : workers) {
+            worker.join();
+            histogram.merge(worker.histogram);
+        }
+
+        long ops = acquisitions.get();
+        System.out.println("mode=" + mode +
+                " threads=" + threads +
+                " locks=" + lockCount +
+                " acquisitions=" + ops +
+                " acquisitions_per_sec=" + (ops / seconds) +
+                " p50_ns=" + histogram.percentile(50) +
+                " p99_ns=" + histogram.percentile(99) +
+                " rss_kb=" + peakRssKb());
+    }
+}
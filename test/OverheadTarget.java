@@ -0,0 +1,242 @@
+import java.io.BufferedReader;
+import java.io.File;
+import java.io.FileReader;
+import java.io.IOException;
+import java.lang.management.ManagementFactory;
+import java.lang.management.ThreadInfo;
+import java.lang.management.ThreadMXBean;
+import java.math.BigInteger;
+import java.util.concurrent.atomic.AtomicLong;
+import java.util.concurrent.locks.ReentrantLock;
+
+// Throughput workload for overhead-test.sh.
+//     java OverheadTarget WORKLOAD SECONDS THREADS
+// WORKLOAD is one of
+//     mixed   - the loops of Target plus small allocations
+//     threads - short-lived threads like ThreadsTarget, one per operation
+//     lock    - all threads contend on one monitor and one ReentrantLock
+// After a warm-up second, every thread runs operations for SECONDS and times each one.
+// Prints one line of key=value pairs: throughput, latency percentiles, CPU time of the
+// whole process and of the profiler's own Java-visible threads, and peak RSS.
+public class OverheadTarget {
+    private static final long WARMUP_NANOS = 1000000000L;
+
+    private static volatile int value;
+    private static volatile Object sink;
+    private static final Object monitor = new Object();
+    private static final ReentrantLock lock = new ReentrantLock();
+    private static final AtomicLong operations = new AtomicLong();
+
+    private static void mixedOperation() {
+        for (int i = 0; i < 100000; ++i)
+            ++value;
+        for (int i = 0; i < 10; ++i)
+            sink = new int[64 + (i & 7) * 32];
+        String[] files = new File("/tmp").list();
+        if (files != null) {
+            for (String s : files) {
+                value += s.hashCode();
+            }
+        }
+    }
+
+    private static void threadsOperation() throws InterruptedException {
+        Thread t = new Thread(new Runnable() {
+            @Override
+            public void run() {
+                BigInteger counter = BigInteger.valueOf(value & 0xffff);
+                for (int i = 0; i < 20; i++) {
+                    counter = counter.nextProbablePrime();
+                }
+                sink = counter;
+            }
+        }, "OverheadTarget-short");
+        t.start();
+        t.join();
+    }
+
+    private static void lockOperation() {
+        for (int i = 0; i < 100; i++) {
+            synchronized (monitor) {
+                for (int j = 0; j < 200; j++)
+                    ++value;
+            }
+            lock.lock();
+            try {
+                for (int j = 0; j < 200; j++)
+                    ++value;
+            } finally {
+                lock.unlock();
+            }
+        }
+    }
+
+    // Log-linear histogram of nanoseconds: 16 sub-buckets per power of two
+    static class Histogram {
+        final long[] counts = new long[64 * 16];
+
+        static int bucket(long v) {
+            if (v < 16) return (int) v;
+            int e = 63 - Long.numberOfLeadingZeros(v);
+            return (e - 3) * 16 + (int) ((v >>> (e - 4)) & 15);
+        }
+
+        static long lowerBound(int bucket) {
+            if (bucket < 16) return bucket;
+            int e = bucket / 16 + 3;
+            return (1L << e) | ((long) (bucket & 15) << (e - 4));
+        }
+
+        void add(long v) {
+            counts[bucket(v)]++;
+        }
+
+        void merge(Histogram other) {
+            for (int i = 0; i < counts.length; i++) {
+                counts[i] += other.counts[i];
+            }
+        }
+
+        long percentile(double p) {
+            long total = 0;
+            for (long c : counts) total += c;
+            long target = (long) Math.ceil(total * p / 100);
+            long seen = 0;
+            for (int i = 0; i < counts.length; i++) {
+                seen += counts[i];
+                if (seen >= target && seen > 0) return lowerBound(i);
+            }
+            return 0;
+        }
+    }
+
+    static class Worker extends Thread {
+        final String workload;
+        final long start;
+        final long end;
+        final Histogram histogram = new Histogram();
+
+        Worker(String workload, long start, long end, int index) {
+            super("OverheadTarget-" + index);
+            this.workload = workload;
+            this.start = start;
+            this.end = end;
+        }
+
+        @Override
+        public void run() {
+            try {
+                long now;
+                while ((now = System.nanoTime()) < end) {
+                    if (workload.equals("mixed")) {
+                        mixedOperation();
+                    } else if (workload.equals("threads")) {
+                        threadsOperation();
+                    } else {
+                        lockOperation();
+                    }
+                    if (now >= start) {
+                        histogram.add(System.nanoTime() - now);
+                        operations.incrementAndGet();
+                    }
+                }
+            } catch (InterruptedException e) {
+                // Stop early
+            }
+        }
+    }
+
+    private static long clockTicks() {
+        return Long.getLong("clk.tck", 100);
+    }
+
+    // utime + stime of a /proc stat file in ms; the command may contain spaces
+    private static long cpuMillis(File stat) {
+        String line = readLine(stat);
+        if (line == null) return 0;
+        String[] fields = line.substring(line.lastIndexOf(')') + 2).split(" ");
+        return (Long.parseLong(fields[11]) + Long.parseLong(fields[12])) * 1000 / clockTicks();
+    }
+
+    // The profiler threads attached to the VM (collector, reporters). Signal handlers run
+    // on the sampled threads and the timer threads are not visible to the VM; their time
+    // shows in cpu_ms and in the throughput loss instead.
+    private static long agentCpuMillis() {
+        ThreadMXBean bean = ManagementFactory.getThreadMXBean();
+        long total = 0;
+        for (ThreadInfo info : bean.getThreadInfo(bean.getAllThreadIds())) {
+            if (info != null && (info.getThreadName().startsWith("AsyncProfiler") ||
+                                 info.getThreadName().startsWith("Async-profiler"))) {
+                long nanos = bean.getThreadCpuTime(info.getThreadId());
+                if (nanos > 0) total += nanos / 1000000;
+            }
+        }
+        return total;
+    }
+
+    private static long peakRssKb() {
+        try {
+            BufferedReader reader = new BufferedReader(new FileReader("/proc/self/status"));
+            try {
+                for (String line; (line = reader.readLine()) != null; ) {
+                    if (line.startsWith("VmHWM:")) {
+                        return Long.parseLong(line.replaceAll("[^0-9]", ""));
+                    }
+                }
+            } finally {
+                reader.close();
+            }
+        } catch (IOException e) {
+            // Not Linux
+        }
+        return 0;
+    }
+
+    private static String readLine(File file) {
+        try {
+            BufferedReader reader = new BufferedReader(new FileReader(file));
+            try {
+                return reader.readLine();
+            } finally {
+                reader.close();
+            }
+        } catch (IOException e) {
+            return null;
+        }
+    }
+
+    public static void main(String[] args) throws Exception {
+        String workload = args.length > 0 ? args[0] : "mixed";
+        int seconds = args.length > 1 ? Integer.parseInt(args[1]) : 10;
+        int threads = args.length > 2 ? Integer.parseInt(args[2]) : Runtime.getRuntime().availableProcessors();
+        if (!workload.equals("mixed") && !workload.equals("threads") && !workload.equals("lock")) {
+            System.err.println("Unknown workload: " + workload);
+            System.exit(1);
+        }
+
+        long start = System.nanoTime() + WARMUP_NANOS;
+        long end = start + seconds * 1000000000L;
+        Worker[] workers = new Worker[threads];
+        for (int i = 0; i < threads; i++) {
+            workers[i] = new Worker(workload, start, end, i);
+            workers[i].start();
+        }
+
+        Histogram histogram = new Histogram();
+        for (Worker worker : workers) {
+            worker.join();
+            histogram.merge(worker.histogram);
+        }
+
+        long ops = operations.get();
+        System.out.println("workload=" + workload +
+                " threads=" + threads +
+                " ops=" + ops +
+                " ops_per_sec=" + (ops / seconds) +
+                " p50_us=" + histogram.percentile(50) / 1000 +
+                " p99_us=" + histogram.percentile(99) / 1000 +
+                " cpu_ms=" + cpuMillis(new File("/proc/self/stat")) +
+                " agent_cpu_ms=" + agentCpuMillis() +
+                " rss_kb=" + peakRssKb());
+    }
+}
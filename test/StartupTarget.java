@@ -0,0 +1,31 @@
+import java.io.BufferedReader;
+import java.io.FileReader;
+import java.io.IOException;
+
+// Workload for startup-test.sh: does nothing but report its peak RSS and exit,
+// so the run time is the JVM startup and shutdown.
+//     java StartupTarget
+public class StartupTarget {
+
+    private static long peakRssKb() {
+        try {
+            BufferedReader reader = new BufferedReader(new FileReader("/proc/self/status"));
+            try {
+                for (String line; (line = reader.readLine()) != null; ) {
+                    if (line.startsWith("VmHWM:")) {
+                        return Long.parseLong(line.replaceAll("[^0-9]", ""));
+                    }
+                }
+            } finally {
+                reader.close();
+            }
+        } catch (IOException e) {
+            // Not Linux
+        }
+        return 0;
+    }
+
+    public static void main(String[] args) {
+        System.out.println("rss_kb=" + peakRssKb());
+    }
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright 2022 The Kindling Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Microbenchmarks of the core data structures (make bench).
+// Compiled after all of src/*.cpp in one translation unit, so that classes
+// private to a source file, such as the JFR Buffer, can be measured as well.
+// Every result is one JSON object per line:
+//     {"bench":"...","params":"...","threads":N,"ops":N,"ns_per_op":X[,more fields]}
+// Usage: bench [substring of the benchmark names to run]
+// Benchmarks that also check their results make bench exit with 1 on a mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+
+static const char* _filter = NULL;
+static bool _failed = false;
+
+static bool selected(const char* name) {
+    return _filter == NULL || strstr(name, _filter) != NULL;
+}
+
+// extra, if any, is appended to the object as is, e.g. "\"events\":10"
+static void report(const char* name, const char* params, int threads, u64 ops, u64 ns, const char* extra = NULL) {
+    printf("{\"bench\":\"%s\",\"params\":\"%s\",\"threads\":%d,\"ops\":%llu,\"ns_per_op\":%.2f%s%s}\n",
+           name, params, threads, (unsigned long long)ops, ops == 0 ? 0.0 : (double)ns / ops,
+           extra != NULL ? "," : "", extra != NULL ? extra : "");
+    fflush(stdout);
+}
+
+// xorshift, so that the generator costs next to nothing compared with the measured code
+static inline u64 nextRandom(u64& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Frames reuse a fixed set of native symbols; the stack shape comes from the seed
+static char** _symbols = NULL;
+static const int SYMBOL_COUNT = 4096;
+
+static void initSymbols() {
+    _symbols = new char*[SYMBOL_COUNT];
+    for (int i = 0; i < SYMBOL_COUNT; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "_ZN9benchmark6symbolILi%dEE4callEv", i);
+        _symbols[i] = NativeFunc::create(name, -1);
+    }
+}
+
+static void makeStack(ASGCT_CallFrame* frames, int depth, u64 seed) {
+    for (int i = 0; i < depth; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        frames[i].bci = BCI_NATIVE_FRAME;
+        frames[i].method_id = (jmethodID)_symbols[(seed >> 33) % SYMBOL_COUNT];
+    }
+}
+
+static void benchCallTraceStorage() {
+    if (!selected("callTraceStorage.put")) return;
+
+    const int depths[] = {8, 64, 256};
+    const int unique_pct[] = {1, 100};
+    const int ops = 200000;
+    ASGCT_CallFrame frames[256];
+
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        for (size_t u = 0; u < sizeof(unique_pct) / sizeof(unique_pct[0]); u++) {
+            CallTraceStorage storage;
+            u64 distinct = (u64)ops * unique_pct[u] / 100;
+            u64 rnd = 88172645463325252ULL;
+
+            u64 start = OS::nanotime();
+            for (int i = 0; i < ops; i++) {
+                makeStack(frames, depths[d], nextRandom(rnd) % distinct);
+                storage.put(depths[d], frames, 1);
+            }
+            u64 ns = OS::nanotime() - start;
+
+            char params[64];
+            snprintf(params, sizeof(params), "depth=%d,unique=%d%%", depths[d], unique_pct[u]);
+            report("callTraceStorage.put", params, 1, ops, ns);
+        }
+    }
+}
+
+static void benchDictionary() {
+    if (!selected("dictionary.lookup")) return;
+
+    const int keys = 100000;
+    std::vector<std::string> names(keys);
+    for (int i = 0; i < keys; i++) {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "Ljava/util/concurrent/ConcurrentHashMap$Node%d;", i);
+        names[i] = buf;
+    }
+
+    Dictionary dict;
+    u64 start = OS::nanotime();
+    for (int i = 0; i < keys; i++) {
+        dict.lookup(names[i].c_str());
+    }
+    report("dictionary.lookup", "new", 1, keys, OS::nanotime() - start);
+
+    const int ops = 1000000;
+    u64 rnd = 2463534242ULL;
+    start = OS::nanotime();
+    for (int i = 0; i < ops; i++) {
+        dict.lookup(names[nextRandom(rnd) % keys].c_str());
+    }
+    report("dictionary.lookup", "existing", 1, ops, OS::nanotime() - start);
+}
+
+static void benchLinearAllocator() {
+    if (!selected("linearAllocator.alloc")) return;
+
+    const int thread_counts[] = {1, 2, 4, 8};
+    const int ops = 1000000;
+
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        int threads = thread_counts[t];
+        LinearAllocator allocator(8 * 1024 * 1024, MEMORY_CALL_TRACES);
+        std::vector<std::thread> workers;
+
+        u64 start = OS::nanotime();
+        for (int i = 0; i < threads; i++) {
+            workers.push_back(std::thread([&allocator, i] {
+                u64 rnd = 0x9e3779b97f4a7c15ULL + i;
+                for (int j = 0; j < ops; j++) {
+                    allocator.alloc(16 + (nextRandom(rnd) & 0xf0));
+                }
+            }));
+        }
+        for (int i = 0; i < threads; i++) {
+            workers[i].join();
+        }
+        report("linearAllocator.alloc", "size=16..256", threads, (u64)ops * threads, OS::nanotime() - start);
+    }
+}
+
+static void benchCodeCache() {
+    if (!selected("codeCache.binarySearch")) return;
+
+    const int blobs = 100000;
+    const int ops = 2000000;
+    const uintptr_t base = 0x100000;
+    CodeCache cc("bench");
+    for (int i = 0; i < blobs; i++) {
+        cc.add((const void*)(base + (uintptr_t)i * 64), 48, _symbols[i % SYMBOL_COUNT]);
+    }
+    cc.sort();
+
+    u64 rnd = 1181783497276652981ULL;
+    volatile uintptr_t sink = 0;
+    u64 start = OS::nanotime();
+    for (int i = 0; i < ops; i++) {
+        sink += (uintptr_t)cc.binarySearch((const void*)(base + nextRandom(rnd) % ((uintptr_t)blobs * 64)));
+    }
+    report("codeCache.binarySearch", "blobs=100000", 1, ops, OS::nanotime() - start);
+}
+
+static void benchJfrBuffer() {
+    if (!selected("jfrBuffer.putVar")) return;
+
+    const int ops = 10000000;
+    Buffer* buf = new Buffer();
+    const int limit = BUFFER_SIZE - sizeof(int) - 64;
+    // Mostly small values, like ids and deltas in real recordings
+    const int bits[] = {7, 14, 32, 64};
+
+    for (size_t b = 0; b < sizeof(bits) / sizeof(bits[0]); b++) {
+        u64 mask = bits[b] == 64 ? ~0ULL : (1ULL << bits[b]) - 1;
+        u64 rnd = 0x2545f4914f6cdd1dULL;
+        char params[32];
+
+        u64 start;
+        if (bits[b] <= 32) {
+            start = OS::nanotime();
+            for (int i = 0; i < ops; i++) {
+                if (buf->offset() > limit) buf->reset();
+                buf->putVar32((u32)(nextRandom(rnd) & mask));
+            }
+            snprintf(params, sizeof(params), "putVar32,bits=%d", bits[b]);
+            report("jfrBuffer.putVar", params, 1, ops, OS::nanotime() - start);
+        }
+
+        buf->reset();
+        start = OS::nanotime();
+        for (int i = 0; i < ops; i++) {
+            if (buf->offset() > limit) buf->reset();
+            buf->putVar64(nextRandom(rnd) & mask);
+        }
+        snprintf(params, sizeof(params), "putVar64,bits=%d", bits[b]);
+        report("jfrBuffer.putVar", params, 1, ops, OS::nanotime() - start);
+    }
+    delete buf;
+}
+
+static void benchFrameEventCache() {
+    if (!selected("frameEventCache")) return;
+
+    const int capacity = 8192;
+    const int depth = 64;
+    const int traces = 512;
+    const int rounds = 50;
+
+    Arguments args;
+    Mutex names_lock;
+    ThreadMap names;
+    FrameName fn(args, 0, 0, names_lock, names);
+    CallTraceStorage storage;
+    FrameEventCache cache(16, storage);
+    cache.init(capacity, depth, false);
+
+    ASGCT_CallFrame frames[depth];
+    std::vector<u32> ids(traces);
+    for (int i = 0; i < traces; i++) {
+        makeStack(frames, depth, i);
+        ids[i] = storage.put(depth, frames, 1);
+    }
+
+    u64 add_ns = 0, collect_ns = 0, events = 0;
+    for (int r = 0; r < rounds; r++) {
+        u64 start = OS::nanotime();
+        for (int i = 0; i < capacity / 2; i++) {
+            cache.add(i & 15, 1000 + (i & 255), ids[i % traces], NULL);
+        }
+        add_ns += OS::nanotime() - start;
+        events += capacity / 2;
+
+        start = OS::nanotime();
+        cache.collect(&fn);
+        collect_ns += OS::nanotime() - start;
+    }
+    report("frameEventCache.add", "slots=16", 1, events, add_ns);
+    report("frameEventCache.collect", "depth=64,format=text,per_event", 1, events, collect_ns);
+}
+
+static void benchEventLogger() {
+    if (!selected("eventLogger.log")) return;
+
+    const int ops = 500000;
+
+    u64 start = OS::nanotime();
+    for (int i = 0; i < ops; i++) {
+        EventLogger::log("kd-agg@%d!%u!%llu!%llu!%llu!", i & 1023, (u32)i, 1ULL, (u64)i, (u64)i + 1);
+    }
+    report("eventLogger.log", "sync", 1, ops, OS::nanotime() - start);
+
+    const bool compress[] = {false, true};
+    for (int c = 0; c < 2; c++) {
+        EventLogger::startWriter(compress[c]);
+        start = OS::nanotime();
+        for (int i = 0; i < ops; i++) {
+            EventLogger::log("kd-agg@%d!%u!%llu!%llu!%llu!", i & 1023, (u32)i, 1ULL, (u64)i, (u64)i + 1);
+        }
+        u64 ns = OS::nanotime() - start;
+        u64 dropped = EventLogger::dropped();
+        EventLogger::close();
+        EventLogger::open("/dev/null");
+
+        char params[64];
+        snprintf(params, sizeof(params), "%s,dropped=%llu", compress[c] ? "kdcompress" : "kdasync", (unsigned long long)dropped);
+        report("eventLogger.log", params, 1, ops, ns);
+    }
+    EventLogger::close();
+}
+
+// Minimal reader of kdcompress frames: checks the header and the checksum and
+// expands the payload into dst, which holds raw_length bytes. Returns the raw length or -1
+static long decodeFrame(const char* frame, u32 frame_len, char* dst, u32 capacity) {
+    if (frame_len < KD_FRAME_HEADER || read32(frame) != KD_FRAME_MAGIC) return -1;
+    u32 raw_len = read32(frame + 8);
+    u32 length = read32(frame + 12);
+    u32 payload_len = length & ~KD_FRAME_STORED;
+    const u8* ip = (const u8*)frame + KD_FRAME_HEADER;
+    const u8* ip_end = ip + payload_len;
+    if (raw_len > capacity || KD_FRAME_HEADER + payload_len != frame_len) return -1;
+
+    u32 checksum = 2166136261U;
+    for (const u8* p = ip; p < ip_end; p++) {
+        checksum = (checksum ^ *p) * 16777619;
+    }
+    if (checksum != read32(frame + 16)) return -1;
+
+    if (length & KD_FRAME_STORED) {
+        if (payload_len != raw_len) return -1;
+        memcpy(dst, ip, raw_len);
+        return raw_len;
+    }
+
+    char* op = dst;
+    char* op_end = dst + raw_len;
+    while (ip < ip_end) {
+        u32 token = *ip++;
+        u32 literal_len = token >> 4;
+        if (literal_len == 15) {
+            u32 b;
+            do {
+                if (ip >= ip_end) return -1;
+                literal_len += (b = *ip++);
+            } while (b == 255);
+        }
+        if ((u32)(ip_end - ip) < literal_len || (u32)(op_end - op) < literal_len) return -1;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == ip_end) break;  // the last sequence has no match
+
+        if (ip_end - ip < 2) return -1;
+        u32 offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        u32 match_len = (token & 15) + LZ4_MIN_MATCH;
+        if ((token & 15) == 15) {
+            u32 b;
+            do {
+                if (ip >= ip_end) return -1;
+                match_len += (b = *ip++);
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > (u32)(op - dst) || (u32)(op_end - op) < match_len) return -1;
+        // Byte by byte: the match may overlap the bytes it produces
+        for (const char* ref = op - offset; match_len > 0; match_len--) {
+            *op++ = *ref++;
+        }
+    }
+    return op == op_end ? raw_len : -1;
+}
+
+// One op encodes a batch of kdcompress output. Every frame is decoded back and compared
+// with its batch, both for Kindling-like records and for random bytes that go out stored
+static void benchLz4Frame() {
+    if (!selected("lz4Frame.encode")) return;
+
+    const u32 batch = 64 * 1024;
+    const int ops = 2000;
+    char* data = (char*)malloc(batch);
+    char* decoded = (char*)malloc(batch);
+    FrameEncoder encoder(batch);
+
+    for (int kind = 0; kind < 2; kind++) {
+        u64 rnd = 0x853c49e6748fea9bULL;
+        u32 len = 0;
+        if (kind == 0) {
+            for (int i = 0; len + 128 < batch; i++) {
+                len += snprintf(data + len, batch - len, "kd-agg@%d!%u!%llu!%llu!%llu!\n",
+                                (int)(nextRandom(rnd) & 1023), (u32)i, 1ULL, (u64)i * 7919, (u64)i * 7919 + 1);
+            }
+        } else {
+            for (; len < batch; len++) {
+                data[len] = (char)nextRandom(rnd);
+            }
+        }
+
+        u64 frame_bytes = 0;
+        u64 ns = 0;
+        for (int i = 0; i < ops; i++) {
+            // Shorter batches too, down to empty ones and ones without room for a match
+            u32 n = i == 0 ? 0 : i < 16 ? i : len - (u32)(nextRandom(rnd) % (len / 2));
+            u32 frame_len;
+            u64 start = OS::nanotime();
+            const char* frame = encoder.encode(data, n, frame_len);
+            ns += OS::nanotime() - start;
+            frame_bytes += frame_len;
+
+            if (decodeFrame(frame, frame_len, decoded, batch) != (long)n || memcmp(decoded, data, n) != 0) {
+                fprintf(stderr, "lz4Frame.encode: %s batch of %u bytes does not decode back\n",
+                        kind == 0 ? "records" : "random", n);
+                _failed = true;
+                break;
+            }
+        }
+
+        char extra[64];
+        snprintf(extra, sizeof(extra), "\"frame_bytes\":%llu", (unsigned long long)frame_bytes);
+        report("lz4Frame.encode", kind == 0 ? "records,batch=64k" : "random,batch=64k", 1, ops, ns, extra);
+    }
+
+    free(decoded);
+    free(data);
+}
+
+// One op is a wait and a wake of the Kindling lock path, as LockTracer reports them
+// for a contended park or monitor enter. Waits are spread over the given number of locks.
+// threshold=0 reports every wait, so the event pools and the flusher are measured too.
+static void benchLockRecorder() {
+    if (!selected("lockRecorder.wait")) return;
+
+    const int thread_counts[] = {1, 8, 64, 512};
+    const int lock_counts[] = {16, 4096};
+    const jlong thresholds[] = {DEFAULT_LOCK_THRESHOLD, 0};
+    const int total_ops = 1000000;
+
+    for (size_t l = 0; l < sizeof(lock_counts) / sizeof(lock_counts[0]); l++) {
+        for (size_t th = 0; th < sizeof(thresholds) / sizeof(thresholds[0]); th++) {
+            for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+                int threads = thread_counts[t];
+                int locks = lock_counts[l];
+                int ops = total_ops / threads;
+                LockRecorder* recorder = new LockRecorder();
+                recorder->setup(thresholds[th], 0, 0);
+
+                volatile bool running = true;
+                std::thread flusher([recorder, &running] {
+                    while (running) {
+                        recorder->flushEvents();
+                        recorder->clearLockedThread();
+                        std::this_thread::sleep_for(std::chrono::milliseconds(LOCK_FLUSH_INTERVAL_MS));
+                    }
+                    recorder->flushEvents();
+                });
+
+                volatile u64 events = 0;
+                std::vector<std::thread> workers;
+                u64 start = OS::nanotime();
+                for (int i = 0; i < threads; i++) {
+                    workers.push_back(std::thread([recorder, &events, ops, locks, i] {
+                        jint tid = 100000 + i;
+                        u64 rnd = 0x9e3779b97f4a7c15ULL + i;
+                        u64 recorded = 0;
+                        for (int j = 0; j < ops; j++) {
+                            uintptr_t address = 0x7f0000000000ULL + (nextRandom(rnd) % locks) * 64;
+                            recorder->updateWaitLockThread(address, tid, KdClock::now(), true);
+                            LockWaitEvent* event = recorder->updateWakeThread(address, tid, KdClock::now());
+                            if (event != NULL) {
+                                event->describe("bench", tid, "UnsafePark", "Ljava/util/concurrent/locks/ReentrantLock");
+                                recorder->record(event);
+                                recorded++;
+                            }
+                        }
+                        atomicInc(events, recorded);
+                    }));
+                }
+                for (int i = 0; i < threads; i++) {
+                    workers[i].join();
+                }
+                u64 ns = OS::nanotime() - start;
+                running = false;
+                flusher.join();
+
+                char params[64];
+                char extra[160];
+                snprintf(params, sizeof(params), "locks=%d,threshold=%s", locks, thresholds[th] == 0 ? "0" : "default");
+                snprintf(extra, sizeof(extra), "\"events_per_sec\":%.0f,\"memory_kb\":%llu",
+                         ns == 0 ? 0.0 : events * 1e9 / ns,
+                         (unsigned long long)((sizeof(LockRecorder) + LOCK_TABLE_SHARDS * sizeof(LockShard) +
+                                               MemoryBudget::used(MEMORY_LOCK_EVENTS)) / 1024));
+                report("lockRecorder.wait", params, threads, (u64)ops * threads, ns, extra);
+                delete recorder;
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        _filter = argv[1];
+    }
+    initSymbols();
+    // Kindling records of the collect benchmark must not mix with the results
+    EventLogger::open("/dev/null");
+
+    benchCallTraceStorage();
+    benchDictionary();
+    benchLinearAllocator();
+    benchCodeCache();
+    benchJfrBuffer();
+    benchFrameEventCache();
+    benchEventLogger();
+    benchLz4Frame();
+    benchLockRecorder();
+    return _failed ? 1 : 0;
+}
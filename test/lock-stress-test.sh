@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# Cost of the Kindling lock path on LockStressTarget as the number of threads grows.
+# For every thread count the target runs without the agent, with lock (default threshold,
+# mostly the wait/wake tables) and with lock=1 (every contended wait becomes an event;
+# lock=0 means the default threshold).
+# Each run prints a JSON line with the acquire latency added per lock operation.
+# The LockRecorder side alone, with events/s and memory, is measured by make bench BENCH=lockRecorder.
+#
+#     THREAD_COUNTS="8 64 512" LOCKS=16 HOLD_US=5 WAIT_US=50 DURATION=10 test/lock-stress-test.sh
+
+set -e  # exit on any failure
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+THREAD_COUNTS=${THREAD_COUNTS:-"8 64 512"}
+LOCKS=${LOCKS:-16}
+HOLD_US=${HOLD_US:-5}
+WAIT_US=${WAIT_US:-50}
+DURATION=${DURATION:-10}
+LOCK_MODE=${LOCK_MODE:-both}
+
+(
+  cd $(dirname $0)
+
+  if [ "LockStressTarget.class" -ot "LockStressTarget.java" ] || [ "OverheadTarget.class" -ot "OverheadTarget.java" ]; then
+     ${JAVA_HOME}/bin/javac LockStressTarget.java OverheadTarget.java
+  fi
+
+  AGENT=$(pwd)/../build/libasyncProfiler.so
+
+  # Sets r_acquisitions_per_sec, r_p50_ns, r_p99_ns, r_rss_kb from the target output
+  function run_target() {
+    local line
+    line=$(${JAVA_HOME}/bin/java $1 LockStressTarget $2 $LOCKS $HOLD_US $WAIT_US $DURATION $LOCK_MODE | tail -1)
+    for kv in $line; do
+      eval "r_${kv%%=*}=${kv#*=}"
+    done
+  }
+
+  function report() {
+    awk -v mode=$1 -v threads=$2 -v locks=$LOCKS -v ops=$r_acquisitions_per_sec \
+        -v p50=$r_p50_ns -v p99=$r_p99_ns -v rss=$r_rss_kb \
+        -v base_ops=$base_ops -v base_p50=$base_p50 -v base_p99=$base_p99 -v base_rss=$base_rss 'BEGIN {
+      loss = base_ops > 0 ? (base_ops - ops) * 100 / base_ops : 0
+      printf "{\"mode\":\"%s\",\"threads\":%d,\"locks\":%d,\"acquisitions_per_sec\":%d,\"throughput_loss_pct\":%.2f,", mode, threads, locks, ops, loss
+      printf "\"p50_ns\":%d,\"p50_delta_ns\":%d,\"p99_ns\":%d,\"p99_delta_ns\":%d,", p50, p50 - base_p50, p99, p99 - base_p99
+      printf "\"rss_kb\":%d,\"rss_delta_kb\":%d}\n", rss, rss - base_rss
+    }'
+  }
+
+  for threads in $THREAD_COUNTS; do
+    run_target "" $threads
+    base_ops=$r_acquisitions_per_sec
+    base_p50=$r_p50_ns
+    base_p99=$r_p99_ns
+    base_rss=$r_rss_kb
+    report none $threads
+
+    run_target "-agentpath:$AGENT=start,lock" $threads
+    report lock $threads
+
+    run_target "-agentpath:$AGENT=start,lock=1" $threads
+    report lock=1 $threads
+  done
+)
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# Overhead of each profiling mode on the OverheadTarget workloads.
+# Every workload runs once without the agent and once per mode; each run prints a JSON line
+# with its throughput, latency, CPU and RSS, and the deltas against the run without the agent.
+#
+#     DURATION=10 THREADS=8 WORKLOADS="mixed lock" MODES="cpu wall" test/overhead-test.sh
+#
+# Defaults: DURATION=10 seconds, THREADS=number of CPUs, all workloads and all modes.
+
+set -e  # exit on any failure
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-$(nproc)}
+WORKLOADS=${WORKLOADS:-"mixed threads lock"}
+MODES=${MODES:-"cpu itimer wall lock alloc kindling"}
+OUTDIR=${OUTDIR:-/tmp/overhead-test}
+
+(
+  cd $(dirname $0)
+
+  if [ "OverheadTarget.class" -ot "OverheadTarget.java" ]; then
+     ${JAVA_HOME}/bin/javac OverheadTarget.java
+  fi
+
+  mkdir -p $OUTDIR
+  AGENT=$(pwd)/../build/libasyncProfiler.so
+
+  function agent_options() {
+    case "$1" in
+      cpu|itimer|wall) echo "start,event=$1,collapsed,file=$OUTDIR/$1.collapsed" ;;
+      lock|alloc)      echo "start,$1,collapsed,file=$OUTDIR/$1.collapsed" ;;
+      kindling)        echo "start,event=cpu,kdshm=/dev/shm/overhead-test,kdformat=binary" ;;
+      *)               echo "Unknown mode: $1" >&2; return 1 ;;
+    esac
+  }
+
+  for mode in $MODES; do
+    agent_options $mode > /dev/null
+  done
+
+  # Sets r_ops_per_sec, r_p99_us, r_cpu_ms, r_agent_cpu_ms, r_rss_kb, ... from the target output
+  function run_target() {
+    local line
+    line=$(${JAVA_HOME}/bin/java $1 -Dclk.tck=$(getconf CLK_TCK) OverheadTarget $2 $DURATION $THREADS | tail -1)
+    for kv in $line; do
+      eval "r_${kv%%=*}=${kv#*=}"
+    done
+  }
+
+  function report() {
+    awk -v workload=$1 -v mode=$2 -v threads=$THREADS \
+        -v ops=$r_ops_per_sec -v p50=$r_p50_us -v p99=$r_p99_us -v cpu=$r_cpu_ms \
+        -v agent_cpu=$r_agent_cpu_ms -v rss=$r_rss_kb \
+        -v base_ops=$base_ops -v base_p99=$base_p99 -v base_cpu=$base_cpu -v base_rss=$base_rss 'BEGIN {
+      loss = base_ops > 0 ? (base_ops - ops) * 100 / base_ops : 0
+      printf "{\"workload\":\"%s\",\"mode\":\"%s\",\"threads\":%d,\"ops_per_sec\":%d,\"throughput_loss_pct\":%.2f,", workload, mode, threads, ops, loss
+      printf "\"p50_us\":%d,\"p99_us\":%d,\"p99_delta_us\":%d,", p50, p99, p99 - base_p99
+      printf "\"cpu_ms\":%d,\"cpu_delta_ms\":%d,\"agent_cpu_ms\":%d,\"rss_kb\":%d,\"rss_delta_kb\":%d}\n", cpu, cpu - base_cpu, agent_cpu, rss, rss - base_rss
+    }'
+  }
+
+  for workload in $WORKLOADS; do
+    run_target "" $workload
+    base_ops=$r_ops_per_sec
+    base_p99=$r_p99_us
+    base_cpu=$r_cpu_ms
+    base_rss=$r_rss_kb
+    report $workload none
+
+    for mode in $MODES; do
+      run_target "-agentpath:$AGENT=$(agent_options $mode)" $workload
+      report $workload $mode
+    done
+  done
+
+  rm -f /dev/shm/overhead-test
+)
@@ -0,0 +1,79 @@
+#!/bin/bash
+
+# Startup cost of the agent on a JVM that does nothing.
+# Every mode runs StartupTarget RUNS times and prints a JSON line with the median wall time
+# of the run and the median peak RSS, and their deltas against the first mode (none by default):
+#     none  - no agent
+#     idle  - -agentpath without a command, the agent waits for one (e.g. from asprof)
+#     start - -agentpath:...=start, profiling from the JVM start
+# An idle agent is meant to cost next to nothing: it only asks for the VMInit and VMDeath
+# events and does the rest of its initialization on the first command.
+#
+#     RUNS=20 MODES="none idle" test/startup-test.sh
+
+set -e  # exit on any failure
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+RUNS=${RUNS:-10}
+MODES=${MODES:-"none idle start"}
+OUTDIR=${OUTDIR:-/tmp/startup-test}
+
+(
+  cd $(dirname $0)
+
+  if [ "StartupTarget.class" -ot "StartupTarget.java" ]; then
+     ${JAVA_HOME}/bin/javac StartupTarget.java
+  fi
+
+  mkdir -p $OUTDIR
+  AGENT=$(pwd)/../build/libasyncProfiler.so
+
+  function java_options() {
+    case "$1" in
+      none)  echo "" ;;
+      idle)  echo "-agentpath:$AGENT" ;;
+      start) echo "-agentpath:$AGENT=start,event=itimer,collapsed,file=$OUTDIR/start.collapsed" ;;
+      *)     echo "Unknown mode: $1" >&2; return 1 ;;
+    esac
+  }
+
+  for mode in $MODES; do
+    java_options $mode > /dev/null
+  done
+
+  function median() {
+    sort -n | awk '{ v[NR] = $1 } END { print NR > 0 ? v[int((NR + 1) / 2)] : 0 }'
+  }
+
+  # Sets r_startup_us and r_rss_kb to the medians over RUNS runs
+  function run_target() {
+    local times="" rss="" start end line
+    for i in $(seq $RUNS); do
+      start=$(date +%s%N)
+      line=$(${JAVA_HOME}/bin/java $1 StartupTarget | tail -1)
+      end=$(date +%s%N)
+      times="$times $(( (end - start) / 1000 ))"
+      rss="$rss ${line#rss_kb=}"
+    done
+    r_startup_us=$(echo $times | tr ' ' '\n' | median)
+    r_rss_kb=$(echo $rss | tr ' ' '\n' | median)
+  }
+
+  base_startup=""
+  for mode in $MODES; do
+    run_target "$(java_options $mode)"
+    if [ -z "$base_startup" ]; then
+      base_startup=$r_startup_us
+      base_rss=$r_rss_kb
+    fi
+    awk -v mode=$mode -v runs=$RUNS -v startup=$r_startup_us -v rss=$r_rss_kb \
+        -v base_startup=$base_startup -v base_rss=$base_rss 'BEGIN {
+      printf "{\"mode\":\"%s\",\"runs\":%d,\"startup_ms\":%.1f,\"startup_delta_ms\":%.1f,", mode, runs, startup / 1000, (startup - base_startup) / 1000
+      printf "\"rss_kb\":%d,\"rss_delta_kb\":%d}\n", rss, rss - base_rss
+    }'
+  done
+)